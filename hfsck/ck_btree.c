@@ -20,20 +20,370 @@
  */
 
 # include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
 
 # include "hfsck.h"
 # include "util.h"
 
 # include "ck_btree.h"
 
+/* what the traversal remembers about each tree level */
+
+typedef struct {
+  unsigned long first;		/* leftmost node reached at this height */
+  unsigned long last;		/* most recent node reached at this height */
+  unsigned long flink;		/* forward link of the most recent node */
+  int haskey;			/* whether key holds anything yet */
+  byte key[HFS_MAX_KEYLEN];	/* last (unpacked) key seen at this height */
+} btlevel;
+
+typedef struct {
+  btree *bt;
+  byte *visited;		/* one bit per node reached */
+  btlevel *levels;		/* indexed by node height */
+  unsigned long nrecs;		/* live leaf records seen */
+  int problems;			/* structural problems found */
+  int unrepaired;		/* problems no repair here addresses */
+} btwalk;
+
+/*
+ * NAME:	getkey()
+ * DESCRIPTION:	unpack a record key without reading past the record
+ */
+static
+void getkey(const btree *bt, const byte *rec, byte *key)
+{
+  byte pkey[HFS_MAX_KEYLEN];
+  size_t len;
+
+  len = 1 + HFS_RECKEYLEN(rec);
+  if (len > sizeof(pkey))
+    len = sizeof(pkey);
+
+  memset(pkey, 0, sizeof(pkey));
+  memcpy(pkey, rec, len);
+
+  bt->keyunpack(pkey, key);
+}
+
+/*
+ * NAME:	checkrecs()
+ * DESCRIPTION:	verify the record offsets and key lengths of a node
+ */
+static
+int checkrecs(btwalk *w, const node *np)
+{
+  const btree *bt = w->bt;
+  unsigned int limit;
+  int i;
+
+  limit = HFS_BLOCKSZ - 2 * (np->nd.ndNRecs + 1);
+
+  if (np->roff[0] != 0x00e)
+    {
+      printf("%s node %lu: first record at offset %u, not 14\n",
+	     bt->f.name, np->nnum, np->roff[0]);
+      return -1;
+    }
+
+  for (i = 0; i < np->nd.ndNRecs; ++i)
+    {
+      const byte *rec;
+      unsigned int reclen, need;
+
+      if (np->roff[i + 1] <= np->roff[i] || np->roff[i + 1] > limit)
+	{
+	  printf("%s node %lu: bad offset for record %d\n",
+		 bt->f.name, np->nnum, i);
+	  return -1;
+	}
+
+      rec    = HFS_NODEREC(*np, i);
+      reclen = HFS_RECLEN(*np, i);
+
+      if (HFS_RECKEYLEN(rec) == 0)
+	continue;  /* deleted record */
+
+      need = HFS_RECKEYSKIP(rec);
+      if (np->nd.ndType == ndIndxNode)
+	need += 4;
+
+      if (HFS_RECKEYLEN(rec) > bt->hdr.bthKeyLen || reclen < need)
+	{
+	  printf("%s node %lu: record %d is malformed\n",
+		 bt->f.name, np->nnum, i);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+/*
+ * NAME:	visit()
+ * DESCRIPTION:	verify a node and the subtree below it
+ */
+static
+int visit(btwalk *w, unsigned long nnum, int height,
+	  const byte *lower, const byte *upper)
+{
+  btree *bt = w->bt;
+  btlevel *lv = &w->levels[height];
+  byte key[HFS_MAX_KEYLEN], next[HFS_MAX_KEYLEN];
+  node n;
+  int i;
+
+  if (nnum == 0 || nnum >= bt->hdr.bthNNodes)
+    {
+      printf("%s B*-tree refers to nonexistent node %lu\n", bt->f.name, nnum);
+      ++w->problems;
+      return 0;
+    }
+
+  if (BMTST(w->visited, nnum))
+    {
+      printf("%s node %lu is reached more than once\n", bt->f.name, nnum);
+      ++w->problems;
+      return 0;
+    }
+
+  BMSET(w->visited, nnum);
+
+  if (bt_getnode(&n, bt, nnum) == -1)
+    {
+      printf("%s node %lu cannot be read (%s)\n",
+	     bt->f.name, nnum, hfs_error);
+      ++w->problems;
+      return 0;
+    }
+
+  /* node type and height */
+
+  if (n.nd.ndNHeight != height ||
+      n.nd.ndType != (height == 1 ? ndLeafNode : ndIndxNode))
+    {
+      printf("%s node %lu has type %d, height %d; expected %s node"
+	     " at height %d\n", bt->f.name, nnum, n.nd.ndType,
+	     n.nd.ndNHeight, height == 1 ? "a leaf" : "an index", height);
+      ++w->problems;
+      return 0;
+    }
+
+  /* sibling links at this height, in key order */
+
+  if (lv->last == 0)
+    {
+      lv->first = nnum;
+
+      if (n.nd.ndBLink != 0)
+	{
+	  printf("%s node %lu is leftmost at height %d but links back"
+		 " to node %lu\n", bt->f.name, nnum, height, n.nd.ndBLink);
+	  ++w->problems;
+	}
+    }
+  else
+    {
+      if (lv->flink != nnum)
+	{
+	  printf("%s node %lu links forward to node %lu, not node %lu\n",
+		 bt->f.name, lv->last, lv->flink, nnum);
+	  ++w->problems;
+	}
+
+      if (n.nd.ndBLink != lv->last)
+	{
+	  printf("%s node %lu links back to node %lu, not node %lu\n",
+		 bt->f.name, nnum, n.nd.ndBLink, lv->last);
+	  ++w->problems;
+	}
+    }
+
+  lv->last  = nnum;
+  lv->flink = n.nd.ndFLink;
+
+  if (n.nd.ndNRecs == 0)
+    {
+      printf("%s node %lu has no records\n", bt->f.name, nnum);
+      ++w->problems;
+    }
+
+  if (checkrecs(w, &n) == -1)
+    {
+      ++w->problems;
+      return 0;
+    }
+
+  /* keys: ascending across the whole level, and within the parent's range */
+
+  for (i = 0; i < n.nd.ndNRecs; ++i)
+    {
+      const byte *rec = HFS_NODEREC(n, i);
+
+      if (HFS_RECKEYLEN(rec) == 0)
+	continue;  /* deleted record */
+
+      getkey(bt, rec, key);
+
+      if (lv->haskey && bt->keycompare(key, lv->key) <= 0)
+	{
+	  printf("%s node %lu: record %d is out of order\n",
+		 bt->f.name, nnum, i);
+	  ++w->problems;
+	}
+      else if ((lower && bt->keycompare(key, lower) < 0) ||
+	       (upper && bt->keycompare(key, upper) >= 0))
+	{
+	  printf("%s node %lu: record %d is outside the range of its"
+		 " index record\n", bt->f.name, nnum, i);
+	  ++w->problems;
+	}
+
+      memcpy(lv->key, key, sizeof(lv->key));
+      lv->haskey = 1;
+
+      if (height == 1)
+	++w->nrecs;
+    }
+
+  if (height == 1)
+    return 0;
+
+  /* descend; each child's keys lie between its index key and the next */
+
+  for (i = 0; i < n.nd.ndNRecs; ++i)
+    {
+      const byte *rec = HFS_NODEREC(n, i), *bound = upper;
+      int j;
+
+      if (HFS_RECKEYLEN(rec) == 0)
+	continue;
+
+      for (j = i + 1; j < n.nd.ndNRecs; ++j)
+	{
+	  const byte *nrec = HFS_NODEREC(n, j);
+
+	  if (HFS_RECKEYLEN(nrec) > 0)
+	    {
+	      getkey(bt, nrec, next);
+	      bound = next;
+	      break;
+	    }
+	}
+
+      getkey(bt, rec, key);
+
+      if (visit(w, d_getul(HFS_RECDATA(rec)), height - 1, key, bound) == -1)
+	return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * NAME:	checkmap()
+ * DESCRIPTION:	compare the node allocation map with the nodes reached
+ */
+static
+int checkmap(btwalk *w, int repair)
+{
+  btree *bt = w->bt;
+  unsigned long nnum, nfree = 0, unreached = 0, mapnodes;
+  int problems = 0;
+
+  mapnodes = (unsigned long) bt->mapsz * 8;
+
+  if (mapnodes < bt->hdr.bthNNodes)
+    {
+      printf("%s B*-tree map covers %lu of %lu nodes\n",
+	     bt->f.name, mapnodes, bt->hdr.bthNNodes);
+      ++problems;
+      ++w->unrepaired;
+    }
+
+  for (nnum = 0; nnum < bt->hdr.bthNNodes; ++nnum)
+    {
+      int used  = BMTST(w->visited, nnum) != 0;
+      int inmap = nnum < mapnodes && BMTST(bt->map, nnum);
+
+      if (used && ! inmap)
+	{
+	  ++problems;
+
+	  if (nnum >= mapnodes)
+	    {
+	      printf("%s node %lu is in use but not in the map\n",
+		     bt->f.name, nnum);
+	      ++w->unrepaired;
+	    }
+	  else if (ask("%s node %lu is in use but marked free",
+		       bt->f.name, nnum))
+	    {
+	      BMSET(bt->map, nnum);
+	      bt->flags |= HFS_BT_UPDATE_HDR;
+	      inmap = 1;
+	    }
+	}
+      else if (! used && inmap)
+	{
+	  /* a broken tree may still own nodes the walk could not reach */
+
+	  if (! repair)
+	    ++unreached;
+	  else
+	    {
+	      ++problems;
+
+	      if (ask("%s node %lu is marked in use but unreachable",
+		      bt->f.name, nnum))
+		{
+		  BMCLR(bt->map, nnum);
+		  bt->flags |= HFS_BT_UPDATE_HDR;
+		  inmap = 0;
+		}
+	    }
+	}
+
+      if (! inmap)
+	++nfree;
+    }
+
+  if (unreached)
+    {
+      printf("%s B*-tree has %lu allocated node%s the check could not"
+	     " reach\n", bt->f.name, unreached, unreached == 1 ? "" : "s");
+      ++problems;
+      ++w->unrepaired;
+    }
+
+  if (bt->hdr.bthFree != nfree && ++problems &&
+      ask("%s B*-tree free node count is %lu; should be %lu",
+	  bt->f.name, bt->hdr.bthFree, nfree))
+    {
+      bt->hdr.bthFree = nfree;
+      bt->flags |= HFS_BT_UPDATE_HDR;
+    }
+
+  return problems;
+}
+
 /*
  * NAME:	ck->btree()
- * DESCRIPTION:	verify/repair a b*-tree
+ * DESCRIPTION:	verify/repair a b*-tree; structural problems, which are
+ *		reported but not repaired, are also counted in *unrepaired
  */
-int ck_btree(btree *bt)
+int ck_btree(btree *bt, int *unrepaired)
 {
+  btwalk w;
+  byte *map;
+  unsigned long nnum;
+  int result = 0, height;
+
   printf("*** Checking %s B*-tree\n", bt->f.name);
 
+  *unrepaired = 0;
+
   if (bt_readhdr(bt) == -1)
     return -1;
 
@@ -50,47 +400,152 @@ int ck_btree(btree *bt)
       printf("  bthFree     = %lu\n", bt->hdr.bthFree);
     }
 
-# if 0
-  if (VERBOSE)
+  if (bt->hdr.bthDepth > 127)
+    {
+      printf("%s B*-tree depth %u is impossible\n",
+	     bt->f.name, bt->hdr.bthDepth);
+      *unrepaired = 1;
+      return 1;
+    }
+
+  /*
+   * Every node is read at most once, through its parent, in key order, so
+   * the sibling links, heights and key order of each level can be checked
+   * in one pass; the only per-node state is one bit in the visited map.
+   */
+
+  w.bt       = bt;
+  w.visited  = ALLOC(byte, bt->hdr.bthNNodes / 8 + 1);
+  w.levels   = ALLOC(btlevel, bt->hdr.bthDepth + 1);
+  w.nrecs    = 0;
+  w.problems = 0;
+  w.unrepaired = 0;
+
+  if (w.visited == 0 || w.levels == 0)
+    {
+      FREE(w.visited);
+      FREE(w.levels);
+      printf("%s B*-tree: out of memory\n", bt->f.name);
+      return -1;
+    }
+
+  memset(w.visited, 0, bt->hdr.bthNNodes / 8 + 1);
+  memset(w.levels, 0, sizeof(btlevel) * (bt->hdr.bthDepth + 1));
+
+  /* the header node and the map nodes chained to it */
+
+  BMSET(w.visited, 0);
+
+  nnum = bt->hdrnd.nd.ndFLink;
+
+  while (nnum)
     {
       node n;
-      int i;
 
-      n.bt   = bt;
-      n.nnum = bt->hdr.bthFNode;
+      if (nnum >= bt->hdr.bthNNodes || BMTST(w.visited, nnum) ||
+	  bt_getnode(&n, bt, nnum) == -1)
+	{
+	  printf("%s B*-tree map node chain is corrupt\n", bt->f.name);
+	  ++w.problems;
+	  break;
+	}
+
+      BMSET(w.visited, nnum);
+      nnum = n.nd.ndFLink;
+    }
+
+  /* read unallocated nodes too, so they can be reported */
 
-      while (n.nnum)
+  map = bt->map;
+  bt->map = 0;
+
+  if (bt->hdr.bthDepth == 0)
+    {
+      if (bt->hdr.bthRoot != 0)
 	{
-	  if (bt_getnode(&n) == -1)
-	    return -1;
+	  printf("%s B*-tree is empty but has root node %lu\n",
+		 bt->f.name, bt->hdr.bthRoot);
+	  ++w.problems;
+	}
+    }
+  else
+    result = visit(&w, bt->hdr.bthRoot, bt->hdr.bthDepth, 0, 0);
 
-	  if (n.nnum == bt->hdr.bthFNode)
-	    printf("  { ");
-	  else
-	    printf("} { ");
+  bt->map = map;
 
-	  for (i = 0; i < n.nd.ndNRecs; ++i)
-	    {
-	      byte *ptr;
+  if (result == -1)
+    {
+      FREE(w.visited);
+      FREE(w.levels);
+      return -1;
+    }
 
-	      ptr = HFS_NODEREC(n, i);
+  for (height = 1; height <= bt->hdr.bthDepth; ++height)
+    {
+      btlevel *lv = &w.levels[height];
 
-	      outhex(ptr, 1 + HFS_RECKEYLEN(ptr));
-	      printf(": ");
-	      outhex(HFS_RECDATA(ptr),
-		     HFS_NODEREC(n, i + 1) - HFS_RECDATA(ptr));
-	      printf("\n");
+      if (lv->last && lv->flink != 0)
+	{
+	  printf("%s node %lu is rightmost at height %d but links forward"
+		 " to node %lu\n", bt->f.name, lv->last, height, lv->flink);
+	  ++w.problems;
+	}
+    }
 
-	      if (i < n.nd.ndNRecs - 1)
-		printf("    ");
-	    }
+  /* header fields that follow from the leaves */
+
+  result = w.problems;
+
+  if (w.problems == 0)
+    {
+      unsigned long fnode = 0, lnode = 0;
+
+      if (bt->hdr.bthDepth > 0)
+	{
+	  fnode = w.levels[1].first;
+	  lnode = w.levels[1].last;
+	}
 
-	  n.nnum = n.nd.ndFLink;
+      if (bt->hdr.bthNRecs != w.nrecs && ++result &&
+	  ask("%s B*-tree record count is %lu; should be %lu",
+	      bt->f.name, bt->hdr.bthNRecs, w.nrecs))
+	{
+	  bt->hdr.bthNRecs = w.nrecs;
+	  bt->flags |= HFS_BT_UPDATE_HDR;
 	}
 
-      printf("}\n");
+      if (bt->hdr.bthFNode != fnode && ++result &&
+	  ask("%s B*-tree first leaf is node %lu; should be node %lu",
+	      bt->f.name, bt->hdr.bthFNode, fnode))
+	{
+	  bt->hdr.bthFNode = fnode;
+	  bt->flags |= HFS_BT_UPDATE_HDR;
+	}
+
+      if (bt->hdr.bthLNode != lnode && ++result &&
+	  ask("%s B*-tree last leaf is node %lu; should be node %lu",
+	      bt->f.name, bt->hdr.bthLNode, lnode))
+	{
+	  bt->hdr.bthLNode = lnode;
+	  bt->flags |= HFS_BT_UPDATE_HDR;
+	}
     }
-# endif
+  else
+    printf("%s B*-tree has %d structural problem%s; header counts"
+	   " not checked\n", bt->f.name, w.problems,
+	   w.problems == 1 ? "" : "s");
 
-  return 0;
+  /* only a sound tree can tell which allocated nodes are really unused */
+
+  result += checkmap(&w, w.problems == 0);
+
+  *unrepaired = w.problems + w.unrepaired;
+
+  FREE(w.visited);
+  FREE(w.levels);
+
+  if (VERBOSE)
+    printf("  %lu leaf records checked\n", w.nrecs);
+
+  return result;
 }
@@ -19,4 +19,4 @@
  * $Id: ck_btree.h,v 1.6 1998/04/11 08:27:07 rob Exp $
  */
 
-int ck_btree(btree *);
+int ck_btree(btree *, int *);
@@ -44,6 +44,8 @@ int hfsck(hfsvol *vol)
 {
   int errors_found = 0;
   int errors_corrected = 0;
+  int errors_uncorrected = 0;
+  int unrepaired;
   int result;
 
   if (VERBOSE) {
@@ -75,10 +77,12 @@ int hfsck(hfsvol *vol)
   }
 
   /* Check extents overflow B-tree */
-  result = ck_btree(&vol->ext);
+  result = ck_btree(&vol->ext, &unrepaired);
   if (result) {
     errors_found = 1;
-    if (REPAIR) {
+    if (result < 0 || unrepaired) {
+      errors_uncorrected = 1;
+    } else if (REPAIR) {
       errors_corrected = 1;
       if (VERBOSE) {
         printf("*** Extents B-tree errors corrected\n");
@@ -87,10 +91,12 @@ int hfsck(hfsvol *vol)
   }
 
   /* Check catalog B-tree */
-  result = ck_btree(&vol->cat);
+  result = ck_btree(&vol->cat, &unrepaired);
   if (result) {
     errors_found = 1;
-    if (REPAIR) {
+    if (result < 0 || unrepaired) {
+      errors_uncorrected = 1;
+    } else if (REPAIR) {
       errors_corrected = 1;
       if (VERBOSE) {
         printf("*** Catalog B-tree errors corrected\n");
@@ -104,7 +110,7 @@ int hfsck(hfsvol *vol)
       printf("*** Volume check completed: no errors found\n");
     }
     return FSCK_OK;
-  } else if (errors_corrected && REPAIR) {
+  } else if (errors_corrected && !errors_uncorrected && REPAIR) {
     if (VERBOSE) {
       printf("*** Volume check completed: errors found and corrected\n");
     }
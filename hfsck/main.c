@@ -27,6 +27,7 @@
 # include <sys/stat.h>
 # include <fcntl.h>
 # include <errno.h>
+# include <sys/wait.h>
 
 # include "hfsck.h"
 # include "suid.h"
@@ -65,6 +66,7 @@ int usage(char *argv[])
   fprintf(stderr, "  -a, --auto        Automatically repair filesystem without prompting\n");
   fprintf(stderr, "  -f, --force       Force checking even if filesystem appears clean\n");
   fprintf(stderr, "  -y, --yes         Assume 'yes' to all questions (same as -a)\n");
+  fprintf(stderr, "  -P                Check every HFS partition of the medium at once\n");
   fprintf(stderr, "      --version     Display version information and exit\n");
   fprintf(stderr, "      --license     Display license information and exit\n");
   fprintf(stderr, "\n");
@@ -88,11 +90,217 @@ int usage(char *argv[])
   fprintf(stderr, "  %s -v /dev/sdb1           Check with verbose output\n", argv[0]);
   fprintf(stderr, "  %s -n /dev/sdb1           Check without making changes\n", argv[0]);
   fprintf(stderr, "  %s -a /dev/sdb1           Check and auto-repair\n", argv[0]);
+  fprintf(stderr, "  %s -P -n cdrom.iso        Check all partitions of an image\n", argv[0]);
   fprintf(stderr, "\n");
 
   return FSCK_USAGE_ERROR;
 }
 
+/*
+ * NAME:	openvol()
+ * DESCRIPTION:	open the medium, read-only if it cannot be repaired
+ */
+static
+int openvol(char *argv[], hfsvol *vol, const char *path)
+{
+  int result;
+
+  if (REPAIR)
+    {
+      suid_enable();
+      result = v_open(vol, path, HFS_MODE_RDWR);
+      suid_disable();
+
+      if (result == -1)
+	{
+	  vol->flags |= HFS_VOL_READONLY;
+
+	  suid_enable();
+	  result = v_open(vol, path, HFS_MODE_RDONLY);
+	  suid_disable();
+	}
+    }
+  else
+    {
+      vol->flags |= HFS_VOL_READONLY;
+
+      suid_enable();
+      result = v_open(vol, path, HFS_MODE_RDONLY);
+      suid_disable();
+    }
+
+  if (result == -1)
+    {
+      perror(path);
+      return -1;
+    }
+
+  if (REPAIR && (vol->flags & HFS_VOL_READONLY))
+    {
+      fprintf(stderr, "%s: warning: %s not writable; cannot repair\n",
+	      argv[0], path);
+
+      options &= ~HFSCK_REPAIR;
+    }
+
+  return 0;
+}
+
+/*
+ * NAME:	checkpart()
+ * DESCRIPTION:	check one partition in a forked child, with all output going
+ *		to its log; never returns
+ */
+static
+void checkpart(char *argv[], const char *path, const hfspartent *part,
+	       FILE *log)
+{
+  hfsvol vol;
+  int fd, result;
+
+  fd = open("/dev/null", O_RDONLY);
+  if (fd >= 0)
+    {
+      dup2(fd, STDIN_FILENO);
+      close(fd);
+    }
+
+  dup2(fileno(log), STDOUT_FILENO);
+  dup2(fileno(log), STDERR_FILENO);
+
+  v_init(&vol, HFS_OPT_NOCACHE);
+
+  if (openvol(argv, &vol, path) == -1)
+    result = FSCK_OPERATIONAL_ERROR;
+  else if (v_place(&vol, part) == -1 ||
+	   l_getmdb(&vol, &vol.mdb, 0) == -1)
+    {
+      perror(path);
+      v_close(&vol);
+      result = FSCK_OPERATIONAL_ERROR;
+    }
+  else
+    {
+      result = hfsck(&vol);
+
+      vol.flags |= HFS_VOL_MOUNTED;
+
+      if (v_close(&vol) == -1)
+	{
+	  perror("closing volume");
+	  result = FSCK_OPERATIONAL_ERROR;
+	}
+    }
+
+  fflush(0);
+  _exit(result);
+}
+
+/*
+ * NAME:	checkall()
+ * DESCRIPTION:	check every partition of a table at once, one child per
+ *		partition, and print the logs in partition map order
+ */
+static
+int checkall(char *argv[], const char *path, const hfspartent *parts,
+	     int nparts)
+{
+  pid_t *pids;
+  FILE **logs;
+  char line[1024];
+  int i, bol, status, result = 0;
+
+  pids = malloc(nparts * sizeof(*pids));
+  logs = malloc(nparts * sizeof(*logs));
+  if (pids == 0 || logs == 0)
+    {
+      fprintf(stderr, "%s: not enough memory\n", argv[0]);
+      free(pids);
+      free(logs);
+      return FSCK_OPERATIONAL_ERROR;
+    }
+
+  /* the partition table was read once; every child inherits it */
+
+  for (i = 0; i < nparts; ++i)
+    {
+      pids[i] = -1;
+
+      logs[i] = tmpfile();
+      if (logs[i] == 0)
+	{
+	  fprintf(stderr, "%s: %s (partition %d): cannot create log: %s\n",
+		  argv[0], path, parts[i].pnum, strerror(errno));
+	  result |= FSCK_OPERATIONAL_ERROR;
+	  continue;
+	}
+
+      fflush(0);
+
+      pids[i] = fork();
+      if (pids[i] == 0)
+	checkpart(argv, path, &parts[i], logs[i]);
+
+      if (pids[i] == -1)
+	{
+	  fprintf(stderr, "%s: %s (partition %d): cannot start check: %s\n",
+		  argv[0], path, parts[i].pnum, strerror(errno));
+	  result |= FSCK_OPERATIONAL_ERROR;
+	}
+    }
+
+  for (i = 0; i < nparts; ++i)
+    {
+      if (logs[i] == 0)
+	continue;
+
+      if (pids[i] != -1)
+	{
+	  while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR)
+	    ;
+
+	  /* each line is prefixed with its partition */
+
+	  rewind(logs[i]);
+
+	  bol = 1;
+	  while (fgets(line, sizeof(line), logs[i]))
+	    {
+	      if (bol)
+		printf("%s (partition %d): ", path, parts[i].pnum);
+
+	      fputs(line, stdout);
+	      bol = strchr(line, '\n') != 0;
+	    }
+
+	  if (! bol)
+	    putchar('\n');
+
+	  if (WIFEXITED(status))
+	    {
+	      printf("%s (partition %d): exit %d\n",
+		     path, parts[i].pnum, WEXITSTATUS(status));
+	      result |= WEXITSTATUS(status);
+	    }
+	  else
+	    {
+	      printf("%s (partition %d): killed by signal %d\n",
+		     path, parts[i].pnum, WTERMSIG(status));
+	      result |= FSCK_OPERATIONAL_ERROR;
+	    }
+
+	  fflush(stdout);
+	}
+
+      fclose(logs[i]);
+    }
+
+  free(pids);
+  free(logs);
+
+  return result;
+}
+
 /*
  * NAME:	main()
  * DESCRIPTION:	program entry
@@ -100,8 +308,9 @@ int usage(char *argv[])
 int main(int argc, char *argv[])
 {
   char *path;
-  int nparts, pnum, result;
+  int nparts, pnum, result, allparts = 0;
   hfsvol vol;
+  hfspartent *parts = 0;
   const char *progname;
   int force_fs_type = 0;  /* 0=auto, 1=HFS, 2=HFS+ */
 
@@ -146,7 +355,7 @@ int main(int argc, char *argv[])
       int opt;
 
       /* Standard fsck options: v(verbose), n(no-write), a(auto), f(force), y(yes) */
-      opt = getopt(argc, argv, "vnafy");
+      opt = getopt(argc, argv, "vnafyP");
       if (opt == EOF)
 	break;
 
@@ -180,6 +389,11 @@ int main(int argc, char *argv[])
 	  /* Yes mode - same as auto mode */
 	  options |= HFSCK_YES;
 	  break;
+
+	case 'P':
+	  /* All partitions - check each HFS partition in a child of its own */
+	  allparts = 1;
+	  break;
 	}
     }
 
@@ -189,8 +403,21 @@ int main(int argc, char *argv[])
 
   path = argv[optind];
 
+  if (allparts)
+    {
+      if (argc - optind != 1)
+	return usage(argv);
+
+      if (REPAIR && ! YES)
+	{
+	  fprintf(stderr, "%s: -P cannot ask questions; use -n, -y or -a\n",
+		  argv[0]);
+	  return FSCK_USAGE_ERROR;
+	}
+    }
+
   suid_enable();
-  nparts = hfs_nparts(path);
+  nparts = allparts ? hfs_partitions(path, &parts) : hfs_nparts(path);
   suid_disable();
 
   if (nparts == 0)
@@ -200,6 +427,14 @@ int main(int argc, char *argv[])
       return FSCK_OPERATIONAL_ERROR;
     }
 
+  if (allparts && nparts > 0)
+    {
+      result = checkall(argv, path, parts, nparts);
+      free(parts);
+
+      return result;
+    }
+
   if (argc - optind == 2)
     {
       pnum = atoi(argv[optind + 1]);
@@ -246,35 +481,8 @@ int main(int argc, char *argv[])
 
   v_init(&vol, HFS_OPT_NOCACHE);
 
-  if (REPAIR)
-    {
-      suid_enable();
-      result = v_open(&vol, path, HFS_MODE_RDWR);
-      suid_disable();
-
-      if (result == -1)
-	{
-	  vol.flags |= HFS_VOL_READONLY;
-
-	  suid_enable();
-	  result = v_open(&vol, path, HFS_MODE_RDONLY);
-	  suid_disable();
-	}
-    }
-
-  if (result == -1)
-    {
-      perror(path);
-      return FSCK_OPERATIONAL_ERROR;
-    }
-
-  if (REPAIR && (vol.flags & HFS_VOL_READONLY))
-    {
-      fprintf(stderr, "%s: warning: %s not writable; cannot repair\n",
-	      argv[0], path);
-
-      options &= ~HFSCK_REPAIR;
-    }
+  if (openvol(argv, &vol, path) == -1)
+    return FSCK_OPERATIONAL_ERROR;
 
   /* Detect filesystem type and handle HFS+ journaling */
   if (force_fs_type != 0) {
@@ -308,14 +516,19 @@ int main(int argc, char *argv[])
       /* Handle HFS+ journaling if detected */
       if (detected_type == FS_TYPE_HFSPLUS || detected_type == FS_TYPE_HFSX) {
         struct HFSPlus_VolumeHeader vh;
+        off_t offset = hfs_detect_embedded_offset(fd);
         
-        /* Read HFS+ Volume Header */
-        if (lseek(fd, 1024, SEEK_SET) != -1 && 
+        /* Read HFS+ Volume Header (possibly inside an HFS wrapper) */
+        if (offset >= 0 &&
+            lseek(fd, offset + 1024, SEEK_SET) != -1 && 
             read(fd, &vh, sizeof(vh)) == sizeof(vh)) {
           
           uint32_t attributes = be32toh(vh.attributes);
           
-          if (attributes & HFSPLUS_VOL_JOURNALED) {
+          if (offset > 0 && (attributes & HFSPLUS_VOL_JOURNALED)) {
+            fprintf(stderr, "%s: warning: journal of wrapped HFS+ volume not replayed\n",
+                    argv[0]);
+          } else if (attributes & HFSPLUS_VOL_JOURNALED) {
             if (VERBOSE) {
               printf("HFS+ volume has journaling enabled\n");
             }
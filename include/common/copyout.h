@@ -27,3 +27,7 @@ int cpo_macb(hfsvol *, const char *, const char *);
 int cpo_binh(hfsvol *, const char *, const char *);
 int cpo_text(hfsvol *, const char *, const char *);
 int cpo_raw(hfsvol *, const char *, const char *);
+
+int cpo_links(int);
+const char *cpo_copied(unsigned long);
+int cpo_remember(unsigned long, const char *);
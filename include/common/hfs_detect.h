@@ -12,6 +12,7 @@
 #define HFS_DETECT_H
 
 #include <stdint.h>
+#include <sys/types.h>
 #include <time.h>
 #include <endian.h>
 
@@ -27,6 +28,12 @@
 #define HFSPLUS_SIGNATURE       0x482B      /* "H+" */
 #define HFSX_SIGNATURE          0x4858      /* "HX" */
 
+/* HFS wrapper fields locating an embedded HFS+ volume (MDB offsets) */
+#define HFS_MDB_ALBLKSIZ        20          /* drAlBlkSiz */
+#define HFS_MDB_ALBLST          28          /* drAlBlSt */
+#define HFS_MDB_EMBEDSIGWORD    124         /* drEmbedSigWord */
+#define HFS_MDB_EMBEDEXTENT     126         /* drEmbedExtent */
+
 /* Filesystem Types */
 typedef enum {
     FS_TYPE_UNKNOWN = 0,
@@ -43,10 +50,11 @@ struct hfs_mdb {
     uint16_t drAtrb;            /* Volume attributes */
     uint16_t drNmFls;           /* Number of files in root directory */
     uint16_t drVBMSt;           /* Volume bitmap start block */
-    uint16_t drAlBlSt;          /* Allocation block start */
+    uint16_t drAllocPtr;        /* Start of next allocation search */
+    uint16_t drNmAlBlks;        /* Number of allocation blocks */
     uint32_t drAlBlkSiz;        /* Allocation block size */
     uint32_t drClpSiz;          /* Default clump size */
-    uint16_t drNmAlBlks;        /* Number of allocation blocks */
+    uint16_t drAlBlSt;          /* Allocation block start */
     uint32_t drNxtCNID;         /* Next catalog node ID */
     uint16_t drFreeBks;         /* Number of free allocation blocks */
     char drVN[28];              /* Volume name (27 chars + null) */
@@ -128,11 +136,13 @@ typedef struct {
     uint32_t free_blocks;
     time_t create_date;
     time_t modify_date;
+    off_t offset;               /* byte offset of an embedded HFS+ volume */
     char volume_name[256];
 } hfs_volume_info_t;
 
 /* Function Prototypes */
 hfs_fs_type_t hfs_detect_fs_type(int fd);
+off_t hfs_detect_embedded_offset(int fd);
 int hfs_read_volume_info(int fd, hfs_volume_info_t *vol_info);
 int hfs_validate_dates(time_t date, const char *field_name);
 time_t hfs_get_safe_time(void);
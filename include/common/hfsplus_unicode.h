@@ -0,0 +1,56 @@
+/*
+ * hfsplus_unicode.h - HFS+ Unicode name comparison
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef HFSPLUS_UNICODE_H
+#define HFSPLUS_UNICODE_H
+
+#include <stdint.h>
+
+/* Catalog B-tree key compare types (BTHeaderRec.keyCompareType) */
+#define HFSPLUS_KEY_CASEFOLDING  0xCF    /* HFS+ and case-insensitive HFSX */
+#define HFSPLUS_KEY_BINARY       0xBC    /* Case-sensitive HFSX */
+
+/* Longest HFSUniStr255 */
+#define HFSPLUS_MAX_NAME_LEN     255
+
+/*
+ * A name folded once with hfsplus_unicode_foldkey(), for comparing one
+ * search name against many on-disk names.  Units are in host order with
+ * ignorable code points already removed.
+ */
+typedef struct {
+    uint16_t length;
+    uint16_t unicode[HFSPLUS_MAX_NAME_LEN];
+} hfsplus_foldkey_t;
+
+/* Fold a single UTF-16 unit (host order); 0 means "ignore this unit" */
+uint16_t hfsplus_unicode_fold(uint16_t c);
+
+/* TN1150 FastUnicodeCompare on two big-endian (on-disk) names */
+int hfsplus_unicode_compare(const uint16_t *name1, unsigned int len1,
+                            const uint16_t *name2, unsigned int len2);
+
+/* Binary (HFSX) comparison on two big-endian names */
+int hfsplus_unicode_compare_binary(const uint16_t *name1, unsigned int len1,
+                                   const uint16_t *name2, unsigned int len2);
+
+/* Precompute the folded form of a big-endian name */
+void hfsplus_unicode_foldkey(hfsplus_foldkey_t *key,
+                             const uint16_t *name, unsigned int len);
+
+/* Compare a precomputed fold key against a big-endian on-disk name */
+int hfsplus_unicode_compare_foldkey(const hfsplus_foldkey_t *key,
+                                    const uint16_t *name, unsigned int len);
+
+/* Compare two raw catalog keys (keyLength, parentID, nodeName) */
+int hfsplus_catkey_compare(const uint8_t *key1, const uint8_t *key2,
+                           uint8_t key_compare_type);
+
+#endif /* HFSPLUS_UNICODE_H */
@@ -31,6 +31,10 @@ void hfsutil_perrorp(const char *);
 hfsvol *hfsutil_remount(mountent *, int);
 void hfsutil_unmount(hfsvol *, int *);
 
+typedef int (*partfunc)(hfsvol *, const hfspartent *, void *);
+
+int hfsutil_allparts(mountent *, int, partfunc, void *);
+
 void hfsutil_pinfo(hfsvolent *);
 char **hfsutil_glob(hfsvol *, int, char *[], int *, int *);
 char *hfsutil_getcwd(hfsvol *);
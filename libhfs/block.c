@@ -714,6 +714,76 @@ fail:
   return -1;
 }
 
+/*
+ * NAME:	block->readrun()
+ * DESCRIPTION:	read a run of logical blocks in one transfer, taking any
+ *		block the cache holds from the cache
+ */
+int b_readrun(hfsvol *vol, unsigned long bnum, block *bp, unsigned int blen)
+{
+  unsigned int i;
+
+  if (vol->vlen > 0 && bnum + blen > vol->vlen)
+    ERROR(EIO, "read nonexistent logical block");
+
+  if (b_readpb(vol, vol->vstart + bnum, bp, blen) == -1)
+    goto fail;
+
+  if (vol->cache)
+    {
+      for (i = 0; i < blen; ++i)
+	{
+	  bucket **hslot, *b;
+
+	  b = findbucket(vol->cache, bnum + i, &hslot);
+	  if (b)
+	    memcpy(&bp[i], b->data, HFS_BLOCKSZ);
+	}
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	block->writerun()
+ * DESCRIPTION:	write a run of logical blocks in one transfer, refreshing
+ *		any copies the cache holds
+ */
+int b_writerun(hfsvol *vol, unsigned long bnum, const block *bp,
+	       unsigned int blen)
+{
+  unsigned int i;
+
+  if (vol->vlen > 0 && bnum + blen > vol->vlen)
+    ERROR(EIO, "write nonexistent logical block");
+
+  if (b_writepb(vol, vol->vstart + bnum, bp, blen) == -1)
+    goto fail;
+
+  if (vol->cache)
+    {
+      for (i = 0; i < blen; ++i)
+	{
+	  bucket **hslot, *b;
+
+	  b = findbucket(vol->cache, bnum + i, &hslot);
+	  if (b)
+	    {
+	      memcpy(b->data, &bp[i], HFS_BLOCKSZ);
+	      b->flags &= ~HFS_BUCKET_DIRTY;
+	    }
+	}
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
 /*
  * NAME:	block->readab()
  * DESCRIPTION:	read a block from an allocation block from a volume
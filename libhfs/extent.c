@@ -0,0 +1,1306 @@
+/*
+ * libhfs - library for reading and writing Macintosh HFS volumes
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+# ifdef HAVE_CONFIG_H
+#  include "config.h"
+# endif
+
+# include <stdlib.h>
+# include <string.h>
+# include <errno.h>
+
+# include "libhfs.h"
+# include "extent.h"
+# include "volume.h"
+# include "block.h"
+# include "file.h"
+# include "btree.h"
+# include "record.h"
+# include "data.h"
+
+/*
+ * Whole-fork extent handling for HFS volumes.  A fork's extents are read
+ * into one flat list and written back as a catalog (or MDB) record plus
+ * as many extents overflow records as needed, so callers can move blocks
+ * around without caring where each descriptor is stored.  Copies go
+ * through the cache-aware run transfers of block.c, and a moved fork's
+ * records are rewritten only once its data is in place.
+ */
+
+# define E_COPYSZ	256	/* logical blocks per copy transfer */
+
+typedef struct {
+  unsigned long parid;		/* parent directory ID */
+  char name[HFS_MAX_FLEN + 1];	/* catalog name */
+} fileref;
+
+typedef struct {
+  unsigned long parid;		/* parent directory ID */
+  char name[HFS_MAX_FLEN + 1];	/* catalog name */
+  int fork;			/* fkData or fkRsrc */
+  unsigned int start;		/* first allocation block */
+  unsigned int count;		/* number of extents */
+} forkref;
+
+typedef struct {
+  forkref *refs;		/* forks found */
+  unsigned long nrefs;		/* number of forks found */
+  unsigned long size;		/* room in the table */
+  hfsdefragent *ent;		/* statistics being gathered */
+} forklist;
+
+/*
+ * NAME:	addext()
+ * DESCRIPTION:	append a run to an extent list, merging it with the last one
+ */
+static
+int addext(ExtDescriptor **list, unsigned int *count, unsigned int *size,
+	   unsigned int start, unsigned int len)
+{
+  ExtDescriptor *last;
+
+  if (len == 0)
+    goto done;
+
+  last = *count ? &(*list)[*count - 1] : 0;
+
+  if (last && last->xdrStABN + last->xdrNumABlks == start &&
+      last->xdrNumABlks + len <= 0xffff)
+    {
+      last->xdrNumABlks += len;
+      goto done;
+    }
+
+  if (*count == *size)
+    {
+      ExtDescriptor *grow;
+
+      grow = REALLOC(*list, ExtDescriptor, *size ? *size * 2 : 8);
+      if (grow == 0)
+	ERROR(ENOMEM, 0);
+
+      *list  = grow;
+      *size  = *size ? *size * 2 : 8;
+    }
+
+  (*list)[*count].xdrStABN    = start;
+  (*list)[*count].xdrNumABlks = len;
+  ++*count;
+
+done:
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	extent->getexts()
+ * DESCRIPTION:	return every extent of a file's current fork as one list
+ */
+int e_getexts(hfsfile *file, ExtDescriptor **list, unsigned int *count)
+{
+  hfsvol *vol = file->vol;
+  ExtDataRec *extrec, rec;
+  unsigned long *pylen;
+  unsigned int total, fabn = 0, size = 0;
+  int i, found;
+
+  *list  = 0;
+  *count = 0;
+
+  f_getptrs(file, &extrec, 0, &pylen);
+
+  total = *pylen / vol->mdb.drAlBlkSiz;
+  memcpy(&rec, extrec, sizeof(ExtDataRec));
+
+  while (fabn < total)
+    {
+      for (i = 0; i < 3 && fabn < total; ++i)
+	{
+	  if (rec[i].xdrNumABlks == 0)
+	    ERROR(EIO, "empty file extent");
+
+	  if (addext(list, count, &size, rec[i].xdrStABN,
+		     rec[i].xdrNumABlks) == -1)
+	    goto fail;
+
+	  fabn += rec[i].xdrNumABlks;
+	}
+
+      if (fabn < total)
+	{
+	  found = v_extsearch(file, fabn, &rec, 0);
+	  if (found == -1)
+	    goto fail;
+	  else if (! found)
+	    ERROR(EIO, "missing extents overflow record");
+	}
+    }
+
+  if (fabn != total)
+    ERROR(EIO, "file extents exceed file physical length");
+
+  return 0;
+
+fail:
+  FREE(*list);
+
+  *list  = 0;
+  *count = 0;
+
+  return -1;
+}
+
+/*
+ * NAME:	extent->setexts()
+ * DESCRIPTION:	replace the extent records of a file's current fork
+ */
+int e_setexts(hfsfile *file, const ExtDescriptor *list, unsigned int count)
+{
+  hfsvol *vol = file->vol;
+  ExtDataRec *extrec, rec;
+  ExtKeyRec key;
+  byte record[HFS_MAX_EXTRECLEN];
+  unsigned int reclen, fabn, i;
+  node n;
+  int j, found;
+
+  f_getptrs(file, &extrec, 0, 0);
+
+  if (count > 3)
+    {
+      if (file == &vol->ext.f)
+	ERROR(ENOSPC, "extents overflow file needs more than three extents");
+
+      if (bt_space(&vol->ext, (count - 1) / 3) == -1)
+	goto fail;
+    }
+
+  /* drop the overflow records of the old list */
+
+  for (fabn = 0, j = 0; j < 3; ++j)
+    fabn += (*extrec)[j].xdrNumABlks;
+
+  while (1)
+    {
+      found = v_extsearch(file, fabn, &rec, &n);
+      if (found == -1)
+	goto fail;
+      else if (! found)
+	break;
+
+      for (j = 0; j < 3; ++j)
+	fabn += rec[j].xdrNumABlks;
+
+      if (bt_delete(&vol->ext, HFS_NODEREC(n, n.rnum)) == -1)
+	goto fail;
+    }
+
+  /* the first three extents live in the catalog record (or the MDB) */
+
+  memset(extrec, 0, sizeof(ExtDataRec));
+
+  for (i = 0, fabn = 0; i < count && i < 3; ++i)
+    {
+      (*extrec)[i] = list[i];
+      fabn += list[i].xdrNumABlks;
+    }
+
+  for ( ; i < count; i += 3)
+    {
+      memset(&rec, 0, sizeof(ExtDataRec));
+
+      for (j = 0; j < 3 && i + j < count; ++j)
+	rec[j] = list[i + j];
+
+      r_makeextkey(&key, file->fork, file->cat.u.fil.filFlNum, fabn);
+      r_packextrec(&key, &rec, record, &reclen);
+
+      if (bt_insert(&vol->ext, record, reclen) == -1)
+	goto fail;
+
+      for (j = 0; j < 3; ++j)
+	fabn += rec[j].xdrNumABlks;
+    }
+
+  memcpy(&file->ext, extrec, sizeof(ExtDataRec));
+  file->fabn = 0;
+
+  if (file == &vol->ext.f || file == &vol->cat.f)
+    vol->flags |= HFS_VOL_UPDATE_MDB;
+  else
+    {
+      file->flags |= HFS_FILE_UPDATE_CATREC;
+
+      if (f_flush(file) == -1)
+	goto fail;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	extent->copy()
+ * DESCRIPTION:	copy the contents of a run of allocation blocks in large
+ *		transfers
+ */
+int e_copy(hfsvol *vol, unsigned int from, unsigned int to, unsigned int len)
+{
+  block *buf = 0;
+  unsigned long src, dst, left, chunk;
+
+  if ((unsigned long) from + len > vol->mdb.drNmAlBlks ||
+      (unsigned long) to   + len > vol->mdb.drNmAlBlks)
+    ERROR(EIO, "copy of nonexistent allocation blocks");
+
+  buf = ALLOC(block, E_COPYSZ);
+  if (buf == 0)
+    ERROR(ENOMEM, 0);
+
+  if (v_dirty(vol) == -1)
+    goto fail;
+
+  src = vol->mdb.drAlBlSt + (unsigned long) from * vol->lpa;
+  dst = vol->mdb.drAlBlSt + (unsigned long) to   * vol->lpa;
+
+  for (left = (unsigned long) len * vol->lpa; left; left -= chunk)
+    {
+      chunk = left < E_COPYSZ ? left : E_COPYSZ;
+
+      if (b_readrun(vol, src, buf, chunk) == -1 ||
+	  b_writerun(vol, dst, buf, chunk) == -1)
+	goto fail;
+
+      src += chunk;
+      dst += chunk;
+    }
+
+  FREE(buf);
+
+  return 0;
+
+fail:
+  FREE(buf);
+
+  return -1;
+}
+
+/*
+ * NAME:	extent->evict()
+ * DESCRIPTION:	move the blocks of a fork that lie in [lo, hi) elsewhere;
+ *		the caller keeps the allocator out of that range and
+ *		releases it once every fork has been moved
+ */
+int e_evict(hfsfile *file, unsigned int lo, unsigned int hi)
+{
+  hfsvol *vol = file->vol;
+  ExtDescriptor *exts = 0, *list = 0, *got = 0;
+  unsigned int count, nlist = 0, ngot = 0, szlist = 0, szgot = 0, i;
+  int moved = 0;
+
+  if (e_getexts(file, &exts, &count) == -1)
+    goto fail;
+
+  for (i = 0; i < count; ++i)
+    {
+      ExtDescriptor blocks;
+      unsigned int start, end, mlo, mhi, pt;
+
+      start = exts[i].xdrStABN;
+      end   = start + exts[i].xdrNumABlks;
+
+      mlo = start > lo ? start : lo;
+      mhi = end   < hi ? end   : hi;
+
+      if (mlo >= mhi)
+	{
+	  if (addext(&list, &nlist, &szlist, start, end - start) == -1)
+	    goto fail;
+
+	  continue;
+	}
+
+      if (addext(&list, &nlist, &szlist, start, mlo - start) == -1)
+	goto fail;
+
+      moved = 1;
+
+      for (pt = mlo; pt < mhi; pt += blocks.xdrNumABlks)
+	{
+	  blocks.xdrNumABlks = mhi - pt;
+
+	  if (v_allocblocks(vol, &blocks) == -1)
+	    goto fail;
+
+	  if (addext(&got, &ngot, &szgot, blocks.xdrStABN,
+		     blocks.xdrNumABlks) == -1)
+	    {
+	      v_freeblocks(vol, &blocks);
+	      goto fail;
+	    }
+
+	  if (e_copy(vol, pt, blocks.xdrStABN, blocks.xdrNumABlks) == -1 ||
+	      addext(&list, &nlist, &szlist, blocks.xdrStABN,
+		     blocks.xdrNumABlks) == -1)
+	    goto fail;
+	}
+
+      if (addext(&list, &nlist, &szlist, mhi, end - mhi) == -1)
+	goto fail;
+    }
+
+  if (moved && e_setexts(file, list, nlist) == -1)
+    goto fail;
+
+  FREE(exts);
+  FREE(list);
+  FREE(got);
+
+  return 0;
+
+fail:
+  for (i = 0; i < ngot; ++i)
+    v_freeblocks(vol, &got[i]);
+
+  FREE(exts);
+  FREE(list);
+  FREE(got);
+
+  return -1;
+}
+
+/*
+ * NAME:	getfile()
+ * DESCRIPTION:	look up a file record and make it ready for fork access
+ */
+static
+int getfile(hfsvol *vol, unsigned long parid, const char *name, hfsfile *file)
+{
+  int found;
+
+  f_init(file, vol, 0, name);
+  file->parid = parid;
+
+  found = v_catsearch(vol, parid, file->name, &file->cat, 0, 0);
+  if (found == -1)
+    goto fail;
+  else if (! found || file->cat.cdrType != cdrFilRec)
+    ERROR(EIO, "catalog file record disappeared");
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	extent->forall()
+ * DESCRIPTION:	call a function for every fork on the volume, starting with
+ *		the extents overflow and catalog files
+ */
+int e_forall(hfsvol *vol, forkfunc func, void *arg)
+{
+  fileref *refs = 0;
+  unsigned long nrefs = 0, size = 0, i;
+  node n;
+
+  if (func(&vol->ext.f, arg) == -1 ||
+      func(&vol->cat.f, arg) == -1)
+    goto fail;
+
+  /* collect the file records first; the callback may change the tree */
+
+  if (vol->cat.hdr.bthFNode > 0)
+    {
+      if (bt_getnode(&n, &vol->cat, vol->cat.hdr.bthFNode) == -1)
+	goto fail;
+
+      n.rnum = 0;
+
+      while (1)
+	{
+	  CatKeyRec key;
+	  CatDataRec data;
+	  const byte *ptr;
+
+	  while (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink > 0)
+	    {
+	      if (bt_getnode(&n, &vol->cat, n.nd.ndFLink) == -1)
+		goto fail;
+
+	      n.rnum = 0;
+	    }
+
+	  if (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink == 0)
+	    break;
+
+	  ptr = HFS_NODEREC(n, n.rnum);
+	  r_unpackcatdata(HFS_RECDATA(ptr), &data);
+
+	  if (data.cdrType == cdrFilRec)
+	    {
+	      if (nrefs == size)
+		{
+		  fileref *grow;
+
+		  grow = REALLOC(refs, fileref, size ? size * 2 : 64);
+		  if (grow == 0)
+		    ERROR(ENOMEM, 0);
+
+		  refs = grow;
+		  size = size ? size * 2 : 64;
+		}
+
+	      r_unpackcatkey(ptr, &key);
+
+	      refs[nrefs].parid = key.ckrParID;
+	      strcpy(refs[nrefs].name, key.ckrCName);
+	      ++nrefs;
+	    }
+
+	  ++n.rnum;
+	}
+    }
+
+  for (i = 0; i < nrefs; ++i)
+    {
+      hfsfile file;
+      unsigned long *pylen;
+      int fork;
+
+      if (getfile(vol, refs[i].parid, refs[i].name, &file) == -1)
+	goto fail;
+
+      for (fork = 0; fork < 2; ++fork)
+	{
+	  f_selectfork(&file, fork ? fkRsrc : fkData);
+	  f_getptrs(&file, 0, 0, &pylen);
+
+	  if (*pylen && func(&file, arg) == -1)
+	    goto fail;
+	}
+    }
+
+  FREE(refs);
+
+  return 0;
+
+fail:
+  FREE(refs);
+
+  return -1;
+}
+
+/*
+ * NAME:	freestats()
+ * DESCRIPTION:	count the free runs of the volume bitmap and find the longest
+ */
+static
+void freestats(hfsvol *vol, unsigned long *runs, unsigned long *longest)
+{
+  unsigned int pt, mark, end = vol->mdb.drNmAlBlks;
+
+  *runs    = 0;
+  *longest = 0;
+
+  for (pt = 0; pt < end; )
+    {
+      if (BMTST(vol->vbm, pt))
+	{
+	  ++pt;
+	  continue;
+	}
+
+      for (mark = pt; pt < end && ! BMTST(vol->vbm, pt); ++pt)
+	;
+
+      ++*runs;
+
+      if (pt - mark > *longest)
+	*longest = pt - mark;
+    }
+
+  *longest *= vol->mdb.drAlBlkSiz;
+}
+
+/*
+ * NAME:	listfork()
+ * DESCRIPTION:	record a fork and its extent count (e_forall() callback)
+ */
+static
+int listfork(hfsfile *file, void *arg)
+{
+  forklist *list = arg;
+  ExtDescriptor *exts = 0;
+  unsigned int count;
+
+  /* the B*-tree files stay where they are */
+
+  if (file == &file->vol->ext.f ||
+      file == &file->vol->cat.f)
+    goto done;
+
+  if (e_getexts(file, &exts, &count) == -1)
+    goto fail;
+
+  if (count == 0)
+    goto done;
+
+  ++list->ent->forks;
+
+  if (count > 1)
+    {
+      ++list->ent->fragmented;
+      list->ent->extents += count;
+
+      if (count > 3)
+	list->ent->overflow += count - 3;
+    }
+
+  if (list->nrefs == list->size)
+    {
+      forkref *grow;
+
+      grow = REALLOC(list->refs, forkref, list->size ? list->size * 2 : 64);
+      if (grow == 0)
+	ERROR(ENOMEM, 0);
+
+      list->refs = grow;
+      list->size = list->size ? list->size * 2 : 64;
+    }
+
+  list->refs[list->nrefs].parid = file->parid;
+  strcpy(list->refs[list->nrefs].name, file->name);
+  list->refs[list->nrefs].fork  = file->fork;
+  list->refs[list->nrefs].start = exts[0].xdrStABN;
+  list->refs[list->nrefs].count = count;
+  ++list->nrefs;
+
+done:
+  FREE(exts);
+
+  return 0;
+
+fail:
+  FREE(exts);
+
+  return -1;
+}
+
+/*
+ * NAME:	byextents()
+ * DESCRIPTION:	qsort() comparison putting the most fragmented forks first
+ */
+static
+int byextents(const void *p1, const void *p2)
+{
+  const forkref *r1 = p1, *r2 = p2;
+
+  return (r1->count < r2->count) - (r1->count > r2->count);
+}
+
+/*
+ * NAME:	bystart()
+ * DESCRIPTION:	qsort() comparison putting forks in on-disk order
+ */
+static
+int bystart(const void *p1, const void *p2)
+{
+  const forkref *r1 = p1, *r2 = p2;
+
+  return (r1->start > r2->start) - (r1->start < r2->start);
+}
+
+/*
+ * NAME:	moverun()
+ * DESCRIPTION:	copy a fork into a claimed run, point its records there and
+ *		release the old runs
+ */
+static
+int moverun(hfsfile *file, const ExtDescriptor *exts, unsigned int count,
+	    const ExtDescriptor *run)
+{
+  hfsvol *vol = file->vol;
+  unsigned int pt, i;
+
+  for (pt = run->xdrStABN, i = 0; i < count; pt += exts[i++].xdrNumABlks)
+    {
+      if (e_copy(vol, exts[i].xdrStABN, pt, exts[i].xdrNumABlks) == -1)
+	goto fail;
+    }
+
+  /* the data is in place before the records name it */
+
+  if (e_setexts(file, run, 1) == -1)
+    goto fail;
+
+  for (i = 0; i < count; ++i)
+    {
+      if (v_freeblocks(vol, &exts[i]) == -1)
+	goto fail;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	defragfork()
+ * DESCRIPTION:	move a fragmented fork into one run from the allocator;
+ *		return 1 if it moved, 0 if no free run could hold it
+ */
+static
+int defragfork(hfsfile *file)
+{
+  hfsvol *vol = file->vol;
+  ExtDescriptor *exts = 0, run;
+  unsigned int count, total, i;
+  int result = 0;
+
+  if (e_getexts(file, &exts, &count) == -1)
+    goto fail;
+
+  for (total = 0, i = 0; i < count; ++i)
+    total += exts[i].xdrNumABlks;
+
+  if (count < 2 || total > vol->mdb.drFreeBks)
+    goto done;
+
+  run.xdrNumABlks = total;
+
+  if (v_allocblocks(vol, &run) == -1)
+    goto fail;
+
+  if (run.xdrNumABlks < total)
+    {
+      v_freeblocks(vol, &run);
+      goto done;
+    }
+
+  if (moverun(file, exts, count, &run) == -1)
+    {
+      v_freeblocks(vol, &run);
+      goto fail;
+    }
+
+  result = 1;
+
+done:
+  FREE(exts);
+
+  return result;
+
+fail:
+  FREE(exts);
+
+  return -1;
+}
+
+/*
+ * NAME:	compactfork()
+ * DESCRIPTION:	move a contiguous fork down into the lowest free run that
+ *		holds it; return 1 if it moved
+ */
+static
+int compactfork(hfsfile *file, unsigned int *low)
+{
+  hfsvol *vol = file->vol;
+  block *vbm = vol->vbm;
+  ExtDescriptor *exts = 0, run;
+  unsigned int count, pt, mark;
+  int result = 0;
+
+  if (e_getexts(file, &exts, &count) == -1)
+    goto fail;
+
+  if (count != 1)
+    goto done;
+
+  while (*low < exts[0].xdrStABN && BMTST(vbm, *low))
+    ++*low;
+
+  for (pt = *low; pt < exts[0].xdrStABN; )
+    {
+      if ((pt & 7) == 0 && ((byte *) vbm)[pt >> 3] == 0xff)
+	{
+	  pt += 8;
+	  continue;
+	}
+
+      if (BMTST(vbm, pt))
+	{
+	  ++pt;
+	  continue;
+	}
+
+      mark = pt;
+      while (pt < exts[0].xdrStABN && pt - mark < exts[0].xdrNumABlks &&
+	     ! BMTST(vbm, pt))
+	++pt;
+
+      if (pt - mark < exts[0].xdrNumABlks)
+	continue;
+
+      run.xdrStABN    = mark;
+      run.xdrNumABlks = exts[0].xdrNumABlks;
+
+      for (pt = mark; pt < mark + run.xdrNumABlks; ++pt)
+	BMSET(vbm, pt);
+
+      vol->mdb.drFreeBks -= run.xdrNumABlks;
+      vol->flags |= HFS_VOL_UPDATE_MDB | HFS_VOL_UPDATE_VBM;
+
+      if (moverun(file, exts, count, &run) == -1)
+	{
+	  v_freeblocks(vol, &run);
+	  goto fail;
+	}
+
+      result = 1;
+      break;
+    }
+
+done:
+  FREE(exts);
+
+  return result;
+
+fail:
+  FREE(exts);
+
+  return -1;
+}
+
+/*
+ * NAME:	extent->defrag()
+ * DESCRIPTION:	make the most fragmented forks contiguous first, then slide
+ *		forks down to gather the free space at the end
+ */
+int e_defrag(hfsvol *vol, int flags, hfsdefragent *ent)
+{
+  forklist list;
+  unsigned long i;
+  unsigned int low = 0;
+  int pass, result;
+
+  memset(ent, 0, sizeof(*ent));
+
+  list.refs = 0;
+  list.ent  = ent;
+
+  freestats(vol, &ent->freeruns[0], &ent->maxfree[0]);
+
+  for (pass = 0; pass < 2; ++pass)
+    {
+      list.nrefs = 0;
+      list.size  = 0;
+
+      FREE(list.refs);
+      list.refs = 0;
+
+      if (pass == 0)
+	{
+	  if (e_forall(vol, listfork, &list) == -1)
+	    goto fail;
+
+	  if (flags & HFS_DEFRAG_DRYRUN)
+	    break;
+
+	  qsort(list.refs, list.nrefs, sizeof(forkref), byextents);
+	}
+      else
+	{
+	  hfsdefragent scratch;
+
+	  if (flags & HFS_DEFRAG_NOCOMPACT)
+	    break;
+
+	  /* the extents moved, so list the forks again in disk order */
+
+	  memset(&scratch, 0, sizeof(scratch));
+	  list.ent = &scratch;
+
+	  if (e_forall(vol, listfork, &list) == -1)
+	    goto fail;
+
+	  qsort(list.refs, list.nrefs, sizeof(forkref), bystart);
+	}
+
+      for (i = 0; i < list.nrefs; ++i)
+	{
+	  forkref *ref = &list.refs[i];
+	  hfsfile file;
+
+	  if (pass == 0 && ref->count < 2)
+	    break;
+
+	  if (getfile(vol, ref->parid, ref->name, &file) == -1)
+	    goto fail;
+
+	  f_selectfork(&file, ref->fork);
+
+	  if (pass == 0)
+	    {
+	      result = defragfork(&file);
+	      if (result == -1)
+		goto fail;
+
+	      if (result)
+		++ent->defragged;
+	      else
+		++ent->skipped;
+	    }
+	  else
+	    {
+	      result = compactfork(&file, &low);
+	      if (result == -1)
+		goto fail;
+
+	      ent->compacted += result;
+	    }
+	}
+    }
+
+  freestats(vol, &ent->freeruns[1], &ent->maxfree[1]);
+
+  FREE(list.refs);
+
+  return 0;
+
+fail:
+  FREE(list.refs);
+
+  return -1;
+}
+
+/*
+ * NAME:	histslot()
+ * DESCRIPTION:	return the histogram bucket of a count: 1, 2-3, 4-7, ...
+ */
+static
+unsigned int histslot(unsigned long n)
+{
+  unsigned int b;
+
+  for (b = 0; n > 1 && b < HFS_HISTSZ - 1; n >>= 1)
+    ++b;
+
+  return b;
+}
+
+/*
+ * NAME:	extent->tally()
+ * DESCRIPTION:	add a fork to the fragmentation statistics
+ */
+void e_tally(hfsfragent *ent, unsigned long cnid, const char *name, int rsrc,
+	     unsigned long nexts, unsigned long nblocks)
+{
+  unsigned int i;
+
+  ++ent->forks;
+  ent->extents += nexts;
+  ++ent->exthist[histslot(nexts)];
+
+  if (nexts < 2)
+    return;
+
+  ++ent->fragmented;
+
+  /* keep the worst forks, most extents first */
+
+  for (i = ent->nworst; i > 0 && ent->worst[i - 1].extents < nexts; --i)
+    {
+      if (i < HFS_WORSTSZ)
+	ent->worst[i] = ent->worst[i - 1];
+    }
+
+  if (i >= HFS_WORSTSZ)
+    return;
+
+  if (ent->nworst < HFS_WORSTSZ)
+    ++ent->nworst;
+
+  ent->worst[i].cnid    = cnid;
+  ent->worst[i].rsrc    = rsrc;
+  ent->worst[i].extents = nexts;
+  ent->worst[i].blocks  = nblocks;
+
+  strncpy(ent->worst[i].name, name, HFSPLUS_MAX_NLEN);
+  ent->worst[i].name[HFSPLUS_MAX_NLEN] = 0;
+}
+
+/*
+ * NAME:	extent->tallyfree()
+ * DESCRIPTION:	add a run of free blocks to the fragmentation statistics
+ */
+void e_tallyfree(hfsfragent *ent, unsigned long run)
+{
+  ++ent->freeruns;
+  ent->freeblocks += run;
+  ++ent->freehist[histslot(run)];
+
+  if (run > ent->maxfree)
+    ent->maxfree = run;
+}
+
+typedef struct {
+  unsigned long cnid;		/* file ID */
+  int fork;			/* fkData or fkRsrc */
+  unsigned long count;		/* extents in overflow records */
+} ovfref;
+
+/*
+ * NAME:	byfork()
+ * DESCRIPTION:	qsort()/bsearch() comparison of overflow counts
+ */
+static
+int byfork(const void *p1, const void *p2)
+{
+  const ovfref *r1 = p1, *r2 = p2;
+
+  if (r1->cnid != r2->cnid)
+    return (r1->cnid > r2->cnid) - (r1->cnid < r2->cnid);
+
+  return (r1->fork > r2->fork) - (r1->fork < r2->fork);
+}
+
+/*
+ * NAME:	countexts()
+ * DESCRIPTION:	return the number of extents used in an extent record
+ */
+static
+unsigned int countexts(const ExtDataRec *rec)
+{
+  unsigned int i, count;
+
+  for (count = 0, i = 0; i < 3; ++i)
+    {
+      if ((*rec)[i].xdrNumABlks)
+	++count;
+    }
+
+  return count;
+}
+
+/*
+ * NAME:	scanovf()
+ * DESCRIPTION:	count the extents each fork keeps in overflow records
+ */
+static
+int scanovf(hfsvol *vol, ovfref **list, unsigned long *nlist)
+{
+  unsigned long size = 0;
+  node n;
+
+  *list  = 0;
+  *nlist = 0;
+
+  if (vol->ext.hdr.bthFNode == 0)
+    goto done;
+
+  if (bt_getnode(&n, &vol->ext, vol->ext.hdr.bthFNode) == -1)
+    goto fail;
+
+  n.rnum = 0;
+
+  while (1)
+    {
+      ExtKeyRec key;
+      ExtDataRec data;
+      const byte *ptr;
+      ovfref *last;
+
+      while (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink > 0)
+	{
+	  if (bt_getnode(&n, &vol->ext, n.nd.ndFLink) == -1)
+	    goto fail;
+
+	  n.rnum = 0;
+	}
+
+      if (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink == 0)
+	break;
+
+      ptr = HFS_NODEREC(n, n.rnum);
+      r_unpackextkey(ptr, &key);
+      r_unpackextdata(HFS_RECDATA(ptr), &data);
+
+      last = *nlist ? &(*list)[*nlist - 1] : 0;
+
+      if (last && last->cnid == key.xkrFNum && last->fork == key.xkrFkType)
+	last->count += countexts(&data);
+      else
+	{
+	  if (*nlist == size)
+	    {
+	      ovfref *grow;
+
+	      grow = REALLOC(*list, ovfref, size ? size * 2 : 64);
+	      if (grow == 0)
+		ERROR(ENOMEM, 0);
+
+	      *list = grow;
+	      size  = size ? size * 2 : 64;
+	    }
+
+	  (*list)[*nlist].cnid  = key.xkrFNum;
+	  (*list)[*nlist].fork  = key.xkrFkType;
+	  (*list)[*nlist].count = countexts(&data);
+	  ++*nlist;
+	}
+
+      ++n.rnum;
+    }
+
+  qsort(*list, *nlist, sizeof(ovfref), byfork);
+
+done:
+  return 0;
+
+fail:
+  FREE(*list);
+  *list = 0;
+
+  return -1;
+}
+
+/*
+ * NAME:	ovfcount()
+ * DESCRIPTION:	look up the overflow extent count of a fork
+ */
+static
+unsigned long ovfcount(const ovfref *list, unsigned long nlist,
+		       unsigned long cnid, int fork)
+{
+  ovfref key, *found;
+
+  key.cnid = cnid;
+  key.fork = fork;
+
+  found = bsearch(&key, list, nlist, sizeof(ovfref), byfork);
+
+  return found ? found->count : 0;
+}
+
+/*
+ * NAME:	treestat()
+ * DESCRIPTION:	measure the fill and leaf locality of a B*-tree, walking
+ *		each level from its leftmost node
+ */
+static
+int treestat(hfsvol *vol, btree *bt, hfstreestat *st)
+{
+  ExtDescriptor *exts = 0;
+  unsigned int count, i;
+  unsigned long nnum, first, child, seen = 0, pos, prev = 0;
+  int haveprev = 0;
+  node n;
+
+  st->nodesz    = HFS_BLOCKSZ;
+  st->nodes     = bt->hdr.bthNNodes;
+  st->freenodes = bt->hdr.bthFree;
+  st->depth     = bt->hdr.bthDepth;
+  st->records   = bt->hdr.bthNRecs;
+
+  if (e_getexts(&bt->f, &exts, &count) == -1)
+    goto fail;
+
+  st->extents = count;
+
+  for (nnum = bt->hdr.bthRoot; nnum; nnum = child)
+    {
+      for (first = nnum, child = 0; nnum; nnum = n.nd.ndFLink)
+	{
+	  unsigned long used;
+
+	  if (++seen > bt->hdr.bthNNodes)
+	    ERROR(EIO, "b*-tree node chain loops");
+
+	  if (bt_getnode(&n, bt, nnum) == -1)
+	    goto fail;
+
+	  used = n.roff[n.nd.ndNRecs] + 2 * (n.nd.ndNRecs + 1);
+
+	  if (n.nd.ndType == ndIndxNode)
+	    {
+	      ++st->index;
+	      st->indexused += used;
+
+	      if (nnum == first && n.nd.ndNRecs > 0)
+		child = d_getul(HFS_RECDATA(HFS_NODEREC(n, 0)));
+
+	      continue;
+	    }
+
+	  if (n.nd.ndType != ndLeafNode)
+	    ERROR(EIO, "unexpected b*-tree node type");
+
+	  ++st->leaves;
+	  st->leafused += used;
+
+	  /* where the node lies on the medium, in logical blocks */
+
+	  for (pos = nnum / vol->lpa, i = 0; i < count; ++i)
+	    {
+	      if (pos < exts[i].xdrNumABlks)
+		break;
+
+	      pos -= exts[i].xdrNumABlks;
+	    }
+
+	  if (i == count)
+	    ERROR(EIO, "b*-tree node beyond end of file");
+
+	  pos = vol->mdb.drAlBlSt +
+	    (exts[i].xdrStABN + pos) * vol->lpa + nnum % vol->lpa;
+
+	  if (haveprev && pos != prev + 1)
+	    {
+	      ++st->jumps;
+
+	      if (pos < prev)
+		++st->backward;
+
+	      st->distance += (pos < prev ? prev - pos : pos - prev) >> 1;
+	    }
+
+	  prev     = pos;
+	  haveprev = 1;
+	}
+    }
+
+  FREE(exts);
+
+  return 0;
+
+fail:
+  FREE(exts);
+
+  return -1;
+}
+
+/*
+ * NAME:	extent->fragstat()
+ * DESCRIPTION:	gather fragmentation and layout statistics with one scan of
+ *		the extents and catalog trees
+ */
+int e_fragstat(hfsvol *vol, hfsfragent *ent)
+{
+  ovfref *ovf = 0;
+  unsigned long novf, mark, pt;
+  node n;
+
+  memset(ent, 0, sizeof(*ent));
+
+  ent->blocksz = vol->mdb.drAlBlkSiz;
+
+  if (scanovf(vol, &ovf, &novf) == -1)
+    goto fail;
+
+  if (vol->cat.hdr.bthFNode > 0)
+    {
+      if (bt_getnode(&n, &vol->cat, vol->cat.hdr.bthFNode) == -1)
+	goto fail;
+
+      n.rnum = 0;
+
+      while (1)
+	{
+	  CatKeyRec key;
+	  CatDataRec data;
+	  const byte *ptr;
+	  unsigned long extra;
+
+	  while (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink > 0)
+	    {
+	      if (bt_getnode(&n, &vol->cat, n.nd.ndFLink) == -1)
+		goto fail;
+
+	      n.rnum = 0;
+	    }
+
+	  if (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink == 0)
+	    break;
+
+	  ptr = HFS_NODEREC(n, n.rnum);
+	  r_unpackcatkey(ptr, &key);
+	  r_unpackcatdata(HFS_RECDATA(ptr), &data);
+
+	  if (data.cdrType == cdrFilRec)
+	    {
+	      if (data.u.fil.filPyLen)
+		{
+		  extra = ovfcount(ovf, novf, data.u.fil.filFlNum, fkData);
+		  ent->overflow += extra;
+
+		  e_tally(ent, data.u.fil.filFlNum, key.ckrCName, 0,
+			  countexts(&data.u.fil.filExtRec) + extra,
+			  data.u.fil.filPyLen / ent->blocksz);
+		}
+
+	      if (data.u.fil.filRPyLen)
+		{
+		  extra = ovfcount(ovf, novf, data.u.fil.filFlNum, fkRsrc);
+		  ent->overflow += extra;
+
+		  e_tally(ent, data.u.fil.filFlNum, key.ckrCName, 1,
+			  countexts(&data.u.fil.filRExtRec) + extra,
+			  data.u.fil.filRPyLen / ent->blocksz);
+		}
+	    }
+
+	  ++n.rnum;
+	}
+    }
+
+  /* free space, from the volume bitmap */
+
+  for (pt = 0; pt < vol->mdb.drNmAlBlks; )
+    {
+      if (BMTST(vol->vbm, pt))
+	{
+	  ++pt;
+	  continue;
+	}
+
+      for (mark = pt; pt < vol->mdb.drNmAlBlks && ! BMTST(vol->vbm, pt); ++pt)
+	;
+
+      e_tallyfree(ent, pt - mark);
+    }
+
+  if (treestat(vol, &vol->cat, &ent->cat) == -1 ||
+      treestat(vol, &vol->ext, &ent->ext) == -1)
+    goto fail;
+
+  FREE(ovf);
+
+  return 0;
+
+fail:
+  FREE(ovf);
+
+  return -1;
+}
@@ -0,0 +1,35 @@
+/*
+ * libhfs - library for reading and writing Macintosh HFS volumes
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+typedef int (*forkfunc)(hfsfile *, void *);
+
+int e_getexts(hfsfile *, ExtDescriptor **, unsigned int *);
+int e_setexts(hfsfile *, const ExtDescriptor *, unsigned int);
+
+int e_copy(hfsvol *, unsigned int, unsigned int, unsigned int);
+int e_evict(hfsfile *, unsigned int, unsigned int);
+
+int e_forall(hfsvol *, forkfunc, void *);
+int e_defrag(hfsvol *, int, hfsdefragent *);
+
+void e_tally(hfsfragent *, unsigned long, const char *, int,
+	     unsigned long, unsigned long);
+void e_tallyfree(hfsfragent *, unsigned long);
+
+int e_fragstat(hfsvol *, hfsfragent *);
@@ -91,6 +91,7 @@ void f_init(hfsfile *file, hfsvol *vol, long cnid, const char *name)
   f_selectfork(file, fkData);
 
   file->flags = 0;
+  file->plus  = 0;
 
   file->prev  = 0;
   file->next  = 0;
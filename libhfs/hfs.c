@@ -37,6 +37,8 @@
 # include "node.h"
 # include "record.h"
 # include "volume.h"
+# include "plus.h"
+# include "extent.h"
 
 const char *hfs_error = "no error";	/* static error string */
 
@@ -94,10 +96,11 @@ fail:
 /* High-Level Volume Routines ============================================== */
 
 /*
- * NAME:	hfs->mount()
- * DESCRIPTION:	open an HFS volume; return volume descriptor or 0 (error)
+ * NAME:	mount()
+ * DESCRIPTION:	open a volume found by partition number or table entry
  */
-hfsvol *hfs_mount(const char *path, int pnum, int mode)
+static
+hfsvol *mount(const char *path, int pnum, const hfspartent *part, int mode)
 {
   hfsvol *vol, *check;
 
@@ -148,7 +151,7 @@ hfsvol *hfs_mount(const char *path, int pnum, int mode)
 
   /* mount the volume */
 
-  if (v_geometry(vol, pnum) == -1 ||
+  if ((part ? v_place(vol, part) : v_geometry(vol, pnum)) == -1 ||
       v_mount(vol) == -1)
     goto fail;
 
@@ -178,6 +181,25 @@ fail:
   return 0;
 }
 
+/*
+ * NAME:	hfs->mount()
+ * DESCRIPTION:	open an HFS volume; return volume descriptor or 0 (error)
+ */
+hfsvol *hfs_mount(const char *path, int pnum, int mode)
+{
+  return mount(path, pnum, 0, mode);
+}
+
+/*
+ * NAME:	hfs->mountpart()
+ * DESCRIPTION:	open the volume of an hfs_partitions() entry without
+ *		reading the partition map again
+ */
+hfsvol *hfs_mountpart(const char *path, const hfspartent *part, int mode)
+{
+  return mount(path, part->pnum, part, mode);
+}
+
 /*
  * NAME:	hfs->flush()
  * DESCRIPTION:	flush all pending changes to an HFS volume
@@ -321,6 +343,9 @@ int hfs_vstat(hfsvol *vol, hfsvolent *ent)
   if (getvol(&vol) == -1)
     goto fail;
 
+  if (vol->plus)
+    return p_vstat(vol, ent);
+
   strcpy(ent->name, vol->mdb.drVN);
 
   ent->flags     = (vol->flags & HFS_VOL_READONLY) ? HFS_ISLOCKED : 0;
@@ -383,6 +408,81 @@ fail:
   return -1;
 }
 
+/*
+ * NAME:	hfs->resize()
+ * DESCRIPTION:	grow or shrink a volume to len blocks of HFS_BLOCKSZ bytes
+ */
+int hfs_resize(hfsvol *vol, unsigned long len)
+{
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  if (vol->files || vol->dirs)
+    ERROR(EBUSY, "volume has open files or directories");
+
+  if (vol->plus)
+    {
+      if (p_resize(vol, len) == -1)
+	goto fail;
+    }
+  else if (v_resize(vol, len) == -1 ||
+	   v_flush(vol) == -1)
+    goto fail;
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	hfs->defrag()
+ * DESCRIPTION:	make fragmented forks contiguous and close free-space gaps
+ */
+int hfs_defrag(hfsvol *vol, int flags, hfsdefragent *ent)
+{
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  if (vol->plus)
+    ERROR(EINVAL, "HFS+ volumes cannot be defragmented");
+
+  if (! (flags & HFS_DEFRAG_DRYRUN) && (vol->flags & HFS_VOL_READONLY))
+    ERROR(EROFS, 0);
+
+  if (vol->files || vol->dirs)
+    ERROR(EBUSY, "volume has open files or directories");
+
+  if (e_defrag(vol, flags, ent) == -1)
+    goto fail;
+
+  if (! (flags & HFS_DEFRAG_DRYRUN) && v_flush(vol) == -1)
+    goto fail;
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	hfs->fragstat()
+ * DESCRIPTION:	report fragmentation and B*-tree layout statistics
+ */
+int hfs_fragstat(hfsvol *vol, hfsfragent *ent)
+{
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  if (vol->plus)
+    return p_fragstat(vol, ent);
+
+  return e_fragstat(vol, ent);
+
+fail:
+  return -1;
+}
+
 /* High-Level Directory Routines =========================================== */
 
 /*
@@ -454,8 +554,13 @@ int hfs_dirinfo(hfsvol *vol, unsigned long *id, char *name)
 {
   CatDataRec thread;
 
-  if (getvol(&vol) == -1 ||
-      v_getdthread(vol, *id, &thread, 0) <= 0)
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  if (vol->plus)
+    return p_dirinfo(vol, id, name);
+
+  if (v_getdthread(vol, *id, &thread, 0) <= 0)
     goto fail;
 
   *id = thread.u.dthd.thdParID;
@@ -487,7 +592,8 @@ hfsdir *hfs_opendir(hfsvol *vol, const char *path)
   if (dir == 0)
     ERROR(ENOMEM, 0);
 
-  dir->vol = vol;
+  dir->vol  = vol;
+  dir->plus = 0;
 
   if (*path == 0)
     {
@@ -504,14 +610,23 @@ hfsdir *hfs_opendir(hfsvol *vol, const char *path)
       if (data.cdrType != cdrDirRec)
 	ERROR(ENOTDIR, 0);
 
+      dir->vol   = vol;
       dir->dirid = data.u.dir.dirDirID;
       dir->vptr  = 0;
 
-      r_makecatkey(&key, dir->dirid, "");
-      r_packcatkey(&key, pkey, 0);
+      if (vol->plus)
+	{
+	  if (p_opendir(dir) == -1)
+	    goto fail;
+	}
+      else
+	{
+	  r_makecatkey(&key, dir->dirid, "");
+	  r_packcatkey(&key, pkey, 0);
 
-      if (bt_search(&vol->cat, pkey, &dir->n) <= 0)
-	goto fail;
+	  if (bt_search(&vol->cat, pkey, &dir->n) <= 0)
+	    goto fail;
+	}
     }
 
   dir->prev = 0;
@@ -525,6 +640,9 @@ hfsdir *hfs_opendir(hfsvol *vol, const char *path)
   return dir;
 
 fail:
+  if (dir)
+    p_closedir(dir);
+
   FREE(dir);
   return 0;
 }
@@ -553,18 +671,29 @@ int hfs_readdir(hfsdir *dir, hfsdirent *ent)
       if (vol == 0)
 	ERROR(ENOENT, "no more entries");
 
-      if (v_getdthread(vol, HFS_CNID_ROOTDIR, &data, 0) <= 0 ||
-	  v_catsearch(vol, HFS_CNID_ROOTPAR, data.u.dthd.thdCName,
-		      &data, cname, 0) <= 0)
-	goto fail;
+      if (vol->plus)
+	{
+	  if (p_rootent(vol, ent) == -1)
+	    goto fail;
+	}
+      else
+	{
+	  if (v_getdthread(vol, HFS_CNID_ROOTDIR, &data, 0) <= 0 ||
+	      v_catsearch(vol, HFS_CNID_ROOTPAR, data.u.dthd.thdCName,
+			  &data, cname, 0) <= 0)
+	    goto fail;
 
-      r_unpackdirent(HFS_CNID_ROOTPAR, cname, &data, ent);
+	  r_unpackdirent(HFS_CNID_ROOTPAR, cname, &data, ent);
+	}
 
       dir->vptr = vol->next;
 
       goto done;
     }
 
+  if (dir->plus)
+    return p_readdir(dir, ent);
+
   if (dir->n.rnum == -1)
     ERROR(ENOENT, "no more entries");
 
@@ -640,6 +769,8 @@ int hfs_closedir(hfsdir *dir)
   if (dir == vol->dirs)
     vol->dirs = dir->next;
 
+  p_closedir(dir);
+
   FREE(dir);
 
   return 0;
@@ -656,7 +787,7 @@ hfsfile *hfs_create(hfsvol *vol, const char *path,
 {
   hfsfile *file = 0;
   unsigned long parid;
-  char name[HFS_MAX_FLEN + 1];
+  char name[HFSPLUS_MAX_NLEN + 1];
   CatKeyRec key;
   byte record[HFS_MAX_CATRECLEN];
   unsigned reclen;
@@ -740,6 +871,8 @@ hfsfile *hfs_open(hfsvol *vol, const char *path)
   if (file == 0)
     ERROR(ENOMEM, 0);
 
+  file->plus = 0;
+
   if (v_resolve(&vol, path, &file->cat, &file->parid, file->name, 0) <= 0)
     goto fail;
 
@@ -753,6 +886,10 @@ hfsfile *hfs_open(hfsvol *vol, const char *path)
 
   f_selectfork(file, fkData);
 
+  if (vol->plus &&
+      p_open(file) == -1)
+    goto fail;
+
   file->prev = 0;
   file->next = vol->files;
 
@@ -802,6 +939,9 @@ unsigned long hfs_read(hfsfile *file, void *buf, unsigned long len)
   unsigned long *lglen, count;
   byte *ptr = buf;
 
+  if (file->plus)
+    return p_read(file, buf, len);
+
   f_getptrs(file, 0, &lglen, 0);
 
   if (file->pos + len > *lglen)
@@ -1016,6 +1156,8 @@ int hfs_close(hfsfile *file)
   if (file == vol->files)
     vol->files = file->next;
 
+  p_close(file);
+
   FREE(file);
 
   return result;
@@ -1031,7 +1173,7 @@ int hfs_stat(hfsvol *vol, const char *path, hfsdirent *ent)
 {
   CatDataRec data;
   unsigned long parid;
-  char name[HFS_MAX_FLEN + 1];
+  char name[HFSPLUS_MAX_NLEN + 1];
 
   if (getvol(&vol) == -1 ||
       v_resolve(&vol, path, &data, &parid, name, 0) <= 0)
@@ -1099,6 +1241,45 @@ fail:
   return -1;
 }
 
+/*
+ * NAME:	hfs->listxattr()
+ * DESCRIPTION:	list the extended attribute names of a file or directory
+ */
+long hfs_listxattr(hfsvol *vol, unsigned long id, char *list, unsigned long size)
+{
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  /* HFS volumes have no extended attributes */
+
+  if (vol->plus == 0)
+    return 0;
+
+  return p_listattr(vol, id, list, size);
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	hfs->getxattr()
+ * DESCRIPTION:	read an extended attribute of a file or directory
+ */
+long hfs_getxattr(hfsvol *vol, unsigned long id, const char *name,
+		  void *buf, unsigned long size)
+{
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  if (vol->plus == 0)
+    ERROR(ENOENT, "no such attribute");
+
+  return p_getattr(vol, id, name, buf, size);
+
+fail:
+  return -1;
+}
+
 /*
  * NAME:	hfs->mkdir()
  * DESCRIPTION:	create a new directory
@@ -1107,7 +1288,7 @@ int hfs_mkdir(hfsvol *vol, const char *path)
 {
   CatDataRec data;
   unsigned long parid;
-  char name[HFS_MAX_FLEN + 1];
+  char name[HFSPLUS_MAX_NLEN + 1];
   int found;
 
   if (getvol(&vol) == -1)
@@ -1141,7 +1322,7 @@ int hfs_rmdir(hfsvol *vol, const char *path)
   CatKeyRec key;
   CatDataRec data;
   unsigned long parid;
-  char name[HFS_MAX_FLEN + 1];
+  char name[HFSPLUS_MAX_NLEN + 1];
   byte pkey[HFS_CATKEYLEN];
 
   if (getvol(&vol) == -1 ||
@@ -1263,7 +1444,7 @@ int hfs_rename(hfsvol *vol, const char *srcpath, const char *dstpath)
   CatDataRec src, dst;
   unsigned long srcid, dstid;
   CatKeyRec key;
-  char srcname[HFS_MAX_FLEN + 1], dstname[HFS_MAX_FLEN + 1];
+  char srcname[HFSPLUS_MAX_NLEN + 1], dstname[HFSPLUS_MAX_NLEN + 1];
   byte record[HFS_MAX_CATRECLEN];
   unsigned int reclen;
   int found, isdir, moving;
@@ -1534,6 +1715,66 @@ fail:
   return -1;
 }
 
+/*
+ * NAME:	hfs->partitions()
+ * DESCRIPTION:	read the partition map once and return a table of its HFS
+ *		partitions, or -1 if the medium has no partition map
+ */
+int hfs_partitions(const char *path, hfspartent **parts)
+{
+  hfsvol vol;
+  hfspartent *list = 0, *more;
+  int nparts = 0, found;
+  Partition map;
+  unsigned long bnum = 0;
+
+  v_init(&vol, HFS_OPT_NOCACHE);
+
+  if (v_open(&vol, path, HFS_MODE_RDONLY) == -1)
+    goto fail;
+
+  while (1)
+    {
+      found = m_findpmentry(&vol, "Apple_HFS", &map, &bnum);
+      if (found == -1)
+	goto fail;
+
+      if (! found)
+	break;
+
+      more = REALLOC(list, hfspartent, nparts + 1);
+      if (more == 0)
+	ERROR(ENOMEM, 0);
+
+      list = more;
+
+      list[nparts].pnum = nparts + 1;
+      strcpy(list[nparts].name, (char *) map.pmPartName);
+
+      /* a bad entry is kept, so later partitions keep their numbers */
+
+      if (v_partition(&vol, &map) == -1)
+	vol.vstart = vol.vlen = 0;
+
+      list[nparts].start  = vol.vstart;
+      list[nparts].length = vol.vlen;
+
+      ++nparts;
+    }
+
+  if (v_close(&vol) == -1)
+    goto fail;
+
+  *parts = list;
+
+  return nparts;
+
+fail:
+  v_close(&vol);
+  FREE(list);
+  return -1;
+}
+
 /*
  * NAME:	compare()
  * DESCRIPTION:	comparison function for qsort of blocks to be spared
@@ -27,6 +27,9 @@
 # define HFS_MAX_FLEN		31
 # define HFS_MAX_VLEN		27
 
+# define HFSPLUS_MAX_FLEN	255
+# define HFSPLUS_MAX_NLEN	(6 * HFSPLUS_MAX_FLEN)	/* with %uXXXX escapes */
+
 typedef struct _hfsvol_  hfsvol;
 typedef struct _hfsfile_ hfsfile;
 typedef struct _hfsdir_  hfsdir;
@@ -52,7 +55,7 @@ typedef struct {
 } hfsvolent;
 
 typedef struct {
-  char name[HFS_MAX_FLEN + 1];	/* catalog name (MacOS Standard Roman) */
+  char name[HFSPLUS_MAX_NLEN + 1];	/* catalog name (MacOS Standard Roman) */
   int flags;			/* bit flags */
   unsigned long cnid;		/* catalog node id (CNID) */
   unsigned long parid;		/* CNID of parent directory */
@@ -90,6 +93,70 @@ typedef struct {
   } u;
 } hfsdirent;
 
+typedef struct {
+  unsigned long forks;		/* forks with blocks allocated */
+  unsigned long fragmented;	/* forks with more than one extent */
+  unsigned long extents;	/* extents of the fragmented forks */
+  unsigned long overflow;	/* extents kept in overflow records */
+  unsigned long defragged;	/* forks made contiguous */
+  unsigned long skipped;	/* forks no free run could hold */
+  unsigned long compacted;	/* forks moved down into free gaps */
+  unsigned long freeruns[2];	/* free runs before and after */
+  unsigned long maxfree[2];	/* bytes in the largest free run */
+} hfsdefragent;
+
+# define HFS_HISTSZ	16	/* histogram buckets: 1, 2-3, 4-7, ... */
+# define HFS_WORSTSZ	10	/* most fragmented forks reported */
+
+typedef struct {
+  unsigned long cnid;		/* file ID */
+  char name[HFSPLUS_MAX_NLEN + 1];	/* catalog name (MacOS Standard Roman) */
+  int rsrc;			/* resource fork rather than data fork */
+  unsigned long extents;	/* number of extents */
+  unsigned long blocks;		/* allocation blocks */
+} hfsfragfork;
+
+typedef struct {
+  unsigned long nodesz;		/* bytes per node */
+  unsigned long nodes;		/* nodes in the tree file */
+  unsigned long freenodes;	/* nodes not in use */
+  unsigned int depth;		/* levels in the tree */
+  unsigned long records;	/* leaf records */
+  unsigned long leaves;		/* leaf nodes */
+  unsigned long index;		/* index nodes */
+  unsigned long leafused;	/* bytes in use in leaf nodes */
+  unsigned long indexused;	/* bytes in use in index nodes */
+  unsigned long extents;	/* extents of the tree file */
+  unsigned long jumps;		/* leaf steps to a non-adjacent node */
+  unsigned long backward;	/* leaf steps to an earlier node */
+  unsigned long distance;	/* kilobytes travelled by those steps */
+} hfstreestat;
+
+typedef struct {
+  unsigned long blocksz;	/* allocation block size */
+  unsigned long forks;		/* forks with blocks allocated */
+  unsigned long fragmented;	/* forks with more than one extent */
+  unsigned long extents;	/* extents of all forks */
+  unsigned long overflow;	/* extents kept in overflow records */
+  unsigned long exthist[HFS_HISTSZ];	/* forks by number of extents */
+  unsigned int nworst;		/* entries in worst[] */
+  hfsfragfork worst[HFS_WORSTSZ];	/* most fragmented forks */
+  unsigned long freeblocks;	/* free allocation blocks */
+  unsigned long freeruns;	/* runs of free blocks */
+  unsigned long maxfree;	/* blocks in the longest free run */
+  unsigned long freehist[HFS_HISTSZ];	/* free runs by length in blocks */
+  hfstreestat cat;		/* catalog B*-tree */
+  hfstreestat ext;		/* extents overflow B*-tree */
+  hfstreestat attr;		/* attributes B*-tree (HFS+ only) */
+} hfsfragent;
+
+typedef struct {
+  int pnum;			/* partition number, as for hfs_mount() */
+  char name[33];		/* partition name */
+  unsigned long start;		/* first 512-byte block of the volume */
+  unsigned long length;		/* volume size in 512-byte blocks */
+} hfspartent;
+
 # define HFS_ISDIR		0x0001
 # define HFS_ISLOCKED		0x0002
 
@@ -131,7 +198,11 @@ extern const unsigned char hfs_charorder[];
 # define HFS_SEEK_CUR		1
 # define HFS_SEEK_END		2
 
+# define HFS_DEFRAG_DRYRUN	0x01
+# define HFS_DEFRAG_NOCOMPACT	0x02
+
 hfsvol *hfs_mount(const char *, int, int);
+hfsvol *hfs_mountpart(const char *, const hfspartent *, int);
 int hfs_flush(hfsvol *);
 void hfs_flushall(void);
 int hfs_umount(hfsvol *);
@@ -141,6 +212,9 @@ void hfs_setvol(hfsvol *);
 
 int hfs_vstat(hfsvol *, hfsvolent *);
 int hfs_vsetattr(hfsvol *, hfsvolent *);
+int hfs_resize(hfsvol *, unsigned long);
+int hfs_defrag(hfsvol *, int, hfsdefragent *);
+int hfs_fragstat(hfsvol *, hfsfragent *);
 
 int hfs_chdir(hfsvol *, const char *);
 unsigned long hfs_getcwd(hfsvol *);
@@ -166,6 +240,10 @@ int hfs_fstat(hfsfile *, hfsdirent *);
 int hfs_setattr(hfsvol *, const char *, const hfsdirent *);
 int hfs_fsetattr(hfsfile *, const hfsdirent *);
 
+long hfs_listxattr(hfsvol *, unsigned long, char *, unsigned long);
+long hfs_getxattr(hfsvol *, unsigned long, const char *,
+		  void *, unsigned long);
+
 int hfs_mkdir(hfsvol *, const char *);
 int hfs_rmdir(hfsvol *, const char *);
 
@@ -175,6 +253,7 @@ int hfs_rename(hfsvol *, const char *, const char *);
 int hfs_zero(const char *, unsigned int, unsigned long *);
 int hfs_mkpart(const char *, unsigned long);
 int hfs_nparts(const char *);
+int hfs_partitions(const char *, hfspartent **);
 
 int hfs_format(const char *, int, int,
 	       const char *, unsigned int, const unsigned long []);
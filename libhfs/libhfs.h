@@ -130,7 +130,7 @@ typedef struct {
 struct _hfsfile_ {
   struct _hfsvol_ *vol;		/* pointer to volume descriptor */
   unsigned long parid;		/* parent directory ID of this file */
-  char name[HFS_MAX_FLEN + 1];	/* catalog name of this file */
+  char name[HFSPLUS_MAX_NLEN + 1];	/* catalog name of this file */
   CatDataRec cat;		/* catalog information */
   ExtDataRec ext;		/* current extent record */
   unsigned int fabn;		/* starting file allocation block number */
@@ -138,6 +138,8 @@ struct _hfsfile_ {
   unsigned long pos;		/* current file seek pointer */
   int flags;			/* bit flags */
 
+  struct _plusfile_ *plus;	/* HFS+ file state (or 0) */
+
   struct _hfsfile_ *prev;
   struct _hfsfile_ *next;
 };
@@ -163,6 +165,8 @@ struct _hfsdir_ {
   node n;			/* current B*-tree node */
   struct _hfsvol_ *vptr;	/* current volume pointer */
 
+  struct _plusdir_ *plus;	/* HFS+ directory state (or 0) */
+
   struct _hfsdir_ *prev;
   struct _hfsdir_ *next;
 };
@@ -202,6 +206,8 @@ struct _hfsvol_ {
   btree ext;		/* B*-tree control block for extents overflow file */
   btree cat;		/* B*-tree control block for catalog file */
 
+  struct _plusvol_ *plus;	/* HFS+ volume information (or 0) */
+
   unsigned long cwd;	/* directory id of current working directory */
 
   int refs;		/* number of external references to this volume */
@@ -220,6 +226,7 @@ struct _hfsvol_ {
 # define HFS_VOL_UPDATE_MDB	0x0010
 # define HFS_VOL_UPDATE_ALTMDB	0x0020
 # define HFS_VOL_UPDATE_VBM	0x0040
+# define HFS_VOL_EMBEDDED	0x0080
 
 # define HFS_VOL_OPT_MASK	0xff00
 
@@ -0,0 +1,3227 @@
+/*
+ * libhfs - library for reading and writing Macintosh HFS volumes
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+# ifdef HAVE_CONFIG_H
+#  include "config.h"
+# endif
+
+# include <stdlib.h>
+# include <string.h>
+# include <time.h>
+# include <errno.h>
+# include <zlib.h>
+
+# include "libhfs.h"
+# include "plus.h"
+# include "data.h"
+# include "block.h"
+# include "unicode.h"
+# include "file.h"
+# include "record.h"
+# include "extent.h"
+
+/*
+ * Read-only access to HFS+ and HFSX volumes (Apple TN1150).  The volume
+ * header, B*-trees and forks are read directly; catalog records are turned
+ * into HFS-style CatDataRec structures so the rest of the library (and
+ * hfs_stat(), hfs_fstat() and friends) can treat them like HFS records.
+ * The one writer is p_resize(), which edits extent records in place;
+ * p_fragstat() reports on fragmentation and B*-tree layout.
+ */
+
+# define TIMEDIFF		2082844800UL
+
+# define PLUS_FOLDER		1
+# define PLUS_FILE		2
+# define PLUS_FOLDERTHREAD	3
+# define PLUS_FILETHREAD	4
+
+# define PLUS_ATTR_INLINE	0x10
+# define PLUS_ATTR_FORK		0x20
+# define PLUS_ATTR_EXTENTS	0x30
+
+# define PLUS_LEAFNODE		(-1)
+# define PLUS_INDEXNODE		0
+
+# define PLUS_UF_COMPRESSED	0x20
+
+# define PLUS_HLNK		0x686c6e6bUL	/* 'hlnk' */
+# define PLUS_HFSP		0x6866732bUL	/* 'hfs+' */
+# define PLUS_FDRP		0x66647270UL	/* 'fdrp' */
+# define PLUS_MACS		0x4d414353UL	/* 'MACS' */
+
+# define DECMPFS_MAGIC		0x636d7066UL	/* 'cmpf' */
+# define DECMPFS_HDRSZ		16
+
+# define PLUS_VH_UNMOUNTED	0x00000100UL
+# define PLUS_VH_JOURNALED	0x00002000UL
+
+# define PLUS_COPYSZ		128	/* blocks moved per read and write */
+
+typedef int (*pluskeycmp)(const plustree *, const byte *, const byte *);
+
+/* Utility Routines ======================================================== */
+
+/*
+ * NAME:	getle32()
+ * DESCRIPTION:	marshal 4 little-endian bytes into local host format
+ */
+static
+unsigned long getle32(const byte *ptr)
+{
+  return
+    ((unsigned long) ptr[0] <<  0) |
+    ((unsigned long) ptr[1] <<  8) |
+    ((unsigned long) ptr[2] << 16) |
+    ((unsigned long) ptr[3] << 24);
+}
+
+/*
+ * NAME:	mactime()
+ * DESCRIPTION:	convert an HFS+ (GMT) date to an HFS (local time) date
+ */
+static
+unsigned long mactime(unsigned long gmt)
+{
+  if (gmt == 0)
+    return 0;
+
+  return d_mtime((time_t) gmt - (time_t) TIMEDIFF);
+}
+
+/*
+ * NAME:	getfork()
+ * DESCRIPTION:	unpack an HFSPlusForkData structure
+ */
+static
+void getfork(const byte *ptr, plusfork *fork)
+{
+  int i;
+
+  /* sizes beyond 4 GB cannot be represented by the rest of libhfs */
+
+  fork->lsize   = d_getul(ptr + 0) ? ~0UL : d_getul(ptr + 4);
+  fork->nblocks = d_getul(ptr + 12);
+
+  for (i = 0; i < 8; ++i)
+    {
+      fork->ext[i].start = d_getul(ptr + 16 + i * 8);
+      fork->ext[i].count = d_getul(ptr + 20 + i * 8);
+    }
+}
+
+/*
+ * NAME:	getname()
+ * DESCRIPTION:	unpack an HFSUniStr255 into host-order units; return length
+ */
+static
+unsigned int getname(const byte *ptr, UInteger *name)
+{
+  unsigned int len, i;
+
+  len = d_getuw(ptr);
+  if (len > HFSPLUS_MAX_FLEN)
+    len = HFSPLUS_MAX_FLEN;
+
+  for (i = 0; i < len; ++i)
+    name[i] = d_getuw(ptr + 2 + i * 2);
+
+  return len;
+}
+
+/* Low-Level Block and Fork Routines ======================================= */
+
+/*
+ * NAME:	readbytes()
+ * DESCRIPTION:	read an arbitrary byte range starting within a physical block
+ */
+static
+int readbytes(hfsvol *vol, unsigned long bnum, unsigned int offs,
+	      byte *buf, unsigned long len)
+{
+  block b;
+  unsigned long chunk;
+
+  if (offs)
+    {
+      chunk = HFS_BLOCKSZ - offs;
+      if (chunk > len)
+	chunk = len;
+
+      if (b_readpb(vol, bnum++, &b, 1) == -1)
+	goto fail;
+
+      memcpy(buf, b + offs, chunk);
+
+      buf += chunk;
+      len -= chunk;
+    }
+
+  chunk = len >> HFS_BLOCKSZ_BITS;
+  if (chunk)
+    {
+      if (b_readpb(vol, bnum, (block *) buf, chunk) == -1)
+	goto fail;
+
+      bnum += chunk;
+      buf  += chunk << HFS_BLOCKSZ_BITS;
+      len  -= chunk << HFS_BLOCKSZ_BITS;
+    }
+
+  if (len)
+    {
+      if (b_readpb(vol, bnum, &b, 1) == -1)
+	goto fail;
+
+      memcpy(buf, b, len);
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	writebytes()
+ * DESCRIPTION:	write an arbitrary byte range starting within a physical block
+ */
+static
+int writebytes(hfsvol *vol, unsigned long bnum, unsigned int offs,
+	       const byte *buf, unsigned long len)
+{
+  block b;
+  unsigned long chunk;
+
+  if (offs)
+    {
+      chunk = HFS_BLOCKSZ - offs;
+      if (chunk > len)
+	chunk = len;
+
+      if (b_readpb(vol, bnum, &b, 1) == -1)
+	goto fail;
+
+      memcpy(b + offs, buf, chunk);
+
+      if (b_writepb(vol, bnum++, &b, 1) == -1)
+	goto fail;
+
+      buf += chunk;
+      len -= chunk;
+    }
+
+  chunk = len >> HFS_BLOCKSZ_BITS;
+  if (chunk)
+    {
+      if (b_writepb(vol, bnum, (const block *) buf, chunk) == -1)
+	goto fail;
+
+      bnum += chunk;
+      buf  += chunk << HFS_BLOCKSZ_BITS;
+      len  -= chunk << HFS_BLOCKSZ_BITS;
+    }
+
+  if (len)
+    {
+      if (b_readpb(vol, bnum, &b, 1) == -1)
+	goto fail;
+
+      memcpy(b, buf, len);
+
+      if (b_writepb(vol, bnum, &b, 1) == -1)
+	goto fail;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+static
+int search(hfsvol *, plustree *, const byte *, pluskeycmp,
+	   unsigned long *, int *);
+static
+const byte *record(const plustree *, const byte *, int, const byte **);
+static
+int extcompare(const plustree *, const byte *, const byte *);
+
+/*
+ * NAME:	mapblock()
+ * DESCRIPTION:	translate a fork allocation block to a volume block and run
+ */
+static
+int mapblock(hfsvol *vol, unsigned long cnid, int forktype,
+	     const plusfork *fork, unsigned long fabn,
+	     unsigned long *vabn, unsigned long *run)
+{
+  plusvol *pv = vol->plus;
+  plusext over[8];
+  const plusext *ext = fork->ext;
+  unsigned long base = 0;
+  int i;
+
+  while (1)
+    {
+      for (i = 0; i < 8 && ext[i].count; ++i)
+	{
+	  if (fabn < base + ext[i].count)
+	    {
+	      *vabn = ext[i].start + (fabn - base);
+	      *run  = ext[i].count - (fabn - base);
+
+	      return 0;
+	    }
+
+	  base += ext[i].count;
+	}
+
+      if (i < 8 || cnid == 0 || cnid == HFS_CNID_EXT ||
+	  pv->ext.root == 0)
+	break;
+
+      /* continue in the extents overflow file */
+
+      {
+	byte key[12];
+	const byte *ptr, *data;
+	unsigned long nnum;
+	int rnum;
+
+	d_putuw(key + 0, 10);
+	key[2] = forktype;
+	key[3] = 0;
+	d_putul(key + 4, cnid);
+	d_putul(key + 8, fabn);
+
+	if (search(vol, &pv->ext, key, extcompare, &nnum, &rnum) == -1)
+	  goto fail;
+
+	ptr = record(&pv->ext, pv->ext.node, rnum, &data);
+	if (ptr == 0 ||
+	    d_getul(ptr + 4) != cnid || ptr[2] != forktype ||
+	    d_getul(ptr + 8) != base)
+	  break;
+
+	for (i = 0; i < 8; ++i)
+	  {
+	    over[i].start = d_getul(data + i * 8);
+	    over[i].count = d_getul(data + 4 + i * 8);
+	  }
+
+	ext = over;
+      }
+    }
+
+  ERROR(EIO, "HFS+ fork block not mapped by extents");
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	readfork()
+ * DESCRIPTION:	read bytes from an HFS+ fork
+ */
+static
+int readfork(hfsvol *vol, unsigned long cnid, int forktype,
+	     const plusfork *fork, unsigned long offset,
+	     void *buf, unsigned long len)
+{
+  plusvol *pv = vol->plus;
+  byte *ptr = buf;
+
+  while (len)
+    {
+      unsigned long vabn, run, offs, chunk, bnum;
+
+      if (mapblock(vol, cnid, forktype, fork,
+		   offset / pv->blocksz, &vabn, &run) == -1)
+	goto fail;
+
+      offs  = offset % pv->blocksz;
+      chunk = run * pv->blocksz - offs;
+      if (chunk > len)
+	chunk = len;
+
+      bnum = vol->vstart + vabn * (pv->blocksz >> HFS_BLOCKSZ_BITS) +
+	(offs >> HFS_BLOCKSZ_BITS);
+
+      if (readbytes(vol, bnum, offs & (HFS_BLOCKSZ - 1), ptr, chunk) == -1)
+	goto fail;
+
+      ptr    += chunk;
+      offset += chunk;
+      len    -= chunk;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	writefork()
+ * DESCRIPTION:	write bytes to an HFS+ fork within its allocated blocks
+ */
+static
+int writefork(hfsvol *vol, unsigned long cnid, int forktype,
+	      const plusfork *fork, unsigned long offset,
+	      const void *buf, unsigned long len)
+{
+  plusvol *pv = vol->plus;
+  const byte *ptr = buf;
+
+  while (len)
+    {
+      unsigned long vabn, run, offs, chunk, bnum;
+
+      if (mapblock(vol, cnid, forktype, fork,
+		   offset / pv->blocksz, &vabn, &run) == -1)
+	goto fail;
+
+      offs  = offset % pv->blocksz;
+      chunk = run * pv->blocksz - offs;
+      if (chunk > len)
+	chunk = len;
+
+      bnum = vol->vstart + vabn * (pv->blocksz >> HFS_BLOCKSZ_BITS) +
+	(offs >> HFS_BLOCKSZ_BITS);
+
+      if (writebytes(vol, bnum, offs & (HFS_BLOCKSZ - 1), ptr, chunk) == -1)
+	goto fail;
+
+      ptr    += chunk;
+      offset += chunk;
+      len    -= chunk;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/* B*-tree Routines ======================================================== */
+
+/*
+ * NAME:	getnode()
+ * DESCRIPTION:	return a (cached) B*-tree node, reading it if necessary
+ */
+static
+const byte *getnode(hfsvol *vol, plustree *tree, unsigned long nnum)
+{
+  plusnode *slot = &tree->cache[0];
+  unsigned int nrecs;
+  int i;
+
+  for (i = 0; i < HFSPLUS_NODECACHE; ++i)
+    {
+      plusnode *np = &tree->cache[i];
+
+      if (np->nnum == nnum && np->data)
+	{
+	  np->lru = ++tree->tick;
+	  return np->data;
+	}
+
+      if (np->lru < slot->lru)
+	slot = np;
+    }
+
+  /* replace the least recently used node */
+
+  if (slot->data == 0)
+    {
+      slot->data = ALLOC(byte, tree->nodesz);
+      if (slot->data == 0)
+	ERROR(ENOMEM, 0);
+    }
+
+  slot->nnum = 0;
+
+  if (nnum == 0 ||
+      readfork(vol, tree->cnid, 0, &tree->fork,
+	       nnum * tree->nodesz, slot->data, tree->nodesz) == -1)
+    goto fail;
+
+  nrecs = d_getuw(slot->data + 10);
+  if (14 + 2 * (nrecs + 1) > tree->nodesz)
+    ERROR(EIO, "bad HFS+ B*-tree node");
+
+  slot->nnum = nnum;
+  slot->lru  = ++tree->tick;
+
+  return slot->data;
+
+fail:
+  return 0;
+}
+
+/*
+ * NAME:	freenodes()
+ * DESCRIPTION:	release a B*-tree's node cache
+ */
+static
+void freenodes(plustree *tree)
+{
+  int i;
+
+  for (i = 0; i < HFSPLUS_NODECACHE; ++i)
+    {
+      FREE(tree->cache[i].data);
+
+      tree->cache[i].data = 0;
+      tree->cache[i].nnum = 0;
+    }
+
+  tree->node = 0;
+  tree->hint = 0;
+}
+
+/*
+ * NAME:	record()
+ * DESCRIPTION:	locate a record (key) and its data within a node
+ */
+static
+const byte *record(const plustree *tree, const byte *node, int rnum,
+		   const byte **data)
+{
+  unsigned int offs, klen;
+
+  if (rnum < 0 || rnum >= (int) d_getuw(node + 10))
+    return 0;
+
+  offs = d_getuw(node + tree->nodesz - 2 * (rnum + 1));
+  if (offs < 14 || offs + 2 > tree->nodesz)
+    return 0;
+
+  klen = d_getuw(node + offs);
+  if (offs + 2 + klen > tree->nodesz)
+    return 0;
+
+  if (data)
+    *data = node + offs + 2 + klen;
+
+  return node + offs;
+}
+
+/*
+ * NAME:	locate()
+ * DESCRIPTION:	binary search a node for the greatest key not above key
+ */
+static
+int locate(const plustree *tree, const byte *node, const byte *key,
+	   pluskeycmp compare, int *found)
+{
+  const byte *ptr;
+  int lo, hi, mid, cmp;
+
+  lo = 0;
+  hi = d_getuw(node + 10) - 1;
+
+  mid    = -1;
+  *found = 0;
+
+  while (lo <= hi)
+    {
+      int i = (lo + hi) / 2;
+
+      ptr = record(tree, node, i, 0);
+      if (ptr == 0)
+	ERROR(EIO, "bad HFS+ B*-tree record");
+
+      cmp = compare(tree, ptr, key);
+      if (cmp <= 0)
+	{
+	  mid    = i;
+	  *found = (cmp == 0);
+	  lo     = i + 1;
+	}
+      else
+	hi = i - 1;
+    }
+
+  return mid;
+
+fail:
+  return -2;
+}
+
+/*
+ * NAME:	search()
+ * DESCRIPTION:	find the leaf record with the greatest key not above key
+ */
+static
+int search(hfsvol *vol, plustree *tree, const byte *key, pluskeycmp compare,
+	   unsigned long *nnum, int *rnum)
+{
+  unsigned long n = tree->root;
+  unsigned int depth = 0;
+  const byte *node, *ptr, *data;
+  int mid, found;
+
+  *nnum = 0;
+  *rnum = -1;
+
+  if (n == 0)
+    return 0;
+
+  /* lookups tend to cluster; try the leaf of the previous search first */
+
+  if (tree->hint)
+    {
+      unsigned int nrecs;
+
+      node = getnode(vol, tree, tree->hint);
+      if (node == 0)
+	goto fail;
+
+      nrecs = d_getuw(node + 10);
+
+      if ((signed char) node[8] == PLUS_LEAFNODE && nrecs > 0 &&
+	  (ptr = record(tree, node, 0, 0)) &&
+	  compare(tree, ptr, key) <= 0 &&
+	  (ptr = record(tree, node, nrecs - 1, 0)) &&
+	  compare(tree, ptr, key) >= 0)
+	{
+	  mid = locate(tree, node, key, compare, &found);
+	  if (mid == -2)
+	    goto fail;
+
+	  tree->node = node;
+
+	  *nnum = tree->hint;
+	  *rnum = mid;
+
+	  return found;
+	}
+    }
+
+  while (1)
+    {
+      node = getnode(vol, tree, n);
+      if (node == 0)
+	goto fail;
+
+      mid = locate(tree, node, key, compare, &found);
+      if (mid == -2)
+	goto fail;
+
+      switch ((signed char) node[8])
+	{
+	case PLUS_LEAFNODE:
+	  tree->node = node;
+	  tree->hint = n;
+
+	  *nnum = n;
+	  *rnum = mid;
+
+	  return found;
+
+	case PLUS_INDEXNODE:
+	  break;
+
+	default:
+	  ERROR(EIO, "unexpected HFS+ B*-tree node type");
+	}
+
+      if (++depth > tree->depth + 1 || depth > 16)
+	ERROR(EIO, "HFS+ B*-tree is corrupt");
+
+      ptr = record(tree, node, mid < 0 ? 0 : mid, &data);
+      if (ptr == 0 || data + 4 > node + tree->nodesz)
+	ERROR(EIO, "bad HFS+ B*-tree index record");
+
+      n = d_getul(data);
+    }
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	nextrec()
+ * DESCRIPTION:	step to the following leaf record; return 0 at the end
+ */
+static
+int nextrec(hfsvol *vol, plustree *tree, unsigned long *nnum, int *rnum,
+	    const byte **node)
+{
+  const byte *np;
+
+  np = getnode(vol, tree, *nnum);
+  if (np == 0)
+    goto fail;
+
+  ++*rnum;
+
+  while (*rnum >= (int) d_getuw(np + 10))
+    {
+      *nnum = d_getul(np + 0);
+      *rnum = 0;
+
+      if (*nnum == 0)
+	return 0;
+
+      np = getnode(vol, tree, *nnum);
+      if (np == 0)
+	goto fail;
+
+      if ((signed char) np[8] != PLUS_LEAFNODE)
+	ERROR(EIO, "bad HFS+ B*-tree leaf chain");
+    }
+
+  *node = np;
+
+  return 1;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	opentree()
+ * DESCRIPTION:	read the header of one of the special B*-tree files
+ */
+static
+int opentree(hfsvol *vol, plustree *tree, unsigned long cnid,
+	     const byte *forkdata)
+{
+  byte hdr[HFS_BLOCKSZ];
+
+  memset(tree, 0, sizeof(plustree));
+
+  tree->cnid = cnid;
+
+  getfork(forkdata, &tree->fork);
+
+  if (tree->fork.lsize == 0)
+    return 0;  /* e.g. no attributes file */
+
+  tree->nodesz = HFS_BLOCKSZ;
+
+  if (readfork(vol, cnid, 0, &tree->fork, 0, hdr, HFS_BLOCKSZ) == -1)
+    goto fail;
+
+  if (hdr[8] != 1)
+    ERROR(EIO, "bad HFS+ B*-tree header node");
+
+  tree->depth  = d_getuw(hdr + 14 +  0);
+  tree->root   = d_getul(hdr + 14 +  2);
+  tree->nodesz = d_getuw(hdr + 14 + 18);
+  tree->keycmp = hdr[14 + 37];
+
+  if (tree->nodesz < HFS_BLOCKSZ || tree->nodesz > HFSPLUS_NODESZ_MAX ||
+      (tree->nodesz & (tree->nodesz - 1)))
+    ERROR(EIO, "bad HFS+ B*-tree node size");
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/* Key Comparison Routines ================================================= */
+
+/*
+ * NAME:	extcompare()
+ * DESCRIPTION:	compare extents overflow keys (file, fork, start block)
+ */
+static
+int extcompare(const plustree *tree, const byte *key1, const byte *key2)
+{
+  unsigned long v1, v2;
+
+  v1 = d_getul(key1 + 4);
+  v2 = d_getul(key2 + 4);
+  if (v1 != v2)
+    return (v1 < v2) ? -1 : 1;
+
+  if (key1[2] != key2[2])
+    return (key1[2] < key2[2]) ? -1 : 1;
+
+  v1 = d_getul(key1 + 8);
+  v2 = d_getul(key2 + 8);
+  if (v1 != v2)
+    return (v1 < v2) ? -1 : 1;
+
+  return 0;
+}
+
+/*
+ * NAME:	catcompare()
+ * DESCRIPTION:	compare catalog keys (parent ID, Unicode name)
+ */
+static
+int catcompare(const plustree *tree, const byte *key1, const byte *key2)
+{
+  unsigned long id1, id2;
+  unsigned int len;
+
+  /* the names are compared as stored, without unpacking them */
+
+  if (key2 != tree->foldfor)
+    return hfsplus_catkey_compare(key1, key2, tree->keycmp);
+
+  /* the search key was folded once by findrec(); fold only the node key */
+
+  id1 = d_getul(key1 + 2);
+  id2 = d_getul(key2 + 2);
+  if (id1 != id2)
+    return (id1 < id2) ? -1 : 1;
+
+  len = d_getuw(key1 + 6);
+  if (len > HFSPLUS_MAX_FLEN)
+    len = HFSPLUS_MAX_FLEN;
+
+  return -hfsplus_unicode_compare_foldkey(&tree->fold,
+					  (const uint16_t *) (key1 + 8), len);
+}
+
+/*
+ * NAME:	attrcompare()
+ * DESCRIPTION:	compare attribute keys (file ID, name, start block)
+ */
+static
+int attrcompare(const plustree *tree, const byte *key1, const byte *key2)
+{
+  UInteger name1[HFSPLUS_MAX_FLEN], name2[HFSPLUS_MAX_FLEN];
+  unsigned long v1, v2;
+  int cmp;
+
+  v1 = d_getul(key1 + 4);
+  v2 = d_getul(key2 + 4);
+  if (v1 != v2)
+    return (v1 < v2) ? -1 : 1;
+
+  cmp = u_binary(name1, getname(key1 + 12, name1),
+		 name2, getname(key2 + 12, name2));
+  if (cmp)
+    return cmp;
+
+  v1 = d_getul(key1 + 8);
+  v2 = d_getul(key2 + 8);
+  if (v1 != v2)
+    return (v1 < v2) ? -1 : 1;
+
+  return 0;
+}
+
+/* Catalog Routines ======================================================== */
+
+/*
+ * NAME:	makekey()
+ * DESCRIPTION:	construct a catalog key from a parent ID and Unicode name
+ */
+static
+void makekey(byte *key, unsigned long parid,
+	     const UInteger *name, unsigned int len)
+{
+  unsigned int i;
+
+  d_putuw(key + 0, 6 + 2 * len);
+  d_putul(key + 2, parid);
+  d_putuw(key + 6, len);
+
+  for (i = 0; i < len; ++i)
+    d_putuw(key + 8 + 2 * i, name[i]);
+}
+
+/*
+ * NAME:	unpackrec()
+ * DESCRIPTION:	unpack a folder or file catalog record
+ */
+static
+int unpackrec(const byte *key, const byte *data, unsigned int len,
+	      plusrec *rec)
+{
+  rec->type  = d_getsw(data + 0);
+  rec->parid = d_getul(key + 2);
+
+  switch (rec->type)
+    {
+    case PLUS_FOLDER:
+      if (len < 88)
+	ERROR(EIO, "short HFS+ folder record");
+
+      rec->valence = d_getul(data + 4);
+      break;
+
+    case PLUS_FILE:
+      if (len < 248)
+	ERROR(EIO, "short HFS+ file record");
+
+      rec->valence = 0;
+
+      getfork(data +  88, &rec->data);
+      getfork(data + 168, &rec->rsrc);
+      break;
+
+    default:
+      ERROR(EIO, "unexpected HFS+ catalog record");
+    }
+
+  rec->flags      = d_getuw(data + 2);
+  rec->cnid       = d_getul(data + 8);
+  rec->crdate     = d_getul(data + 12);
+  rec->mddate     = d_getul(data + 16);
+  rec->bkdate     = d_getul(data + 28);
+  rec->ownerflags = data[41];
+  rec->special    = d_getul(data + 44);
+
+  memcpy(rec->finfo, data + 48, 32);
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+static
+int catlookup(hfsvol *, unsigned long, const char *, plusrec *, char *);
+
+/*
+ * NAME:	linkname()
+ * DESCRIPTION:	construct the name of a hard link target (e.g. "iNode123")
+ */
+static
+void linkname(char *name, const char *prefix, unsigned long num)
+{
+  char digits[12], *ptr = digits + sizeof(digits);
+
+  *--ptr = 0;
+
+  do
+    *--ptr = '0' + num % 10;
+  while (num /= 10);
+
+  strcpy(name, prefix);
+  strcat(name, ptr);
+}
+
+/*
+ * NAME:	resolvelink()
+ * DESCRIPTION:	replace a hard link record with the record of its target
+ */
+static
+int resolvelink(hfsvol *vol, plusrec *rec)
+{
+  plusvol *pv = vol->plus;
+  unsigned long type, creator, privdir, parid;
+  const char *prefix;
+  pluslink *link;
+  char name[32];
+  int found;
+
+  if (rec->type != PLUS_FILE)
+    return 0;
+
+  type    = d_getul(rec->finfo + 0);
+  creator = d_getul(rec->finfo + 4);
+
+  if (type == PLUS_HLNK && creator == PLUS_HFSP)
+    {
+      privdir = pv->fileprivdir;
+      prefix  = "iNode";
+    }
+  else if (type == PLUS_FDRP && creator == PLUS_MACS)
+    {
+      privdir = pv->dirprivdir;
+      prefix  = "dir_";
+    }
+  else
+    return 0;
+
+  if (privdir == 0 || rec->parid == privdir)
+    return 0;
+
+  if (pv->links == 0)
+    {
+      pv->links = ALLOC(pluslink, HFSPLUS_LINKCACHE);
+      if (pv->links == 0)
+	ERROR(ENOMEM, 0);
+
+      memset(pv->links, 0, HFSPLUS_LINKCACHE * sizeof(pluslink));
+    }
+
+  /* every link to an inode shares one slot, so a tree of links is cheap */
+
+  link = &pv->links[rec->special % HFSPLUS_LINKCACHE];
+
+  if (link->inode != rec->special || link->rec.parid != privdir)
+    {
+      link->inode = 0;
+
+      linkname(name, prefix, rec->special);
+
+      found = catlookup(vol, privdir, name, &link->rec, 0);
+      if (found == -1)
+	goto fail;
+      else if (! found)
+	return 0;  /* dangling link; show the link record itself */
+
+      link->inode = rec->special;
+    }
+
+  parid = rec->parid;
+
+  *rec = link->rec;
+  rec->parid = parid;
+
+  return 1;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	findrec()
+ * DESCRIPTION:	search the catalog for a folder or file record
+ */
+static
+int findrec(hfsvol *vol, const byte *key, plusrec *rec, char *cname)
+{
+  plustree *cat = &vol->plus->cat;
+  const byte *ptr, *data;
+  unsigned long nnum;
+  int rnum, found;
+
+  /* the name is compared against every key on the way down; fold it once */
+
+  if (cat->keycmp != HFSPLUS_KEY_BINARY)
+    {
+      hfsplus_unicode_foldkey(&cat->fold, (const uint16_t *) (key + 8),
+			      d_getuw(key + 6));
+      cat->foldfor = key;
+    }
+
+  found = search(vol, cat, key, catcompare, &nnum, &rnum);
+  cat->foldfor = 0;
+  if (found <= 0)
+    return found;
+
+  ptr = record(cat, cat->node, rnum, &data);
+
+  if (unpackrec(ptr, data, cat->node + cat->nodesz - data, rec) == -1)
+    return -1;
+
+  if (cname)
+    {
+      UInteger name[HFSPLUS_MAX_FLEN];
+
+      if (rec->cnid == HFS_CNID_ROOTDIR)
+	strcpy(cname, vol->mdb.drVN);
+      else
+	u_toname(cname, name, getname(ptr + 6, name));
+    }
+
+  if (resolvelink(vol, rec) == -1)
+    return -1;
+
+  return 1;
+}
+
+/*
+ * NAME:	getthread()
+ * DESCRIPTION:	find the thread record of a CNID; return its type and key
+ */
+static
+int getthread(hfsvol *vol, unsigned long cnid, int *type,
+	      unsigned long *parid, UInteger *name, unsigned int *len)
+{
+  plustree *cat = &vol->plus->cat;
+  byte key[8];
+  const byte *data;
+  unsigned long nnum;
+  int rnum, found;
+
+  makekey(key, cnid, 0, 0);
+
+  found = search(vol, cat, key, catcompare, &nnum, &rnum);
+  if (found <= 0)
+    {
+      if (found == 0)
+	{
+	  hfs_error = 0;
+	  errno = ENOENT;
+	}
+
+      return found;
+    }
+
+  record(cat, cat->node, rnum, &data);
+  if (data + 8 > cat->node + cat->nodesz)
+    ERROR(EIO, "short HFS+ thread record");
+
+  *type = d_getsw(data);
+  if (*type != PLUS_FOLDERTHREAD && *type != PLUS_FILETHREAD)
+    ERROR(EIO, "bad HFS+ thread record");
+
+  *parid = d_getul(data + 4);
+
+  if (name)
+    *len = getname(data + 8, name);
+
+  return 1;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	getrec()
+ * DESCRIPTION:	find the folder or file record of a CNID by way of its thread
+ */
+static
+int getrec(hfsvol *vol, unsigned long cnid, plusrec *rec,
+	   unsigned long *parid, char *cname)
+{
+  UInteger name[HFSPLUS_MAX_FLEN];
+  byte key[8 + 2 * HFSPLUS_MAX_FLEN];
+  unsigned long id;
+  unsigned int len;
+  int found, type;
+
+  found = getthread(vol, cnid, &type, &id, name, &len);
+  if (found <= 0)
+    return found;
+
+  if (parid)
+    *parid = id;
+
+  makekey(key, id, name, len);
+
+  found = findrec(vol, key, rec, cname);
+  if (found == 0)
+    ERROR(EIO, "HFS+ thread record has no catalog record");
+
+  return found;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	catlookup()
+ * DESCRIPTION:	find a catalog record by parent ID and MacOS Roman name
+ */
+static
+int catlookup(hfsvol *vol, unsigned long parid, const char *name,
+	      plusrec *rec, char *cname)
+{
+  UInteger uname[HFSPLUS_MAX_FLEN];
+  byte key[8 + 2 * HFSPLUS_MAX_FLEN];
+  unsigned int len;
+  int found = 0;
+
+  /* the root folder is named after the (possibly truncated) volume name */
+
+  if (parid == HFS_CNID_ROOTPAR)
+    {
+      if (d_relstring(name, vol->mdb.drVN) != 0)
+	ERROR(ENOENT, 0);
+
+      return getrec(vol, HFS_CNID_ROOTDIR, rec, 0, cname);
+    }
+
+  len = u_fromname(uname, name, HFSPLUS_MAX_FLEN);
+  if (len > HFSPLUS_MAX_FLEN)
+    ERROR(ENOENT, 0);
+
+  makekey(key, parid, uname, len);
+
+  found = findrec(vol, key, rec, cname);
+  if (found == 0)
+    ERROR(ENOENT, 0);
+
+fail:
+  return found;
+}
+
+/* Attribute Routines ====================================================== */
+
+/*
+ * NAME:	getattr()
+ * DESCRIPTION:	read (up to *len bytes of) an extended attribute
+ */
+static
+int getattr(hfsvol *vol, unsigned long cnid, const char *name,
+	    byte *buf, unsigned long *len)
+{
+  plustree *attr = &vol->plus->attr;
+  UInteger uname[HFSPLUS_MAX_FLEN];
+  byte key[14 + 2 * HFSPLUS_MAX_FLEN];
+  const byte *data, *end;
+  unsigned long nnum, size;
+  unsigned int ulen, i;
+  int rnum, found;
+
+  if (attr->root == 0)
+    return 0;
+
+  ulen = u_fromname(uname, name, HFSPLUS_MAX_FLEN);
+  if (ulen > HFSPLUS_MAX_FLEN)
+    return 0;
+
+  d_putuw(key +  0, 12 + 2 * ulen);
+  d_putuw(key +  2, 0);
+  d_putul(key +  4, cnid);
+  d_putul(key +  8, 0);
+  d_putuw(key + 12, ulen);
+
+  for (i = 0; i < ulen; ++i)
+    d_putuw(key + 14 + 2 * i, uname[i]);
+
+  found = search(vol, attr, key, attrcompare, &nnum, &rnum);
+  if (found <= 0)
+    return found;
+
+  if (record(attr, attr->node, rnum, &data) == 0)
+    ERROR(EIO, "bad HFS+ B*-tree record");
+
+  end = attr->node + attr->nodesz;
+
+  if (data + 16 > end)
+    ERROR(EIO, "short HFS+ attribute record");
+
+  switch (d_getul(data))
+    {
+    case PLUS_ATTR_INLINE:
+      size = d_getul(data + 12);
+      if (data + 16 + size > end)
+	ERROR(EIO, "bad HFS+ inline attribute size");
+
+      if (buf)
+	memcpy(buf, data + 16, (size < *len) ? size : *len);
+      break;
+
+    case PLUS_ATTR_FORK:
+      {
+	plusfork fork;
+
+	if (data + 88 > end)
+	  ERROR(EIO, "short HFS+ attribute fork record");
+
+	getfork(data + 8, &fork);
+	size = fork.lsize;
+
+	if (readfork(vol, 0, 0, &fork, 0, buf,
+		     (size < *len) ? size : *len) == -1)
+	  goto fail;
+      }
+      break;
+
+    default:
+      ERROR(EIO, "unexpected HFS+ attribute record");
+    }
+
+  *len = size;
+
+  return 1;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	getcomp()
+ * DESCRIPTION:	read the decmpfs header of a compressed file
+ */
+static
+int getcomp(hfsvol *vol, unsigned long cnid,
+	    unsigned long *type, unsigned long *size)
+{
+  byte hdr[DECMPFS_HDRSZ];
+  unsigned long len = DECMPFS_HDRSZ;
+  int found;
+
+  found = getattr(vol, cnid, "com.apple.decmpfs", hdr, &len);
+  if (found <= 0)
+    return found;
+
+  if (len < DECMPFS_HDRSZ || getle32(hdr) != DECMPFS_MAGIC)
+    ERROR(EIO, "bad HFS+ compression header");
+
+  *type = getle32(hdr + 4);
+  *size = getle32(hdr + 12) ? ~0UL : getle32(hdr + 8);
+
+  return 1;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	catdata()
+ * DESCRIPTION:	present an HFS+ catalog record as an HFS catalog record
+ */
+static
+int catdata(hfsvol *vol, const plusrec *rec, CatDataRec *data)
+{
+  const byte *fi = rec->finfo;
+  unsigned long blocksz = vol->plus->blocksz;
+
+  memset(data, 0, sizeof(CatDataRec));
+
+  if (rec->type == PLUS_FOLDER)
+    {
+      data->cdrType = cdrDirRec;
+
+      data->u.dir.dirVal   = (rec->valence > 0xffff) ? 0xffff : rec->valence;
+      data->u.dir.dirDirID = rec->cnid;
+
+      data->u.dir.dirCrDat = mactime(rec->crdate);
+      data->u.dir.dirMdDat = mactime(rec->mddate);
+      data->u.dir.dirBkDat = mactime(rec->bkdate);
+
+      data->u.dir.dirUsrInfo.frRect.top      = d_getsw(fi +  0);
+      data->u.dir.dirUsrInfo.frRect.left     = d_getsw(fi +  2);
+      data->u.dir.dirUsrInfo.frRect.bottom   = d_getsw(fi +  4);
+      data->u.dir.dirUsrInfo.frRect.right    = d_getsw(fi +  6);
+      data->u.dir.dirUsrInfo.frFlags         = d_getsw(fi +  8);
+      data->u.dir.dirUsrInfo.frLocation.v    = d_getsw(fi + 10);
+      data->u.dir.dirUsrInfo.frLocation.h    = d_getsw(fi + 12);
+      data->u.dir.dirUsrInfo.frView          = d_getsw(fi + 14);
+
+      data->u.dir.dirFndrInfo.frScroll.v     = d_getsw(fi + 16);
+      data->u.dir.dirFndrInfo.frScroll.h     = d_getsw(fi + 18);
+      data->u.dir.dirFndrInfo.frOpenChain    = d_getsl(fi + 20);
+      data->u.dir.dirFndrInfo.frUnused       = d_getsw(fi + 24);
+      data->u.dir.dirFndrInfo.frComment      = d_getsw(fi + 26);
+      data->u.dir.dirFndrInfo.frPutAway      = d_getsl(fi + 28);
+
+      return 0;
+    }
+
+  data->cdrType = cdrFilRec;
+
+  data->u.fil.filFlags = (rec->flags & 0x0001) ? (1 << 0) : 0;
+
+  data->u.fil.filUsrWds.fdType       = d_getsl(fi +  0);
+  data->u.fil.filUsrWds.fdCreator    = d_getsl(fi +  4);
+  data->u.fil.filUsrWds.fdFlags      = d_getsw(fi +  8);
+  data->u.fil.filUsrWds.fdLocation.v = d_getsw(fi + 10);
+  data->u.fil.filUsrWds.fdLocation.h = d_getsw(fi + 12);
+  data->u.fil.filUsrWds.fdFldr       = d_getsw(fi + 14);
+
+  data->u.fil.filFlNum  = rec->cnid;
+
+  data->u.fil.filLgLen  = rec->data.lsize;
+  data->u.fil.filPyLen  = rec->data.nblocks * blocksz;
+  data->u.fil.filRLgLen = rec->rsrc.lsize;
+  data->u.fil.filRPyLen = rec->rsrc.nblocks * blocksz;
+
+  data->u.fil.filCrDat  = mactime(rec->crdate);
+  data->u.fil.filMdDat  = mactime(rec->mddate);
+  data->u.fil.filBkDat  = mactime(rec->bkdate);
+
+  data->u.fil.filFndrInfo.fdIconID  = d_getsw(fi + 16);
+  data->u.fil.filFndrInfo.fdComment = d_getsw(fi + 26);
+  data->u.fil.filFndrInfo.fdPutAway = d_getsl(fi + 28);
+
+  /* compressed files show their decompressed data and no resource fork */
+
+  if (rec->ownerflags & PLUS_UF_COMPRESSED)
+    {
+      unsigned long type, size;
+      int found;
+
+      found = getcomp(vol, rec->cnid, &type, &size);
+      if (found == -1)
+	return -1;
+
+      if (found)
+	{
+	  data->u.fil.filLgLen  = size;
+	  data->u.fil.filPyLen  = size;
+	  data->u.fil.filRLgLen = 0;
+	  data->u.fil.filRPyLen = 0;
+	}
+    }
+
+  return 0;
+}
+
+/* Volume Routines ========================================================= */
+
+/*
+ * NAME:	privdir()
+ * DESCRIPTION:	find the CNID of a private hard link folder (0 if none)
+ */
+static
+int privdir(hfsvol *vol, const char *name, unsigned int nuls,
+	    unsigned long *cnid)
+{
+  UInteger uname[HFSPLUS_MAX_FLEN];
+  byte key[8 + 2 * HFSPLUS_MAX_FLEN];
+  plusrec rec;
+  unsigned int len;
+  int found;
+
+  for (len = 0; len < nuls; ++len)
+    uname[len] = 0;
+
+  while (*name)
+    uname[len++] = (unsigned char) *name++;
+
+  makekey(key, HFS_CNID_ROOTDIR, uname, len);
+
+  found = findrec(vol, key, &rec, 0);
+  if (found == -1)
+    return -1;
+
+  *cnid = (found && rec.type == PLUS_FOLDER) ? rec.cnid : 0;
+
+  return 0;
+}
+
+/*
+ * NAME:	plus->mount()
+ * DESCRIPTION:	load HFS+ volume information into memory
+ */
+int p_mount(hfsvol *vol)
+{
+  plusvol *pv;
+  block vh;
+  UInteger name[HFSPLUS_MAX_FLEN];
+  char vname[HFSPLUS_MAX_NLEN + 1];
+  unsigned long parid;
+  unsigned int len;
+  int type, found;
+
+  pv = ALLOC(plusvol, 1);
+  if (pv == 0)
+    ERROR(ENOMEM, 0);
+
+  memset(pv, 0, sizeof(plusvol));
+  vol->plus = pv;
+
+  if (b_readlb(vol, 2, &vh) == -1)
+    goto fail;
+
+  pv->blocksz    = d_getul(vh + 40);
+  pv->totblocks  = d_getul(vh + 44);
+  pv->freeblocks = d_getul(vh + 48);
+  pv->clumpsz    = d_getul(vh + 60);
+
+  pv->files      = d_getul(vh + 32);
+  pv->dirs       = d_getul(vh + 36);
+
+  pv->crdate     = d_getul(vh + 16);
+  pv->mddate     = d_getul(vh + 20);
+  pv->bkdate     = d_getul(vh + 24);
+
+  pv->blessed    = d_getul(vh + 80);
+
+  if (pv->blocksz < HFS_BLOCKSZ || (pv->blocksz & (pv->blocksz - 1)))
+    ERROR(EINVAL, "bad HFS+ allocation block size");
+
+  if (opentree(vol, &pv->ext,  HFS_CNID_EXT, vh + 192) == -1 ||
+      opentree(vol, &pv->cat,  HFS_CNID_CAT, vh + 272) == -1 ||
+      opentree(vol, &pv->attr, 8,            vh + 352) == -1)
+    goto fail;
+
+  if (pv->cat.root == 0)
+    ERROR(EIO, "HFS+ catalog is empty");
+
+  /* present enough of an MDB for the rest of the library */
+
+  memset(&vol->mdb, 0, sizeof(MDB));
+
+  vol->mdb.drSigWord  = d_getsw(vh + 0);
+  vol->mdb.drAlBlkSiz = pv->blocksz;
+  vol->mdb.drClpSiz   = pv->clumpsz;
+  vol->mdb.drAtrb     = HFS_ATRB_HLOCKED;
+
+  vol->lpa = pv->blocksz >> HFS_BLOCKSZ_BITS;
+
+  found = getthread(vol, HFS_CNID_ROOTDIR, &type, &parid, name, &len);
+  if (found == -1)
+    goto fail;
+  else if (! found || type != PLUS_FOLDERTHREAD)
+    ERROR(EIO, "HFS+ root folder thread not found");
+
+  u_toname(vname, name, len);
+
+  strncpy(vol->mdb.drVN, vname, HFS_MAX_VLEN);
+  vol->mdb.drVN[HFS_MAX_VLEN] = 0;
+
+  /* hard link targets live in two folders hidden from directory listings */
+
+  if (privdir(vol, "HFS+ Private Data", 4, &pv->fileprivdir) == -1 ||
+      privdir(vol, ".HFS+ Private Directory Data\r", 0,
+	      &pv->dirprivdir) == -1)
+    goto fail;
+
+  vol->flags |= HFS_VOL_READONLY | HFS_VOL_MOUNTED;
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->umount()
+ * DESCRIPTION:	release HFS+ volume information
+ */
+void p_umount(hfsvol *vol)
+{
+  plusvol *pv = vol->plus;
+
+  if (pv == 0)
+    return;
+
+  freenodes(&pv->ext);
+  freenodes(&pv->cat);
+  freenodes(&pv->attr);
+
+  FREE(pv->links);
+  FREE(pv);
+
+  vol->plus = 0;
+}
+
+/*
+ * NAME:	plus->vstat()
+ * DESCRIPTION:	return HFS+ volume statistics
+ */
+int p_vstat(hfsvol *vol, hfsvolent *ent)
+{
+  plusvol *pv = vol->plus;
+
+  strcpy(ent->name, vol->mdb.drVN);
+
+  ent->flags     = HFS_ISLOCKED;
+
+  ent->totbytes  = pv->totblocks  * pv->blocksz;
+  ent->freebytes = pv->freeblocks * pv->blocksz;
+
+  ent->alblocksz = pv->blocksz;
+  ent->clumpsz   = pv->clumpsz;
+
+  ent->numfiles  = pv->files;
+  ent->numdirs   = pv->dirs;
+
+  ent->crdate    = d_ltime(pv->crdate);
+  ent->mddate    = d_ltime(mactime(pv->mddate));
+  ent->bkdate    = d_ltime(mactime(pv->bkdate));
+
+  ent->blessed   = pv->blessed;
+
+  return 0;
+}
+
+/* Catalog Interface ======================================================= */
+
+/*
+ * NAME:	plus->catsearch()
+ * DESCRIPTION:	search the HFS+ catalog by parent ID and name
+ */
+int p_catsearch(hfsvol *vol, unsigned long parid, const char *name,
+		CatDataRec *data, char *cname)
+{
+  plusvol *pv = vol->plus;
+  int found;
+
+  found = catlookup(vol, parid, name, &pv->last, cname);
+  if (found == 1 && data &&
+      catdata(vol, &pv->last, data) == -1)
+    return -1;
+
+  return found;
+}
+
+/*
+ * NAME:	plus->getthread()
+ * DESCRIPTION:	retrieve HFS+ thread information in HFS form
+ */
+int p_getthread(hfsvol *vol, unsigned long id, CatDataRec *thread, int type)
+{
+  UInteger name[HFSPLUS_MAX_FLEN];
+  char cname[HFSPLUS_MAX_NLEN + 1];
+  unsigned long parid;
+  unsigned int len;
+  int found, ptype;
+
+  found = getthread(vol, id, &ptype, &parid, name, &len);
+  if (found <= 0)
+    return found;
+
+  if (ptype != type)
+    ERROR(EIO, "bad thread record");
+
+  if (thread)
+    {
+      memset(thread, 0, sizeof(CatDataRec));
+
+      thread->cdrType = type;
+      u_toname(cname, name, len);
+
+      /* HFS thread names are limited; callers here only need the ID */
+
+      if (type == cdrThdRec)
+	{
+	  thread->u.dthd.thdParID = parid;
+	  strncpy(thread->u.dthd.thdCName, cname, HFS_MAX_FLEN);
+	}
+      else
+	{
+	  thread->u.fthd.fthdParID = parid;
+	  strncpy(thread->u.fthd.fthdCName, cname, HFS_MAX_FLEN);
+	}
+    }
+
+  return 1;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->resolve()
+ * DESCRIPTION:	translate a pathname relative to a directory ID
+ */
+int p_resolve(hfsvol *vol, unsigned long dirid, const char *path,
+	      CatDataRec *data, unsigned long *parid, char *fname)
+{
+  plusvol *pv = vol->plus;
+  char name[HFSPLUS_MAX_NLEN + 1], *nptr;
+  unsigned long id;
+  int found = 0, type;
+
+  while (1)
+    {
+      while (*path == ':')
+	{
+	  ++path;
+
+	  found = getthread(vol, dirid, &type, &id, 0, 0);
+	  if (found == -1)
+	    goto fail;
+	  else if (! found)
+	    goto done;
+
+	  dirid = id;
+	}
+
+      if (*path == 0)
+	{
+	  found = getrec(vol, dirid, &pv->last, parid, fname);
+	  if (found == -1)
+	    goto fail;
+
+	  goto done;
+	}
+
+      nptr = name;
+      while (nptr < name + sizeof(name) - 1 && *path && *path != ':')
+	*nptr++ = *path++;
+
+      if (*path && *path != ':')
+	ERROR(ENAMETOOLONG, 0);
+
+      *nptr = 0;
+      if (*path == ':')
+	++path;
+
+      if (parid)
+	*parid = dirid;
+
+      found = catlookup(vol, dirid, name, &pv->last, fname);
+      if (found == -1)
+	goto fail;
+
+      if (! found)
+	{
+	  if (*path && parid)
+	    *parid = 0;
+
+	  if (*path == 0 && fname)
+	    strcpy(fname, name);
+
+	  goto done;
+	}
+
+      if (*path == 0)
+	goto done;
+
+      if (pv->last.type != PLUS_FOLDER)
+	ERROR(ENOTDIR, "invalid pathname");
+
+      dirid = pv->last.cnid;
+    }
+
+done:
+  if (found == 1 && data &&
+      catdata(vol, &pv->last, data) == -1)
+    goto fail;
+
+  return found;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->dirinfo()
+ * DESCRIPTION:	given a directory ID, return its (name and) parent ID
+ */
+int p_dirinfo(hfsvol *vol, unsigned long *id, char *name)
+{
+  UInteger uname[HFSPLUS_MAX_FLEN];
+  unsigned long parid;
+  unsigned int len;
+  int found, type;
+
+  found = getthread(vol, *id, &type, &parid, uname, &len);
+  if (found == -1)
+    goto fail;
+  else if (! found)
+    ERROR(ENOENT, 0);
+  else if (type != PLUS_FOLDERTHREAD)
+    ERROR(ENOTDIR, 0);
+
+  if (name)
+    {
+      if (*id == HFS_CNID_ROOTDIR)
+	strcpy(name, vol->mdb.drVN);
+      else
+	u_toname(name, uname, len);
+    }
+
+  *id = parid;
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/* Attribute Interface ===================================================== */
+
+/*
+ * NAME:	plus->listattr()
+ * DESCRIPTION:	list the names of a catalog node's extended attributes
+ */
+long p_listattr(hfsvol *vol, unsigned long cnid, char *list, unsigned long size)
+{
+  plustree *attr = &vol->plus->attr;
+  UInteger uname[HFSPLUS_MAX_FLEN];
+  char name[HFSPLUS_MAX_NLEN + 1];
+  byte key[14];
+  const byte *node, *ptr, *data;
+  unsigned long nnum, total = 0, len;
+  int rnum, result;
+
+  if (attr->root == 0)
+    return 0;
+
+  d_putuw(key +  0, 12);
+  d_putuw(key +  2, 0);
+  d_putul(key +  4, cnid);
+  d_putul(key +  8, 0);
+  d_putuw(key + 12, 0);
+
+  /* one search, then a sequential walk of this file's records */
+
+  if (search(vol, attr, key, attrcompare, &nnum, &rnum) == -1)
+    goto fail;
+
+  while (nnum)
+    {
+      result = nextrec(vol, attr, &nnum, &rnum, &node);
+      if (result == -1)
+	goto fail;
+      else if (result == 0)
+	break;
+
+      ptr = record(attr, node, rnum, &data);
+      if (ptr == 0 || data + 4 > node + attr->nodesz)
+	ERROR(EIO, "bad HFS+ B*-tree record");
+
+      if (d_getul(ptr + 4) != cnid)
+	break;
+
+      if (d_getul(data) != PLUS_ATTR_INLINE &&
+	  d_getul(data) != PLUS_ATTR_FORK)
+	continue;  /* overflow extents */
+
+      u_toname(name, uname, getname(ptr + 12, uname));
+
+      /* compression is an implementation detail, as on Mac OS X */
+
+      if (strcmp(name, "com.apple.decmpfs") == 0)
+	continue;
+
+      len = strlen(name) + 1;
+
+      if (list && size)
+	{
+	  if (total + len > size)
+	    ERROR(ERANGE, "attribute list buffer too small");
+
+	  memcpy(list + total, name, len);
+	}
+
+      total += len;
+    }
+
+  return total;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->getattr()
+ * DESCRIPTION:	read the value of an extended attribute
+ */
+long p_getattr(hfsvol *vol, unsigned long cnid, const char *name,
+	       void *buf, unsigned long size)
+{
+  unsigned long len = (buf && size) ? size : 0;
+  int found;
+
+  found = getattr(vol, cnid, name, len ? buf : 0, &len);
+  if (found == -1)
+    goto fail;
+  else if (! found)
+    ERROR(ENOENT, "no such attribute");
+
+  if (buf && size && len > size)
+    ERROR(ERANGE, "attribute buffer too small");
+
+  return len;
+
+fail:
+  return -1;
+}
+
+/* Directory Interface ===================================================== */
+
+/*
+ * NAME:	plus->rootent()
+ * DESCRIPTION:	return the directory entry of an HFS+ volume's root folder
+ */
+int p_rootent(hfsvol *vol, hfsdirent *ent)
+{
+  plusrec rec;
+  CatDataRec data;
+  char name[HFSPLUS_MAX_NLEN + 1];
+
+  if (getrec(vol, HFS_CNID_ROOTDIR, &rec, 0, name) <= 0 ||
+      catdata(vol, &rec, &data) == -1)
+    goto fail;
+
+  r_unpackdirent(HFS_CNID_ROOTPAR, name, &data, ent);
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->opendir()
+ * DESCRIPTION:	position a directory stream before a folder's first entry
+ */
+int p_opendir(hfsdir *dir)
+{
+  plustree *cat = &dir->vol->plus->cat;
+  plusdir *pd;
+  byte key[8];
+  int rnum;
+
+  pd = ALLOC(plusdir, 1);
+  if (pd == 0)
+    ERROR(ENOMEM, 0);
+
+  dir->plus = pd;
+
+  makekey(key, dir->dirid, 0, 0);
+
+  if (search(dir->vol, cat, key, catcompare, &pd->nnum, &rnum) == -1)
+    goto fail;
+
+  pd->rnum = rnum;
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->readdir()
+ * DESCRIPTION:	return the next entry of an HFS+ folder
+ */
+int p_readdir(hfsdir *dir, hfsdirent *ent)
+{
+  hfsvol *vol = dir->vol;
+  plusvol *pv = vol->plus;
+  plustree *cat = &pv->cat;
+  plusdir *pd = dir->plus;
+  const byte *node, *ptr, *data;
+  plusrec rec;
+  CatDataRec cdata;
+  UInteger uname[HFSPLUS_MAX_FLEN];
+  char name[HFSPLUS_MAX_NLEN + 1];
+
+  while (1)
+    {
+      if (pd->nnum == 0)
+	ERROR(ENOENT, "no more entries");
+
+      switch (nextrec(vol, cat, &pd->nnum, &pd->rnum, &node))
+	{
+	case -1:
+	  pd->nnum = 0;
+	  goto fail;
+
+	case 0:
+	  ERROR(ENOENT, "no more entries");
+	}
+
+      ptr = record(cat, node, pd->rnum, &data);
+      if (ptr == 0)
+	{
+	  pd->nnum = 0;
+	  ERROR(EIO, "bad HFS+ B*-tree record");
+	}
+
+      if (d_getul(ptr + 2) != dir->dirid)
+	{
+	  pd->nnum = 0;
+	  ERROR(ENOENT, "no more entries");
+	}
+
+      switch (d_getsw(data))
+	{
+	case PLUS_FOLDER:
+	case PLUS_FILE:
+	  if (unpackrec(ptr, data, node + cat->nodesz - data, &rec) == -1)
+	    goto fail;
+
+	  if (dir->dirid == HFS_CNID_ROOTDIR && rec.type == PLUS_FOLDER &&
+	      (rec.cnid == pv->fileprivdir || rec.cnid == pv->dirprivdir))
+	    break;
+
+	  /* the name must be taken before resolving moves the node cache */
+
+	  u_toname(name, uname, getname(ptr + 6, uname));
+
+	  if (resolvelink(vol, &rec) == -1 ||
+	      catdata(vol, &rec, &cdata) == -1)
+	    goto fail;
+
+	  r_unpackdirent(dir->dirid, name, &cdata, ent);
+
+	  return 0;
+
+	case PLUS_FOLDERTHREAD:
+	case PLUS_FILETHREAD:
+	  break;
+
+	default:
+	  pd->nnum = 0;
+	  ERROR(EIO, "unexpected directory entry found");
+	}
+    }
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->closedir()
+ * DESCRIPTION:	release HFS+ directory stream state
+ */
+void p_closedir(hfsdir *dir)
+{
+  plusdir *pd = dir->plus;
+
+  if (pd == 0)
+    return;
+
+  FREE(pd);
+
+  dir->plus = 0;
+}
+
+/* File Interface ========================================================== */
+
+/*
+ * NAME:	loadtable()
+ * DESCRIPTION:	read the chunk table of a resource-fork compressed file
+ */
+static
+int loadtable(hfsfile *file)
+{
+  plusfile *pf = file->plus;
+  const plusfork *rsrc = &pf->rec.rsrc;
+  byte buf[8], *tab = 0;
+  unsigned long base, n, i;
+
+  if (readfork(file->vol, pf->rec.cnid, 0xff, rsrc, 0, buf, 4) == -1)
+    goto fail;
+
+  base = d_getul(buf) + 4;  /* skip the resource data length */
+
+  if (readfork(file->vol, pf->rec.cnid, 0xff, rsrc, base, buf, 4) == -1)
+    goto fail;
+
+  n = getle32(buf);
+  if (n != (pf->csize + HFSPLUS_CHUNKSZ - 1) / HFSPLUS_CHUNKSZ)
+    ERROR(EIO, "bad HFS+ compressed resource");
+
+  pf->nchunks = n;
+
+  pf->ctab = ALLOC(unsigned long, 2 * n + 1);
+  tab      = ALLOC(byte, 8 * n + 1);
+  if (pf->ctab == 0 || tab == 0)
+    ERROR(ENOMEM, 0);
+
+  if (readfork(file->vol, pf->rec.cnid, 0xff, rsrc,
+	       base + 4, tab, 8 * n) == -1)
+    goto fail;
+
+  for (i = 0; i < n; ++i)
+    {
+      pf->ctab[2 * i + 0] = base + getle32(tab + 8 * i);
+      pf->ctab[2 * i + 1] = getle32(tab + 8 * i + 4);
+
+      if (pf->ctab[2 * i] + pf->ctab[2 * i + 1] > rsrc->lsize)
+	ERROR(EIO, "HFS+ compressed chunk beyond resource fork");
+    }
+
+  FREE(tab);
+
+  return 0;
+
+fail:
+  FREE(tab);
+  return -1;
+}
+
+/*
+ * NAME:	loadchunk()
+ * DESCRIPTION:	make the given chunk of a compressed file current
+ */
+static
+int loadchunk(hfsfile *file, unsigned long cnum)
+{
+  plusfile *pf = file->plus;
+  unsigned long csz, want, zlen;
+  uLongf dlen;
+  const byte *src;
+
+  if ((long) cnum == pf->cnum)
+    return 0;
+
+  csz  = (pf->ctype == 4) ? HFSPLUS_CHUNKSZ : pf->csize;
+  want = pf->csize - cnum * csz;
+  if (want > csz)
+    want = csz;
+
+  if (pf->ctype == 4)
+    {
+      zlen = pf->ctab[2 * cnum + 1];
+
+      if (zlen > pf->cbufsz)
+	{
+	  byte *new;
+
+	  new = REALLOC(pf->cbuf, byte, zlen);
+	  if (new == 0)
+	    ERROR(ENOMEM, 0);
+
+	  pf->cbuf   = new;
+	  pf->cbufsz = zlen;
+	}
+
+      if (readfork(file->vol, pf->rec.cnid, 0xff, &pf->rec.rsrc,
+		   pf->ctab[2 * cnum], pf->cbuf, zlen) == -1)
+	goto fail;
+
+      src = pf->cbuf;
+    }
+  else
+    {
+      /* inline data follows the decmpfs header in the attribute */
+
+      src  = pf->cbuf + DECMPFS_HDRSZ;
+      zlen = pf->cbufsz - DECMPFS_HDRSZ;
+    }
+
+  pf->cnum = -1;
+
+  if (pf->ctype == 1)
+    {
+      if (zlen < want)
+	ERROR(EIO, "short HFS+ compressed data");
+
+      memcpy(pf->chunk, src, want);
+    }
+  else if (zlen && (src[0] & 0x0f) == 0x0f)
+    {
+      /* stored without compression */
+
+      if (zlen - 1 < want)
+	ERROR(EIO, "short HFS+ compressed data");
+
+      memcpy(pf->chunk, src + 1, want);
+    }
+  else
+    {
+      dlen = want;
+
+      if (uncompress(pf->chunk, &dlen, src, zlen) != Z_OK ||
+	  dlen != want)
+	ERROR(EIO, "corrupt HFS+ compressed data");
+    }
+
+  pf->cnum = cnum;
+  pf->clen = want;
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->open()
+ * DESCRIPTION:	prepare an HFS+ file for reading
+ */
+int p_open(hfsfile *file)
+{
+  hfsvol *vol = file->vol;
+  plusvol *pv = vol->plus;
+  plusfile *pf;
+  unsigned long cnid = file->cat.u.fil.filFlNum;
+  unsigned long len, chunksz = 0;
+  int found;
+
+  pf = ALLOC(plusfile, 1);
+  if (pf == 0)
+    ERROR(ENOMEM, 0);
+
+  memset(pf, 0, sizeof(plusfile));
+  pf->cnum = -1;
+
+  file->plus = pf;
+
+  /* normally the record was just found by p_resolve() */
+
+  if (pv->last.type == PLUS_FILE && pv->last.cnid == cnid)
+    pf->rec = pv->last;
+  else if (getrec(vol, cnid, &pf->rec, 0, 0) <= 0)
+    goto fail;
+
+  if (pf->rec.ownerflags & PLUS_UF_COMPRESSED)
+    {
+      found = getcomp(vol, cnid, &pf->ctype, &pf->csize);
+      if (found == -1)
+	goto fail;
+      else if (! found)
+	pf->ctype = 0;
+    }
+
+  switch (pf->ctype)
+    {
+    case 0:
+      return 0;
+
+    case 1:  /* stored inline */
+    case 3:  /* zlib, inline */
+      len = 0;
+      if (getattr(vol, cnid, "com.apple.decmpfs", 0, &len) <= 0)
+	goto fail;
+
+      pf->cbuf = ALLOC(byte, len);
+      if (pf->cbuf == 0)
+	ERROR(ENOMEM, 0);
+
+      pf->cbufsz = len;
+
+      if (getattr(vol, cnid, "com.apple.decmpfs", pf->cbuf, &len) <= 0)
+	goto fail;
+
+      chunksz = pf->csize;
+      pf->nchunks = 1;
+      break;
+
+    case 4:  /* zlib, 64K chunks in the resource fork */
+      if (loadtable(file) == -1)
+	goto fail;
+
+      chunksz = HFSPLUS_CHUNKSZ;
+      break;
+
+    default:
+      ERROR(EIO, "unsupported HFS+ compression type");
+    }
+
+  pf->chunk = ALLOCX(byte, chunksz);
+  if (chunksz && pf->chunk == 0)
+    ERROR(ENOMEM, 0);
+
+  return 0;
+
+fail:
+  p_close(file);
+  return -1;
+}
+
+/*
+ * NAME:	plus->read()
+ * DESCRIPTION:	read from an open HFS+ file
+ */
+unsigned long p_read(hfsfile *file, void *buf, unsigned long len)
+{
+  plusfile *pf = file->plus;
+  unsigned long *lglen, count;
+  byte *ptr = buf;
+
+  f_getptrs(file, 0, &lglen, 0);
+
+  if (file->pos + len > *lglen)
+    len = *lglen - file->pos;
+
+  count = len;
+
+  if (pf->ctype == 0 || file->fork != fkData)
+    {
+      if (readfork(file->vol, pf->rec.cnid,
+		   (file->fork == fkData) ? 0x00 : 0xff,
+		   (file->fork == fkData) ? &pf->rec.data : &pf->rec.rsrc,
+		   file->pos, ptr, len) == -1)
+	goto fail;
+
+      file->pos += len;
+
+      return len;
+    }
+
+  while (count)
+    {
+      unsigned long csz, cnum, offs, chunk;
+
+      csz  = (pf->ctype == 4) ? HFSPLUS_CHUNKSZ : pf->csize;
+      cnum = file->pos / csz;
+      offs = file->pos % csz;
+
+      if (loadchunk(file, cnum) == -1)
+	goto fail;
+
+      chunk = pf->clen - offs;
+      if (chunk > count)
+	chunk = count;
+
+      memcpy(ptr, pf->chunk + offs, chunk);
+
+      ptr       += chunk;
+      file->pos += chunk;
+      count     -= chunk;
+    }
+
+  return len;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->close()
+ * DESCRIPTION:	release HFS+ file state
+ */
+void p_close(hfsfile *file)
+{
+  plusfile *pf = file->plus;
+
+  if (pf == 0)
+    return;
+
+  FREE(pf->ctab);
+  FREE(pf->cbuf);
+  FREE(pf->chunk);
+
+  FREE(pf);
+
+  file->plus = 0;
+}
+
+/* Resize Interface ======================================================== */
+
+typedef struct {
+  byte *bm;			/* allocation bitmap */
+  unsigned long limit;		/* extents reaching this block must move */
+  unsigned long first;		/* no free block below this one */
+  plusext *old;			/* runs moved away from */
+  unsigned long nold;		/* number of those runs */
+  unsigned long oldsz;		/* room in the run table */
+  block *buf;			/* copy buffer */
+} plusmove;
+
+/*
+ * NAME:	setbits()
+ * DESCRIPTION:	set or clear a range of bits in the allocation bitmap
+ */
+static
+void setbits(byte *bm, unsigned long from, unsigned long to, int on)
+{
+  while (from < to && (from & 7))
+    {
+      if (on)
+	BMSET(bm, from);
+      else
+	BMCLR(bm, from);
+
+      ++from;
+    }
+
+  if (to - from >= 8)
+    {
+      memset(bm + (from >> 3), on ? 0xff : 0, (to - from) >> 3);
+      from += (to - from) & ~7UL;
+    }
+
+  for ( ; from < to; ++from)
+    {
+      if (on)
+	BMSET(bm, from);
+      else
+	BMCLR(bm, from);
+    }
+}
+
+/*
+ * NAME:	allocrun()
+ * DESCRIPTION:	claim the first free run of want blocks below the limit, or
+ *		the longest shorter one; return its length (0 if none)
+ */
+static
+unsigned long allocrun(plusmove *mv, unsigned long want, unsigned long *start)
+{
+  unsigned long pt, mark, best = 0, bestat = 0;
+
+  while (mv->first < mv->limit && BMTST(mv->bm, mv->first))
+    ++mv->first;
+
+  for (pt = mv->first; pt < mv->limit && best < want; )
+    {
+      if ((pt & 7) == 0 && mv->bm[pt >> 3] == 0xff)
+	{
+	  pt += 8;
+	  continue;
+	}
+
+      if (BMTST(mv->bm, pt))
+	{
+	  ++pt;
+	  continue;
+	}
+
+      mark = pt;
+      while (pt < mv->limit && pt - mark < want && ! BMTST(mv->bm, pt))
+	++pt;
+
+      if (pt - mark > best)
+	{
+	  best   = pt - mark;
+	  bestat = mark;
+	}
+    }
+
+  setbits(mv->bm, bestat, bestat + best, 1);
+
+  *start = bestat;
+
+  return best;
+}
+
+/*
+ * NAME:	release()
+ * DESCRIPTION:	give back runs claimed by allocrun()
+ */
+static
+void release(plusmove *mv, const plusext *ext, unsigned int n)
+{
+  while (n--)
+    setbits(mv->bm, ext[n].start, ext[n].start + ext[n].count, 0);
+
+  mv->first = 0;
+}
+
+/*
+ * NAME:	copyblocks()
+ * DESCRIPTION:	copy a run of allocation blocks to another place
+ */
+static
+int copyblocks(hfsvol *vol, plusmove *mv, unsigned long from,
+	       unsigned long to, unsigned long count)
+{
+  unsigned long lpa, len, chunk;
+
+  lpa  = vol->plus->blocksz >> HFS_BLOCKSZ_BITS;
+  from = vol->vstart + from * lpa;
+  to   = vol->vstart + to   * lpa;
+
+  for (len = count * lpa; len; len -= chunk)
+    {
+      chunk = len < PLUS_COPYSZ ? len : PLUS_COPYSZ;
+
+      if (b_readpb(vol, from, mv->buf, chunk) == -1 ||
+	  b_writepb(vol, to, mv->buf, chunk) == -1)
+	goto fail;
+
+      from += chunk;
+      to   += chunk;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	moveexts()
+ * DESCRIPTION:	move the extents of a packed record that reach the limit;
+ *		return 1 if the record changed
+ */
+static
+int moveexts(hfsvol *vol, plusmove *mv, byte *rec)
+{
+  plusext ext[8], piece[8];
+  unsigned int used, i, j, n;
+  int changed = 0;
+
+  for (used = 0; used < 8; ++used)
+    {
+      ext[used].start = d_getul(rec + used * 8);
+      ext[used].count = d_getul(rec + 4 + used * 8);
+
+      if (ext[used].count == 0)
+	break;
+    }
+
+  for (i = 0; i < used; ++i)
+    {
+      unsigned long need, got, from;
+
+      if (ext[i].start + ext[i].count <= mv->limit)
+	continue;
+
+      /* a split extent takes over the free slots of its record */
+
+      for (n = 0, need = ext[i].count; need; need -= got)
+	{
+	  if (n > 8 - used)
+	    {
+	      release(mv, piece, n);
+	      ERROR(ENOSPC, "free space too fragmented to move an HFS+ extent");
+	    }
+
+	  got = allocrun(mv, need, &piece[n].start);
+	  if (got == 0)
+	    {
+	      release(mv, piece, n);
+	      ERROR(ENOSPC, "not enough free space below the new end");
+	    }
+
+	  piece[n++].count = got;
+	}
+
+      for (from = ext[i].start, j = 0; j < n; from += piece[j++].count)
+	{
+	  if (copyblocks(vol, mv, from, piece[j].start, piece[j].count) == -1)
+	    {
+	      release(mv, piece, n);
+	      goto fail;
+	    }
+	}
+
+      if (mv->nold == mv->oldsz)
+	{
+	  plusext *grow;
+
+	  grow = REALLOC(mv->old, plusext, mv->oldsz ? mv->oldsz * 2 : 64);
+	  if (grow == 0)
+	    {
+	      release(mv, piece, n);
+	      ERROR(ENOMEM, 0);
+	    }
+
+	  mv->old   = grow;
+	  mv->oldsz = mv->oldsz ? mv->oldsz * 2 : 64;
+	}
+
+      mv->old[mv->nold++] = ext[i];
+
+      for (j = used; j-- > i + 1; )
+	ext[j + n - 1] = ext[j];
+
+      for (j = 0; j < n; ++j)
+	ext[i + j] = piece[j];
+
+      used += n - 1;
+      i    += n - 1;
+
+      changed = 1;
+    }
+
+  if (changed)
+    {
+      for (j = 0; j < 8; ++j)
+	{
+	  d_putul(rec + j * 8,     j < used ? ext[j].start : 0);
+	  d_putul(rec + 4 + j * 8, j < used ? ext[j].count : 0);
+	}
+    }
+
+  return changed;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	moverec()
+ * DESCRIPTION:	move the extents held by one leaf record
+ */
+static
+int moverec(hfsvol *vol, plusmove *mv, const plustree *tree,
+	    const byte *node, byte *data)
+{
+  plusvol *pv = vol->plus;
+  const byte *end = node + tree->nodesz;
+  int r1, r2;
+
+  if (tree == &pv->ext)
+    {
+      if (data + 64 > end)
+	ERROR(EIO, "bad HFS+ extents record");
+
+      return moveexts(vol, mv, data);
+    }
+
+  if (tree == &pv->cat)
+    {
+      if (d_getuw(data) != PLUS_FILE)
+	return 0;
+
+      if (data + 248 > end)
+	ERROR(EIO, "bad HFS+ file record");
+
+      r1 = moveexts(vol, mv, data +  88 + 16);
+      r2 = r1 == -1 ? -1 : moveexts(vol, mv, data + 168 + 16);
+
+      return r2 == -1 ? -1 : (r1 | r2);
+    }
+
+  switch (d_getul(data))
+    {
+    case PLUS_ATTR_FORK:
+      if (data + 88 > end)
+	ERROR(EIO, "bad HFS+ attribute record");
+
+      return moveexts(vol, mv, data + 8 + 16);
+
+    case PLUS_ATTR_EXTENTS:
+      if (data + 72 > end)
+	ERROR(EIO, "bad HFS+ attribute record");
+
+      return moveexts(vol, mv, data + 8);
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	movetree()
+ * DESCRIPTION:	move the extents found in the leaf records of a B*-tree
+ */
+static
+int movetree(hfsvol *vol, plusmove *mv, plustree *tree)
+{
+  byte hdr[HFS_BLOCKSZ];
+  unsigned long nnum;
+
+  if (tree->root == 0)
+    return 0;
+
+  if (readfork(vol, tree->cnid, 0, &tree->fork, 0, hdr, HFS_BLOCKSZ) == -1)
+    goto fail;
+
+  nnum = d_getul(hdr + 14 + 10);
+
+  while (nnum)
+    {
+      byte *np;
+      const byte *data;
+      int rnum, nrecs, result, changed = 0;
+
+      np = (byte *) getnode(vol, tree, nnum);
+      if (np == 0)
+	goto fail;
+
+      if ((signed char) np[8] != PLUS_LEAFNODE)
+	ERROR(EIO, "bad HFS+ B*-tree leaf chain");
+
+      nrecs = d_getuw(np + 10);
+
+      for (rnum = 0; rnum < nrecs; ++rnum)
+	{
+	  if (record(tree, np, rnum, &data) == 0)
+	    ERROR(EIO, "bad HFS+ B*-tree record");
+
+	  result = moverec(vol, mv, tree, np, (byte *) data);
+	  if (result == -1)
+	    goto fail;
+
+	  changed |= result;
+	}
+
+      if (changed &&
+	  writefork(vol, tree->cnid, 0, &tree->fork,
+		    nnum * tree->nodesz, np, tree->nodesz) == -1)
+	goto fail;
+
+      nnum = d_getul(np + 0);
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->resize()
+ * DESCRIPTION:	grow or shrink an HFS+ volume to len logical blocks
+ */
+int p_resize(hfsvol *vol, unsigned long len)
+{
+  plusvol *pv = vol->plus;
+  plusmove mv;
+  plusfork alloc;
+  block vh, zero;
+  unsigned long bs, total, oldtail, newtail, have, need, size, nfree, pt;
+  unsigned long oldlen = vol->vlen;
+  int i, moving = 0;
+
+  memset(&mv, 0, sizeof(mv));
+  memset(&zero, 0, sizeof(zero));
+
+  bs = pv->blocksz;
+
+  if (vol->flags & HFS_VOL_EMBEDDED)
+    ERROR(EINVAL, "HFS+ volume inside an HFS wrapper cannot be resized");
+
+  if (len < 800 * (1024 >> HFS_BLOCKSZ_BITS))
+    ERROR(EINVAL, "volume would be smaller than 800K");
+
+  if (vol->pnum > 0 && len > vol->vlen)
+    ERROR(EINVAL, "volume would not fit in its partition");
+
+  /* reading and rewriting the header also proves the medium is writable */
+
+  if (b_readpb(vol, vol->vstart + 2, &vh, 1) == -1 ||
+      b_writepb(vol, vol->vstart + 2, &vh, 1) == -1)
+    goto fail;
+
+  if (d_getul(vh + 4) & PLUS_VH_JOURNALED)
+    ERROR(EINVAL, "journaled HFS+ volume cannot be resized");
+
+  if (! (d_getul(vh + 4) & PLUS_VH_UNMOUNTED))
+    ERROR(EINVAL, "HFS+ volume was not cleanly unmounted");
+
+  total   = (len << HFS_BLOCKSZ_BITS) / bs;
+
+  oldtail = ((oldlen << HFS_BLOCKSZ_BITS) - 1024) / bs;
+  if (oldtail > pv->totblocks)
+    oldtail = pv->totblocks;
+
+  newtail = ((len << HFS_BLOCKSZ_BITS) - 1024) / bs;
+  if (newtail > total)
+    newtail = total;
+
+  /* load the bitmap, with room for the blocks it may have to cover */
+
+  getfork(vh + 112, &alloc);
+
+  have = alloc.nblocks * bs;
+  need = (total + 7) >> 3;
+  size = need > have ? (need + bs - 1) / bs * bs : have;
+
+  mv.bm  = ALLOC(byte, size);
+  mv.buf = ALLOC(block, PLUS_COPYSZ);
+
+  if (mv.bm == 0 || mv.buf == 0)
+    ERROR(ENOMEM, 0);
+
+  memset(mv.bm, 0, size);
+
+  if (readfork(vol, 6, 0, &alloc, 0, mv.bm, have) == -1)
+    goto fail;
+
+  /* make sure the medium reaches the new end before touching anything */
+
+  if (len > oldlen &&
+      b_writepb(vol, vol->vstart + len - 1, &zero, 1) == -1)
+    goto fail;
+
+  /* shrinking: move every extent out of the blocks being cut off */
+
+  if (newtail < oldtail)
+    {
+      unsigned long used = 0, avail = 0;
+
+      for (pt = newtail; pt < oldtail; ++pt)
+	{
+	  if (BMTST(mv.bm, pt))
+	    ++used;
+	}
+
+      for (pt = 0; pt < newtail; ++pt)
+	{
+	  if (! BMTST(mv.bm, pt))
+	    ++avail;
+	}
+
+      if (used > avail)
+	ERROR(ENOSPC, "not enough free space below the new end");
+
+      mv.limit = newtail;
+      moving   = 1;
+
+      /* the special files first, so the trees are read from their copies */
+
+      for (i = 0; i < 5; ++i)
+	{
+	  if (moveexts(vol, &mv, vh + 112 + i * 80 + 16) == -1)
+	    goto fail;
+	}
+
+      getfork(vh + 112, &alloc);
+      getfork(vh + 192, &pv->ext.fork);
+      getfork(vh + 272, &pv->cat.fork);
+      getfork(vh + 352, &pv->attr.fork);
+
+      if (movetree(vol, &mv, &pv->ext)  == -1 ||
+	  movetree(vol, &mv, &pv->cat)  == -1 ||
+	  movetree(vol, &mv, &pv->attr) == -1)
+	goto fail;
+
+      moving = 0;
+
+      for (pt = 0; pt < mv.nold; ++pt)
+	setbits(mv.bm, mv.old[pt].start,
+		mv.old[pt].start + mv.old[pt].count, 0);
+    }
+
+  /* free the old tail and everything past it, then reserve the new tail */
+
+  setbits(mv.bm, oldtail < newtail ? oldtail : newtail, size << 3, 0);
+  setbits(mv.bm, newtail, total, 1);
+
+  /* growing: the allocation file itself may need more blocks */
+
+  if (need > have)
+    {
+      unsigned long want, got, start, sum = 0;
+      unsigned int used;
+
+      for (used = 0; used < 8 && alloc.ext[used].count; ++used)
+	sum += alloc.ext[used].count;
+
+      if (sum != alloc.nblocks)
+	ERROR(EINVAL, "fragmented HFS+ allocation file cannot grow");
+
+      mv.limit = newtail;
+      mv.first = 0;
+
+      for (want = (size - have) / bs; want; want -= got)
+	{
+	  got = allocrun(&mv, want, &start);
+	  if (got == 0)
+	    ERROR(ENOSPC, "no room to grow the allocation file");
+
+	  if (used && alloc.ext[used - 1].start +
+	      alloc.ext[used - 1].count == start)
+	    alloc.ext[used - 1].count += got;
+	  else if (used < 8)
+	    {
+	      alloc.ext[used].start   = start;
+	      alloc.ext[used++].count = got;
+	    }
+	  else
+	    ERROR(ENOSPC, "no extent left to grow the allocation file");
+
+	  alloc.nblocks += got;
+	}
+
+      d_putul(vh + 112 +  0, 0);
+      d_putul(vh + 112 +  4, alloc.nblocks * bs);
+      d_putul(vh + 112 + 12, alloc.nblocks);
+
+      for (i = 0; i < 8; ++i)
+	{
+	  d_putul(vh + 112 + 16 + i * 8, alloc.ext[i].start);
+	  d_putul(vh + 112 + 20 + i * 8, alloc.ext[i].count);
+	}
+    }
+
+  for (nfree = 0, pt = 0; pt < total; ++pt)
+    {
+      if (! BMTST(mv.bm, pt))
+	++nfree;
+    }
+
+  /* the old alternate header may lie in free space now */
+
+  if (len > oldlen &&
+      b_writepb(vol, vol->vstart + oldlen - 2, &zero, 1) == -1)
+    goto fail;
+
+  if (writefork(vol, 6, 0, &alloc, 0, mv.bm, size) == -1)
+    goto fail;
+
+  d_putul(vh + 20, (unsigned long) time(0) + TIMEDIFF);
+  d_putul(vh + 44, total);
+  d_putul(vh + 48, nfree);
+
+  if (d_getul(vh + 52) >= total)
+    d_putul(vh + 52, 0);
+
+  if (b_writepb(vol, vol->vstart + 2, &vh, 1) == -1 ||
+      b_writepb(vol, vol->vstart + len - 2, &vh, 1) == -1)
+    goto fail;
+
+  pv->totblocks  = total;
+  pv->freeblocks = nfree;
+
+  vol->vlen = len;
+
+  FREE(mv.bm);
+  FREE(mv.buf);
+  FREE(mv.old);
+
+  return 0;
+
+fail:
+  if (moving)
+    {
+      /* records may already name the copies; keep the bitmap in step */
+
+      for (nfree = 0, pt = 0; pt < pv->totblocks; ++pt)
+	{
+	  if (! BMTST(mv.bm, pt))
+	    ++nfree;
+	}
+
+      d_putul(vh + 48, nfree);
+
+      writefork(vol, 6, 0, &alloc, 0, mv.bm, have);
+      b_writepb(vol, vol->vstart + 2, &vh, 1);
+      b_writepb(vol, vol->vstart + oldlen - 2, &vh, 1);
+    }
+
+  FREE(mv.bm);
+  FREE(mv.buf);
+  FREE(mv.old);
+
+  return -1;
+}
+
+/* Report Interface ======================================================== */
+
+typedef struct {
+  unsigned long cnid;		/* file ID */
+  int fork;			/* 0x00 data or 0xff resource */
+  unsigned long count;		/* extents in overflow records */
+} plusovf;
+
+/*
+ * NAME:	countfork()
+ * DESCRIPTION:	return the number of extents in a fork's first record
+ */
+static
+unsigned int countfork(const plusfork *fork)
+{
+  unsigned int i;
+
+  for (i = 0; i < 8 && fork->ext[i].count; ++i)
+    ;
+
+  return i;
+}
+
+/*
+ * NAME:	ovflookup()
+ * DESCRIPTION:	find the overflow extent count of a fork
+ */
+static
+unsigned long ovflookup(const plusovf *list, unsigned long nlist,
+			unsigned long cnid, int fork)
+{
+  unsigned long lo = 0, hi = nlist;
+
+  /* the list is in extents key order: file ID, then fork type */
+
+  while (lo < hi)
+    {
+      unsigned long mid = (lo + hi) >> 1;
+      const plusovf *ov = &list[mid];
+
+      if (ov->cnid == cnid && ov->fork == fork)
+	return ov->count;
+
+      if (ov->cnid < cnid || (ov->cnid == cnid && ov->fork < fork))
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return 0;
+}
+
+/*
+ * NAME:	firstleaf()
+ * DESCRIPTION:	read a B*-tree header and return its first leaf node
+ */
+static
+int firstleaf(hfsvol *vol, plustree *tree, hfstreestat *st,
+	      unsigned long *nnum)
+{
+  byte hdr[HFS_BLOCKSZ];
+
+  *nnum = 0;
+
+  if (tree->fork.lsize == 0)
+    return 0;
+
+  if (readfork(vol, tree->cnid, 0, &tree->fork, 0, hdr, HFS_BLOCKSZ) == -1)
+    return -1;
+
+  if (st)
+    {
+      st->nodesz    = tree->nodesz;
+      st->depth     = d_getuw(hdr + 14 +  0);
+      st->records   = d_getul(hdr + 14 +  6);
+      st->nodes     = d_getul(hdr + 14 + 22);
+      st->freenodes = d_getul(hdr + 14 + 26);
+    }
+
+  *nnum = d_getul(hdr + 14 + 10);
+
+  return 0;
+}
+
+/*
+ * NAME:	scanext()
+ * DESCRIPTION:	count the extents each fork keeps in overflow records
+ */
+static
+int scanext(hfsvol *vol, plusovf **list, unsigned long *nlist)
+{
+  plustree *tree = &vol->plus->ext;
+  unsigned long nnum, size = 0;
+
+  *list  = 0;
+  *nlist = 0;
+
+  if (firstleaf(vol, tree, 0, &nnum) == -1)
+    goto fail;
+
+  while (nnum)
+    {
+      const byte *np, *ptr, *data;
+      int rnum, nrecs;
+
+      np = getnode(vol, tree, nnum);
+      if (np == 0)
+	goto fail;
+
+      if ((signed char) np[8] != PLUS_LEAFNODE)
+	ERROR(EIO, "bad HFS+ B*-tree leaf chain");
+
+      nrecs = d_getuw(np + 10);
+
+      for (rnum = 0; rnum < nrecs; ++rnum)
+	{
+	  plusovf *last;
+	  unsigned int count;
+
+	  ptr = record(tree, np, rnum, &data);
+	  if (ptr == 0)
+	    ERROR(EIO, "bad HFS+ B*-tree record");
+
+	  for (count = 0; count < 8 && d_getul(data + 4 + count * 8); ++count)
+	    ;
+
+	  last = *nlist ? &(*list)[*nlist - 1] : 0;
+
+	  if (last && last->cnid == d_getul(ptr + 4) && last->fork == ptr[2])
+	    {
+	      last->count += count;
+	      continue;
+	    }
+
+	  if (*nlist == size)
+	    {
+	      plusovf *grow;
+
+	      grow = REALLOC(*list, plusovf, size ? size * 2 : 64);
+	      if (grow == 0)
+		ERROR(ENOMEM, 0);
+
+	      *list = grow;
+	      size  = size ? size * 2 : 64;
+	    }
+
+	  (*list)[*nlist].cnid  = d_getul(ptr + 4);
+	  (*list)[*nlist].fork  = ptr[2];
+	  (*list)[*nlist].count = count;
+	  ++*nlist;
+	}
+
+      nnum = d_getul(np + 0);
+    }
+
+  return 0;
+
+fail:
+  FREE(*list);
+  *list = 0;
+
+  return -1;
+}
+
+/*
+ * NAME:	treestat()
+ * DESCRIPTION:	measure the fill and leaf locality of a B*-tree, walking
+ *		each level from its leftmost node
+ */
+static
+int treestat(hfsvol *vol, plustree *tree, const plusovf *ovf,
+	     unsigned long novf, hfstreestat *st)
+{
+  plusvol *pv = vol->plus;
+  unsigned long nnum, first, child, seen = 0, pos, prev = 0;
+  unsigned long vabn, run;
+  const byte *np = 0, *data;
+  int haveprev = 0;
+
+  if (firstleaf(vol, tree, st, &nnum) == -1)
+    goto fail;
+
+  if (tree->fork.lsize == 0)
+    return 0;
+
+  st->extents = countfork(&tree->fork) +
+    ovflookup(ovf, novf, tree->cnid, 0);
+
+  for (nnum = tree->root; nnum; nnum = child)
+    {
+      for (first = nnum, child = 0; nnum; nnum = d_getul(np + 0))
+	{
+	  unsigned int nrecs;
+	  unsigned long used;
+
+	  if (++seen > st->nodes)
+	    ERROR(EIO, "HFS+ B*-tree node chain loops");
+
+	  np = getnode(vol, tree, nnum);
+	  if (np == 0)
+	    goto fail;
+
+	  nrecs = d_getuw(np + 10);
+	  used  = d_getuw(np + tree->nodesz - 2 * (nrecs + 1)) + 2 * (nrecs + 1);
+
+	  if ((signed char) np[8] == PLUS_INDEXNODE)
+	    {
+	      ++st->index;
+	      st->indexused += used;
+
+	      if (nnum == first && record(tree, np, 0, &data))
+		child = d_getul(data);
+
+	      continue;
+	    }
+
+	  if ((signed char) np[8] != PLUS_LEAFNODE)
+	    ERROR(EIO, "unexpected HFS+ B*-tree node type");
+
+	  ++st->leaves;
+	  st->leafused += used;
+
+	  /* where the node lies on the medium, in logical blocks */
+
+	  if (mapblock(vol, tree->cnid, 0, &tree->fork,
+		       nnum * tree->nodesz / pv->blocksz, &vabn, &run) == -1)
+	    goto fail;
+
+	  pos = vabn * (pv->blocksz >> HFS_BLOCKSZ_BITS) +
+	    ((nnum * tree->nodesz) % pv->blocksz >> HFS_BLOCKSZ_BITS);
+
+	  if (haveprev && pos != prev + (tree->nodesz >> HFS_BLOCKSZ_BITS))
+	    {
+	      ++st->jumps;
+
+	      if (pos < prev)
+		++st->backward;
+
+	      st->distance += (pos < prev ? prev - pos : pos - prev) >> 1;
+	    }
+
+	  prev     = pos;
+	  haveprev = 1;
+	}
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	plus->fragstat()
+ * DESCRIPTION:	gather fragmentation and layout statistics with one scan of
+ *		the extents and catalog trees
+ */
+int p_fragstat(hfsvol *vol, hfsfragent *ent)
+{
+  plusvol *pv = vol->plus;
+  plustree *cat = &pv->cat;
+  plusovf *ovf = 0;
+  byte *bm = 0;
+  block vh;
+  plusfork alloc;
+  unsigned long novf, nnum, mark, pt;
+
+  memset(ent, 0, sizeof(*ent));
+
+  ent->blocksz = pv->blocksz;
+
+  if (scanext(vol, &ovf, &novf) == -1 ||
+      firstleaf(vol, cat, 0, &nnum) == -1)
+    goto fail;
+
+  while (nnum)
+    {
+      const byte *np, *ptr, *data;
+      int rnum, nrecs, f;
+
+      np = getnode(vol, cat, nnum);
+      if (np == 0)
+	goto fail;
+
+      if ((signed char) np[8] != PLUS_LEAFNODE)
+	ERROR(EIO, "bad HFS+ B*-tree leaf chain");
+
+      nrecs = d_getuw(np + 10);
+
+      for (rnum = 0; rnum < nrecs; ++rnum)
+	{
+	  UInteger uname[HFSPLUS_MAX_FLEN];
+	  char name[HFSPLUS_MAX_NLEN + 1];
+	  unsigned long cnid, extra;
+	  plusfork fork;
+
+	  ptr = record(cat, np, rnum, &data);
+	  if (ptr == 0)
+	    ERROR(EIO, "bad HFS+ B*-tree record");
+
+	  if (d_getuw(data) != PLUS_FILE)
+	    continue;
+
+	  cnid = d_getul(data + 8);
+	  name[u_toname(name, uname, getname(ptr + 6, uname))] = 0;
+
+	  for (f = 0; f < 2; ++f)
+	    {
+	      getfork(data + 88 + f * 80, &fork);
+	      if (fork.nblocks == 0)
+		continue;
+
+	      extra = ovflookup(ovf, novf, cnid, f ? 0xff : 0x00);
+	      ent->overflow += extra;
+
+	      e_tally(ent, cnid, name, f, countfork(&fork) + extra,
+		      fork.nblocks);
+	    }
+	}
+
+      nnum = d_getul(np + 0);
+    }
+
+  /* free space, from the allocation file */
+
+  if (b_readpb(vol, vol->vstart + 2, &vh, 1) == -1)
+    goto fail;
+
+  getfork(vh + 112, &alloc);
+
+  bm = ALLOC(byte, (pv->totblocks + 7) >> 3);
+  if (bm == 0)
+    ERROR(ENOMEM, 0);
+
+  if (readfork(vol, 6, 0, &alloc, 0, bm, (pv->totblocks + 7) >> 3) == -1)
+    goto fail;
+
+  for (pt = 0; pt < pv->totblocks; )
+    {
+      if (BMTST(bm, pt))
+	{
+	  ++pt;
+	  continue;
+	}
+
+      for (mark = pt; pt < pv->totblocks && ! BMTST(bm, pt); ++pt)
+	;
+
+      e_tallyfree(ent, pt - mark);
+    }
+
+  if (treestat(vol, &pv->cat,  ovf, novf, &ent->cat)  == -1 ||
+      treestat(vol, &pv->ext,  ovf, novf, &ent->ext)  == -1 ||
+      treestat(vol, &pv->attr, ovf, novf, &ent->attr) == -1)
+    goto fail;
+
+  FREE(ovf);
+  FREE(bm);
+
+  return 0;
+
+fail:
+  FREE(ovf);
+  FREE(bm);
+
+  return -1;
+}
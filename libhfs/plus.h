@@ -0,0 +1,152 @@
+/*
+ * libhfs - library for reading and writing Macintosh HFS volumes
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+# include "../include/common/hfsplus_unicode.h"
+
+# define HFSPLUS_SIGWORD		0x482b	/* 'H+' */
+# define HFSPLUS_SIGWORD_X	0x4858	/* 'HX' (HFSX) */
+
+# define HFSPLUS_NODESZ_MAX	32768
+# define HFSPLUS_CHUNKSZ		65536	/* decmpfs chunk size */
+
+# define HFSPLUS_NODECACHE	16	/* B*-tree nodes cached per tree */
+# define HFSPLUS_LINKCACHE	64	/* hard link targets cached per volume */
+
+typedef struct {
+  unsigned long start;		/* first allocation block */
+  unsigned long count;		/* number of allocation blocks */
+} plusext;
+
+typedef struct {
+  unsigned long lsize;		/* logical size in bytes */
+  unsigned long nblocks;	/* total allocation blocks */
+  plusext ext[8];		/* first extent record */
+} plusfork;
+
+typedef struct {
+  unsigned long nnum;		/* node number (0 if slot unused) */
+  unsigned long lru;		/* time of last use */
+  byte *data;			/* node contents */
+} plusnode;
+
+typedef struct {
+  unsigned long cnid;		/* file ID of the tree file */
+  plusfork fork;		/* location of the tree file */
+  unsigned int nodesz;		/* bytes per node */
+  unsigned int depth;		/* current depth of tree */
+  unsigned long root;		/* number of root node */
+  int keycmp;			/* catalog key compare type */
+  const byte *foldfor;		/* search key whose name is in fold */
+  hfsplus_foldkey_t fold;	/* folded name of the current search key */
+  const byte *node;		/* node found by the last search */
+  unsigned long hint;		/* leaf node found by the last search */
+  unsigned long tick;		/* node cache clock */
+  plusnode cache[HFSPLUS_NODECACHE];
+} plustree;
+
+typedef struct {
+  int type;			/* catalog record type */
+  unsigned long parid;		/* parent directory ID */
+  unsigned long cnid;		/* catalog node ID */
+  unsigned int flags;		/* record flags */
+  unsigned long valence;	/* number of items in folder */
+  unsigned long crdate;		/* dates (GMT seconds since 1904) */
+  unsigned long mddate;
+  unsigned long bkdate;
+  unsigned int ownerflags;	/* BSD owner flags */
+  unsigned long special;	/* iNodeNum, link count or device */
+  byte finfo[32];		/* Finder user and extended info */
+  plusfork data;		/* data fork */
+  plusfork rsrc;		/* resource fork */
+} plusrec;
+
+typedef struct {
+  unsigned long inode;		/* iNodeNum of the link */
+  plusrec rec;			/* catalog record of the link target */
+} pluslink;
+
+struct _plusvol_ {
+  unsigned long blocksz;	/* allocation block size */
+  unsigned long totblocks;	/* total allocation blocks */
+  unsigned long freeblocks;	/* free allocation blocks */
+  unsigned long clumpsz;	/* default data fork clump size */
+  unsigned long files;		/* number of files on volume */
+  unsigned long dirs;		/* number of folders on volume */
+  unsigned long crdate;		/* creation date (local time) */
+  unsigned long mddate;		/* modification date (GMT) */
+  unsigned long bkdate;		/* backup date (GMT) */
+  unsigned long blessed;	/* CNID of the System Folder */
+
+  plustree ext;			/* extents overflow B*-tree */
+  plustree cat;			/* catalog B*-tree */
+  plustree attr;		/* attributes B*-tree */
+
+  unsigned long fileprivdir;	/* CNID of the file hard link directory */
+  unsigned long dirprivdir;	/* CNID of the folder hard link directory */
+  pluslink *links;		/* hard link target cache */
+
+  plusrec last;			/* most recently resolved record */
+};
+
+struct _plusfile_ {
+  plusrec rec;			/* catalog record */
+
+  unsigned long ctype;		/* decmpfs compression type (0 if none) */
+  unsigned long csize;		/* uncompressed data fork size */
+  unsigned long nchunks;	/* number of compressed chunks */
+  unsigned long *ctab;		/* chunk offset/length pairs */
+  byte *cbuf;			/* compressed chunk buffer */
+  unsigned long cbufsz;		/* size of compressed chunk buffer */
+  byte *chunk;			/* last decompressed chunk */
+  long cnum;			/* index of that chunk, or -1 */
+  unsigned long clen;		/* bytes of that chunk */
+};
+
+struct _plusdir_ {
+  unsigned long nnum;		/* current leaf node, or 0 at end */
+  int rnum;			/* current record */
+};
+
+typedef struct _plusvol_  plusvol;
+typedef struct _plusfile_ plusfile;
+typedef struct _plusdir_  plusdir;
+
+int p_mount(hfsvol *);
+void p_umount(hfsvol *);
+int p_vstat(hfsvol *, hfsvolent *);
+int p_resize(hfsvol *, unsigned long);
+int p_fragstat(hfsvol *, hfsfragent *);
+
+int p_catsearch(hfsvol *, unsigned long, const char *, CatDataRec *, char *);
+int p_getthread(hfsvol *, unsigned long, CatDataRec *, int);
+int p_resolve(hfsvol *, unsigned long, const char *,
+	      CatDataRec *, unsigned long *, char *);
+int p_dirinfo(hfsvol *, unsigned long *, char *);
+
+int p_rootent(hfsvol *, hfsdirent *);
+int p_opendir(hfsdir *);
+int p_readdir(hfsdir *, hfsdirent *);
+void p_closedir(hfsdir *);
+
+long p_listattr(hfsvol *, unsigned long, char *, unsigned long);
+long p_getattr(hfsvol *, unsigned long, const char *, void *, unsigned long);
+
+int p_open(hfsfile *);
+unsigned long p_read(hfsfile *, void *, unsigned long);
+void p_close(hfsfile *);
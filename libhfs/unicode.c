@@ -0,0 +1,320 @@
+/*
+ * libhfs - library for reading and writing Macintosh HFS volumes
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+# ifdef HAVE_CONFIG_H
+#  include "config.h"
+# endif
+
+# include "apple.h"
+# include "unicode.h"
+
+static
+const UInteger macroman[128] = {
+  0x00c4, 0x00c5, 0x00c7, 0x00c9, 0x00d1, 0x00d6, 0x00dc, 0x00e1,
+  0x00e0, 0x00e2, 0x00e4, 0x00e3, 0x00e5, 0x00e7, 0x00e9, 0x00e8,
+  0x00ea, 0x00eb, 0x00ed, 0x00ec, 0x00ee, 0x00ef, 0x00f1, 0x00f3,
+  0x00f2, 0x00f4, 0x00f6, 0x00f5, 0x00fa, 0x00f9, 0x00fb, 0x00fc,
+  0x2020, 0x00b0, 0x00a2, 0x00a3, 0x00a7, 0x2022, 0x00b6, 0x00df,
+  0x00ae, 0x00a9, 0x2122, 0x00b4, 0x00a8, 0x2260, 0x00c6, 0x00d8,
+  0x221e, 0x00b1, 0x2264, 0x2265, 0x00a5, 0x00b5, 0x2202, 0x2211,
+  0x220f, 0x03c0, 0x222b, 0x00aa, 0x00ba, 0x03a9, 0x00e6, 0x00f8,
+  0x00bf, 0x00a1, 0x00ac, 0x221a, 0x0192, 0x2248, 0x2206, 0x00ab,
+  0x00bb, 0x2026, 0x00a0, 0x00c0, 0x00c3, 0x00d5, 0x0152, 0x0153,
+  0x2013, 0x2014, 0x201c, 0x201d, 0x2018, 0x2019, 0x00f7, 0x25ca,
+  0x00ff, 0x0178, 0x2044, 0x20ac, 0x2039, 0x203a, 0xfb01, 0xfb02,
+  0x2021, 0x00b7, 0x201a, 0x201e, 0x2030, 0x00c2, 0x00ca, 0x00c1,
+  0x00cb, 0x00c8, 0x00cd, 0x00ce, 0x00cf, 0x00cc, 0x00d3, 0x00d4,
+  0xf8ff, 0x00d2, 0x00da, 0x00db, 0x00d9, 0x0131, 0x02c6, 0x02dc,
+  0x00af, 0x02d8, 0x02d9, 0x02da, 0x00b8, 0x02dd, 0x02db, 0x02c7
+};
+
+static
+const UInteger macdecomp[128][2] = {
+  { 0x0041, 0x0308 }, { 0x0041, 0x030a }, { 0x0043, 0x0327 }, { 0x0045, 0x0301 },
+  { 0x004e, 0x0303 }, { 0x004f, 0x0308 }, { 0x0055, 0x0308 }, { 0x0061, 0x0301 },
+  { 0x0061, 0x0300 }, { 0x0061, 0x0302 }, { 0x0061, 0x0308 }, { 0x0061, 0x0303 },
+  { 0x0061, 0x030a }, { 0x0063, 0x0327 }, { 0x0065, 0x0301 }, { 0x0065, 0x0300 },
+  { 0x0065, 0x0302 }, { 0x0065, 0x0308 }, { 0x0069, 0x0301 }, { 0x0069, 0x0300 },
+  { 0x0069, 0x0302 }, { 0x0069, 0x0308 }, { 0x006e, 0x0303 }, { 0x006f, 0x0301 },
+  { 0x006f, 0x0300 }, { 0x006f, 0x0302 }, { 0x006f, 0x0308 }, { 0x006f, 0x0303 },
+  { 0x0075, 0x0301 }, { 0x0075, 0x0300 }, { 0x0075, 0x0302 }, { 0x0075, 0x0308 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0041, 0x0300 },
+  { 0x0041, 0x0303 }, { 0x004f, 0x0303 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0079, 0x0308 }, { 0x0059, 0x0308 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0041, 0x0302 }, { 0x0045, 0x0302 }, { 0x0041, 0x0301 },
+  { 0x0045, 0x0308 }, { 0x0045, 0x0300 }, { 0x0049, 0x0301 }, { 0x0049, 0x0302 },
+  { 0x0049, 0x0308 }, { 0x0049, 0x0300 }, { 0x004f, 0x0301 }, { 0x004f, 0x0302 },
+  { 0x0000, 0x0000 }, { 0x004f, 0x0300 }, { 0x0055, 0x0301 }, { 0x0055, 0x0302 },
+  { 0x0055, 0x0300 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 },
+  { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }, { 0x0000, 0x0000 }
+};
+
+/*
+ * NAME:	unicode->binary()
+ * DESCRIPTION:	compare two UTF-16 names unit by unit (case-sensitive HFSX)
+ */
+int u_binary(const UInteger *str1, unsigned int len1,
+	     const UInteger *str2, unsigned int len2)
+{
+  while (len1 && len2)
+    {
+      if (*str1 != *str2)
+	return (*str1 < *str2) ? -1 : 1;
+
+      ++str1, ++str2;
+      --len1, --len2;
+    }
+
+  return (len1 < len2) ? -1 : (len1 > len2);
+}
+
+/*
+ * NAME:	ishex()
+ * DESCRIPTION:	return the value of a hex digit, or -1
+ */
+static
+int ishex(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  else if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  else if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+
+  return -1;
+}
+
+/*
+ * NAME:	isescape()
+ * DESCRIPTION:	return the UTF-16 unit of a %uXXXX escape, or -1
+ */
+static
+long isescape(const unsigned char *str)
+{
+  long c = 0;
+  int i, d;
+
+  if (str[0] != '%' || str[1] != 'u')
+    return -1;
+
+  for (i = 2; i < 6; ++i)
+    {
+      d = ishex(str[i]);
+      if (d == -1)
+	return -1;
+
+      c = (c << 4) | d;
+    }
+
+  return c;
+}
+
+/*
+ * NAME:	tomac()
+ * DESCRIPTION:	convert a UTF-16 name to MacOS Standard Roman; return length
+ */
+static
+unsigned int tomac(char *dst, const UInteger *src, unsigned int len,
+		   int escape)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  char *start = dst;
+  UInteger c;
+  int i;
+
+  while (len--)
+    {
+      c = *src++;
+
+      if (c < 0x80)
+	{
+	  /* recompose a base letter followed by a combining mark */
+
+	  if (len && *src >= 0x0300 && *src < 0x0370)
+	    {
+	      for (i = 0; i < 128; ++i)
+		{
+		  if (macdecomp[i][0] == c && macdecomp[i][1] == *src)
+		    break;
+		}
+
+	      if (i < 128)
+		{
+		  *dst++ = 0x80 + i;
+		  ++src, --len;
+		  continue;
+		}
+	    }
+
+	  /* a literal escape, NUL and the path separator must be escaped */
+
+	  if (! escape ||
+	      (c != 0 && c != ':' &&
+	       ! (c == '%' && len >= 5 && src[0] == 'u' &&
+		  ishex(src[1]) != -1 && ishex(src[2]) != -1 &&
+		  ishex(src[3]) != -1 && ishex(src[4]) != -1)))
+	    {
+	      *dst++ = c;
+	      continue;
+	    }
+	}
+      else
+	{
+	  for (i = 0; i < 128 && macroman[i] != c; ++i)
+	    ;
+
+	  /* a precomposed letter would come back decomposed */
+
+	  if (i < 128 && ! (escape && macdecomp[i][0]))
+	    {
+	      *dst++ = 0x80 + i;
+	      continue;
+	    }
+	  else if (! escape)
+	    {
+	      *dst++ = '?';
+	      continue;
+	    }
+	}
+
+      *dst++ = '%';
+      *dst++ = 'u';
+      *dst++ = hex[(c >> 12) & 0xf];
+      *dst++ = hex[(c >>  8) & 0xf];
+      *dst++ = hex[(c >>  4) & 0xf];
+      *dst++ = hex[(c >>  0) & 0xf];
+    }
+
+  *dst = 0;
+
+  return dst - start;
+}
+
+/*
+ * NAME:	frommac()
+ * DESCRIPTION:	convert a MacOS Standard Roman name to decomposed UTF-16
+ */
+static
+unsigned int frommac(UInteger *dst, const char *src, unsigned int max,
+		     int escape)
+{
+  const unsigned char *ptr = (const unsigned char *) src;
+  unsigned int len = 0;
+  long u;
+  int c;
+
+  /* the returned length may exceed max; only max units are stored */
+
+  for ( ; *ptr; ++ptr)
+    {
+      c = *ptr;
+
+      if (escape && (u = isescape(ptr)) != -1)
+	{
+	  if (len < max)
+	    dst[len] = u;
+	  ++len;
+
+	  ptr += 5;
+	}
+      else if (c < 0x80)
+	{
+	  if (len < max)
+	    dst[len] = c;
+	  ++len;
+	}
+      else if (macdecomp[c - 0x80][0])
+	{
+	  if (len + 1 < max)
+	    {
+	      dst[len]     = macdecomp[c - 0x80][0];
+	      dst[len + 1] = macdecomp[c - 0x80][1];
+	    }
+	  len += 2;
+	}
+      else
+	{
+	  if (len < max)
+	    dst[len] = macroman[c - 0x80];
+	  ++len;
+	}
+    }
+
+  return len;
+}
+
+/*
+ * NAME:	unicode->tomac()
+ * DESCRIPTION:	convert a UTF-16 name to MacOS Standard Roman; return length
+ */
+unsigned int u_tomac(char *dst, const UInteger *src, unsigned int len)
+{
+  /* characters MacOS Roman lacks become '?' */
+
+  return tomac(dst, src, len, 0);
+}
+
+/*
+ * NAME:	unicode->frommac()
+ * DESCRIPTION:	convert a MacOS Standard Roman name to decomposed UTF-16
+ */
+unsigned int u_frommac(UInteger *dst, const char *src, unsigned int max)
+{
+  return frommac(dst, src, max, 0);
+}
+
+/*
+ * NAME:	unicode->toname()
+ * DESCRIPTION:	convert a UTF-16 catalog name to a MacOS Roman path name
+ */
+unsigned int u_toname(char *dst, const UInteger *src, unsigned int len)
+{
+  /*
+   * Anything that would not come back unchanged through u_fromname() is
+   * written as %uXXXX, so every catalog name can be named again in a path.
+   * dst must hold HFSPLUS_MAX_NLEN + 1 characters.
+   */
+
+  return tomac(dst, src, len, 1);
+}
+
+/*
+ * NAME:	unicode->fromname()
+ * DESCRIPTION:	convert a MacOS Roman path name back to a UTF-16 catalog name
+ */
+unsigned int u_fromname(UInteger *dst, const char *src, unsigned int max)
+{
+  return frommac(dst, src, max, 1);
+}
@@ -0,0 +1,26 @@
+/*
+ * libhfs - library for reading and writing Macintosh HFS volumes
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+int u_binary(const UInteger *, unsigned int, const UInteger *, unsigned int);
+
+unsigned int u_tomac(char *, const UInteger *, unsigned int);
+unsigned int u_frommac(UInteger *, const char *, unsigned int);
+
+unsigned int u_toname(char *, const UInteger *, unsigned int);
+unsigned int u_fromname(UInteger *, const char *, unsigned int);
@@ -38,6 +38,8 @@
 # include "btree.h"
 # include "record.h"
 # include "os.h"
+# include "plus.h"
+# include "extent.h"
 
 /*
  * NAME:	vol->init()
@@ -61,6 +63,8 @@ void v_init(hfsvol *vol, int flags)
   vol->vbm        = 0;
   vol->vbmsz      = 0;
 
+  vol->plus       = 0;
+
   f_init(&ext->f, vol, HFS_CNID_EXT, "extents overflow");
 
   ext->map        = 0;
@@ -210,6 +214,8 @@ int v_close(hfsvol *vol)
   vol->ext.map = 0;
   vol->cat.map = 0;
 
+  p_umount(vol);
+
 done:
   return result;
 }
@@ -252,23 +258,62 @@ int v_geometry(hfsvol *vol, int pnum)
 	    goto fail;
 	}
 
-      vol->vstart = map.pmPyPartStart;
-      vol->vlen   = map.pmPartBlkCnt;
+      if (v_partition(vol, &map) == -1)
+	goto fail;
+    }
 
-      if (map.pmDataCnt)
-	{
-	  if ((unsigned long) map.pmLgDataStart +
-	      (unsigned long) map.pmDataCnt > vol->vlen)
-	    ERROR(EINVAL, "partition data overflows partition");
+  if (vol->vlen < 800 * (1024 >> HFS_BLOCKSZ_BITS))
+    ERROR(EINVAL, "volume is smaller than 800K");
 
-	  vol->vstart += (unsigned long) map.pmLgDataStart;
-	  vol->vlen    = map.pmDataCnt;
-	}
+  return 0;
 
-      if (vol->vlen == 0)
-	ERROR(EINVAL, "volume partition is empty");
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	vol->partition()
+ * DESCRIPTION:	locate the volume within a partition map entry
+ */
+int v_partition(hfsvol *vol, const Partition *map)
+{
+  vol->vstart = map->pmPyPartStart;
+  vol->vlen   = map->pmPartBlkCnt;
+
+  if (map->pmDataCnt)
+    {
+      if ((unsigned long) map->pmLgDataStart +
+	  (unsigned long) map->pmDataCnt > vol->vlen)
+	ERROR(EINVAL, "partition data overflows partition");
+
+      vol->vstart += (unsigned long) map->pmLgDataStart;
+      vol->vlen    = map->pmDataCnt;
     }
 
+  if (vol->vlen == 0)
+    ERROR(EINVAL, "volume partition is empty");
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	vol->place()
+ * DESCRIPTION:	set volume location and size from a partition table entry
+ */
+int v_place(hfsvol *vol, const hfspartent *part)
+{
+  vol->pnum   = part->pnum;
+  vol->vstart = part->start;
+  vol->vlen   = part->length;
+
+  /* hfs_partitions() records an unusable map entry as empty */
+
+  if (vol->vlen == 0)
+    ERROR(EINVAL, "volume partition is empty or invalid");
+
   if (vol->vlen < 800 * (1024 >> HFS_BLOCKSZ_BITS))
     ERROR(EINVAL, "volume is smaller than 800K");
 
@@ -278,6 +323,43 @@ fail:
   return -1;
 }
 
+/*
+ * NAME:	vol->embedded()
+ * DESCRIPTION:	narrow the volume to the HFS+ volume inside an HFS wrapper
+ */
+int v_embedded(hfsvol *vol)
+{
+  unsigned long lpa, start, len;
+
+  lpa   = vol->mdb.drAlBlkSiz >> HFS_BLOCKSZ_BITS;
+  start = vol->mdb.drAlBlSt +
+    (unsigned long) vol->mdb.drEmbedExtent.xdrStABN * lpa;
+  len   = (unsigned long) vol->mdb.drEmbedExtent.xdrNumABlks * lpa;
+
+  if (len == 0 || start + len > vol->vlen)
+    ERROR(EIO, "bad embedded HFS+ volume extent");
+
+  /* cached blocks are numbered from the start of the wrapper */
+
+  if (vol->flags & HFS_VOL_USINGCACHE)
+    {
+      if (b_finish(vol) == -1)
+	goto fail;
+
+      if (b_init(vol) == -1)
+	vol->flags &= ~HFS_VOL_USINGCACHE;
+    }
+
+  vol->vstart += start;
+  vol->vlen    = len;
+  vol->flags  |= HFS_VOL_EMBEDDED;
+
+  return l_getmdb(vol, &vol->mdb, 0);
+
+fail:
+  return -1;
+}
+
 /*
  * NAME:	vol->readmdb()
  * DESCRIPTION:	load Master Directory Block into memory
@@ -429,6 +511,22 @@ fail:
  */
 int v_mount(hfsvol *vol)
 {
+  /* HFS+ volumes are handled separately (and read-only) */
+
+  if (l_getmdb(vol, &vol->mdb, 0) == -1)
+    goto fail;
+
+  /* an HFS wrapper may hide an HFS+ volume; mount that one instead */
+
+  if (vol->mdb.drSigWord == HFS_SIGWORD &&
+      vol->mdb.drEmbedSigWord == HFSPLUS_SIGWORD &&
+      v_embedded(vol) == -1)
+    goto fail;
+
+  if (vol->mdb.drSigWord == HFSPLUS_SIGWORD ||
+      vol->mdb.drSigWord == HFSPLUS_SIGWORD_X)
+    return p_mount(vol);
+
   /* read the MDB, volume bitmap, and extents/catalog B*-tree headers */
 
   if (v_readmdb(vol) == -1 ||
@@ -494,6 +592,9 @@ int v_catsearch(hfsvol *vol, unsigned long parid, const char *name,
   node n;
   int found;
 
+  if (vol->plus)
+    return p_catsearch(vol, parid, name, data, cname);
+
   if (np == 0)
     np = &n;
 
@@ -571,6 +672,9 @@ int v_getthread(hfsvol *vol, unsigned long id,
   CatDataRec rec;
   int found;
 
+  if (vol->plus)
+    return p_getthread(vol, id, thread, type);
+
   if (thread == 0)
     thread = &rec;
 
@@ -779,6 +883,9 @@ int v_resolve(hfsvol **vol, const char *path,
       if (*path == ':')
 	++path;
 
+      if ((*vol)->plus)
+	return p_resolve(*vol, dirid, path, data, parid, fname);
+
       if (*path == 0)
 	{
 	  found = v_getdthread(*vol, dirid, data, 0);
@@ -819,6 +926,9 @@ int v_resolve(hfsvol **vol, const char *path,
 	      break;
 	    }
 	}
+
+      if ((*vol)->plus)
+	return p_resolve(*vol, dirid, path, data, parid, fname);
     }
 
   while (1)
@@ -1200,3 +1310,347 @@ done:
 fail:
   return -1;
 }
+
+/*
+ * NAME:	evictfork()
+ * DESCRIPTION:	move one fork out of the block range being emptied
+ */
+static
+int evictfork(hfsfile *file, void *range)
+{
+  const unsigned int *r = range;
+
+  return e_evict(file, r[0], r[1]);
+}
+
+/*
+ * NAME:	evict()
+ * DESCRIPTION:	move every allocated block in [lo, hi) somewhere else
+ */
+static
+int evict(hfsvol *vol, unsigned int lo, unsigned int hi)
+{
+  block *vbm = vol->vbm;
+  byte *fence;
+  unsigned int range[2], used, pt;
+  int result;
+
+  /* fence off the free blocks of the range from the allocator */
+
+  fence = ALLOC(byte, ((hi - lo) >> 3) + 1);
+  if (fence == 0)
+    ERROR(ENOMEM, 0);
+
+  memset(fence, 0, ((hi - lo) >> 3) + 1);
+
+  for (used = 0, pt = lo; pt < hi; ++pt)
+    {
+      if (BMTST(vbm, pt))
+	++used;
+      else
+	{
+	  BMSET(vbm, pt);
+	  BMSET(fence, pt - lo);
+	}
+    }
+
+  vol->mdb.drFreeBks -= hi - lo - used;
+
+  if (vol->mdb.drFreeBks < used)
+    {
+      result = -1;
+      hfs_error = "not enough free space to move the blocks in use";
+      errno = ENOSPC;
+    }
+  else
+    {
+      range[0] = lo;
+      range[1] = hi;
+
+      result = e_forall(vol, evictfork, range);
+    }
+
+  /* on success nothing owns the range any more, so clear all of it */
+
+  for (pt = lo; pt < hi; ++pt)
+    {
+      if (BMTST(vbm, pt) && (result == 0 || BMTST(fence, pt - lo)))
+	{
+	  BMCLR(vbm, pt);
+	  ++vol->mdb.drFreeBks;
+	}
+    }
+
+  vol->flags |= HFS_VOL_UPDATE_MDB | HFS_VOL_UPDATE_VBM;
+
+  FREE(fence);
+
+  return result;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	shiftexts()
+ * DESCRIPTION:	renumber the blocks of an extent record
+ */
+static
+void shiftexts(ExtDataRec *exts, unsigned int shift)
+{
+  int i;
+
+  for (i = 0; i < 3; ++i)
+    {
+      if ((*exts)[i].xdrNumABlks)
+	(*exts)[i].xdrStABN -= shift;
+    }
+}
+
+/*
+ * NAME:	renumber()
+ * DESCRIPTION:	start the allocation blocks later on the medium so the
+ *		volume bitmap can grow into the first (emptied) blocks
+ */
+static
+int renumber(hfsvol *vol, unsigned int shift)
+{
+  block *vbm = vol->vbm;
+  node n;
+  unsigned int pt;
+
+  /* file records first; the catalog is read through the old numbering */
+
+  if (vol->cat.hdr.bthFNode > 0)
+    {
+      if (bt_getnode(&n, &vol->cat, vol->cat.hdr.bthFNode) == -1)
+	goto fail;
+
+      n.rnum = 0;
+
+      while (1)
+	{
+	  CatDataRec data;
+
+	  while (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink > 0)
+	    {
+	      if (bt_getnode(&n, &vol->cat, n.nd.ndFLink) == -1)
+		goto fail;
+
+	      n.rnum = 0;
+	    }
+
+	  if (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink == 0)
+	    break;
+
+	  r_unpackcatdata(HFS_RECDATA(HFS_NODEREC(n, n.rnum)), &data);
+
+	  if (data.cdrType == cdrFilRec)
+	    {
+	      shiftexts(&data.u.fil.filExtRec,  shift);
+	      shiftexts(&data.u.fil.filRExtRec, shift);
+
+	      data.u.fil.filStBlk  = data.u.fil.filExtRec[0].xdrStABN;
+	      data.u.fil.filRStBlk = data.u.fil.filRExtRec[0].xdrStABN;
+
+	      if (v_putcatrec(&data, &n) == -1)
+		goto fail;
+	    }
+
+	  ++n.rnum;
+	}
+    }
+
+  /* then the extents overflow records */
+
+  if (vol->ext.hdr.bthFNode > 0)
+    {
+      if (bt_getnode(&n, &vol->ext, vol->ext.hdr.bthFNode) == -1)
+	goto fail;
+
+      n.rnum = 0;
+
+      while (1)
+	{
+	  ExtDataRec data;
+
+	  while (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink > 0)
+	    {
+	      if (bt_getnode(&n, &vol->ext, n.nd.ndFLink) == -1)
+		goto fail;
+
+	      n.rnum = 0;
+	    }
+
+	  if (n.rnum >= n.nd.ndNRecs && n.nd.ndFLink == 0)
+	    break;
+
+	  r_unpackextdata(HFS_RECDATA(HFS_NODEREC(n, n.rnum)), &data);
+	  shiftexts(&data, shift);
+
+	  if (v_putextrec(&data, &n) == -1)
+	    goto fail;
+
+	  ++n.rnum;
+	}
+    }
+
+  /* and last the two B*-tree files, whose blocks keep their sectors */
+
+  shiftexts(&vol->ext.f.cat.u.fil.filExtRec, shift);
+  shiftexts(&vol->cat.f.cat.u.fil.filExtRec, shift);
+
+  f_selectfork(&vol->ext.f, fkData);
+  f_selectfork(&vol->cat.f, fkData);
+
+  vol->mdb.drAlBlSt  += shift * vol->lpa;
+  vol->mdb.drNmAlBlks -= shift;
+  vol->mdb.drFreeBks  -= shift;
+  vol->mdb.drAllocPtr = 0;
+
+  for (pt = 0; pt < vol->mdb.drNmAlBlks; ++pt)
+    {
+      if (BMTST(vbm, pt + shift))
+	BMSET(vbm, pt);
+      else
+	BMCLR(vbm, pt);
+    }
+
+  for ( ; pt < vol->mdb.drNmAlBlks + shift; ++pt)
+    BMCLR(vbm, pt);
+
+  vol->flags |= HFS_VOL_UPDATE_MDB | HFS_VOL_UPDATE_ALTMDB |
+    HFS_VOL_UPDATE_VBM;
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	setblocks()
+ * DESCRIPTION:	change the number of allocation blocks and size the bitmap
+ */
+static
+int setblocks(hfsvol *vol, unsigned int nblocks)
+{
+  unsigned int vbmsz, pt, blks;
+
+  vbmsz = (nblocks + 0x0fff) >> 12;
+
+  if (vbmsz != vol->vbmsz)
+    {
+      block *vbm;
+
+      vbm = REALLOC(vol->vbm, block, vbmsz);
+      if (vbm == 0)
+	ERROR(ENOMEM, 0);
+
+      if (vbmsz > vol->vbmsz)
+	memset(vbm + vol->vbmsz, 0,
+	       (vbmsz - vol->vbmsz) << HFS_BLOCKSZ_BITS);
+
+      vol->vbm   = vbm;
+      vol->vbmsz = vbmsz;
+    }
+
+  /* new blocks start out free; bits past the end stay clear */
+
+  pt = vol->mdb.drNmAlBlks < nblocks ? vol->mdb.drNmAlBlks : nblocks;
+  for ( ; pt < vbmsz << 12; ++pt)
+    BMCLR(vol->vbm, pt);
+
+  for (blks = 0, pt = nblocks; pt--; )
+    {
+      if (! BMTST(vol->vbm, pt))
+	++blks;
+    }
+
+  vol->mdb.drNmAlBlks = nblocks;
+  vol->mdb.drFreeBks  = blks;
+
+  if (vol->mdb.drAllocPtr >= nblocks)
+    vol->mdb.drAllocPtr = 0;
+
+  vol->flags |= HFS_VOL_UPDATE_MDB | HFS_VOL_UPDATE_VBM;
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	vol->resize()
+ * DESCRIPTION:	grow or shrink a volume to a new number of logical blocks
+ */
+int v_resize(hfsvol *vol, unsigned long len)
+{
+  unsigned long alblst, nblocks, oldlen = vol->vlen;
+  unsigned int shift = 0;
+  block b;
+
+  if (vol->flags & HFS_VOL_READONLY)
+    ERROR(EROFS, 0);
+
+  if (len < 800 * (1024 >> HFS_BLOCKSZ_BITS))
+    ERROR(EINVAL, "volume would be smaller than 800K");
+
+  if (vol->pnum > 0 && len > vol->vlen)
+    ERROR(EINVAL, "volume would not fit in its partition");
+
+  /* growing past the room of the bitmap moves the first block along */
+
+  for (alblst = vol->mdb.drAlBlSt; ; alblst += vol->lpa, ++shift)
+    {
+      if (len < alblst + 2 + vol->lpa)
+	ERROR(EINVAL, "volume too small for its own metadata");
+
+      nblocks = (len - 2 - alblst) / vol->lpa;
+      if (nblocks > 65535)
+	ERROR(EINVAL, "volume too large for its allocation block size");
+
+      if (nblocks <= (alblst - vol->mdb.drVBMSt) << 12)
+	break;
+    }
+
+  if (shift >= vol->mdb.drNmAlBlks)
+    ERROR(EINVAL, "volume bitmap cannot grow that far");
+
+  /* make sure the medium reaches the new end before touching anything */
+
+  if (len > oldlen)
+    {
+      memset(&b, 0, sizeof(b));
+
+      if (b_writepb(vol, vol->vstart + len - 1, &b, 1) == -1)
+	goto fail;
+    }
+
+  if (shift &&
+      (evict(vol, 0, shift) == -1 ||
+       renumber(vol, shift) == -1))
+    goto fail;
+
+  if (nblocks < vol->mdb.drNmAlBlks &&
+      evict(vol, nblocks, vol->mdb.drNmAlBlks) == -1)
+    goto fail;
+
+  if (setblocks(vol, nblocks) == -1)
+    goto fail;
+
+  vol->vlen   = len;
+  vol->flags |= HFS_VOL_UPDATE_MDB | HFS_VOL_UPDATE_ALTMDB;
+
+  /* the old alternate MDB is free space now */
+
+  if (len > oldlen &&
+      b_writelb(vol, oldlen - 2, &b) == -1)
+    goto fail;
+
+  return 0;
+
+fail:
+  return -1;
+}
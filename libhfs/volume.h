@@ -27,6 +27,9 @@ int v_close(hfsvol *);
 
 int v_same(hfsvol *, const char *);
 int v_geometry(hfsvol *, int);
+int v_partition(hfsvol *, const Partition *);
+int v_place(hfsvol *, const hfspartent *);
+int v_embedded(hfsvol *);
 
 int v_readmdb(hfsvol *);
 int v_writemdb(hfsvol *);
@@ -60,3 +63,4 @@ int v_adjvalence(hfsvol *, unsigned long, int, int);
 int v_mkdir(hfsvol *, unsigned long, const char *);
 
 int v_scavenge(hfsvol *);
+int v_resize(hfsvol *, unsigned long);
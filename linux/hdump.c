@@ -20,38 +20,1130 @@
  */
 
 # include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <errno.h>
 
 # include "libhfs.h"
 # include "volume.h"
+# include "block.h"
 # include "low.h"
 # include "data.h"
+# include "plus.h"
 
-int main(int argc, char *argv[])
+/*
+ * With -j or -b, the volume structures are dumped instead of the partition
+ * map: the MDB or HFS+ volume header, every node in use in each B*-tree,
+ * and a summary of the allocation bitmap.  Each special file is read front
+ * to back in runs of up to HDUMP_CHUNK blocks, so even a huge volume is
+ * dumped with a few large sequential reads per tree.  The extents overflow
+ * tree is dumped first; the overflow extents of the other special files are
+ * collected from its leaves on the way.
+ *
+ * The binary dump is "HDMP" and a 32-bit version, then records of a 4-byte
+ * tag, a 32-bit payload length and the payload, all big-endian:
+ *
+ *   VLOC  partition number, first block and length of the volume
+ *   WRAP  the HFS wrapper's MDB, when the volume is embedded
+ *   VOLH  the MDB or HFS+ volume header, as on disk
+ *   TREE  file ID, node size and node count of the tree that follows
+ *   NODE  node number, then the node as on disk (nodes in use only)
+ *   BMAP  blocks, used, free, free runs, longest free run, then the used
+ *         blocks in each of HDUMP_SEGS equal parts of the volume
+ *   END   (empty)
+ */
+
+# define HDUMP_CHUNK	2048	/* blocks per read (1 MB) */
+# define HDUMP_SEGS	32	/* bitmap summary segments */
+
+# define HDUMP_VERSION	1	/* binary dump format version */
+
+enum {
+  DUMP_MAP,			/* driver descriptor and partition map */
+  DUMP_JSON,			/* volume structures as JSON */
+  DUMP_BINARY			/* volume structures as tagged records */
+};
+
+typedef struct {
+  unsigned long bnum;		/* first block, relative to the volume */
+  unsigned long count;		/* number of blocks */
+} span;
+
+typedef struct {
+  unsigned long cnid;		/* file ID */
+  unsigned long fabn;		/* first fork allocation block */
+  unsigned long start;		/* first volume allocation block */
+  unsigned long count;		/* number of allocation blocks */
+} overflow;
+
+typedef struct {
+  const char *name;		/* tree name */
+  unsigned long cnid;		/* file ID of the tree file */
+  span *spans;			/* location of the tree file */
+  unsigned int nspans;
+  unsigned long nodesz;		/* bytes per node */
+  unsigned long nnodes;		/* nodes in the tree file */
+  byte *map;			/* node allocation bitmap */
+  byte *node;			/* node being assembled */
+  unsigned long fill;		/* bytes of it read so far */
+  unsigned long nnum;		/* its node number */
+  unsigned long emitted;	/* nodes dumped so far */
+} dumptree;
+
+typedef struct {
+  unsigned long total;		/* allocation blocks in the volume */
+  unsigned long pos;		/* blocks counted so far */
+  unsigned long used;
+  unsigned long runs;		/* runs of free blocks */
+  unsigned long largest;	/* longest free run */
+  unsigned long run;		/* current free run */
+  unsigned long seg[HDUMP_SEGS];  /* used blocks per segment */
+} bitmap;
+
+typedef int (*sinkfunc)(void *, const byte *, unsigned long);
+
+typedef struct {
+  const char *name;		/* JSON member */
+  unsigned int offs;		/* byte offset in the block */
+  unsigned int size;		/* 2, 4 or 8 bytes */
+} field;
+
+static const field mdbfields[] = {
+  { "signature",	  0, 2 },
+  { "create_date",	  2, 4 },
+  { "modify_date",	  6, 4 },
+  { "attributes",	 10, 2 },
+  { "root_files",	 12, 2 },
+  { "bitmap_start",	 14, 2 },
+  { "next_alloc",	 16, 2 },
+  { "total_blocks",	 18, 2 },
+  { "block_size",	 20, 4 },
+  { "clump_size",	 24, 4 },
+  { "first_block",	 28, 2 },
+  { "next_id",		 30, 4 },
+  { "free_blocks",	 34, 2 },
+  { "backup_date",	 64, 4 },
+  { "backup_seq",	 68, 2 },
+  { "write_count",	 70, 4 },
+  { "ext_clump_size",	 74, 4 },
+  { "cat_clump_size",	 78, 4 },
+  { "root_dirs",	 82, 2 },
+  { "file_count",	 84, 4 },
+  { "folder_count",	 88, 4 },
+  { "embed_signature",	124, 2 },
+  { "embed_start",	126, 2 },
+  { "embed_count",	128, 2 },
+  { "ext_size",		130, 4 },
+  { "cat_size",		146, 4 },
+  { 0,			  0, 0 }
+};
+
+static const field vhfields[] = {
+  { "signature",	  0, 2 },
+  { "version",		  2, 2 },
+  { "attributes",	  4, 4 },
+  { "last_mounted",	  8, 4 },
+  { "journal_block",	 12, 4 },
+  { "create_date",	 16, 4 },
+  { "modify_date",	 20, 4 },
+  { "backup_date",	 24, 4 },
+  { "checked_date",	 28, 4 },
+  { "file_count",	 32, 4 },
+  { "folder_count",	 36, 4 },
+  { "block_size",	 40, 4 },
+  { "total_blocks",	 44, 4 },
+  { "free_blocks",	 48, 4 },
+  { "next_alloc",	 52, 4 },
+  { "rsrc_clump_size",	 56, 4 },
+  { "data_clump_size",	 60, 4 },
+  { "next_id",		 64, 4 },
+  { "write_count",	 68, 4 },
+  { "encodings",	 72, 8 },
+  { 0,			  0, 0 }
+};
+
+static const char *plusforks[] = {
+  "allocation", "extents", "catalog", "attributes", "startup"
+};
+
+static hfsvol vol;
+static int mode = DUMP_MAP;
+static int plus;		/* dumping an HFS+ volume */
+static unsigned long abase;	/* block of allocation block 0 */
+static unsigned long lpa;	/* blocks per allocation block */
+static byte *chunk;		/* read buffer */
+
+static overflow *ovf;		/* special file overflow extents */
+static unsigned long novf, ovfsz;
+
+/* Output Routines ========================================================= */
+
+/*
+ * NAME:	puthex()
+ * DESCRIPTION:	write bytes as a JSON hexadecimal string
+ */
+static
+void puthex(const byte *ptr, unsigned long len)
 {
-  hfsvol vol;
-  Block0 ddr;
-  Partition map;
-  unsigned long bnum;
+  static const char digits[] = "0123456789abcdef";
+
+  putchar('"');
+
+  while (len--)
+    {
+      putchar(digits[*ptr >> 4]);
+      putchar(digits[*ptr++ & 0x0f]);
+    }
+
+  putchar('"');
+}
+
+/*
+ * NAME:	putname()
+ * DESCRIPTION:	write a Pascal string as JSON, escaping all but printable ASCII
+ */
+static
+void putname(const byte *pstr, unsigned int max)
+{
+  unsigned int len, i;
+
+  len = pstr[0] < max ? pstr[0] : max;
+
+  putchar('"');
+
+  for (i = 1; i <= len; ++i)
+    {
+      if (pstr[i] == '"' || pstr[i] == '\\')
+	printf("\\%c", pstr[i]);
+      else if (pstr[i] < 0x20 || pstr[i] >= 0x7f)
+	printf("\\u%04x", pstr[i]);
+      else
+	putchar(pstr[i]);
+    }
+
+  putchar('"');
+}
+
+/*
+ * NAME:	putrec()
+ * DESCRIPTION:	start a binary record: tag, then payload length
+ */
+static
+void putrec(const char *tag, unsigned long len)
+{
+  byte hdr[8];
+
+  memcpy(hdr, tag, 4);
+  d_putul(hdr + 4, len);
+
+  fwrite(hdr, 1, 8, stdout);
+}
+
+/*
+ * NAME:	put32()
+ * DESCRIPTION:	write a binary big-endian 32-bit value
+ */
+static
+void put32(unsigned long value)
+{
+  byte buf[4];
+
+  d_putul(buf, value);
+
+  fwrite(buf, 1, 4, stdout);
+}
+
+/*
+ * NAME:	putfields()
+ * DESCRIPTION:	write the decoded fields of an MDB or volume header as JSON
+ */
+static
+void putfields(const byte *ptr, const field *fields)
+{
+  const field *f;
+
+  for (f = fields; f->name; ++f)
+    {
+      printf("\"%s\":", f->name);
+
+      if (f->size == 2)
+	printf("%u", d_getuw(ptr + f->offs));
+      else if (f->size == 4)
+	printf("%lu", d_getul(ptr + f->offs));
+      else
+	puthex(ptr + f->offs, f->size);
+
+      putchar(',');
+    }
+}
+
+/* Special File Routines =================================================== */
+
+/*
+ * NAME:	addspan()
+ * DESCRIPTION:	append an extent of allocation blocks to a file's spans
+ */
+static
+int addspan(span **spans, unsigned int *nspans,
+	    unsigned long start, unsigned long count)
+{
+  span *grow;
+
+  if (count == 0)
+    return 0;
+
+  grow = REALLOC(*spans, span, *nspans + 1);
+  if (grow == 0)
+    ERROR(ENOMEM, 0);
+
+  *spans = grow;
+
+  grow[*nspans].bnum  = abase + start * lpa;
+  grow[*nspans].count = count * lpa;
+  ++*nspans;
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	byfabn()
+ * DESCRIPTION:	qsort() comparison of overflow extents
+ */
+static
+int byfabn(const void *p1, const void *p2)
+{
+  const overflow *o1 = p1, *o2 = p2;
+
+  if (o1->cnid != o2->cnid)
+    return (o1->cnid > o2->cnid) - (o1->cnid < o2->cnid);
+
+  return (o1->fabn > o2->fabn) - (o1->fabn < o2->fabn);
+}
+
+/*
+ * NAME:	addoverflow()
+ * DESCRIPTION:	append the overflow extents found for a file to its spans
+ */
+static
+int addoverflow(unsigned long cnid, span **spans, unsigned int *nspans)
+{
+  unsigned long i;
+
+  qsort(ovf, novf, sizeof(overflow), byfabn);
+
+  for (i = 0; i < novf; ++i)
+    {
+      if (ovf[i].cnid == cnid &&
+	  addspan(spans, nspans, ovf[i].start, ovf[i].count) == -1)
+	return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * NAME:	collect()
+ * DESCRIPTION:	remember the extents of an extents overflow leaf record that
+ *		belong to a special file
+ */
+static
+int collect(const byte *key, const byte *data)
+{
+  unsigned long cnid, fabn;
+  int fork, i, nexts;
+
+  if (plus)
+    {
+      fork  = key[2];
+      cnid  = d_getul(key + 4);
+      fabn  = d_getul(key + 8);
+      nexts = 8;
+    }
+  else
+    {
+      fork  = key[1];
+      cnid  = d_getul(key + 2);
+      fabn  = d_getuw(key + 6);
+      nexts = 3;
+    }
+
+  if (fork != 0 || (cnid != HFS_CNID_CAT && cnid != 6 && cnid != 8))
+    return 0;
+
+  for (i = 0; i < nexts; ++i)
+    {
+      overflow *ov;
+      unsigned long start, count;
+
+      start = plus ? d_getul(data + i * 8)     : d_getuw(data + i * 4);
+      count = plus ? d_getul(data + i * 8 + 4) : d_getuw(data + i * 4 + 2);
+
+      if (count == 0)
+	break;
+
+      if (novf == ovfsz)
+	{
+	  ov = REALLOC(ovf, overflow, ovfsz ? ovfsz * 2 : 16);
+	  if (ov == 0)
+	    ERROR(ENOMEM, 0);
+
+	  ovf   = ov;
+	  ovfsz = ovfsz ? ovfsz * 2 : 16;
+	}
+
+      ov = &ovf[novf++];
+
+      ov->cnid  = cnid;
+      ov->fabn  = fabn;
+      ov->start = start;
+      ov->count = count;
+
+      fabn += count;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	readfile()
+ * DESCRIPTION:	read len bytes at offset (a multiple of the block size) of a
+ *		special file
+ */
+static
+int readfile(const span *spans, unsigned int nspans, unsigned long offset,
+	     byte *buf, unsigned long len)
+{
+  unsigned long bnum = offset >> HFS_BLOCKSZ_BITS;
+  unsigned int i;
+
+  for (i = 0; i < nspans && len; ++i)
+    {
+      unsigned long n;
+
+      if (bnum >= spans[i].count)
+	{
+	  bnum -= spans[i].count;
+	  continue;
+	}
+
+      n = spans[i].count - bnum;
+      if (n > len >> HFS_BLOCKSZ_BITS)
+	n = len >> HFS_BLOCKSZ_BITS;
+
+      if (b_readpb(&vol, vol.vstart + spans[i].bnum + bnum,
+		   (block *) buf, n) == -1)
+	return -1;
+
+      buf += n << HFS_BLOCKSZ_BITS;
+      len -= n << HFS_BLOCKSZ_BITS;
+      bnum = 0;
+    }
+
+  if (len)
+    ERROR(EIO, "special file is shorter than its header claims");
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	stream()
+ * DESCRIPTION:	read the first len bytes of a special file in large runs,
+ *		passing each run to a sink
+ */
+static
+int stream(const span *spans, unsigned int nspans, unsigned long len,
+	   sinkfunc sink, void *ctx)
+{
+  unsigned int i;
+
+  for (i = 0; i < nspans && len; ++i)
+    {
+      unsigned long done = 0;
+
+      while (done < spans[i].count && len)
+	{
+	  unsigned long n, bytes;
+
+	  n = spans[i].count - done;
+	  if (n > HDUMP_CHUNK)
+	    n = HDUMP_CHUNK;
+
+	  if (n > (len + HFS_BLOCKSZ - 1) >> HFS_BLOCKSZ_BITS)
+	    n = (len + HFS_BLOCKSZ - 1) >> HFS_BLOCKSZ_BITS;
+
+	  if (b_readpb(&vol, vol.vstart + spans[i].bnum + done,
+		       (block *) chunk, n) == -1)
+	    return -1;
+
+	  bytes = n << HFS_BLOCKSZ_BITS;
+	  if (bytes > len)
+	    bytes = len;
+
+	  if (sink(ctx, chunk, bytes) == -1)
+	    return -1;
+
+	  done += n;
+	  len  -= bytes;
+	}
+    }
+
+  if (len)
+    ERROR(EIO, "special file is shorter than its header claims");
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/* B*-tree Routines ======================================================== */
+
+/*
+ * NAME:	recoffs()
+ * DESCRIPTION:	return the offset of a record in a node (nrecs for free space)
+ */
+static
+unsigned int recoffs(const dumptree *tree, const byte *node, unsigned int rnum)
+{
+  return d_getuw(node + tree->nodesz - 2 * (rnum + 1));
+}
+
+/*
+ * NAME:	checknode()
+ * DESCRIPTION:	return 0 if a node's record offsets are sane, else -1
+ */
+static
+int checknode(const dumptree *tree, const byte *node)
+{
+  unsigned int nrecs, rnum, offs, prev = 14;
+
+  nrecs = d_getuw(node + 10);
+  if (14 + 2 * (nrecs + 1) > tree->nodesz)
+    return -1;
+
+  for (rnum = 0; rnum <= nrecs; ++rnum)
+    {
+      offs = recoffs(tree, node, rnum);
+      if (offs < prev || offs > tree->nodesz - 2 * (nrecs + 1))
+	return -1;
+
+      prev = offs;
+    }
+
+  return 0;
+}
+
+/*
+ * NAME:	keylen()
+ * DESCRIPTION:	return the bytes taken by the key at the start of a record
+ */
+static
+unsigned int keylen(const byte *rec)
+{
+  if (plus)
+    return 2 + d_getuw(rec);
+
+  return (1 + rec[0] + 1) & ~1;
+}
+
+/*
+ * NAME:	loadmap()
+ * DESCRIPTION:	read a tree's header node and map nodes; build its node map
+ */
+static
+int loadmap(dumptree *tree, byte *hdr)
+{
+  unsigned long nnum, mapped, seen = 0;
+  byte *node = 0;
+
+  if (readfile(tree->spans, tree->nspans, 0, hdr, HFS_BLOCKSZ) == -1)
+    goto fail;
+
+  tree->nodesz = d_getuw(hdr + 14 + 18);
+  tree->nnodes = d_getul(hdr + 14 + 22);
+
+  if (tree->nodesz < HFS_BLOCKSZ || tree->nodesz > HFSPLUS_NODESZ_MAX ||
+      (tree->nodesz & (tree->nodesz - 1)) || hdr[8] != ndHdrNode)
+    ERROR(EIO, "bad B*-tree header node");
+
+  tree->map  = ALLOC(byte, (tree->nnodes + 7) >> 3);
+  tree->node = ALLOC(byte, tree->nodesz);
+  node       = ALLOC(byte, tree->nodesz);
+
+  if (tree->map == 0 || tree->node == 0 || node == 0)
+    ERROR(ENOMEM, 0);
+
+  memset(tree->map, 0, (tree->nnodes + 7) >> 3);
+
+  /* the header node holds the first map record, map nodes the rest */
+
+  nnum   = 0;
+  mapped = 0;
+
+  do
+    {
+      unsigned int rnum, from, to;
+
+      if (++seen > tree->nnodes)
+	ERROR(EIO, "B*-tree map node chain loops");
+
+      if (readfile(tree->spans, tree->nspans, nnum * tree->nodesz,
+		   node, tree->nodesz) == -1)
+	goto fail;
+
+      if (checknode(tree, node) == -1)
+	ERROR(EIO, "bad B*-tree map node");
+
+      rnum = nnum ? 0 : 2;
+      if (rnum >= d_getuw(node + 10))
+	ERROR(EIO, "B*-tree map record missing");
+
+      from = recoffs(tree, node, rnum);
+      to   = recoffs(tree, node, rnum + 1);
+
+      for ( ; from < to && mapped < tree->nnodes; ++from, mapped += 8)
+	tree->map[mapped >> 3] = node[from];
+
+      nnum = d_getul(node + 0);
+    }
+  while (nnum && mapped < tree->nnodes);
+
+  FREE(node);
+
+  return 0;
+
+fail:
+  FREE(node);
+
+  return -1;
+}
+
+/*
+ * NAME:	dumpnode()
+ * DESCRIPTION:	write one node in use
+ */
+static
+int dumpnode(dumptree *tree, const byte *node, unsigned long nnum)
+{
+  static const char *kinds[] = { "index", "header", "map" };
+  int kind = (signed char) node[8];
+  unsigned int nrecs, rnum, from, to, klen;
+
+  if (mode == DUMP_BINARY)
+    {
+      putrec("NODE", 4 + tree->nodesz);
+      put32(nnum);
+      fwrite(node, 1, tree->nodesz, stdout);
+    }
+  else
+    printf("%s{\"node\":%lu,", tree->emitted ? "," : "", nnum);
+
+  ++tree->emitted;
+
+  if (checknode(tree, node) == -1 || kind < ndLeafNode || kind > ndMapNode)
+    {
+      if (mode == DUMP_JSON)
+	{
+	  printf("\"error\":\"bad node\",\"raw\":");
+	  puthex(node, tree->nodesz);
+	  printf("}");
+	}
+
+      return 0;
+    }
+
+  nrecs = d_getuw(node + 10);
+
+  if (mode == DUMP_JSON)
+    printf("\"kind\":\"%s\",\"height\":%u,\"flink\":%lu,\"blink\":%lu,"
+	   "\"free\":%lu,\"records\":[", kind == ndLeafNode ? "leaf" :
+	   kinds[kind], node[9], d_getul(node + 0), d_getul(node + 4),
+	   tree->nodesz - 2 * (nrecs + 1) - recoffs(tree, node, nrecs));
+
+  for (rnum = 0; rnum < nrecs; ++rnum)
+    {
+      from = recoffs(tree, node, rnum);
+      to   = recoffs(tree, node, rnum + 1);
+
+      if (mode == DUMP_JSON)
+	printf("%s", rnum ? "," : "");
+
+      if (kind != ndLeafNode && kind != ndIndxNode)
+	{
+	  if (mode == DUMP_JSON)
+	    puthex(node + from, to - from);
+
+	  continue;
+	}
+
+      klen = keylen(node + from);
+      if (from + klen > to)
+	klen = to - from;
+
+      if (mode == DUMP_JSON)
+	{
+	  putchar('[');
+	  puthex(node + from, klen);
+	  putchar(',');
+	  puthex(node + from + klen, to - from - klen);
+	  putchar(']');
+	}
+
+      if (tree->cnid == HFS_CNID_EXT && kind == ndLeafNode &&
+	  to - from - klen >= (plus ? 64U : 12U) &&
+	  collect(node + from, node + from + klen) == -1)
+	return -1;
+    }
+
+  if (mode == DUMP_JSON)
+    printf("]}");
+
+  return 0;
+}
+
+/*
+ * NAME:	nodesink()
+ * DESCRIPTION:	assemble streamed tree file data into nodes
+ */
+static
+int nodesink(void *ctx, const byte *data, unsigned long len)
+{
+  dumptree *tree = ctx;
+
+  while (len)
+    {
+      unsigned long n = tree->nodesz - tree->fill;
+
+      if (n > len)
+	n = len;
+
+      memcpy(tree->node + tree->fill, data, n);
+
+      tree->fill += n;
+      data       += n;
+      len        -= n;
+
+      if (tree->fill < tree->nodesz)
+	break;
+
+      if (BMTST(tree->map, tree->nnum) &&
+	  dumpnode(tree, tree->node, tree->nnum) == -1)
+	return -1;
+
+      tree->fill = 0;
+      ++tree->nnum;
+    }
+
+  return 0;
+}
+
+/*
+ * NAME:	dumpbtree()
+ * DESCRIPTION:	write a B*-tree: its header record, then every node in use
+ */
+static
+int dumpbtree(dumptree *tree)
+{
+  block hdr;
+  const byte *rec = hdr + 14;
+
+  if (tree->nspans == 0)
+    return 0;
+
+  if (loadmap(tree, hdr) == -1)
+    return -1;
+
+  if (mode == DUMP_BINARY)
+    {
+      putrec("TREE", 12);
+      put32(tree->cnid);
+      put32(tree->nodesz);
+      put32(tree->nnodes);
+    }
+  else
+    {
+      printf("%s{\"name\":\"%s\",\"id\":%lu,\"header\":{\"depth\":%u,"
+	     "\"root\":%lu,\"leaf_records\":%lu,\"first_leaf\":%lu,"
+	     "\"last_leaf\":%lu,\"node_size\":%u,\"max_key_len\":%u,"
+	     "\"total_nodes\":%lu,\"free_nodes\":%lu", tree->cnid == HFS_CNID_EXT ?
+	     "" : ",", tree->name, tree->cnid,
+	     d_getuw(rec + 0), d_getul(rec + 2), d_getul(rec + 6),
+	     d_getul(rec + 10), d_getul(rec + 14), d_getuw(rec + 18),
+	     d_getuw(rec + 20), d_getul(rec + 22), d_getul(rec + 26));
+
+      if (plus)
+	printf(",\"clump_size\":%lu,\"type\":%u,\"key_compare\":%u,"
+	       "\"attributes\":%lu", d_getul(rec + 32), rec[36], rec[37],
+	       d_getul(rec + 38));
+
+      printf("},\"nodes\":[");
+    }
+
+  if (stream(tree->spans, tree->nspans, tree->nnodes * tree->nodesz,
+	     nodesink, tree) == -1)
+    return -1;
+
+  if (mode == DUMP_JSON)
+    printf("]}");
+
+  return 0;
+}
+
+/* Bitmap Routines ========================================================= */
+
+/*
+ * NAME:	bitsink()
+ * DESCRIPTION:	count used blocks and free runs in streamed bitmap data
+ */
+static
+int bitsink(void *ctx, const byte *data, unsigned long len)
+{
+  bitmap *bm = ctx;
+  unsigned long i;
+
+  for (i = 0; i < len << 3 && bm->pos < bm->total; ++i, ++bm->pos)
+    {
+      if (BMTST(data, i))
+	{
+	  ++bm->used;
+	  ++bm->seg[bm->pos * HDUMP_SEGS / bm->total];
+
+	  bm->run = 0;
+	}
+      else if (bm->run++ == 0)
+	++bm->runs;
+
+      if (bm->run > bm->largest)
+	bm->largest = bm->run;
+    }
+
+  return 0;
+}
+
+/*
+ * NAME:	dumpbitmap()
+ * DESCRIPTION:	write a summary of the allocation bitmap
+ */
+static
+int dumpbitmap(const span *spans, unsigned int nspans, unsigned long total)
+{
+  bitmap bm;
   int i;
 
-  v_init(&vol, HFS_OPT_NOCACHE);
+  memset(&bm, 0, sizeof(bm));
+  bm.total = total;
 
-  if (argc != 2)
+  if (stream(spans, nspans, (total + 7) >> 3, bitsink, &bm) == -1)
+    return -1;
+
+  if (mode == DUMP_BINARY)
     {
-      fprintf(stderr, "Usage: %s <device>\n", argv[0]);
-      goto fail;
+      putrec("BMAP", 4 * (5 + HDUMP_SEGS));
+      put32(bm.total);
+      put32(bm.used);
+      put32(bm.total - bm.used);
+      put32(bm.runs);
+      put32(bm.largest);
+
+      for (i = 0; i < HDUMP_SEGS; ++i)
+	put32(bm.seg[i]);
+    }
+  else
+    {
+      printf(",\"bitmap\":{\"blocks\":%lu,\"used\":%lu,\"free\":%lu,"
+	     "\"free_runs\":%lu,\"largest_free\":%lu,\"segments\":[",
+	     bm.total, bm.used, bm.total - bm.used, bm.runs, bm.largest);
+
+      for (i = 0; i < HDUMP_SEGS; ++i)
+	printf("%s%lu", i ? "," : "", bm.seg[i]);
+
+      printf("]}");
+    }
+
+  return 0;
+}
+
+/* Volume Routines ========================================================= */
+
+/*
+ * NAME:	dumpvolume()
+ * DESCRIPTION:	write the structures of an HFS or HFS+ volume
+ */
+static
+int dumpvolume(int pnum)
+{
+  block wrapper, vh;
+  dumptree trees[3];
+  span *bmspans = 0;
+  unsigned int nbmspans = 0;
+  unsigned long total;
+  int i, ntrees, wrapped = 0, result = -1;
+
+  memset(trees, 0, sizeof(trees));
+
+  chunk = ALLOC(byte, HDUMP_CHUNK << HFS_BLOCKSZ_BITS);
+  if (chunk == 0)
+    ERROR(ENOMEM, 0);
+
+  if (v_geometry(&vol, pnum) == -1 ||
+      l_getmdb(&vol, &vol.mdb, 0) == -1 ||
+      b_readpb(&vol, vol.vstart + 2, &vh, 1) == -1)
+    goto fail;
+
+  /* an HFS wrapper may hide an HFS+ volume; dump that one */
+
+  if (vol.mdb.drSigWord == HFS_SIGWORD &&
+      vol.mdb.drEmbedSigWord == HFSPLUS_SIGWORD)
+    {
+      memcpy(wrapper, vh, HFS_BLOCKSZ);
+      wrapped = 1;
+
+      if (v_embedded(&vol) == -1 ||
+	  b_readpb(&vol, vol.vstart + 2, &vh, 1) == -1)
+	goto fail;
     }
 
-  if (v_open(&vol, argv[1], HFS_MODE_RDONLY) == -1)
+  plus = (d_getuw(vh) == HFSPLUS_SIGWORD || d_getuw(vh) == HFSPLUS_SIGWORD_X);
+
+  if (! plus && d_getuw(vh) != HFS_SIGWORD)
+    ERROR(EINVAL, "not a Macintosh HFS or HFS+ volume");
+
+  if (mode == DUMP_BINARY)
     {
-      fprintf(stderr, "v_open: %s\n", hfs_error);
-      goto fail;
+      fwrite("HDMP", 1, 4, stdout);
+      put32(HDUMP_VERSION);
+
+      putrec("VLOC", 12);
+      put32(pnum);
+      put32(vol.vstart);
+      put32(vol.vlen);
+
+      if (wrapped)
+	{
+	  putrec("WRAP", HFS_BLOCKSZ);
+	  fwrite(wrapper, 1, HFS_BLOCKSZ, stdout);
+	}
+
+      putrec("VOLH", HFS_BLOCKSZ);
+      fwrite(vh, 1, HFS_BLOCKSZ, stdout);
+    }
+  else
+    {
+      printf("{\"partition\":%d,\"start\":%lu,\"blocks\":%lu,", pnum,
+	     vol.vstart, vol.vlen);
+
+      if (wrapped)
+	{
+	  printf("\"wrapper\":{");
+	  putfields(wrapper, mdbfields);
+	  printf("\"name\":");
+	  putname(wrapper + 36, 27);
+	  printf(",\"raw\":");
+	  puthex(wrapper, HFS_BLOCKSZ);
+	  printf("},");
+	}
+
+      printf("\"format\":\"%s\",\"header\":{",
+	     plus ? (d_getuw(vh) == HFSPLUS_SIGWORD ? "hfs+" : "hfsx") : "hfs");
+    }
+
+  if (plus)
+    {
+      unsigned long bs = d_getul(vh + 40);
+
+      if (bs < HFS_BLOCKSZ || (bs & (bs - 1)))
+	ERROR(EIO, "bad HFS+ allocation block size");
+
+      abase = 0;
+      lpa   = bs >> HFS_BLOCKSZ_BITS;
+      total = d_getul(vh + 44);
+
+      if (mode == DUMP_JSON)
+	{
+	  putfields(vh, vhfields);
+	  printf("\"forks\":{");
+
+	  for (i = 0; i < 5; ++i)
+	    {
+	      const byte *fork = vh + 112 + i * 80;
+	      int e;
+
+	      printf("%s\"%s\":{\"size\":%llu,\"clump_size\":%lu,"
+		     "\"blocks\":%lu,\"extents\":[", i ? "," : "", plusforks[i],
+		     (unsigned long long) d_getul(fork) << 32 | d_getul(fork + 4),
+		     d_getul(fork + 8), d_getul(fork + 12));
+
+	      for (e = 0; e < 8 && d_getul(fork + 20 + e * 8); ++e)
+		printf("%s[%lu,%lu]", e ? "," : "", d_getul(fork + 16 + e * 8),
+		       d_getul(fork + 20 + e * 8));
+
+	      printf("]}");
+	    }
+
+	  printf("}");
+	}
+
+      /* extents, catalog, attributes */
+
+      for (ntrees = 0; ntrees < 3; ++ntrees)
+	{
+	  static const unsigned long cnids[] = { 3, 4, 8 };
+	  const byte *fork = vh + 112 + (ntrees + 1) * 80;
+	  int e;
+
+	  trees[ntrees].name = plusforks[ntrees + 1];
+	  trees[ntrees].cnid = cnids[ntrees];
+
+	  for (e = 0; e < 8; ++e)
+	    {
+	      if (addspan(&trees[ntrees].spans, &trees[ntrees].nspans,
+			  d_getul(fork + 16 + e * 8),
+			  d_getul(fork + 20 + e * 8)) == -1)
+		goto fail;
+	    }
+	}
+
+      for (i = 0; i < 8; ++i)
+	{
+	  if (addspan(&bmspans, &nbmspans, d_getul(vh + 112 + 16 + i * 8),
+		      d_getul(vh + 112 + 20 + i * 8)) == -1)
+	    goto fail;
+	}
     }
+  else
+    {
+      if (vol.mdb.drAlBlkSiz == 0 || vol.mdb.drAlBlkSiz % HFS_BLOCKSZ)
+	ERROR(EIO, "bad HFS allocation block size");
+
+      abase = vol.mdb.drAlBlSt;
+      lpa   = vol.mdb.drAlBlkSiz >> HFS_BLOCKSZ_BITS;
+      total = vol.mdb.drNmAlBlks;
+
+      if (mode == DUMP_JSON)
+	{
+	  putfields(vh, mdbfields);
+	  printf("\"name\":");
+	  putname(vh + 36, 27);
+	  printf(",\"embed_extent\":[%u,%u],\"ext_extents\":[",
+		 d_getuw(vh + 126), d_getuw(vh + 128));
+
+	  for (i = 0; i < 3 && d_getuw(vh + 136 + i * 4); ++i)
+	    printf("%s[%u,%u]", i ? "," : "", d_getuw(vh + 134 + i * 4),
+		   d_getuw(vh + 136 + i * 4));
+
+	  printf("],\"cat_extents\":[");
+
+	  for (i = 0; i < 3 && d_getuw(vh + 152 + i * 4); ++i)
+	    printf("%s[%u,%u]", i ? "," : "", d_getuw(vh + 150 + i * 4),
+		   d_getuw(vh + 152 + i * 4));
+
+	  printf("]");
+	}
+
+      ntrees = 2;
+
+      trees[0].name = "extents";
+      trees[0].cnid = HFS_CNID_EXT;
+      trees[1].name = "catalog";
+      trees[1].cnid = HFS_CNID_CAT;
+
+      for (i = 0; i < 3; ++i)
+	{
+	  if (addspan(&trees[0].spans, &trees[0].nspans,
+		      vol.mdb.drXTExtRec[i].xdrStABN,
+		      vol.mdb.drXTExtRec[i].xdrNumABlks) == -1 ||
+	      addspan(&trees[1].spans, &trees[1].nspans,
+		      vol.mdb.drCTExtRec[i].xdrStABN,
+		      vol.mdb.drCTExtRec[i].xdrNumABlks) == -1)
+	    goto fail;
+	}
+
+      /* the bitmap lies outside the allocation blocks */
+
+      bmspans = ALLOC(span, 1);
+      if (bmspans == 0)
+	ERROR(ENOMEM, 0);
+
+      bmspans[0].bnum  = vol.mdb.drVBMSt;
+      bmspans[0].count = (total + 4095) >> 12;
+      nbmspans = 1;
+    }
+
+  if (mode == DUMP_JSON)
+    {
+      printf(",\"raw\":");
+      puthex(vh, HFS_BLOCKSZ);
+      printf("},\"trees\":[");
+    }
+
+  /* the extents tree first: it locates the rest of the special files */
+
+  if (dumpbtree(&trees[0]) == -1 ||
+      addoverflow(HFS_CNID_CAT, &trees[1].spans, &trees[1].nspans) == -1 ||
+      (plus && addoverflow(8, &trees[2].spans, &trees[2].nspans) == -1) ||
+      (plus && addoverflow(6, &bmspans, &nbmspans) == -1))
+    goto fail;
+
+  for (i = 1; i < ntrees; ++i)
+    {
+      if (dumpbtree(&trees[i]) == -1)
+	goto fail;
+    }
+
+  if (mode == DUMP_JSON)
+    printf("]");
+
+  if (dumpbitmap(bmspans, nbmspans, total) == -1)
+    goto fail;
+
+  if (mode == DUMP_BINARY)
+    putrec("END ", 0);
+  else
+    printf("}\n");
+
+  result = 0;
+
+fail:
+  for (i = 0; i < 3; ++i)
+    {
+      FREE(trees[i].spans);
+      FREE(trees[i].map);
+      FREE(trees[i].node);
+    }
+
+  FREE(bmspans);
+  FREE(chunk);
+  FREE(ovf);
+
+  return result;
+}
+
+/*
+ * NAME:	dumpmap()
+ * DESCRIPTION:	print the driver descriptor record and partition map
+ */
+static
+int dumpmap(void)
+{
+  Block0 ddr;
+  Partition map;
+  unsigned long bnum;
+  int i;
 
   if (l_getddr(&vol, &ddr) == -1)
     {
       fprintf(stderr, "l_getddr: %s\n", hfs_error);
-      goto fail;
+      return -1;
     }
 
   if (ddr.sbSig != HFS_DDR_SIGWORD)
@@ -94,13 +1186,13 @@ int main(int argc, char *argv[])
       if (l_getpmentry(&vol, &map, bnum) == -1)
 	{
 	  fprintf(stderr, "l_getpmentry: %s\n", hfs_error);
-	  goto fail;
+	  return -1;
 	}
 
       if (map.pmSig != HFS_PM_SIGWORD)
 	{
 	  fprintf(stderr, "block %lu: not a valid partition entry\n", bnum);
-	  goto fail;
+	  return -1;
 	}
 
       printf("Partition Entry %lu\n", bnum);
@@ -129,11 +1221,82 @@ int main(int argc, char *argv[])
 	    printf("  pmPad[%d]\t= %d\n", i, map.pmPad[i]);
 	}
 
-      if (bnum++ >= map.pmMapBlkCnt)
+      if (bnum++ >= (unsigned long) map.pmMapBlkCnt)
 	break;
     }
 
-  if (v_close(&vol) == -1)
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, pnum = 0, nparts;
+
+  v_init(&vol, HFS_OPT_NOCACHE);
+
+  while ((opt = getopt(argc, argv, "jb")) != EOF)
+    {
+      switch (opt)
+	{
+	case 'j':
+	  mode = DUMP_JSON;
+	  break;
+
+	case 'b':
+	  mode = DUMP_BINARY;
+	  break;
+
+	default:
+	  goto usage;
+	}
+    }
+
+  if (argc - optind < 1 || argc - optind > 2 ||
+      (mode == DUMP_MAP && argc - optind != 1))
+    goto usage;
+
+  if (mode != DUMP_MAP)
+    {
+      if (argc - optind == 2)
+	pnum = atoi(argv[optind + 1]);
+      else
+	{
+	  nparts = hfs_nparts(argv[optind]);
+	  if (nparts > 1)
+	    {
+	      fprintf(stderr, "%s: must specify partition number\n", argv[0]);
+	      goto fail;
+	    }
+
+	  pnum = (nparts == -1) ? 0 : 1;
+	}
+    }
+
+  if (v_open(&vol, argv[optind], HFS_MODE_RDONLY) == -1)
+    {
+      fprintf(stderr, "v_open: %s\n", hfs_error);
+      goto fail;
+    }
+
+  if (mode == DUMP_MAP)
+    {
+      if (dumpmap() == -1)
+	goto fail;
+    }
+  else
+    {
+      setvbuf(stdout, 0, _IOFBF, HDUMP_CHUNK << HFS_BLOCKSZ_BITS);
+
+      if (dumpvolume(pnum) == -1)
+	{
+	  fflush(stdout);
+	  fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind],
+		  hfs_error ? hfs_error : strerror(errno));
+	  goto fail;
+	}
+    }
+
+  if (fflush(stdout) == EOF || v_close(&vol) == -1)
     {
       fprintf(stderr, "v_close: %s\n", hfs_error);
       goto fail;
@@ -141,6 +1304,10 @@ int main(int argc, char *argv[])
 
   return 0;
 
+usage:
+  fprintf(stderr, "Usage: %s <device>\n", argv[0]);
+  fprintf(stderr, "       %s -j | -b <device> [partition-no]\n", argv[0]);
+
 fail:
   v_close(&vol);
   return 1;
@@ -31,6 +31,10 @@
 # include <errno.h>
 # include <sys/stat.h>
 
+# ifdef __linux__
+#  include <sys/xattr.h>
+# endif
+
 # include "hfs.h"
 # include "data.h"
 # include "copyout.h"
@@ -46,6 +50,14 @@ extern int errno;
 
 # define MACB_BLOCKSZ	128
 
+typedef struct {
+  unsigned long cnid;		/* catalog node ID of a copied file */
+  char *path;			/* UNIX path it was copied to */
+} linkent;
+
+static linkent *links;		/* open hash of copied files, if tracking */
+static unsigned long nlinks, linksz;
+
 /* Copy Routines =========================================================== */
 
 /*
@@ -130,6 +142,11 @@ int do_macb(hfsfile *ifile, int ofile)
 
   memset(buf, 0, MACB_BLOCKSZ);
 
+  /* MacBinary has room for 63 characters; HFS+ names may be longer */
+
+  if (strlen(ent.name) > 63)
+    ent.name[63] = 0;
+
   buf[1] = strlen(ent.name);
   strcpy((char *) &buf[2], ent.name);
 
@@ -244,6 +261,9 @@ int binhx(hfsfile *ifile)
       return -1;
     }
 
+  if (strlen(ent.name) > 63)
+    ent.name[63] = 0;
+
   byte = strlen(ent.name);
   if (bh_insert(&byte, 1) == -1 ||
       bh_insert(ent.name, byte + 1) == -1 ||
@@ -414,19 +434,192 @@ int do_raw(hfsfile *ifile, int ofile)
   return 0;
 }
 
+/*
+ * NAME:	do_xattrs()
+ * DESCRIPTION:	carry extended attributes over to the destination file
+ */
+static
+int do_xattrs(hfsvol *vol, hfsfile *ifile, int ofile)
+{
+# ifdef __linux__
+  hfsdirent ent;
+  char *list = 0, *name, *value = 0, *xname = 0;
+  long len, size;
+  int result = 0;
+
+  if (hfs_fstat(ifile, &ent) == -1)
+    {
+      ERROR(errno, hfs_error);
+      return -1;
+    }
+
+  /* all names come from a single walk of the attributes B*-tree */
+
+  len = hfs_listxattr(vol, ent.cnid, 0, 0);
+  if (len <= 0)
+    {
+      if (len == -1)
+	ERROR(errno, hfs_error);
+      return len;
+    }
+
+  list = malloc(len);
+  if (list == 0)
+    {
+      ERROR(ENOMEM, 0);
+      return -1;
+    }
+
+  len = hfs_listxattr(vol, ent.cnid, list, len);
+  if (len == -1)
+    {
+      ERROR(errno, hfs_error);
+      free(list);
+      return -1;
+    }
+
+  for (name = list; name < list + len; name += strlen(name) + 1)
+    {
+      size = hfs_getxattr(vol, ent.cnid, name, 0, 0);
+      if (size == -1)
+	{
+	  ERROR(errno, hfs_error);
+	  result = -1;
+	  break;
+	}
+
+      /* unprivileged processes may only set the "user." namespace */
+
+      value = malloc(size + 1);
+      xname = malloc(strlen(name) + 5 + 1);
+      if (value == 0 || xname == 0)
+	{
+	  ERROR(ENOMEM, 0);
+	  result = -1;
+	  break;
+	}
+
+      if (strncmp(name, "user.", 5) == 0)
+	strcpy(xname, name);
+      else
+	{
+	  strcpy(xname, "user.");
+	  strcat(xname, name);
+	}
+
+      if (hfs_getxattr(vol, ent.cnid, name, value, size + 1) == -1)
+	{
+	  ERROR(errno, hfs_error);
+	  result = -1;
+	  break;
+	}
+
+      if (fsetxattr(ofile, xname, value, size, 0) == -1)
+	{
+	  /* destination file systems without xattrs are not an error */
+
+	  if (errno == ENOTSUP || errno == EOPNOTSUPP || errno == EPERM)
+	    break;
+
+	  ERROR(errno, "error setting extended attribute");
+	  result = -1;
+	  break;
+	}
+
+      free(value);
+      free(xname);
+      value = xname = 0;
+    }
+
+  free(value);
+  free(xname);
+  free(list);
+
+  return result;
+# else
+  return 0;
+# endif
+}
+
 /* Utility Routines ======================================================== */
 
+/*
+ * NAME:	findlink()
+ * DESCRIPTION:	return the hash slot for a catalog node ID
+ */
+static
+linkent *findlink(unsigned long cnid)
+{
+  unsigned long i = (cnid * 2654435761UL) & (linksz - 1);
+
+  while (links[i].path && links[i].cnid != cnid)
+    i = (i + 1) & (linksz - 1);
+
+  return &links[i];
+}
+
+/*
+ * NAME:	addlink()
+ * DESCRIPTION:	remember where a file was copied to
+ */
+static
+int addlink(unsigned long cnid, const char *path)
+{
+  linkent *ent;
+
+  if (2 * (nlinks + 1) > linksz)
+    {
+      linkent *old = links;
+      unsigned long i, oldsz = linksz;
+
+      linksz = 2 * linksz;
+      links  = calloc(linksz, sizeof(linkent));
+      if (links == 0)
+	{
+	  links  = old;
+	  linksz = oldsz;
+
+	  ERROR(ENOMEM, 0);
+	  return -1;
+	}
+
+      for (i = 0; i < oldsz; ++i)
+	{
+	  if (old[i].path)
+	    *findlink(old[i].cnid) = old[i];
+	}
+
+      free(old);
+    }
+
+  ent = findlink(cnid);
+  if (ent->path)
+    return 0;
+
+  ent->path = strdup(path);
+  if (ent->path == 0)
+    {
+      ERROR(ENOMEM, 0);
+      return -1;
+    }
+
+  ent->cnid = cnid;
+  ++nlinks;
+
+  return 0;
+}
+
 /*
  * NAME:	opensrc()
  * DESCRIPTION:	open the source file; set hint for destination filename
  */
 static
 hfsfile *opensrc(hfsvol *vol, const char *srcname,
-		 const char **dsthint, const char *ext)
+		 const char **dsthint, const char *ext, unsigned long *cnid)
 {
   hfsfile *file;
   hfsdirent ent;
-  static char name[HFS_MAX_FLEN + 4 + 1];
+  static char name[HFSPLUS_MAX_NLEN + 4 + 1];
   char *ptr;
 
   file = hfs_open(vol, srcname);
@@ -444,6 +637,8 @@ hfsfile *opensrc(hfsvol *vol, const char *srcname,
       return 0;
     }
 
+  *cnid = ent.cnid;
+
   strcpy(name, ent.name);
 
   for (ptr = name; *ptr; ++ptr)
@@ -469,43 +664,49 @@ hfsfile *opensrc(hfsvol *vol, const char *srcname,
 }
 
 /*
- * NAME:	opendst()
- * DESCRIPTION:	open the destination file
+ * NAME:	dstpath()
+ * DESCRIPTION:	return the full (allocated) destination pathname
  */
 static
-int opendst(const char *dstname, const char *hint)
+char *dstpath(const char *dstname, const char *hint)
 {
-  int fd;
+  struct stat sbuf;
+  char *path;
 
-  if (strcmp(dstname, "-") == 0)
-    fd = dup(STDOUT_FILENO);
-  else
+  if (strcmp(dstname, "-") != 0 &&
+      stat(dstname, &sbuf) != -1 &&
+      S_ISDIR(sbuf.st_mode))
     {
-      struct stat sbuf;
-      char *path = 0;
-
-      if (stat(dstname, &sbuf) != -1 &&
-	  S_ISDIR(sbuf.st_mode))
+      path = malloc(strlen(dstname) + 1 + strlen(hint) + 1);
+      if (path)
 	{
-	  path = malloc(strlen(dstname) + 1 + strlen(hint) + 1);
-	  if (path == 0)
-	    {
-	      ERROR(ENOMEM, 0);
-	      return -1;
-	    }
-
 	  strcpy(path, dstname);
 	  strcat(path, "/");
 	  strcat(path, hint);
-
-	  dstname = path;
 	}
+    }
+  else
+    path = strdup(dstname);
 
-      fd = open(dstname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (path == 0)
+    ERROR(ENOMEM, 0);
 
-      if (path)
-	free(path);
-    }
+  return path;
+}
+
+/*
+ * NAME:	opendst()
+ * DESCRIPTION:	open the destination file
+ */
+static
+int opendst(const char *dstname)
+{
+  int fd;
+
+  if (strcmp(dstname, "-") == 0)
+    fd = dup(STDOUT_FILENO);
+  else
+    fd = open(dstname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
   if (fd == -1)
     {
@@ -518,26 +719,67 @@ int opendst(const char *dstname, const char *hint)
 
 /*
  * NAME:	openfiles()
- * DESCRIPTION:	open source and destination files
+ * DESCRIPTION:	open source and destination files; return 1 if hard linked
  */
 static
 int openfiles(hfsvol *vol, const char *srcname, const char *dstname,
 	      const char *ext, hfsfile **ifile, int *ofile)
 {
   const char *dsthint;
+  unsigned long cnid;
+  char *path;
+  int result = 0;
 
-  *ifile = opensrc(vol, srcname, &dsthint, ext);
+  *ifile = opensrc(vol, srcname, &dsthint, ext, &cnid);
   if (*ifile == 0)
     return -1;
 
-  *ofile = opendst(dstname, dsthint);
+  path = dstpath(dstname, dsthint);
+  if (path == 0)
+    goto fail;
+
+  if (links && strcmp(path, "-") != 0)
+    {
+      linkent *ent = findlink(cnid);
+
+      /* another link to a file already copied: link to that copy */
+
+      if (ent->path)
+	{
+	  if ((unlink(path) == -1 && errno != ENOENT) ||
+	      link(ent->path, path) == -1)
+	    {
+	      ERROR(errno, "error linking destination file");
+	      goto fail;
+	    }
+
+	  result = 1;
+	  hfs_close(*ifile);
+	  goto done;
+	}
+    }
+
+  *ofile = opendst(path);
   if (*ofile == -1)
+    goto fail;
+
+  if (links && strcmp(path, "-") != 0 &&
+      addlink(cnid, path) == -1)
     {
-      hfs_close(*ifile);
-      return -1;
+      close(*ofile);
+      goto fail;
     }
 
-  return 0;
+done:
+  free(path);
+
+  return result;
+
+fail:
+  hfs_close(*ifile);
+  free(path);
+
+  return -1;
 }
 
 /*
@@ -571,8 +813,14 @@ int cpo_macb(hfsvol *vol, const char *srcname, const char *dstname)
   hfsfile *ifile;
   int ofile, result = 0;
 
-  if (openfiles(vol, srcname, dstname, ".bin", &ifile, &ofile) == -1)
-    return -1;
+  switch (openfiles(vol, srcname, dstname, ".bin", &ifile, &ofile))
+    {
+    case -1:
+      return -1;
+
+    case 1:
+      return 0;
+    }
 
   result = do_macb(ifile, ofile);
 
@@ -590,8 +838,14 @@ int cpo_binh(hfsvol *vol, const char *srcname, const char *dstname)
   hfsfile *ifile;
   int ofile, result;
 
-  if (openfiles(vol, srcname, dstname, ".hqx", &ifile, &ofile) == -1)
-    return -1;
+  switch (openfiles(vol, srcname, dstname, ".hqx", &ifile, &ofile))
+    {
+    case -1:
+      return -1;
+
+    case 1:
+      return 0;
+    }
 
   result = do_binh(ifile, ofile);
 
@@ -613,11 +867,20 @@ int cpo_text(hfsvol *vol, const char *srcname, const char *dstname)
   if (strchr(srcname, '.') == 0)
     ext = ".txt";
 
-  if (openfiles(vol, srcname, dstname, ext, &ifile, &ofile) == -1)
-    return -1;
+  switch (openfiles(vol, srcname, dstname, ext, &ifile, &ofile))
+    {
+    case -1:
+      return -1;
+
+    case 1:
+      return 0;
+    }
 
   result = do_text(ifile, ofile);
 
+  if (result == 0 && strcmp(dstname, "-") != 0)
+    result = do_xattrs(vol, ifile, ofile);
+
   closefiles(ifile, ofile, &result);
 
   return result;
@@ -632,12 +895,78 @@ int cpo_raw(hfsvol *vol, const char *srcname, const char *dstname)
   hfsfile *ifile;
   int ofile, result = 0;
 
-  if (openfiles(vol, srcname, dstname, 0, &ifile, &ofile) == -1)
-    return -1;
+  switch (openfiles(vol, srcname, dstname, 0, &ifile, &ofile))
+    {
+    case -1:
+      return -1;
+
+    case 1:
+      return 0;
+    }
 
   result = do_raw(ifile, ofile);
 
+  if (result == 0 && strcmp(dstname, "-") != 0)
+    result = do_xattrs(vol, ifile, ofile);
+
   closefiles(ifile, ofile, &result);
 
   return result;
 }
+
+/*
+ * NAME:	cpo->copied()
+ * DESCRIPTION:	return where a catalog node was first copied to, if anywhere
+ */
+const char *cpo_copied(unsigned long cnid)
+{
+  return links ? findlink(cnid)->path : 0;
+}
+
+/*
+ * NAME:	cpo->remember()
+ * DESCRIPTION:	record where a catalog node (such as a directory) was copied
+ */
+int cpo_remember(unsigned long cnid, const char *path)
+{
+  if (links && addlink(cnid, path) == -1)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * NAME:	cpo->links()
+ * DESCRIPTION:	start or stop linking copies of the same HFS file
+ */
+int cpo_links(int flag)
+{
+  unsigned long i;
+
+  if (flag)
+    {
+      if (links == 0)
+	{
+	  links = calloc(256, sizeof(linkent));
+	  if (links == 0)
+	    {
+	      ERROR(ENOMEM, 0);
+	      return -1;
+	    }
+
+	  linksz = 256;
+	}
+
+      return 0;
+    }
+
+  for (i = 0; i < linksz; ++i)
+    free(links[i].path);
+
+  free(links);
+
+  links  = 0;
+  nlinks = linksz = 0;
+
+  return 0;
+}
@@ -45,7 +45,7 @@
 #define ndIndxNode   0
 #define ndHdrNode    1
 #define ndMapNode    2
-#define ndLeafNode   255
+#define ndLeafNode   (-1)          /* 0xff as a SignedByte */
 
 /* HFS constants */
 #define HFS_MAX_CATKEY_LEN  37
@@ -108,6 +108,7 @@ int getvol(hfsvol **vol);
 
 /* Low-level I/O functions */
 int l_getmdb(hfsvol *vol, MDB *mdb, int backup);
+int l_putmdb(hfsvol *vol, const MDB *mdb, int backup);
 
 /* B-tree functions */
 int bt_readhdr(btree *bt);
@@ -122,6 +123,8 @@ unsigned long d_mtime(time_t unix_time);
 
 /* HFS checking functions */
 int hfs_check_volume(const char *path, int pnum, int check_options);
+long hfs_rebuild_catalog(hfsvol *vol);
+int hfs_compare_catkeys(const byte *k1, const byte *k2);
 
 /* HFS+ checking functions */
 int hfsplus_check_volume(const char *device_path, int partition_number, int check_options);
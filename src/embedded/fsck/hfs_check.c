@@ -10,6 +10,9 @@
  */
 
 #include "fsck_hfs.h"
+#include "io_plan.h"
+#include "alloc_bitmap.h"
+#include "fsck_metrics.h"
 #include <stdarg.h>
 
 /* Global variables */
@@ -23,6 +26,11 @@ int options = 0;
 /* Missing constants */
 #define fkData 0
 
+/* Big-endian fields of raw B*-tree records */
+#define REC_UW(p)  ((unsigned int) ((p)[0] << 8 | (p)[1]))
+#define REC_UL(p)  ((unsigned long) (p)[0] << 24 | (unsigned long) (p)[1] << 16 | \
+                    (unsigned long) (p)[2] << 8 | (unsigned long) (p)[3])
+
 /* Forward declarations */
 static int check_mdb_enhanced(hfsvol *vol);
 static int check_volume_structure_enhanced(hfsvol *vol);
@@ -32,10 +40,17 @@ static int check_catalog_consistency(hfsvol *vol);
 static int repair_btree_node(btree *bt, unsigned long node_num);
 static int validate_btree_structure(btree *bt);
 static int check_btree_keys_order(btree *bt);
-static int verify_allocation_blocks(hfsvol *vol);
-static int repair_allocation_bitmap(hfsvol *vol);
+static int check_btree_index(btree *bt);
+static int rebuild_catalog(hfsvol *vol, int result);
+static int build_expected_bitmap(hfsvol *vol, alloc_bitmap_t *expected);
+static int verify_allocation_blocks(hfsvol *vol, const alloc_bitmap_t *expected,
+                                    const byte *ondisk);
+static int repair_allocation_bitmap(hfsvol *vol, const alloc_bitmap_t *expected,
+                                    const byte *ondisk);
 static int validate_catalog_records(hfsvol *vol);
 static int check_file_extents(hfsvol *vol);
+static io_plan_t *plan_metadata(hfsvol *vol);
+static void plan_extents(io_plan_t *plan, hfsvol *vol, const ExtDataRec *rec);
 
 /*
  * NAME:    hfs_check_volume()
@@ -44,9 +59,12 @@ static int check_file_extents(hfsvol *vol);
 int hfs_check_volume(const char *path, int pnum, int check_options)
 {
     hfsvol vol;
+    io_plan_t *plan;
     int nparts, result;
     int errors_found = 0;
     int errors_corrected = 0;
+    int errors_uncorrected = 0;
+    int bitmap_failed = 0;
     
     /* Set global options */
     options = check_options;
@@ -130,7 +148,9 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
         printf("\n=== Phase 1: Checking Volume Header ===\n");
     }
     
+    fsck_metrics_begin(FSCK_PHASE_HEADER);
     result = check_mdb_enhanced(&vol);
+    fsck_metrics_end(FSCK_PHASE_HEADER, result);
     if (result > 0) {
         errors_found = 1;
         if (REPAIR) {
@@ -145,12 +165,22 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
         return FSCK_UNCORRECTED;
     }
     
+    /*
+     * Read the bitmap and both B*-trees up front, in device order, so the
+     * remaining phases do not seek across the disk for each block.
+     */
+    fsck_metrics_begin(FSCK_PHASE_PRELOAD);
+    plan = plan_metadata(&vol);
+    fsck_metrics_end(FSCK_PHASE_PRELOAD, 0);
+    
     /* Phase 2: Check volume structure and allocation bitmap */
     if (VERBOSE) {
         printf("\n=== Phase 2: Checking Volume Structure ===\n");
     }
     
+    fsck_metrics_begin(FSCK_PHASE_HEADER);
     result = check_volume_structure_enhanced(&vol);
+    fsck_metrics_end(FSCK_PHASE_HEADER, result);
     if (result > 0) {
         errors_found = 1;
         if (REPAIR) {
@@ -162,6 +192,7 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
     } else if (result < 0) {
         fprintf(stderr, "fsck.hfs: critical volume structure errors\n");
         errors_found = 1;
+        errors_uncorrected = 1;
     }
     
     /* Phase 3: Check allocation bitmap */
@@ -169,7 +200,9 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
         printf("\n=== Phase 3: Checking Allocation Bitmap ===\n");
     }
     
+    fsck_metrics_begin(FSCK_PHASE_BITMAP);
     result = check_allocation_bitmap(&vol);
+    fsck_metrics_end(FSCK_PHASE_BITMAP, result);
     if (result > 0) {
         errors_found = 1;
         if (REPAIR) {
@@ -181,6 +214,7 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
     } else if (result < 0) {
         fprintf(stderr, "fsck.hfs: critical allocation bitmap errors\n");
         errors_found = 1;
+        bitmap_failed = 1;
     }
     
     /* Phase 4: Check extents overflow B-tree */
@@ -188,7 +222,9 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
         printf("\n=== Phase 4: Checking Extents B-tree ===\n");
     }
     
+    fsck_metrics_begin(FSCK_PHASE_EXTENTS);
     result = check_btree_enhanced(&vol.ext, "extents");
+    fsck_metrics_end(FSCK_PHASE_EXTENTS, result);
     if (result > 0) {
         errors_found = 1;
         if (REPAIR) {
@@ -200,6 +236,7 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
     } else if (result < 0) {
         fprintf(stderr, "fsck.hfs: critical extents B-tree errors\n");
         errors_found = 1;
+        errors_uncorrected = 1;
     }
     
     /* Phase 5: Check catalog B-tree */
@@ -207,7 +244,26 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
         printf("\n=== Phase 5: Checking Catalog B-tree ===\n");
     }
     
+    fsck_metrics_begin(FSCK_PHASE_CATALOG);
     result = check_btree_enhanced(&vol.cat, "catalog");
+    if (result != 0 && REPAIR) {
+        result = rebuild_catalog(&vol, result);
+    }
+    fsck_metrics_end(FSCK_PHASE_CATALOG, result);
+    
+    /* The rebuilt catalog may hold other extents than the bitmap was
+     * checked against, or be whole where Phase 3 found it broken */
+    if (result > 0 && REPAIR) {
+        int bitmap_result;
+        
+        if (VERBOSE) {
+            printf("*** Rechecking allocation bitmap against rebuilt catalog\n");
+        }
+        fsck_metrics_begin(FSCK_PHASE_BITMAP);
+        bitmap_result = check_allocation_bitmap(&vol);
+        fsck_metrics_end(FSCK_PHASE_BITMAP, bitmap_result);
+        bitmap_failed = bitmap_result < 0;
+    }
     if (result > 0) {
         errors_found = 1;
         if (REPAIR) {
@@ -219,6 +275,7 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
     } else if (result < 0) {
         fprintf(stderr, "fsck.hfs: critical catalog B-tree errors\n");
         errors_found = 1;
+        errors_uncorrected = 1;
     }
     
     /* Phase 6: Check catalog file consistency */
@@ -226,7 +283,9 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
         printf("\n=== Phase 6: Checking Catalog Consistency ===\n");
     }
     
+    fsck_metrics_begin(FSCK_PHASE_CATALOG);
     result = check_catalog_consistency(&vol);
+    fsck_metrics_end(FSCK_PHASE_CATALOG, result);
     if (result > 0) {
         errors_found = 1;
         if (REPAIR) {
@@ -238,6 +297,11 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
     } else if (result < 0) {
         fprintf(stderr, "fsck.hfs: critical catalog consistency errors\n");
         errors_found = 1;
+        errors_uncorrected = 1;
+    }
+    
+    if (bitmap_failed) {
+        errors_uncorrected = 1;
     }
     
     /* Update volume if repairs were made */
@@ -249,6 +313,17 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
         }
     }
     
+    if (VERBOSE && plan) {
+        io_plan_stats_t stats;
+        
+        io_plan_get_stats(plan, &stats);
+        printf("\nMetadata I/O: %lu ranges in %lu runs, %lu reads, %llu bytes; "
+               "%lu blocks from memory, %lu from disk\n",
+               stats.ranges, stats.runs, stats.reads,
+               (unsigned long long) stats.bytes, stats.hits, stats.misses);
+    }
+    io_plan_free(plan);
+    
     /* Mark volume as mounted for proper cleanup */
     vol.flags |= HFS_VOL_MOUNTED;
     
@@ -264,7 +339,7 @@ int hfs_check_volume(const char *path, int pnum, int check_options)
             printf("\n*** Volume check completed: no errors found\n");
         }
         return FSCK_OK;
-    } else if (errors_corrected && REPAIR) {
+    } else if (errors_corrected && !errors_uncorrected && REPAIR) {
         if (VERBOSE) {
             printf("\n*** Volume check completed: errors found and corrected\n");
         }
@@ -431,6 +506,7 @@ static int check_mdb_enhanced(hfsvol *vol)
     vol->lpa = vol->mdb.drAlBlkSiz >> HFS_BLOCKSZ_BITS;
     
     /* Initialize extents pseudo-file structs */
+    vol->ext.f.vol = vol;
     vol->ext.f.cat.u.fil.filStBlk   = vol->mdb.drXTExtRec[0].xdrStABN;
     vol->ext.f.cat.u.fil.filLgLen   = vol->mdb.drXTFlSize;
     vol->ext.f.cat.u.fil.filPyLen   = vol->mdb.drXTFlSize;
@@ -444,6 +520,7 @@ static int check_mdb_enhanced(hfsvol *vol)
     f_selectfork(&vol->ext.f, fkData);
     
     /* Initialize catalog pseudo-file structs */
+    vol->cat.f.vol = vol;
     vol->cat.f.cat.u.fil.filStBlk   = vol->mdb.drCTExtRec[0].xdrStABN;
     vol->cat.f.cat.u.fil.filLgLen   = vol->mdb.drCTFlSize;
     vol->cat.f.cat.u.fil.filPyLen   = vol->mdb.drCTFlSize;
@@ -463,6 +540,61 @@ static int check_mdb_enhanced(hfsvol *vol)
     return errors_fixed;
 }
 
+/*
+ * NAME:    plan_extents()
+ * DESCRIPTION: Queue the allocation blocks of an extent record
+ */
+static void plan_extents(io_plan_t *plan, hfsvol *vol, const ExtDataRec *rec)
+{
+    for (int i = 0; i < 3; i++) {
+        if ((*rec)[i].xdrNumABlks == 0) {
+            continue;
+        }
+        io_plan_add(plan,
+                    (uint64_t) (vol->vstart + vol->mdb.drAlBlSt +
+                                (unsigned long) (*rec)[i].xdrStABN * vol->lpa) * HFS_BLOCKSZ,
+                    (uint64_t) (*rec)[i].xdrNumABlks * vol->mdb.drAlBlkSiz);
+    }
+}
+
+/*
+ * NAME:    plan_metadata()
+ * DESCRIPTION: Load the volume bitmap and the extents and catalog B*-trees
+ *              with offset-ordered sequential reads; NULL if not possible
+ */
+static io_plan_t *plan_metadata(hfsvol *vol)
+{
+    io_plan_t *plan;
+    int fd = (int) (long) vol->priv;
+    
+    if (vol->lpa == 0) {
+        return NULL;
+    }
+    
+    plan = io_plan_new(fd);
+    if (!plan) {
+        return NULL;
+    }
+    
+    /* Volume bitmap: one bit per allocation block */
+    io_plan_add(plan, (uint64_t) (vol->vstart + vol->mdb.drVBMSt) * HFS_BLOCKSZ,
+                (uint64_t) ((vol->mdb.drNmAlBlks + 4095) / 4096) * HFS_BLOCKSZ);
+    
+    plan_extents(plan, vol, &vol->mdb.drXTExtRec);
+    plan_extents(plan, vol, &vol->mdb.drCTExtRec);
+    
+    if (io_plan_load(plan) == -1) {
+        /* Whatever loaded is still used; the rest is read on demand */
+        if (VERBOSE) {
+            printf("Metadata preload incomplete, reading on demand\n");
+        }
+    }
+    
+    io_plan_attach(plan);
+    
+    return plan;
+}
+
 /*
  * NAME:    check_volume_structure_enhanced()
  * DESCRIPTION: Enhanced volume structure checking
@@ -589,6 +721,12 @@ static int check_btree_enhanced(btree *bt, const char *tree_name)
         return -1;
     }
     
+    /* Check that the index leads to the leaves in leaf-chain order */
+    result = check_btree_index(bt);
+    if (result > 0) {
+        errors_fixed += result;
+    }
+    
     /* Check key ordering */
     result = check_btree_keys_order(bt);
     if (result > 0) {
@@ -616,29 +754,62 @@ static int check_allocation_bitmap(hfsvol *vol)
 {
     int errors_fixed = 0;
     int result;
+    alloc_bitmap_t expected;
+    unsigned int bitmap_blocks, i;
+    byte *ondisk;
     
     if (VERBOSE) {
         printf("*** Checking allocation bitmap\n");
     }
     
+    /* Rebuild the bitmap the volume should have from its extents */
+    result = build_expected_bitmap(vol, &expected);
+    if (result < 0) {
+        /* Nothing is freed unless every extent was seen */
+        fprintf(stderr, "fsck.hfs: cannot rebuild allocation bitmap from damaged "
+                "B-trees; bitmap left unchanged\n");
+        return -1;
+    }
+    errors_fixed += result;
+    
+    /* Read the on-disk bitmap: one bit per allocation block */
+    bitmap_blocks = (vol->mdb.drNmAlBlks + 4095) / 4096;
+    ondisk = calloc(bitmap_blocks ? bitmap_blocks : 1, HFS_BLOCKSZ);
+    if (!ondisk) {
+        alloc_bitmap_free(&expected);
+        return -1;
+    }
+    
+    for (i = 0; i < bitmap_blocks; i++) {
+        if (l_getblock(vol->priv, vol->vstart + vol->mdb.drVBMSt + i,
+                       ondisk + i * HFS_BLOCKSZ) == -1) {
+            fprintf(stderr, "fsck.hfs: failed to read bitmap block %u\n", i);
+            free(ondisk);
+            alloc_bitmap_free(&expected);
+            return -1;
+        }
+    }
+    
     /* Verify allocation blocks */
-    result = verify_allocation_blocks(vol);
+    result = verify_allocation_blocks(vol, &expected, ondisk);
     if (result > 0) {
         errors_fixed += result;
-    } else if (result < 0) {
-        fprintf(stderr, "fsck.hfs: critical allocation bitmap errors\n");
-        return -1;
     }
     
     /* Repair allocation bitmap if needed */
     if (errors_fixed > 0 && REPAIR) {
-        result = repair_allocation_bitmap(vol);
+        result = repair_allocation_bitmap(vol, &expected, ondisk);
         if (result < 0) {
             fprintf(stderr, "fsck.hfs: failed to repair allocation bitmap\n");
+            free(ondisk);
+            alloc_bitmap_free(&expected);
             return -1;
         }
     }
     
+    free(ondisk);
+    alloc_bitmap_free(&expected);
+    
     if (VERBOSE) {
         printf("Allocation bitmap validation completed\n");
         if (errors_fixed > 0) {
@@ -683,11 +854,86 @@ static int check_catalog_consistency(hfsvol *vol)
 
 /* Enhanced implementations of helper functions */
 
+/* State of a walk along the leaf chain of a B*-tree */
+struct leaf_walk {
+    btree *bt;
+    alloc_bitmap_t seen;        /* Nodes visited so far, one bit each */
+    unsigned long last;         /* Last node visited, 0 before the first */
+    unsigned long stop;         /* Node the walk refused, if broken */
+    int broken;                 /* Chain looped, left the tree or ended early */
+};
+
+/*
+ * NAME:    leaf_walk_init()
+ * DESCRIPTION: Start a walk along the leaf chain of a B*-tree
+ */
+static int leaf_walk_init(struct leaf_walk *w, btree *bt)
+{
+    memset(w, 0, sizeof(*w));
+    w->bt = bt;
+    
+    return alloc_bitmap_init(&w->seen, bt->hdr.bthNNodes);
+}
+
+/*
+ * NAME:    leaf_walk_next()
+ * DESCRIPTION: Take the next node of a leaf chain walk, given the link to
+ *              it; returns 0 at the end of the chain, and also at a node
+ *              that is out of range or was visited before, which marks
+ *              the walk broken
+ */
+static unsigned long leaf_walk_next(struct leaf_walk *w, unsigned long next)
+{
+    uint32_t overlap;
+    
+    if (w->broken) {
+        return 0;
+    }
+    
+    if (next == 0) {
+        /* The chain must end at the last leaf the header names */
+        if (w->last != w->bt->hdr.bthLNode) {
+            w->broken = 1;
+        }
+        return 0;
+    }
+    
+    if (next >= w->bt->hdr.bthNNodes ||
+        alloc_bitmap_mark(&w->seen, next, 1, &overlap) == -1 || overlap > 0) {
+        w->broken = 1;
+        w->stop = next;
+        return 0;
+    }
+    
+    w->last = next;
+    
+    return next;
+}
+
+/*
+ * NAME:    leaf_walk_report()
+ * DESCRIPTION: Describe why a leaf chain walk did not reach the last leaf
+ */
+static void leaf_walk_report(const struct leaf_walk *w)
+{
+    if (w->stop >= w->bt->hdr.bthNNodes) {
+        printf("Leaf chain leaves the B-tree at node %lu, after node %lu\n",
+               w->stop, w->last);
+    } else if (w->stop != 0) {
+        printf("Leaf chain loops back from node %lu to node %lu\n",
+               w->last, w->stop);
+    } else {
+        printf("Leaf chain ends at node %lu, not at last leaf %lu\n",
+               w->last, w->bt->hdr.bthLNode);
+    }
+}
+
 static int validate_btree_structure(btree *bt)
 {
     int errors_found = 0;
     node n;
     unsigned long node_num;
+    struct leaf_walk w;
     
     if (bt->hdr.bthNNodes == 0) {
         return 0; /* Empty tree is valid */
@@ -721,8 +967,11 @@ static int validate_btree_structure(btree *bt)
     
     /* Validate node structure by walking through leaf nodes */
     if (bt->hdr.bthFNode > 0 && errors_found == 0) {
+        if (leaf_walk_init(&w, bt) == -1) {
+            return -1;
+        }
         n.bt = bt;
-        node_num = bt->hdr.bthFNode;
+        node_num = leaf_walk_next(&w, bt->hdr.bthFNode);
         
         while (node_num != 0) {
             n.nnum = node_num;
@@ -742,7 +991,9 @@ static int validate_btree_structure(btree *bt)
                 }
                 errors_found++;
                 
-                if (REPAIR && (YES || ask("Attempt to repair corrupted B-tree node %lu", node_num))) {
+                /* A damaged catalog is rebuilt as a whole instead */
+                if (REPAIR && bt != &bt->f.vol->cat &&
+                    (YES || ask("Attempt to repair corrupted B-tree node %lu", node_num))) {
                     if (repair_btree_node(bt, node_num) == 0) {
                         if (VERBOSE) {
                             printf("Repaired B-tree node %lu\n", node_num);
@@ -763,30 +1014,49 @@ static int validate_btree_structure(btree *bt)
                 errors_found++;
             }
             
-            /* Move to next node */
-            node_num = n.nd.ndFLink;
-            
-            /* Prevent infinite loops */
-            if (node_num == bt->hdr.bthFNode) {
-                if (VERBOSE || !REPAIR) {
-                    printf("Circular reference detected in B-tree leaf nodes\n");
-                }
-                errors_found++;
-                break;
+            /* Move to next node; a loop or a stray link ends the walk */
+            node_num = leaf_walk_next(&w, n.nd.ndFLink);
+        }
+        
+        if (w.broken) {
+            if (VERBOSE || !REPAIR) {
+                leaf_walk_report(&w);
             }
+            errors_found++;
         }
+        alloc_bitmap_free(&w.seen);
     }
     
     return errors_found;
 }
 
+/*
+ * NAME:    compare_extkeys()
+ * DESCRIPTION: Order two raw extents keys by file ID, fork and start block
+ */
+static int compare_extkeys(const byte *k1, const byte *k2)
+{
+    unsigned long id1 = REC_UL(k1 + 2), id2 = REC_UL(k2 + 2);
+    
+    if (id1 != id2) {
+        return id1 < id2 ? -1 : 1;
+    }
+    if (k1[1] != k2[1]) {
+        return k1[1] < k2[1] ? -1 : 1;
+    }
+    
+    return (int) REC_UW(k1 + 6) - (int) REC_UW(k2 + 6);
+}
+
 static int check_btree_keys_order(btree *bt)
 {
     int errors_found = 0;
     node n;
     unsigned long node_num;
-    byte *prev_key = NULL;
-    byte *curr_key;
+    byte prev_key[256];
+    int have_prev = 0;
+    const byte *curr_key;
+    struct leaf_walk w;
     int i;
     
     if (bt->hdr.bthNNodes == 0) {
@@ -795,8 +1065,11 @@ static int check_btree_keys_order(btree *bt)
     
     /* Walk through leaf nodes to check key ordering */
     if (bt->hdr.bthFNode > 0) {
+        if (leaf_walk_init(&w, bt) == -1) {
+            return -1;
+        }
         n.bt = bt;
-        node_num = bt->hdr.bthFNode;
+        node_num = leaf_walk_next(&w, bt->hdr.bthFNode);
         
         while (node_num != 0) {
             n.nnum = node_num;
@@ -804,28 +1077,28 @@ static int check_btree_keys_order(btree *bt)
             if (bt_getnode(&n) == -1) {
                 break; /* Already reported in structure validation */
             }
+            fsck_metrics_records(n.nd.ndNRecs);
             
             /* Check keys within this node */
             for (i = 0; i < n.nd.ndNRecs; i++) {
                 curr_key = HFS_NODEREC(n, i);
                 
-                if (curr_key == NULL) {
+                if (n.roff[i] < 14 || n.roff[i] >= HFS_BLOCKSZ ||
+                    n.roff[i] + 1 + HFS_RECKEYLEN(curr_key) > HFS_BLOCKSZ) {
                     if (VERBOSE || !REPAIR) {
-                        printf("NULL key pointer in node %lu, record %d\n", node_num, i);
+                        printf("Bad key offset in node %lu, record %d\n", node_num, i);
                     }
                     errors_found++;
                     continue;
                 }
                 
-                /* Compare with previous key if available */
-                if (prev_key != NULL) {
-                    /* Simple byte comparison for key ordering */
-                    int key_len = HFS_RECKEYLEN(curr_key);
-                    int prev_len = HFS_RECKEYLEN(prev_key);
-                    int cmp_len = (key_len < prev_len) ? key_len : prev_len;
+                /* Compare with the previous key, which may be in the previous node */
+                if (have_prev) {
+                    int cmp = (bt == &bt->f.vol->cat) ?
+                              hfs_compare_catkeys(prev_key, curr_key) :
+                              compare_extkeys(prev_key, curr_key);
                     
-                    if (memcmp(prev_key + 1, curr_key + 1, cmp_len) > 0 ||
-                        (memcmp(prev_key + 1, curr_key + 1, cmp_len) == 0 && prev_len > key_len)) {
+                    if (cmp >= 0) {
                         if (VERBOSE || !REPAIR) {
                             printf("Keys out of order in B-tree at node %lu, record %d\n", node_num, i);
                         }
@@ -833,157 +1106,407 @@ static int check_btree_keys_order(btree *bt)
                     }
                 }
                 
-                prev_key = curr_key;
+                memcpy(prev_key, curr_key, 1 + HFS_RECKEYLEN(curr_key));
+                have_prev = 1;
             }
             
-            node_num = n.nd.ndFLink;
-            
-            /* Prevent infinite loops */
-            if (node_num == bt->hdr.bthFNode) {
-                break;
-            }
+            /* A broken chain was already reported in structure validation */
+            node_num = leaf_walk_next(&w, n.nd.ndFLink);
         }
+        alloc_bitmap_free(&w.seen);
     }
     
     return errors_found;
 }
 
-static int verify_allocation_blocks(hfsvol *vol)
+/* Differing bitmap runs listed before the rest are only counted */
+#define BITMAP_MAX_RUNS  20
+
+/* State of the index walk in check_btree_index() */
+struct index_walk {
+    btree *bt;
+    unsigned long visited;      /* Nodes reached, to stop on cycles */
+    unsigned long prev_leaf;    /* Last leaf reached, 0 before the first */
+    unsigned long prev_flink;
+    int errors_found;
+};
+
+/*
+ * NAME:    walk_index()
+ * DESCRIPTION: Descend from a node of the given height, checking node
+ *              kinds and that the leaves come out in leaf-chain order;
+ *              stops at the first problem
+ */
+static void walk_index(struct index_walk *w, unsigned long node_num, int height)
 {
-    int errors_found = 0;
-    unsigned int total_blocks = vol->mdb.drNmAlBlks;
-    unsigned int free_blocks = vol->mdb.drFreeBks;
-    unsigned int bitmap_blocks;
-    unsigned int i, j;
-    block bitmap_block;
-    unsigned int actual_free = 0;
+    btree *bt = w->bt;
+    node n;
+    int i;
     
-    if (VERBOSE) {
-        printf("Total allocation blocks: %u\n", total_blocks);
-        printf("Free blocks reported: %u\n", free_blocks);
+    if (node_num == 0 || node_num >= bt->hdr.bthNNodes ||
+        ++w->visited > bt->hdr.bthNNodes) {
+        if (VERBOSE || !REPAIR) {
+            printf("B-tree index points to invalid node %lu\n", node_num);
+        }
+        w->errors_found++;
+        return;
     }
     
-    /* Basic sanity checks */
-    if (free_blocks > total_blocks) {
+    n.bt = bt;
+    n.nnum = node_num;
+    
+    if (bt_getnode(&n) == -1) {
         if (VERBOSE || !REPAIR) {
-            printf("Free block count (%u) exceeds total blocks (%u)\n",
-                   free_blocks, total_blocks);
+            printf("Failed to read B-tree node %lu\n", node_num);
         }
-        errors_found++;
+        w->errors_found++;
+        return;
     }
     
-    /* Calculate number of bitmap blocks */
-    bitmap_blocks = (total_blocks + 4095) / 4096; /* 4096 bits per block */
+    if (n.nd.ndType != (height == 1 ? ndLeafNode : ndIndxNode) ||
+        n.nd.ndNHeight != height || n.nd.ndNRecs == 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("B-tree node %lu is not the %s node of height %d its index expects\n",
+                   node_num, height == 1 ? "leaf" : "index", height);
+        }
+        w->errors_found++;
+        return;
+    }
     
-    if (VERBOSE) {
-        printf("Scanning %u bitmap blocks\n", bitmap_blocks);
+    if (height == 1) {
+        if (w->prev_leaf ? w->prev_flink != node_num : node_num != bt->hdr.bthFNode) {
+            if (VERBOSE || !REPAIR) {
+                printf("Leaf node %lu is out of place in the leaf chain\n", node_num);
+            }
+            w->errors_found++;
+        }
+        w->prev_leaf = node_num;
+        w->prev_flink = n.nd.ndFLink;
+        return;
     }
     
-    /* Read and verify allocation bitmap */
-    for (i = 0; i < bitmap_blocks; i++) {
-        if (l_getblock(&vol->priv, vol->mdb.drVBMSt + i, bitmap_block) == -1) {
+    for (i = 0; i < n.nd.ndNRecs && w->errors_found == 0; i++) {
+        const byte *rec = HFS_NODEREC(n, i);
+        
+        if (n.roff[i + 1] <= n.roff[i] || n.roff[i + 1] > HFS_BLOCKSZ ||
+            HFS_RECLEN(n, i) < HFS_RECKEYSKIP(rec) + 4) {
             if (VERBOSE || !REPAIR) {
-                printf("Failed to read bitmap block %u\n", i);
+                printf("Bad index record %d in B-tree node %lu\n", i, node_num);
             }
-            errors_found++;
-            continue;
+            w->errors_found++;
+            return;
+        }
+        
+        walk_index(w, REC_UL(HFS_RECDATA(rec)), height - 1);
+    }
+}
+
+/*
+ * NAME:    check_btree_index()
+ * DESCRIPTION: Check that the index nodes reach every leaf, in order
+ */
+static int check_btree_index(btree *bt)
+{
+    struct index_walk w;
+    
+    if (bt->hdr.bthDepth == 0 || bt->hdr.bthRoot == 0) {
+        return 0; /* Empty tree has no index */
+    }
+    
+    memset(&w, 0, sizeof(w));
+    w.bt = bt;
+    
+    walk_index(&w, bt->hdr.bthRoot, bt->hdr.bthDepth);
+    
+    if (w.errors_found == 0 && w.prev_leaf != bt->hdr.bthLNode) {
+        if (VERBOSE || !REPAIR) {
+            printf("B-tree index ends at leaf node %lu, not at last leaf %lu\n",
+                   w.prev_leaf, bt->hdr.bthLNode);
+        }
+        w.errors_found++;
+    }
+    
+    return w.errors_found;
+}
+
+/*
+ * NAME:    mark_run()
+ * DESCRIPTION: Mark one extent in the expected bitmap, reporting runs
+ *              that are out of range or already claimed
+ */
+static int mark_run(alloc_bitmap_t *expected, unsigned int start,
+                    unsigned int count, unsigned long fnum)
+{
+    int errors_found = 0;
+    uint32_t overlap;
+    
+    if (count == 0) {
+        return 0;
+    }
+    
+    if (alloc_bitmap_mark(expected, start, count, &overlap) == -1) {
+        if (VERBOSE || !REPAIR) {
+            printf("Extent %u+%u of file %lu extends beyond volume end\n",
+                   start, count, fnum);
         }
+        errors_found++;
+    }
+    if (overlap > 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("Extent %u+%u of file %lu shares %u blocks with another file\n",
+                   start, count, fnum, overlap);
+        }
+        errors_found++;
+    }
+    
+    return errors_found;
+}
+
+/*
+ * NAME:    mark_extents()
+ * DESCRIPTION: Mark the three extents of a raw extent record
+ */
+static int mark_extents(alloc_bitmap_t *expected, const byte *rec, unsigned long fnum)
+{
+    int errors_found = 0;
+    
+    for (int i = 0; i < 3; i++) {
+        errors_found += mark_run(expected, REC_UW(rec + 4 * i),
+                                 REC_UW(rec + 4 * i + 2), fnum);
+    }
+    
+    return errors_found;
+}
+
+/*
+ * NAME:    mark_tree_extents()
+ * DESCRIPTION: Walk the leaf records of the extents or catalog B*-tree
+ *              and mark every extent they hold; returns -1 unless every
+ *              leaf was reached exactly once, since blocks would be freed
+ *              on the word of a partial walk
+ */
+static int mark_tree_extents(hfsvol *vol, btree *bt, alloc_bitmap_t *expected)
+{
+    int errors_found = 0;
+    unsigned long node_num;
+    struct leaf_walk w;
+    node n;
+    
+    if (bt_readhdr(bt) == -1 || leaf_walk_init(&w, bt) == -1) {
+        return -1;
+    }
+    
+    n.bt = bt;
+    node_num = leaf_walk_next(&w, bt->hdr.bthFNode);
+    
+    while (node_num != 0) {
+        n.nnum = node_num;
+        if (bt_getnode(&n) == -1 || n.nd.ndType != ndLeafNode) {
+            alloc_bitmap_free(&w.seen);
+            return -1;
+        }
+        fsck_metrics_records(n.nd.ndNRecs);
         
-        /* Count free blocks in this bitmap block */
-        for (j = 0; j < HFS_BLOCKSZ; j++) {
-            unsigned char byte_val = bitmap_block[j];
-            unsigned int block_base = (i * HFS_BLOCKSZ + j) * 8;
+        for (int i = 0; i < n.nd.ndNRecs; i++) {
+            const byte *rec = HFS_NODEREC(n, i);
+            const byte *data;
             
-            /* Don't count beyond total blocks */
-            if (block_base >= total_blocks) {
-                break;
+            if (n.roff[i] < 14 || n.roff[i] >= n.roff[i + 1] ||
+                n.roff[i + 1] > HFS_BLOCKSZ - 2 * (n.nd.ndNRecs + 1)) {
+                continue;
             }
+            data = HFS_RECDATA(rec);
             
-            /* Count zero bits (free blocks) */
-            for (int bit = 0; bit < 8 && (block_base + bit) < total_blocks; bit++) {
-                if ((byte_val & (1 << (7 - bit))) == 0) {
-                    actual_free++;
+            if (bt == &vol->ext) {
+                /* Key: length, fork type, file number, first block */
+                if (data + 12 <= n.data + n.roff[i + 1]) {
+                    errors_found += mark_extents(expected, data, REC_UL(rec + 2));
                 }
+            } else if (data[0] == cdrFilRec &&
+                       data + 98 <= n.data + n.roff[i + 1]) {
+                /* File record: data fork at 74, resource fork at 86 */
+                errors_found += mark_extents(expected, data + 74, REC_UL(data + 20));
+                errors_found += mark_extents(expected, data + 86, REC_UL(data + 20));
             }
         }
+        
+        node_num = leaf_walk_next(&w, n.nd.ndFLink);
+    }
+    
+    alloc_bitmap_free(&w.seen);
+    if (w.broken) {
+        if (VERBOSE) {
+            leaf_walk_report(&w);
+        }
+        return -1;
+    }
+    
+    return errors_found;
+}
+
+/*
+ * NAME:    build_expected_bitmap()
+ * DESCRIPTION: Build the bitmap the volume should have from the system
+ *              file extents in the MDB, the extents overflow records and
+ *              every file record in the catalog
+ */
+static int build_expected_bitmap(hfsvol *vol, alloc_bitmap_t *expected)
+{
+    int errors_found = 0;
+    int result;
+    
+    if (alloc_bitmap_init(expected, vol->mdb.drNmAlBlks) == -1) {
+        return -1;
+    }
+    
+    for (int i = 0; i < 3; i++) {
+        errors_found += mark_run(expected, vol->mdb.drXTExtRec[i].xdrStABN,
+                                 vol->mdb.drXTExtRec[i].xdrNumABlks, HFS_CNID_EXT);
+        errors_found += mark_run(expected, vol->mdb.drCTExtRec[i].xdrStABN,
+                                 vol->mdb.drCTExtRec[i].xdrNumABlks, HFS_CNID_CAT);
+    }
+    
+    /* Tree walks are credited to their own phases in --metrics */
+    fsck_metrics_begin(FSCK_PHASE_EXTENTS);
+    result = mark_tree_extents(vol, &vol->ext, expected);
+    fsck_metrics_end(FSCK_PHASE_EXTENTS, 0);
+    if (result >= 0) {
+        errors_found += result;
+        fsck_metrics_begin(FSCK_PHASE_CATALOG);
+        result = mark_tree_extents(vol, &vol->cat, expected);
+        fsck_metrics_end(FSCK_PHASE_CATALOG, 0);
+    }
+    if (result < 0) {
+        alloc_bitmap_free(expected);
+        return -1;
+    }
+    errors_found += result;
+    
+    return errors_found;
+}
+
+/*
+ * NAME:    report_bitmap_run()
+ * DESCRIPTION: Describe one run where the bitmap disagrees with the files
+ */
+static void report_bitmap_run(int leaked, uint32_t start, uint32_t count, void *arg)
+{
+    unsigned int *listed = arg;
+    
+    if (!(VERBOSE || !REPAIR) || (*listed)++ >= BITMAP_MAX_RUNS) {
+        return;
+    }
+    
+    if (leaked) {
+        printf("Allocation blocks %u-%u are marked in use but belong to no file\n",
+               start, start + count - 1);
+    } else {
+        printf("Allocation blocks %u-%u are in use but marked free\n",
+               start, start + count - 1);
+    }
+}
+
+static int verify_allocation_blocks(hfsvol *vol, const alloc_bitmap_t *expected,
+                                    const byte *ondisk)
+{
+    int errors_found = 0;
+    unsigned int total_blocks = vol->mdb.drNmAlBlks;
+    unsigned int free_blocks = vol->mdb.drFreeBks;
+    unsigned int listed = 0;
+    alloc_bitmap_diff_t diff;
+    
+    if (VERBOSE) {
+        printf("Total allocation blocks: %u\n", total_blocks);
+        printf("Free blocks reported: %u\n", free_blocks);
     }
     
-    /* Compare actual free count with reported count */
-    if (actual_free != free_blocks) {
+    /* Compare the rebuilt bitmap with the one on disk */
+    alloc_bitmap_compare(expected, ondisk, report_bitmap_run, &listed, &diff);
+    
+    if (listed > BITMAP_MAX_RUNS && (VERBOSE || !REPAIR)) {
+        printf("(%u more differing runs not listed)\n", listed - BITMAP_MAX_RUNS);
+    }
+    
+    if (diff.leaked > 0) {
         if (VERBOSE || !REPAIR) {
-            printf("Free block count mismatch: reported %u, actual %u\n",
-                   free_blocks, actual_free);
+            printf("%u allocation blocks in %u runs are leaked\n",
+                   diff.leaked, diff.leakedRuns);
         }
         errors_found++;
     }
     
-    /* Check for blocks allocated to system files */
-    unsigned int system_blocks = 0;
-    
-    /* Count blocks used by extents file */
-    for (i = 0; i < 3; i++) {
-        if (vol->mdb.drXTExtRec[i].xdrNumABlks > 0) {
-            system_blocks += vol->mdb.drXTExtRec[i].xdrNumABlks;
+    if (diff.missing > 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("%u allocation blocks in %u runs are in use but marked free\n",
+                   diff.missing, diff.missingRuns);
         }
+        errors_found++;
     }
     
-    /* Count blocks used by catalog file */
-    for (i = 0; i < 3; i++) {
-        if (vol->mdb.drCTExtRec[i].xdrNumABlks > 0) {
-            system_blocks += vol->mdb.drCTExtRec[i].xdrNumABlks;
+    if (free_blocks != total_blocks - diff.used) {
+        if (VERBOSE || !REPAIR) {
+            printf("Free block count mismatch: reported %u, actual %u\n",
+                   free_blocks, total_blocks - diff.used);
         }
+        errors_found++;
     }
     
     if (VERBOSE) {
-        printf("System files use %u allocation blocks\n", system_blocks);
-        printf("User files use %u allocation blocks\n", 
-               total_blocks - actual_free - system_blocks);
+        printf("Files use %u of %u allocation blocks\n", diff.used, total_blocks);
     }
     
     return errors_found;
 }
 
-static int repair_allocation_bitmap(hfsvol *vol)
+/*
+ * NAME:    repair_allocation_bitmap()
+ * DESCRIPTION: Write the rebuilt bitmap, only the blocks that differ, and
+ *              the matching free block count
+ */
+static int repair_allocation_bitmap(hfsvol *vol, const alloc_bitmap_t *expected,
+                                    const byte *ondisk)
 {
-    int repairs_made = 0;
-    unsigned int total_blocks = vol->mdb.drNmAlBlks;
-    unsigned int bitmap_blocks;
-    unsigned int i, j;
+    unsigned int bitmap_blocks = (vol->mdb.drNmAlBlks + 4095) / 4096;
+    unsigned int written = 0;
+    unsigned int i;
     block bitmap_block;
-    unsigned int actual_free = 0;
+    unsigned int actual_free;
     
     if (VERBOSE) {
         printf("Repairing allocation bitmap\n");
     }
     
-    /* Calculate number of bitmap blocks */
-    bitmap_blocks = (total_blocks + 4095) / 4096;
-    
-    /* Recalculate free block count */
     for (i = 0; i < bitmap_blocks; i++) {
-        if (l_getblock(&vol->priv, vol->mdb.drVBMSt + i, bitmap_block) == -1) {
+        size_t offset = (size_t) i * HFS_BLOCKSZ;
+        size_t len = expected->nbytes - offset;
+        
+        if (len > HFS_BLOCKSZ) {
+            len = HFS_BLOCKSZ;
+        }
+        
+        /* Bits past the last allocation block are kept clear */
+        memset(bitmap_block, 0, HFS_BLOCKSZ);
+        memcpy(bitmap_block, expected->bits + offset, len);
+        
+        if (memcmp(bitmap_block, ondisk + offset, HFS_BLOCKSZ) == 0) {
             continue;
         }
         
-        /* Count free blocks in this bitmap block */
-        for (j = 0; j < HFS_BLOCKSZ; j++) {
-            unsigned char byte_val = bitmap_block[j];
-            unsigned int block_base = (i * HFS_BLOCKSZ + j) * 8;
-            
-            if (block_base >= total_blocks) {
-                break;
-            }
-            
-            /* Count zero bits (free blocks) */
-            for (int bit = 0; bit < 8 && (block_base + bit) < total_blocks; bit++) {
-                if ((byte_val & (1 << (7 - bit))) == 0) {
-                    actual_free++;
-                }
-            }
+        if (l_putblock(vol->priv, vol->vstart + vol->mdb.drVBMSt + i,
+                       bitmap_block) == -1) {
+            return -1;
         }
+        written++;
+    }
+    
+    if (VERBOSE) {
+        printf("Rewrote %u of %u bitmap blocks\n", written, bitmap_blocks);
     }
     
     /* Update MDB with correct free block count */
+    actual_free = vol->mdb.drNmAlBlks -
+                  alloc_bitmap_count(expected->bits, 0, expected->nblocks);
+    
     if (vol->mdb.drFreeBks != actual_free) {
         if (VERBOSE) {
             printf("Updating free block count from %u to %u\n",
@@ -991,10 +1514,13 @@ static int repair_allocation_bitmap(hfsvol *vol)
         }
         vol->mdb.drFreeBks = actual_free;
         vol->flags |= HFS_VOL_UPDATE_MDB;
-        repairs_made++;
+        
+        if (l_putmdb(vol, &vol->mdb, 0) == -1) {
+            return -1;
+        }
     }
     
-    return repairs_made;
+    return written;
 }
 
 static int validate_catalog_records(hfsvol *vol)
@@ -1004,26 +1530,33 @@ static int validate_catalog_records(hfsvol *vol)
     unsigned long node_num;
     int i;
     byte *rec_ptr;
-    CatKeyRec *key;
-    CatDataRec *data;
+    const byte *data;
+    unsigned long parent;
     unsigned long total_files = 0;
     unsigned long total_dirs = 0;
+    struct leaf_walk w;
     
     if (VERBOSE) {
         printf("Validating catalog records\n");
     }
     
+    if (leaf_walk_init(&w, &vol->cat) == -1) {
+        return -1;
+    }
+    
     /* Walk through catalog B-tree leaf nodes */
     if (vol->cat.hdr.bthFNode > 0) {
         n.bt = &vol->cat;
-        node_num = vol->cat.hdr.bthFNode;
+        node_num = leaf_walk_next(&w, vol->cat.hdr.bthFNode);
         
         while (node_num != 0) {
             n.nnum = node_num;
             
             if (bt_getnode(&n) == -1) {
-                break; /* Already reported in B-tree validation */
+                w.broken = 1; /* Already reported in B-tree validation */
+                break;
             }
+            fsck_metrics_records(n.nd.ndNRecs);
             
             /* Check each record in this node */
             for (i = 0; i < n.nd.ndNRecs; i++) {
@@ -1032,21 +1565,22 @@ static int validate_catalog_records(hfsvol *vol)
                     continue;
                 }
                 
-                key = (CatKeyRec *)rec_ptr;
-                data = (CatDataRec *)HFS_RECDATA(rec_ptr);
+                /* Records are decoded in place: key length, reserved, parent, name */
+                data = HFS_RECDATA(rec_ptr);
+                parent = REC_UL(rec_ptr + 2);
                 
                 /* Validate key length */
-                if (key->ckrKeyLen == 0 || key->ckrKeyLen > HFS_MAX_CATKEY_LEN) {
+                if (rec_ptr[0] == 0 || rec_ptr[0] > HFS_MAX_CATKEY_LEN) {
                     if (VERBOSE || !REPAIR) {
                         printf("Invalid catalog key length %d in node %lu, record %d\n",
-                               key->ckrKeyLen, node_num, i);
+                               rec_ptr[0], node_num, i);
                     }
                     errors_found++;
                     continue;
                 }
                 
                 /* Validate parent directory ID */
-                if (key->ckrParID == 0 && key->ckrCName[0] != 0) {
+                if (parent == 0 && rec_ptr[6] != 0) {
                     if (VERBOSE || !REPAIR) {
                         printf("Invalid parent ID 0 for non-root entry in node %lu, record %d\n",
                                node_num, i);
@@ -1055,12 +1589,15 @@ static int validate_catalog_records(hfsvol *vol)
                 }
                 
                 /* Validate record type and count files/directories */
-                switch (data->cdrType) {
+                switch (data[0]) {
                     case cdrDirRec:
-                        total_dirs++;
+                        /* drDirCnt leaves out the root folder */
+                        if (REC_UL(data + 6) != HFS_CNID_ROOTDIR) {
+                            total_dirs++;
+                        }
                         
                         /* Validate directory record */
-                        if (data->u.dir.dirDirID == 0) {
+                        if (REC_UL(data + 6) == 0) {
                             if (VERBOSE || !REPAIR) {
                                 printf("Directory with invalid ID 0 in node %lu, record %d\n",
                                        node_num, i);
@@ -1073,7 +1610,7 @@ static int validate_catalog_records(hfsvol *vol)
                         total_files++;
                         
                         /* Validate file record */
-                        if (data->u.fil.filFlNum == 0) {
+                        if (REC_UL(data + 20) == 0) {
                             if (VERBOSE || !REPAIR) {
                                 printf("File with invalid ID 0 in node %lu, record %d\n",
                                        node_num, i);
@@ -1081,11 +1618,11 @@ static int validate_catalog_records(hfsvol *vol)
                             errors_found++;
                         }
                         
-                        /* Check file extent records */
-                        for (int ext = 0; ext < 3; ext++) {
-                            ExtDescriptor *extent = &data->u.fil.filExtRec[ext];
-                            if (extent->xdrNumABlks > 0) {
-                                if (extent->xdrStABN >= vol->mdb.drNmAlBlks) {
+                        /* Check both forks' extent records, data then resource */
+                        for (int ext = 0; ext < 6; ext++) {
+                            const byte *extent = data + 74 + 4 * ext;
+                            if (REC_UW(extent + 2) > 0) {
+                                if (REC_UW(extent) >= vol->mdb.drNmAlBlks) {
                                     if (VERBOSE || !REPAIR) {
                                         printf("File extent %d starts beyond volume end in node %lu, record %d\n",
                                                ext, node_num, i);
@@ -1098,7 +1635,7 @@ static int validate_catalog_records(hfsvol *vol)
                         
                     case cdrThdRec:
                         /* Thread record - validate parent ID */
-                        if (data->u.dthd.thdParID == 0 && key->ckrParID != fsRtParID) {
+                        if (REC_UL(data + 10) == 0 && parent != fsRtParID) {
                             if (VERBOSE || !REPAIR) {
                                 printf("Thread record with invalid parent ID in node %lu, record %d\n",
                                        node_num, i);
@@ -1109,7 +1646,7 @@ static int validate_catalog_records(hfsvol *vol)
                         
                     case cdrFThdRec:
                         /* File thread record - similar validation */
-                        if (data->u.fthd.fthdParID == 0 && key->ckrParID != fsRtParID) {
+                        if (REC_UL(data + 10) == 0 && parent != fsRtParID) {
                             if (VERBOSE || !REPAIR) {
                                 printf("File thread record with invalid parent ID in node %lu, record %d\n",
                                        node_num, i);
@@ -1121,20 +1658,25 @@ static int validate_catalog_records(hfsvol *vol)
                     default:
                         if (VERBOSE || !REPAIR) {
                             printf("Unknown catalog record type %d in node %lu, record %d\n",
-                                   data->cdrType, node_num, i);
+                                   data[0], node_num, i);
                         }
                         errors_found++;
                         break;
                 }
             }
             
-            node_num = n.nd.ndFLink;
-            
-            /* Prevent infinite loops */
-            if (node_num == vol->cat.hdr.bthFNode) {
-                break;
-            }
+            node_num = leaf_walk_next(&w, n.nd.ndFLink);
+        }
+    }
+    
+    alloc_bitmap_free(&w.seen);
+    
+    /* A partial walk undercounts; leave the MDB counts alone */
+    if (w.broken) {
+        if (VERBOSE) {
+            leaf_walk_report(&w);
         }
+        return -1;
     }
     
     /* Compare counted files/directories with MDB values */
@@ -1231,6 +1773,32 @@ static int check_file_extents(hfsvol *vol)
     return errors_found;
 }
 
+/*
+ * NAME:    rebuild_catalog()
+ * DESCRIPTION: Offer to replace a damaged catalog B*-tree with one built
+ *              from the records of its leaf nodes; returns the new result
+ *              of the catalog B-tree phase
+ */
+static int rebuild_catalog(hfsvol *vol, int result)
+{
+    if (!(YES || ask("Catalog B-tree is damaged; rebuild it from its leaf records"))) {
+        return result;
+    }
+    
+    if (hfs_rebuild_catalog(vol) < 0) {
+        fprintf(stderr, "fsck.hfs: catalog B-tree rebuild failed\n");
+        return result;
+    }
+    
+    /* The new tree must pass the same checks */
+    if (check_btree_enhanced(&vol->cat, "catalog") != 0) {
+        fprintf(stderr, "fsck.hfs: rebuilt catalog B-tree still has errors\n");
+        return -1;
+    }
+    
+    return result > 0 ? result : 1;
+}
+
 static int repair_btree_node(btree *bt, unsigned long node_num)
 {
     node n;
@@ -0,0 +1,700 @@
+/*
+ * hfs_rebuild.c - Rebuild a damaged HFS catalog B*-tree
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Once the index of a catalog is damaged, patching it a node at a time
+ * rarely gives back a usable tree.  Instead every node of the catalog
+ * file is read in order, ignoring the index and the leaf chain, and each
+ * leaf node that still looks sound gives up its records.  The records are
+ * sorted by key, the stale copies of a key left behind by earlier node
+ * splits are dropped, and a new tree of fully packed nodes is built from
+ * the bottom up and written over the old one.
+ */
+
+#include "fsck_hfs.h"
+#include "fsck_metrics.h"
+
+#define VERBOSE (options & HFSCK_VERBOSE)
+
+/* Big-endian fields of raw nodes */
+#define REC_UL(p)     ((unsigned long) (p)[0] << 24 | (unsigned long) (p)[1] << 16 | \
+                       (unsigned long) (p)[2] << 8 | (unsigned long) (p)[3])
+#define PUT_UL(p, v)  ((p)[0] = (byte) ((v) >> 24), (p)[1] = (byte) ((v) >> 16), \
+                       (p)[2] = (byte) ((v) >> 8), (p)[3] = (byte) (v))
+#define PUT_UW(p, v)  ((p)[0] = (byte) ((v) >> 8), (p)[1] = (byte) (v))
+
+/* Layout of a catalog node */
+#define NODE_DESCSZ     14
+#define INDEX_KEYLEN    0x25        /* Catalog index keys are always this long */
+#define INDEX_RECLEN    (1 + INDEX_KEYLEN + 4)
+#define INDEX_PER_NODE  ((HFS_BLOCKSZ - NODE_DESCSZ - 2) / (INDEX_RECLEN + 2))
+#define MAX_RECLEN      (1 + HFS_MAX_CATKEY_LEN + 102)
+
+/* Header node records and the node usage map */
+#define HDR_REC         NODE_DESCSZ
+#define HDR_USERREC     0x78
+#define HDR_MAPREC      0xf8
+#define HDR_FREESPACE   0x1f8
+#define MAPNODE_BITS    (HFS_MAPXSZ * 8)
+
+/* The MacOS collating order for HFS names, as in libhfs */
+static const byte charorder[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+
+    0x20, 0x22, 0x23, 0x28, 0x29, 0x2a, 0x2b, 0x2c,
+    0x2f, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e,
+    0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+
+    0x47, 0x48, 0x58, 0x5a, 0x5e, 0x60, 0x67, 0x69,
+    0x6b, 0x6d, 0x73, 0x75, 0x77, 0x79, 0x7b, 0x7f,
+    0x8d, 0x8f, 0x91, 0x93, 0x96, 0x98, 0x9f, 0xa1,
+    0xa3, 0xa5, 0xa8, 0xaa, 0xab, 0xac, 0xad, 0xae,
+
+    0x54, 0x48, 0x58, 0x5a, 0x5e, 0x60, 0x67, 0x69,
+    0x6b, 0x6d, 0x73, 0x75, 0x77, 0x79, 0x7b, 0x7f,
+    0x8d, 0x8f, 0x91, 0x93, 0x96, 0x98, 0x9f, 0xa1,
+    0xa3, 0xa5, 0xa8, 0xaf, 0xb0, 0xb1, 0xb2, 0xb3,
+
+    0x4c, 0x50, 0x5c, 0x62, 0x7d, 0x81, 0x9a, 0x55,
+    0x4a, 0x56, 0x4c, 0x4e, 0x50, 0x5c, 0x62, 0x64,
+    0x65, 0x66, 0x6f, 0x70, 0x71, 0x72, 0x7d, 0x89,
+    0x8a, 0x8b, 0x81, 0x83, 0x9c, 0x9d, 0x9e, 0x9a,
+
+    0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0x95,
+    0xbb, 0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0x52, 0x85,
+    0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8,
+    0xc9, 0xca, 0xcb, 0x57, 0x8c, 0xcc, 0x52, 0x85,
+
+    0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0x26,
+    0x27, 0xd4, 0x20, 0x4a, 0x4e, 0x83, 0x87, 0x87,
+    0xd5, 0xd6, 0x24, 0x25, 0x2d, 0x2e, 0xd7, 0xd8,
+    0xa7, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+
+    0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+    0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+    0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+/* A leaf record that survived */
+struct catrec {
+    unsigned long mddate;       /* Modification date of files and folders */
+    unsigned long seq;          /* Order found, to keep the sort stable */
+    unsigned int len;
+    byte data[MAX_RECLEN];
+};
+
+/* One record of the level being written */
+struct recref {
+    const byte *data;
+    unsigned int len;
+};
+
+/* Everything the rebuild keeps track of */
+struct rebuild {
+    btree *bt;
+    unsigned long nnodes;       /* Nodes in the catalog file */
+    byte *inuse;                /* Old usage map, NULL if unreadable */
+
+    struct catrec *recs;
+    unsigned long nrecs, maxrecs;
+    unsigned long leaves;       /* Leaf nodes that gave up records */
+    unsigned long badrecs;      /* Records that did not look sound */
+
+    byte *map;                  /* Usage map of the new tree */
+    unsigned long next;         /* Next node to write */
+};
+
+/*
+ * NAME:    hfs_compare_catkeys()
+ * DESCRIPTION: Order two raw catalog keys by parent ID, then by name as
+ *              MacOS does
+ */
+int hfs_compare_catkeys(const byte *k1, const byte *k2)
+{
+    unsigned long p1 = REC_UL(k1 + 2), p2 = REC_UL(k2 + 2);
+    unsigned int n1 = k1[6], n2 = k2[6];
+
+    if (p1 != p2) {
+        return p1 < p2 ? -1 : 1;
+    }
+
+    for (unsigned int i = 0; i < n1 && i < n2; i++) {
+        int diff = charorder[k1[7 + i]] - charorder[k2[7 + i]];
+
+        if (diff) {
+            return diff;
+        }
+    }
+
+    return (int) n1 - (int) n2;
+}
+
+/*
+ * NAME:    compare_recs()
+ * DESCRIPTION: qsort() order of surviving records: by key, and for equal
+ *              keys the most recently modified copy first
+ */
+static int compare_recs(const void *a, const void *b)
+{
+    const struct catrec *r1 = a, *r2 = b;
+    int cmp = hfs_compare_catkeys(r1->data, r2->data);
+
+    if (cmp) {
+        return cmp;
+    }
+    if (r1->mddate != r2->mddate) {
+        return r1->mddate > r2->mddate ? -1 : 1;
+    }
+
+    return r1->seq < r2->seq ? -1 : r1->seq > r2->seq;
+}
+
+/*
+ * NAME:    record_datalen()
+ * DESCRIPTION: Size of the data of a catalog record type, 0 if unknown
+ */
+static unsigned int record_datalen(int type)
+{
+    switch (type) {
+    case cdrDirRec:  return 70;
+    case cdrFilRec:  return 102;
+    case cdrThdRec:
+    case cdrFThdRec: return 46;
+    default:         return 0;
+    }
+}
+
+/*
+ * NAME:    add_record()
+ * DESCRIPTION: Keep one leaf record if it looks sound
+ */
+static int add_record(struct rebuild *rb, const byte *rec, unsigned int len)
+{
+    unsigned int keylen = HFS_RECKEYLEN(rec), skip, datalen;
+    struct catrec *r;
+    const byte *data;
+
+    if (keylen < 6 || keylen > HFS_MAX_CATKEY_LEN || 6 + rec[6] > keylen) {
+        return 0;
+    }
+
+    skip = HFS_RECKEYSKIP(rec);
+    if (skip >= len) {
+        return 0;
+    }
+    data = rec + skip;
+    datalen = record_datalen((SignedByte) data[0]);
+    if (datalen == 0 || skip + datalen > len) {
+        return 0;
+    }
+
+    if (rb->nrecs == rb->maxrecs) {
+        unsigned long max = rb->maxrecs ? rb->maxrecs * 2 : 1024;
+        struct catrec *recs = realloc(rb->recs, max * sizeof(*recs));
+
+        if (!recs) {
+            return -1;
+        }
+        rb->recs = recs;
+        rb->maxrecs = max;
+    }
+
+    r = &rb->recs[rb->nrecs];
+    r->len = skip + datalen;
+    r->seq = rb->nrecs++;
+    memcpy(r->data, rec, r->len);
+
+    switch ((SignedByte) data[0]) {
+    case cdrDirRec:  r->mddate = REC_UL(data + 14); break;
+    case cdrFilRec:  r->mddate = REC_UL(data + 48); break;
+    default:         r->mddate = 0;                 break;
+    }
+
+    return 1;
+}
+
+/*
+ * NAME:    sound_offsets()
+ * DESCRIPTION: Tell whether the record offsets of a node are usable
+ */
+static int sound_offsets(const node *n)
+{
+    int i;
+
+    if (n->roff[0] != NODE_DESCSZ) {
+        return 0;
+    }
+    for (i = 0; i < n->nd.ndNRecs; i++) {
+        if (n->roff[i + 1] <= n->roff[i]) {
+            return 0;
+        }
+    }
+
+    return n->roff[n->nd.ndNRecs] <= HFS_BLOCKSZ - 2 * (n->nd.ndNRecs + 1);
+}
+
+/*
+ * NAME:    load_usage_map()
+ * DESCRIPTION: Read the old node usage map, so that nodes freed long ago
+ *              do not bring deleted records back; NULL if it is damaged
+ */
+static byte *load_usage_map(struct rebuild *rb)
+{
+    unsigned long mapsz = (rb->nnodes + 7) / 8, have;
+    unsigned long nnum, hops = 0;
+    byte *map;
+    node n;
+
+    n.bt = rb->bt;
+    n.nnum = 0;
+    if (bt_getnode(&n) == -1 || n.nd.ndType != ndHdrNode ||
+        n.nd.ndNRecs != 3 || !sound_offsets(&n) ||
+        REC_UL(HFS_NODEREC(n, 0) + 22) != rb->nnodes) {
+        return NULL;
+    }
+
+    map = calloc(mapsz ? mapsz : 1, 1);
+    if (!map) {
+        return NULL;
+    }
+
+    have = HFS_RECLEN(n, 2) < mapsz ? HFS_RECLEN(n, 2) : mapsz;
+    memcpy(map, HFS_NODEREC(n, 2), have);
+
+    /* Larger trees continue the map in a chain of map nodes */
+    nnum = n.nd.ndFLink;
+    while (have < mapsz) {
+        unsigned long len;
+
+        n.nnum = nnum;
+        if (nnum == 0 || nnum >= rb->nnodes || ++hops > rb->nnodes ||
+            bt_getnode(&n) == -1 || n.nd.ndType != ndMapNode ||
+            n.nd.ndNRecs < 1 || !sound_offsets(&n)) {
+            free(map);
+            return NULL;
+        }
+
+        len = HFS_RECLEN(n, 0);
+        if (len > mapsz - have) {
+            len = mapsz - have;
+        }
+        memcpy(map + have, HFS_NODEREC(n, 0), len);
+        have += len;
+        nnum = n.nd.ndFLink;
+    }
+
+    return map;
+}
+
+/*
+ * NAME:    scan_leaves()
+ * DESCRIPTION: Gather the records of every sound leaf node in the file
+ */
+static int scan_leaves(struct rebuild *rb)
+{
+    node n;
+
+    n.bt = rb->bt;
+
+    for (unsigned long nnum = 1; nnum < rb->nnodes; nnum++) {
+        int kept = 0;
+
+        if (rb->inuse && !(rb->inuse[nnum >> 3] & (0x80 >> (nnum & 7)))) {
+            continue;
+        }
+
+        n.nnum = nnum;
+        if (bt_getnode(&n) == -1 || n.nd.ndType != ndLeafNode ||
+            n.nd.ndNHeight != 1 || !sound_offsets(&n)) {
+            continue;
+        }
+        fsck_metrics_records(n.nd.ndNRecs);
+
+        for (int i = 0; i < n.nd.ndNRecs; i++) {
+            int result = add_record(rb, HFS_NODEREC(n, i), HFS_RECLEN(n, i));
+
+            if (result < 0) {
+                return -1;
+            }
+            if (result == 0) {
+                rb->badrecs++;
+            }
+            kept += result;
+        }
+        if (kept) {
+            rb->leaves++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * NAME:    drop_duplicates()
+ * DESCRIPTION: Sort the records and keep the newest copy of each key;
+ *              returns the number dropped
+ */
+static unsigned long drop_duplicates(struct rebuild *rb)
+{
+    unsigned long i, out = 0;
+
+    qsort(rb->recs, rb->nrecs, sizeof(*rb->recs), compare_recs);
+
+    for (i = 0; i < rb->nrecs; i++) {
+        if (out > 0 && hfs_compare_catkeys(rb->recs[out - 1].data, rb->recs[i].data) == 0) {
+            continue;
+        }
+        if (out != i) {
+            rb->recs[out] = rb->recs[i];
+        }
+        out++;
+    }
+
+    i = rb->nrecs - out;
+    rb->nrecs = out;
+
+    return i;
+}
+
+/*
+ * NAME:    fits()
+ * DESCRIPTION: Tell whether one more record fits in a node
+ */
+static int fits(unsigned int used, int nrecs, unsigned int len)
+{
+    return NODE_DESCSZ + used + len + 2 * (nrecs + 2) <= HFS_BLOCKSZ;
+}
+
+/*
+ * NAME:    count_nodes()
+ * DESCRIPTION: Number of fully packed nodes a level of records needs
+ */
+static unsigned long count_nodes(const struct recref *recs, unsigned long nrecs)
+{
+    unsigned long nodes = 0;
+    unsigned int used = 0;
+    int count = 0;
+
+    for (unsigned long i = 0; i < nrecs; i++) {
+        if (count == 0 || !fits(used, count, recs[i].len)) {
+            nodes++;
+            used = 0;
+            count = 0;
+        }
+        used += recs[i].len;
+        count++;
+    }
+
+    return nodes;
+}
+
+/*
+ * NAME:    put_node()
+ * DESCRIPTION: Write a node and mark it in use in the new map
+ */
+static int put_node(struct rebuild *rb, node *n)
+{
+    rb->map[n->nnum >> 3] |= 0x80 >> (n->nnum & 7);
+
+    return bt_putnode(n);
+}
+
+/*
+ * NAME:    write_level()
+ * DESCRIPTION: Pack one level of the tree into consecutive nodes and
+ *              make the index records of the level above
+ */
+static int write_level(struct rebuild *rb, const struct recref *recs,
+                       unsigned long nrecs, int height,
+                       byte **index, unsigned long *nindex)
+{
+    unsigned long nodes = count_nodes(recs, nrecs), first = rb->next, i = 0;
+    byte *up;
+    node n;
+
+    up = malloc(nodes * INDEX_RECLEN);
+    if (!up) {
+        return -1;
+    }
+
+    n.bt = rb->bt;
+
+    for (unsigned long k = 0; k < nodes; k++) {
+        const byte *key = recs[i].data;
+        byte *ix = up + k * INDEX_RECLEN;
+        unsigned int used = 0;
+
+        memset(&n.nd, 0, sizeof(n.nd));
+        memset(n.data, 0, sizeof(n.data));
+        n.nnum = first + k;
+        n.nd.ndFLink = k + 1 < nodes ? n.nnum + 1 : 0;
+        n.nd.ndBLink = k > 0 ? n.nnum - 1 : 0;
+        n.nd.ndType = height == 1 ? ndLeafNode : ndIndxNode;
+        n.nd.ndNHeight = height;
+        n.roff[0] = NODE_DESCSZ;
+
+        while (i < nrecs && (n.nd.ndNRecs == 0 || fits(used, n.nd.ndNRecs, recs[i].len))) {
+            memcpy(n.data + NODE_DESCSZ + used, recs[i].data, recs[i].len);
+            used += recs[i].len;
+            n.roff[++n.nd.ndNRecs] = NODE_DESCSZ + used;
+            i++;
+        }
+
+        if (put_node(rb, &n) == -1) {
+            free(up);
+            return -1;
+        }
+
+        /* Index keys are padded to full length */
+        memset(ix, 0, INDEX_RECLEN);
+        ix[0] = INDEX_KEYLEN;
+        memcpy(ix + 1, key + 1, HFS_RECKEYLEN(key));
+        PUT_UL(HFS_RECDATA(ix), n.nnum);
+    }
+
+    rb->next = first + nodes;
+    *index = up;
+    *nindex = nodes;
+
+    return 0;
+}
+
+/*
+ * NAME:    write_map()
+ * DESCRIPTION: Write the header node, and the map nodes the new usage
+ *              map spills into
+ */
+static int write_map(struct rebuild *rb, unsigned long mapnodes,
+                     unsigned int depth, unsigned long root,
+                     unsigned long leaves, unsigned long used)
+{
+    unsigned long mapsz = (rb->nnodes + 7) / 8, done;
+    byte *hdr;
+    node n;
+
+    n.bt = rb->bt;
+
+    /* Map nodes follow the header */
+    done = HFS_MAP1SZ;
+    for (unsigned long k = 0; k < mapnodes; k++) {
+        unsigned long len = mapsz - done < HFS_MAPXSZ ? mapsz - done : HFS_MAPXSZ;
+
+        memset(&n.nd, 0, sizeof(n.nd));
+        memset(n.data, 0, sizeof(n.data));
+        n.nnum = 1 + k;
+        n.nd.ndFLink = k + 1 < mapnodes ? n.nnum + 1 : 0;
+        n.nd.ndType = ndMapNode;
+        n.nd.ndNRecs = 1;
+        n.roff[0] = NODE_DESCSZ;
+        n.roff[1] = NODE_DESCSZ + HFS_MAPXSZ;
+        memcpy(n.data + NODE_DESCSZ, rb->map + done, len);
+        done += len;
+
+        if (bt_putnode(&n) == -1) {
+            return -1;
+        }
+    }
+
+    memset(&n.nd, 0, sizeof(n.nd));
+    memset(n.data, 0, sizeof(n.data));
+    n.nnum = 0;
+    n.nd.ndFLink = mapnodes ? 1 : 0;
+    n.nd.ndType = ndHdrNode;
+    n.nd.ndNRecs = 3;
+    n.roff[0] = HDR_REC;
+    n.roff[1] = HDR_USERREC;
+    n.roff[2] = HDR_MAPREC;
+    n.roff[3] = HDR_FREESPACE;
+
+    hdr = n.data + HDR_REC;
+    PUT_UW(hdr + 0, depth);
+    PUT_UL(hdr + 2, root);
+    PUT_UL(hdr + 6, rb->nrecs);
+    PUT_UL(hdr + 10, depth ? 1 + mapnodes : 0);
+    PUT_UL(hdr + 14, depth ? mapnodes + leaves : 0);
+    PUT_UW(hdr + 18, HFS_BLOCKSZ);
+    PUT_UW(hdr + 20, HFS_MAX_CATKEY_LEN);
+    PUT_UL(hdr + 22, rb->nnodes);
+    PUT_UL(hdr + 26, rb->nnodes - used);
+    memcpy(n.data + HDR_MAPREC, rb->map, mapsz < HFS_MAP1SZ ? mapsz : HFS_MAP1SZ);
+
+    return bt_putnode(&n);
+}
+
+/*
+ * NAME:    build_tree()
+ * DESCRIPTION: Write the sorted records as a new, fully packed tree
+ */
+static int build_tree(struct rebuild *rb)
+{
+    unsigned long mapnodes = 0, leaves = 0, root = 0, nlevel, used, count;
+    unsigned int depth = 0;
+    struct recref *level;
+    byte *below = NULL;
+    node n;
+
+    if (rb->nnodes > HFS_MAP1SZ * 8) {
+        mapnodes = (rb->nnodes - HFS_MAP1SZ * 8 + MAPNODE_BITS - 1) / MAPNODE_BITS;
+    }
+
+    level = malloc(rb->nrecs * sizeof(*level));
+    rb->map = calloc(mapnodes * HFS_MAPXSZ + HFS_MAP1SZ, 1);
+    if (!level || !rb->map) {
+        free(level);
+        return -1;
+    }
+
+    nlevel = rb->nrecs;
+    for (unsigned long i = 0; i < nlevel; i++) {
+        level[i].data = rb->recs[i].data;
+        level[i].len = rb->recs[i].len;
+    }
+
+    /* Make sure the whole tree fits before touching the disk */
+    used = 1 + mapnodes;
+    for (count = count_nodes(level, nlevel); ; count = (count + INDEX_PER_NODE - 1) / INDEX_PER_NODE) {
+        used += count;
+        depth++;
+        if (count == 1) {
+            break;
+        }
+    }
+    if (used > rb->nnodes) {
+        fprintf(stderr, "fsck.hfs: rebuilt catalog needs %lu nodes but the file has %lu\n",
+                used, rb->nnodes);
+        free(level);
+        return -1;
+    }
+
+    rb->map[0] = 0x80;
+    for (unsigned long k = 1; k <= mapnodes; k++) {
+        rb->map[k >> 3] |= 0x80 >> (k & 7);
+    }
+
+    /* Leaves first, then each index level from the first keys below it */
+    rb->next = 1 + mapnodes;
+    for (int height = 1; ; height++) {
+        unsigned long nindex;
+        byte *index;
+
+        if (write_level(rb, level, nlevel, height, &index, &nindex) == -1) {
+            free(below);
+            free(level);
+            return -1;
+        }
+        free(below);
+        below = NULL;
+
+        if (height == 1) {
+            leaves = nindex;
+        }
+        if (nindex == 1) {
+            root = rb->next - 1;
+            free(index);
+            break;
+        }
+
+        for (unsigned long i = 0; i < nindex; i++) {
+            level[i].data = index + i * INDEX_RECLEN;
+            level[i].len = INDEX_RECLEN;
+        }
+        nlevel = nindex;
+        below = index;
+    }
+    free(level);
+
+    /* Old nodes left unused could bring stale records back later */
+    n.bt = rb->bt;
+    memset(&n.nd, 0, sizeof(n.nd));
+    memset(n.roff, 0, sizeof(n.roff));
+    memset(n.data, 0, sizeof(n.data));
+    for (n.nnum = rb->next; n.nnum < rb->nnodes; n.nnum++) {
+        if (bt_putnode(&n) == -1) {
+            return -1;
+        }
+    }
+
+    return write_map(rb, mapnodes, depth, root, leaves, rb->next);
+}
+
+/*
+ * NAME:    hfs_rebuild_catalog()
+ * DESCRIPTION: Replace the catalog B*-tree with one built from the
+ *              records of its sound leaf nodes; returns the number of
+ *              records in the new tree, or -1
+ */
+long hfs_rebuild_catalog(hfsvol *vol)
+{
+    struct rebuild rb;
+    unsigned long mappable = 0, dropped;
+    long result = -1;
+
+    memset(&rb, 0, sizeof(rb));
+    rb.bt = &vol->cat;
+    rb.nnodes = vol->mdb.drCTFlSize / HFS_BLOCKSZ;
+
+    for (int i = 0; i < 3; i++) {
+        mappable += (unsigned long) vol->mdb.drCTExtRec[i].xdrNumABlks * vol->lpa;
+    }
+    if (rb.nnodes < 2 || mappable < rb.nnodes) {
+        fprintf(stderr, "fsck.hfs: catalog file extends into the extents overflow file; "
+                "cannot rebuild it\n");
+        return -1;
+    }
+
+    rb.inuse = load_usage_map(&rb);
+    if (VERBOSE) {
+        printf("Scanning %lu catalog nodes for leaf records%s\n", rb.nnodes,
+               rb.inuse ? "" : " (node map damaged, scanning all)");
+    }
+
+    if (scan_leaves(&rb) == -1) {
+        fprintf(stderr, "fsck.hfs: out of memory gathering catalog records\n");
+        goto done;
+    }
+    if (rb.nrecs == 0) {
+        fprintf(stderr, "fsck.hfs: no catalog records survived; cannot rebuild\n");
+        goto done;
+    }
+
+    dropped = drop_duplicates(&rb);
+    if (VERBOSE) {
+        printf("Found %lu records in %lu leaf nodes; dropped %lu stale copies "
+               "and %lu damaged records\n",
+               rb.nrecs + dropped, rb.leaves, dropped, rb.badrecs);
+    }
+
+    if (build_tree(&rb) == -1) {
+        fprintf(stderr, "fsck.hfs: failed to write rebuilt catalog\n");
+        goto done;
+    }
+
+    if (bt_readhdr(&vol->cat) == -1) {
+        fprintf(stderr, "fsck.hfs: failed to read rebuilt catalog header\n");
+        goto done;
+    }
+
+    if (VERBOSE) {
+        printf("Rebuilt catalog B*-tree: %lu records in %lu nodes, depth %u\n",
+               vol->cat.hdr.bthNRecs, vol->cat.hdr.bthNNodes - vol->cat.hdr.bthFree,
+               vol->cat.hdr.bthDepth);
+    }
+    result = (long) vol->cat.hdr.bthNRecs;
+
+done:
+    free(rb.recs);
+    free(rb.inuse);
+    free(rb.map);
+
+    return result;
+}
@@ -35,10 +35,22 @@ typedef struct {
     int block_size;       /* Block size (0 = auto-calculate) */
     long long total_size; /* Total size in bytes (0 = use full device) */
     int enable_journaling; /* Enable HFS+ journaling (0 = disabled, 1 = enabled) */
+    char *source_dir;     /* Copy this host directory onto the volume (-d) */
+    int discard;          /* Discard the free blocks after formatting (-D) */
+    char *batch_file;     /* Format every volume listed in this manifest (-b) */
+    int jobs;             /* Batch volumes formatted at once (0 = one per CPU) */
 } mkfs_options_t;
 
 /* Main formatting functions */
 int mkfs_hfs_format(const char *device_path, const mkfs_options_t *opts);
 int mkfs_hfsplus_format(const char *device_path, const mkfs_options_t *opts);
 
+/* Batch formatting: an empty volume's layout, computed once per type and size */
+typedef struct mkfs_template mkfs_template_t;
+
+mkfs_template_t *mkfs_template_new(int hfsplus, long long size, const mkfs_options_t *opts);
+void mkfs_template_free(mkfs_template_t *tmpl);
+int mkfs_format_template(const char *device_path, const mkfs_options_t *opts,
+                         const mkfs_template_t *tmpl);
+
 #endif /* MKFS_HFS_H */
\ No newline at end of file
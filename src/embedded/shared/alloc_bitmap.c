@@ -0,0 +1,245 @@
+/*
+ * alloc_bitmap.c - Expected allocation bitmap for the checkers
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * The checkers rebuild the allocation bitmap a volume should have by
+ * marking every extent they can find, then compare it with the bitmap
+ * on disk.  Runs are marked with whole-byte fills and the comparison
+ * works a 64-bit word at a time, so both are cheap even for volumes with
+ * millions of allocation blocks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc_bitmap.h"
+
+/* A differing run being accumulated by alloc_bitmap_compare() */
+struct run_state {
+    int kind;                   /* 0 none, 1 leaked, 2 missing */
+    uint32_t start;
+    alloc_bitmap_run_fn fn;
+    void *arg;
+    alloc_bitmap_diff_t *diff;
+};
+
+static inline int bit_test(const uint8_t *bits, uint32_t n)
+{
+    return (bits[n >> 3] & (0x80 >> (n & 7))) != 0;
+}
+
+/*
+ * NAME:    alloc_bitmap_init()
+ * DESCRIPTION: Create a bitmap with every block free
+ */
+int alloc_bitmap_init(alloc_bitmap_t *bm, uint32_t nblocks)
+{
+    bm->nblocks = nblocks;
+    bm->nbytes = ((size_t)nblocks + 7) / 8;
+    bm->bits = calloc(bm->nbytes ? bm->nbytes : 1, 1);
+
+    return bm->bits ? 0 : -1;
+}
+
+/*
+ * NAME:    alloc_bitmap_free()
+ * DESCRIPTION: Release a bitmap
+ */
+void alloc_bitmap_free(alloc_bitmap_t *bm)
+{
+    free(bm->bits);
+    bm->bits = NULL;
+    bm->nblocks = 0;
+    bm->nbytes = 0;
+}
+
+/*
+ * NAME:    alloc_bitmap_count()
+ * DESCRIPTION: Count the set bits in a range, a word at a time
+ */
+uint32_t alloc_bitmap_count(const uint8_t *bits, uint32_t start, uint32_t count)
+{
+    uint64_t pos = start, end = (uint64_t)start + count;
+    uint32_t n = 0;
+
+    while (pos < end && (pos & 7)) {
+        n += bit_test(bits, pos++);
+    }
+    while (end - pos >= 64) {
+        uint64_t w;
+
+        memcpy(&w, bits + (pos >> 3), sizeof(w));
+        n += __builtin_popcountll(w);
+        pos += 64;
+    }
+    while (end - pos >= 8) {
+        n += __builtin_popcount(bits[pos >> 3]);
+        pos += 8;
+    }
+    while (pos < end) {
+        n += bit_test(bits, pos++);
+    }
+
+    return n;
+}
+
+/*
+ * NAME:    alloc_bitmap_mark()
+ * DESCRIPTION: Mark a run of blocks in use: partial bytes at either end,
+ *              whole bytes in between
+ */
+int alloc_bitmap_mark(alloc_bitmap_t *bm, uint32_t start, uint32_t count,
+                      uint32_t *overlap)
+{
+    int result = 0;
+    uint32_t pos, end;
+
+    *overlap = 0;
+
+    if (start >= bm->nblocks) {
+        return count ? -1 : 0;
+    }
+    if (count > bm->nblocks - start) {
+        count = bm->nblocks - start;
+        result = -1;
+    }
+
+    *overlap = alloc_bitmap_count(bm->bits, start, count);
+
+    pos = start;
+    end = start + count;
+
+    while (pos < end && (pos & 7)) {
+        bm->bits[pos >> 3] |= 0x80 >> (pos & 7);
+        pos++;
+    }
+    if (end - pos >= 8) {
+        memset(bm->bits + (pos >> 3), 0xFF, (end - pos) >> 3);
+        pos += (end - pos) & ~7u;
+    }
+    while (pos < end) {
+        bm->bits[pos >> 3] |= 0x80 >> (pos & 7);
+        pos++;
+    }
+
+    return result;
+}
+
+/*
+ * NAME:    run_close()
+ * DESCRIPTION: Finish the run in progress, if any, at block end
+ */
+static void run_close(struct run_state *rs, uint32_t end)
+{
+    if (rs->kind == 0) {
+        return;
+    }
+
+    if (rs->kind == 1) {
+        rs->diff->leakedRuns++;
+    } else {
+        rs->diff->missingRuns++;
+    }
+    if (rs->fn) {
+        rs->fn(rs->kind == 1, rs->start, end - rs->start, rs->arg);
+    }
+    rs->kind = 0;
+}
+
+/*
+ * NAME:    run_scan()
+ * DESCRIPTION: Follow runs through one byte that is known to differ
+ */
+static void run_scan(struct run_state *rs, uint32_t base, uint8_t want, uint8_t have)
+{
+    for (int bit = 0; bit < 8; bit++) {
+        uint8_t mask = 0x80 >> bit;
+        int kind = 0;
+
+        if ((have & mask) && !(want & mask)) {
+            kind = 1;
+        } else if (!(have & mask) && (want & mask)) {
+            kind = 2;
+        }
+
+        if (kind != rs->kind) {
+            run_close(rs, base + bit);
+            if (kind) {
+                rs->kind = kind;
+                rs->start = base + bit;
+            }
+        }
+    }
+}
+
+/*
+ * NAME:    alloc_bitmap_compare()
+ * DESCRIPTION: Compare the expected bitmap with the on-disk one: XOR a
+ *              word at a time, popcount the differences, and walk only
+ *              the words that differ to report runs
+ */
+void alloc_bitmap_compare(const alloc_bitmap_t *bm, const uint8_t *ondisk,
+                          alloc_bitmap_run_fn fn, void *arg,
+                          alloc_bitmap_diff_t *diff)
+{
+    struct run_state rs = { 0, 0, fn, arg, diff };
+    size_t full = bm->nblocks / 8;      /* Bytes with no bits past the end */
+    size_t i = 0;
+
+    memset(diff, 0, sizeof(*diff));
+    diff->used = alloc_bitmap_count(bm->bits, 0, bm->nblocks);
+
+    while (i < full) {
+        uint64_t want, have, x;
+        size_t n = (full - i >= 8) ? 8 : 1;
+
+        if (n == 8) {
+            memcpy(&want, bm->bits + i, sizeof(want));
+            memcpy(&have, ondisk + i, sizeof(have));
+        } else {
+            want = bm->bits[i];
+            have = ondisk[i];
+        }
+
+        x = want ^ have;
+        if (x == 0) {
+            run_close(&rs, (uint32_t)(i * 8));
+            i += n;
+            continue;
+        }
+
+        diff->leaked += __builtin_popcountll(have & x);
+        diff->missing += __builtin_popcountll(want & x);
+
+        for (size_t j = i; j < i + n; j++) {
+            if (bm->bits[j] != ondisk[j]) {
+                run_scan(&rs, (uint32_t)(j * 8), bm->bits[j], ondisk[j]);
+            } else {
+                run_close(&rs, (uint32_t)(j * 8));
+            }
+        }
+        i += n;
+    }
+
+    /* Last partial byte: ignore the bits past the final block */
+    if (bm->nblocks & 7) {
+        uint8_t mask = (uint8_t)(0xFF << (8 - (bm->nblocks & 7)));
+        uint8_t want = bm->bits[full] & mask;
+        uint8_t have = ondisk[full] & mask;
+
+        diff->leaked += __builtin_popcount(have & (want ^ have));
+        diff->missing += __builtin_popcount(want & (want ^ have));
+        if (want != have) {
+            run_scan(&rs, (uint32_t)(full * 8), want, have);
+        } else {
+            run_close(&rs, (uint32_t)(full * 8));
+        }
+    }
+
+    run_close(&rs, bm->nblocks);
+}
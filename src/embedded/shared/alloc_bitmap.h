@@ -0,0 +1,55 @@
+/*
+ * alloc_bitmap.h - Expected allocation bitmap for the checkers
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef ALLOC_BITMAP_H
+#define ALLOC_BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A bitmap in on-disk order: the high bit of byte 0 is block 0 */
+typedef struct {
+    uint8_t *bits;
+    uint32_t nblocks;
+    size_t nbytes;
+} alloc_bitmap_t;
+
+/* Result of comparing an expected bitmap with the one on disk */
+typedef struct {
+    uint32_t used;              /* Blocks in use per the expected bitmap */
+    uint32_t leaked;            /* Marked in use on disk but owned by nothing */
+    uint32_t missing;           /* Owned by a file but marked free on disk */
+    uint32_t leakedRuns;
+    uint32_t missingRuns;
+} alloc_bitmap_diff_t;
+
+/* Called once per differing run; leaked is 0 for blocks marked free */
+typedef void (*alloc_bitmap_run_fn)(int leaked, uint32_t start, uint32_t count, void *arg);
+
+/* Create and destroy an all-free bitmap */
+int alloc_bitmap_init(alloc_bitmap_t *bm, uint32_t nblocks);
+void alloc_bitmap_free(alloc_bitmap_t *bm);
+
+/* Number of set bits in a range of an on-disk order bitmap */
+uint32_t alloc_bitmap_count(const uint8_t *bits, uint32_t start, uint32_t count);
+
+/*
+ * Mark a run of blocks in use.  *overlap receives how many were already
+ * marked; returns -1 if the run goes past the end (the rest is marked).
+ */
+int alloc_bitmap_mark(alloc_bitmap_t *bm, uint32_t start, uint32_t count,
+                      uint32_t *overlap);
+
+/* Compare with an on-disk bitmap of at least bm->nbytes bytes */
+void alloc_bitmap_compare(const alloc_bitmap_t *bm, const uint8_t *ondisk,
+                          alloc_bitmap_run_fn fn, void *arg,
+                          alloc_bitmap_diff_t *diff);
+
+#endif /* ALLOC_BITMAP_H */
@@ -8,6 +8,10 @@
  * (at your option) any later version.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* fallocate() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +22,12 @@
 #include <sys/types.h>
 #include <stdint.h>
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
+
 #include "device_utils.h"
 #include "suid.h"
 
@@ -98,9 +108,6 @@ off_t device_get_size(const char *path)
         if (size == -1) {
             /* If seek fails, try ioctl methods on Linux */
 #ifdef __linux__
-            #include <sys/ioctl.h>
-            #include <linux/fs.h>
-            
             suid_enable();
             fd = open(path, O_RDONLY);
             suid_disable();
@@ -158,6 +165,124 @@ int device_is_mounted(const char *path)
     return mounted;
 }
 
+/*
+ * NAME:    device_zero_range()
+ * DESCRIPTION: Make a byte range of a device or image read back as zeros
+ */
+int device_zero_range(int fd, off_t offset, off_t length)
+{
+    static const unsigned char zeros[64 * 1024];
+    struct stat st;
+    
+    if (length <= 0) {
+        return 0;
+    }
+    
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    
+    if (S_ISREG(st.st_mode)) {
+        /* Past the end of an image everything already reads as zeros */
+        if (offset >= st.st_size) {
+            return 0;
+        }
+        if (offset + length > st.st_size) {
+            length = st.st_size - offset;
+        }
+        
+#ifdef __linux__
+        /* Give the blocks back rather than writing zeros over them */
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      offset, length) == 0) {
+            return 0;
+        }
+        if (fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0) {
+            return 0;
+        }
+#endif
+    }
+#ifdef __linux__
+    else if (S_ISBLK(st.st_mode) && offset % 512 == 0 && length % 512 == 0) {
+        uint64_t range[2] = { (uint64_t)offset, (uint64_t)length };
+        
+        if (ioctl(fd, BLKZEROOUT, range) == 0) {
+            return 0;
+        }
+    }
+#endif
+    
+    /* Fall back to writing the zeros */
+    while (length > 0) {
+        size_t chunk = length < (off_t)sizeof(zeros) ? (size_t)length : sizeof(zeros);
+        ssize_t n = pwrite(fd, zeros, chunk, offset);
+        
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += n;
+        length -= n;
+    }
+    
+    return 0;
+}
+
+/*
+ * NAME:    device_discard_range()
+ * DESCRIPTION: Tell a device or image that a byte range holds nothing;
+ *              unlike device_zero_range() it never writes, and the range
+ *              need not read back as zeros afterwards
+ */
+int device_discard_range(int fd, off_t offset, off_t length)
+{
+    struct stat st;
+    
+    if (length <= 0) {
+        return 0;
+    }
+    
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    
+#ifdef __linux__
+    if (S_ISREG(st.st_mode)) {
+        if (offset >= st.st_size) {
+            return 0;
+        }
+        if (offset + length > st.st_size) {
+            length = st.st_size - offset;
+        }
+        
+        return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+    }
+    
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t range[2];
+        int sector_size = 512;
+        off_t end = offset + length;
+        
+        /* The range must cover whole logical sectors */
+        ioctl(fd, BLKSSZGET, &sector_size);
+        offset = (offset + sector_size - 1) / sector_size * sector_size;
+        end = end / sector_size * sector_size;
+        if (end <= offset) {
+            return 0;
+        }
+        
+        range[0] = (uint64_t)offset;
+        range[1] = (uint64_t)(end - offset);
+        return ioctl(fd, BLKDISCARD, range);
+    }
+#endif
+    
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
 /*
  * NAME:    partition_detect_type()
  * DESCRIPTION: Detect partition table type
@@ -26,6 +26,12 @@ int device_validate(const char *path, int flags);
 off_t device_get_size(const char *path);
 int device_is_mounted(const char *path);
 
+/* Zero a byte range, punching holes in image files where possible */
+int device_zero_range(int fd, off_t offset, off_t length);
+
+/* Discard a byte range: BLKDISCARD on block devices, a hole in image files */
+int device_discard_range(int fd, off_t offset, off_t length);
+
 /* Partition detection */
 partition_type_t partition_detect_type(const char *path);
 int partition_count(const char *path);
@@ -0,0 +1,307 @@
+/*
+ * fsck_metrics.c - Per-phase timing and counters for the checkers
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * The checkers mark where each phase starts and ends; the shared read
+ * paths and the B-tree walkers credit bytes, nodes and records to
+ * whichever phase is running.  Nodes are counted once per phase, so a
+ * phase that walks a tree twice still reports the size of the tree.  fsck --metrics=json prints the result so
+ * check times can be tracked across many images.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fsck_metrics.h"
+
+/* Deepest phase nesting; deeper begins are counted against the top */
+#define METRICS_MAX_DEPTH 8
+
+/* B-trees told apart per phase, and the highest node tracked in each */
+#define METRICS_MAX_TREES 4
+#define METRICS_MAX_NODE  (1UL << 24)
+
+/* Nodes of one B-tree already counted in a phase */
+struct seen_nodes {
+    unsigned long tree;
+    unsigned char *bits;
+    unsigned long nbytes;
+};
+
+static const char *const phase_names[FSCK_PHASE_COUNT] = {
+    "volume_header", "journal", "preload", "catalog",
+    "extents", "bitmap", "attributes"
+};
+
+static struct {
+    int enabled;
+    struct timespec started;    /* When collection was enabled */
+    struct timespec resumed;    /* When the top phase last started running */
+    fsck_phase_t stack[METRICS_MAX_DEPTH];
+    int depth;
+    uint64_t bytes;             /* All device reads, in a phase or not */
+    fsck_phase_metrics_t phase[FSCK_PHASE_COUNT];
+    struct seen_nodes seen[FSCK_PHASE_COUNT][METRICS_MAX_TREES];
+} metrics;
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+    return (double)(to->tv_sec - from->tv_sec) +
+           (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/*
+ * NAME:    fsck_metrics_enable()
+ * DESCRIPTION: Start collecting metrics
+ */
+void fsck_metrics_enable(void)
+{
+    for (int i = 0; i < FSCK_PHASE_COUNT; i++) {
+        for (int j = 0; j < METRICS_MAX_TREES; j++) {
+            free(metrics.seen[i][j].bits);
+        }
+    }
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.enabled = 1;
+    clock_gettime(CLOCK_MONOTONIC, &metrics.started);
+}
+
+/*
+ * NAME:    fsck_metrics_enabled()
+ * DESCRIPTION: Tell whether metrics are being collected
+ */
+int fsck_metrics_enabled(void)
+{
+    return metrics.enabled;
+}
+
+/*
+ * NAME:    fsck_metrics_begin()
+ * DESCRIPTION: Enter a phase, pausing the one it is nested in
+ */
+void fsck_metrics_begin(fsck_phase_t phase)
+{
+    struct timespec now;
+
+    if (!metrics.enabled || phase >= FSCK_PHASE_COUNT) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (metrics.depth > 0) {
+        metrics.phase[metrics.stack[metrics.depth - 1]].seconds +=
+            elapsed(&metrics.resumed, &now);
+    }
+    if (metrics.depth < METRICS_MAX_DEPTH) {
+        metrics.stack[metrics.depth] = phase;
+    }
+    metrics.depth++;
+    metrics.phase[phase].ran = 1;
+    metrics.resumed = now;
+}
+
+/*
+ * NAME:    fsck_metrics_end()
+ * DESCRIPTION: Leave a phase, recording the problems its check returned
+ *              (a positive count, or negative for a critical failure)
+ */
+void fsck_metrics_end(fsck_phase_t phase, int result)
+{
+    struct timespec now;
+
+    if (!metrics.enabled || phase >= FSCK_PHASE_COUNT || metrics.depth == 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (metrics.depth <= METRICS_MAX_DEPTH) {
+        metrics.phase[metrics.stack[metrics.depth - 1]].seconds +=
+            elapsed(&metrics.resumed, &now);
+    }
+    metrics.depth--;
+    metrics.resumed = now;
+
+    if (result > 0) {
+        metrics.phase[phase].errors += result;
+    } else if (result < 0) {
+        metrics.phase[phase].errors++;
+    }
+}
+
+/* The phase work is currently credited to, or NULL outside phases */
+static fsck_phase_metrics_t *current(void)
+{
+    if (!metrics.enabled || metrics.depth == 0) {
+        return NULL;
+    }
+    if (metrics.depth > METRICS_MAX_DEPTH) {
+        return &metrics.phase[metrics.stack[METRICS_MAX_DEPTH - 1]];
+    }
+    return &metrics.phase[metrics.stack[metrics.depth - 1]];
+}
+
+/*
+ * NAME:    fsck_metrics_bytes()
+ * DESCRIPTION: Count bytes read from the device
+ */
+void fsck_metrics_bytes(uint64_t bytes)
+{
+    fsck_phase_metrics_t *p = current();
+
+    if (!metrics.enabled) {
+        return;
+    }
+    metrics.bytes += bytes;
+    if (p) {
+        p->bytes += bytes;
+    }
+}
+
+/*
+ * NAME:    first_read()
+ * DESCRIPTION: Mark a node of a tree as read in a phase; tell whether it
+ *              was not yet.  Past the limits every read is counted.
+ */
+static int first_read(struct seen_nodes *seen, unsigned long tree, unsigned long node)
+{
+    struct seen_nodes *s = NULL;
+    unsigned long need = node / 8 + 1;
+
+    for (int i = 0; i < METRICS_MAX_TREES && !s; i++) {
+        if (!seen[i].bits || seen[i].tree == tree) {
+            s = &seen[i];
+        }
+    }
+    if (!s || node >= METRICS_MAX_NODE) {
+        return 1;
+    }
+
+    if (need > s->nbytes) {
+        unsigned long nbytes = need < 2 * s->nbytes ? 2 * s->nbytes : need;
+        unsigned char *bits = realloc(s->bits, nbytes);
+
+        if (!bits) {
+            return 1;
+        }
+        memset(bits + s->nbytes, 0, nbytes - s->nbytes);
+        s->bits = bits;
+        s->nbytes = nbytes;
+        s->tree = tree;
+    }
+
+    if (s->bits[node / 8] & (1 << (node % 8))) {
+        return 0;
+    }
+    s->bits[node / 8] |= 1 << (node % 8);
+    return 1;
+}
+
+/*
+ * NAME:    fsck_metrics_node()
+ * DESCRIPTION: Count a B-tree node read, once per phase
+ */
+void fsck_metrics_node(unsigned long tree, unsigned long node)
+{
+    fsck_phase_metrics_t *p = current();
+
+    if (p && first_read(metrics.seen[p - metrics.phase], tree, node)) {
+        p->nodes++;
+    }
+}
+
+/*
+ * NAME:    fsck_metrics_records()
+ * DESCRIPTION: Count records checked
+ */
+void fsck_metrics_records(unsigned long records)
+{
+    fsck_phase_metrics_t *p = current();
+
+    if (p) {
+        p->records += records;
+    }
+}
+
+/*
+ * NAME:    fsck_metrics_get()
+ * DESCRIPTION: Copy out the counters of one phase
+ */
+void fsck_metrics_get(fsck_phase_t phase, fsck_phase_metrics_t *out)
+{
+    if (phase < FSCK_PHASE_COUNT) {
+        *out = metrics.phase[phase];
+    } else {
+        memset(out, 0, sizeof(*out));
+    }
+}
+
+/* Print a string as a JSON string literal */
+static void json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; s && *s; s++) {
+        unsigned char c = (unsigned char)*s;
+
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * NAME:    fsck_metrics_write_json()
+ * DESCRIPTION: Print the totals and every phase as a single JSON object;
+ *              phases that did not run are null
+ */
+void fsck_metrics_write_json(FILE *out, const char *device, const char *filesystem,
+                             int exit_code)
+{
+    struct timespec now;
+    unsigned long errors = 0;
+
+    if (!metrics.enabled) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < FSCK_PHASE_COUNT; i++) {
+        errors += metrics.phase[i].errors;
+    }
+
+    fprintf(out, "{\"device\":");
+    json_string(out, device);
+    fprintf(out, ",\"filesystem\":");
+    json_string(out, filesystem);
+    fprintf(out, ",\"exit_code\":%d,\"seconds\":%.6f,\"bytes_read\":%llu,\"errors\":%lu,"
+            "\"phases\":{",
+            exit_code, elapsed(&metrics.started, &now),
+            (unsigned long long)metrics.bytes, errors);
+
+    for (int i = 0; i < FSCK_PHASE_COUNT; i++) {
+        const fsck_phase_metrics_t *p = &metrics.phase[i];
+
+        fprintf(out, "%s\"%s\":", i ? "," : "", phase_names[i]);
+        if (!p->ran) {
+            fprintf(out, "null");
+            continue;
+        }
+        fprintf(out, "{\"seconds\":%.6f,\"bytes_read\":%llu,\"nodes\":%lu,"
+                "\"records\":%lu,\"errors\":%lu}",
+                p->seconds, (unsigned long long)p->bytes, p->nodes,
+                p->records, p->errors);
+    }
+
+    fprintf(out, "}}\n");
+    fflush(out);
+}
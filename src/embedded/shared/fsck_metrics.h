@@ -0,0 +1,67 @@
+/*
+ * fsck_metrics.h - Per-phase timing and counters for the checkers
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FSCK_METRICS_H
+#define FSCK_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Check phases reported by --metrics; the order is the output order */
+typedef enum {
+    FSCK_PHASE_HEADER = 0,      /* MDB or volume header */
+    FSCK_PHASE_JOURNAL,
+    FSCK_PHASE_PRELOAD,         /* Offset-ordered metadata reads */
+    FSCK_PHASE_CATALOG,
+    FSCK_PHASE_EXTENTS,
+    FSCK_PHASE_BITMAP,
+    FSCK_PHASE_ATTRIBUTES,
+    FSCK_PHASE_COUNT
+} fsck_phase_t;
+
+/* Counters for one phase */
+typedef struct {
+    int ran;
+    double seconds;             /* Wall time, excluding nested phases */
+    uint64_t bytes;             /* Bytes read from the device */
+    unsigned long nodes;        /* Distinct B-tree nodes read */
+    unsigned long records;      /* Records checked */
+    unsigned long errors;       /* Problems found */
+} fsck_phase_metrics_t;
+
+/* Start collecting; until then every call below does nothing */
+void fsck_metrics_enable(void);
+int fsck_metrics_enabled(void);
+
+/*
+ * Phases nest: work done for one structure inside another phase (such as
+ * walking the extents tree to rebuild the bitmap) is credited to the
+ * inner phase and its time is not counted twice.
+ */
+void fsck_metrics_begin(fsck_phase_t phase);
+void fsck_metrics_end(fsck_phase_t phase, int result);
+
+/*
+ * Credit work to the current phase.  A node is counted once per phase
+ * however often it is read; tree is anything that tells the B-trees of
+ * the volume apart, such as where their file starts.
+ */
+void fsck_metrics_bytes(uint64_t bytes);
+void fsck_metrics_node(unsigned long tree, unsigned long node);
+void fsck_metrics_records(unsigned long records);
+
+/* Read back one phase */
+void fsck_metrics_get(fsck_phase_t phase, fsck_phase_metrics_t *metrics);
+
+/* Write everything as one line of JSON */
+void fsck_metrics_write_json(FILE *out, const char *device, const char *filesystem,
+                             int exit_code);
+
+#endif /* FSCK_METRICS_H */
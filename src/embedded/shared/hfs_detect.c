@@ -19,6 +19,44 @@
 
 #include "../../include/common/hfs_detect.h"
 
+/*
+ * NAME:    hfs_detect_embedded_offset()
+ * DESCRIPTION: Return the byte offset of an HFS+ volume embedded in an
+ *              HFS wrapper, 0 if the volume is not wrapped, -1 on error
+ */
+off_t hfs_detect_embedded_offset(int fd)
+{
+    uint8_t mdb[HFS_BLOCK_SIZE];
+    uint16_t sig, embed_sig, al_bl_st, embed_start;
+    uint32_t al_blk_siz;
+    
+    if (pread(fd, mdb, sizeof(mdb), HFS_SUPERBLOCK_OFFSET) != sizeof(mdb)) {
+        return -1;
+    }
+    
+    memcpy(&sig, mdb, sizeof(sig));
+    memcpy(&embed_sig, mdb + HFS_MDB_EMBEDSIGWORD, sizeof(embed_sig));
+    
+    if (HFS_BE16(sig) != HFS_SIGNATURE ||
+        HFS_BE16(embed_sig) != HFSPLUS_SIGNATURE) {
+        return 0;
+    }
+    
+    memcpy(&al_blk_siz, mdb + HFS_MDB_ALBLKSIZ, sizeof(al_blk_siz));
+    memcpy(&al_bl_st, mdb + HFS_MDB_ALBLST, sizeof(al_bl_st));
+    memcpy(&embed_start, mdb + HFS_MDB_EMBEDEXTENT, sizeof(embed_start));
+    
+    al_blk_siz = HFS_BE32(al_blk_siz);
+    
+    if (al_blk_siz == 0 || al_blk_siz % HFS_BLOCK_SIZE != 0) {
+        return -1;
+    }
+    
+    /* drAlBlSt counts 512-byte sectors; the extent counts allocation blocks */
+    return (off_t)HFS_BE16(al_bl_st) * HFS_BLOCK_SIZE +
+           (off_t)HFS_BE16(embed_start) * al_blk_siz;
+}
+
 /*
  * NAME:    hfs_detect_fs_type()
  * DESCRIPTION: Detect filesystem type by reading signature
@@ -26,6 +64,7 @@
 hfs_fs_type_t hfs_detect_fs_type(int fd)
 {
     uint16_t signature;
+    off_t offset;
     
     if (lseek(fd, HFS_SUPERBLOCK_OFFSET, SEEK_SET) == -1) {
         return FS_TYPE_UNKNOWN;
@@ -37,6 +76,20 @@ hfs_fs_type_t hfs_detect_fs_type(int fd)
     
     signature = HFS_BE16(signature);
     
+    /* An HFS wrapper is reported as the HFS+ volume it contains */
+    if (signature == HFS_SIGNATURE &&
+        (offset = hfs_detect_embedded_offset(fd)) > 0) {
+        if (pread(fd, &signature, sizeof(signature),
+                  offset + HFS_SUPERBLOCK_OFFSET) != sizeof(signature)) {
+            return FS_TYPE_UNKNOWN;
+        }
+        
+        signature = HFS_BE16(signature);
+        if (signature == HFS_SIGNATURE) {
+            return FS_TYPE_UNKNOWN;
+        }
+    }
+    
     switch (signature) {
         case HFS_SIGNATURE:
             return FS_TYPE_HFS;
@@ -69,8 +122,16 @@ int hfs_read_volume_info(int fd, hfs_volume_info_t *vol_info)
         return -1;
     }
     
+    /* A wrapped HFS+ volume starts inside the HFS wrapper */
+    if (vol_info->fs_type != FS_TYPE_HFS) {
+        vol_info->offset = hfs_detect_embedded_offset(fd);
+        if (vol_info->offset < 0) {
+            return -1;
+        }
+    }
+    
     /* Seek to superblock */
-    if (lseek(fd, HFS_SUPERBLOCK_OFFSET, SEEK_SET) == -1) {
+    if (lseek(fd, vol_info->offset + HFS_SUPERBLOCK_OFFSET, SEEK_SET) == -1) {
         return -1;
     }
     
@@ -0,0 +1,404 @@
+/*
+ * io_plan.c - Offset-ordered metadata read planner
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * The checkers know up front which metadata they will touch: the volume
+ * bitmap and the B*-tree files.  Rather than seeking to each block as a
+ * check phase asks for it, the ranges are collected, sorted by device
+ * offset, merged across small holes and read with a few large sequential
+ * reads.  The check phases are then served from memory.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "io_plan.h"
+#include "fsck_metrics.h"
+
+struct io_range {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/* A loaded, contiguous piece of the device */
+struct io_run {
+    uint64_t offset;
+    uint64_t length;
+    uint8_t *data;
+};
+
+struct io_plan {
+    int fd;
+    struct io_range *pending;   /* Queued, not yet loaded */
+    size_t npending;
+    size_t apending;
+    struct io_run *runs;        /* Loaded, sorted by offset, disjoint */
+    size_t nruns;
+    size_t aruns;
+    io_plan_stats_t stats;
+};
+
+static io_plan_t *active_plan;
+
+/*
+ * NAME:    io_plan_new()
+ * DESCRIPTION: Create an empty plan for a device
+ */
+io_plan_t *io_plan_new(int fd)
+{
+    io_plan_t *plan = calloc(1, sizeof(*plan));
+
+    if (plan) {
+        plan->fd = fd;
+    }
+
+    return plan;
+}
+
+/*
+ * NAME:    io_plan_free()
+ * DESCRIPTION: Release a plan and its in-memory copy
+ */
+void io_plan_free(io_plan_t *plan)
+{
+    if (!plan) {
+        return;
+    }
+
+    if (active_plan == plan) {
+        active_plan = NULL;
+    }
+
+    for (size_t i = 0; i < plan->nruns; i++) {
+        free(plan->runs[i].data);
+    }
+    free(plan->runs);
+    free(plan->pending);
+    free(plan);
+}
+
+/*
+ * NAME:    io_plan_add()
+ * DESCRIPTION: Queue a byte range to be loaded
+ */
+int io_plan_add(io_plan_t *plan, uint64_t offset, uint64_t length)
+{
+    if (!plan || length == 0) {
+        return 0;
+    }
+
+    if (plan->npending == plan->apending) {
+        size_t n = plan->apending ? plan->apending * 2 : 32;
+        struct io_range *r = realloc(plan->pending, n * sizeof(*r));
+
+        if (!r) {
+            return -1;
+        }
+        plan->pending = r;
+        plan->apending = n;
+    }
+
+    plan->pending[plan->npending].offset = offset;
+    plan->pending[plan->npending].length = length;
+    plan->npending++;
+    plan->stats.ranges++;
+
+    return 0;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+    const struct io_range *ra = a, *rb = b;
+
+    if (ra->offset != rb->offset) {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * NAME:    find_run()
+ * DESCRIPTION: Return the loaded run holding all of a range, or NULL
+ */
+static struct io_run *find_run(const io_plan_t *plan, uint64_t offset, uint64_t length)
+{
+    size_t lo = 0, hi = plan->nruns;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        struct io_run *run = &plan->runs[mid];
+
+        if (offset < run->offset) {
+            hi = mid;
+        } else if (offset >= run->offset + run->length) {
+            lo = mid + 1;
+        } else {
+            return (offset + length <= run->offset + run->length) ? run : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * NAME:    read_range()
+ * DESCRIPTION: Read a device range in IO_PLAN_CHUNK pieces; returns the
+ *              number of bytes read, short only at the end of the device
+ */
+static uint64_t read_range(io_plan_t *plan, uint8_t *buf, uint64_t offset, uint64_t length)
+{
+    uint64_t done = 0;
+
+    while (done < length) {
+        size_t want = (length - done > IO_PLAN_CHUNK) ? IO_PLAN_CHUNK : (size_t)(length - done);
+        ssize_t n = pread(plan->fd, buf + done, want, (off_t)(offset + done));
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        plan->stats.reads++;
+        if (n <= 0) {
+            break;
+        }
+        fsck_metrics_bytes(n);
+        done += n;
+    }
+
+    return done;
+}
+
+/*
+ * NAME:    load_span()
+ * DESCRIPTION: Load one merged span as a single run.  Loaded runs that
+ *              overlap or touch it are folded in from memory, so only
+ *              the holes between them are read from the device.
+ */
+static int load_span(io_plan_t *plan, uint64_t offset, uint64_t length)
+{
+    uint64_t end = offset + length;
+    uint64_t pos, got;
+    size_t first, last;
+    uint8_t *data;
+
+    /* Runs are sorted and disjoint: the ones touching the span are adjacent */
+    for (first = 0; first < plan->nruns &&
+         plan->runs[first].offset + plan->runs[first].length < offset; first++)
+        ;
+    for (last = first; last < plan->nruns && plan->runs[last].offset <= end; last++)
+        ;
+
+    if (last > first) {
+        struct io_run *hi = &plan->runs[last - 1];
+
+        if (plan->runs[first].offset < offset) {
+            offset = plan->runs[first].offset;
+        }
+        if (hi->offset + hi->length > end) {
+            end = hi->offset + hi->length;
+        }
+    }
+    length = end - offset;
+
+    data = malloc(length);
+    if (!data) {
+        return -1;
+    }
+
+    pos = offset;
+    for (size_t i = first; i < last; i++) {
+        struct io_run *r = &plan->runs[i];
+
+        if (pos < r->offset &&
+            read_range(plan, data + (pos - offset), pos, r->offset - pos) != r->offset - pos) {
+            free(data);
+            return -1;
+        }
+        memcpy(data + (r->offset - offset), r->data, r->length);
+        pos = r->offset + r->length;
+    }
+
+    got = read_range(plan, data + (pos - offset), pos, end - pos);
+    length = pos - offset + got;
+
+    if (length == 0) {
+        free(data);
+        return 0;
+    }
+
+    /* Replace the folded runs by the new one */
+    for (size_t i = first; i < last; i++) {
+        plan->stats.bytes -= plan->runs[i].length;
+        free(plan->runs[i].data);
+    }
+
+    if (last == first) {
+        if (plan->nruns == plan->aruns) {
+            size_t n = plan->aruns ? plan->aruns * 2 : 16;
+            struct io_run *r = realloc(plan->runs, n * sizeof(*r));
+
+            if (!r) {
+                free(data);
+                return -1;
+            }
+            plan->runs = r;
+            plan->aruns = n;
+        }
+        memmove(&plan->runs[first + 1], &plan->runs[first],
+                (plan->nruns - first) * sizeof(*plan->runs));
+        plan->nruns++;
+    } else {
+        memmove(&plan->runs[first + 1], &plan->runs[last],
+                (plan->nruns - last) * sizeof(*plan->runs));
+        plan->nruns -= last - first - 1;
+    }
+
+    plan->runs[first].offset = offset;
+    plan->runs[first].length = length;
+    plan->runs[first].data = data;
+    plan->stats.bytes += length;
+
+    return 0;
+}
+
+/*
+ * NAME:    io_plan_load()
+ * DESCRIPTION: Sort the queued ranges by offset, merge neighbours closer
+ *              than IO_PLAN_GAP and read each merged span sequentially;
+ *              ranges already in memory are not read again
+ */
+int io_plan_load(io_plan_t *plan)
+{
+    size_t i = 0;
+    int result = 0;
+
+    if (!plan || plan->npending == 0) {
+        return 0;
+    }
+
+    qsort(plan->pending, plan->npending, sizeof(*plan->pending), range_cmp);
+
+    while (i < plan->npending) {
+        uint64_t start = plan->pending[i].offset;
+        uint64_t end = start + plan->pending[i].length;
+        int needed = !find_run(plan, plan->pending[i].offset, plan->pending[i].length);
+
+        for (i++; i < plan->npending && plan->pending[i].offset <= end + IO_PLAN_GAP; i++) {
+            uint64_t e = plan->pending[i].offset + plan->pending[i].length;
+
+            if (!find_run(plan, plan->pending[i].offset, plan->pending[i].length)) {
+                needed = 1;
+            }
+            if (e > end) {
+                end = e;
+            }
+        }
+
+        if (needed && load_span(plan, start, end - start) < 0) {
+            result = -1;
+        }
+    }
+
+    plan->npending = 0;
+    plan->stats.runs = plan->nruns;
+
+    return result;
+}
+
+/*
+ * NAME:    io_plan_read()
+ * DESCRIPTION: Copy a range out of the plan, or read it from the device
+ *              when the plan does not hold all of it
+ */
+int io_plan_read(io_plan_t *plan, int fd, uint64_t offset, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    if (plan) {
+        struct io_run *run = find_run(plan, offset, len);
+
+        if (run) {
+            memcpy(buf, run->data + (offset - run->offset), len);
+            plan->stats.hits++;
+            return 0;
+        }
+        plan->stats.misses++;
+    }
+
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        fsck_metrics_bytes(n);
+        p += n;
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * NAME:    io_plan_update()
+ * DESCRIPTION: Apply a device write to any loaded runs it overlaps
+ */
+void io_plan_update(io_plan_t *plan, uint64_t offset, const void *buf, size_t len)
+{
+    if (!plan) {
+        return;
+    }
+
+    for (size_t i = 0; i < plan->nruns; i++) {
+        struct io_run *run = &plan->runs[i];
+        uint64_t lo = offset > run->offset ? offset : run->offset;
+        uint64_t hi = offset + len < run->offset + run->length ?
+                      offset + len : run->offset + run->length;
+
+        if (lo < hi) {
+            memcpy(run->data + (lo - run->offset),
+                   (const uint8_t *)buf + (lo - offset), hi - lo);
+        }
+    }
+}
+
+/*
+ * NAME:    io_plan_get_stats()
+ * DESCRIPTION: Report how many ranges, runs and reads the plan used
+ */
+void io_plan_get_stats(const io_plan_t *plan, io_plan_stats_t *stats)
+{
+    if (plan) {
+        *stats = plan->stats;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+/*
+ * NAME:    io_plan_attach()
+ * DESCRIPTION: Make a plan the one consulted by block-level reads
+ */
+void io_plan_attach(io_plan_t *plan)
+{
+    active_plan = plan;
+}
+
+/*
+ * NAME:    io_plan_active()
+ * DESCRIPTION: Return the attached plan if it belongs to this device
+ */
+io_plan_t *io_plan_active(int fd)
+{
+    return (active_plan && active_plan->fd == fd) ? active_plan : NULL;
+}
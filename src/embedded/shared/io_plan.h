@@ -0,0 +1,58 @@
+/*
+ * io_plan.h - Offset-ordered metadata read planner
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef IO_PLAN_H
+#define IO_PLAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Holes smaller than this are read through rather than seeked over */
+#define IO_PLAN_GAP     (256 * 1024)
+
+/* Largest single read issued while loading a run */
+#define IO_PLAN_CHUNK   (8 * 1024 * 1024)
+
+typedef struct io_plan io_plan_t;
+
+/* Counters for reporting how the plan was served */
+typedef struct {
+    unsigned long ranges;       /* Ranges requested */
+    unsigned long runs;         /* Sequential runs they were merged into */
+    unsigned long reads;        /* read calls issued while loading */
+    uint64_t bytes;             /* Bytes held in memory */
+    unsigned long hits;         /* Reads served from memory */
+    unsigned long misses;       /* Reads that fell back to the device */
+} io_plan_stats_t;
+
+/* Create and destroy a plan for a device */
+io_plan_t *io_plan_new(int fd);
+void io_plan_free(io_plan_t *plan);
+
+/* Queue a byte range; nothing is read until io_plan_load() */
+int io_plan_add(io_plan_t *plan, uint64_t offset, uint64_t length);
+
+/* Sort, merge and read all queued ranges with large sequential reads */
+int io_plan_load(io_plan_t *plan);
+
+/* Read through the plan, falling back to the device; plan may be NULL */
+int io_plan_read(io_plan_t *plan, int fd, uint64_t offset, void *buf, size_t len);
+
+/* Keep the in-memory copy in step with a write made to the device */
+void io_plan_update(io_plan_t *plan, uint64_t offset, const void *buf, size_t len);
+
+/* Report counters */
+void io_plan_get_stats(const io_plan_t *plan, io_plan_stats_t *stats);
+
+/* Make a plan visible to the block-level helpers (NULL to detach) */
+void io_plan_attach(io_plan_t *plan);
+io_plan_t *io_plan_active(int fd);
+
+#endif /* IO_PLAN_H */
@@ -14,6 +14,8 @@
 #include <stdint.h>
 #include <endian.h>
 #include "libhfs.h"
+#include "io_plan.h"
+#include "fsck_metrics.h"
 
 /* HFS+ Volume attributes */
 #define HFSPLUS_VOL_JOURNALED   0x00002000
@@ -125,18 +127,85 @@ int l_putblocks(hfsvol *vol, unsigned long start, unsigned int count, const bloc
     return 0;
 }
 
+/*
+ * Big-endian field access.  The MDB, node descriptor and header record
+ * structs are padded, so they cannot be read or written as a raw image
+ * of the on-disk block.
+ */
+#define BE_GET16(p, o)     ((unsigned int)((p)[o] << 8 | (p)[(o) + 1]))
+#define BE_GET32(p, o)     ((unsigned long)(p)[o] << 24 | (unsigned long)(p)[(o) + 1] << 16 | \
+                            (unsigned long)(p)[(o) + 2] << 8 | (unsigned long)(p)[(o) + 3])
+#define BE_PUT16(p, o, v)  ((p)[o] = (unsigned char)((v) >> 8), (p)[(o) + 1] = (unsigned char)(v))
+#define BE_PUT32(p, o, v)  ((p)[o] = (unsigned char)((v) >> 24), (p)[(o) + 1] = (unsigned char)((v) >> 16), \
+                            (p)[(o) + 2] = (unsigned char)((v) >> 8), (p)[(o) + 3] = (unsigned char)(v))
+
+static void mdb_getext(const unsigned char *p, ExtDataRec *rec)
+{
+    for (int i = 0; i < 3; i++) {
+        (*rec)[i].xdrStABN    = BE_GET16(p, 4 * i);
+        (*rec)[i].xdrNumABlks = BE_GET16(p, 4 * i + 2);
+    }
+}
+
+static void mdb_putext(unsigned char *p, const ExtDataRec *rec)
+{
+    for (int i = 0; i < 3; i++) {
+        BE_PUT16(p, 4 * i, (*rec)[i].xdrStABN);
+        BE_PUT16(p, 4 * i + 2, (*rec)[i].xdrNumABlks);
+    }
+}
+
+/*
+ * NAME:    l_putmdb()
+ * DESCRIPTION: Encode and write the (backup) MDB
+ */
 int l_putmdb(hfsvol *vol, const MDB *mdb, int backup)
 {
+    unsigned char b[HFS_BLOCKSZ];
+
     if (!vol->priv)
         return -1;
     
     int fd = (int)(long)vol->priv;
-    off_t offset = backup ? (vol->vlen - 2) * HFS_BLOCKSZ : 2 * HFS_BLOCKSZ;
-    
-    if (lseek(fd, offset, SEEK_SET) == -1)
-        return -1;
-    
-    if (write(fd, mdb, sizeof(MDB)) != sizeof(MDB))
+    off_t offset = backup ? (off_t)(vol->vlen - 2) * HFS_BLOCKSZ : 2 * HFS_BLOCKSZ;
+    
+    /* Keep the reserved tail of the block as it is on disk */
+    if (pread(fd, b, HFS_BLOCKSZ, offset) != HFS_BLOCKSZ)
+        memset(b, 0, sizeof(b));
+
+    BE_PUT16(b, 0, mdb->drSigWord);
+    BE_PUT32(b, 2, mdb->drCrDate);
+    BE_PUT32(b, 6, mdb->drLsMod);
+    BE_PUT16(b, 10, mdb->drAtrb);
+    BE_PUT16(b, 12, mdb->drNmFls);
+    BE_PUT16(b, 14, mdb->drVBMSt);
+    BE_PUT16(b, 16, mdb->drAllocPtr);
+    BE_PUT16(b, 18, mdb->drNmAlBlks);
+    BE_PUT32(b, 20, mdb->drAlBlkSiz);
+    BE_PUT32(b, 24, mdb->drClpSiz);
+    BE_PUT16(b, 28, mdb->drAlBlSt);
+    BE_PUT32(b, 30, mdb->drNxtCNID);
+    BE_PUT16(b, 34, mdb->drFreeBks);
+    memcpy(b + 36, mdb->drVN, sizeof(mdb->drVN));
+    BE_PUT32(b, 64, mdb->drVolBkUp);
+    BE_PUT16(b, 68, mdb->drVSeqNum);
+    BE_PUT32(b, 70, mdb->drWrCnt);
+    BE_PUT32(b, 74, mdb->drXTClpSiz);
+    BE_PUT32(b, 78, mdb->drCTClpSiz);
+    BE_PUT16(b, 82, mdb->drNmRtDirs);
+    BE_PUT32(b, 84, mdb->drFilCnt);
+    BE_PUT32(b, 88, mdb->drDirCnt);
+    for (int i = 0; i < 8; i++)
+        BE_PUT32(b, 92 + 4 * i, mdb->drFndrInfo[i]);
+    BE_PUT16(b, 124, mdb->drEmbedSigWord);
+    BE_PUT16(b, 126, mdb->drEmbedExtent.xdrStABN);
+    BE_PUT16(b, 128, mdb->drEmbedExtent.xdrNumABlks);
+    BE_PUT32(b, 130, mdb->drXTFlSize);
+    mdb_putext(b + 134, &mdb->drXTExtRec);
+    BE_PUT32(b, 146, mdb->drCTFlSize);
+    mdb_putext(b + 150, &mdb->drCTExtRec);
+
+    if (pwrite(fd, b, HFS_BLOCKSZ, offset) != HFS_BLOCKSZ)
         return -1;
     
     return 0;
@@ -160,20 +229,55 @@ unsigned long d_ltime(unsigned long mtime)
     return mtime - mac_unix_offset;
 }
 
+/*
+ * NAME:    l_getmdb()
+ * DESCRIPTION: Read and decode the (backup) MDB
+ */
 int l_getmdb(hfsvol *vol, MDB *mdb, int backup)
 {
+    unsigned char b[HFS_BLOCKSZ];
+
     if (!vol->priv)
         return -1;
     
     int fd = (int)(long)vol->priv;
-    off_t offset = backup ? (vol->vlen - 2) * HFS_BLOCKSZ : 2 * HFS_BLOCKSZ;
+    off_t offset = backup ? (off_t)(vol->vlen - 2) * HFS_BLOCKSZ : 2 * HFS_BLOCKSZ;
     
-    if (lseek(fd, offset, SEEK_SET) == -1)
-        return -1;
-    
-    if (read(fd, mdb, sizeof(MDB)) != sizeof(MDB))
+    if (pread(fd, b, HFS_BLOCKSZ, offset) != HFS_BLOCKSZ)
         return -1;
-    
+
+    mdb->drSigWord   = BE_GET16(b, 0);
+    mdb->drCrDate    = BE_GET32(b, 2);
+    mdb->drLsMod     = BE_GET32(b, 6);
+    mdb->drAtrb      = BE_GET16(b, 10);
+    mdb->drNmFls     = BE_GET16(b, 12);
+    mdb->drVBMSt     = BE_GET16(b, 14);
+    mdb->drAllocPtr  = BE_GET16(b, 16);
+    mdb->drNmAlBlks  = BE_GET16(b, 18);
+    mdb->drAlBlkSiz  = BE_GET32(b, 20);
+    mdb->drClpSiz    = BE_GET32(b, 24);
+    mdb->drAlBlSt    = BE_GET16(b, 28);
+    mdb->drNxtCNID   = BE_GET32(b, 30);
+    mdb->drFreeBks   = BE_GET16(b, 34);
+    memcpy(mdb->drVN, b + 36, sizeof(mdb->drVN));
+    mdb->drVolBkUp   = BE_GET32(b, 64);
+    mdb->drVSeqNum   = BE_GET16(b, 68);
+    mdb->drWrCnt     = BE_GET32(b, 70);
+    mdb->drXTClpSiz  = BE_GET32(b, 74);
+    mdb->drCTClpSiz  = BE_GET32(b, 78);
+    mdb->drNmRtDirs  = BE_GET16(b, 82);
+    mdb->drFilCnt    = BE_GET32(b, 84);
+    mdb->drDirCnt    = BE_GET32(b, 88);
+    for (int i = 0; i < 8; i++)
+        mdb->drFndrInfo[i] = BE_GET32(b, 92 + 4 * i);
+    mdb->drEmbedSigWord = BE_GET16(b, 124);
+    mdb->drEmbedExtent.xdrStABN    = BE_GET16(b, 126);
+    mdb->drEmbedExtent.xdrNumABlks = BE_GET16(b, 128);
+    mdb->drXTFlSize  = BE_GET32(b, 130);
+    mdb_getext(b + 134, &mdb->drXTExtRec);
+    mdb->drCTFlSize  = BE_GET32(b, 146);
+    mdb_getext(b + 150, &mdb->drCTExtRec);
+
     return 0;
 }
 
@@ -204,15 +308,10 @@ int l_getblock(void *priv, unsigned long block_num, void *buffer)
         return -1;
     
     int fd = (int)(long)priv;
-    off_t offset = block_num * HFS_BLOCKSZ;
-    
-    if (lseek(fd, offset, SEEK_SET) == -1)
-        return -1;
-    
-    if (read(fd, buffer, HFS_BLOCKSZ) != HFS_BLOCKSZ)
-        return -1;
+    off_t offset = (off_t)block_num * HFS_BLOCKSZ;
     
-    return 0;
+    /* Served from the checker's metadata plan when one is attached */
+    return io_plan_read(io_plan_active(fd), fd, offset, buffer, HFS_BLOCKSZ);
 }
 
 int l_putblock(void *priv, unsigned long block_num, const void *buffer)
@@ -221,86 +320,137 @@ int l_putblock(void *priv, unsigned long block_num, const void *buffer)
         return -1;
     
     int fd = (int)(long)priv;
-    off_t offset = block_num * HFS_BLOCKSZ;
+    off_t offset = (off_t)block_num * HFS_BLOCKSZ;
     
-    if (lseek(fd, offset, SEEK_SET) == -1)
+    if (pwrite(fd, buffer, HFS_BLOCKSZ, offset) != HFS_BLOCKSZ)
         return -1;
     
-    if (write(fd, buffer, HFS_BLOCKSZ) != HFS_BLOCKSZ)
-        return -1;
+    io_plan_update(io_plan_active(fd), offset, buffer, HFS_BLOCKSZ);
     
     return 0;
 }
 
-int bt_readhdr(btree *bt)
+/*
+ * NAME:    bt_nodeblock()
+ * DESCRIPTION: Map a B*-tree node to its device block through the file's
+ *              first extent record
+ */
+static int bt_nodeblock(btree *bt, unsigned long nnum, unsigned long *bnum)
 {
-    /* Simplified B-tree header reading */
-    if (!bt || !bt->f.vol)
+    hfsvol *vol = bt->f.vol;
+    const ExtDescriptor *ext = bt->f.cat.u.fil.filExtRec;
+    unsigned long fabn;
+    
+    if (vol->lpa == 0)
         return -1;
     
-    /* Read first node which contains the header */
-    node n;
-    n.bt = bt;
-    n.nnum = 0;
+    fabn = nnum / vol->lpa;
+    
+    for (int i = 0; i < 3; i++) {
+        if (fabn < ext[i].xdrNumABlks) {
+            *bnum = vol->vstart + vol->mdb.drAlBlSt +
+                    (ext[i].xdrStABN + fabn) * vol->lpa + nnum % vol->lpa;
+            return 0;
+        }
+        fabn -= ext[i].xdrNumABlks;
+    }
+    
+    return -1;
+}
+
+int bt_getnode(node *n)
+{
+    unsigned long bnum;
+    int i;
+    
+    if (!n || !n->bt || !n->bt->f.vol)
+        return -1;
     
-    /* Calculate node offset */
-    unsigned long node_size = 512; /* Default node size */
-    off_t offset = n.nnum * node_size;
+    if (bt_nodeblock(n->bt, n->nnum, &bnum) == -1)
+        return -1;
     
-    /* Read node data directly */
-    if (l_getblock(n.bt->f.vol->priv, offset / HFS_BLOCKSZ, n.data) == -1)
+    if (l_getblock(n->bt->f.vol->priv, bnum, n->data) == -1)
         return -1;
     
-    /* Parse node descriptor */
-    memcpy(&n.nd, n.data, sizeof(NodeDescriptor));
+    fsck_metrics_node((unsigned long) n->bt, n->nnum);
+    
+    /* Unpack node descriptor */
+    n->nd.ndFLink   = BE_GET32(n->data, 0);
+    n->nd.ndBLink   = BE_GET32(n->data, 4);
+    n->nd.ndType    = (SignedByte) n->data[8];
+    n->nd.ndNHeight = (SignedByte) n->data[9];
+    n->nd.ndNRecs   = BE_GET16(n->data, 10);
+    n->nd.ndResv2   = (Integer) BE_GET16(n->data, 12);
+    
+    if (n->nd.ndNRecs > HFS_MAX_NRECS)
+        return -1;
     
-    /* Copy header from node data */
-    memcpy(&bt->hdr, n.data + sizeof(NodeDescriptor), sizeof(BTHdrRec));
+    /* Record offsets are stored backwards from the end of the node */
+    for (i = 0; i <= n->nd.ndNRecs; i++)
+        n->roff[i] = BE_GET16(n->data, HFS_BLOCKSZ - 2 * (i + 1));
     
     return 0;
 }
 
-int bt_getnode(node *n)
+int bt_readhdr(btree *bt)
 {
-    /* Simplified node reading */
-    if (!n || !n->bt || !n->bt->f.vol)
+    const unsigned char *p;
+    
+    if (!bt || !bt->f.vol)
         return -1;
     
-    /* Calculate node offset */
-    unsigned long node_size = 512; /* Default node size */
-    if (n->bt->hdr.bthNodeSize > 0)
-        node_size = n->bt->hdr.bthNodeSize;
+    /* The header record is the first record of node 0 */
+    bt->hdrnd.bt = bt;
+    bt->hdrnd.nnum = 0;
     
-    off_t offset = n->nnum * node_size;
+    if (bt_getnode(&bt->hdrnd) == -1)
+        return -1;
     
-    /* Read node data */
-    if (l_getblock(n->bt->f.vol->priv, offset / HFS_BLOCKSZ, n->data) == -1)
+    if (bt->hdrnd.nd.ndType != ndHdrNode || bt->hdrnd.nd.ndNRecs < 1)
         return -1;
     
-    /* Parse node descriptor */
-    memcpy(&n->nd, n->data, sizeof(NodeDescriptor));
+    p = HFS_NODEREC(bt->hdrnd, 0);
+    
+    bt->hdr.bthDepth    = BE_GET16(p, 0);
+    bt->hdr.bthRoot     = BE_GET32(p, 2);
+    bt->hdr.bthNRecs    = BE_GET32(p, 6);
+    bt->hdr.bthFNode    = BE_GET32(p, 10);
+    bt->hdr.bthLNode    = BE_GET32(p, 14);
+    bt->hdr.bthNodeSize = BE_GET16(p, 18);
+    bt->hdr.bthKeyLen   = BE_GET16(p, 20);
+    bt->hdr.bthNNodes   = BE_GET32(p, 22);
+    bt->hdr.bthFree     = BE_GET32(p, 26);
+    memcpy(bt->hdr.bthResv, p + 30, sizeof(bt->hdr.bthResv));
     
     return 0;
 }
 
 int bt_putnode(node *n)
 {
-    /* Simplified node writing */
+    unsigned long bnum;
+    int i;
+    
     if (!n || !n->bt || !n->bt->f.vol)
         return -1;
     
-    /* Update node descriptor in data */
-    memcpy(n->data, &n->nd, sizeof(NodeDescriptor));
+    if (n->nd.ndNRecs > HFS_MAX_NRECS)
+        return -1;
+    
+    /* Pack node descriptor and record offsets */
+    BE_PUT32(n->data, 0, n->nd.ndFLink);
+    BE_PUT32(n->data, 4, n->nd.ndBLink);
+    n->data[8] = (unsigned char) n->nd.ndType;
+    n->data[9] = (unsigned char) n->nd.ndNHeight;
+    BE_PUT16(n->data, 10, n->nd.ndNRecs);
+    BE_PUT16(n->data, 12, (unsigned int) n->nd.ndResv2);
     
-    /* Calculate node offset */
-    unsigned long node_size = 512; /* Default node size */
-    if (n->bt->hdr.bthNodeSize > 0)
-        node_size = n->bt->hdr.bthNodeSize;
+    for (i = 0; i <= n->nd.ndNRecs; i++)
+        BE_PUT16(n->data, HFS_BLOCKSZ - 2 * (i + 1), n->roff[i]);
     
-    off_t offset = n->nnum * node_size;
+    if (bt_nodeblock(n->bt, n->nnum, &bnum) == -1)
+        return -1;
     
-    /* Write node data */
-    if (l_putblock(n->bt->f.vol->priv, offset / HFS_BLOCKSZ, n->data) == -1)
+    if (l_putblock(n->bt->f.vol->priv, bnum, n->data) == -1)
         return -1;
     
     return 0;
@@ -0,0 +1,421 @@
+/*
+ * fsck_checkpoint.c - Resumable progress for long HFS+ checks
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * fsck --checkpoint=FILE records which phases have finished, and while
+ * the allocation bitmap is rebuilt, the next leaf node of the B-tree
+ * being walked together with the bitmap built so far.  While the catalog
+ * is cross-checked it records the next catalog leaf and the references
+ * sorted so far instead.  A check that is stopped or killed picks up from
+ * there when run again with the same file.  The file is host byte order
+ * and is only meant to be read back by the machine that wrote it.
+ */
+
+#include "fsck_common.h"
+#include "fsck_checkpoint.h"
+#include <signal.h>
+#include <time.h>
+
+#define CHECKPOINT_MAGIC   "HFSCKPT"
+#define CHECKPOINT_VERSION 3
+
+/* Bytes read or written at a time for the saved sorts */
+#define CHECKPOINT_CHUNK   (64 * 1024)
+
+/* On-disk layout; the expected bitmap and then the saved sorts follow */
+struct checkpoint_file {
+    char magic[8];
+    uint32_t version;
+    uint32_t checksum;          /* Over the whole file with this field zero */
+    fsck_volume_id_t volume;
+    uint32_t repair;
+    uint32_t phasesDone;
+    uint32_t errorsFound;
+    uint32_t errorsCorrected;
+    uint32_t errorsUncorrected;
+    uint32_t walkTree;
+    uint32_t walkNode;
+    uint32_t walkProblems;
+    uint32_t catalogNode;
+    uint32_t catalogProblems;
+    uint32_t catalogFolders;
+    uint32_t catalogFiles;
+    uint64_t bitmapBytes;
+    uint64_t sortBytes[FSCK_CHECKPOINT_SORTS];
+    uint8_t volumeHeader[FSCK_CHECKPOINT_VH_SIZE];
+};
+
+/* Running state while the saved sorts are written */
+struct sort_writer {
+    int fd;
+    uint32_t sum;
+};
+
+static char *checkpoint_path;
+static unsigned int checkpoint_interval;
+static struct timespec last_save;
+static int save_failed;
+static volatile sig_atomic_t stop_requested;
+
+/*
+ * NAME:    checkpoint_signal()
+ * DESCRIPTION: Ask the check to stop at the next save point; a second
+ *              signal is not caught
+ */
+static void checkpoint_signal(int sig)
+{
+    if (stop_requested) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    stop_requested = 1;
+}
+
+/*
+ * NAME:    checksum()
+ * DESCRIPTION: FNV-1a over a buffer, continuing from a previous value
+ */
+static uint32_t checksum(uint32_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        h = (h ^ *p++) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * NAME:    fsck_checkpoint_enable()
+ * DESCRIPTION: Start saving progress to a file
+ */
+int fsck_checkpoint_enable(const char *path, unsigned int interval)
+{
+    struct sigaction sa;
+
+    free(checkpoint_path);
+    checkpoint_path = strdup(path);
+    if (!checkpoint_path) {
+        return -1;
+    }
+    checkpoint_interval = interval;
+    clock_gettime(CLOCK_MONOTONIC, &last_save);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = checkpoint_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    return 0;
+}
+
+/*
+ * NAME:    fsck_checkpoint_enabled()
+ * DESCRIPTION: Tell whether progress is being saved
+ */
+int fsck_checkpoint_enabled(void)
+{
+    return checkpoint_path != NULL;
+}
+
+/*
+ * NAME:    fsck_checkpoint_path()
+ * DESCRIPTION: Return the checkpoint file name
+ */
+const char *fsck_checkpoint_path(void)
+{
+    return checkpoint_path;
+}
+
+/*
+ * NAME:    fsck_checkpoint_load()
+ * DESCRIPTION: Read the checkpoint file, if there is one, and verify it
+ */
+int fsck_checkpoint_load(fsck_checkpoint_t *cp)
+{
+    struct checkpoint_file f;
+    static uint8_t chunk[CHECKPOINT_CHUNK];
+    uint32_t sum, h;
+    FILE *in;
+
+    memset(cp, 0, sizeof(*cp));
+    if (!checkpoint_path) {
+        return 0;
+    }
+
+    in = fopen(checkpoint_path, "rb");
+    if (!in) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (fread(&f, sizeof(f), 1, in) != 1 ||
+        memcmp(f.magic, CHECKPOINT_MAGIC, sizeof(f.magic)) != 0 ||
+        f.version != CHECKPOINT_VERSION || f.bitmapBytes > SIZE_MAX) {
+        fclose(in);
+        return -1;
+    }
+
+    if (f.bitmapBytes > 0) {
+        cp->bitmap = malloc(f.bitmapBytes);
+        if (!cp->bitmap || fread(cp->bitmap, f.bitmapBytes, 1, in) != 1) {
+            fclose(in);
+            fsck_checkpoint_release(cp);
+            return -1;
+        }
+    }
+
+    sum = f.checksum;
+    f.checksum = 0;
+    h = checksum(checksum(2166136261u, &f, sizeof(f)), cp->bitmap, f.bitmapBytes);
+
+    /* The sorts stay in the file until they are asked for */
+    for (unsigned int i = 0; i < FSCK_CHECKPOINT_SORTS; i++) {
+        uint64_t left = f.sortBytes[i];
+
+        while (left > 0) {
+            size_t len = left < sizeof(chunk) ? (size_t)left : sizeof(chunk);
+
+            if (fread(chunk, len, 1, in) != 1) {
+                fclose(in);
+                fsck_checkpoint_release(cp);
+                return -1;
+            }
+            h = checksum(h, chunk, len);
+            left -= len;
+        }
+    }
+    fclose(in);
+
+    if (h != sum) {
+        fsck_checkpoint_release(cp);
+        return -1;
+    }
+
+    cp->volume = f.volume;
+    cp->repair = f.repair;
+    cp->phasesDone = f.phasesDone;
+    cp->errorsFound = f.errorsFound;
+    cp->errorsCorrected = f.errorsCorrected;
+    cp->errorsUncorrected = f.errorsUncorrected;
+    memcpy(cp->volumeHeader, f.volumeHeader, sizeof(cp->volumeHeader));
+    cp->walkTree = f.walkTree;
+    cp->walkNode = f.walkNode;
+    cp->walkProblems = f.walkProblems;
+    cp->bitmapBytes = f.bitmapBytes;
+    cp->catalogNode = f.catalogNode;
+    cp->catalogProblems = f.catalogProblems;
+    cp->catalogFolders = f.catalogFolders;
+    cp->catalogFiles = f.catalogFiles;
+    memcpy(cp->sortBytes, f.sortBytes, sizeof(cp->sortBytes));
+    cp->sortOffset = sizeof(f) + f.bitmapBytes;
+
+    return 1;
+}
+
+/*
+ * NAME:    write_sort()
+ * DESCRIPTION: Append the next records of a saved sort to the file
+ */
+static int write_sort(const void *buf, size_t len, void *arg)
+{
+    struct sort_writer *w = arg;
+
+    if (write(w->fd, buf, len) != (ssize_t)len) {
+        return -1;
+    }
+    w->sum = checksum(w->sum, buf, len);
+    return 0;
+}
+
+/*
+ * NAME:    fsck_checkpoint_save()
+ * DESCRIPTION: Write the checkpoint to a temporary file, sync it and
+ *              rename it over the previous one, so a crash leaves either
+ *              the old checkpoint or the new one
+ */
+int fsck_checkpoint_save(const fsck_checkpoint_t *cp)
+{
+    struct checkpoint_file f;
+    struct sort_writer w;
+    size_t bitmapBytes = cp->bitmap ? cp->bitmapBytes : 0;
+    char *tmp;
+    int fd, ok;
+
+    if (!checkpoint_path) {
+        return 0;
+    }
+
+    memset(&f, 0, sizeof(f));
+    memcpy(f.magic, CHECKPOINT_MAGIC, sizeof(f.magic));
+    f.version = CHECKPOINT_VERSION;
+    f.volume = cp->volume;
+    f.repair = cp->repair;
+    f.phasesDone = cp->phasesDone;
+    f.errorsFound = cp->errorsFound;
+    f.errorsCorrected = cp->errorsCorrected;
+    f.errorsUncorrected = cp->errorsUncorrected;
+    f.walkTree = cp->walkTree;
+    f.walkNode = cp->walkNode;
+    f.walkProblems = cp->walkProblems;
+    f.catalogNode = cp->catalogNode;
+    f.catalogProblems = cp->catalogProblems;
+    f.catalogFolders = cp->catalogFolders;
+    f.catalogFiles = cp->catalogFiles;
+    f.bitmapBytes = bitmapBytes;
+    for (unsigned int i = 0; i < FSCK_CHECKPOINT_SORTS; i++) {
+        if (cp->sorts[i]) {
+            f.sortBytes[i] = fsck_extsort_count(cp->sorts[i]) *
+                             fsck_extsort_recsize(cp->sorts[i]);
+        }
+    }
+    memcpy(f.volumeHeader, cp->volumeHeader, sizeof(f.volumeHeader));
+
+    tmp = malloc(strlen(checkpoint_path) + 5);
+    if (!tmp) {
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", checkpoint_path);
+
+    /* The sorts are streamed, so the header goes in last with the checksum */
+    w.sum = checksum(checksum(2166136261u, &f, sizeof(f)), cp->bitmap, bitmapBytes);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    w.fd = fd;
+    ok = fd >= 0 &&
+         lseek(fd, sizeof(f), SEEK_SET) == (off_t)sizeof(f) &&
+         (bitmapBytes == 0 ||
+          write(fd, cp->bitmap, bitmapBytes) == (ssize_t)bitmapBytes);
+    for (unsigned int i = 0; ok && i < FSCK_CHECKPOINT_SORTS; i++) {
+        ok = !cp->sorts[i] || fsck_extsort_each(cp->sorts[i], write_sort, &w) == 0;
+    }
+    f.checksum = w.sum;
+    ok = ok &&
+         pwrite(fd, &f, sizeof(f), 0) == (ssize_t)sizeof(f) &&
+         fsync(fd) == 0;
+    if (fd >= 0 && close(fd) != 0) {
+        ok = 0;
+    }
+    if (ok && rename(tmp, checkpoint_path) != 0) {
+        ok = 0;
+    }
+
+    if (!ok) {
+        /* The check goes on without checkpoints rather than failing */
+        if (!save_failed) {
+            error_print("cannot write checkpoint %s: %s", checkpoint_path, strerror(errno));
+            save_failed = 1;
+        }
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    free(tmp);
+    clock_gettime(CLOCK_MONOTONIC, &last_save);
+    return 0;
+}
+
+/*
+ * NAME:    fsck_checkpoint_load_sort()
+ * DESCRIPTION: Feed the records saved for one sort back into a new sort
+ */
+int fsck_checkpoint_load_sort(const fsck_checkpoint_t *cp, unsigned int which,
+                              fsck_extsort_t *s)
+{
+    size_t recsize = fsck_extsort_recsize(s);
+    uint64_t offset = cp->sortOffset, left;
+    static uint8_t chunk[CHECKPOINT_CHUNK];
+    size_t per = sizeof(chunk) / recsize;
+    FILE *in;
+
+    if (!checkpoint_path || which >= FSCK_CHECKPOINT_SORTS ||
+        cp->sortBytes[which] % recsize != 0) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < which; i++) {
+        offset += cp->sortBytes[i];
+    }
+
+    in = fopen(checkpoint_path, "rb");
+    if (!in || fseeko(in, (off_t)offset, SEEK_SET) != 0) {
+        if (in) {
+            fclose(in);
+        }
+        return -1;
+    }
+
+    for (left = cp->sortBytes[which] / recsize; left > 0; ) {
+        size_t n = left < per ? (size_t)left : per;
+
+        if (fread(chunk, recsize, n, in) != n) {
+            fclose(in);
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (fsck_extsort_add(s, chunk + i * recsize) < 0) {
+                fclose(in);
+                return -1;
+            }
+        }
+        left -= n;
+    }
+
+    fclose(in);
+    return 0;
+}
+
+/*
+ * NAME:    fsck_checkpoint_due()
+ * DESCRIPTION: Tell a walk whether to save its position now
+ */
+int fsck_checkpoint_due(void)
+{
+    struct timespec now;
+
+    if (!checkpoint_path) {
+        return 0;
+    }
+    if (stop_requested) {
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - last_save.tv_sec >= (time_t)checkpoint_interval;
+}
+
+/*
+ * NAME:    fsck_checkpoint_stop_requested()
+ * DESCRIPTION: Tell whether SIGINT or SIGTERM asked the check to stop
+ */
+int fsck_checkpoint_stop_requested(void)
+{
+    return checkpoint_path != NULL && stop_requested;
+}
+
+/*
+ * NAME:    fsck_checkpoint_remove()
+ * DESCRIPTION: Delete the checkpoint of a finished check
+ */
+void fsck_checkpoint_remove(void)
+{
+    if (checkpoint_path && unlink(checkpoint_path) != 0 && errno != ENOENT) {
+        error_print("cannot remove checkpoint %s: %s", checkpoint_path, strerror(errno));
+    }
+}
+
+/*
+ * NAME:    fsck_checkpoint_release()
+ * DESCRIPTION: Free what fsck_checkpoint_load() allocated
+ */
+void fsck_checkpoint_release(fsck_checkpoint_t *cp)
+{
+    free(cp->bitmap);
+    cp->bitmap = NULL;
+    cp->bitmapBytes = 0;
+}
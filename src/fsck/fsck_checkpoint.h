@@ -0,0 +1,94 @@
+/*
+ * fsck_checkpoint.h - Resumable progress for long HFS+ checks
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FSCK_CHECKPOINT_H
+#define FSCK_CHECKPOINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fsck_metrics.h"   /* For fsck_phase_t */
+#include "fsck_extsort.h"
+
+/* Seconds between saves while the allocation bitmap is being rebuilt */
+#define FSCK_CHECKPOINT_INTERVAL 60
+
+/* Room kept for the working copy of the volume header */
+#define FSCK_CHECKPOINT_VH_SIZE  512
+
+/* External sorts a walk in progress can save: catalog by ID and by parent */
+#define FSCK_CHECKPOINT_SORTS    2
+
+/* Volume header fields a checkpoint must match to be resumed */
+typedef struct {
+    uint32_t createDate;
+    uint32_t modifyDate;
+    uint32_t writeCount;
+    uint32_t blockSize;
+    uint32_t totalBlocks;
+} fsck_volume_id_t;
+
+/* Everything a restarted check needs to carry on */
+typedef struct {
+    fsck_volume_id_t volume;
+    uint32_t repair;            /* Saved by a repairing run */
+    uint32_t phasesDone;        /* Bit (1 << fsck_phase_t) per finished phase */
+    uint32_t errorsFound;
+    uint32_t errorsCorrected;
+    uint32_t errorsUncorrected; /* Errors reported that no repair addresses */
+    uint8_t volumeHeader[FSCK_CHECKPOINT_VH_SIZE];  /* With in-memory repairs */
+
+    /* Allocation bitmap rebuild in progress; bitmap is NULL when none */
+    uint32_t walkTree;          /* B-tree being walked, in walk order */
+    uint32_t walkNode;          /* Next leaf to visit; 0 for the first */
+    uint32_t walkProblems;      /* Problems found by the walk so far */
+    uint8_t *bitmap;            /* Expected bitmap built so far */
+    size_t bitmapBytes;
+
+    /* Catalog cross-check in progress; catalogNode is 0 when none */
+    uint32_t catalogNode;       /* Next catalog leaf to feed the sorts */
+    uint32_t catalogProblems;   /* Found by the catalog phase before the walk */
+    uint32_t catalogFolders;    /* Counted by the catalog B-tree check */
+    uint32_t catalogFiles;
+    const fsck_extsort_t *sorts[FSCK_CHECKPOINT_SORTS];    /* Fed so far, to save */
+    uint64_t sortBytes[FSCK_CHECKPOINT_SORTS];             /* Saved, once loaded */
+    uint64_t sortOffset;        /* Where the saved sorts start in the file */
+} fsck_checkpoint_t;
+
+/*
+ * Save progress to path, at most every interval seconds during long
+ * walks.  Also makes SIGINT and SIGTERM stop the check at the next point
+ * where progress can be saved; a second signal ends it at once.
+ */
+int fsck_checkpoint_enable(const char *path, unsigned int interval);
+int fsck_checkpoint_enabled(void);
+const char *fsck_checkpoint_path(void);
+
+/* 1 if a checkpoint was read, 0 if there is none, -1 if it is unusable */
+int fsck_checkpoint_load(fsck_checkpoint_t *cp);
+
+/* Replace the checkpoint file atomically */
+int fsck_checkpoint_save(const fsck_checkpoint_t *cp);
+
+/* Add the records of a loaded checkpoint's saved sort to s; 0 or -1 */
+int fsck_checkpoint_load_sort(const fsck_checkpoint_t *cp, unsigned int which,
+                              fsck_extsort_t *s);
+
+/* Whether a walk should save now: the interval ran out or a stop is pending */
+int fsck_checkpoint_due(void);
+int fsck_checkpoint_stop_requested(void);
+
+/* Delete the file once the check has finished */
+void fsck_checkpoint_remove(void);
+
+/* Free the bitmap of a loaded checkpoint */
+void fsck_checkpoint_release(fsck_checkpoint_t *cp);
+
+#endif /* FSCK_CHECKPOINT_H */
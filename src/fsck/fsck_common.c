@@ -13,6 +13,7 @@
 
 #include "../embedded/fsck/fsck_hfs.h"
 #include "fsck_common.h"
+#include "fsck_checkpoint.h"
 
 /*
  * NAME:    show_license()
@@ -48,6 +49,8 @@ void fsck_show_license(const char *program_name)
 int fsck_parse_command_line(int argc, char *argv[], fsck_options_t *opts)
 {
     int c;
+    char *end;
+    unsigned long value;
     static struct option long_options[] = {
         {"auto",    no_argument,       0, 'a'},
         {"force",   no_argument,       0, 'f'},
@@ -56,14 +59,20 @@ int fsck_parse_command_line(int argc, char *argv[], fsck_options_t *opts)
         {"yes",     no_argument,       0, 'y'},
         {"version", no_argument,       0, 'V'},
         {"help",    no_argument,       0, 'h'},
+        {"jobs",    required_argument, 0, 'j'},
         {"license", no_argument,       0, 1000},
+        {"metrics", required_argument, 0, 1001},
+        {"checkpoint", required_argument, 0, 1002},
+        {"checkpoint-interval", required_argument, 0, 1003},
+        {"memory",  required_argument, 0, 1004},
         {0, 0, 0, 0}
     };
     
     /* Initialize default options - repair is enabled by default like original hfsck */
     opts->repair = 1;
+    opts->checkpoint_interval = FSCK_CHECKPOINT_INTERVAL;
     
-    while ((c = getopt_long(argc, argv, "afnprvyVh", long_options, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "afj:nprvyVh", long_options, NULL)) != -1) {
         switch (c) {
             case 'a':
             case 'p':
@@ -78,6 +87,18 @@ int fsck_parse_command_line(int argc, char *argv[], fsck_options_t *opts)
                 opts->force = 1;
                 break;
                 
+            case 'j':
+                /* Check every device argument, this many at a time */
+                errno = 0;
+                value = strtoul(optarg, &end, 10);
+                if (errno || end == optarg || *end || optarg[0] == '-' || value > 1024) {
+                    error_print("invalid job count '%s'", optarg);
+                    return -1;
+                }
+                opts->parallel = 1;
+                opts->jobs = (int)value;
+                break;
+                
             case 'n':
                 /* No-write mode - check only, don't repair */
                 opts->read_only = 1;
@@ -114,6 +135,44 @@ int fsck_parse_command_line(int argc, char *argv[], fsck_options_t *opts)
                 opts->show_license = 1;
                 return 0;
                 
+            case 1001:  /* --metrics=json */
+                if (strcmp(optarg, "json") != 0) {
+                    error_print("unsupported metrics format '%s'", optarg);
+                    return -1;
+                }
+                opts->metrics = 1;
+                break;
+                
+            case 1002:  /* --checkpoint=FILE */
+                free(opts->checkpoint_path);
+                opts->checkpoint_path = strdup(optarg);
+                if (!opts->checkpoint_path) {
+                    error_print_errno("failed to allocate memory for checkpoint path");
+                    return -1;
+                }
+                break;
+                
+            case 1003:  /* --checkpoint-interval=SECONDS */
+                errno = 0;
+                value = strtoul(optarg, &end, 10);
+                if (errno || end == optarg || *end || optarg[0] == '-' || value > 86400) {
+                    error_print("invalid checkpoint interval '%s'", optarg);
+                    return -1;
+                }
+                opts->checkpoint_interval = (unsigned int)value;
+                break;
+                
+            case 1004:  /* --memory=MIB */
+                errno = 0;
+                value = strtoul(optarg, &end, 10);
+                if (errno || end == optarg || *end || optarg[0] == '-' ||
+                    value == 0 || value > 1048576) {
+                    error_print("invalid memory limit '%s'", optarg);
+                    return -1;
+                }
+                opts->memory = (unsigned int)value;
+                break;
+                
             case '?':
                 /* getopt_long already printed an error message */
                 return -1;
@@ -136,6 +195,14 @@ int fsck_parse_command_line(int argc, char *argv[], fsck_options_t *opts)
         return -1;
     }
     
+    /* With -j every argument is a device */
+    if (opts->parallel) {
+        opts->devices = &argv[optind];
+        opts->ndevices = argc - optind;
+        opts->partition_number = 0;
+        return 0;
+    }
+    
     /* Optional partition number */
     if (optind + 1 < argc) {
         if (common_parse_partition_number(argv[optind + 1], &opts->partition_number) != 0) {
@@ -173,6 +240,16 @@ int fsck_validate_options(fsck_options_t *opts)
         opts->yes_to_all = 1;
     }
     
+    /* Parallel checks run without a terminal */
+    if (opts->parallel && opts->repair && !opts->yes_to_all) {
+        error_print("parallel checks cannot ask questions; use -n, -y or -a with -j");
+        return -1;
+    }
+    if (opts->parallel && opts->checkpoint_path && opts->ndevices > 1) {
+        error_print("--checkpoint cannot be shared by several devices");
+        return -1;
+    }
+    
     return 0;
 }
 
@@ -186,4 +263,6 @@ void fsck_cleanup_options(fsck_options_t *opts)
         free(opts->device_path);
         opts->device_path = NULL;
     }
+    free(opts->checkpoint_path);
+    opts->checkpoint_path = NULL;
 }
\ No newline at end of file
@@ -21,6 +21,14 @@ typedef struct {
     int show_version;
     int show_help;
     int show_license;
+    int metrics;            /* --metrics=json: print per-phase metrics */
+    char *checkpoint_path;  /* --checkpoint=FILE: resumable progress */
+    unsigned int checkpoint_interval;   /* Seconds between checkpoints */
+    unsigned int memory;    /* --memory=MIB: bound per check, 0 for none */
+    int parallel;           /* -j: check every device argument */
+    int jobs;               /* Checks at a time, 0 for one per CPU */
+    char **devices;         /* Device arguments (into argv) */
+    int ndevices;
 } fsck_options_t;
 
 /* Common function declarations */
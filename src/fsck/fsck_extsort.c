@@ -0,0 +1,606 @@
+/*
+ * fsck_extsort.c - Sorting more records than fit in memory
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Records are gathered in a buffer of the size allowed.  Each time it
+ * fills up, it is sorted and appended to a temporary file as a run.  When
+ * the records are read back, the runs are merged through a heap with one
+ * read buffer per run; if there are too many runs for reasonably sized
+ * buffers, groups of them are first merged into longer runs.  A sort
+ * that fits in memory never touches the disk.
+ */
+
+#include "fsck_common.h"
+#include "fsck_extsort.h"
+
+/* Smallest read buffer worth giving a run during a merge */
+#define EXTSORT_MINREAD     (64 * 1024)
+
+/* Records a sort buffers before its first run, whatever the memory */
+#define EXTSORT_MINRECS     1024
+
+/* A sorted stretch of the temporary file */
+struct run {
+    uint64_t offset;
+    uint64_t count;
+};
+
+/* Read position in one run during a merge */
+struct cursor {
+    uint64_t offset;            /* Next byte to read */
+    uint64_t left;              /* Records not yet read */
+    uint8_t *buf;
+    size_t cap, n, i;           /* Buffer size, records in it, next one */
+};
+
+struct fsck_extsort {
+    size_t recsize;
+    size_t memory;
+    fsck_extsort_cmp cmp;
+    uint64_t count;
+
+    /* Records not yet in a run */
+    uint8_t *buf;
+    size_t cap, used, next;
+
+    /* Runs written so far */
+    FILE *file;
+    uint64_t fileEnd;
+    struct run *runs;
+    unsigned int nruns, maxruns;
+    unsigned int spilled;       /* Runs written before any merge */
+
+    /* Merge in progress */
+    struct cursor *cursors;
+    unsigned int *heap;
+    unsigned int nheap;
+    int merging;
+};
+
+static size_t extsort_memory;     /* 0 when --memory was not given */
+
+/*
+ * NAME:    fsck_extsort_set_memory()
+ * DESCRIPTION: Bound the memory of the check
+ */
+void fsck_extsort_set_memory(size_t bytes)
+{
+    extsort_memory = bytes;
+}
+
+/*
+ * NAME:    fsck_extsort_memory()
+ * DESCRIPTION: Return the memory the sorts of one check may use
+ */
+size_t fsck_extsort_memory(void)
+{
+    return extsort_memory ? extsort_memory : (size_t)FSCK_EXTSORT_MEMORY << 20;
+}
+
+/*
+ * NAME:    fsck_extsort_memory_limited()
+ * DESCRIPTION: Tell whether the memory of the check was bounded
+ */
+int fsck_extsort_memory_limited(void)
+{
+    return extsort_memory != 0;
+}
+
+/*
+ * NAME:    fsck_extsort_new()
+ * DESCRIPTION: Start an empty sort
+ */
+fsck_extsort_t *fsck_extsort_new(size_t recsize, size_t memory, fsck_extsort_cmp cmp)
+{
+    fsck_extsort_t *s;
+
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        return NULL;
+    }
+
+    s->recsize = recsize;
+    s->memory = memory;
+    s->cmp = cmp;
+    s->cap = memory / recsize;
+    if (s->cap < EXTSORT_MINRECS) {
+        s->cap = EXTSORT_MINRECS;
+    }
+
+    s->buf = malloc(s->cap * recsize);
+    if (!s->buf) {
+        free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+/*
+ * NAME:    write_at()
+ * DESCRIPTION: Write a whole buffer at an offset of a temporary file
+ */
+static int write_at(FILE *file, const void *buf, size_t len, uint64_t offset)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fileno(file), p, len, (off_t)offset);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * NAME:    add_run()
+ * DESCRIPTION: Record a run written to the temporary file
+ */
+static int add_run(fsck_extsort_t *s, uint64_t offset, uint64_t count)
+{
+    if (s->nruns == s->maxruns) {
+        unsigned int max = s->maxruns ? 2 * s->maxruns : 16;
+        struct run *runs = realloc(s->runs, max * sizeof(*runs));
+
+        if (!runs) {
+            return -1;
+        }
+        s->runs = runs;
+        s->maxruns = max;
+    }
+
+    s->runs[s->nruns].offset = offset;
+    s->runs[s->nruns].count = count;
+    s->nruns++;
+    return 0;
+}
+
+/*
+ * NAME:    spill()
+ * DESCRIPTION: Sort the buffered records and write them out as a run
+ */
+static int spill(fsck_extsort_t *s)
+{
+    size_t len = s->used * s->recsize;
+
+    if (!s->file) {
+        s->file = tmpfile();
+        if (!s->file) {
+            error_print("cannot create sort file: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    qsort(s->buf, s->used, s->recsize, s->cmp);
+    if (write_at(s->file, s->buf, len, s->fileEnd) < 0) {
+        error_print("cannot write sort file: %s", strerror(errno));
+        return -1;
+    }
+    if (add_run(s, s->fileEnd, s->used) < 0) {
+        return -1;
+    }
+
+    s->fileEnd += len;
+    s->used = 0;
+    s->spilled++;
+    return 0;
+}
+
+/*
+ * NAME:    fsck_extsort_add()
+ * DESCRIPTION: Add one record to a sort
+ */
+int fsck_extsort_add(fsck_extsort_t *s, const void *rec)
+{
+    if (s->used == s->cap && spill(s) < 0) {
+        return -1;
+    }
+
+    memcpy(s->buf + s->used * s->recsize, rec, s->recsize);
+    s->used++;
+    s->count++;
+    return 0;
+}
+
+/*
+ * NAME:    fsck_extsort_each()
+ * DESCRIPTION: Hand every record added so far to fn, a buffer at a time
+ *              and in no particular order, without disturbing the sort
+ */
+int fsck_extsort_each(const fsck_extsort_t *s, fsck_extsort_fn fn, void *arg)
+{
+    size_t chunk = (EXTSORT_MINREAD / s->recsize) * s->recsize;
+    uint64_t offset = 0;
+    uint8_t *buf;
+
+    if (s->merging) {
+        return -1;
+    }
+
+    /* Runs are appended back to back until the merge starts */
+    if (s->fileEnd > 0) {
+        buf = malloc(chunk);
+        if (!buf) {
+            return -1;
+        }
+        while (offset < s->fileEnd) {
+            size_t len = s->fileEnd - offset < chunk ? (size_t)(s->fileEnd - offset) : chunk;
+            ssize_t n = pread(fileno(s->file), buf, len, (off_t)offset);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || fn(buf, n, arg) != 0) {
+                free(buf);
+                return -1;
+            }
+            offset += n;
+        }
+        free(buf);
+    }
+
+    if (s->used > 0 && fn(s->buf, s->used * s->recsize, arg) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * NAME:    cursor_fill()
+ * DESCRIPTION: Read the next stretch of a run; 0 once it is used up
+ */
+static int cursor_fill(fsck_extsort_t *s, struct cursor *c)
+{
+    size_t n = c->left < c->cap ? (size_t)c->left : c->cap;
+    size_t len = n * s->recsize;
+    uint8_t *p = c->buf;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    while (len > 0) {
+        ssize_t got = pread(fileno(s->file), p, len, (off_t)c->offset);
+
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            error_print("cannot read sort file: %s",
+                        got < 0 ? strerror(errno) : "unexpected end of file");
+            return -1;
+        }
+        p += got;
+        len -= got;
+        c->offset += got;
+    }
+
+    c->left -= n;
+    c->n = n;
+    c->i = 0;
+    return 1;
+}
+
+/*
+ * NAME:    cursor_record()
+ * DESCRIPTION: Return the record a run is positioned at
+ */
+static const uint8_t *cursor_record(const fsck_extsort_t *s, unsigned int c)
+{
+    return s->cursors[c].buf + s->cursors[c].i * s->recsize;
+}
+
+/*
+ * NAME:    sift_down()
+ * DESCRIPTION: Restore the heap order below a slot
+ */
+static void sift_down(fsck_extsort_t *s, unsigned int i)
+{
+    for (;;) {
+        unsigned int least = i, l = 2 * i + 1, r = 2 * i + 2, tmp;
+
+        if (l < s->nheap &&
+            s->cmp(cursor_record(s, s->heap[l]), cursor_record(s, s->heap[least])) < 0) {
+            least = l;
+        }
+        if (r < s->nheap &&
+            s->cmp(cursor_record(s, s->heap[r]), cursor_record(s, s->heap[least])) < 0) {
+            least = r;
+        }
+        if (least == i) {
+            return;
+        }
+
+        tmp = s->heap[i];
+        s->heap[i] = s->heap[least];
+        s->heap[least] = tmp;
+        i = least;
+    }
+}
+
+/*
+ * NAME:    merge_close()
+ * DESCRIPTION: Release the buffers of a merge
+ */
+static void merge_close(fsck_extsort_t *s, unsigned int nruns)
+{
+    if (s->cursors) {
+        for (unsigned int i = 0; i < nruns; i++) {
+            free(s->cursors[i].buf);
+        }
+    }
+    free(s->cursors);
+    free(s->heap);
+    s->cursors = NULL;
+    s->heap = NULL;
+    s->nheap = 0;
+}
+
+/*
+ * NAME:    merge_open()
+ * DESCRIPTION: Start merging nruns runs, sharing the memory between them
+ */
+static int merge_open(fsck_extsort_t *s, const struct run *runs, unsigned int nruns)
+{
+    size_t cap = s->memory / nruns / s->recsize;
+
+    if (cap == 0) {
+        cap = 1;
+    }
+
+    s->cursors = calloc(nruns, sizeof(*s->cursors));
+    s->heap = malloc(nruns * sizeof(*s->heap));
+    if (!s->cursors || !s->heap) {
+        merge_close(s, nruns);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < nruns; i++) {
+        struct cursor *c = &s->cursors[i];
+        int r;
+
+        c->offset = runs[i].offset;
+        c->left = runs[i].count;
+        c->cap = cap;
+        c->buf = malloc(cap * s->recsize);
+        if (!c->buf) {
+            merge_close(s, nruns);
+            return -1;
+        }
+
+        r = cursor_fill(s, c);
+        if (r < 0) {
+            merge_close(s, nruns);
+            return -1;
+        }
+        if (r > 0) {
+            s->heap[s->nheap++] = i;
+        }
+    }
+
+    for (unsigned int i = s->nheap / 2; i-- > 0; ) {
+        sift_down(s, i);
+    }
+    return 0;
+}
+
+/*
+ * NAME:    merge_next()
+ * DESCRIPTION: Take the smallest record off the merge
+ */
+static int merge_next(fsck_extsort_t *s, void *rec)
+{
+    struct cursor *c;
+
+    if (s->nheap == 0) {
+        return 0;
+    }
+
+    c = &s->cursors[s->heap[0]];
+    memcpy(rec, c->buf + c->i * s->recsize, s->recsize);
+
+    if (++c->i == c->n) {
+        int r = cursor_fill(s, c);
+
+        if (r < 0) {
+            return -1;
+        }
+        if (r == 0) {
+            s->heap[0] = s->heap[--s->nheap];
+        }
+    }
+    sift_down(s, 0);
+    return 1;
+}
+
+/*
+ * NAME:    merge_pass()
+ * DESCRIPTION: Merge groups of fanin runs into longer runs in a new file
+ */
+static int merge_pass(fsck_extsort_t *s, unsigned int fanin)
+{
+    struct run *old = s->runs;
+    unsigned int nold = s->nruns;
+    FILE *oldFile = s->file, *newFile;
+    uint64_t newEnd = 0;
+    size_t outcap = EXTSORT_MINREAD / s->recsize;
+    uint8_t *out;
+    int result = 0;
+
+    if (outcap == 0) {
+        outcap = 1;
+    }
+
+    newFile = tmpfile();
+    out = malloc(outcap * s->recsize);
+    if (!newFile || !out) {
+        error_print("cannot set up sort merge: %s", strerror(errno));
+        if (newFile) {
+            fclose(newFile);
+        }
+        free(out);
+        return -1;
+    }
+
+    s->runs = NULL;
+    s->nruns = s->maxruns = 0;
+
+    for (unsigned int first = 0; first < nold && result == 0; first += fanin) {
+        unsigned int k = nold - first < fanin ? nold - first : fanin;
+        uint64_t start = newEnd, count = 0;
+        size_t n = 0;
+        int r;
+
+        if (merge_open(s, old + first, k) < 0) {
+            result = -1;
+            break;
+        }
+
+        while ((r = merge_next(s, out + n * s->recsize)) > 0) {
+            count++;
+            if (++n == outcap) {
+                if (write_at(newFile, out, n * s->recsize, newEnd) < 0) {
+                    r = -1;
+                    break;
+                }
+                newEnd += n * s->recsize;
+                n = 0;
+            }
+        }
+        if (r == 0 && n > 0) {
+            if (write_at(newFile, out, n * s->recsize, newEnd) < 0) {
+                r = -1;
+            }
+            newEnd += n * s->recsize;
+        }
+        merge_close(s, k);
+
+        if (r < 0 || add_run(s, start, count) < 0) {
+            error_print("cannot write sort file: %s", strerror(errno));
+            result = -1;
+        }
+    }
+
+    free(out);
+    free(old);
+    fclose(oldFile);
+    s->file = newFile;
+    s->fileEnd = newEnd;
+    return result;
+}
+
+/*
+ * NAME:    fsck_extsort_finish()
+ * DESCRIPTION: Get ready to read the records back in order
+ */
+int fsck_extsort_finish(fsck_extsort_t *s)
+{
+    unsigned int fanin;
+
+    if (s->nruns == 0) {
+        /* Everything fit */
+        qsort(s->buf, s->used, s->recsize, s->cmp);
+        s->next = 0;
+        return 0;
+    }
+
+    if (s->used > 0 && spill(s) < 0) {
+        return -1;
+    }
+    free(s->buf);
+    s->buf = NULL;
+
+    fanin = s->memory / EXTSORT_MINREAD;
+    if (fanin < 2) {
+        fanin = 2;
+    }
+    while (s->nruns > fanin) {
+        if (merge_pass(s, fanin) < 0) {
+            return -1;
+        }
+    }
+
+    if (merge_open(s, s->runs, s->nruns) < 0) {
+        error_print("cannot set up sort merge: %s", strerror(errno));
+        return -1;
+    }
+    s->merging = 1;
+    return 0;
+}
+
+/*
+ * NAME:    fsck_extsort_next()
+ * DESCRIPTION: Read back the next record in order
+ */
+int fsck_extsort_next(fsck_extsort_t *s, void *rec)
+{
+    if (s->merging) {
+        return merge_next(s, rec);
+    }
+    if (s->next == s->used) {
+        return 0;
+    }
+
+    memcpy(rec, s->buf + s->next * s->recsize, s->recsize);
+    s->next++;
+    return 1;
+}
+
+/*
+ * NAME:    fsck_extsort_count()
+ * DESCRIPTION: Return how many records were added
+ */
+uint64_t fsck_extsort_count(const fsck_extsort_t *s)
+{
+    return s->count;
+}
+
+/*
+ * NAME:    fsck_extsort_recsize()
+ * DESCRIPTION: Return the size of the records being sorted
+ */
+size_t fsck_extsort_recsize(const fsck_extsort_t *s)
+{
+    return s->recsize;
+}
+
+/*
+ * NAME:    fsck_extsort_runs()
+ * DESCRIPTION: Return how many runs the records were sorted in on disk
+ */
+unsigned int fsck_extsort_runs(const fsck_extsort_t *s)
+{
+    return s->spilled;
+}
+
+/*
+ * NAME:    fsck_extsort_free()
+ * DESCRIPTION: Release a sort and delete its temporary file
+ */
+void fsck_extsort_free(fsck_extsort_t *s)
+{
+    if (!s) {
+        return;
+    }
+
+    merge_close(s, s->merging ? s->nruns : 0);
+    free(s->buf);
+    free(s->runs);
+    if (s->file) {
+        fclose(s->file);
+    }
+    free(s);
+}
@@ -0,0 +1,66 @@
+/*
+ * fsck_extsort.h - Sorting more records than fit in memory
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FSCK_EXTSORT_H
+#define FSCK_EXTSORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default memory for the sorts of one check, in MiB (--memory) */
+#define FSCK_EXTSORT_MEMORY     64
+
+typedef struct fsck_extsort fsck_extsort_t;
+
+/* qsort()-style comparison of two records */
+typedef int (*fsck_extsort_cmp)(const void *a, const void *b);
+
+/*
+ * Bound the memory of a check (--memory).  The sorts of one check share
+ * this much, FSCK_EXTSORT_MEMORY when no bound was set; other structures
+ * that would grow with the volume check fsck_extsort_memory_limited().
+ */
+void fsck_extsort_set_memory(size_t bytes);
+size_t fsck_extsort_memory(void);
+int fsck_extsort_memory_limited(void);
+
+/*
+ * Start a sort of fixed-size records using at most memory bytes.
+ * Records that do not fit are sorted in runs written to a temporary
+ * file and merged back when read.
+ */
+fsck_extsort_t *fsck_extsort_new(size_t recsize, size_t memory, fsck_extsort_cmp cmp);
+
+/* Add a record; returns 0, or -1 if a run could not be written */
+int fsck_extsort_add(fsck_extsort_t *s, const void *rec);
+
+/* Called with the next bytes of records; non-zero stops fsck_extsort_each() */
+typedef int (*fsck_extsort_fn)(const void *buf, size_t len, void *arg);
+
+/*
+ * Hand the records added so far to fn, unsorted, leaving the sort as it
+ * was (for saving it); only before fsck_extsort_finish().  Returns 0 or -1.
+ */
+int fsck_extsort_each(const fsck_extsort_t *s, fsck_extsort_fn fn, void *arg);
+
+/* Stop adding and prepare to read back in order; returns 0 or -1 */
+int fsck_extsort_finish(fsck_extsort_t *s);
+
+/* Read the next record: 1 if there was one, 0 at the end, -1 on error */
+int fsck_extsort_next(fsck_extsort_t *s, void *rec);
+
+/* Records added, and runs written to disk (0 if the sort fit in memory) */
+uint64_t fsck_extsort_count(const fsck_extsort_t *s);
+size_t fsck_extsort_recsize(const fsck_extsort_t *s);
+unsigned int fsck_extsort_runs(const fsck_extsort_t *s);
+
+void fsck_extsort_free(fsck_extsort_t *s);
+
+#endif /* FSCK_EXTSORT_H */
@@ -18,6 +18,10 @@
 
 #include "../embedded/fsck/fsck_hfs.h"
 #include "fsck_common.h"
+#include "fsck_metrics.h"
+#include "fsck_checkpoint.h"
+#include "fsck_extsort.h"
+#include "fsck_parallel.h"
 #include "journal.h"
 
 /* Global variables */
@@ -31,6 +35,7 @@ extern int options;
 static void show_usage(const char *program_name)
 {
     printf("Usage: %s [options] device-path [partition-no]\n", program_name);
+    printf("       %s -j jobs [options] device-path...\n", program_name);
     printf("\n");
     printf("Check and repair HFS+ filesystems with journaling support.\n");
     printf("\n");
@@ -42,9 +47,15 @@ static void show_usage(const char *program_name)
     printf("  -y, --yes         Assume 'yes' to all questions (same as -a)\n");
     printf("  -p                Automatically repair filesystem (same as -a)\n");
     printf("  -r                Interactively repair filesystem\n");
+    printf("  -j, --jobs=N      Check every device given, N at a time (0: one per CPU)\n");
     printf("  -V, --version     Display version information and exit\n");
     printf("  -h, --help        Display this help message and exit\n");
     printf("      --license     Display license information and exit\n");
+    printf("      --metrics=json  Print per-phase timing and counters as JSON\n");
+    printf("      --checkpoint=FILE  Save progress to FILE and resume from it\n");
+    printf("      --checkpoint-interval=SECONDS  Time between saves (default %d)\n",
+           FSCK_CHECKPOINT_INTERVAL);
+    printf("      --memory=MIB  Check HFS+ volumes in about MIB of memory\n");
     printf("\n");
     printf("Exit codes:\n");
     printf("  0   No errors found\n");
@@ -66,6 +77,8 @@ static void show_usage(const char *program_name)
     printf("  %s -v /dev/sdb1           Check with verbose output\n", program_name);
     printf("  %s -n /dev/sdb1           Check without making changes\n", program_name);
     printf("  %s -a /dev/sdb1           Check and auto-repair\n", program_name);
+    printf("  %s -n -j 8 *.img          Check many images, 8 at a time\n", program_name);
+    printf("  %s -n --memory=256 /dev/sdb1  Check a huge volume in 256 MiB\n", program_name);
     printf("\n");
     printf("Note: This program only works with HFS+ filesystems.\n");
     printf("      For HFS filesystems, use fsck.hfs instead.\n");
@@ -84,6 +97,24 @@ static void show_version(const char *program_name)
     printf("This is free software; see the source for copying conditions.\n");
 }
 
+/*
+ * NAME:    check_device()
+ * DESCRIPTION: Check one device of a -j run
+ */
+static int check_device(const char *device, int check_options, const char **fs_name)
+{
+    hfs_fs_type_t fs_type = hfs_detect_filesystem_type(device, 0);
+    
+    *fs_name = "hfs+";
+    if (fs_type != FS_TYPE_HFSPLUS && fs_type != FS_TYPE_HFSX) {
+        error_print("%s is not an HFS+ filesystem (detected %s)",
+                    device, hfs_get_fs_type_name(fs_type));
+        return FSCK_OPERATIONAL_ERROR;
+    }
+    
+    return hfsplus_check_volume(device, 0, check_options);
+}
+
 /*
  * NAME:    main()
  * DESCRIPTION: Main entry point for fsck.hfs+
@@ -146,12 +177,37 @@ int main(int argc, char *argv[])
         return FSCK_OPERATIONAL_ERROR;
     }
     
+    if (opts.metrics && !opts.parallel) {
+        fsck_metrics_enable();
+    }
+    
+    if (opts.memory) {
+        fsck_extsort_set_memory((size_t)opts.memory << 20);
+    }
+    
+    if (opts.checkpoint_path &&
+        fsck_checkpoint_enable(opts.checkpoint_path, opts.checkpoint_interval) != 0) {
+        error_print("failed to set up checkpoint %s", opts.checkpoint_path);
+        fsck_cleanup_options(&opts);
+        common_cleanup();
+        return FSCK_OPERATIONAL_ERROR;
+    }
+    
     /* Set global options for compatibility with original hfsck */
     options = 0;
     if (opts.repair) options |= HFSCK_REPAIR;
     if (opts.verbose) options |= HFSCK_VERBOSE;
     if (opts.yes_to_all) options |= HFSCK_YES;
     
+    /* Many devices: each is checked in a worker of its own */
+    if (opts.parallel) {
+        result = fsck_check_parallel(opts.devices, opts.ndevices, opts.jobs,
+                                     options, opts.metrics, check_device);
+        fsck_cleanup_options(&opts);
+        common_cleanup();
+        return result;
+    }
+    
     /* Detect filesystem type */
     fs_type = hfs_detect_filesystem_type(opts.device_path, opts.partition_number);
     if (fs_type == FS_TYPE_UNKNOWN) {
@@ -177,6 +233,10 @@ int main(int argc, char *argv[])
     /* Use enhanced HFS+ checking with journal support */
     result = hfsplus_check_volume(opts.device_path, opts.partition_number, options);
     
+    if (opts.metrics) {
+        fsck_metrics_write_json(stdout, opts.device_path, "hfs+", result);
+    }
+    
     /* Cleanup */
     fsck_cleanup_options(&opts);
     common_cleanup();
@@ -0,0 +1,255 @@
+/*
+ * fsck_parallel.c - Check many devices or images at once
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * fsck -j N checks every device named on the command line with up to N
+ * checks running at once.  The checkers keep their state in globals, so
+ * each device is checked in its own forked worker.  A worker's output
+ * goes to a temporary file, which the parent prints as one block when
+ * the worker exits, so the logs of different devices never interleave.
+ */
+
+#include "fsck_common.h"
+#include "fsck_parallel.h"
+#include "fsck_metrics.h"
+#include <signal.h>
+#include <sys/wait.h>
+
+/* A running check */
+struct worker {
+    pid_t pid;
+    int device;                 /* Index into the device list */
+    FILE *log;                  /* Everything the check printed */
+    FILE *json;                 /* Its --metrics line */
+};
+
+/*
+ * NAME:    status_name()
+ * DESCRIPTION: Describe the exit code of one check
+ */
+static const char *status_name(int code)
+{
+    switch (code) {
+    case FSCK_OK:                return "clean";
+    case FSCK_CORRECTED:         return "errors corrected";
+    case FSCK_REBOOT_REQUIRED:   return "reboot required";
+    case FSCK_UNCORRECTED:       return "errors not corrected";
+    case FSCK_OPERATIONAL_ERROR: return "operational error";
+    case FSCK_USAGE_ERROR:       return "usage error";
+    case FSCK_CANCELLED:         return "canceled";
+    default:                     return "failed";
+    }
+}
+
+/*
+ * NAME:    run_worker()
+ * DESCRIPTION: Check one device in a forked child with its output going
+ *              to the worker's files; never returns
+ */
+static void run_worker(const char *device, int check_options, int metrics,
+                       fsck_device_fn check, struct worker *w)
+{
+    const char *fs_name = "unknown";
+    int null_fd, result;
+
+    /* No questions can be answered, and nothing may reach the terminal */
+    null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+    dup2(fileno(w->log), STDOUT_FILENO);
+    dup2(fileno(w->log), STDERR_FILENO);
+
+    if (metrics) {
+        fsck_metrics_enable();
+    }
+    result = check(device, check_options, &fs_name);
+    if (metrics) {
+        fsck_metrics_write_json(w->json, device, fs_name, result);
+    }
+
+    fflush(NULL);
+    _exit(result);
+}
+
+/*
+ * NAME:    print_log()
+ * DESCRIPTION: Copy a finished worker's output, each line prefixed with
+ *              its device
+ */
+static void print_log(const char *device, FILE *log)
+{
+    char line[1024];
+    int bol = 1;
+
+    rewind(log);
+    while (fgets(line, sizeof(line), log)) {
+        if (bol) {
+            printf("%s: ", device);
+        }
+        fputs(line, stdout);
+        bol = strchr(line, '\n') != NULL;
+    }
+    if (!bol) {
+        putchar('\n');
+    }
+}
+
+/*
+ * NAME:    copy_json()
+ * DESCRIPTION: Pass a worker's metrics line through unchanged
+ */
+static void copy_json(FILE *json)
+{
+    char buf[4096];
+    size_t n;
+
+    rewind(json);
+    while ((n = fread(buf, 1, sizeof(buf), json)) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+}
+
+/*
+ * NAME:    finish_worker()
+ * DESCRIPTION: Report a worker that has exited and release its slot
+ */
+static int finish_worker(char *const devices[], struct worker *w, int status)
+{
+    const char *device = devices[w->device];
+    int result;
+
+    if (WIFEXITED(status)) {
+        result = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status) &&
+               (WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGTERM)) {
+        result = FSCK_CANCELLED;
+    } else {
+        result = FSCK_OPERATIONAL_ERROR;
+    }
+
+    print_log(device, w->log);
+    if (WIFSIGNALED(status)) {
+        printf("%s: killed by signal %d\n", device, WTERMSIG(status));
+    }
+    printf("%s: %s (exit %d)\n", device, status_name(result), result);
+    copy_json(w->json);
+    fflush(stdout);
+
+    fclose(w->log);
+    fclose(w->json);
+    w->pid = 0;
+
+    return result;
+}
+
+/*
+ * NAME:    fsck_check_parallel()
+ * DESCRIPTION: Run a bounded pool of forked checks over a device list
+ */
+int fsck_check_parallel(char *const devices[], int ndevices, int jobs,
+                        int check_options, int metrics, fsck_device_fn check)
+{
+    struct worker *workers;
+    int next = 0, running = 0, result = 0;
+
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if (jobs > ndevices) {
+        jobs = ndevices;
+    }
+
+    workers = calloc(jobs, sizeof(*workers));
+    if (!workers) {
+        error_print("failed to allocate memory for %d workers", jobs);
+        return FSCK_OPERATIONAL_ERROR;
+    }
+
+    while (next < ndevices || running > 0) {
+        int status;
+        pid_t pid;
+
+        /* Fill the free slots */
+        for (int i = 0; i < jobs && next < ndevices; i++) {
+            struct worker *w = &workers[i];
+
+            if (w->pid != 0) {
+                continue;
+            }
+
+            w->device = next++;
+            w->log = tmpfile();
+            w->json = tmpfile();
+            if (!w->log || !w->json) {
+                error_print("%s: cannot create log file: %s",
+                            devices[w->device], strerror(errno));
+                if (w->log) {
+                    fclose(w->log);
+                }
+                if (w->json) {
+                    fclose(w->json);
+                }
+                result |= FSCK_OPERATIONAL_ERROR;
+                i--;
+                continue;
+            }
+
+            /* Nothing buffered may be written twice */
+            fflush(NULL);
+            pid = fork();
+            if (pid == 0) {
+                run_worker(devices[w->device], check_options, metrics, check, w);
+            }
+            if (pid < 0) {
+                fclose(w->log);
+                fclose(w->json);
+                if (running > 0) {
+                    /* Try again once a running check has finished */
+                    next--;
+                    break;
+                }
+                error_print("%s: cannot start check: %s",
+                            devices[w->device], strerror(errno));
+                result |= FSCK_OPERATIONAL_ERROR;
+                i--;
+                continue;
+            }
+            w->pid = pid;
+            running++;
+        }
+
+        if (running == 0) {
+            continue;
+        }
+
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_print("waitpid failed: %s", strerror(errno));
+            result |= FSCK_OPERATIONAL_ERROR;
+            break;
+        }
+
+        for (int i = 0; i < jobs; i++) {
+            if (workers[i].pid == pid) {
+                result |= finish_worker(devices, &workers[i], status);
+                running--;
+                break;
+            }
+        }
+    }
+
+    free(workers);
+    return result;
+}
@@ -0,0 +1,30 @@
+/*
+ * fsck_parallel.h - Check many devices or images at once
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FSCK_PARALLEL_H
+#define FSCK_PARALLEL_H
+
+/*
+ * Check one device in a worker; sets *fs_name for --metrics and returns
+ * an fsck exit code
+ */
+typedef int (*fsck_device_fn)(const char *device, int check_options,
+                              const char **fs_name);
+
+/*
+ * Check every device with at most jobs checks running at a time (0 for
+ * one per CPU).  Each check's output is printed as one block, every line
+ * prefixed with the device name, when it finishes; --metrics JSON lines
+ * are passed through unprefixed.  Returns the exit codes OR'ed together.
+ */
+int fsck_check_parallel(char *const devices[], int ndevices, int jobs,
+                        int check_options, int metrics, fsck_device_fn check);
+
+#endif /* FSCK_PARALLEL_H */
@@ -0,0 +1,1388 @@
+/*
+ * hfsplus_btree.c - HFS+ fork mapping and catalog B-tree verification
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "fsck_common.h"
+#include "../embedded/fsck/fsck_hfs.h"
+#include "journal.h"  /* For VERBOSE and REPAIR */
+#include "hfsplus_btree.h"
+#include "../../include/common/hfsplus_unicode.h"
+#include "fsck_metrics.h"
+#include <stdarg.h>
+#include <pthread.h>
+
+/* Longest catalog key (keyLength field value) */
+#define CATALOG_KEY_MAXLEN      516
+
+/* BTHeaderRec.attributes */
+#define BTREE_VARIABLE_INDEX_KEYS 0x00000004
+
+/* Catalog leaf record types and their minimum sizes */
+#define CATALOG_FOLDER          1
+#define CATALOG_FILE            2
+#define CATALOG_FOLDER_THREAD   3
+#define CATALOG_FILE_THREAD     4
+#define CATALOG_FOLDER_SIZE     88
+#define CATALOG_FILE_SIZE       248
+#define CATALOG_THREAD_SIZE     10
+
+/* Per-node problem flags */
+#define NODE_FREE               0x01    /* Not allocated in the node map */
+#define NODE_READERR            0x02    /* Could not be read */
+#define NODE_BADDESC            0x04    /* Bad node descriptor */
+#define NODE_BADOFFS            0x08    /* Bad record offset table */
+#define NODE_BROKEN             (NODE_READERR | NODE_BADDESC | NODE_BADOFFS)
+
+/* How a node was reached during the merge */
+#define SEEN_TREE               0x01
+#define SEEN_CHAIN              0x02
+#define SEEN_MAP                0x04
+
+#define NO_KEY                  0xFFFF
+
+/* Messages printed per check before the rest are only counted */
+#define BTREE_MAX_MESSAGES      50
+
+/* Nodes handed to a worker at a time */
+#define BTREE_CHUNK             8
+
+/* What a worker learned about one node */
+struct node_info {
+    uint32_t fLink;
+    uint32_t bLink;
+    int8_t kind;
+    uint8_t height;
+    uint8_t flags;
+    uint8_t seen;
+    uint16_t numRecords;
+    uint16_t badKeys;
+    uint16_t badRecords;
+    uint16_t orderErrors;
+    uint16_t folders;
+    uint16_t files;
+    uint16_t threads;
+    uint16_t firstKey;          /* Offsets into keys, or NO_KEY */
+    uint16_t lastKey;
+    uint8_t *keys;              /* Copies of the keys kept for the merge */
+    uint32_t *children;         /* Index nodes: child pointers */
+    uint16_t *childKeys;        /* Index nodes: key offset per child */
+};
+
+/* State shared by all workers checking one tree */
+struct btree_ctx {
+    uint16_t nodeSize;
+    uint16_t maxKeyLength;
+    uint8_t keyCompareType;
+    int variableIndexKeys;
+    uint32_t totalNodes;
+    const uint8_t *bitmap;
+    struct node_info *info;
+};
+
+/* A batch of nodes being validated by the worker pool */
+struct btree_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    struct btree_ctx *ctx;
+    const uint8_t *buf;
+    uint32_t first;             /* Node number of buf[0] */
+    uint32_t count;             /* Nodes in this batch */
+    uint32_t next;              /* Next node index to hand out */
+    uint32_t busy;              /* Nodes not yet finished */
+    int quit;
+};
+
+static unsigned int messages;
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline int node_used(const uint8_t *bitmap, uint32_t node)
+{
+    return (bitmap[node >> 3] & (0x80 >> (node & 7))) != 0;
+}
+
+/*
+ * NAME:    problem()
+ * DESCRIPTION: Report one B-tree problem, up to BTREE_MAX_MESSAGES per check
+ */
+static void problem(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!(VERBOSE || !REPAIR)) {
+        return;
+    }
+
+    if (messages++ >= BTREE_MAX_MESSAGES) {
+        if (messages == BTREE_MAX_MESSAGES + 1) {
+            printf("  (further catalog problems are counted but not listed)\n");
+        }
+        return;
+    }
+
+    va_start(ap, fmt);
+    printf("  ");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+}
+
+/*
+ * NAME:    fork_add()
+ * DESCRIPTION: Append a run of blocks to a fork map
+ */
+static int fork_add(hfsplus_fork_t *fork, uint32_t *alloc,
+                    uint32_t startBlock, uint32_t blockCount)
+{
+    if (fork->count == *alloc) {
+        uint32_t n = *alloc ? *alloc * 2 : 16;
+        hfsplus_extent_t *ext = realloc(fork->extents, n * sizeof(*ext));
+
+        if (!ext) {
+            return -1;
+        }
+        fork->extents = ext;
+        *alloc = n;
+    }
+
+    fork->extents[fork->count].startBlock = startBlock;
+    fork->extents[fork->count].blockCount = blockCount;
+    fork->count++;
+
+    return 0;
+}
+
+/*
+ * NAME:    fork_addrec()
+ * DESCRIPTION: Append the used entries of an 8-extent record; returns
+ *              the number of blocks added or -1
+ */
+static int64_t fork_addrec(hfsplus_fork_t *fork, uint32_t *alloc,
+                           const uint8_t *extrec)
+{
+    int64_t blocks = 0;
+
+    for (int i = 0; i < 8; i++) {
+        uint32_t start = get32(extrec + 8 * i);
+        uint32_t count = get32(extrec + 8 * i + 4);
+
+        if (count == 0) {
+            break;
+        }
+        if (fork_add(fork, alloc, start, count) < 0) {
+            return -1;
+        }
+        blocks += count;
+    }
+
+    return blocks;
+}
+
+/*
+ * NAME:    fork_io()
+ * DESCRIPTION: Transfer bytes at a fork offset, one transfer per extent
+ *              run touched; reads are served from the fork's plan when
+ *              it holds them, and writes keep the plan current
+ */
+static int fork_io(int fd, const hfsplus_fork_t *fork, uint64_t offset,
+                   uint8_t *buf, size_t len, int writing)
+{
+    uint64_t base = 0;
+
+    for (uint32_t i = 0; i < fork->count && len > 0; i++) {
+        uint64_t extlen = (uint64_t)fork->extents[i].blockCount * fork->blockSize;
+
+        if (offset < base + extlen) {
+            uint64_t within = offset - base;
+            size_t chunk = (size_t)((extlen - within < len) ? extlen - within : len);
+            off_t pos = hfsplus_volume_start +
+                        (off_t)fork->extents[i].startBlock * fork->blockSize + within;
+
+            if (!writing) {
+                if (io_plan_read(fork->plan, fd, pos, buf, chunk) < 0) {
+                    return -1;
+                }
+                buf += chunk;
+                offset += chunk;
+                len -= chunk;
+                base += extlen;
+                continue;
+            }
+
+            while (chunk > 0) {
+                ssize_t n = pwrite(fd, buf, chunk, pos);
+
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return -1;
+                }
+                io_plan_update(fork->plan, pos, buf, n);
+                buf += n;
+                pos += n;
+                offset += n;
+                len -= n;
+                chunk -= n;
+            }
+        }
+        base += extlen;
+    }
+
+    return len == 0 ? 0 : -1;
+}
+
+/*
+ * NAME:    hfsplus_fork_read()
+ * DESCRIPTION: Read bytes at a fork offset
+ */
+int hfsplus_fork_read(int fd, const hfsplus_fork_t *fork,
+                      uint64_t offset, void *buf, size_t len)
+{
+    return fork_io(fd, fork, offset, buf, len, 0);
+}
+
+/*
+ * NAME:    hfsplus_fork_write()
+ * DESCRIPTION: Write bytes at a fork offset
+ */
+int hfsplus_fork_write(int fd, const hfsplus_fork_t *fork,
+                       uint64_t offset, const void *buf, size_t len)
+{
+    return fork_io(fd, fork, offset, (uint8_t *)buf, len, 1);
+}
+
+/*
+ * NAME:    fork_overflow()
+ * DESCRIPTION: Append the extents overflow records of a fork, walking the
+ *              extents B-tree leaf chain in key order
+ */
+static int fork_overflow(int fd, const hfsplus_fork_t *extents_file,
+                         uint32_t fileID, uint8_t forkType,
+                         hfsplus_fork_t *fork, uint32_t *alloc,
+                         uint64_t *blocks)
+{
+    uint8_t head[512];
+    uint8_t *node = NULL;
+    uint16_t nodeSize;
+    uint32_t totalNodes, leaf, steps = 0;
+
+    if (hfsplus_fork_read(fd, extents_file, 0, head, sizeof(head)) < 0) {
+        return -1;
+    }
+
+    nodeSize = get16(head + 14 + 18);
+    totalNodes = get32(head + 14 + 22);
+    leaf = get32(head + 14 + 10);
+    if (nodeSize < 512 || (nodeSize & (nodeSize - 1)) != 0) {
+        return -1;
+    }
+
+    node = malloc(nodeSize);
+    if (!node) {
+        return -1;
+    }
+
+    while (leaf != 0 && leaf < totalNodes && steps++ < totalNodes) {
+        uint16_t numRecords;
+
+        if (hfsplus_fork_read(fd, extents_file, (uint64_t)leaf * nodeSize,
+                              node, nodeSize) < 0 ||
+            (int8_t)node[8] != HFSPLUS_NODE_LEAF) {
+            break;
+        }
+
+        numRecords = get16(node + 10);
+        for (uint16_t i = 0; i < numRecords; i++) {
+            uint16_t offset = get16(node + nodeSize - 2 * (i + 1));
+            const uint8_t *key = node + offset;
+            uint32_t keyFile;
+
+            if (offset < 14 || offset + 12 + 64 > nodeSize || get16(key) != 10) {
+                continue;
+            }
+
+            keyFile = get32(key + 4);
+            if (keyFile > fileID || (keyFile == fileID && key[2] > forkType)) {
+                free(node);
+                return 0;
+            }
+            if (keyFile == fileID && key[2] == forkType) {
+                int64_t added;
+
+                if (get32(key + 8) != *blocks) {
+                    free(node);
+                    return -1;  /* Gap or overlap in the fork */
+                }
+                added = fork_addrec(fork, alloc, key + 12);
+                if (added < 0) {
+                    free(node);
+                    return -1;
+                }
+                *blocks += added;
+            }
+        }
+
+        leaf = get32(node);
+    }
+
+    free(node);
+    return 0;
+}
+
+/*
+ * NAME:    hfsplus_fork_map()
+ * DESCRIPTION: Build the full extent list of a fork from its fork data
+ *              record, consulting the extents overflow file when the
+ *              first eight extents do not cover the fork
+ */
+int hfsplus_fork_map(int fd, const uint8_t *extrec, uint32_t totalBlocks,
+                     uint64_t logicalSize, uint32_t blockSize,
+                     uint32_t fileID, uint8_t forkType,
+                     const hfsplus_fork_t *extents_file,
+                     hfsplus_fork_t *fork)
+{
+    uint32_t alloc = 0;
+    int64_t added;
+    uint64_t blocks;
+
+    memset(fork, 0, sizeof(*fork));
+    fork->blockSize = blockSize;
+    fork->logicalSize = logicalSize;
+
+    added = fork_addrec(fork, &alloc, extrec);
+    if (added < 0) {
+        goto fail;
+    }
+    blocks = added;
+
+    if (blocks < totalBlocks && extents_file && fileID != HFSPLUS_EXTENTS_FILE_ID) {
+        if (fork_overflow(fd, extents_file, fileID, forkType,
+                          fork, &alloc, &blocks) < 0) {
+            goto fail;
+        }
+    }
+
+    if (blocks < totalBlocks || blocks * blockSize < logicalSize) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    hfsplus_fork_free(fork);
+    return -1;
+}
+
+/*
+ * NAME:    hfsplus_fork_free()
+ * DESCRIPTION: Release a mapped fork
+ */
+void hfsplus_fork_free(hfsplus_fork_t *fork)
+{
+    free(fork->extents);
+    fork->extents = NULL;
+    fork->count = 0;
+}
+
+/*
+ * NAME:    hfsplus_btree_leaves()
+ * DESCRIPTION: Follow the leaf chain from the first leaf, or from a leaf
+ *              a previous walk stopped at, and hand every record that
+ *              lies inside its node to a callback
+ */
+int hfsplus_btree_leaves(int fd, const hfsplus_fork_t *fork, uint32_t start,
+                         hfsplus_leaf_fn fn, hfsplus_node_fn node_fn, void *arg)
+{
+    uint8_t head[512];
+    uint8_t *node;
+    uint16_t nodeSize;
+    uint32_t totalNodes, leaf, steps = 0;
+    int result = 0;
+
+    if (hfsplus_fork_read(fd, fork, 0, head, sizeof(head)) < 0) {
+        return -1;
+    }
+
+    nodeSize = get16(head + 14 + 18);
+    totalNodes = get32(head + 14 + 22);
+    leaf = start ? start : get32(head + 14 + 10);
+    if (nodeSize < 512 || nodeSize > 32768 || (nodeSize & (nodeSize - 1)) != 0) {
+        return -1;
+    }
+
+    node = malloc(nodeSize);
+    if (!node) {
+        return -1;
+    }
+
+    while (leaf != 0) {
+        uint16_t numRecords, limit;
+
+        if (leaf >= totalNodes || steps++ >= totalNodes ||
+            hfsplus_fork_read(fd, fork, (uint64_t)leaf * nodeSize, node, nodeSize) < 0 ||
+            (int8_t)node[8] != HFSPLUS_NODE_LEAF) {
+            result = -1;
+            break;
+        }
+
+        numRecords = get16(node + 10);
+        if (14 + 2 * (numRecords + 1) > nodeSize) {
+            result = -1;
+            break;
+        }
+        limit = nodeSize - 2 * (numRecords + 1);
+        fsck_metrics_node(fork->extents[0].startBlock, leaf);
+        fsck_metrics_records(numRecords);
+
+        for (uint16_t i = 0; i < numRecords; i++) {
+            uint16_t start = get16(node + nodeSize - 2 * (i + 1));
+            uint16_t end = get16(node + nodeSize - 2 * (i + 2));
+
+            if (start < 14 || end <= start || end > limit) {
+                continue;
+            }
+            if (fn(node + start, end - start, arg) != 0) {
+                free(node);
+                return 0;
+            }
+        }
+
+        leaf = get32(node);
+        if (node_fn && node_fn(leaf, arg) != 0) {
+            result = 1;
+            break;
+        }
+    }
+
+    free(node);
+    return result;
+}
+
+/*
+ * NAME:    validate_unicode_string()
+ * DESCRIPTION: Validate an on-disk (big-endian) HFS+ Unicode name
+ */
+static int validate_unicode_string(const uint8_t *str)
+{
+    uint16_t length = get16(str);
+    const uint8_t *unicode = str + 2;
+
+    /* Check length bounds */
+    if (length > HFSPLUS_MAX_NAME_LEN) {
+        return -1;
+    }
+
+    for (int i = 0; i < length; i++) {
+        uint16_t unicode_char = get16(unicode + 2 * i);
+
+        /*
+         * NUL is legal: the hard link directory is named
+         * "\0\0\0\0HFS+ Private Data"
+         */
+        /* Surrogates must come as a high/low pair */
+        if (unicode_char >= 0xD800 && unicode_char <= 0xDFFF) {
+            uint16_t next_char;
+
+            if (unicode_char > 0xDBFF || i + 1 >= length) {
+                return -1;
+            }
+            next_char = get16(unicode + 2 * (i + 1));
+            if (next_char < 0xDC00 || next_char > 0xDFFF) {
+                return -1;
+            }
+            i++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * NAME:    check_leaf_record()
+ * DESCRIPTION: Validate the data part of a catalog leaf record
+ */
+static int check_leaf_record(struct node_info *ni, const uint8_t *key,
+                             const uint8_t *data, unsigned int len)
+{
+    unsigned int nameLength;
+
+    if (len < 2) {
+        return -1;
+    }
+
+    switch (get16(data)) {
+    case CATALOG_FOLDER:
+        if (len < CATALOG_FOLDER_SIZE) {
+            return -1;
+        }
+        ni->folders++;
+        break;
+
+    case CATALOG_FILE:
+        if (len < CATALOG_FILE_SIZE) {
+            return -1;
+        }
+        ni->files++;
+        break;
+
+    case CATALOG_FOLDER_THREAD:
+    case CATALOG_FILE_THREAD:
+        /* Threads are keyed by CNID alone */
+        if (len < CATALOG_THREAD_SIZE || get16(key + 6) != 0) {
+            return -1;
+        }
+        nameLength = get16(data + 8);
+        if (nameLength > HFSPLUS_MAX_NAME_LEN ||
+            len < CATALOG_THREAD_SIZE + 2 * nameLength ||
+            validate_unicode_string(data + 8) != 0) {
+            return -1;
+        }
+        ni->threads++;
+        break;
+
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * NAME:    check_node()
+ * DESCRIPTION: Validate one catalog node: descriptor, record offsets,
+ *              keys, Unicode names, in-node key order and leaf records
+ */
+static void check_node(struct btree_ctx *ctx, uint32_t num, const uint8_t *node)
+{
+    struct node_info *ni = &ctx->info[num];
+    uint16_t nodeSize = ctx->nodeSize;
+    uint16_t numRecords, tableStart, prevOffset, used = 0;
+    const uint8_t *prev = NULL;
+    const uint8_t *first = NULL, *last = NULL;
+
+    ni->fLink = get32(node);
+    ni->bLink = get32(node + 4);
+    ni->kind = (int8_t)node[8];
+    ni->height = node[9];
+    ni->numRecords = numRecords = get16(node + 10);
+
+    /* Node descriptor */
+    if (ni->kind < HFSPLUS_NODE_LEAF || ni->kind > HFSPLUS_NODE_MAP ||
+        (num == 0) != (ni->kind == HFSPLUS_NODE_HEADER) ||
+        (ni->kind == HFSPLUS_NODE_LEAF && ni->height != 1) ||
+        (ni->kind == HFSPLUS_NODE_INDEX && ni->height < 2) ||
+        (ni->kind > HFSPLUS_NODE_INDEX && ni->height != 0) ||
+        ni->fLink >= ctx->totalNodes || ni->bLink >= ctx->totalNodes) {
+        ni->flags |= NODE_BADDESC;
+        return;
+    }
+
+    /* Record offset table: ascending, even, clear of the table itself */
+    if (14 + 2 * (unsigned int)(numRecords + 1) > nodeSize) {
+        ni->flags |= NODE_BADOFFS;
+        return;
+    }
+    tableStart = nodeSize - 2 * (numRecords + 1);
+    prevOffset = 0;
+    for (unsigned int i = 0; i <= numRecords; i++) {
+        uint16_t offset = get16(node + nodeSize - 2 * (i + 1));
+
+        if ((i == 0 && offset != 14) || (i > 0 && offset <= prevOffset) ||
+            (offset & 1) || offset > tableStart) {
+            ni->flags |= NODE_BADOFFS;
+            return;
+        }
+        prevOffset = offset;
+    }
+
+    if (ni->kind != HFSPLUS_NODE_LEAF && ni->kind != HFSPLUS_NODE_INDEX) {
+        return;
+    }
+
+    if (ni->kind == HFSPLUS_NODE_INDEX) {
+        uint16_t space = get16(node + nodeSize - 2 * (numRecords + 1)) - 14;
+
+        ni->keys = malloc(space ? space : 1);
+        ni->children = malloc(numRecords * sizeof(uint32_t) + 1);
+        ni->childKeys = malloc(numRecords * sizeof(uint16_t) + 1);
+        if (!ni->keys || !ni->children || !ni->childKeys) {
+            ni->flags |= NODE_READERR;
+            return;
+        }
+    }
+
+    ni->firstKey = ni->lastKey = NO_KEY;
+
+    for (uint16_t i = 0; i < numRecords; i++) {
+        uint16_t offset = get16(node + nodeSize - 2 * (i + 1));
+        uint16_t end = get16(node + nodeSize - 2 * (i + 2));
+        const uint8_t *key = node + offset;
+        unsigned int reclen = end - offset;
+        unsigned int keyLength, nameLength, keySpace;
+        int goodKey = 1;
+
+        if (ni->kind == HFSPLUS_NODE_INDEX) {
+            ni->children[i] = 0;
+            ni->childKeys[i] = NO_KEY;
+        }
+
+        if (reclen < 2) {
+            ni->badKeys++;
+            prev = NULL;
+            continue;
+        }
+
+        keyLength = get16(key);
+        keySpace = keyLength;
+        if (ni->kind == HFSPLUS_NODE_INDEX && !ctx->variableIndexKeys) {
+            keySpace = ctx->maxKeyLength;
+        }
+
+        if (keyLength < 6 || keyLength > CATALOG_KEY_MAXLEN ||
+            keyLength > ctx->maxKeyLength || 2 + keySpace > reclen) {
+            ni->badKeys++;
+            prev = NULL;
+            continue;
+        }
+
+        nameLength = get16(key + 6);
+        if (nameLength > HFSPLUS_MAX_NAME_LEN ||
+            (keyLength != 6 + 2 * nameLength &&
+             !(ni->kind == HFSPLUS_NODE_INDEX && !ctx->variableIndexKeys &&
+               6 + 2 * nameLength <= keyLength)) ||
+            validate_unicode_string(key + 6) != 0) {
+            ni->badKeys++;
+            goodKey = 0;
+        }
+
+        if (goodKey) {
+            if (prev && hfsplus_catkey_compare(prev, key, ctx->keyCompareType) >= 0) {
+                ni->orderErrors++;
+            }
+            prev = key;
+            if (i == 0) {
+                first = key;
+            }
+            last = key;
+        } else {
+            prev = NULL;
+        }
+
+        if (ni->kind == HFSPLUS_NODE_LEAF) {
+            if (check_leaf_record(ni, key, key + 2 + keySpace,
+                                  reclen - 2 - keySpace) < 0) {
+                ni->badRecords++;
+            }
+        } else {
+            uint16_t keyOffset = NO_KEY;
+
+            if (reclen < 2 + keySpace + 4) {
+                ni->badRecords++;
+                continue;
+            }
+            if (goodKey) {
+                keyOffset = used;
+                memcpy(ni->keys + used, key, 2 + keyLength);
+                used += 2 + keyLength;
+                if (i == 0) {
+                    ni->firstKey = keyOffset;
+                }
+                ni->lastKey = keyOffset;
+            }
+            ni->children[i] = get32(key + 2 + keySpace);
+            ni->childKeys[i] = keyOffset;
+        }
+    }
+
+    /* Leaf nodes keep only their boundary keys for the cross-node checks */
+    if (ni->kind == HFSPLUS_NODE_LEAF && last) {
+        unsigned int firstLen = first ? 2 + get16(first) : 0;
+        unsigned int lastLen = 2 + get16(last);
+
+        ni->keys = malloc(firstLen + lastLen);
+        if (!ni->keys) {
+            ni->flags |= NODE_READERR;
+            return;
+        }
+        if (first) {
+            memcpy(ni->keys, first, firstLen);
+            ni->firstKey = 0;
+        }
+        memcpy(ni->keys + firstLen, last, lastLen);
+        ni->lastKey = firstLen;
+    }
+}
+
+/*
+ * NAME:    check_batch()
+ * DESCRIPTION: Validate the allocated nodes in part of a batch
+ */
+static void check_batch(struct btree_ctx *ctx, const uint8_t *buf,
+                        uint32_t first, uint32_t from, uint32_t to)
+{
+    for (uint32_t i = from; i < to; i++) {
+        uint32_t num = first + i;
+
+        if (!(ctx->info[num].flags & NODE_FREE)) {
+            check_node(ctx, num, buf + (size_t)i * ctx->nodeSize);
+        }
+    }
+}
+
+/*
+ * NAME:    pool_worker()
+ * DESCRIPTION: Take chunks of the current batch until told to quit
+ */
+static void *pool_worker(void *arg)
+{
+    struct btree_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        uint32_t from, to;
+
+        while (!pool->quit && pool->next >= pool->count) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+
+        from = pool->next;
+        to = (pool->count - from > BTREE_CHUNK) ? from + BTREE_CHUNK : pool->count;
+        pool->next = to;
+        pthread_mutex_unlock(&pool->lock);
+
+        check_batch(pool->ctx, pool->buf, pool->first, from, to);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->busy -= to - from;
+        if (pool->busy == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * NAME:    pool_dispatch()
+ * DESCRIPTION: Hand a batch to the workers without waiting for it
+ */
+static void pool_dispatch(struct btree_pool *pool, const uint8_t *buf,
+                          uint32_t first, uint32_t count)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->buf = buf;
+    pool->first = first;
+    pool->count = count;
+    pool->next = 0;
+    pool->busy = count;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * NAME:    pool_wait()
+ * DESCRIPTION: Wait until the workers have finished the current batch
+ */
+static void pool_wait(struct btree_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pool->count = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * NAME:    load_node_map()
+ * DESCRIPTION: Assemble the node allocation bitmap from the header node's
+ *              map record and any map nodes chained after it
+ */
+static uint8_t *load_node_map(int fd, const hfsplus_fork_t *fork,
+                              const uint8_t *header, uint16_t nodeSize,
+                              uint32_t totalNodes, hfsplus_btree_report_t *report)
+{
+    uint32_t mapBytes = (totalNodes + 7) / 8;
+    uint8_t *bitmap = calloc(mapBytes, 1);
+    uint8_t *node = NULL;
+    uint32_t have = 0, next, steps = 0;
+    uint16_t start, end;
+
+    if (!bitmap) {
+        return NULL;
+    }
+
+    /* Record 2 of the header node */
+    start = get16(header + nodeSize - 6);
+    end = get16(header + nodeSize - 8);
+    if (get16(header + 10) >= 3 && start < end && end <= nodeSize) {
+        have = (end - start < mapBytes) ? end - start : mapBytes;
+        memcpy(bitmap, header + start, have);
+    }
+
+    next = get32(header);
+    if (next != 0 && have < mapBytes) {
+        node = malloc(nodeSize);
+    }
+
+    while (node && next != 0 && next < totalNodes && have < mapBytes &&
+           steps++ < totalNodes) {
+        if (hfsplus_fork_read(fd, fork, (uint64_t)next * nodeSize, node, nodeSize) < 0 ||
+            (int8_t)node[8] != HFSPLUS_NODE_MAP) {
+            break;
+        }
+        start = get16(node + nodeSize - 2);
+        end = get16(node + nodeSize - 4);
+        if (start >= end || end > nodeSize) {
+            break;
+        }
+        if (end - start > mapBytes - have) {
+            end = start + (mapBytes - have);
+        }
+        memcpy(bitmap + have, node + start, end - start);
+        have += end - start;
+        next = get32(node);
+    }
+    free(node);
+
+    if (have < mapBytes) {
+        problem("Catalog node map covers %u of %u nodes", have * 8, totalNodes);
+        report->headerErrors++;
+    }
+
+    /* The header node is always in use */
+    bitmap[0] |= 0x80;
+
+    return bitmap;
+}
+
+/*
+ * NAME:    scan_nodes()
+ * DESCRIPTION: Read the tree file in large sequential batches and let the
+ *              worker pool validate each batch while the next one is read
+ */
+static int scan_nodes(int fd, const hfsplus_fork_t *fork, struct btree_ctx *ctx,
+                      hfsplus_btree_report_t *report)
+{
+    struct btree_pool pool;
+    pthread_t threads[HFSPLUS_BTREE_MAXTHREADS];
+    unsigned int nthreads = 0, wanted;
+    uint32_t batchNodes = HFSPLUS_BTREE_BATCH / ctx->nodeSize;
+    uint8_t *bufs[2];
+    uint32_t num;
+    int cur = 0, inflight = 0;
+    long ncpu;
+
+    if (batchNodes == 0) {
+        batchNodes = 1;
+    }
+    if (batchNodes > ctx->totalNodes) {
+        batchNodes = ctx->totalNodes;
+    }
+
+    bufs[0] = malloc((size_t)batchNodes * ctx->nodeSize);
+    bufs[1] = malloc((size_t)batchNodes * ctx->nodeSize);
+    if (!bufs[0] || !bufs[1]) {
+        free(bufs[0]);
+        free(bufs[1]);
+        return -1;
+    }
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    wanted = (ncpu > 0) ? (unsigned int)ncpu : 1;
+    if (wanted > HFSPLUS_BTREE_MAXTHREADS) {
+        wanted = HFSPLUS_BTREE_MAXTHREADS;
+    }
+    if (ctx->totalNodes < 4 * BTREE_CHUNK) {
+        wanted = 1;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.ctx = ctx;
+    if (wanted > 1) {
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.start, NULL);
+        pthread_cond_init(&pool.done, NULL);
+        while (nthreads < wanted &&
+               pthread_create(&threads[nthreads], NULL, pool_worker, &pool) == 0) {
+            nthreads++;
+        }
+    }
+    report->threadsUsed = nthreads ? nthreads : 1;
+
+    for (num = 0; num < ctx->totalNodes; num += batchNodes) {
+        uint32_t count = ctx->totalNodes - num;
+        uint32_t lo, hi;
+
+        if (count > batchNodes) {
+            count = batchNodes;
+        }
+
+        /* Only read the span between the first and last allocated node */
+        for (lo = 0; lo < count && (ctx->info[num + lo].flags & NODE_FREE); lo++)
+            ;
+        for (hi = count; hi > lo && (ctx->info[num + hi - 1].flags & NODE_FREE); hi--)
+            ;
+        if (lo == hi) {
+            continue;
+        }
+
+        if (hfsplus_fork_read(fd, fork, (uint64_t)(num + lo) * ctx->nodeSize,
+                              bufs[cur] + (size_t)lo * ctx->nodeSize,
+                              (size_t)(hi - lo) * ctx->nodeSize) < 0) {
+            for (uint32_t i = lo; i < hi; i++) {
+                ctx->info[num + i].flags |= NODE_READERR;
+            }
+            continue;
+        }
+
+        if (nthreads == 0) {
+            check_batch(ctx, bufs[cur], num, lo, hi);
+            continue;
+        }
+
+        /* Hand this batch over, then finish the previous one */
+        if (inflight) {
+            pool_wait(&pool);
+        }
+        pool_dispatch(&pool, bufs[cur] + (size_t)lo * ctx->nodeSize, num + lo, hi - lo);
+        inflight = 1;
+        cur ^= 1;
+    }
+
+    if (nthreads > 0) {
+        if (inflight) {
+            pool_wait(&pool);
+        }
+        pthread_mutex_lock(&pool.lock);
+        pool.quit = 1;
+        pthread_cond_broadcast(&pool.start);
+        pthread_mutex_unlock(&pool.lock);
+        for (unsigned int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.start);
+        pthread_cond_destroy(&pool.done);
+    } else if (wanted > 1) {
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.start);
+        pthread_cond_destroy(&pool.done);
+    }
+
+    free(bufs[0]);
+    free(bufs[1]);
+
+    return 0;
+}
+
+/*
+ * NAME:    node_key()
+ * DESCRIPTION: Return a saved key of a node, or NULL
+ */
+static inline const uint8_t *node_key(const struct node_info *ni, uint16_t offset)
+{
+    return (offset == NO_KEY || !ni->keys) ? NULL : ni->keys + offset;
+}
+
+/*
+ * NAME:    merge_tree()
+ * DESCRIPTION: Walk the index from the root and check each child pointer
+ *              against the validated node it points to
+ */
+static void merge_tree(struct btree_ctx *ctx, uint32_t rootNode, uint16_t treeDepth,
+                       hfsplus_btree_report_t *report)
+{
+    struct node_info *info = ctx->info;
+    uint32_t *stack, top = 0;
+
+    if (treeDepth == 0) {
+        if (rootNode != 0) {
+            problem("Catalog tree is empty but root node is %u", rootNode);
+            report->headerErrors++;
+        }
+        return;
+    }
+
+    if (rootNode == 0 || rootNode >= ctx->totalNodes ||
+        (info[rootNode].flags & (NODE_FREE | NODE_BROKEN))) {
+        problem("Catalog root node %u is not a valid node", rootNode);
+        report->headerErrors++;
+        return;
+    }
+    if (info[rootNode].height != treeDepth) {
+        problem("Catalog root node height %u does not match tree depth %u",
+                info[rootNode].height, treeDepth);
+        report->headerErrors++;
+    }
+
+    stack = malloc(ctx->totalNodes * sizeof(uint32_t));
+    if (!stack) {
+        return;
+    }
+
+    info[rootNode].seen |= SEEN_TREE;
+    stack[top++] = rootNode;
+
+    while (top > 0) {
+        uint32_t parent = stack[--top];
+        struct node_info *pi = &info[parent];
+
+        if (pi->kind != HFSPLUS_NODE_INDEX || !pi->children) {
+            continue;
+        }
+
+        for (uint16_t i = 0; i < pi->numRecords; i++) {
+            uint32_t child = pi->children[i];
+            struct node_info *ci;
+            const uint8_t *ikey, *ckey;
+
+            if (pi->childKeys[i] == NO_KEY && child == 0) {
+                continue;   /* Already counted as a bad record */
+            }
+            if (child == 0 || child >= ctx->totalNodes ||
+                (info[child].flags & NODE_FREE)) {
+                problem("Catalog index node %u points to invalid node %u",
+                        parent, child);
+                report->linkErrors++;
+                continue;
+            }
+
+            ci = &info[child];
+            if (ci->seen & SEEN_TREE) {
+                problem("Catalog node %u is referenced more than once", child);
+                report->linkErrors++;
+                continue;
+            }
+            ci->seen |= SEEN_TREE;
+
+            if (ci->flags & NODE_BROKEN) {
+                continue;
+            }
+
+            if (ci->height != pi->height - 1 ||
+                ci->kind != (pi->height == 2 ? HFSPLUS_NODE_LEAF : HFSPLUS_NODE_INDEX)) {
+                problem("Catalog node %u has height %u under index node %u (height %u)",
+                        child, ci->height, parent, pi->height);
+                report->linkErrors++;
+                continue;
+            }
+
+            ikey = node_key(pi, pi->childKeys[i]);
+            ckey = node_key(ci, ci->firstKey);
+            if (ikey && ckey &&
+                hfsplus_catkey_compare(ikey, ckey, ctx->keyCompareType) != 0) {
+                problem("Catalog index node %u key %u does not match first key of node %u",
+                        parent, i, child);
+                report->linkErrors++;
+            }
+
+            if (ci->kind == HFSPLUS_NODE_INDEX) {
+                stack[top++] = child;
+            }
+        }
+    }
+
+    free(stack);
+}
+
+/*
+ * NAME:    merge_leaves()
+ * DESCRIPTION: Follow the leaf chain, checking sibling links, order across
+ *              node boundaries and the header's leaf totals
+ */
+static void merge_leaves(struct btree_ctx *ctx, const uint8_t *hdr,
+                         hfsplus_btree_report_t *report)
+{
+    struct node_info *info = ctx->info;
+    uint16_t treeDepth = get16(hdr);
+    uint32_t firstLeaf = get32(hdr + 10);
+    uint32_t lastLeaf = get32(hdr + 14);
+    uint32_t leafRecords = get32(hdr + 6);
+    uint32_t node = firstLeaf, prev = 0, steps = 0;
+
+    while (node != 0) {
+        struct node_info *ni;
+
+        if (node >= ctx->totalNodes || steps++ >= ctx->totalNodes) {
+            problem("Catalog leaf chain runs past node %u", prev);
+            report->linkErrors++;
+            break;
+        }
+
+        ni = &info[node];
+        if (ni->seen & SEEN_CHAIN) {
+            problem("Catalog leaf chain loops back to node %u", node);
+            report->linkErrors++;
+            break;
+        }
+        if ((ni->flags & (NODE_FREE | NODE_BROKEN)) || ni->kind != HFSPLUS_NODE_LEAF) {
+            problem("Catalog leaf chain reaches non-leaf node %u", node);
+            report->linkErrors++;
+            break;
+        }
+        ni->seen |= SEEN_CHAIN;
+
+        if (ni->bLink != prev) {
+            problem("Catalog leaf node %u has back link %u (expected %u)",
+                    node, ni->bLink, prev);
+            report->linkErrors++;
+        }
+        if (treeDepth > 0 && !(ni->seen & SEEN_TREE)) {
+            problem("Catalog leaf node %u is not reachable from the index", node);
+            report->linkErrors++;
+        }
+
+        if (prev) {
+            const uint8_t *a = node_key(&info[prev], info[prev].lastKey);
+            const uint8_t *b = node_key(ni, ni->firstKey);
+
+            if (a && b && hfsplus_catkey_compare(a, b, ctx->keyCompareType) >= 0) {
+                problem("Catalog leaf nodes %u and %u are out of order", prev, node);
+                report->orderErrors++;
+            }
+        }
+
+        report->leafNodes++;
+        report->leafRecords += ni->numRecords;
+        report->folders += ni->folders;
+        report->files += ni->files;
+        report->threads += ni->threads;
+
+        prev = node;
+        node = ni->fLink;
+    }
+
+    if (prev != lastLeaf) {
+        problem("Catalog last leaf is %u, header says %u", prev, lastLeaf);
+        report->headerErrors++;
+    }
+    if (report->leafRecords != leafRecords) {
+        problem("Catalog has %u leaf records, header says %u",
+                report->leafRecords, leafRecords);
+        report->headerErrors++;
+    }
+
+    /* Every leaf reached from the index must also be on the chain */
+    for (uint32_t i = 1; i < ctx->totalNodes; i++) {
+        if ((info[i].seen & SEEN_TREE) && info[i].kind == HFSPLUS_NODE_LEAF &&
+            !(info[i].flags & NODE_BROKEN) && !(info[i].seen & SEEN_CHAIN)) {
+            problem("Catalog leaf node %u is missing from the leaf chain", i);
+            report->linkErrors++;
+        }
+    }
+}
+
+/*
+ * NAME:    merge_nodes()
+ * DESCRIPTION: Fold per-node results into the report and account for
+ *              allocated nodes that nothing points to
+ */
+static void merge_nodes(struct btree_ctx *ctx, hfsplus_btree_report_t *report)
+{
+    struct node_info *info = ctx->info;
+    uint32_t node;
+
+    /* Map nodes hang off the header node */
+    node = info[0].fLink;
+    for (uint32_t steps = 0; node != 0 && node < ctx->totalNodes &&
+         steps < ctx->totalNodes; steps++) {
+        if (info[node].kind != HFSPLUS_NODE_MAP || (info[node].seen & SEEN_MAP)) {
+            break;
+        }
+        info[node].seen |= SEEN_MAP;
+        node = info[node].fLink;
+    }
+
+    for (uint32_t i = 0; i < ctx->totalNodes; i++) {
+        struct node_info *ni = &info[i];
+
+        if (ni->flags & NODE_FREE) {
+            continue;
+        }
+        report->usedNodes++;
+
+        if (ni->flags & NODE_READERR) {
+            problem("Catalog node %u could not be read", i);
+            report->badNodes++;
+            continue;
+        }
+        if (ni->flags & NODE_BADDESC) {
+            problem("Catalog node %u has a bad node descriptor", i);
+            report->badNodes++;
+            continue;
+        }
+        if (ni->flags & NODE_BADOFFS) {
+            problem("Catalog node %u has a bad record offset table", i);
+            report->badNodes++;
+            continue;
+        }
+
+        if (ni->kind == HFSPLUS_NODE_INDEX) {
+            report->indexNodes++;
+        }
+        if (ni->badKeys) {
+            problem("Catalog node %u has %u bad keys", i, ni->badKeys);
+            report->badKeys += ni->badKeys;
+        }
+        if (ni->badRecords) {
+            problem("Catalog node %u has %u bad records", i, ni->badRecords);
+            report->badRecords += ni->badRecords;
+        }
+        if (ni->orderErrors) {
+            problem("Catalog node %u has %u keys out of order", i, ni->orderErrors);
+            report->orderErrors += ni->orderErrors;
+        }
+
+        if (i != 0 && !ni->seen) {
+            problem("Catalog node %u is allocated but unreachable", i);
+            report->orphanNodes++;
+        }
+    }
+}
+
+/*
+ * NAME:    hfsplus_btree_check_catalog()
+ * DESCRIPTION: Verify every node of the catalog B-tree.  Nodes are read in
+ *              large sequential batches and validated on a pool of worker
+ *              threads; the per-node results are then merged to check the
+ *              index, the leaf chain and the header record.  Returns the
+ *              number of problems found, or -1 if the tree cannot be read.
+ */
+int hfsplus_btree_check_catalog(int fd, const hfsplus_fork_t *fork,
+                                hfsplus_btree_report_t *report)
+{
+    struct btree_ctx ctx;
+    uint8_t head[512];
+    uint8_t *header = NULL, *bitmap = NULL;
+    const uint8_t *hdr;
+    uint64_t forkBytes = 0;
+    uint32_t freeNodes;
+    int problems = -1;
+
+    memset(report, 0, sizeof(*report));
+    memset(&ctx, 0, sizeof(ctx));
+    messages = 0;
+
+    for (uint32_t i = 0; i < fork->count; i++) {
+        forkBytes += (uint64_t)fork->extents[i].blockCount * fork->blockSize;
+    }
+
+    if (hfsplus_fork_read(fd, fork, 0, head, sizeof(head)) < 0) {
+        error_print("failed to read catalog header node");
+        return -1;
+    }
+
+    hdr = head + 14;
+    ctx.nodeSize = get16(hdr + 18);
+    ctx.maxKeyLength = get16(hdr + 20);
+    ctx.totalNodes = get32(hdr + 22);
+    ctx.keyCompareType = hdr[37];
+    ctx.variableIndexKeys = (get32(hdr + 38) & BTREE_VARIABLE_INDEX_KEYS) != 0;
+
+    report->nodeSize = ctx.nodeSize;
+    report->treeDepth = get16(hdr);
+    report->totalNodes = ctx.totalNodes;
+
+    if (ctx.nodeSize < 512 || ctx.nodeSize > 32768 ||
+        (ctx.nodeSize & (ctx.nodeSize - 1)) != 0) {
+        problem("Catalog node size %u is invalid", ctx.nodeSize);
+        return -1;
+    }
+    if (ctx.totalNodes == 0 || (uint64_t)ctx.totalNodes * ctx.nodeSize > forkBytes) {
+        problem("Catalog total nodes %u does not fit the catalog file", ctx.totalNodes);
+        return -1;
+    }
+    if (ctx.maxKeyLength < 6) {
+        problem("Catalog maximum key length %u is invalid", ctx.maxKeyLength);
+        return -1;
+    }
+
+    header = malloc(ctx.nodeSize);
+    ctx.info = calloc(ctx.totalNodes, sizeof(struct node_info));
+    if (!header || !ctx.info) {
+        error_print("failed to allocate catalog node table");
+        goto done;
+    }
+    if (hfsplus_fork_read(fd, fork, 0, header, ctx.nodeSize) < 0) {
+        error_print("failed to read catalog header node");
+        goto done;
+    }
+    hdr = header + 14;
+
+    bitmap = load_node_map(fd, fork, header, ctx.nodeSize, ctx.totalNodes, report);
+    if (!bitmap) {
+        error_print("failed to allocate catalog node map");
+        goto done;
+    }
+    ctx.bitmap = bitmap;
+
+    for (uint32_t i = 0; i < ctx.totalNodes; i++) {
+        if (!node_used(bitmap, i)) {
+            ctx.info[i].flags = NODE_FREE;
+        }
+    }
+
+    if (scan_nodes(fd, fork, &ctx, report) < 0) {
+        error_print("failed to allocate catalog read buffers");
+        goto done;
+    }
+
+    merge_tree(&ctx, get32(hdr + 2), report->treeDepth, report);
+    merge_leaves(&ctx, hdr, report);
+    merge_nodes(&ctx, report);
+
+    freeNodes = get32(hdr + 26);
+    if (ctx.totalNodes - report->usedNodes != freeNodes) {
+        problem("Catalog has %u free nodes, header says %u",
+                ctx.totalNodes - report->usedNodes, freeNodes);
+        report->headerErrors++;
+    }
+
+    for (uint32_t i = 0; i < ctx.totalNodes; i++) {
+        if (!(ctx.info[i].flags & NODE_FREE)) {
+            fsck_metrics_node(fork->extents[0].startBlock, i);
+        }
+    }
+    fsck_metrics_records(report->leafRecords);
+
+    problems = report->badNodes + report->badKeys + report->badRecords +
+               report->orderErrors + report->linkErrors + report->headerErrors +
+               report->orphanNodes;
+
+done:
+    if (ctx.info) {
+        for (uint32_t i = 0; i < ctx.totalNodes; i++) {
+            free(ctx.info[i].keys);
+            free(ctx.info[i].children);
+            free(ctx.info[i].childKeys);
+        }
+    }
+    free(ctx.info);
+    free(bitmap);
+    free(header);
+
+    return problems;
+}
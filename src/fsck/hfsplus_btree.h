@@ -0,0 +1,113 @@
+/*
+ * hfsplus_btree.h - HFS+ fork mapping and catalog B-tree verification
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef HFSPLUS_BTREE_H
+#define HFSPLUS_BTREE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "io_plan.h"
+
+/* Special file IDs */
+#define HFSPLUS_EXTENTS_FILE_ID    3
+#define HFSPLUS_CATALOG_FILE_ID    4
+#define HFSPLUS_ALLOCATION_FILE_ID 6
+#define HFSPLUS_STARTUP_FILE_ID    7
+#define HFSPLUS_ATTRIBUTES_FILE_ID 8
+
+/* Fork types in extents overflow keys */
+#define HFSPLUS_FORK_DATA        0x00
+#define HFSPLUS_FORK_RSRC        0xFF
+
+/* B-tree node kinds (BTNodeDescriptor.kind) */
+#define HFSPLUS_NODE_LEAF        -1
+#define HFSPLUS_NODE_INDEX       0
+#define HFSPLUS_NODE_HEADER      1
+#define HFSPLUS_NODE_MAP         2
+
+/* Bytes read per batch while scanning a B-tree file */
+#define HFSPLUS_BTREE_BATCH      (8 * 1024 * 1024)
+
+/* Upper bound on validation threads */
+#define HFSPLUS_BTREE_MAXTHREADS 16
+
+/* A single allocation block run */
+typedef struct {
+    uint32_t startBlock;
+    uint32_t blockCount;
+} hfsplus_extent_t;
+
+/* A fork mapped to its full list of extents */
+typedef struct {
+    hfsplus_extent_t *extents;
+    uint32_t count;
+    uint32_t blockSize;
+    uint64_t logicalSize;
+    io_plan_t *plan;            /* Preloaded metadata, or NULL */
+} hfsplus_fork_t;
+
+/* Totals gathered while checking a catalog B-tree */
+typedef struct {
+    uint16_t nodeSize;
+    uint16_t treeDepth;
+    uint32_t totalNodes;
+    uint32_t usedNodes;
+    uint32_t indexNodes;
+    uint32_t leafNodes;
+    uint32_t leafRecords;
+    uint32_t folders;
+    uint32_t files;
+    uint32_t threads;
+    uint32_t badNodes;          /* Bad descriptors or record offsets */
+    uint32_t badKeys;           /* Bad key lengths or Unicode names */
+    uint32_t badRecords;        /* Bad leaf record types or sizes */
+    uint32_t orderErrors;       /* Keys out of order, in or across nodes */
+    uint32_t linkErrors;        /* Broken index pointers or sibling links */
+    uint32_t headerErrors;      /* Header record disagrees with the tree */
+    uint32_t orphanNodes;       /* Allocated but unreachable nodes */
+    unsigned int threadsUsed;
+} hfsplus_btree_report_t;
+
+/* Map a fork, following the extents overflow file when needed */
+int hfsplus_fork_map(int fd, const uint8_t *extrec, uint32_t totalBlocks,
+                     uint64_t logicalSize, uint32_t blockSize,
+                     uint32_t fileID, uint8_t forkType,
+                     const hfsplus_fork_t *extents_file,
+                     hfsplus_fork_t *fork);
+
+/* Release a mapped fork */
+void hfsplus_fork_free(hfsplus_fork_t *fork);
+
+/* Read or write bytes at a fork offset; returns 0 on success */
+int hfsplus_fork_read(int fd, const hfsplus_fork_t *fork,
+                      uint64_t offset, void *buf, size_t len);
+int hfsplus_fork_write(int fd, const hfsplus_fork_t *fork,
+                       uint64_t offset, const void *buf, size_t len);
+
+/* Called for each leaf record, key included; non-zero stops the walk */
+typedef int (*hfsplus_leaf_fn)(const uint8_t *record, uint16_t length, void *arg);
+
+/* Called after each leaf node with the next one (0 after the last); non-zero stops the walk */
+typedef int (*hfsplus_node_fn)(uint32_t next, void *arg);
+
+/*
+ * Visit every leaf record in key order, starting at leaf node start (0
+ * for the first leaf); node_fn may be NULL.  Returns -1 if the leaf
+ * chain breaks and 1 if node_fn stopped the walk.
+ */
+int hfsplus_btree_leaves(int fd, const hfsplus_fork_t *fork, uint32_t start,
+                         hfsplus_leaf_fn fn, hfsplus_node_fn node_fn, void *arg);
+
+/* Verify every node of a catalog B-tree; returns the number of problems */
+int hfsplus_btree_check_catalog(int fd, const hfsplus_fork_t *fork,
+                                hfsplus_btree_report_t *report);
+
+#endif /* HFSPLUS_BTREE_H */
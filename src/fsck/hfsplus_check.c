@@ -12,9 +12,14 @@
 #include "../embedded/fsck/fsck_hfs.h"
 #include "../embedded/shared/hfs_detect.h"  /* For hfs_get_safe_time() */
 #include "journal.h"  /* For journal support */
+#include "hfsplus_btree.h"  /* For catalog fork mapping and tree checks */
+#include "hfsplus_hierarchy.h"  /* For thread and parent cross-checks */
+#include "alloc_bitmap.h"   /* For allocation file reconstruction */
+#include "fsck_metrics.h"   /* For --metrics */
+#include "fsck_checkpoint.h" /* For --checkpoint */
+#include "fsck_extsort.h"   /* For --memory */
 #include <wchar.h>
 #include <locale.h>
-#include <locale.h>
 
 /* HFS+ specific constants */
 #define HFSPLUS_SIGNATURE       0x482B
@@ -81,10 +86,34 @@ static int check_hfsplus_volume_header(int fd, struct HFSPlus_VolumeHeader_Compl
 static int check_hfsplus_journal(int fd, struct HFSPlus_VolumeHeader_Complete *vh, int repair_mode);
 static int check_hfsplus_catalog_unicode(int fd, struct HFSPlus_VolumeHeader_Complete *vh);
 static int check_hfsplus_attributes_file(int fd, struct HFSPlus_VolumeHeader_Complete *vh);
-static int validate_unicode_string(const struct HFSPlus_UniStr255 *str);
+static int check_hfsplus_allocation_file(int fd, struct HFSPlus_VolumeHeader_Complete *vh);
 
 static int repair_hfsplus_volume_header(int fd, struct HFSPlus_VolumeHeader_Complete *vh);
 
+static io_plan_t *plan_hfsplus_metadata(int fd, const struct HFSPlus_VolumeHeader_Complete *vh);
+static int map_metadata_fork(int fd, const struct HFSPlus_VolumeHeader_Complete *vh,
+                             const struct HFSPlus_ForkData *forkData, uint32_t fileID,
+                             hfsplus_fork_t *fork);
+
+/* Metadata preloaded for the catalog and attributes phases */
+static io_plan_t *metadata_plan;
+
+/* Where the HFS+ volume starts, past any HFS wrapper */
+off_t hfsplus_volume_start;
+
+/* Progress recorded for --checkpoint */
+static fsck_checkpoint_t checkpoint;
+static int walk_stopped;        /* A walk stopped; its position was saved */
+
+/* Set by a phase for problems it reports but cannot repair */
+static int errors_uncorrected;
+
+static void resume_checkpoint(int fd, struct HFSPlus_VolumeHeader_Complete *vh,
+                              int *errors_found, int *errors_corrected);
+static int phase_skipped(fsck_phase_t phase);
+static int phase_finished(int fd, const struct HFSPlus_VolumeHeader_Complete *vh,
+                          fsck_phase_t phase, int errors_found, int errors_corrected);
+
 /*
  * NAME:    hfsplus_check_volume()
  * DESCRIPTION: Complete HFS+ volume checking with journal support
@@ -118,8 +147,20 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
         return FSCK_OPERATIONAL_ERROR;
     }
     
+    /* A wrapped volume is checked where the HFS wrapper embeds it */
+    hfsplus_volume_start = hfs_detect_embedded_offset(fd);
+    if (hfsplus_volume_start < 0) {
+        error_print("invalid HFS wrapper on %s", device_path);
+        close(fd);
+        return FSCK_OPERATIONAL_ERROR;
+    }
+    if (hfsplus_volume_start > 0 && VERBOSE) {
+        printf("HFS+ volume embedded in HFS wrapper at offset %llu\n",
+               (unsigned long long)hfsplus_volume_start);
+    }
+    
     /* Read HFS+ Volume Header */
-    if (lseek(fd, 1024, SEEK_SET) == -1) {
+    if (lseek(fd, hfsplus_volume_start + 1024, SEEK_SET) == -1) {
         error_print("failed to seek to volume header");
         close(fd);
         return FSCK_OPERATIONAL_ERROR;
@@ -130,6 +171,7 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
         close(fd);
         return FSCK_OPERATIONAL_ERROR;
     }
+    fsck_metrics_bytes(sizeof(vh));
     
     /* Validate HFS+ signature */
     if (be16toh(vh.signature) != HFSPLUS_SIGNATURE) {
@@ -138,12 +180,25 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
         return FSCK_OPERATIONAL_ERROR;
     }
     
+    /* Carry on from an interrupted run of the same check */
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    walk_stopped = 0;
+    errors_uncorrected = 0;
+    if (fsck_checkpoint_enabled()) {
+        resume_checkpoint(fd, &vh, &errors_found, &errors_corrected);
+    }
+    
     /* Phase 1: Check Volume Header */
     if (VERBOSE) {
         printf("\n=== Phase 1: Checking HFS+ Volume Header ===\n");
     }
     
-    result = check_hfsplus_volume_header(fd, &vh);
+    result = 0;
+    if (!phase_skipped(FSCK_PHASE_HEADER)) {
+        fsck_metrics_begin(FSCK_PHASE_HEADER);
+        result = check_hfsplus_volume_header(fd, &vh);
+        fsck_metrics_end(FSCK_PHASE_HEADER, result);
+    }
     if (result > 0) {
         errors_found = 1;
         if (check_options & HFSCK_REPAIR) {
@@ -157,6 +212,9 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
         close(fd);
         return FSCK_UNCORRECTED;
     }
+    if (phase_finished(fd, &vh, FSCK_PHASE_HEADER, errors_found, errors_corrected)) {
+        goto interrupted;
+    }
     
     /* Phase 2: Check Journal (if present) */
     uint32_t attributes = be32toh(vh.attributes);
@@ -165,7 +223,12 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
             printf("\n=== Phase 2: Checking HFS+ Journal ===\n");
         }
         
-        result = check_hfsplus_journal(fd, &vh, check_options & HFSCK_REPAIR);
+        result = 0;
+        if (!phase_skipped(FSCK_PHASE_JOURNAL)) {
+            fsck_metrics_begin(FSCK_PHASE_JOURNAL);
+            result = check_hfsplus_journal(fd, &vh, check_options & HFSCK_REPAIR);
+            fsck_metrics_end(FSCK_PHASE_JOURNAL, result);
+        }
         if (result > 0) {
             errors_found = 1;
             if (check_options & HFSCK_REPAIR) {
@@ -177,56 +240,10 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
         } else if (result < 0) {
             error_print("critical journal errors");
             errors_found = 1;
+            errors_uncorrected = 1;
         }
-                if (YES || ask("Disable journaling to continue")) {
-                    if (journal_disable(fd, &vh) == 0) {
-                        printf("Journaling disabled successfully\n");
-                        errors_corrected = 1;
-                    } else {
-                        error_print("Failed to disable journaling");
-                        errors_found = 1;
-                    }
-                }
-            } else {
-                printf("Run with -y to disable journaling\n");
-                errors_found = 1;
-            }
-        } else if (journal_status == 1) {
-            /* Valid journal - check if replay needed */
-            if (VERBOSE) {
-                printf("Journal is valid\n");
-            }
-            
-            /* Check if volume was cleanly unmounted */
-            if (!(attributes & HFSPLUS_UNMOUNTED)) {
-                printf("Volume was not cleanly unmounted - journal replay may be needed\n");
-                
-                if (check_options & HFSCK_REPAIR) {
-                    printf("Replaying journal transactions...\n");
-                    int replayed = journal_replay(fd, &vh, 1);
-                    
-                    if (replayed > 0) {
-                        printf("Successfully replayed %d journal transaction(s)\n", replayed);
-                        errors_corrected = 1;
-                    } else if (replayed < 0) {
-                        printf("WARNING: Journal replay failed (error %d)\n", replayed);
-                        printf("         Filesystem may be inconsistent\n");
-                        errors_found = 1;
-                    } else {
-                        printf("No journal transactions to replay\n");
-                    }
-                } else {
-                    printf("Run with repair option to replay journal\n");
-                    errors_found = 1;
-                }
-            } else if (VERBOSE) {
-                printf("Volume was cleanly unmounted - no journal replay needed\n");
-            }
-        } else {
-            /* journal_status == 0: not journaled */
-            if (VERBOSE) {
-                printf("Volume is marked as journaled but journal is disabled\n");
-            }
+        if (phase_finished(fd, &vh, FSCK_PHASE_JOURNAL, errors_found, errors_corrected)) {
+            goto interrupted;
         }
         
         /* Linux compatibility warning */
@@ -238,12 +255,28 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
         printf("Volume is not journaled\n");
     }
     
+    /*
+     * Read the B*-tree files up front in device order.  This comes after
+     * the journal phase: replay rewrites exactly these blocks.
+     */
+    fsck_metrics_begin(FSCK_PHASE_PRELOAD);
+    metadata_plan = plan_hfsplus_metadata(fd, &vh);
+    fsck_metrics_end(FSCK_PHASE_PRELOAD, 0);
+    
     /* Phase 3: Catalog and Attributes Validation */
     if (VERBOSE) {
         printf("\n=== Phase 3: Checking HFS+ Catalog with Unicode Support ===\n");
     }
     
-    result = check_hfsplus_catalog_unicode(fd, &vh);
+    result = 0;
+    if (!phase_skipped(FSCK_PHASE_CATALOG)) {
+        fsck_metrics_begin(FSCK_PHASE_CATALOG);
+        result = check_hfsplus_catalog_unicode(fd, &vh);
+        fsck_metrics_end(FSCK_PHASE_CATALOG, result);
+        if (walk_stopped) {
+            goto interrupted;
+        }
+    }
     if (result > 0) {
         errors_found = 1;
         if (check_options & HFSCK_REPAIR) {
@@ -255,6 +288,10 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
     } else if (result < 0) {
         error_print("critical catalog Unicode errors");
         errors_found = 1;
+        errors_uncorrected = 1;
+    }
+    if (phase_finished(fd, &vh, FSCK_PHASE_CATALOG, errors_found, errors_corrected)) {
+        goto interrupted;
     }
     
     /* Phase 4: Check Attributes File */
@@ -262,7 +299,12 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
         printf("\n=== Phase 4: Checking HFS+ Attributes File ===\n");
     }
     
-    result = check_hfsplus_attributes_file(fd, &vh);
+    result = 0;
+    if (!phase_skipped(FSCK_PHASE_ATTRIBUTES)) {
+        fsck_metrics_begin(FSCK_PHASE_ATTRIBUTES);
+        result = check_hfsplus_attributes_file(fd, &vh);
+        fsck_metrics_end(FSCK_PHASE_ATTRIBUTES, result);
+    }
     if (result > 0) {
         errors_found = 1;
         if (check_options & HFSCK_REPAIR) {
@@ -274,7 +316,52 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
     } else if (result < 0) {
         error_print("critical attributes file errors");
         errors_found = 1;
+        errors_uncorrected = 1;
+    }
+    if (phase_finished(fd, &vh, FSCK_PHASE_ATTRIBUTES, errors_found, errors_corrected)) {
+        goto interrupted;
+    }
+    
+    /* Phase 5: Check Allocation File */
+    if (VERBOSE) {
+        printf("\n=== Phase 5: Checking HFS+ Allocation File ===\n");
+    }
+    
+    result = 0;
+    if (!phase_skipped(FSCK_PHASE_BITMAP)) {
+        fsck_metrics_begin(FSCK_PHASE_BITMAP);
+        result = check_hfsplus_allocation_file(fd, &vh);
+        fsck_metrics_end(FSCK_PHASE_BITMAP, result);
+        if (walk_stopped) {
+            goto interrupted;
+        }
+    }
+    if (result > 0) {
+        errors_found = 1;
+        if (check_options & HFSCK_REPAIR) {
+            errors_corrected = 1;
+            if (VERBOSE) {
+                printf("*** Allocation file errors corrected\n");
+            }
+        }
+    } else if (result < 0) {
+        error_print("critical allocation file errors");
+        errors_found = 1;
+        errors_uncorrected = 1;
+    }
+    phase_finished(fd, &vh, FSCK_PHASE_BITMAP, errors_found, errors_corrected);
+    
+    if (VERBOSE && metadata_plan) {
+        io_plan_stats_t stats;
+        
+        io_plan_get_stats(metadata_plan, &stats);
+        printf("\nMetadata I/O: %lu ranges in %lu runs, %lu reads, %llu bytes; "
+               "%lu reads from memory, %lu from disk\n",
+               stats.ranges, stats.runs, stats.reads,
+               (unsigned long long)stats.bytes, stats.hits, stats.misses);
     }
+    io_plan_free(metadata_plan);
+    metadata_plan = NULL;
     
     /* Update volume header if repairs were made */
     if (errors_corrected && (check_options & HFSCK_REPAIR)) {
@@ -290,6 +377,7 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
     }
     
     close(fd);
+    fsck_checkpoint_remove();
     
     /* Return appropriate exit code */
     if (!errors_found) {
@@ -297,7 +385,7 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
             printf("\n*** HFS+ volume check completed: no errors found\n");
         }
         return FSCK_OK;
-    } else if (errors_corrected && (check_options & HFSCK_REPAIR)) {
+    } else if (errors_corrected && !errors_uncorrected && (check_options & HFSCK_REPAIR)) {
         if (VERBOSE) {
             printf("\n*** HFS+ volume check completed: errors found and corrected\n");
         }
@@ -308,6 +396,249 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
         }
         return FSCK_UNCORRECTED;
     }
+    
+interrupted:
+    /* Everything up to here is in the checkpoint file */
+    io_plan_free(metadata_plan);
+    metadata_plan = NULL;
+    close(fd);
+    printf("Check interrupted; run again with --checkpoint=%s to resume\n",
+           fsck_checkpoint_path());
+    return FSCK_CANCELLED;
+}
+
+/*
+ * NAME:    volume_identity()
+ * DESCRIPTION: Read the volume header fields a checkpoint is matched
+ *              against.  They are read from disk at every save, so a
+ *              journal replay that rewrote the header is accounted for.
+ */
+static int volume_identity(int fd, fsck_volume_id_t *id)
+{
+    struct HFSPlus_VolumeHeader_Complete ondisk;
+    
+    if (pread(fd, &ondisk, sizeof(ondisk),
+              hfsplus_volume_start + 1024) != sizeof(ondisk)) {
+        return -1;
+    }
+    
+    id->createDate = be32toh(ondisk.createDate);
+    id->modifyDate = be32toh(ondisk.modifyDate);
+    id->writeCount = be32toh(ondisk.writeCount);
+    id->blockSize = be32toh(ondisk.blockSize);
+    id->totalBlocks = be32toh(ondisk.totalBlocks);
+    
+    return 0;
+}
+
+/*
+ * NAME:    save_checkpoint()
+ * DESCRIPTION: Record the progress made so far, with the working copy of
+ *              the volume header
+ */
+static void save_checkpoint(int fd, const struct HFSPlus_VolumeHeader_Complete *vh)
+{
+    if (!fsck_checkpoint_enabled() || volume_identity(fd, &checkpoint.volume) < 0) {
+        return;
+    }
+    
+    checkpoint.repair = REPAIR ? 1 : 0;
+    memcpy(checkpoint.volumeHeader, vh, sizeof(*vh));
+    fsck_checkpoint_save(&checkpoint);
+}
+
+/*
+ * NAME:    resume_checkpoint()
+ * DESCRIPTION: Load the checkpoint file and, if it was saved by the same
+ *              kind of run on this volume as it is now, take over its
+ *              finished phases, error state and volume header
+ */
+static void resume_checkpoint(int fd, struct HFSPlus_VolumeHeader_Complete *vh,
+                              int *errors_found, int *errors_corrected)
+{
+    fsck_volume_id_t id;
+    int loaded = fsck_checkpoint_load(&checkpoint);
+    
+    if (loaded < 0) {
+        printf("Checkpoint %s is unreadable; starting over\n", fsck_checkpoint_path());
+    }
+    if (loaded <= 0) {
+        return;
+    }
+    
+    if (volume_identity(fd, &id) < 0 ||
+        memcmp(&id, &checkpoint.volume, sizeof(id)) != 0 ||
+        checkpoint.repair != (REPAIR ? 1u : 0u)) {
+        printf("Checkpoint %s does not match this volume or mode; starting over\n",
+               fsck_checkpoint_path());
+        fsck_checkpoint_release(&checkpoint);
+        memset(&checkpoint, 0, sizeof(checkpoint));
+        return;
+    }
+    
+    memcpy(vh, checkpoint.volumeHeader, sizeof(*vh));
+    *errors_found = checkpoint.errorsFound != 0;
+    *errors_corrected = checkpoint.errorsCorrected != 0;
+    errors_uncorrected = checkpoint.errorsUncorrected != 0;
+    
+    if (VERBOSE) {
+        printf("Resuming from checkpoint %s\n", fsck_checkpoint_path());
+    }
+}
+
+/*
+ * NAME:    phase_skipped()
+ * DESCRIPTION: Tell whether a resumed check already finished a phase
+ */
+static int phase_skipped(fsck_phase_t phase)
+{
+    if (!(checkpoint.phasesDone & (1u << phase))) {
+        return 0;
+    }
+    
+    if (VERBOSE) {
+        printf("Already checked before the checkpoint\n");
+    }
+    return 1;
+}
+
+/*
+ * NAME:    phase_finished()
+ * DESCRIPTION: Record a finished phase; returns non-zero when the check
+ *              has been asked to stop
+ */
+static int phase_finished(int fd, const struct HFSPlus_VolumeHeader_Complete *vh,
+                          fsck_phase_t phase, int errors_found, int errors_corrected)
+{
+    if (!fsck_checkpoint_enabled()) {
+        return 0;
+    }
+    
+    /* Saving again would drop a walk position a later phase resumes from */
+    if (checkpoint.phasesDone & (1u << phase)) {
+        return fsck_checkpoint_stop_requested();
+    }
+    
+    checkpoint.phasesDone |= 1u << phase;
+    checkpoint.errorsFound = errors_found;
+    checkpoint.errorsCorrected = errors_corrected;
+    checkpoint.errorsUncorrected = errors_uncorrected;
+    save_checkpoint(fd, vh);
+    
+    return fsck_checkpoint_stop_requested();
+}
+
+/*
+ * NAME:    plan_fork_extents()
+ * DESCRIPTION: Queue the extents of a fork for preloading
+ */
+static void plan_fork_extents(io_plan_t *plan, const hfsplus_extent_t *extents,
+                              uint32_t count, uint32_t blockSize)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        io_plan_add(plan, hfsplus_volume_start + (uint64_t)extents[i].startBlock * blockSize,
+                    (uint64_t)extents[i].blockCount * blockSize);
+    }
+}
+
+/*
+ * NAME:    plan_hfsplus_metadata()
+ * DESCRIPTION: Preload the allocation file and the extents, catalog and
+ *              attributes B*-trees as found in the volume header, with
+ *              offset-ordered reads
+ */
+static io_plan_t *plan_hfsplus_metadata(int fd, const struct HFSPlus_VolumeHeader_Complete *vh)
+{
+    const struct HFSPlus_ForkData *forks[] = {
+        &vh->allocationFile, &vh->extentsFile, &vh->catalogFile, &vh->attributesFile
+    };
+    uint32_t blockSize = be32toh(vh->blockSize);
+    uint32_t totalBlocks = be32toh(vh->totalBlocks);
+    uint64_t bytes = 0;
+    io_plan_t *plan;
+    
+    /* Under --memory, metadata that does not fit is read as it is walked */
+    for (size_t f = 0; f < sizeof(forks) / sizeof(forks[0]); f++) {
+        bytes += (uint64_t)be32toh(forks[f]->totalBlocks) * blockSize;
+    }
+    if (fsck_extsort_memory_limited() && bytes > fsck_extsort_memory()) {
+        if (VERBOSE) {
+            printf("Metadata (%llu bytes) exceeds the memory limit, reading on demand\n",
+                   (unsigned long long)bytes);
+        }
+        return NULL;
+    }
+    
+    plan = io_plan_new(fd);
+    if (!plan) {
+        return NULL;
+    }
+    
+    for (size_t f = 0; f < sizeof(forks) / sizeof(forks[0]); f++) {
+        for (int i = 0; i < 8; i++) {
+            hfsplus_extent_t extent;
+            
+            memcpy(&extent, forks[f]->extents + i * 8, sizeof(extent));
+            extent.startBlock = be32toh(extent.startBlock);
+            extent.blockCount = be32toh(extent.blockCount);
+            
+            /* Bad extents are reported by the phases, not preloaded */
+            if (extent.blockCount == 0 ||
+                (uint64_t)extent.startBlock + extent.blockCount > totalBlocks) {
+                continue;
+            }
+            plan_fork_extents(plan, &extent, 1, blockSize);
+        }
+    }
+    
+    if (io_plan_load(plan) < 0 && VERBOSE) {
+        printf("Metadata preload incomplete, reading on demand\n");
+    }
+    
+    return plan;
+}
+
+/*
+ * NAME:    map_metadata_fork()
+ * DESCRIPTION: Map a special file's fork through the extents file and
+ *              serve it from the metadata plan, preloading any extents
+ *              that only the extents file records
+ */
+static int map_metadata_fork(int fd, const struct HFSPlus_VolumeHeader_Complete *vh,
+                             const struct HFSPlus_ForkData *forkData, uint32_t fileID,
+                             hfsplus_fork_t *fork)
+{
+    uint32_t blockSize = be32toh(vh->blockSize);
+    hfsplus_fork_t extentsFork;
+    int result;
+    
+    if (hfsplus_fork_map(fd, vh->extentsFile.extents,
+                         be32toh(vh->extentsFile.totalBlocks),
+                         be64toh(vh->extentsFile.logicalSize), blockSize,
+                         HFSPLUS_EXTENTS_FILE_ID, HFSPLUS_FORK_DATA,
+                         NULL, &extentsFork) < 0) {
+        extentsFork.count = 0;  /* The fork must then fit in its own extents */
+    }
+    extentsFork.plan = metadata_plan;
+    
+    result = hfsplus_fork_map(fd, forkData->extents, be32toh(forkData->totalBlocks),
+                              be64toh(forkData->logicalSize), blockSize,
+                              fileID, HFSPLUS_FORK_DATA,
+                              extentsFork.count ? &extentsFork : NULL, fork);
+    hfsplus_fork_free(&extentsFork);
+    
+    if (result < 0) {
+        return -1;
+    }
+    
+    /* Extents already in memory are not read again */
+    fork->plan = metadata_plan;
+    if (metadata_plan) {
+        plan_fork_extents(metadata_plan, fork->extents, fork->count, blockSize);
+        io_plan_load(metadata_plan);
+    }
+    
+    return 0;
 }
 
 /*
@@ -317,7 +648,6 @@ int hfsplus_check_volume(const char *device_path, int partition_number, int chec
 static int check_hfsplus_volume_header(int fd, struct HFSPlus_VolumeHeader_Complete *vh)
 {
     int errors_fixed = 0;
-    time_t now;
     uint32_t attributes;
     
     if (VERBOSE) {
@@ -534,7 +864,9 @@ static int check_hfsplus_journal(int fd, struct HFSPlus_VolumeHeader_Complete *v
                 return -1; /* Critical error */
             }
         } else if (replay_result > 0) {
-            if (VERBOSE) {
+            if (!repair_mode) {
+                printf("Journal has %d block lists to replay\n", replay_result);
+            } else if (VERBOSE) {
                 printf("Journal replay completed successfully\n");
             }
             errors_fixed++; /* Journal had transactions to replay */
@@ -552,6 +884,65 @@ static int check_hfsplus_journal(int fd, struct HFSPlus_VolumeHeader_Complete *v
     return errors_fixed;
 }
 
+/* What the catalog cross-check needs to save its position */
+struct catalog_walk {
+    int fd;
+    const struct HFSPlus_VolumeHeader_Complete *vh;
+    int problems;
+    uint32_t folders;
+    uint32_t files;
+};
+
+/*
+ * NAME:    checkpoint_catalog()
+ * DESCRIPTION: Save the next catalog leaf and the references sorted so far
+ *              when a checkpoint is due; stops the walk if asked to
+ */
+static int checkpoint_catalog(uint32_t next, const fsck_extsort_t *byID,
+                              const fsck_extsort_t *byParent, void *arg)
+{
+    struct catalog_walk *w = arg;
+    
+    if (!fsck_checkpoint_due()) {
+        return 0;
+    }
+    
+    checkpoint.catalogNode = next;
+    checkpoint.catalogProblems = w->problems;
+    checkpoint.catalogFolders = w->folders;
+    checkpoint.catalogFiles = w->files;
+    checkpoint.sorts[0] = byID;
+    checkpoint.sorts[1] = byParent;
+    save_checkpoint(w->fd, w->vh);
+    checkpoint.sorts[0] = checkpoint.sorts[1] = NULL;
+    
+    return fsck_checkpoint_stop_requested();
+}
+
+/*
+ * NAME:    resume_catalog()
+ * DESCRIPTION: Refill the catalog sorts from the checkpoint file
+ */
+static int resume_catalog(fsck_extsort_t *byID, fsck_extsort_t *byParent,
+                          uint32_t *next, void *arg)
+{
+    (void)arg;
+    
+    if (fsck_checkpoint_load_sort(&checkpoint, 0, byID) < 0 ||
+        fsck_checkpoint_load_sort(&checkpoint, 1, byParent) < 0) {
+        if (VERBOSE) {
+            printf("Saved catalog references are unreadable; cross-checking from the start\n");
+        }
+        return -1;
+    }
+    
+    *next = checkpoint.catalogNode;
+    if (VERBOSE) {
+        printf("Resuming catalog cross-check at leaf node %u\n", *next);
+    }
+    return 0;
+}
+
 /*
  * NAME:    check_hfsplus_catalog_unicode()
  * DESCRIPTION: Check HFS+ catalog file with Unicode support
@@ -587,35 +978,48 @@ static int check_hfsplus_catalog_unicode(int fd, struct HFSPlus_VolumeHeader_Com
     /* Set locale for Unicode processing */
     setlocale(LC_ALL, "");
     
-    /* Basic catalog file validation - simplified */
-    uint32_t startBlock = 0; /* Would need to parse extent data */
-    uint32_t blockCount = 1; /* Simplified for now */
+    /* Map the catalog fork, including any extents overflow records */
+    hfsplus_fork_t catalogFork;
+    hfsplus_btree_report_t report;
     
-    if (blockCount == 0) {
+    if (map_metadata_fork(fd, vh, &vh->catalogFile, HFSPLUS_CATALOG_FILE_ID,
+                          &catalogFork) < 0) {
         if (VERBOSE || !REPAIR) {
-            printf("Catalog file first extent is empty\n");
+            printf("Catalog file extents do not cover its %u blocks\n", catalogBlocks);
         }
         return -1; /* Critical error */
     }
     
-    /* Allocate buffer for catalog node */
-    uint8_t *nodeBuffer = malloc(blockSize);
-    if (!nodeBuffer) {
-        error_print("failed to allocate catalog node buffer");
-        return -1;
+    for (uint32_t i = 0; i < catalogFork.count; i++) {
+        uint64_t end = (uint64_t)catalogFork.extents[i].startBlock +
+                       catalogFork.extents[i].blockCount;
+        
+        if (end > be32toh(vh->totalBlocks)) {
+            if (VERBOSE || !REPAIR) {
+                printf("Catalog file extent %u extends beyond volume end\n", i);
+            }
+            hfsplus_fork_free(&catalogFork);
+            return -1; /* Critical error */
+        }
     }
     
-    /* Read first catalog node (header node) */
-    off_t nodeOffset = (off_t)startBlock * blockSize;
-    if (lseek(fd, nodeOffset, SEEK_SET) == -1) {
-        error_print("failed to seek to catalog header node");
-        free(nodeBuffer);
+    if (VERBOSE) {
+        printf("  Catalog extents: %u\n", catalogFork.count);
+    }
+    
+    /* Allocate buffer for catalog header node */
+    uint8_t *nodeBuffer = malloc(512);
+    if (!nodeBuffer) {
+        error_print("failed to allocate catalog node buffer");
+        hfsplus_fork_free(&catalogFork);
         return -1;
     }
     
-    if (read(fd, nodeBuffer, blockSize) != blockSize) {
+    /* Read the start of the header node, which holds the BTHeaderRec */
+    if (hfsplus_fork_read(fd, &catalogFork, 0, nodeBuffer, 512) < 0) {
         error_print("failed to read catalog header node");
         free(nodeBuffer);
+        hfsplus_fork_free(&catalogFork);
         return -1;
     }
     
@@ -656,17 +1060,20 @@ static int check_hfsplus_catalog_unicode(int fd, struct HFSPlus_VolumeHeader_Com
     uint16_t nodeSize = be16toh(btHeader->nodeSize);
     uint16_t nodeSize_fixed = 0;
     
-    if (nodeSize != blockSize) {
+    /* Catalog nodes are 512..32768 bytes, often larger than a block */
+    if (nodeSize < 512 || nodeSize > 32768 || (nodeSize & (nodeSize - 1)) != 0) {
+        uint16_t fallback = (blockSize > 32768) ? 32768 : blockSize;
+        
         if (VERBOSE || !REPAIR) {
-            printf("Catalog B-tree node size (%u) doesn't match block size (%u)\n",
-                   nodeSize, blockSize);
+            printf("Catalog B-tree node size (%u) is invalid\n", nodeSize);
         }
         if (REPAIR && (YES || ask("Fix B-tree node size"))) {
-            btHeader->nodeSize = htobe16(blockSize);
+            btHeader->nodeSize = htobe16(fallback);
+            nodeSize = fallback;
             nodeSize_fixed = 1;
             errors_fixed++;
             if (VERBOSE) {
-                printf("Fixed B-tree node size to %u\n", blockSize);
+                printf("Fixed B-tree node size to %u\n", fallback);
             }
         }
     }
@@ -677,6 +1084,7 @@ static int check_hfsplus_catalog_unicode(int fd, struct HFSPlus_VolumeHeader_Com
             printf("Catalog B-tree has zero nodes\n");
         }
         free(nodeBuffer);
+        hfsplus_fork_free(&catalogFork);
         return -1; /* Critical error */
     }
     
@@ -741,16 +1149,10 @@ static int check_hfsplus_catalog_unicode(int fd, struct HFSPlus_VolumeHeader_Com
             printf("Writing corrected B-tree header...\n");
         }
         
-        /* Seek back to header node */
-        if (lseek(fd, nodeOffset, SEEK_SET) == -1) {
-            error_print("failed to seek to catalog header for write");
-            free(nodeBuffer);
-            return -1;
-        }
-        
-        if (write(fd, nodeBuffer, blockSize) != blockSize) {
+        if (hfsplus_fork_write(fd, &catalogFork, 0, nodeBuffer, 512) < 0) {
             error_print("failed to write corrected catalog header");
             free(nodeBuffer);
+            hfsplus_fork_free(&catalogFork);
             return -1;
         }
         
@@ -764,47 +1166,130 @@ static int check_hfsplus_catalog_unicode(int fd, struct HFSPlus_VolumeHeader_Com
     uint32_t fileCount = be32toh(vh->fileCount);
     uint32_t folderCount = be32toh(vh->folderCount);
     
-    /* Basic consistency check */
-    if (leafRecords > 0 && (fileCount + folderCount) == 0) {
+    /* Basic consistency check; the root folder and its thread are not counted */
+    if (leafRecords > 2 && (fileCount + folderCount) == 0) {
         if (VERBOSE || !REPAIR) {
             printf("Catalog has records but volume header shows no files/folders\n");
         }
         errors_fixed++;
     }
     
-    /* Validate first leaf node for Unicode strings */
-    uint32_t firstLeaf = be32toh(btHeader->firstLeafNode);
-    if (firstLeaf > 0 && firstLeaf < totalNodes) {
-        /* Read first leaf node */
-        off_t leafOffset = nodeOffset + (off_t)firstLeaf * nodeSize;
-        if (lseek(fd, leafOffset, SEEK_SET) != -1) {
-            if (read(fd, nodeBuffer, nodeSize) == nodeSize) {
-                /* Parse node descriptor */
-                struct BTNodeDescriptor {
-                    uint32_t fLink;
-                    uint32_t bLink;
-                    int8_t kind;
-                    uint8_t height;
-                    uint16_t numRecords;
-                    uint16_t reserved;
-                } __attribute__((packed));
-                
-                struct BTNodeDescriptor *nodeDesc = (struct BTNodeDescriptor *)nodeBuffer;
-                uint16_t numRecords = be16toh(nodeDesc->numRecords);
-                
-                if (VERBOSE) {
-                    printf("  First leaf node has %u records\n", numRecords);
+    /* Verify every catalog node, then the tree they form */
+    free(nodeBuffer);
+    
+    /* A resumed cross-check was only started on a sound catalog */
+    int resuming = checkpoint.catalogNode != 0;
+    int problems = 0;
+    
+    if (resuming) {
+        memset(&report, 0, sizeof(report));
+        report.folders = checkpoint.catalogFolders;
+        report.files = checkpoint.catalogFiles;
+        errors_fixed = checkpoint.catalogProblems;
+        if (VERBOSE) {
+            printf("Catalog nodes already verified before the checkpoint\n");
+        }
+    } else {
+        problems = hfsplus_btree_check_catalog(fd, &catalogFork, &report);
+    }
+    
+    if (problems < 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("Catalog B-tree could not be verified\n");
+        }
+        hfsplus_fork_free(&catalogFork);
+        return -1;
+    }
+    
+    if (VERBOSE && !resuming) {
+        printf("  Checked %u of %u catalog nodes (%u index, %u leaf) with %u thread%s\n",
+               report.usedNodes, report.totalNodes, report.indexNodes,
+               report.leafNodes, report.threadsUsed,
+               report.threadsUsed == 1 ? "" : "s");
+        printf("  Leaf records: %u (%u folders, %u files, %u threads)\n",
+               report.leafRecords, report.folders, report.files, report.threads);
+    }
+    
+    if (problems > 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("Catalog B-tree has %d problems: %u bad nodes, %u bad keys, "
+                   "%u bad records, %u order, %u link, %u header, %u orphaned\n",
+                   problems, report.badNodes, report.badKeys, report.badRecords,
+                   report.orderErrors, report.linkErrors, report.headerErrors,
+                   report.orphanNodes);
+        }
+        /* Nodes are only checked here, never rewritten */
+        errors_fixed++;
+        errors_uncorrected = 1;
+    } else if (VERBOSE && !resuming) {
+        printf("Catalog records appear structurally valid\n");
+    }
+    
+    /* IDs, threads and parents, in bounded memory however big the catalog */
+    if (problems == 0) {
+        hfsplus_hierarchy_report_t hierarchy;
+        hfsplus_hierarchy_resume_t resume = { checkpoint_catalog, NULL, NULL };
+        struct catalog_walk walk = { fd, vh, errors_fixed, report.folders, report.files };
+        int crossProblems;
+        
+        resume.arg = &walk;
+        if (resuming) {
+            resume.load = resume_catalog;
+        }
+        crossProblems = hfsplus_check_hierarchy(fd, &catalogFork, be32toh(vh->nextCatalogID),
+                                                fsck_checkpoint_enabled() ? &resume : NULL,
+                                                &hierarchy);
+        checkpoint.catalogNode = 0;
+        if (crossProblems == HFSPLUS_HIERARCHY_STOPPED) {
+            /* Stopped on request; the position is in the checkpoint file */
+            walk_stopped = 1;
+            hfsplus_fork_free(&catalogFork);
+            return 0;
+        }
+        if (crossProblems < 0) {
+            if (VERBOSE || !REPAIR) {
+                printf("Catalog threads and parents could not be cross-checked\n");
+            }
+            errors_fixed++;
+            errors_uncorrected = 1;
+        } else {
+            if (VERBOSE) {
+                printf("  Cross-checked %llu folders, %llu files and %llu threads",
+                       (unsigned long long)hierarchy.folders,
+                       (unsigned long long)hierarchy.files,
+                       (unsigned long long)hierarchy.threads);
+                if (hierarchy.runs > 0) {
+                    printf(" (%u sort runs on disk)", hierarchy.runs);
                 }
-                
-                /* Basic catalog record validation - simplified */
-                if (VERBOSE) {
-                    printf("Catalog records appear structurally valid\n");
+                printf("\n");
+            }
+            if (crossProblems > 0) {
+                if (VERBOSE || !REPAIR) {
+                    printf("Catalog hierarchy has %d problems: %u duplicate IDs, "
+                           "%u bad IDs, %u missing threads, %u extra threads, "
+                           "%u orphaned threads, %u mismatched threads, "
+                           "%u bad parents, %u bad valences\n",
+                           crossProblems, hierarchy.duplicateIDs, hierarchy.badIDs,
+                           hierarchy.missingThreads, hierarchy.extraThreads,
+                           hierarchy.orphanThreads, hierarchy.threadMismatches,
+                           hierarchy.badParents, hierarchy.valenceErrors);
                 }
+                errors_fixed++;
+                errors_uncorrected = 1;
             }
         }
     }
+    hfsplus_fork_free(&catalogFork);
     
-    free(nodeBuffer);
+    /* The root folder is not included in the volume folder count */
+    if (problems == 0 && report.folders > 0 &&
+        (report.files != fileCount || report.folders - 1 != folderCount)) {
+        if (VERBOSE || !REPAIR) {
+            printf("Volume header counts %u files and %u folders, catalog has %u and %u\n",
+                   fileCount, folderCount, report.files, report.folders - 1);
+        }
+        errors_fixed++;
+    }
     
     if (VERBOSE && errors_fixed > 0) {
         printf("Fixed %d catalog Unicode issues\n", errors_fixed);
@@ -820,7 +1305,6 @@ static int check_hfsplus_catalog_unicode(int fd, struct HFSPlus_VolumeHeader_Com
 static int check_hfsplus_attributes_file(int fd, struct HFSPlus_VolumeHeader_Complete *vh)
 {
     int errors_fixed = 0;
-    uint32_t blockSize = be32toh(vh->blockSize);
     uint64_t attrSize = be64toh(vh->attributesFile.logicalSize);
     uint32_t attrBlocks = be32toh(vh->attributesFile.totalBlocks);
     
@@ -853,109 +1337,106 @@ static int check_hfsplus_attributes_file(int fd, struct HFSPlus_VolumeHeader_Com
         errors_fixed++;
     }
     
-    /* Basic attributes file extent validation - simplified */
-    uint32_t startBlock = 0; /* Would need to parse extent data */
-    uint32_t blockCount = 0; /* Simplified for now */
+    /* Map the attributes fork and check its extents */
+    hfsplus_fork_t attrFork;
+    uint32_t totalBlocks = be32toh(vh->totalBlocks);
     
-    if (attrBlocks > 0 && blockCount == 0) {
+    if (attrBlocks == 0) {
+        goto done;
+    }
+    
+    if (map_metadata_fork(fd, vh, &vh->attributesFile, HFSPLUS_ATTRIBUTES_FILE_ID,
+                          &attrFork) < 0) {
         if (VERBOSE || !REPAIR) {
-            printf("Attributes file has blocks but first extent is empty\n");
+            printf("Attributes file extents do not cover its %u blocks\n", attrBlocks);
         }
         errors_fixed++;
+        goto done;
     }
     
-    if (blockCount > 0) {
-        /* Validate extent bounds */
-        uint32_t totalBlocks = be32toh(vh->totalBlocks);
-        if (startBlock >= totalBlocks) {
+    for (uint32_t i = 0; i < attrFork.count; i++) {
+        if ((uint64_t)attrFork.extents[i].startBlock + attrFork.extents[i].blockCount > totalBlocks) {
             if (VERBOSE || !REPAIR) {
-                printf("Attributes file extent starts beyond volume end\n");
+                printf("Attributes file extent %u extends beyond volume end\n", i);
             }
             errors_fixed++;
+            hfsplus_fork_free(&attrFork);
+            goto done;
         }
+    }
+    
+    /* Read attributes file header */
+    uint8_t *nodeBuffer = malloc(512);
+    if (nodeBuffer && hfsplus_fork_read(fd, &attrFork, 0, nodeBuffer, 512) == 0) {
+        fsck_metrics_node(attrFork.extents[0].startBlock, 0);
         
-        if (startBlock + blockCount > totalBlocks) {
+        /* Parse B-tree header for attributes */
+        struct BTHeaderRec {
+            uint16_t treeDepth;
+            uint32_t rootNode;
+            uint32_t leafRecords;
+            uint32_t firstLeafNode;
+            uint32_t lastLeafNode;
+            uint16_t nodeSize;
+            uint16_t maxKeyLength;
+            uint32_t totalNodes;
+            uint32_t freeNodes;
+            uint16_t reserved1;
+            uint32_t clumpSize;
+            uint8_t btreeType;
+            uint8_t keyCompareType;
+            uint32_t attributes;
+            uint32_t reserved3[16];
+        } __attribute__((packed));
+        
+        struct BTHeaderRec *btHeader = (struct BTHeaderRec *)(nodeBuffer + 14);
+        
+        if (VERBOSE) {
+            printf("  Attributes B-tree depth: %u\n", be16toh(btHeader->treeDepth));
+            printf("  Attributes root node: %u\n", be32toh(btHeader->rootNode));
+            printf("  Attributes leaf records: %u\n", be32toh(btHeader->leafRecords));
+            printf("  Attributes node size: %u\n", be16toh(btHeader->nodeSize));
+            printf("  Attributes total nodes: %u\n", be32toh(btHeader->totalNodes));
+        }
+        
+        /* Validate attributes B-tree header; nodes are 512..32768 bytes */
+        uint16_t nodeSize = be16toh(btHeader->nodeSize);
+        if (nodeSize < 512 || nodeSize > 32768 || (nodeSize & (nodeSize - 1)) != 0) {
             if (VERBOSE || !REPAIR) {
-                printf("Attributes file extent extends beyond volume end\n");
+                printf("Attributes B-tree node size (%u) is invalid\n", nodeSize);
             }
             errors_fixed++;
         }
         
-        /* Read attributes file header if present */
-        uint8_t *nodeBuffer = malloc(blockSize);
-        if (nodeBuffer) {
-            off_t nodeOffset = (off_t)startBlock * blockSize;
-            if (lseek(fd, nodeOffset, SEEK_SET) != -1) {
-                if (read(fd, nodeBuffer, blockSize) == blockSize) {
-                    /* Parse B-tree header for attributes */
-                    struct BTHeaderRec {
-                        uint16_t treeDepth;
-                        uint32_t rootNode;
-                        uint32_t leafRecords;
-                        uint32_t firstLeafNode;
-                        uint32_t lastLeafNode;
-                        uint16_t nodeSize;
-                        uint16_t maxKeyLength;
-                        uint32_t totalNodes;
-                        uint32_t freeNodes;
-                        uint16_t reserved1;
-                        uint32_t clumpSize;
-                        uint8_t btreeType;
-                        uint8_t keyCompareType;
-                        uint32_t attributes;
-                        uint32_t reserved3[16];
-                    } __attribute__((packed));
-                    
-                    struct BTHeaderRec *btHeader = (struct BTHeaderRec *)(nodeBuffer + 14);
-                    
-                    if (VERBOSE) {
-                        printf("  Attributes B-tree depth: %u\n", be16toh(btHeader->treeDepth));
-                        printf("  Attributes root node: %u\n", be32toh(btHeader->rootNode));
-                        printf("  Attributes leaf records: %u\n", be32toh(btHeader->leafRecords));
-                        printf("  Attributes node size: %u\n", be16toh(btHeader->nodeSize));
-                        printf("  Attributes total nodes: %u\n", be32toh(btHeader->totalNodes));
-                    }
-                    
-                    /* Validate attributes B-tree header */
-                    uint16_t nodeSize = be16toh(btHeader->nodeSize);
-                    if (nodeSize != blockSize) {
-                        if (VERBOSE || !REPAIR) {
-                            printf("Attributes B-tree node size (%u) doesn't match block size (%u)\n",
-                                   nodeSize, blockSize);
-                        }
-                        errors_fixed++;
-                    }
-                    
-                    uint32_t totalNodes = be32toh(btHeader->totalNodes);
-                    if (totalNodes == 0 && be32toh(btHeader->leafRecords) > 0) {
-                        if (VERBOSE || !REPAIR) {
-                            printf("Attributes B-tree has records but zero nodes\n");
-                        }
-                        errors_fixed++;
-                    }
-                    
-                    /* Check for valid attribute records */
-                    uint32_t leafRecords = be32toh(btHeader->leafRecords);
-                    if (leafRecords > 0) {
-                        if (VERBOSE) {
-                            printf("Found %u extended attribute records\n", leafRecords);
-                        }
-                        
-                        /* Validate first leaf node for attribute keys */
-                        uint32_t firstLeaf = be32toh(btHeader->firstLeafNode);
-                        if (firstLeaf > 0 && firstLeaf < totalNodes) {
-                            /* Basic validation - could be expanded */
-                            if (VERBOSE) {
-                                printf("Attributes file structure appears valid\n");
-                            }
-                        }
-                    }
+        uint32_t totalNodes = be32toh(btHeader->totalNodes);
+        if (totalNodes == 0 && be32toh(btHeader->leafRecords) > 0) {
+            if (VERBOSE || !REPAIR) {
+                printf("Attributes B-tree has records but zero nodes\n");
+            }
+            errors_fixed++;
+        }
+        
+        /* Check for valid attribute records */
+        uint32_t leafRecords = be32toh(btHeader->leafRecords);
+        if (leafRecords > 0) {
+            if (VERBOSE) {
+                printf("Found %u extended attribute records\n", leafRecords);
+            }
+            
+            /* Validate first leaf node for attribute keys */
+            uint32_t firstLeaf = be32toh(btHeader->firstLeafNode);
+            if (firstLeaf > 0 && firstLeaf < totalNodes) {
+                /* Basic validation - could be expanded */
+                if (VERBOSE) {
+                    printf("Attributes file structure appears valid\n");
                 }
             }
-            free(nodeBuffer);
         }
     }
+    free(nodeBuffer);
+    hfsplus_fork_free(&attrFork);
     
+done:
     if (VERBOSE && errors_fixed > 0) {
         printf("Fixed %d attributes file issues\n", errors_fixed);
     }
@@ -963,52 +1444,455 @@ static int check_hfsplus_attributes_file(int fd, struct HFSPlus_VolumeHeader_Com
     return errors_fixed;
 }
 
+/* Attributes leaf record types that own allocation blocks */
+#define HFSPLUS_ATTR_FORK_DATA  0x20
+#define HFSPLUS_ATTR_EXTENTS    0x30
+
+/* Differing allocation runs listed before the rest are only counted */
+#define ALLOC_MAX_RUNS          20
+
+/* B-trees walked to rebuild the bitmap, in walk order */
+#define ALLOC_TREES             3
+
+/* State for marking extents found in the B-trees */
+struct alloc_marker {
+    alloc_bitmap_t bitmap;
+    uint32_t problems;
+    uint32_t tree;              /* Index of the tree being walked */
+    int fd;                     /* For checkpoints taken during the walk */
+    const struct HFSPlus_VolumeHeader_Complete *vh;
+};
+
 /*
- * NAME:    validate_unicode_string()
- * DESCRIPTION: Validate HFS+ Unicode string
+ * NAME:    mark_alloc_run()
+ * DESCRIPTION: Mark one extent in the expected bitmap, reporting runs that
+ *              are out of range or already claimed
  */
-static int validate_unicode_string(const struct HFSPlus_UniStr255 *str)
+static void mark_alloc_run(struct alloc_marker *m, uint32_t start, uint32_t count,
+                           uint32_t fileID)
 {
-    uint16_t length = be16toh(str->length);
+    uint32_t overlap;
     
-    /* Check length bounds */
-    if (length > 255) {
-        return -1; /* Invalid length */
+    if (count == 0) {
+        return;
     }
     
-    /* Check for valid Unicode characters */
-    for (int i = 0; i < length; i++) {
-        uint16_t unicode_char = be16toh(str->unicode[i]);
+    if (alloc_bitmap_mark(&m->bitmap, start, count, &overlap) < 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("Extent %u+%u of file %u extends beyond volume end\n",
+                   start, count, fileID);
+        }
+        m->problems++;
+    }
+    if (overlap > 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("Extent %u+%u of file %u shares %u blocks with another file\n",
+                   start, count, fileID, overlap);
+        }
+        m->problems++;
+    }
+}
+
+/*
+ * NAME:    mark_alloc_extents()
+ * DESCRIPTION: Mark the used entries of an on-disk 8-extent record
+ */
+static void mark_alloc_extents(struct alloc_marker *m, const uint8_t *extrec,
+                               uint32_t fileID)
+{
+    for (int i = 0; i < 8; i++) {
+        hfsplus_extent_t extent;
         
-        /* Check for invalid Unicode code points */
-        if (unicode_char == 0x0000 && i < length - 1) {
-            return -1; /* Null character in middle of string */
+        memcpy(&extent, extrec + 8 * i, sizeof(extent));
+        if (extent.blockCount == 0) {
+            break;
         }
+        mark_alloc_run(m, be32toh(extent.startBlock), be32toh(extent.blockCount), fileID);
+    }
+}
+
+/*
+ * NAME:    mark_catalog_record()
+ * DESCRIPTION: Mark both forks of a catalog file record
+ */
+static int mark_catalog_record(const uint8_t *record, uint16_t length, void *arg)
+{
+    uint16_t keyLength;
+    const uint8_t *data;
+    
+    memcpy(&keyLength, record, 2);
+    keyLength = be16toh(keyLength);
+    if (2 + keyLength + 248 > length) {
+        return 0;
+    }
+    
+    /* HFSPlusCatalogFile: fileID at 8, data fork at 88, resource fork at 168 */
+    data = record + 2 + keyLength;
+    if (data[0] == 0 && data[1] == 2) {
+        uint32_t fileID;
         
-        /* Check for surrogate pairs (basic validation) */
-        if (unicode_char >= 0xD800 && unicode_char <= 0xDFFF) {
-            /* This is a surrogate - should be paired */
-            if (i + 1 >= length) {
-                return -1; /* Unpaired surrogate at end */
-            }
+        memcpy(&fileID, data + 8, 4);
+        mark_alloc_extents(arg, data + 88 + 16, be32toh(fileID));
+        mark_alloc_extents(arg, data + 168 + 16, be32toh(fileID));
+    }
+    
+    return 0;
+}
+
+/*
+ * NAME:    mark_extents_record()
+ * DESCRIPTION: Mark an extents overflow record
+ */
+static int mark_extents_record(const uint8_t *record, uint16_t length, void *arg)
+{
+    uint32_t fileID;
+    
+    /* Key: length (10), fork type, pad, file ID, start block */
+    if (length < 12 + 64 || record[0] != 0 || record[1] != 10) {
+        return 0;
+    }
+    
+    memcpy(&fileID, record + 4, 4);
+    mark_alloc_extents(arg, record + 12, be32toh(fileID));
+    
+    return 0;
+}
+
+/*
+ * NAME:    mark_attributes_record()
+ * DESCRIPTION: Mark the extents of a fork-backed extended attribute
+ */
+static int mark_attributes_record(const uint8_t *record, uint16_t length, void *arg)
+{
+    uint16_t keyLength;
+    uint32_t recordType, fileID;
+    const uint8_t *data;
+    
+    memcpy(&keyLength, record, 2);
+    keyLength = be16toh(keyLength);
+    if (2 + keyLength + 8 + 64 > length || keyLength < 12) {
+        return 0;
+    }
+    
+    memcpy(&fileID, record + 4, 4);
+    fileID = be32toh(fileID);
+    data = record + 2 + keyLength;
+    memcpy(&recordType, data, 4);
+    
+    switch (be32toh(recordType)) {
+    case HFSPLUS_ATTR_FORK_DATA:
+        /* recordType, reserved, HFSPlusForkData */
+        if (2 + keyLength + 8 + 80 <= length) {
+            mark_alloc_extents(arg, data + 8 + 16, fileID);
+        }
+        break;
+    case HFSPLUS_ATTR_EXTENTS:
+        mark_alloc_extents(arg, data + 8, fileID);
+        break;
+    }
+    
+    return 0;
+}
+
+/*
+ * NAME:    checkpoint_leaf()
+ * DESCRIPTION: Save the walk position and the bitmap built so far when a
+ *              checkpoint is due; stops the walk if asked to
+ */
+static int checkpoint_leaf(uint32_t next, void *arg)
+{
+    struct alloc_marker *m = arg;
+    
+    if (!fsck_checkpoint_due()) {
+        return 0;
+    }
+    
+    /* After the last leaf, resume at the start of the next tree */
+    checkpoint.walkTree = next ? m->tree : m->tree + 1;
+    checkpoint.walkNode = next;
+    checkpoint.walkProblems = m->problems;
+    checkpoint.bitmap = m->bitmap.bits;
+    checkpoint.bitmapBytes = m->bitmap.nbytes;
+    save_checkpoint(m->fd, m->vh);
+    checkpoint.bitmap = NULL;
+    
+    return fsck_checkpoint_stop_requested();
+}
+
+/*
+ * NAME:    mark_tree_records()
+ * DESCRIPTION: Map a special B-tree file and mark what its leaves own,
+ *              starting at leaf node start (0 for the first leaf)
+ */
+static int mark_tree_records(int fd, struct HFSPlus_VolumeHeader_Complete *vh,
+                             const struct HFSPlus_ForkData *forkData, uint32_t fileID,
+                             fsck_phase_t phase, hfsplus_leaf_fn fn, uint32_t start,
+                             struct alloc_marker *m)
+{
+    hfsplus_fork_t fork;
+    int result = -1;
+    
+    if (be32toh(forkData->totalBlocks) == 0) {
+        return 0;
+    }
+    
+    /* The walk is credited to the tree's own phase in --metrics */
+    fsck_metrics_begin(phase);
+    if (map_metadata_fork(fd, vh, forkData, fileID, &fork) == 0) {
+        result = hfsplus_btree_leaves(fd, &fork, start, fn,
+                                      fsck_checkpoint_enabled() ? checkpoint_leaf : NULL, m);
+        hfsplus_fork_free(&fork);
+    }
+    fsck_metrics_end(phase, 0);
+    
+    return result;
+}
+
+/*
+ * NAME:    mark_fixed_areas()
+ * DESCRIPTION: Mark what is in use regardless of the B-trees: the reserved
+ *              areas, the special files and the journal
+ */
+static void mark_fixed_areas(int fd, const struct HFSPlus_VolumeHeader_Complete *vh,
+                             struct alloc_marker *m)
+{
+    uint32_t blockSize = be32toh(vh->blockSize);
+    uint32_t totalBlocks = be32toh(vh->totalBlocks);
+    uint32_t first, last;
+    
+    /* Boot blocks and volume header, and the alternate header at the end */
+    last = (1024 + 512 + blockSize - 1) / blockSize;
+    mark_alloc_run(m, 0, last, 0);
+    first = (uint32_t)(((uint64_t)totalBlocks * blockSize - 1024) / blockSize);
+    mark_alloc_run(m, first, totalBlocks - first, 0);
+    
+    /* Special files: the first eight extents; the rest are overflow records */
+    mark_alloc_extents(m, vh->allocationFile.extents, HFSPLUS_ALLOCATION_FILE_ID);
+    mark_alloc_extents(m, vh->extentsFile.extents, HFSPLUS_EXTENTS_FILE_ID);
+    mark_alloc_extents(m, vh->catalogFile.extents, HFSPLUS_CATALOG_FILE_ID);
+    mark_alloc_extents(m, vh->attributesFile.extents, HFSPLUS_ATTRIBUTES_FILE_ID);
+    mark_alloc_extents(m, vh->startupFile.extents, HFSPLUS_STARTUP_FILE_ID);
+    
+    /* Journal info block and the journal it describes */
+    if ((be32toh(vh->attributes) & HFSPLUS_JOURNALED) && vh->journalInfoBlock) {
+        struct HFSPlus_JournalInfoBlock jib;
+        uint32_t jibBlock = be32toh(vh->journalInfoBlock);
+        
+        mark_alloc_run(m, jibBlock, 1, 0);
+        if (jibBlock < totalBlocks &&
+            io_plan_read(metadata_plan, fd,
+                         hfsplus_volume_start + (uint64_t)jibBlock * blockSize,
+                         &jib, sizeof(jib)) == 0 &&
+            (be32toh(jib.flags) & JOURNAL_IN_FS)) {
+            uint64_t offset = be64toh(jib.offset);
+            uint64_t size = be64toh(jib.size);
             
-            uint16_t next_char = be16toh(str->unicode[i + 1]);
-            if (unicode_char >= 0xD800 && unicode_char <= 0xDBFF) {
-                /* High surrogate */
-                if (next_char < 0xDC00 || next_char > 0xDFFF) {
-                    return -1; /* Invalid low surrogate */
-                }
-                i++; /* Skip the low surrogate */
-            } else {
-                return -1; /* Invalid surrogate sequence */
+            if (size > 0 && offset % blockSize == 0 &&
+                offset / blockSize < totalBlocks) {
+                mark_alloc_run(m, (uint32_t)(offset / blockSize),
+                               (uint32_t)((size + blockSize - 1) / blockSize), 0);
             }
         }
     }
-    
-    return 0; /* Valid Unicode string */
 }
 
+/*
+ * NAME:    report_alloc_run()
+ * DESCRIPTION: Describe one run where the allocation file disagrees with
+ *              the extents that own blocks
+ */
+static void report_alloc_run(int leaked, uint32_t start, uint32_t count, void *arg)
+{
+    unsigned int *listed = arg;
+    
+    if (!(VERBOSE || !REPAIR) || (*listed)++ >= ALLOC_MAX_RUNS) {
+        return;
+    }
+    
+    if (leaked) {
+        printf("Allocation blocks %u-%u are marked in use but belong to no file\n",
+               start, start + count - 1);
+    } else {
+        printf("Allocation blocks %u-%u are in use but marked free\n",
+               start, start + count - 1);
+    }
+}
 
+/*
+ * NAME:    check_hfsplus_allocation_file()
+ * DESCRIPTION: Rebuild the allocation bitmap from the reserved areas, the
+ *              special files, the journal and every extent recorded in the
+ *              catalog, extents and attributes B-trees, then compare it
+ *              with the allocation file; repair rewrites only the blocks
+ *              of the allocation file that differ
+ */
+static int check_hfsplus_allocation_file(int fd, struct HFSPlus_VolumeHeader_Complete *vh)
+{
+    int errors_fixed = 0;
+    uint32_t blockSize = be32toh(vh->blockSize);
+    uint32_t totalBlocks = be32toh(vh->totalBlocks);
+    uint32_t freeBlocks = be32toh(vh->freeBlocks);
+    struct alloc_marker m = { { NULL, 0, 0 }, 0, 0, fd, vh };
+    const struct {
+        const struct HFSPlus_ForkData *forkData;
+        uint32_t fileID;
+        fsck_phase_t phase;
+        hfsplus_leaf_fn fn;
+    } trees[ALLOC_TREES] = {
+        { &vh->extentsFile, HFSPLUS_EXTENTS_FILE_ID, FSCK_PHASE_EXTENTS, mark_extents_record },
+        { &vh->catalogFile, HFSPLUS_CATALOG_FILE_ID, FSCK_PHASE_CATALOG, mark_catalog_record },
+        { &vh->attributesFile, HFSPLUS_ATTRIBUTES_FILE_ID, FSCK_PHASE_ATTRIBUTES,
+          mark_attributes_record }
+    };
+    uint32_t start = 0;
+    int walked = 0;
+    hfsplus_fork_t allocFork;
+    alloc_bitmap_diff_t diff;
+    unsigned int listed = 0;
+    uint8_t *ondisk = NULL;
+    
+    if (VERBOSE) {
+        printf("*** Checking HFS+ Allocation File\n");
+    }
+    
+    if (blockSize < 512 || totalBlocks == 0 || alloc_bitmap_init(&m.bitmap, totalBlocks) < 0) {
+        return -1;
+    }
+    
+    /* Pick up a walk an interrupted run saved, or start with the fixed areas */
+    if (checkpoint.bitmap && checkpoint.bitmapBytes == m.bitmap.nbytes &&
+        checkpoint.walkTree <= ALLOC_TREES) {
+        memcpy(m.bitmap.bits, checkpoint.bitmap, m.bitmap.nbytes);
+        m.problems = checkpoint.walkProblems;
+        m.tree = checkpoint.walkTree;
+        start = checkpoint.walkNode;
+        if (VERBOSE) {
+            printf("Resuming bitmap rebuild at B-tree %u, leaf node %u\n", m.tree, start);
+        }
+    } else {
+        mark_fixed_areas(fd, vh, &m);
+    }
+    fsck_checkpoint_release(&checkpoint);
+    
+    /* Everything the B-trees say is owned */
+    for (; m.tree < ALLOC_TREES; m.tree++, start = 0) {
+        walked = mark_tree_records(fd, vh, trees[m.tree].forkData, trees[m.tree].fileID,
+                                   trees[m.tree].phase, trees[m.tree].fn, start, &m);
+        if (walked != 0) {
+            break;
+        }
+    }
+    if (walked > 0) {
+        /* Stopped on request; the position is in the checkpoint file */
+        walk_stopped = 1;
+        alloc_bitmap_free(&m.bitmap);
+        return 0;
+    }
+    if (walked < 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("Cannot walk the B-trees; allocation file not checked\n");
+        }
+        alloc_bitmap_free(&m.bitmap);
+        return -1;
+    }
+    errors_fixed += m.problems;
+    
+    /* Read the allocation file itself */
+    if (map_metadata_fork(fd, vh, &vh->allocationFile, HFSPLUS_ALLOCATION_FILE_ID,
+                          &allocFork) < 0 ||
+        allocFork.logicalSize < m.bitmap.nbytes) {
+        if (VERBOSE || !REPAIR) {
+            printf("Allocation file does not cover %u blocks\n", totalBlocks);
+        }
+        hfsplus_fork_free(&allocFork);
+        alloc_bitmap_free(&m.bitmap);
+        return -1;
+    }
+    
+    ondisk = malloc(m.bitmap.nbytes);
+    if (!ondisk ||
+        hfsplus_fork_read(fd, &allocFork, 0, ondisk, m.bitmap.nbytes) < 0) {
+        error_print("failed to read allocation file");
+        free(ondisk);
+        hfsplus_fork_free(&allocFork);
+        alloc_bitmap_free(&m.bitmap);
+        return -1;
+    }
+    
+    /* Word-by-word comparison */
+    alloc_bitmap_compare(&m.bitmap, ondisk, report_alloc_run, &listed, &diff);
+    
+    if (listed > ALLOC_MAX_RUNS && (VERBOSE || !REPAIR)) {
+        printf("(%u more differing runs not listed)\n", listed - ALLOC_MAX_RUNS);
+    }
+    if (diff.leaked > 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("%u allocation blocks in %u runs are leaked\n",
+                   diff.leaked, diff.leakedRuns);
+        }
+        errors_fixed++;
+    }
+    if (diff.missing > 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("%u allocation blocks in %u runs are in use but marked free\n",
+                   diff.missing, diff.missingRuns);
+        }
+        errors_fixed++;
+    }
+    if (freeBlocks != totalBlocks - diff.used) {
+        if (VERBOSE || !REPAIR) {
+            printf("Free block count mismatch: reported %u, actual %u\n",
+                   freeBlocks, totalBlocks - diff.used);
+        }
+        errors_fixed++;
+    }
+    
+    if (VERBOSE) {
+        printf("  Blocks in use: %u of %u\n", diff.used, totalBlocks);
+    }
+    
+    /* Rewrite only the allocation file blocks that differ */
+    if (errors_fixed > 0 && REPAIR && (YES || ask("Rebuild allocation file"))) {
+        uint32_t written = 0, chunks = 0;
+        
+        for (size_t offset = 0; offset < m.bitmap.nbytes; offset += blockSize) {
+            size_t len = m.bitmap.nbytes - offset;
+            
+            if (len > blockSize) {
+                len = blockSize;
+            }
+            chunks++;
+            
+            if (memcmp(m.bitmap.bits + offset, ondisk + offset, len) == 0) {
+                continue;
+            }
+            if (hfsplus_fork_write(fd, &allocFork, offset,
+                                   m.bitmap.bits + offset, len) < 0) {
+                error_print("failed to write allocation file");
+                errors_fixed = -1;
+                break;
+            }
+            written++;
+        }
+        
+        if (errors_fixed > 0) {
+            vh->freeBlocks = htobe32(totalBlocks - diff.used);
+            if (VERBOSE) {
+                printf("Rewrote %u of %u allocation file blocks\n", written, chunks);
+            }
+        }
+    }
+    
+    free(ondisk);
+    hfsplus_fork_free(&allocFork);
+    alloc_bitmap_free(&m.bitmap);
+    
+    if (VERBOSE && errors_fixed > 0) {
+        printf("Fixed %d allocation file issues\n", errors_fixed);
+    }
+    
+    return errors_fixed;
+}
 
 /*
  * NAME:    repair_hfsplus_volume_header()
@@ -1022,7 +1906,7 @@ static int repair_hfsplus_volume_header(int fd, struct HFSPlus_VolumeHeader_Comp
     vh->checkedDate = htobe32(hfs_now);
     
     /* Write primary volume header */
-    if (lseek(fd, 1024, SEEK_SET) == -1) {
+    if (lseek(fd, hfsplus_volume_start + 1024, SEEK_SET) == -1) {
         error_print("failed to seek to primary volume header");
         return -1;
     }
@@ -1032,12 +1916,12 @@ static int repair_hfsplus_volume_header(int fd, struct HFSPlus_VolumeHeader_Comp
         return -1;
     }
     
-    /* Write backup volume header */
+    /* Write backup volume header, 1024 bytes before the end of the volume */
     uint32_t totalBlocks = be32toh(vh->totalBlocks);
     uint32_t blockSize = be32toh(vh->blockSize);
-    off_t backupOffset = (off_t)(totalBlocks - 2) * blockSize + 1024;
+    off_t backupOffset = (off_t)totalBlocks * blockSize - 1024;
     
-    if (lseek(fd, backupOffset, SEEK_SET) == -1) {
+    if (lseek(fd, hfsplus_volume_start + backupOffset, SEEK_SET) == -1) {
         error_print("failed to seek to backup volume header");
         return -1;
     }
@@ -0,0 +1,532 @@
+/*
+ * hfsplus_hierarchy.c - HFS+ catalog ID, thread and parent cross-checks
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * The catalog is keyed by parent ID and name, so the thread of a file or
+ * folder and its parent folder can be anywhere else in the tree.  Rather
+ * than hold the whole catalog in memory, one pass over the leaf records
+ * feeds two external sorts of 16-byte references:
+ *
+ *   by ID:     every file, folder and thread record, keyed by the ID it
+ *              describes, with its parent ID and a hash of its name
+ *   by parent: every file and folder keyed by its parent ID, and every
+ *              folder keyed by its own ID together with its valence
+ *
+ * Reading each sort back in order brings together all the records about
+ * one ID, or one folder and all its items, so each group can be checked
+ * on its own and forgotten.
+ */
+
+#include "fsck_common.h"
+#include "../embedded/fsck/fsck_hfs.h"
+#include "journal.h"  /* For VERBOSE and REPAIR */
+#include "hfsplus_hierarchy.h"
+#include "fsck_extsort.h"
+
+/* Catalog leaf record types and their minimum sizes */
+#define CATALOG_FOLDER          1
+#define CATALOG_FILE            2
+#define CATALOG_FOLDER_THREAD   3
+#define CATALOG_FILE_THREAD     4
+#define CATALOG_FOLDER_SIZE     88
+#define CATALOG_FILE_SIZE       248
+#define CATALOG_THREAD_SIZE     10
+
+/* Reserved catalog node IDs */
+#define ROOT_PARENT_ID          1
+#define ROOT_FOLDER_ID          2
+#define FIRST_USER_ID           16
+
+/* Reference kinds, in the order they sort within one key */
+enum {
+    REF_FOLDER = 0,             /* By ID: a = parent, b = name hash */
+    REF_FILE,
+    REF_FOLDER_THREAD,
+    REF_FILE_THREAD
+};
+enum {
+    REF_PARENT = 0,             /* By parent: a = valence */
+    REF_CHILD                   /* By parent: a = item ID */
+};
+
+/* One sorted reference */
+struct ref {
+    uint32_t key;
+    uint32_t kind;
+    uint32_t a;
+    uint32_t b;
+};
+
+/* Everything the ID sort holds about one ID */
+struct id_group {
+    uint32_t id;
+    unsigned int items;         /* File and folder records */
+    unsigned int threads;
+    struct ref item;            /* The first of each */
+    struct ref thread;
+};
+
+/* State of the leaf pass */
+struct feeder {
+    fsck_extsort_t *byID;
+    fsck_extsort_t *byParent;
+    const hfsplus_hierarchy_resume_t *resume;
+    int failed;
+};
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * NAME:    compare_refs()
+ * DESCRIPTION: Order references by key, kind and first value
+ */
+static int compare_refs(const void *pa, const void *pb)
+{
+    const struct ref *a = pa, *b = pb;
+
+    if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+    if (a->kind != b->kind) {
+        return a->kind < b->kind ? -1 : 1;
+    }
+    if (a->a != b->a) {
+        return a->a < b->a ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * NAME:    name_hash()
+ * DESCRIPTION: FNV-1a over an on-disk HFSUniStr255, length included
+ */
+static uint32_t name_hash(const uint8_t *name)
+{
+    size_t len = 2 + 2 * (size_t)get16(name);
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h = (h ^ *name++) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * NAME:    add_ref()
+ * DESCRIPTION: Add one reference to a sort
+ */
+static void add_ref(struct feeder *f, fsck_extsort_t *s,
+                    uint32_t key, uint32_t kind, uint32_t a, uint32_t b)
+{
+    struct ref r;
+
+    r.key = key;
+    r.kind = kind;
+    r.a = a;
+    r.b = b;
+    if (fsck_extsort_add(s, &r) < 0) {
+        f->failed = 1;
+    }
+}
+
+/*
+ * NAME:    feed_record()
+ * DESCRIPTION: Turn one catalog leaf record into references
+ */
+static int feed_record(const uint8_t *record, uint16_t length, void *arg)
+{
+    struct feeder *f = arg;
+    uint16_t keyLength, dataLength, type;
+    uint32_t parentID, id;
+    const uint8_t *data;
+
+    /* Key: length, parent ID, name; the B-tree check vouches for the rest */
+    keyLength = get16(record);
+    if (keyLength < 6 || 2 + (uint32_t)keyLength + 2 > length ||
+        2 * (uint32_t)get16(record + 6) + 6 > keyLength) {
+        return 0;
+    }
+    parentID = get32(record + 2);
+    data = record + 2 + keyLength;
+    dataLength = length - 2 - keyLength;
+    type = get16(data);
+
+    switch (type) {
+    case CATALOG_FOLDER:
+        if (dataLength < CATALOG_FOLDER_SIZE) {
+            break;
+        }
+        id = get32(data + 8);
+        add_ref(f, f->byID, id, REF_FOLDER, parentID, name_hash(record + 6));
+        add_ref(f, f->byParent, id, REF_PARENT, get32(data + 4), 0);
+        add_ref(f, f->byParent, parentID, REF_CHILD, id, 0);
+        break;
+
+    case CATALOG_FILE:
+        if (dataLength < CATALOG_FILE_SIZE) {
+            break;
+        }
+        id = get32(data + 8);
+        add_ref(f, f->byID, id, REF_FILE, parentID, name_hash(record + 6));
+        add_ref(f, f->byParent, parentID, REF_CHILD, id, 0);
+        break;
+
+    case CATALOG_FOLDER_THREAD:
+    case CATALOG_FILE_THREAD:
+        /* The key holds the ID; the record, its parent and name */
+        if (dataLength < CATALOG_THREAD_SIZE ||
+            2 * (uint32_t)get16(data + 8) + CATALOG_THREAD_SIZE > dataLength) {
+            break;
+        }
+        add_ref(f, f->byID, parentID,
+                type == CATALOG_FOLDER_THREAD ? REF_FOLDER_THREAD : REF_FILE_THREAD,
+                get32(data + 4), name_hash(data + 8));
+        break;
+    }
+
+    return f->failed;
+}
+
+/*
+ * NAME:    check_id()
+ * DESCRIPTION: Check everything recorded about one catalog node ID
+ */
+static int check_id(const struct id_group *g, uint32_t nextCatalogID,
+                    hfsplus_hierarchy_report_t *report)
+{
+    const char *what;
+    int problems = 0;
+
+    if (g->items == 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("Thread record for catalog node %u, which does not exist\n", g->id);
+        }
+        report->orphanThreads++;
+        return 1;
+    }
+
+    what = g->item.kind == REF_FOLDER ? "Folder" : "File";
+
+    if (g->items > 1) {
+        if (VERBOSE || !REPAIR) {
+            printf("Catalog node ID %u is used by %u files and folders\n",
+                   g->id, g->items);
+        }
+        report->duplicateIDs++;
+        problems++;
+    }
+
+    if (g->id == ROOT_FOLDER_ID) {
+        if (g->item.kind != REF_FOLDER || g->item.a != ROOT_PARENT_ID) {
+            if (VERBOSE || !REPAIR) {
+                printf("Catalog node ID %u is not the root folder\n", g->id);
+            }
+            report->badIDs++;
+            problems++;
+        }
+    } else if (g->id < FIRST_USER_ID) {
+        if (VERBOSE || !REPAIR) {
+            printf("%s has reserved catalog node ID %u\n", what, g->id);
+        }
+        report->badIDs++;
+        problems++;
+    } else if (nextCatalogID != 0 && g->id >= nextCatalogID) {
+        if (VERBOSE || !REPAIR) {
+            printf("%s %u is not below the next catalog ID %u\n",
+                   what, g->id, nextCatalogID);
+        }
+        report->badIDs++;
+        problems++;
+    }
+
+    if (g->threads == 0) {
+        if (VERBOSE || !REPAIR) {
+            printf("%s %u has no thread record\n", what, g->id);
+        }
+        report->missingThreads++;
+        return problems + 1;
+    }
+    if (g->threads > 1) {
+        if (VERBOSE || !REPAIR) {
+            printf("%s %u has %u thread records\n", what, g->id, g->threads);
+        }
+        report->extraThreads++;
+        problems++;
+    }
+
+    if ((g->item.kind == REF_FOLDER) != (g->thread.kind == REF_FOLDER_THREAD)) {
+        if (VERBOSE || !REPAIR) {
+            printf("%s %u has a %s thread record\n", what, g->id,
+                   g->thread.kind == REF_FOLDER_THREAD ? "folder" : "file");
+        }
+        report->threadMismatches++;
+        problems++;
+    } else if (g->thread.a != g->item.a || g->thread.b != g->item.b) {
+        if (VERBOSE || !REPAIR) {
+            printf("Thread record of %s %u does not match its parent %u and name\n",
+                   g->item.kind == REF_FOLDER ? "folder" : "file", g->id, g->item.a);
+        }
+        report->threadMismatches++;
+        problems++;
+    }
+
+    return problems;
+}
+
+/*
+ * NAME:    check_folder()
+ * DESCRIPTION: Check one parent ID against the items that name it
+ */
+static int check_folder(uint32_t parentID, int isFolder, uint32_t valence,
+                        uint64_t children, uint32_t firstChild,
+                        hfsplus_hierarchy_report_t *report)
+{
+    if (parentID == ROOT_PARENT_ID) {
+        /* Only the root folder lives here */
+        if (children != 1 || firstChild != ROOT_FOLDER_ID) {
+            if (VERBOSE || !REPAIR) {
+                printf("Catalog has %llu items above the root folder\n",
+                       (unsigned long long)(firstChild == ROOT_FOLDER_ID ?
+                                            children - 1 : children));
+            }
+            report->badParents++;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!isFolder) {
+        if (VERBOSE || !REPAIR) {
+            printf("%llu item%s in folder %u, which does not exist\n",
+                   (unsigned long long)children, children == 1 ? " is" : "s are",
+                   parentID);
+        }
+        report->badParents++;
+        return 1;
+    }
+
+    if (children != valence) {
+        if (VERBOSE || !REPAIR) {
+            printf("Folder %u has valence %u but holds %llu item%s\n",
+                   parentID, valence, (unsigned long long)children,
+                   children == 1 ? "" : "s");
+        }
+        report->valenceErrors++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * NAME:    merge_by_id()
+ * DESCRIPTION: Read the ID sort back one ID at a time
+ */
+static int merge_by_id(fsck_extsort_t *s, uint32_t nextCatalogID,
+                       hfsplus_hierarchy_report_t *report)
+{
+    struct id_group g;
+    struct ref r;
+    int problems = 0, rootSeen = 0, pending = 0, got;
+
+    while ((got = fsck_extsort_next(s, &r)) > 0) {
+        if (pending && r.key != g.id) {
+            problems += check_id(&g, nextCatalogID, report);
+            pending = 0;
+        }
+        if (!pending) {
+            memset(&g, 0, sizeof(g));
+            g.id = r.key;
+            pending = 1;
+            if (r.key == ROOT_FOLDER_ID) {
+                rootSeen = 1;
+            }
+        }
+
+        /* Only the first item and thread of an ID are compared */
+        if (r.kind == REF_FOLDER || r.kind == REF_FILE) {
+            if (g.items++ == 0) {
+                g.item = r;
+            }
+            if (r.kind == REF_FOLDER) {
+                report->folders++;
+            } else {
+                report->files++;
+            }
+        } else {
+            if (g.threads++ == 0) {
+                g.thread = r;
+            }
+            report->threads++;
+        }
+    }
+    if (got < 0) {
+        return -1;
+    }
+    if (pending) {
+        problems += check_id(&g, nextCatalogID, report);
+    }
+
+    if (!rootSeen) {
+        if (VERBOSE || !REPAIR) {
+            printf("Catalog has no root folder\n");
+        }
+        report->badIDs++;
+        problems++;
+    }
+
+    return problems;
+}
+
+/*
+ * NAME:    merge_by_parent()
+ * DESCRIPTION: Read the parent sort back one folder at a time
+ */
+static int merge_by_parent(fsck_extsort_t *s, hfsplus_hierarchy_report_t *report)
+{
+    struct ref r;
+    uint32_t parentID = 0, valence = 0, firstChild = 0;
+    uint64_t children = 0;
+    int problems = 0, isFolder = 0, pending = 0, got;
+
+    while ((got = fsck_extsort_next(s, &r)) > 0) {
+        if (pending && r.key != parentID) {
+            problems += check_folder(parentID, isFolder, valence, children,
+                                     firstChild, report);
+            pending = 0;
+        }
+        if (!pending) {
+            parentID = r.key;
+            isFolder = 0;
+            valence = 0;
+            children = 0;
+            pending = 1;
+        }
+
+        if (r.kind == REF_PARENT) {
+            /* Duplicate folder IDs have been reported already */
+            if (!isFolder) {
+                isFolder = 1;
+                valence = r.a;
+            }
+        } else if (children++ == 0) {
+            firstChild = r.a;
+        }
+    }
+    if (got < 0) {
+        return -1;
+    }
+
+    /* A folder with no items leaves only its own reference */
+    if (pending) {
+        problems += check_folder(parentID, isFolder, valence, children,
+                                 firstChild, report);
+    }
+
+    return problems;
+}
+
+/*
+ * NAME:    save_leaf()
+ * DESCRIPTION: Offer the position after a leaf node for saving
+ */
+static int save_leaf(uint32_t next, void *arg)
+{
+    struct feeder *f = arg;
+
+    if (next == 0 || f->failed) {
+        return 0;
+    }
+    return f->resume->save(next, f->byID, f->byParent, f->resume->arg);
+}
+
+/*
+ * NAME:    new_sorts()
+ * DESCRIPTION: Start the two empty sorts of the leaf pass
+ */
+static int new_sorts(struct feeder *f)
+{
+    size_t memory = fsck_extsort_memory() / 2;
+
+    f->byID = fsck_extsort_new(sizeof(struct ref), memory, compare_refs);
+    f->byParent = fsck_extsort_new(sizeof(struct ref), memory, compare_refs);
+    if (!f->byID || !f->byParent) {
+        error_print("failed to allocate catalog sort buffers");
+        fsck_extsort_free(f->byID);
+        fsck_extsort_free(f->byParent);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * NAME:    hfsplus_check_hierarchy()
+ * DESCRIPTION: Cross-check catalog IDs, threads and parents through two
+ *              external sorts
+ */
+int hfsplus_check_hierarchy(int fd, const hfsplus_fork_t *catalog,
+                            uint32_t nextCatalogID,
+                            const hfsplus_hierarchy_resume_t *resume,
+                            hfsplus_hierarchy_report_t *report)
+{
+    struct feeder f;
+    uint32_t start = 0;
+    int walked, byID, byParent;
+
+    memset(report, 0, sizeof(*report));
+    memset(&f, 0, sizeof(f));
+    f.resume = resume;
+
+    if (new_sorts(&f) < 0) {
+        return -1;
+    }
+
+    /* Go on from the leaf an interrupted pass stopped at */
+    if (resume && resume->load &&
+        resume->load(f.byID, f.byParent, &start, resume->arg) < 0) {
+        fsck_extsort_free(f.byID);
+        fsck_extsort_free(f.byParent);
+        start = 0;
+        if (new_sorts(&f) < 0) {
+            return -1;
+        }
+    }
+
+    walked = hfsplus_btree_leaves(fd, catalog, start, feed_record,
+                                  resume && resume->save ? save_leaf : NULL, &f);
+    if (walked > 0) {
+        fsck_extsort_free(f.byID);
+        fsck_extsort_free(f.byParent);
+        return HFSPLUS_HIERARCHY_STOPPED;
+    }
+    if (walked != 0 || f.failed ||
+        fsck_extsort_finish(f.byID) < 0 || fsck_extsort_finish(f.byParent) < 0) {
+        fsck_extsort_free(f.byID);
+        fsck_extsort_free(f.byParent);
+        return -1;
+    }
+    report->runs = fsck_extsort_runs(f.byID) + fsck_extsort_runs(f.byParent);
+
+    byID = merge_by_id(f.byID, nextCatalogID, report);
+    fsck_extsort_free(f.byID);
+    byParent = byID < 0 ? -1 : merge_by_parent(f.byParent, report);
+    fsck_extsort_free(f.byParent);
+
+    if (byID < 0 || byParent < 0) {
+        return -1;
+    }
+    return byID + byParent;
+}
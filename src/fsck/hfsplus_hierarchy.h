@@ -0,0 +1,66 @@
+/*
+ * hfsplus_hierarchy.h - HFS+ catalog ID, thread and parent cross-checks
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef HFSPLUS_HIERARCHY_H
+#define HFSPLUS_HIERARCHY_H
+
+#include <stdint.h>
+
+#include "hfsplus_btree.h"
+#include "fsck_extsort.h"
+
+/* Totals gathered while cross-checking the catalog */
+typedef struct {
+    uint64_t folders;
+    uint64_t files;
+    uint64_t threads;
+    unsigned int runs;          /* Sort runs written to disk */
+    uint32_t duplicateIDs;      /* IDs used by more than one file or folder */
+    uint32_t badIDs;            /* Reserved IDs, or IDs past nextCatalogID */
+    uint32_t missingThreads;    /* Files and folders without a thread */
+    uint32_t extraThreads;      /* Files and folders with several threads */
+    uint32_t orphanThreads;     /* Threads of IDs no file or folder has */
+    uint32_t threadMismatches;  /* Threads of the wrong kind, parent or name */
+    uint32_t badParents;        /* Parent IDs that are not folders */
+    uint32_t valenceErrors;     /* Folders whose valence is not their item count */
+} hfsplus_hierarchy_report_t;
+
+/* Returned by hfsplus_check_hierarchy() when save asked it to stop */
+#define HFSPLUS_HIERARCHY_STOPPED   -2
+
+/*
+ * Saving and resuming the leaf pass.  save is called after each leaf but
+ * the last with the next leaf and the sorts fed so far; non-zero stops
+ * the check.  load, if set, refills empty sorts with what an interrupted
+ * pass fed them and sets the leaf to go on from; it returns 0, or -1 to
+ * start over.
+ */
+typedef struct {
+    int (*save)(uint32_t next, const fsck_extsort_t *byID,
+                const fsck_extsort_t *byParent, void *arg);
+    int (*load)(fsck_extsort_t *byID, fsck_extsort_t *byParent,
+                uint32_t *next, void *arg);
+    void *arg;
+} hfsplus_hierarchy_resume_t;
+
+/*
+ * Check that every file and folder of a structurally sound catalog has a
+ * unique ID, exactly one matching thread and a folder as its parent, and
+ * that folder valences are right.  Memory use is bounded by
+ * fsck_extsort_memory(), whatever the size of the catalog.  resume may be
+ * NULL.  Returns the number of problems, -1 if the check could not be
+ * done, or HFSPLUS_HIERARCHY_STOPPED.
+ */
+int hfsplus_check_hierarchy(int fd, const hfsplus_fork_t *catalog,
+                            uint32_t nextCatalogID,
+                            const hfsplus_hierarchy_resume_t *resume,
+                            hfsplus_hierarchy_report_t *report);
+
+#endif /* HFSPLUS_HIERARCHY_H */
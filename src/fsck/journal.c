@@ -11,30 +11,114 @@
 #include "fsck_common.h"
 #include "../embedded/fsck/fsck_hfs.h"
 #include "journal.h"
+#include "fsck_metrics.h"
+#include <stddef.h>
+#include <sys/uio.h>
+#include <limits.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* The active journal header, decoded */
+struct journal_info {
+    off_t jibOffset;            /* Journal info block, in bytes */
+    struct HFSPlus_JournalInfoBlock jib;
+    uint64_t offset;            /* Journal start on the volume */
+    uint64_t size;
+    uint64_t start;             /* Oldest unreplayed block list */
+    uint64_t end;
+    uint32_t blhdrSize;
+    uint32_t jhdrSize;
+    int le;                     /* Journal written by a little-endian host */
+    struct HFSPlus_JournalHeader jh;
+};
+
+/* One journaled block, pointing into the loaded journal region */
+struct journal_write {
+    uint64_t offset;            /* Byte offset on the volume */
+    uint32_t length;
+    uint32_t seq;               /* Journal order: later versions win */
+    const uint8_t *data;
+};
+
+/* A run of volume bytes to write, after later versions were applied */
+struct journal_segment {
+    uint64_t offset;
+    size_t length;
+    const uint8_t *data;
+    uint8_t *owned;             /* Merged copy, or NULL */
+};
 
 /*
  * NAME:        journal_calculate_checksum()
- * DESCRIPTION: Calculate checksum for HFS+ journal structures with enhanced validation
+ * DESCRIPTION: Calculate the checksum of a journal header or block list
+ *              header, as computed by the kernel that wrote the journal
  */
 uint32_t journal_calculate_checksum(const void *data, size_t size)
 {
-    uint32_t sum = 0;
-    const uint32_t *ptr = (const uint32_t *)data;
+    const uint8_t *ptr = data;
+    uint32_t cksum = 0;
     
-    /* Ensure size is multiple of 4 */
-    if (size % 4 != 0) {
-        if (VERBOSE) {
-            printf("Warning: journal checksum size %zu is not multiple of 4\n", size);
-        }
-        size = (size / 4) * 4; /* Truncate to multiple of 4 */
+    for (size_t i = 0; i < size; i++) {
+        cksum = (cksum << 8) ^ (cksum + ptr[i]);
     }
     
-    /* Sum all 32-bit words in big-endian format */
-    for (size_t i = 0; i < size / 4; i++) {
-        sum += be32toh(ptr[i]);
+    return ~cksum;
+}
+
+/*
+ * NAME:        journal_get16()/journal_get32()/journal_get64()
+ * DESCRIPTION: Decode a journal field in the byte order it was written in
+ */
+static uint16_t journal_get16(int le, const void *p)
+{
+    uint16_t v;
+    
+    memcpy(&v, p, sizeof(v));
+    return le ? le16toh(v) : be16toh(v);
+}
+
+static uint32_t journal_get32(int le, const void *p)
+{
+    uint32_t v;
+    
+    memcpy(&v, p, sizeof(v));
+    return le ? le32toh(v) : be32toh(v);
+}
+
+static uint64_t journal_get64(int le, const void *p)
+{
+    uint64_t v;
+    
+    memcpy(&v, p, sizeof(v));
+    return le ? le64toh(v) : be64toh(v);
+}
+
+/*
+ * NAME:        journal_pread()
+ * DESCRIPTION: Read exactly len bytes at a volume offset
+ */
+static int journal_pread(int fd, void *buf, size_t len, uint64_t offset)
+{
+    uint8_t *p = buf;
+    
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, hfsplus_volume_start + (off_t)offset);
+        
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        fsck_metrics_bytes(n);
+        p += n;
+        offset += n;
+        len -= n;
     }
     
-    return sum;
+    return 0;
 }
 
 /*
@@ -69,24 +153,20 @@ void journal_log_error(const char *device, const char *message)
 }
 
 /*
- * NAME:        journal_is_valid()
- * DESCRIPTION: Enhanced journal validation with comprehensive checks
+ * NAME:        read_journal_header()
+ * DESCRIPTION: Read and validate the journal info block and the journal
+ *              header, printing them if asked; returns 0, or -1 after
+ *              logging why
  */
-int journal_is_valid(int fd, struct HFSPlus_VolumeHeader *vh)
+static int read_journal_header(int fd, struct HFSPlus_VolumeHeader *vh,
+                               struct journal_info *ji, int report)
 {
-    uint32_t attributes = be32toh(vh->attributes);
-    
-    /* Check if journaling is enabled */
-    if (!(attributes & HFSPLUS_VOL_JOURNALED)) {
-        if (VERBOSE) {
-            printf("Volume is not journaled\n");
-        }
-        return 0; /* Not journaled, but valid */
-    }
-    
     uint32_t blockSize = be32toh(vh->blockSize);
     uint32_t jibBlock = be32toh(vh->journalInfoBlock);
     uint32_t totalBlocks = be32toh(vh->totalBlocks);
+    uint64_t volume_size = (uint64_t)totalBlocks * blockSize;
+    
+    memset(ji, 0, sizeof(*ji));
     
     /* Validate journal info block location */
     if (jibBlock == 0) {
@@ -100,30 +180,27 @@ int journal_is_valid(int fd, struct HFSPlus_VolumeHeader *vh)
     }
     
     /* Read Journal Info Block */
-    struct HFSPlus_JournalInfoBlock jib;
-    off_t jib_offset = (off_t)jibBlock * blockSize;
-    
-    if (lseek(fd, jib_offset, SEEK_SET) == -1) {
-        journal_log_error(NULL, "Failed to seek to Journal Info Block");
-        return -1;
-    }
+    ji->jibOffset = (off_t)jibBlock * blockSize;
     
-    if (read(fd, &jib, sizeof(jib)) != sizeof(jib)) {
+    if (journal_pread(fd, &ji->jib, sizeof(ji->jib), ji->jibOffset) < 0) {
         journal_log_error(NULL, "Failed to read Journal Info Block");
         return -1;
     }
     
-    uint32_t flags = be32toh(jib.flags);
+    uint32_t flags = be32toh(ji->jib.flags);
     
-    if (VERBOSE) {
+    ji->offset = be64toh(ji->jib.offset);
+    ji->size = be64toh(ji->jib.size);
+    
+    if (VERBOSE && report) {
         printf("Journal Info Block:\n");
         printf("  Flags: 0x%08x\n", flags);
-        printf("  Offset: %llu\n", (unsigned long long)be64toh(jib.offset));
-        printf("  Size: %llu\n", (unsigned long long)be64toh(jib.size));
+        printf("  Offset: %llu\n", (unsigned long long)ji->offset);
+        printf("  Size: %llu\n", (unsigned long long)ji->size);
     }
     
     /* Check for external journal (not supported) */
-    if (flags & JOURNAL_ON_OTHER_DEVICE) {
+    if ((flags & JOURNAL_ON_OTHER_DEVICE) || !(flags & JOURNAL_IN_FS)) {
         journal_log_error(NULL, "External journal not supported");
         return -1;
     }
@@ -135,85 +212,90 @@ int journal_is_valid(int fd, struct HFSPlus_VolumeHeader *vh)
     }
     
     /* Validate journal offset and size */
-    uint64_t journal_offset = be64toh(jib.offset);
-    uint64_t journal_size = be64toh(jib.size);
-    
-    if (journal_offset == 0) {
+    if (ji->offset == 0) {
         journal_log_error(NULL, "Journal offset is zero");
         return -1;
     }
     
-    if (journal_size == 0) {
+    if (ji->size == 0) {
         journal_log_error(NULL, "Journal size is zero");
         return -1;
     }
     
     /* Check if journal fits within volume */
-    uint64_t volume_size = (uint64_t)totalBlocks * blockSize;
-    if (journal_offset + journal_size > volume_size) {
+    if (ji->offset + ji->size > volume_size) {
         journal_log_error(NULL, "Journal extends beyond volume end");
         return -1;
     }
     
     /* Read Journal Header */
-    struct HFSPlus_JournalHeader jh;
+    struct HFSPlus_JournalHeader *jh = &ji->jh;
     
-    if (lseek(fd, journal_offset, SEEK_SET) == -1) {
-        journal_log_error(NULL, "Failed to seek to Journal Header");
-        return -1;
-    }
-    
-    if (read(fd, &jh, sizeof(jh)) != sizeof(jh)) {
+    if (journal_pread(fd, jh, sizeof(*jh), ji->offset) < 0) {
         journal_log_error(NULL, "Failed to read Journal Header");
         return -1;
     }
     
-    /* Validate journal header */
-    if (be32toh(jh.magic) != JOURNAL_MAGIC) {
+    /* The magic number tells the byte order of the rest */
+    if (be32toh(jh->magic) == JOURNAL_MAGIC) {
+        ji->le = 0;
+    } else if (le32toh(jh->magic) == JOURNAL_MAGIC) {
+        ji->le = 1;
+    } else {
         char msg[64];
-        snprintf(msg, sizeof(msg), "Invalid journal magic: 0x%08x", be32toh(jh.magic));
+        snprintf(msg, sizeof(msg), "Invalid journal magic: 0x%08x", be32toh(jh->magic));
         journal_log_error(NULL, msg);
         return -1;
     }
     
-    if (be32toh(jh.endian) != JOURNAL_ENDIAN) {
+    if (journal_get32(ji->le, &jh->endian) != JOURNAL_ENDIAN) {
         char msg[64];
-        snprintf(msg, sizeof(msg), "Invalid journal endianness: 0x%08x", be32toh(jh.endian));
+        snprintf(msg, sizeof(msg), "Invalid journal endianness: 0x%08x",
+                 journal_get32(ji->le, &jh->endian));
         journal_log_error(NULL, msg);
         return -1;
     }
     
     /* Validate journal header fields */
-    uint64_t start = be64toh(jh.start);
-    uint64_t end = be64toh(jh.end);
-    uint64_t size = be64toh(jh.size);
+    ji->start = journal_get64(ji->le, &jh->start);
+    ji->end = journal_get64(ji->le, &jh->end);
+    ji->blhdrSize = journal_get32(ji->le, &jh->blhdrSize);
+    ji->jhdrSize = journal_get32(ji->le, &jh->jhdrSize);
+    uint64_t size = journal_get64(ji->le, &jh->size);
     
-    if (VERBOSE) {
+    if (VERBOSE && report) {
         printf("Journal Header:\n");
-        printf("  Magic: 0x%08x\n", be32toh(jh.magic));
-        printf("  Endian: 0x%08x\n", be32toh(jh.endian));
-        printf("  Start: %llu\n", (unsigned long long)start);
-        printf("  End: %llu\n", (unsigned long long)end);
+        printf("  Magic: 0x%08x (%s-endian)\n", JOURNAL_MAGIC, ji->le ? "little" : "big");
+        printf("  Start: %llu\n", (unsigned long long)ji->start);
+        printf("  End: %llu\n", (unsigned long long)ji->end);
         printf("  Size: %llu\n", (unsigned long long)size);
-        printf("  Block header size: %u\n", be32toh(jh.blhdrSize));
-        printf("  Journal header size: %u\n", be32toh(jh.jhdrSize));
+        printf("  Block header size: %u\n", ji->blhdrSize);
+        printf("  Journal header size: %u\n", ji->jhdrSize);
     }
     
-    if (size != journal_size) {
+    if (size != ji->size) {
         journal_log_error(NULL, "Journal header size doesn't match info block");
         return -1;
     }
     
-    if (start > size || end > size) {
+    if (ji->jhdrSize < sizeof(*jh) || ji->jhdrSize >= size ||
+        ji->blhdrSize < sizeof(struct HFSPlus_BlockListHeader) + 2 * sizeof(struct HFSPlus_BlockInfo) ||
+        ji->blhdrSize > size - ji->jhdrSize) {
+        journal_log_error(NULL, "Journal header or block list size out of range");
+        return -1;
+    }
+    
+    if (ji->start < ji->jhdrSize || ji->start >= size ||
+        ji->end < ji->jhdrSize || ji->end >= size) {
         journal_log_error(NULL, "Journal start/end pointers beyond journal size");
         return -1;
     }
     
     /* Validate checksum */
-    uint32_t stored_checksum = be32toh(jh.checksum);
-    struct HFSPlus_JournalHeader temp_jh = jh;
+    struct HFSPlus_JournalHeader temp_jh = *jh;
+    uint32_t stored_checksum = journal_get32(ji->le, &jh->checksum);
     temp_jh.checksum = 0;
-    uint32_t calculated_checksum = journal_calculate_checksum(&temp_jh, sizeof(temp_jh));
+    uint32_t calculated_checksum = journal_calculate_checksum(&temp_jh, JOURNAL_HEADER_CKSUM_SIZE);
     
     if (stored_checksum != calculated_checksum) {
         char msg[128];
@@ -223,288 +305,475 @@ int journal_is_valid(int fd, struct HFSPlus_VolumeHeader *vh)
         return -1;
     }
     
-    if (VERBOSE) {
-        printf("Journal validation successful\n");
-    }
-    
-    return 1; /* Valid journal */
+    return 0;
 }
 
 /*
- * NAME:        journal_replay()
- * DESCRIPTION: Enhanced journal replay with better error handling and validation
+ * NAME:        journal_is_valid()
+ * DESCRIPTION: Enhanced journal validation with comprehensive checks
  */
-int journal_replay(int fd, struct HFSPlus_VolumeHeader *vh, int repair_mode)
+int journal_is_valid(int fd, struct HFSPlus_VolumeHeader *vh)
 {
-    uint32_t blockSize = be32toh(vh->blockSize);
-    uint32_t jibBlock = be32toh(vh->journalInfoBlock);
-    int transactions_replayed = 0;
-    
-    /* Read Journal Info Block */
-    struct HFSPlus_JournalInfoBlock jib;
-    off_t jib_offset = (off_t)jibBlock * blockSize;
+    uint32_t attributes = be32toh(vh->attributes);
+    struct journal_info ji;
     
-    if (lseek(fd, jib_offset, SEEK_SET) == -1) {
-        journal_log_error(NULL, "Failed to seek to Journal Info Block during replay");
-        return -EIO;
+    /* Check if journaling is enabled */
+    if (!(attributes & HFSPLUS_VOL_JOURNALED)) {
+        if (VERBOSE) {
+            printf("Volume is not journaled\n");
+        }
+        return 0; /* Not journaled, but valid */
     }
     
-    if (read(fd, &jib, sizeof(jib)) != sizeof(jib)) {
-        journal_log_error(NULL, "Failed to read Journal Info Block during replay");
-        return -EIO;
+    if (read_journal_header(fd, vh, &ji, 1) < 0) {
+        return -1;
     }
     
-    uint32_t flags = be32toh(jib.flags);
-    
-    /* Check for unsupported configurations */
-    if (flags & JOURNAL_ON_OTHER_DEVICE) {
-        journal_log_error(NULL, "External journal not supported during replay");
-        return -EINVAL;
+    if (VERBOSE) {
+        printf("Journal validation successful\n");
     }
     
-    /* Read Journal Header */
-    struct HFSPlus_JournalHeader jh;
-    uint64_t journal_offset = be64toh(jib.offset);
-    
-    if (lseek(fd, journal_offset, SEEK_SET) == -1) {
-        journal_log_error(NULL, "Failed to seek to journal during replay");
-        return -EIO;
-    }
+    return 1; /* Valid journal */
+}
+
+/*
+ * NAME:        journal_mark_need_init()
+ * DESCRIPTION: Flag the journal for reinitialization after corruption
+ */
+static void journal_mark_need_init(int fd, struct journal_info *ji, const char *why)
+{
+    char msg[128];
     
-    if (read(fd, &jh, sizeof(jh)) != sizeof(jh)) {
-        journal_log_error(NULL, "Failed to read journal header during replay");
-        return -EIO;
+    ji->jib.flags = htobe32(be32toh(ji->jib.flags) | JOURNAL_NEED_INIT);
+    if (pwrite(fd, &ji->jib, sizeof(ji->jib),
+               hfsplus_volume_start + ji->jibOffset) == sizeof(ji->jib)) {
+        snprintf(msg, sizeof(msg), "Marked journal for reinitialization due to %s", why);
+    } else {
+        snprintf(msg, sizeof(msg), "Failed to mark journal for reinitialization");
     }
+    journal_log_error(NULL, msg);
+}
+
+/*
+ * NAME:        journal_load_region()
+ * DESCRIPTION: Read the active part of the circular journal, from start
+ *              to end, into one linear buffer with large sequential reads
+ */
+static uint8_t *journal_load_region(int fd, const struct journal_info *ji, uint64_t *length)
+{
+    uint64_t pos = ji->start;
+    uint64_t len, done = 0;
+    uint8_t *buf;
     
-    /* Validate journal header */
-    if (be32toh(jh.magic) != JOURNAL_MAGIC || 
-        be32toh(jh.endian) != JOURNAL_ENDIAN) {
-        if (repair_mode) {
-            /* Mark journal for reinitialization */
-            jib.flags = htobe32(be32toh(jib.flags) | JOURNAL_NEED_INIT);
-            if (lseek(fd, jib_offset, SEEK_SET) != -1) {
-                if (write(fd, &jib, sizeof(jib)) == sizeof(jib)) {
-                    journal_log_error(NULL, "Marked journal for reinitialization due to corruption");
-                } else {
-                    journal_log_error(NULL, "Failed to mark journal for reinitialization");
-                }
-            }
-        }
-        journal_log_error(NULL, "Corrupt journal header during replay");
-        return -EINVAL;
+    if (ji->end >= ji->start) {
+        len = ji->end - ji->start;
+    } else {
+        len = (ji->size - ji->start) + (ji->end - ji->jhdrSize);
     }
     
-    uint64_t start = be64toh(jh.start);
-    uint64_t end = be64toh(jh.end);
-    uint64_t journal_size = be64toh(jh.size);
-    
-    if (VERBOSE) {
-        printf("Starting journal replay: start=%llu, end=%llu\n", 
-               (unsigned long long)start, (unsigned long long)end);
+    buf = malloc(len ? len : 1);
+    if (!buf) {
+        return NULL;
     }
     
-    /* Check if there are transactions to replay */
-    if (start == end) {
-        if (VERBOSE) {
-            printf("Journal is clean, no transactions to replay\n");
+    while (done < len) {
+        uint64_t n = len - done;
+        
+        if (n > ji->size - pos) {
+            n = ji->size - pos;
+        }
+        if (n > JOURNAL_READ_CHUNK) {
+            n = JOURNAL_READ_CHUNK;
+        }
+        
+        if (journal_pread(fd, buf + done, n, ji->offset + pos) < 0) {
+            free(buf);
+            return NULL;
+        }
+        
+        done += n;
+        pos += n;
+        if (pos == ji->size) {
+            pos = ji->jhdrSize;     /* Wrap past the journal header */
         }
-        return 0; /* No transactions to replay */
     }
     
-    journal_log_error(NULL, "Replaying journal transactions");
-    
-    uint64_t pos = start;
-    int max_transactions = 1000; /* Prevent infinite loops */
-    int transaction_count = 0;
-    
-    /* Replay transactions */
-    while (pos != end && transaction_count < max_transactions) {
-        /* Read Block List Header */
-        struct HFSPlus_BlockListHeader blh;
-        uint64_t blh_offset = journal_offset + pos;
+    *length = len;
+    return buf;
+}
+
+/*
+ * NAME:        journal_parse_region()
+ * DESCRIPTION: Walk the block lists of a loaded region and collect every
+ *              journaled block in journal order; returns the number of
+ *              block lists, or -EINVAL with *why set on corruption
+ */
+static int journal_parse_region(const struct journal_info *ji, const uint8_t *buf,
+                                uint64_t length, uint64_t volume_size,
+                                struct journal_write **writes, size_t *nwrites,
+                                const char **why)
+{
+    struct journal_write *w = NULL;
+    size_t n = 0, alloc = 0;
+    uint64_t pos = 0;
+    int lists = 0;
+    
+    while (pos < length) {
+        const uint8_t *blh = buf + pos;
+        uint8_t temp[JOURNAL_BLHDR_CKSUM_SIZE];
         
-        if (lseek(fd, blh_offset, SEEK_SET) == -1) {
-            journal_log_error(NULL, "Failed to seek to block list during replay");
-            return -EIO;
+        if (length - pos < ji->blhdrSize) {
+            *why = "truncated block list header";
+            goto corrupt;
         }
         
-        if (read(fd, &blh, sizeof(blh)) != sizeof(blh)) {
-            journal_log_error(NULL, "Failed to read block list header during replay");
-            return -EIO;
+        /* Checksum over the header and block info 0, checksum zeroed */
+        memcpy(temp, blh, sizeof(temp));
+        memset(temp + offsetof(struct HFSPlus_BlockListHeader, checksum), 0, 4);
+        if (journal_calculate_checksum(temp, sizeof(temp)) !=
+            journal_get32(ji->le, blh + offsetof(struct HFSPlus_BlockListHeader, checksum))) {
+            *why = "block list checksum error";
+            goto corrupt;
         }
         
-        /* Validate block list header */
-        uint16_t bsize = be16toh(blh.bsize);
-        uint16_t numBlocks = be16toh(blh.numBlocks);
-        uint32_t stored_checksum = be32toh(blh.checksum);
+        uint16_t maxBlocks = journal_get16(ji->le, blh + offsetof(struct HFSPlus_BlockListHeader, maxBlocks));
+        uint16_t numBlocks = journal_get16(ji->le, blh + offsetof(struct HFSPlus_BlockListHeader, numBlocks));
+        uint32_t bytesUsed = journal_get32(ji->le, blh + offsetof(struct HFSPlus_BlockListHeader, bytesUsed));
+        uint64_t data = pos + ji->blhdrSize;
         
         if (VERBOSE) {
-            printf("Transaction %d: bsize=%u, numBlocks=%u\n", 
-                   transaction_count, bsize, numBlocks);
+            printf("Block list %d: %u blocks, %u bytes\n", lists, numBlocks - 1, bytesUsed);
         }
         
-        /* Validate checksum */
-        struct HFSPlus_BlockListHeader temp_blh = blh;
-        temp_blh.checksum = 0;
-        uint32_t calculated_checksum = journal_calculate_checksum(&temp_blh, sizeof(temp_blh));
+        if (numBlocks == 0 || numBlocks > maxBlocks ||
+            sizeof(struct HFSPlus_BlockListHeader) +
+            (size_t)numBlocks * sizeof(struct HFSPlus_BlockInfo) > ji->blhdrSize ||
+            bytesUsed < ji->blhdrSize || bytesUsed > length - pos) {
+            *why = "invalid block list header";
+            goto corrupt;
+        }
         
-        if (calculated_checksum != stored_checksum) {
-            if (repair_mode) {
-                jib.flags = htobe32(be32toh(jib.flags) | JOURNAL_NEED_INIT);
-                if (lseek(fd, jib_offset, SEEK_SET) != -1) {
-                    if (write(fd, &jib, sizeof(jib)) == sizeof(jib)) {
-                        journal_log_error(NULL, "Marked journal for reinitialization due to checksum error");
+        fsck_metrics_records(numBlocks - 1);
+        
+        /* Entry 0 describes the list itself; the data follows the header */
+        for (uint16_t i = 1; i < numBlocks; i++) {
+            const uint8_t *bi = blh + sizeof(struct HFSPlus_BlockListHeader) +
+                                (size_t)i * sizeof(struct HFSPlus_BlockInfo);
+            uint64_t bnum = journal_get64(ji->le, bi + offsetof(struct HFSPlus_BlockInfo, bnum));
+            uint32_t bsize = journal_get32(ji->le, bi + offsetof(struct HFSPlus_BlockInfo, bsize));
+            
+            if (bsize > pos + bytesUsed - data) {
+                *why = "block data beyond block list";
+                goto corrupt;
+            }
+            
+            if (bnum != JOURNAL_KILLED_BLOCK && bsize > 0) {
+                if (bnum > (volume_size - bsize) / ji->jhdrSize) {
+                    *why = "journaled block beyond volume end";
+                    goto corrupt;
+                }
+                
+                if (n == alloc) {
+                    size_t grow = alloc ? alloc * 2 : 256;
+                    struct journal_write *nw = realloc(w, grow * sizeof(*w));
+                    
+                    if (!nw) {
+                        free(w);
+                        *why = "out of memory";
+                        return -ENOMEM;
                     }
+                    w = nw;
+                    alloc = grow;
                 }
+                w[n].offset = bnum * ji->jhdrSize;
+                w[n].length = bsize;
+                w[n].seq = (uint32_t)n;
+                w[n].data = buf + data;
+                n++;
             }
-            char msg[128];
-            snprintf(msg, sizeof(msg), "Invalid block list checksum: stored=0x%08x, calculated=0x%08x",
-                    stored_checksum, calculated_checksum);
-            journal_log_error(NULL, msg);
-            return -EINVAL;
-        }
-        
-        /* Validate block count */
-        if (numBlocks == 0 || numBlocks > 1000) { /* Reasonable limit */
-            char msg[64];
-            snprintf(msg, sizeof(msg), "Invalid block count in transaction: %u", numBlocks);
-            journal_log_error(NULL, msg);
-            return -EINVAL;
+            data += bsize;
         }
         
-        pos += sizeof(blh);
+        pos += bytesUsed;
+        lists++;
+    }
+    
+    *writes = w;
+    *nwrites = n;
+    return lists;
+    
+corrupt:
+    free(w);
+    return -EINVAL;
+}
+
+static int write_offset_cmp(const void *a, const void *b)
+{
+    const struct journal_write *wa = a, *wb = b;
+    
+    if (wa->offset != wb->offset) {
+        return wa->offset < wb->offset ? -1 : 1;
+    }
+    return wa->seq < wb->seq ? -1 : (wa->seq > wb->seq);
+}
+
+static int write_seq_cmp(const void *a, const void *b)
+{
+    const struct journal_write *wa = a, *wb = b;
+    
+    return wa->seq < wb->seq ? -1 : (wa->seq > wb->seq);
+}
+
+/*
+ * NAME:        journal_resolve_writes()
+ * DESCRIPTION: Sort journaled blocks by volume offset and keep only what
+ *              the last transaction wrote: repeated blocks collapse to
+ *              their newest version, partial overlaps are merged in
+ *              journal order.  Returns the number of segments or -1.
+ */
+static ssize_t journal_resolve_writes(struct journal_write *w, size_t n,
+                                      struct journal_segment **segments)
+{
+    struct journal_segment *seg;
+    size_t nseg = 0, i = 0;
+    
+    seg = malloc((n ? n : 1) * sizeof(*seg));
+    if (!seg) {
+        return -1;
+    }
+    
+    qsort(w, n, sizeof(*w), write_offset_cmp);
+    
+    while (i < n) {
+        uint64_t lo = w[i].offset;
+        uint64_t hi = lo + w[i].length;
+        size_t j, newest = i;
         
-        /* Process each block in the transaction */
-        for (uint16_t i = 0; i < numBlocks; i++) {
-            struct HFSPlus_BlockInfo bi;
-            
-            if (lseek(fd, journal_offset + pos, SEEK_SET) == -1) {
-                journal_log_error(NULL, "Failed to seek to block info during replay");
-                return -EIO;
-            }
-            
-            if (read(fd, &bi, sizeof(bi)) != sizeof(bi)) {
-                journal_log_error(NULL, "Failed to read block info during replay");
-                return -EIO;
+        /* Everything overlapping this block, transitively */
+        for (j = i + 1; j < n && w[j].offset < hi; j++) {
+            if (w[j].offset + w[j].length > hi) {
+                hi = w[j].offset + w[j].length;
             }
-            
-            uint32_t block_size = be32toh(bi.bsize);
-            uint64_t block_num = be64toh(bi.bnum);
-            uint64_t next_pos = be64toh(bi.next);
-            
-            /* Validate block info */
-            if (block_size == 0 || block_size > blockSize * 8) { /* Reasonable limit */
-                char msg[64];
-                snprintf(msg, sizeof(msg), "Invalid block size in journal: %u", block_size);
-                journal_log_error(NULL, msg);
-                return -EINVAL;
+            if (w[j].seq > w[newest].seq) {
+                newest = j;
             }
+        }
+        
+        seg[nseg].offset = lo;
+        seg[nseg].length = hi - lo;
+        seg[nseg].owned = NULL;
+        
+        if (w[newest].offset == lo && w[newest].length == hi - lo) {
+            /* The newest version covers the others */
+            seg[nseg].data = w[newest].data;
+        } else {
+            uint8_t *merged = malloc(hi - lo);
             
-            if (block_num >= be32toh(vh->totalBlocks)) {
-                char msg[64];
-                snprintf(msg, sizeof(msg), "Block number beyond volume end: %llu", 
-                        (unsigned long long)block_num);
-                journal_log_error(NULL, msg);
-                return -EINVAL;
+            if (!merged) {
+                for (size_t k = 0; k < nseg; k++) {
+                    free(seg[k].owned);
+                }
+                free(seg);
+                return -1;
             }
-            
-            /* Allocate buffer for block data */
-            uint8_t *data = malloc(block_size);
-            if (!data) {
-                journal_log_error(NULL, "Memory allocation failed during replay");
-                return -ENOMEM;
+            qsort(w + i, j - i, sizeof(*w), write_seq_cmp);
+            for (size_t k = i; k < j; k++) {
+                memcpy(merged + (w[k].offset - lo), w[k].data, w[k].length);
             }
+            seg[nseg].data = merged;
+            seg[nseg].owned = merged;
+        }
+        
+        nseg++;
+        i = j;
+    }
+    
+    *segments = seg;
+    return (ssize_t)nseg;
+}
+
+/*
+ * NAME:        journal_write_segments()
+ * DESCRIPTION: Write sorted segments, gathering each contiguous stretch
+ *              into one pwritev; returns the number of calls or -1
+ */
+static long journal_write_segments(int fd, const struct journal_segment *seg, size_t nseg)
+{
+    struct iovec iov[IOV_MAX];
+    long calls = 0;
+    size_t i = 0;
+    
+    while (i < nseg) {
+        uint64_t offset = seg[i].offset;
+        uint64_t next = offset;
+        int cnt = 0;
+        
+        while (i < nseg && cnt < IOV_MAX && seg[i].offset == next) {
+            iov[cnt].iov_base = (void *)seg[i].data;
+            iov[cnt].iov_len = seg[i].length;
+            next += seg[i].length;
+            cnt++;
+            i++;
+        }
+        
+        /* Resume after short writes */
+        struct iovec *v = iov;
+        
+        while (cnt > 0) {
+            ssize_t done = pwritev(fd, v, cnt, hfsplus_volume_start + (off_t)offset);
             
-            pos += sizeof(bi);
-            
-            /* Read block data from journal */
-            if (lseek(fd, journal_offset + pos, SEEK_SET) == -1) {
-                free(data);
-                journal_log_error(NULL, "Failed to seek to block data during replay");
-                return -EIO;
+            if (done < 0 && errno == EINTR) {
+                continue;
             }
-            
-            if (read(fd, data, block_size) != block_size) {
-                free(data);
-                journal_log_error(NULL, "Failed to read block data during replay");
-                return -EIO;
+            if (done <= 0) {
+                return -1;
             }
-            
-            /* Write block data to its location in the volume */
-            if (repair_mode) {
-                off_t block_offset = (off_t)block_num * blockSize;
-                if (lseek(fd, block_offset, SEEK_SET) == -1) {
-                    free(data);
-                    journal_log_error(NULL, "Failed to seek to volume block during replay");
-                    return -EIO;
-                }
-                
-                if (write(fd, data, block_size) != block_size) {
-                    free(data);
-                    journal_log_error(NULL, "Failed to write volume block during replay");
-                    return -EIO;
-                }
-                
-                if (VERBOSE) {
-                    printf("  Replayed block %llu (%u bytes)\n", 
-                           (unsigned long long)block_num, block_size);
-                }
+            calls++;
+            offset += done;
+            while (cnt > 0 && (size_t)done >= v->iov_len) {
+                done -= v->iov_len;
+                v++;
+                cnt--;
             }
-            
-            free(data);
-            pos = next_pos;
-            
-            /* Wrap around journal if necessary */
-            if (pos >= journal_size) {
-                pos = sizeof(struct HFSPlus_JournalHeader);
+            if (cnt > 0) {
+                v->iov_base = (uint8_t *)v->iov_base + done;
+                v->iov_len -= done;
             }
         }
-        
-        transactions_replayed++;
-        transaction_count++;
     }
     
-    if (transaction_count >= max_transactions) {
-        journal_log_error(NULL, "Too many transactions, possible corruption");
+    return calls;
+}
+
+/*
+ * NAME:        journal_replay()
+ * DESCRIPTION: Replay the journal as a pipeline: load the active region
+ *              with large reads, keep the newest version of each block,
+ *              sort the writes by volume offset, issue coalesced
+ *              pwritev calls and sync once at the end
+ */
+int journal_replay(int fd, struct HFSPlus_VolumeHeader *vh, int repair_mode)
+{
+    uint64_t volume_size = (uint64_t)be32toh(vh->totalBlocks) * be32toh(vh->blockSize);
+    struct journal_info ji;
+    struct journal_write *writes = NULL;
+    struct journal_segment *segments = NULL;
+    size_t nwrites = 0;
+    ssize_t nseg;
+    uint64_t region_len, bytes = 0;
+    uint8_t *region;
+    const char *why = NULL;
+    long calls = 0;
+    int lists;
+    
+    if (read_journal_header(fd, vh, &ji, 0) < 0) {
+        if (repair_mode && ji.jibOffset) {
+            journal_mark_need_init(fd, &ji, "corruption");
+        }
+        journal_log_error(NULL, "Corrupt journal header during replay");
         return -EINVAL;
     }
     
-    /* Update journal header to mark transactions as replayed */
-    if (repair_mode && transactions_replayed > 0) {
-        jh.start = htobe64(end);
-        
-        /* Recalculate checksum */
-        jh.checksum = 0;
-        uint32_t new_checksum = journal_calculate_checksum(&jh, sizeof(jh));
-        jh.checksum = htobe32(new_checksum);
-        
-        if (lseek(fd, journal_offset, SEEK_SET) == -1) {
-            journal_log_error(NULL, "Failed to seek to journal header for update");
-            return -EIO;
+    if (VERBOSE) {
+        printf("Starting journal replay: start=%llu, end=%llu\n", 
+               (unsigned long long)ji.start, (unsigned long long)ji.end);
+    }
+    
+    /* Check if there are transactions to replay */
+    if (ji.start == ji.end) {
+        if (VERBOSE) {
+            printf("Journal is clean, no transactions to replay\n");
         }
+        return 0; /* No transactions to replay */
+    }
+    
+    journal_log_error(NULL, "Replaying journal transactions");
+    
+    /* Stage 1: the whole active region, in large sequential reads */
+    region = journal_load_region(fd, &ji, &region_len);
+    if (!region) {
+        journal_log_error(NULL, "Failed to read journal during replay");
+        return -EIO;
+    }
+    
+    /* Stage 2: every journaled block, in journal order */
+    lists = journal_parse_region(&ji, region, region_len, volume_size,
+                                 &writes, &nwrites, &why);
+    if (lists < 0) {
+        char msg[128];
         
-        if (write(fd, &jh, sizeof(jh)) != sizeof(jh)) {
-            journal_log_error(NULL, "Failed to update journal header");
-            return -EIO;
+        if (repair_mode && lists == -EINVAL) {
+            journal_mark_need_init(fd, &ji, why);
         }
+        snprintf(msg, sizeof(msg), "Corrupt journal during replay: %s", why);
+        journal_log_error(NULL, msg);
+        free(region);
+        return lists;
+    }
+    
+    /* Stage 3: newest version of each block, sorted by volume offset */
+    nseg = journal_resolve_writes(writes, nwrites, &segments);
+    if (nseg < 0) {
+        journal_log_error(NULL, "Memory allocation failed during replay");
+        free(writes);
+        free(region);
+        return -ENOMEM;
+    }
+    for (ssize_t i = 0; i < nseg; i++) {
+        bytes += segments[i].length;
+    }
+    
+    /* Stage 4: coalesced writes, then mark the journal empty and sync once */
+    if (repair_mode) {
+        calls = journal_write_segments(fd, segments, (size_t)nseg);
         
-        /* Sync to disk */
-        if (fsync(fd) == -1) {
-            journal_log_error(NULL, "Failed to sync journal updates");
-            return -EIO;
+        if (calls >= 0) {
+            struct HFSPlus_JournalHeader *jh = &ji.jh;
+            uint64_t end = ji.le ? htole64(ji.end) : htobe64(ji.end);
+            uint32_t checksum;
+            
+            memcpy(&jh->start, &end, sizeof(end));
+            jh->checksum = 0;
+            checksum = journal_calculate_checksum(jh, JOURNAL_HEADER_CKSUM_SIZE);
+            jh->checksum = ji.le ? htole32(checksum) : htobe32(checksum);
+            
+            if (pwrite(fd, jh, sizeof(*jh),
+                       hfsplus_volume_start + (off_t)ji.offset) != sizeof(*jh)) {
+                journal_log_error(NULL, "Failed to update journal header");
+                calls = -1;
+            } else if (fsync(fd) == -1) {
+                journal_log_error(NULL, "Failed to sync journal updates");
+                calls = -1;
+            }
+        } else {
+            journal_log_error(NULL, "Failed to write volume blocks during replay");
         }
     }
     
     if (VERBOSE) {
-        printf("Journal replay completed: %d transactions replayed\n", transactions_replayed);
+        printf("Journal: %d block lists, %zu blocks, %zd distinct runs (%llu bytes)\n",
+               lists, nwrites, nseg, (unsigned long long)bytes);
+        if (repair_mode && calls >= 0) {
+            printf("Journal replay completed: %ld writes\n", calls);
+        }
+    }
+    
+    for (ssize_t i = 0; i < nseg; i++) {
+        free(segments[i].owned);
+    }
+    free(segments);
+    free(writes);
+    free(region);
+    
+    if (calls < 0) {
+        return -EIO;
     }
     
-    char msg[64];
-    snprintf(msg, sizeof(msg), "Journal replay completed successfully: %d transactions", 
-             transactions_replayed);
+    char msg[96];
+    snprintf(msg, sizeof(msg), "Journal replay completed successfully: %d block lists", lists);
     journal_log_error(NULL, msg);
     
-    return transactions_replayed;
+    return lists;
 }
 
 /*
@@ -527,7 +796,7 @@ int journal_disable(int fd, struct HFSPlus_VolumeHeader *vh)
     vh->journalInfoBlock = 0;
     
     /* Write updated volume header */
-    if (lseek(fd, 1024, SEEK_SET) == -1) {
+    if (lseek(fd, hfsplus_volume_start + 1024, SEEK_SET) == -1) {
         journal_log_error(NULL, "Failed to seek to volume header for journal disable");
         return -EIO;
     }
@@ -537,12 +806,12 @@ int journal_disable(int fd, struct HFSPlus_VolumeHeader *vh)
         return -EIO;
     }
     
-    /* Write backup volume header */
+    /* Write backup volume header, 1024 bytes before the end of the volume */
     uint32_t totalBlocks = be32toh(vh->totalBlocks);
     uint32_t blockSize = be32toh(vh->blockSize);
-    off_t backupOffset = (off_t)(totalBlocks - 2) * blockSize + 1024;
+    off_t backupOffset = (off_t)totalBlocks * blockSize - 1024;
     
-    if (lseek(fd, backupOffset, SEEK_SET) == -1) {
+    if (lseek(fd, hfsplus_volume_start + backupOffset, SEEK_SET) == -1) {
         journal_log_error(NULL, "Failed to seek to backup volume header for journal disable");
         return -EIO;
     }
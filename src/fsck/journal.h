@@ -26,11 +26,22 @@
 #define JOURNAL_MAGIC          0x4A4E4C78
 #define JOURNAL_ENDIAN         0x12345678
 
-/* Journal Flags */
-#define JOURNAL_ON_OTHER_DEVICE (1 << 0)
-#define JOURNAL_NEED_INIT       (1 << 1)
+/* Journal Info Block Flags */
+#define JOURNAL_IN_FS           (1 << 0)
+#define JOURNAL_ON_OTHER_DEVICE (1 << 1)
+#define JOURNAL_NEED_INIT       (1 << 2)
 
-/* HFS+ Journal Info Block */
+/* Bytes covered by the journal header and block list header checksums */
+#define JOURNAL_HEADER_CKSUM_SIZE 44
+#define JOURNAL_BLHDR_CKSUM_SIZE  32
+
+/* Block number of a block list entry that was cancelled */
+#define JOURNAL_KILLED_BLOCK    0xFFFFFFFFFFFFFFFFULL
+
+/* Largest single read issued while loading the active journal region */
+#define JOURNAL_READ_CHUNK      (8 * 1024 * 1024)
+
+/* HFS+ Journal Info Block (always big-endian) */
 struct HFSPlus_JournalInfoBlock {
     uint32_t flags;
     uint32_t deviceSignature[8];
@@ -39,6 +50,11 @@ struct HFSPlus_JournalInfoBlock {
     uint8_t reserved[432];
 } __attribute__((packed));
 
+/*
+ * The journal header and block lists are stored in the byte order of the
+ * host that wrote them; the endian field tells which.
+ */
+
 /* HFS+ Journal Header */
 struct HFSPlus_JournalHeader {
     uint32_t magic;
@@ -49,22 +65,24 @@ struct HFSPlus_JournalHeader {
     uint32_t blhdrSize;
     uint32_t checksum;
     uint32_t jhdrSize;
-    uint8_t reserved[88];
+    uint32_t sequenceNum;
+    uint8_t reserved[84];
 } __attribute__((packed));
 
-/* HFS+ Block List Header */
+/* HFS+ Block List Header, followed by blockInfo[numBlocks] */
 struct HFSPlus_BlockListHeader {
-    uint16_t bsize;
-    uint16_t numBlocks;
+    uint16_t maxBlocks;
+    uint16_t numBlocks;         /* Including entry 0, which holds no data */
+    uint32_t bytesUsed;         /* Header plus block data */
     uint32_t checksum;
-    uint32_t reserved[8];
+    uint32_t flags;
 } __attribute__((packed));
 
-/* HFS+ Block Info */
+/* HFS+ Block Info; bnum is in units of the journal header size */
 struct HFSPlus_BlockInfo {
     uint64_t bnum;
     uint32_t bsize;
-    uint64_t next;
+    uint32_t next;
 } __attribute__((packed));
 
 /* Forward declaration - actual definition is in fsck_hfs.h */
@@ -75,6 +93,9 @@ struct HFSPlus_VolumeHeader;
 /* HFS+ specific checking functions */
 int hfsplus_check_volume(const char *device_path, int partition_number, int check_options);
 
+/* Device offset of the volume being checked; non-zero inside an HFS wrapper */
+extern off_t hfsplus_volume_start;
+
 /* Global variables for compatibility */
 extern int options;
 
@@ -41,20 +41,122 @@ int usage(void)
 {
   fprintf(stderr,
 	  "Usage: %s [-t TYPE] [-c CREA] [-|+i] [-|+l] hfs-path [...]\n"
-	  "       %s -b hfs-path\n",
-	  argv0, argv0);
+	  "       %s -b hfs-path\n"
+	  "       %s -x hfs-path [...]\n"
+	  "       %s -X NAME hfs-path\n",
+	  argv0, argv0, argv0, argv0);
 
   return 1;
 }
 
+/*
+ * NAME:	listxattrs()
+ * DESCRIPTION:	output the extended attribute names and sizes of a file
+ */
+static
+int listxattrs(hfsvol *vol, const char *path, int many)
+{
+  hfsdirent ent;
+  char *list = 0, *name;
+  long len, size;
+
+  if (hfs_stat(vol, path, &ent) == -1 ||
+      (len = hfs_listxattr(vol, ent.cnid, 0, 0)) == -1)
+    goto fail;
+
+  if (many)
+    printf("%s:\n", path);
+
+  if (len == 0)
+    return 0;
+
+  list = malloc(len);
+  if (list == 0)
+    {
+      fprintf(stderr, "%s: not enough memory\n", argv0);
+      return -1;
+    }
+
+  len = hfs_listxattr(vol, ent.cnid, list, len);
+  if (len == -1)
+    goto fail;
+
+  for (name = list; name < list + len; name += strlen(name) + 1)
+    {
+      size = hfs_getxattr(vol, ent.cnid, name, 0, 0);
+      if (size == -1)
+	goto fail;
+
+      printf("%9ld %s\n", size, name);
+    }
+
+  free(list);
+
+  return 0;
+
+fail:
+  hfsutil_perrorp(path);
+
+  if (list)
+    free(list);
+
+  return -1;
+}
+
+/*
+ * NAME:	printxattr()
+ * DESCRIPTION:	write the value of an extended attribute to stdout
+ */
+static
+int printxattr(hfsvol *vol, const char *path, const char *name)
+{
+  hfsdirent ent;
+  char *buf = 0;
+  long len;
+
+  if (hfs_stat(vol, path, &ent) == -1 ||
+      (len = hfs_getxattr(vol, ent.cnid, name, 0, 0)) == -1)
+    goto fail;
+
+  buf = malloc(len + 1);
+  if (buf == 0)
+    {
+      fprintf(stderr, "%s: not enough memory\n", argv0);
+      return -1;
+    }
+
+  len = hfs_getxattr(vol, ent.cnid, name, buf, len + 1);
+  if (len == -1)
+    goto fail;
+
+  if (fwrite(buf, 1, len, stdout) != (size_t) len)
+    {
+      perror(argv0);
+      free(buf);
+      return -1;
+    }
+
+  free(buf);
+
+  return 0;
+
+fail:
+  hfsutil_perrorp(path);
+
+  if (buf)
+    free(buf);
+
+  return -1;
+}
+
 /*
  * NAME:	hattrib->main()
  * DESCRIPTION:	implement hattrib command
  */
 int hattrib_main(int argc, char *argv[])
 {
-  const char *type = 0, *crea = 0;
-  int invis = 0, lock = 0, bless = 0;
+  const char *type = 0, *crea = 0, *xname = 0;
+  int invis = 0, lock = 0, bless = 0, xlist = 0;
   hfsvol *vol;
   int fargc;
   char **fargv;
@@ -107,6 +209,17 @@ int hattrib_main(int argc, char *argv[])
 	      bless = 1;
 	      continue;
 
+	    case 'x':
+	      xlist = 1;
+	      continue;
+
+	    case 'X':
+	      xname = argv[++i];
+
+	      if (xname == 0)
+		return usage();
+	      continue;
+
 	    default:
 	      return usage();
 	    }
@@ -144,7 +257,13 @@ int hattrib_main(int argc, char *argv[])
   if (bless && (lock || invis || type || crea || argc - i > 1))
     return usage();
 
-  vol = hfsutil_remount(hcwd_getvol(-1), HFS_MODE_ANY);
+  if ((xlist || xname) &&
+      (bless || lock || invis || type || crea || (xlist && xname) ||
+       (xname && argc - i > 1)))
+    return usage();
+
+  vol = hfsutil_remount(hcwd_getvol(-1),
+			(xlist || xname) ? HFS_MODE_RDONLY : HFS_MODE_ANY);
   if (vol == 0)
     return 1;
 
@@ -154,7 +273,25 @@ int hattrib_main(int argc, char *argv[])
     {
       hfsdirent ent;
 
-      if (bless)
+      if (xlist)
+	{
+	  for (i = 0; i < fargc; ++i)
+	    {
+	      if (listxattrs(vol, fargv[i], fargc > 1) == -1)
+		result = 1;
+	    }
+	}
+      else if (xname)
+	{
+	  if (fargc != 1)
+	    {
+	      fprintf(stderr, "%s: %s: ambiguous path\n", argv0, argv[i]);
+	      result = 1;
+	    }
+	  else if (printxattr(vol, fargv[0], xname) == -1)
+	    result = 1;
+	}
+      else if (bless)
 	{
 	  if (fargc != 1)
 	    {
@@ -43,6 +43,19 @@
 
 extern int optind;
 
+typedef struct {
+  int argc;
+  char **argv;
+  const char *target;
+  int mode;
+  int recursive;
+} copyreq;
+
+typedef struct dirchain {
+  unsigned long cnid;		/* directory being copied */
+  const struct dirchain *up;	/* the directory it was reached from */
+} dirchain;
+
 /*
  * NAME:	automode_unix()
  * DESCRIPTION:	automatically choose copyin transfer mode for UNIX path
@@ -263,6 +276,116 @@ cpofunc automode_hfs(hfsvol *vol, const char *path)
   return cpo_macb;
 }
 
+/*
+ * NAME:	copyout_dir()
+ * DESCRIPTION:	recursively copy a directory from HFS to UNIX
+ */
+static
+int copyout_dir(hfsvol *vol, const char *hfspath, const char *unixpath,
+		int mode, cpofunc copyfile, unsigned long cnid,
+		const dirchain *up)
+{
+  hfsdir *dir;
+  hfsdirent ent;
+  dirchain here;
+  char hfsbuf[PATH_MAX];
+  char unixbuf[PATH_MAX];
+  const char *first;
+  const dirchain *chain;
+  char *ptr;
+  int result = 0;
+
+  here.cnid = cnid;
+  here.up   = up;
+
+  /* Create the UNIX directory */
+  if (mkdir(unixpath, 0777) == -1 && errno != EEXIST)
+    {
+      ERROR(errno, "cannot create directory");
+      hfsutil_perrorp(unixpath);
+      return 1;
+    }
+
+  /* later links to this directory become symbolic links to this copy */
+  if (realpath(unixpath, unixbuf) == 0 ||
+      cpo_remember(cnid, unixbuf) == -1)
+    {
+      ERROR(errno, "cannot record directory");
+      hfsutil_perrorp(unixpath);
+      return 1;
+    }
+
+  dir = hfs_opendir(vol, hfspath);
+  if (dir == 0)
+    {
+      hfsutil_perrorp(hfspath);
+      return 1;
+    }
+
+  while (hfs_readdir(dir, &ent) != -1)
+    {
+      /* Build HFS path; a bare name must stay relative */
+      snprintf(hfsbuf, sizeof(hfsbuf), "%s%s%s%s",
+	       strchr(hfspath, ':') ? "" : ":", hfspath,
+	       hfspath[strlen(hfspath) - 1] == ':' ? "" : ":", ent.name);
+
+      if (ent.flags & HFS_ISDIR)
+	{
+	  for (ptr = ent.name; *ptr; ++ptr)
+	    {
+	      if (*ptr == '/')
+		*ptr = '-';
+	    }
+
+	  snprintf(unixbuf, sizeof(unixbuf), "%s/%s", unixpath, ent.name);
+
+	  /* a directory hard link may lead back up the tree */
+	  for (chain = &here; chain; chain = chain->up)
+	    {
+	      if (chain->cnid == ent.cnid)
+		break;
+	    }
+
+	  if (chain)
+	    {
+	      ERROR(ELOOP, "directory contains itself");
+	      hfsutil_perrorp(hfsbuf);
+	      result = 1;
+	    }
+	  else if ((first = cpo_copied(ent.cnid)) != 0)
+	    {
+	      if (symlink(first, unixbuf) == -1)
+		{
+		  ERROR(errno, "cannot link directory");
+		  hfsutil_perrorp(unixbuf);
+		  result = 1;
+		}
+	    }
+	  else if (copyout_dir(vol, hfsbuf, unixbuf, mode, copyfile,
+			       ent.cnid, &here) != 0)
+	    result = 1;
+	}
+      else
+	{
+	  /* Copy file; further links to the same file become hard links */
+	  cpofunc func = copyfile;
+	  if (mode == 'a')
+	    func = automode_hfs(vol, hfsbuf);
+
+	  if (func(vol, hfsbuf, unixpath) == -1)
+	    {
+	      ERROR(errno, cpo_error);
+	      hfsutil_perrorp(hfsbuf);
+	      result = 1;
+	    }
+	}
+    }
+
+  hfs_closedir(dir);
+
+  return result;
+}
+
 /*
  * NAME:	do_copyout()
  * DESCRIPTION:	copy files from HFS to UNIX
@@ -304,15 +427,40 @@ int do_copyout(hfsvol *vol, int argc, char *argv[], const char *dest,
       break;
     }
 
+  if (recursive && cpo_links(1) == -1)
+    {
+      ERROR(errno, cpo_error);
+      hfsutil_perrorp(dest);
+
+      return 1;
+    }
+
   for (i = 0; i < argc; ++i)
     {
       if (hfs_stat(vol, argv[i], &ent) != -1 &&
 	  (ent.flags & HFS_ISDIR))
 	{
-	  ERROR(EISDIR, 0);
-	  hfsutil_perrorp(argv[i]);
+	  if (! recursive)
+	    {
+	      ERROR(EISDIR, 0);
+	      hfsutil_perrorp(argv[i]);
 
-	  result = 1;
+	      result = 1;
+	    }
+	  else
+	    {
+	      char unixbuf[PATH_MAX];
+
+	      /* copy into an existing directory, or create the target */
+	      if (stat(dest, &sbuf) != -1 && S_ISDIR(sbuf.st_mode))
+		snprintf(unixbuf, sizeof(unixbuf), "%s/%s", dest, ent.name);
+	      else
+		snprintf(unixbuf, sizeof(unixbuf), "%s", dest);
+
+	      if (copyout_dir(vol, argv[i], unixbuf, mode, copyfile,
+			      ent.cnid, 0) != 0)
+		result = 1;
+	    }
 	}
       else
 	{
@@ -329,6 +477,49 @@ int do_copyout(hfsvol *vol, int argc, char *argv[], const char *dest,
 	}
     }
 
+  if (recursive)
+    cpo_links(0);
+
+  return result;
+}
+
+/*
+ * NAME:	copypart()
+ * DESCRIPTION:	copy from one partition of a -P run into its own directory
+ */
+static
+int copypart(hfsvol *vol, const hfspartent *part, void *data)
+{
+  const copyreq *req = data;
+  char dest[PATH_MAX];
+  int fargc, result = 0;
+  char **fargv;
+
+  /* a medium without a partition map is copied straight to the target */
+
+  if (part->pnum == 0)
+    snprintf(dest, sizeof(dest), "%s", req->target);
+  else
+    {
+      snprintf(dest, sizeof(dest), "%s/%d", req->target, part->pnum);
+
+      if (mkdir(dest, 0777) == -1 && errno != EEXIST)
+	{
+	  ERROR(errno, 0);
+	  hfsutil_perrorp(dest);
+
+	  return 1;
+	}
+    }
+
+  fargv = hfsutil_glob(vol, req->argc, req->argv, &fargc, &result);
+
+  if (result == 0)
+    result = do_copyout(vol, fargc, fargv, dest, req->mode, req->recursive);
+
+  if (fargv)
+    free(fargv);
+
   return result;
 }
 
@@ -341,6 +532,8 @@ int usage(void)
 {
   fprintf(stderr, "Usage: %s [-m|-b|-t|-r|-a] [-R] source-path [...] target-path\n",
 	  argv0);
+  fprintf(stderr, "       %s -P [-m|-b|-t|-r|-a] [-R] hfs-path [...] unix-directory\n",
+	  argv0);
 
   return 1;
 }
@@ -351,7 +544,7 @@ int usage(void)
  */
 int hcopy_main(int argc, char *argv[])
 {
-  int nargs, mode = 'a', result = 0, recursive = 0;
+  int nargs, mode = 'a', result = 0, recursive = 0, allparts = 0;
   const char *target;
   int fargc;
   char **fargv;
@@ -362,7 +555,7 @@ int hcopy_main(int argc, char *argv[])
     {
       int opt;
 
-      opt = getopt(argc, argv, "mbtraR");
+      opt = getopt(argc, argv, "mbtraPR");
       if (opt == EOF)
 	break;
 
@@ -371,6 +564,10 @@ int hcopy_main(int argc, char *argv[])
 	case '?':
 	  return usage();
 
+	case 'P':
+	  allparts = 1;
+	  break;
+
 	case 'R':
 	  recursive = 1;
 	  break;
@@ -387,6 +584,34 @@ int hcopy_main(int argc, char *argv[])
 
   target = argv[argc - 1];
 
+  /* every HFS partition of the current medium, each in a child */
+
+  if (allparts)
+    {
+      struct stat sbuf;
+      copyreq req;
+
+      if (strchr(target, ':') && target[0] != '.' && target[0] != '/')
+	return usage();
+
+      if (stat(target, &sbuf) == -1 || ! S_ISDIR(sbuf.st_mode))
+	{
+	  ERROR(ENOTDIR, 0);
+	  hfsutil_perrorp(target);
+
+	  return 1;
+	}
+
+      req.argc      = nargs - 1;
+      req.argv      = &argv[optind];
+      req.target    = target;
+      req.mode      = mode;
+      req.recursive = recursive;
+
+      return hfsutil_allparts(hcwd_getvol(-1), HFS_MODE_RDONLY,
+			      copypart, &req);
+    }
+
   if (strchr(target, ':') && target[0] != '.' && target[0] != '/')
     {
       vol = hfsutil_remount(hcwd_getvol(-1), HFS_MODE_ANY);
@@ -0,0 +1,126 @@
+/*
+ * hfsutils - tools for reading and writing Macintosh HFS volumes
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+# ifdef HAVE_CONFIG_H
+#  include "../../include/config.h"
+# endif
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <unistd.h>
+
+# include "hfs.h"
+# include "hcwd.h"
+# include "hfsutil.h"
+# include "hdefrag.h"
+
+/*
+ * NAME:	usage()
+ * DESCRIPTION:	display usage message
+ */
+static
+int usage(void)
+{
+  fprintf(stderr, "Usage: %s [-n] [-s]\n", bargv0);
+
+  return 1;
+}
+
+/*
+ * NAME:	hdefrag->main()
+ * DESCRIPTION:	implement hdefrag command
+ */
+int hdefrag_main(int argc, char *argv[])
+{
+  hfsvol *vol;
+  hfsvolent vent;
+  hfsdefragent ent;
+  int flags = 0, result = 0;
+
+  while (1)
+    {
+      int opt;
+
+      opt = getopt(argc, argv, "ns");
+      if (opt == EOF)
+	break;
+
+      switch (opt)
+	{
+	case 'n':
+	  flags |= HFS_DEFRAG_DRYRUN;
+	  break;
+
+	case 's':
+	  flags |= HFS_DEFRAG_NOCOMPACT;
+	  break;
+
+	default:
+	  return usage();
+	}
+    }
+
+  if (optind != argc)
+    return usage();
+
+  vol = hfsutil_remount(hcwd_getvol(-1),
+			(flags & HFS_DEFRAG_DRYRUN) ? HFS_MODE_RDONLY :
+			HFS_MODE_RDWR);
+  if (vol == 0)
+    return 1;
+
+  hfs_vstat(vol, &vent);
+
+  if (hfs_defrag(vol, flags, &ent) == -1)
+    {
+      hfsutil_perror(vent.name);
+      result = 1;
+    }
+  else
+    {
+      printf("%s: %lu of %lu forks fragmented into %lu extents"
+	     " (%lu in overflow records)\n", vent.name,
+	     ent.fragmented, ent.forks, ent.extents, ent.overflow);
+
+      if (! (flags & HFS_DEFRAG_DRYRUN))
+	{
+	  printf("%s: %lu forks made contiguous, %lu left for want of"
+		 " a free run\n", vent.name, ent.defragged, ent.skipped);
+
+	  if (! (flags & HFS_DEFRAG_NOCOMPACT))
+	    printf("%s: %lu forks moved down to gather free space\n",
+		   vent.name, ent.compacted);
+	}
+
+      if (flags & HFS_DEFRAG_DRYRUN)
+	printf("%s: free space in %lu runs, largest %lu bytes", vent.name,
+	       ent.freeruns[0], ent.maxfree[0]);
+      else
+	printf("%s: free space in %lu runs, largest %lu bytes"
+	       " (was %lu runs, largest %lu bytes)", vent.name,
+	       ent.freeruns[1], ent.maxfree[1],
+	       ent.freeruns[0], ent.maxfree[0]);
+
+      printf("\n");
+    }
+
+  hfsutil_unmount(vol, &result);
+
+  return result;
+}
@@ -0,0 +1,343 @@
+/*
+ * hfsutils - tools for reading and writing Macintosh HFS volumes
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+# ifdef HAVE_CONFIG_H
+#  include "../../include/config.h"
+# endif
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <unistd.h>
+
+# include "hfs.h"
+# include "hcwd.h"
+# include "hfsutil.h"
+# include "charset.h"
+# include "hfrag.h"
+
+/*
+ * NAME:	usage()
+ * DESCRIPTION:	display usage message
+ */
+static
+int usage(void)
+{
+  fprintf(stderr, "Usage: %s [-j]\n", bargv0);
+
+  return 1;
+}
+
+/*
+ * NAME:	percent()
+ * DESCRIPTION:	return part as a percentage of whole
+ */
+static
+unsigned int percent(unsigned long part, unsigned long whole)
+{
+  return whole ? (unsigned int) ((double) part * 100 / whole + 0.5) : 0;
+}
+
+/*
+ * NAME:	histrange()
+ * DESCRIPTION:	format the range of values held by a histogram bucket
+ */
+static
+void histrange(char *str, int b)
+{
+  unsigned long lo = 1UL << b;
+
+  if (b == HFS_HISTSZ - 1)
+    sprintf(str, "%lu+", lo);
+  else if (b == 0)
+    sprintf(str, "1");
+  else
+    sprintf(str, "%lu-%lu", lo, (lo << 1) - 1);
+}
+
+/*
+ * NAME:	showhist()
+ * DESCRIPTION:	print the non-empty buckets of a histogram
+ */
+static
+void showhist(const char *title, const unsigned long *hist)
+{
+  unsigned long total = 0;
+  char range[32];
+  int b;
+
+  for (b = 0; b < HFS_HISTSZ; ++b)
+    total += hist[b];
+
+  printf("%s:\n", title);
+
+  for (b = 0; b < HFS_HISTSZ; ++b)
+    {
+      if (hist[b] == 0)
+	continue;
+
+      histrange(range, b);
+      printf("  %12s  %8lu  %3u%%\n", range, hist[b],
+	     percent(hist[b], total));
+    }
+}
+
+/*
+ * NAME:	showtree()
+ * DESCRIPTION:	print the layout statistics of one B*-tree
+ */
+static
+void showtree(const char *title, const hfstreestat *st)
+{
+  if (st->nodes == 0)
+    return;
+
+  printf("  %-10s depth %u, %lu of %lu nodes in use, %lu records,"
+	 " %lu extent%s\n", title, st->depth, st->nodes - st->freenodes,
+	 st->nodes, st->records, st->extents, st->extents == 1 ? "" : "s");
+  printf("  %-10s leaf fill %u%% over %lu nodes, index fill %u%% over"
+	 " %lu nodes\n", "", percent(st->leafused, st->leaves * st->nodesz),
+	 st->leaves, percent(st->indexused, st->index * st->nodesz),
+	 st->index);
+  printf("  %-10s leaf chain: %lu jumps (%lu backward), %lu KB seeked\n",
+	 "", st->jumps, st->backward, st->distance);
+}
+
+/*
+ * NAME:	showtext()
+ * DESCRIPTION:	print the report for people
+ */
+static
+void showtext(const hfsvolent *vent, const hfsfragent *ent)
+{
+  unsigned int i;
+
+  printf("%s: %lu forks in %lu extents, %lu fragmented"
+	 " (%lu extents in overflow records), %lu-byte blocks\n\n",
+	 vent->name, ent->forks, ent->extents, ent->fragmented,
+	 ent->overflow, ent->blocksz);
+
+  showhist("Extents per fork", ent->exthist);
+
+  if (ent->nworst)
+    {
+      printf("\nMost fragmented forks:\n");
+      printf("  %8s  %8s  %10s  %-4s  %s\n",
+	     "extents", "blocks", "id", "fork", "name");
+
+      for (i = 0; i < ent->nworst; ++i)
+	printf("  %8lu  %8lu  %10lu  %-4s  %s\n", ent->worst[i].extents,
+	       ent->worst[i].blocks, ent->worst[i].cnid,
+	       ent->worst[i].rsrc ? "rsrc" : "data", ent->worst[i].name);
+    }
+
+  printf("\nFree space: %lu blocks in %lu runs, largest %lu blocks\n",
+	 ent->freeblocks, ent->freeruns, ent->maxfree);
+
+  if (ent->freeruns)
+    showhist("Free run length (blocks)", ent->freehist);
+
+  printf("\nB*-trees:\n");
+
+  showtree("catalog", &ent->cat);
+  showtree("extents", &ent->ext);
+  showtree("attributes", &ent->attr);
+}
+
+/*
+ * NAME:	jsonstr()
+ * DESCRIPTION:	print a MacOS Standard Roman string as a JSON string
+ */
+static
+void jsonstr(const char *str)
+{
+  UCS2 *ucs, *ptr;
+
+  ucs = cs_unicode((char *) str, 0);
+  if (ucs == 0)
+    {
+      printf("null");
+      return;
+    }
+
+  putchar('"');
+
+  for (ptr = ucs; *ptr; ++ptr)
+    {
+      if (*ptr == '"' || *ptr == '\\')
+	printf("\\%c", *ptr);
+      else if (*ptr < 0x20 || *ptr >= 0x7f)
+	printf("\\u%04x", *ptr);
+      else
+	putchar(*ptr);
+    }
+
+  putchar('"');
+
+  free(ucs);
+}
+
+/*
+ * NAME:	jsonhist()
+ * DESCRIPTION:	print the non-empty buckets of a histogram as JSON
+ */
+static
+void jsonhist(const char *count, const unsigned long *hist)
+{
+  int b, first = 1;
+
+  printf("[");
+
+  for (b = 0; b < HFS_HISTSZ; ++b)
+    {
+      if (hist[b] == 0)
+	continue;
+
+      printf("%s{\"min\":%lu,", first ? "" : ",", 1UL << b);
+
+      if (b == HFS_HISTSZ - 1)
+	printf("\"max\":null,");
+      else
+	printf("\"max\":%lu,", (2UL << b) - 1);
+
+      printf("\"%s\":%lu}", count, hist[b]);
+      first = 0;
+    }
+
+  printf("]");
+}
+
+/*
+ * NAME:	jsontree()
+ * DESCRIPTION:	print the layout statistics of one B*-tree as JSON
+ */
+static
+void jsontree(const hfstreestat *st)
+{
+  if (st->nodes == 0)
+    {
+      printf("null");
+      return;
+    }
+
+  printf("{\"node_size\":%lu,\"nodes\":%lu,\"free_nodes\":%lu,"
+	 "\"depth\":%u,\"records\":%lu,\"extents\":%lu,"
+	 "\"leaf_nodes\":%lu,\"leaf_fill\":%u,"
+	 "\"index_nodes\":%lu,\"index_fill\":%u,"
+	 "\"leaf_jumps\":%lu,\"leaf_backward\":%lu,\"leaf_seek_kb\":%lu}",
+	 st->nodesz, st->nodes, st->freenodes, st->depth, st->records,
+	 st->extents, st->leaves, percent(st->leafused, st->leaves * st->nodesz),
+	 st->index, percent(st->indexused, st->index * st->nodesz),
+	 st->jumps, st->backward, st->distance);
+}
+
+/*
+ * NAME:	showjson()
+ * DESCRIPTION:	print the report as a single JSON object
+ */
+static
+void showjson(const hfsvolent *vent, const hfsfragent *ent)
+{
+  unsigned int i;
+
+  printf("{\"volume\":");
+  jsonstr(vent->name);
+
+  printf(",\"block_size\":%lu,\"forks\":%lu,\"fragmented\":%lu,"
+	 "\"extents\":%lu,\"overflow_extents\":%lu,\"extent_histogram\":",
+	 ent->blocksz, ent->forks, ent->fragmented, ent->extents,
+	 ent->overflow);
+  jsonhist("forks", ent->exthist);
+
+  printf(",\"worst\":[");
+
+  for (i = 0; i < ent->nworst; ++i)
+    {
+      printf("%s{\"id\":%lu,\"name\":", i ? "," : "", ent->worst[i].cnid);
+      jsonstr(ent->worst[i].name);
+      printf(",\"fork\":\"%s\",\"extents\":%lu,\"blocks\":%lu}",
+	     ent->worst[i].rsrc ? "rsrc" : "data",
+	     ent->worst[i].extents, ent->worst[i].blocks);
+    }
+
+  printf("],\"free\":{\"blocks\":%lu,\"runs\":%lu,\"largest\":%lu,"
+	 "\"histogram\":", ent->freeblocks, ent->freeruns, ent->maxfree);
+  jsonhist("runs", ent->freehist);
+
+  printf("},\"trees\":{\"catalog\":");
+  jsontree(&ent->cat);
+  printf(",\"extents\":");
+  jsontree(&ent->ext);
+  printf(",\"attributes\":");
+  jsontree(&ent->attr);
+  printf("}}\n");
+}
+
+/*
+ * NAME:	hfrag->main()
+ * DESCRIPTION:	implement hfrag command
+ */
+int hfrag_main(int argc, char *argv[])
+{
+  hfsvol *vol;
+  hfsvolent vent;
+  hfsfragent ent;
+  int json = 0, result = 0;
+
+  while (1)
+    {
+      int opt;
+
+      opt = getopt(argc, argv, "j");
+      if (opt == EOF)
+	break;
+
+      switch (opt)
+	{
+	case 'j':
+	  json = 1;
+	  break;
+
+	default:
+	  return usage();
+	}
+    }
+
+  if (optind != argc)
+    return usage();
+
+  vol = hfsutil_remount(hcwd_getvol(-1), HFS_MODE_RDONLY);
+  if (vol == 0)
+    return 1;
+
+  hfs_vstat(vol, &vent);
+
+  if (hfs_fragstat(vol, &ent) == -1)
+    {
+      hfsutil_perror(vent.name);
+      result = 1;
+    }
+  else if (json)
+    showjson(&vent, &ent);
+  else
+    showtext(&vent, &ent);
+
+  hfsutil_unmount(vol, &result);
+
+  return result;
+}
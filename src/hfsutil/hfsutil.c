@@ -30,8 +30,10 @@
 # include <ctype.h>
 # include <errno.h>
 # include <sys/stat.h>
+# include <sys/wait.h>
 
 # include <unistd.h>
+# include <fcntl.h>
 
 # include "hfs.h"
 # include "hcwd.h"
@@ -43,13 +45,16 @@
 # include "hattrib.h"
 # include "hcd.h"
 # include "hcopy.h"
+# include "hdefrag.h"
 # include "hdel.h"
 # include "hformat.h"
+# include "hfrag.h"
 # include "hls.h"
 # include "hmkdir.h"
 # include "hmount.h"
 # include "hpwd.h"
 # include "hrename.h"
+# include "hresize.h"
 # include "hrmdir.h"
 # include "humount.h"
 # include "hvol.h"
@@ -72,14 +77,17 @@ int main(int argc, char *argv[])
     { "hattrib", hattrib_main },
     { "hcd",     hcd_main     },
     { "hcopy",   hcopy_main   },
+    { "hdefrag", hdefrag_main },
     { "hdel",    hdel_main    },
     { "hdir",    hls_main     },
     { "hformat", hformat_main },
+    { "hfrag",   hfrag_main   },
     { "hls",     hls_main     },
     { "hmkdir",  hmkdir_main  },
     { "hmount",  hmount_main  },
     { "hpwd",    hpwd_main    },
     { "hrename", hrename_main },
+    { "hresize", hresize_main },
     { "hrmdir",  hrmdir_main  },
     { "humount", humount_main },
     { "hvol",    hvol_main    },
@@ -266,6 +274,203 @@ void hfsutil_unmount(hfsvol *vol, int *result)
     }
 }
 
+/*
+ * NAME:	runpart()
+ * DESCRIPTION:	mount one partition in a forked child and run a function on
+ *		it, with its output going to the child's logs; never returns
+ */
+static
+void runpart(const char *path, const hfspartent *part, int mode,
+	     partfunc func, void *data, FILE *out, FILE *err)
+{
+  hfsvol *vol;
+  int fd, result = 0;
+
+  /* nothing can be asked, and nothing may reach the terminal */
+
+  fd = open("/dev/null", O_RDONLY);
+  if (fd != -1)
+    {
+      dup2(fd, STDIN_FILENO);
+      close(fd);
+    }
+
+  dup2(fileno(out), STDOUT_FILENO);
+  dup2(fileno(err), STDERR_FILENO);
+
+  suid_enable();
+  vol = hfs_mountpart(path, part, mode);
+  suid_disable();
+
+  if (vol == 0)
+    {
+      char *label;
+
+      label = malloc(strlen(path) + 32);
+      if (label)
+	sprintf(label, "%s (partition %d)", path, part->pnum);
+
+      hfsutil_perror(label ? label : path);
+      result = 1;
+    }
+  else
+    {
+      result = func(vol, part, data);
+      hfsutil_unmount(vol, &result);
+    }
+
+  fflush(0);
+  _exit(result);
+}
+
+/*
+ * NAME:	copylog()
+ * DESCRIPTION:	pass a finished child's log to a stream and close it
+ */
+static
+void copylog(FILE *log, FILE *stream)
+{
+  char buf[4096];
+  size_t len;
+
+  rewind(log);
+
+  while ((len = fread(buf, 1, sizeof(buf), log)) > 0)
+    fwrite(buf, 1, len, stream);
+
+  fflush(stream);
+  fclose(log);
+}
+
+/*
+ * NAME:	hfsutil->allparts()
+ * DESCRIPTION:	run a function on every HFS partition of a medium at once
+ */
+int hfsutil_allparts(mountent *ment, int mode, partfunc func, void *data)
+{
+  hfspartent *parts, whole;
+  hfsvol *vol;
+  pid_t *pids;
+  FILE **logs;
+  int nparts, i, status, result = 0;
+
+  if (ment == 0)
+    {
+      fprintf(stderr, "%s: No volume is current; use `hmount' or `hvol'\n",
+	      argv0);
+      return 1;
+    }
+
+  suid_enable();
+  nparts = hfs_partitions(ment->path, &parts);
+  suid_disable();
+
+  /* a medium without a partition map holds a single volume */
+
+  if (nparts == -1)
+    {
+      suid_enable();
+      vol = hfs_mount(ment->path, 0, mode);
+      suid_disable();
+
+      if (vol == 0)
+	{
+	  hfsutil_perror(ment->path);
+	  return 1;
+	}
+
+      memset(&whole, 0, sizeof(whole));
+
+      result = func(vol, &whole, data);
+      hfsutil_unmount(vol, &result);
+
+      return result;
+    }
+
+  if (nparts == 0)
+    {
+      fprintf(stderr, "%s: %s: medium contains no HFS partitions\n",
+	      argv0, ment->path);
+      return 1;
+    }
+
+  pids = malloc(nparts * sizeof(*pids));
+  logs = malloc(2 * nparts * sizeof(*logs));
+  if (pids == 0 || logs == 0)
+    {
+      fprintf(stderr, "%s: not enough memory\n", argv0);
+      free(pids);
+      free(logs);
+      free(parts);
+      return 1;
+    }
+
+  /* the partition table was read once; every child inherits it */
+
+  for (i = 0; i < nparts; ++i)
+    {
+      pids[i] = -1;
+
+      logs[2 * i]     = tmpfile();
+      logs[2 * i + 1] = tmpfile();
+      if (logs[2 * i] == 0 || logs[2 * i + 1] == 0)
+	{
+	  fprintf(stderr, "%s: %s (partition %d): cannot create log: %s\n",
+		  argv0, ment->path, parts[i].pnum, strerror(errno));
+	  result = 1;
+	  continue;
+	}
+
+      fflush(0);
+
+      pids[i] = fork();
+      if (pids[i] == 0)
+	runpart(ment->path, &parts[i], mode, func, data,
+		logs[2 * i], logs[2 * i + 1]);
+
+      if (pids[i] == -1)
+	{
+	  fprintf(stderr, "%s: %s (partition %d): cannot fork: %s\n",
+		  argv0, ment->path, parts[i].pnum, strerror(errno));
+	  result = 1;
+	}
+    }
+
+  /* report in partition map order, each partition as one block */
+
+  for (i = 0; i < nparts; ++i)
+    {
+      if (pids[i] != -1)
+	{
+	  while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR)
+	    ;
+
+	  if (! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    result = 1;
+
+	  copylog(logs[2 * i], stdout);
+	  copylog(logs[2 * i + 1], stderr);
+
+	  if (WIFSIGNALED(status))
+	    fprintf(stderr, "%s: %s (partition %d): killed by signal %d\n",
+		    argv0, ment->path, parts[i].pnum, WTERMSIG(status));
+	}
+      else
+	{
+	  if (logs[2 * i])
+	    fclose(logs[2 * i]);
+	  if (logs[2 * i + 1])
+	    fclose(logs[2 * i + 1]);
+	}
+    }
+
+  free(pids);
+  free(logs);
+  free(parts);
+
+  return result;
+}
+
 /*
  * NAME:	hfsutil->pinfo()
  * DESCRIPTION:	print information about a volume
@@ -304,7 +509,7 @@ char **hfsutil_glob(hfsvol *vol, int argc, char *argv[],
  */
 char *hfsutil_getcwd(hfsvol *vol)
 {
-  char *path, name[HFS_MAX_FLEN + 1 + 1];
+  char *path, name[HFSPLUS_MAX_NLEN + 1 + 1];
   unsigned long cwd;
   int pathlen;
 
@@ -62,6 +62,7 @@ int ioctl(int, int, ...);
 # define HLS_RECURSIVE		0x0200
 # define HLS_NAME		0x0400
 # define HLS_SPACE		0x0800
+# define HLS_XATTRS		0x1000
 
 # define F_MASK			0x0007
 # define F_LONG			0x0000
@@ -90,6 +91,17 @@ typedef struct _queueent_ {
 extern char *optarg;
 extern int optind;
 
+/* volume being listed, for extended attribute lookups */
+static hfsvol *xvol;
+
+typedef struct {
+  int argc;
+  char **argv;
+  int flags;
+  int options;
+  int width;
+} lsreq;
+
 /*
  * NAME:	usage()
  * DESCRIPTION:	display usage message
@@ -378,6 +390,37 @@ void showmisc(hfsdirent *ent, int flags)
     printf("%4lu ", size / 1024 + (size % 1024 != 0));
 }
 
+/*
+ * NAME:	showxattrs()
+ * DESCRIPTION:	output the extended attribute names and sizes of an entry
+ */
+static
+void showxattrs(hfsdirent *ent)
+{
+  char *list, *name;
+  long len, size;
+
+  len = hfs_listxattr(xvol, ent->cnid, 0, 0);
+  if (len <= 0)
+    return;
+
+  list = malloc(len);
+  if (list == 0)
+    return;
+
+  len = hfs_listxattr(xvol, ent->cnid, list, len);
+
+  for (name = list; len > 0 && name < list + len;
+       name += strlen(name) + 1)
+    {
+      size = hfs_getxattr(xvol, ent->cnid, name, 0, 0);
+      if (size >= 0)
+	printf("\t%s\t%9ld\n", name, size);
+    }
+
+  free(list);
+}
+
 /*
  * NAME:	show_long()
  * DESCRIPTION:	output a list of files in long format
@@ -435,6 +478,9 @@ void show_long(int sz, queueent *ents, char **strs,
 	       ent->u.file.type, ent->u.file.creator,
 	       ent->u.file.rsize, ent->u.file.dsize,
 	       timebuf + 4, strs[i]);
+
+      if (flags & HLS_XATTRS)
+	showxattrs(ent);
     }
 }
 
@@ -675,6 +721,8 @@ int process(hfsvol *vol, darray *dirs, darray *files,
   queueent *ents;
   int result = 0;
 
+  xvol = vol;
+
   dsz = darr_size(dirs);
   fsz = darr_size(files);
 
@@ -822,6 +870,84 @@ int queuepath(hfsvol *vol, char *path, darray *dirs, darray *files, int flags)
   return 0;
 }
 
+/*
+ * NAME:	list()
+ * DESCRIPTION:	list the named files and directories of a mounted volume
+ */
+static
+int list(hfsvol *vol, int argc, char *argv[],
+	 int flags, int options, int width)
+{
+  int fargc, i;
+  char **fargv = 0;
+  int result = 0;
+  darray *dirs, *files;
+
+  fargv = hfsutil_glob(vol, argc, argv, &fargc, &result);
+
+  dirs  = qnew();
+  files = qnew();
+  if (result == 0 && (dirs == 0 || files == 0))
+    {
+      fprintf(stderr, "%s: not enough memory\n", argv0);
+      result = 1;
+    }
+
+  if (result == 0)
+    {
+      if (fargc == 0)
+	{
+	  if (queuepath(vol, ":", dirs, files, flags) == -1)
+	    result = 1;
+	}
+      else
+	{
+	  for (i = 0; i < fargc; ++i)
+	    {
+	      if (queuepath(vol, fargv[i], dirs, files, flags) == -1)
+		{
+		  result = 1;
+		  break;
+		}
+	    }
+	}
+    }
+
+  if (result == 0 && process(vol, dirs, files, flags, options, width) == -1)
+    result = 1;
+
+  if (files)
+    qfree(files);
+  if (dirs)
+    qfree(dirs);
+
+  if (fargv)
+    free(fargv);
+
+  return result;
+}
+
+/*
+ * NAME:	listpart()
+ * DESCRIPTION:	list one partition of a -P run under its own heading
+ */
+static
+int listpart(hfsvol *vol, const hfspartent *part, void *data)
+{
+  const lsreq *req = data;
+  hfsvolent vent;
+
+  if (part->pnum > 0)
+    {
+      hfs_vstat(vol, &vent);
+      printf("%s%s (partition %d):\n",
+	     part->pnum > 1 ? "\n" : "", vent.name, part->pnum);
+    }
+
+  return list(vol, req->argc, req->argv,
+	      req->flags, req->options, req->width);
+}
+
 /*
  * NAME:	hls->main()
  * DESCRIPTION:	implement hls command
@@ -829,12 +955,9 @@ int queuepath(hfsvol *vol, char *path, darray *dirs, darray *files, int flags)
 int hls_main(int argc, char *argv[])
 {
   hfsvol *vol;
-  int fargc, i;
-  char **fargv = 0;
-  int result = 0;
+  int result = 0, allparts = 0;
   int flags, options, width;
   char *ptr;
-  darray *dirs, *files;
 
   options = T_MOD | S_NAME;
 
@@ -869,7 +992,7 @@ int hls_main(int argc, char *argv[])
     {
       int opt;
 
-      opt = getopt(argc, argv, "1abcdfilmqrstxw:CFNQRSU");
+      opt = getopt(argc, argv, "1@abcdfilmqrstxw:CFNPQRSU");
       if (opt == EOF)
 	break;
 
@@ -882,6 +1005,10 @@ int hls_main(int argc, char *argv[])
 	  options = (options & ~F_MASK) | F_ONE;
 	  break;
 
+	case '@':
+	  flags |= HLS_XATTRS;
+	  break;
+
 	case 'a':
 	  flags |= HLS_ALL_FILES;
 	  break;
@@ -957,6 +1084,10 @@ int hls_main(int argc, char *argv[])
 	  flags &= ~(HLS_ESCAPE | HLS_QMARK_CTRL);
 	  break;
 
+	case 'P':
+	  allparts = 1;
+	  break;
+
 	case 'Q':
 	  flags |= HLS_QUOTE | HLS_ESCAPE;
 	  flags &= ~HLS_QMARK_CTRL;
@@ -976,52 +1107,29 @@ int hls_main(int argc, char *argv[])
 	}
     }
 
-  vol = hfsutil_remount(hcwd_getvol(-1), HFS_MODE_RDONLY);
-  if (vol == 0)
-    return 1;
-
-  fargv = hfsutil_glob(vol, argc - optind, &argv[optind], &fargc, &result);
+  /* every HFS partition of the current medium, each in a child */
 
-  dirs  = qnew();
-  files = qnew();
-  if (result == 0 && (dirs == 0 || files == 0))
+  if (allparts)
     {
-      fprintf(stderr, "%s: not enough memory\n", argv0);
-      result = 1;
-    }
+      lsreq req;
 
-  if (result == 0)
-    {
-      if (fargc == 0)
-	{
-	  if (queuepath(vol, ":", dirs, files, flags) == -1)
-	    result = 1;
-	}
-      else
-	{
-	  for (i = 0; i < fargc; ++i)
-	    {
-	      if (queuepath(vol, fargv[i], dirs, files, flags) == -1)
-		{
-		  result = 1;
-		  break;
-		}
-	    }
-	}
+      req.argc    = argc - optind;
+      req.argv    = &argv[optind];
+      req.flags   = flags;
+      req.options = options;
+      req.width   = width;
+
+      return hfsutil_allparts(hcwd_getvol(-1), HFS_MODE_RDONLY,
+			      listpart, &req);
     }
 
-  if (result == 0 && process(vol, dirs, files, flags, options, width) == -1)
-    result = 1;
+  vol = hfsutil_remount(hcwd_getvol(-1), HFS_MODE_RDONLY);
+  if (vol == 0)
+    return 1;
 
-  if (files)
-    qfree(files);
-  if (dirs)
-    qfree(dirs);
+  result = list(vol, argc - optind, &argv[optind], flags, options, width);
 
   hfsutil_unmount(vol, &result);
 
-  if (fargv)
-    free(fargv);
-
   return result;
 }
@@ -0,0 +1,166 @@
+/*
+ * hfsutils - tools for reading and writing Macintosh HFS volumes
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+# ifdef HAVE_CONFIG_H
+#  include "../../include/config.h"
+# endif
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <unistd.h>
+# include <sys/stat.h>
+
+# include "hfs.h"
+# include "hcwd.h"
+# include "hfsutil.h"
+# include "suid.h"
+# include "hresize.h"
+
+/*
+ * NAME:	getsize()
+ * DESCRIPTION:	parse a size in bytes with optional K, M or G suffix
+ */
+static
+unsigned long getsize(const char *str)
+{
+  unsigned long long size;
+  char *end;
+
+  size = strtoull(str, &end, 10);
+
+  switch (*end)
+    {
+    case 'G':
+    case 'g':
+      size <<= 10;
+      /* fall through */
+    case 'M':
+    case 'm':
+      size <<= 10;
+      /* fall through */
+    case 'K':
+    case 'k':
+      size <<= 10;
+      ++end;
+    }
+
+  if (end == str || *end != 0 || (size >> 9) > 0xffffffffULL)
+    return 0;
+
+  return (unsigned long) (size >> 9);
+}
+
+/*
+ * NAME:	hresize->main()
+ * DESCRIPTION:	implement hresize command
+ */
+int hresize_main(int argc, char *argv[])
+{
+  char *path = 0;
+  hfsvol *vol;
+  hfsvolent ent;
+  struct stat st;
+  unsigned long len;
+  int nparts, partno, result = 0;
+
+  if (argc < 3 || argc > 4)
+    {
+      fprintf(stderr, "Usage: %s source-path [partition-no] size\n", bargv0);
+      goto fail;
+    }
+
+  len = getsize(argv[argc - 1]);
+  if (len == 0)
+    {
+      fprintf(stderr, "%s: invalid size \"%s\"\n", argv0, argv[argc - 1]);
+      goto fail;
+    }
+
+  path = hfsutil_abspath(argv[1]);
+  if (path == 0)
+    {
+      fprintf(stderr, "%s: not enough memory\n", argv0);
+      goto fail;
+    }
+
+  suid_enable();
+  nparts = hfs_nparts(path);
+  suid_disable();
+
+  if (argc == 4)
+    partno = atoi(argv[2]);
+  else
+    {
+      if (nparts > 1)
+	{
+	  fprintf(stderr, "%s: must specify partition number\n", argv0);
+	  goto fail;
+	}
+      else if (nparts == -1)
+	partno = 0;
+      else
+	partno = 1;
+    }
+
+  suid_enable();
+  vol = hfs_mount(path, partno, HFS_MODE_RDWR);
+  suid_disable();
+
+  if (vol == 0)
+    {
+      hfsutil_perror(path);
+      goto fail;
+    }
+
+  hfs_vstat(vol, &ent);
+
+  if (hfs_resize(vol, len) == -1)
+    {
+      hfsutil_perror(path);
+      result = 1;
+    }
+  else
+    printf("%s: resized to %lu bytes\n", ent.name, len << 9);
+
+  hfsutil_unmount(vol, &result);
+
+  /* a shrunken image file gives back the space past the new end */
+
+  if (result == 0 && partno == 0 && stat(path, &st) == 0 &&
+      S_ISREG(st.st_mode) && st.st_size > (off_t) len << 9)
+    {
+      suid_enable();
+      if (truncate(path, (off_t) len << 9) == -1)
+	{
+	  perror(path);
+	  result = 1;
+	}
+      suid_disable();
+    }
+
+  free(path);
+
+  return result;
+
+fail:
+  if (path)
+    free(path);
+
+  return 1;
+}
@@ -0,0 +1,576 @@
+/*
+ * mkfs_batch.c - Format the volumes listed in a manifest
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mkfs -b reads the whole manifest before anything is formatted, so a
+ * mistake on its last line costs no half-finished batch.  Empty volumes
+ * of the same type and size share one template: their parameters, boot
+ * blocks, bitmap and extents file are worked out once in the parent and
+ * inherited by every worker.  The format code keeps its state in
+ * globals, so each volume is formatted in its own forked worker, with
+ * its output collected in a temporary file and printed as one block,
+ * every line prefixed with the volume's path, when the worker exits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "../embedded/mkfs/mkfs_hfs.h"
+#include "mkfs_common.h"
+#include "mkfs_batch.h"
+
+/* Fields of a manifest line */
+#define BATCH_FIELDS    5
+
+/* One volume of the manifest */
+typedef struct {
+    char *path;
+    long long size;             /* 0 for the device's own size */
+    int hfsplus;
+    char *name;                 /* NULL for the -l name */
+    char *dir;                  /* NULL for an empty volume */
+    int line;
+    mkfs_template_t *tmpl;      /* Shared with the other empty volumes alike */
+} batch_entry_t;
+
+typedef struct {
+    batch_entry_t *entries;
+    int count;
+    int alloc;
+    mkfs_template_t **templates;
+    int ntemplates;
+} batch_t;
+
+/* A running format */
+struct worker {
+    pid_t pid;
+    int entry;                  /* Index into the manifest */
+    FILE *log;                  /* Everything the format printed */
+};
+
+static int split_fields(char *line, char *fields[], int max);
+static int parse_entry(batch_t *batch, const char *manifest, int line,
+                       char *fields[], int nfields, const mkfs_options_t *opts);
+static int read_manifest(batch_t *batch, const char *manifest, const mkfs_options_t *opts);
+static int path_cmp(const void *a, const void *b);
+static int check_duplicates(const batch_t *batch, const char *manifest);
+static int share_templates(batch_t *batch, const mkfs_options_t *opts);
+static void run_worker(const batch_entry_t *e, const mkfs_options_t *opts, struct worker *w);
+static void print_log(const char *path, FILE *log);
+static int finish_worker(const batch_t *batch, struct worker *w, int status);
+static void free_batch(batch_t *batch);
+
+/*
+ * NAME:    mkfs_batch()
+ * DESCRIPTION: Format every volume of a manifest on a bounded pool of
+ *              forked workers
+ */
+int mkfs_batch(const char *manifest, const mkfs_options_t *opts)
+{
+    batch_t batch;
+    struct worker *workers = NULL;
+    int jobs = opts->jobs;
+    int next = 0, running = 0, failed = 0;
+    
+    memset(&batch, 0, sizeof(batch));
+    
+    if (read_manifest(&batch, manifest, opts) != 0 ||
+        check_duplicates(&batch, manifest) != 0 ||
+        share_templates(&batch, opts) != 0) {
+        free_batch(&batch);
+        return -1;
+    }
+    
+    if (batch.count == 0) {
+        error_print("%s: no volumes to format", manifest);
+        free_batch(&batch);
+        return -1;
+    }
+    
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if (jobs > batch.count) {
+        jobs = batch.count;
+    }
+    
+    error_verbose("formatting %d volumes with %d templates, %d at a time",
+                 batch.count, batch.ntemplates, jobs);
+    
+    workers = calloc(jobs, sizeof(*workers));
+    if (!workers) {
+        error_print_errno("failed to allocate memory for %d workers", jobs);
+        free_batch(&batch);
+        return -1;
+    }
+    
+    while (next < batch.count || running > 0) {
+        int status;
+        pid_t pid;
+        
+        /* Fill the free slots */
+        for (int i = 0; i < jobs && next < batch.count; i++) {
+            struct worker *w = &workers[i];
+            
+            if (w->pid != 0) {
+                continue;
+            }
+            
+            w->entry = next++;
+            w->log = tmpfile();
+            if (!w->log) {
+                error_print_errno("%s: cannot create log file", batch.entries[w->entry].path);
+                failed++;
+                i--;
+                continue;
+            }
+            
+            /* Nothing buffered may be written twice */
+            fflush(NULL);
+            pid = fork();
+            if (pid == 0) {
+                run_worker(&batch.entries[w->entry], opts, w);
+            }
+            if (pid < 0) {
+                fclose(w->log);
+                if (running > 0) {
+                    /* Try again once a running format has finished */
+                    next--;
+                    break;
+                }
+                error_print_errno("%s: cannot start format", batch.entries[w->entry].path);
+                failed++;
+                i--;
+                continue;
+            }
+            w->pid = pid;
+            running++;
+        }
+        
+        if (running == 0) {
+            continue;
+        }
+        
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_print_errno("waitpid failed");
+            failed++;
+            break;
+        }
+        
+        for (int i = 0; i < jobs; i++) {
+            if (workers[i].pid == pid) {
+                failed += finish_worker(&batch, &workers[i], status) != 0;
+                running--;
+                break;
+            }
+        }
+    }
+    
+    printf("%d of %d volumes formatted\n", batch.count - failed, batch.count);
+    
+    free(workers);
+    free_batch(&batch);
+    
+    return failed ? -1 : 0;
+}
+
+/*
+ * NAME:    split_fields()
+ * DESCRIPTION: Split a manifest line in place into whitespace-separated
+ *              fields; returns their number, max + 1 when there are too
+ *              many, or -1 for an unterminated quote
+ */
+static int split_fields(char *line, char *fields[], int max)
+{
+    char *p = line, *out;
+    int n = 0;
+    
+    for (;;) {
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            return n;
+        }
+        if (n == max) {
+            return max + 1;
+        }
+        
+        fields[n++] = out = p;
+        while (*p != '\0' && !isspace((unsigned char)*p)) {
+            if (*p != '"') {
+                *out++ = *p++;
+                continue;
+            }
+            
+            /* Quoted text; \" and \\ stand for themselves */
+            for (p++; *p != '\0' && *p != '"'; p++) {
+                if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) {
+                    p++;
+                }
+                *out++ = *p;
+            }
+            if (*p != '"') {
+                return -1;
+            }
+            p++;
+        }
+        if (*p != '\0') {
+            p++;
+        }
+        *out = '\0';
+    }
+}
+
+/*
+ * NAME:    parse_entry()
+ * DESCRIPTION: Check the fields of one manifest line and add its volume
+ */
+static int parse_entry(batch_t *batch, const char *manifest, int line,
+                       char *fields[], int nfields, const mkfs_options_t *opts)
+{
+    batch_entry_t *e;
+    const char *name;
+    
+    if (batch->count == batch->alloc) {
+        int alloc = batch->alloc ? batch->alloc * 2 : 32;
+        
+        e = realloc(batch->entries, alloc * sizeof(*e));
+        if (!e) {
+            error_print_errno("failed to allocate memory for manifest");
+            return -1;
+        }
+        batch->entries = e;
+        batch->alloc = alloc;
+    }
+    
+    e = &batch->entries[batch->count];
+    memset(e, 0, sizeof(*e));
+    e->line = line;
+    
+    if (strcmp(fields[2], "hfs") == 0) {
+        e->hfsplus = 0;
+    } else if (strcmp(fields[2], "hfs+") == 0 || strcmp(fields[2], "hfsplus") == 0) {
+        e->hfsplus = 1;
+    } else {
+        error_print("%s:%d: unknown filesystem type '%s' (hfs, hfs+ or hfsplus)",
+                   manifest, line, fields[2]);
+        return -1;
+    }
+    
+    if (strcmp(fields[1], "-") == 0) {
+        e->size = opts->total_size;
+    } else {
+        e->size = mkfs_parse_size(fields[1], e->hfsplus);
+        if (e->size < 0) {
+            error_print("%s:%d: invalid size specification: %s", manifest, line, fields[1]);
+            return -1;
+        }
+    }
+    
+    /* A name is checked against the rules of this volume's type */
+    name = nfields > 3 && strcmp(fields[3], "-") != 0 ? fields[3] : opts->volume_name;
+    if (e->hfsplus ? validate_volume_name_hfsplus(name) : validate_volume_name_hfs(name)) {
+        error_print("%s:%d: invalid volume name '%s'", manifest, line, name);
+        return -1;
+    }
+    
+    e->path = strdup(fields[0]);
+    e->name = name != opts->volume_name ? strdup(name) : NULL;
+    e->dir = nfields > 4 ? strdup(fields[4]) : NULL;
+    if (!e->path || (name != opts->volume_name && !e->name) || (nfields > 4 && !e->dir)) {
+        error_print_errno("failed to allocate memory for manifest");
+        free(e->path);
+        free(e->name);
+        free(e->dir);
+        return -1;
+    }
+    
+    batch->count++;
+    return 0;
+}
+
+/*
+ * NAME:    read_manifest()
+ * DESCRIPTION: Read every line of the manifest; any error stops the batch
+ */
+static int read_manifest(batch_t *batch, const char *manifest, const mkfs_options_t *opts)
+{
+    FILE *fp;
+    char *buf = NULL;
+    size_t size = 0;
+    int line = 0, result = 0;
+    
+    if (strcmp(manifest, "-") == 0) {
+        fp = stdin;
+    } else {
+        fp = fopen(manifest, "r");
+        if (!fp) {
+            error_print_errno("cannot open manifest %s", manifest);
+            return -1;
+        }
+    }
+    
+    while (getline(&buf, &size, fp) != -1) {
+        char *fields[BATCH_FIELDS];
+        int n;
+        
+        line++;
+        n = split_fields(buf, fields, BATCH_FIELDS);
+        if (n == 0) {
+            continue;
+        }
+        
+        if (n < 0) {
+            error_print("%s:%d: unterminated quote", manifest, line);
+        } else if (n < 3) {
+            error_print("%s:%d: expected path, size and type", manifest, line);
+        } else if (n > BATCH_FIELDS) {
+            error_print("%s:%d: too many fields", manifest, line);
+        } else if (parse_entry(batch, manifest, line, fields, n, opts) == 0) {
+            continue;
+        }
+        result = -1;
+    }
+    
+    if (ferror(fp)) {
+        error_print_errno("failed to read manifest %s", manifest);
+        result = -1;
+    }
+    
+    free(buf);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    
+    return result;
+}
+
+/*
+ * NAME:    path_cmp()
+ * DESCRIPTION: qsort() comparator ordering entries by path
+ */
+static int path_cmp(const void *a, const void *b)
+{
+    const batch_entry_t *ea = *(const batch_entry_t *const *)a;
+    const batch_entry_t *eb = *(const batch_entry_t *const *)b;
+    
+    return strcmp(ea->path, eb->path);
+}
+
+/*
+ * NAME:    check_duplicates()
+ * DESCRIPTION: Refuse a manifest naming the same path twice, which would
+ *              have two workers formatting one volume
+ */
+static int check_duplicates(const batch_t *batch, const char *manifest)
+{
+    const batch_entry_t **sorted;
+    int i, result = 0;
+    
+    if (batch->count < 2) {
+        return 0;
+    }
+    
+    sorted = malloc(batch->count * sizeof(*sorted));
+    if (!sorted) {
+        error_print_errno("failed to allocate memory for manifest");
+        return -1;
+    }
+    
+    for (i = 0; i < batch->count; i++) {
+        sorted[i] = &batch->entries[i];
+    }
+    qsort(sorted, batch->count, sizeof(*sorted), path_cmp);
+    
+    for (i = 1; i < batch->count; i++) {
+        if (strcmp(sorted[i - 1]->path, sorted[i]->path) == 0) {
+            error_print("%s:%d: %s is already listed on line %d", manifest,
+                       sorted[i]->line, sorted[i]->path, sorted[i - 1]->line);
+            result = -1;
+        }
+    }
+    
+    free(sorted);
+    return result;
+}
+
+/*
+ * NAME:    share_templates()
+ * DESCRIPTION: Give every empty volume of a known size the template of
+ *              its type and size, laying each one out only once
+ */
+static int share_templates(batch_t *batch, const mkfs_options_t *opts)
+{
+    int i, j;
+    
+    for (i = 0; i < batch->count; i++) {
+        batch_entry_t *e = &batch->entries[i];
+        
+        /* A populated volume sizes its catalog from its tree */
+        if (e->dir || e->size == 0) {
+            continue;
+        }
+        
+        for (j = 0; j < i; j++) {
+            const batch_entry_t *prev = &batch->entries[j];
+            
+            if (prev->tmpl && prev->hfsplus == e->hfsplus && prev->size == e->size) {
+                e->tmpl = prev->tmpl;
+                break;
+            }
+        }
+        if (e->tmpl) {
+            continue;
+        }
+        
+        if (batch->ntemplates % 16 == 0) {
+            mkfs_template_t **t = realloc(batch->templates,
+                                          (batch->ntemplates + 16) * sizeof(*t));
+            
+            if (!t) {
+                error_print_errno("failed to allocate memory for volume templates");
+                return -1;
+            }
+            batch->templates = t;
+        }
+        
+        e->tmpl = mkfs_template_new(e->hfsplus, e->size, opts);
+        if (!e->tmpl) {
+            error_print("%s: cannot lay out a %lld byte %s volume", e->path,
+                       e->size, e->hfsplus ? "HFS+" : "HFS");
+            return -1;
+        }
+        batch->templates[batch->ntemplates++] = e->tmpl;
+    }
+    
+    return 0;
+}
+
+/*
+ * NAME:    run_worker()
+ * DESCRIPTION: Format one volume in a forked child with its output going
+ *              to the worker's log; never returns
+ */
+static void run_worker(const batch_entry_t *e, const mkfs_options_t *opts, struct worker *w)
+{
+    mkfs_options_t entry_opts = *opts;
+    int null_fd, result;
+    
+    /* No questions can be answered, and nothing may reach the terminal */
+    null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+    dup2(fileno(w->log), STDOUT_FILENO);
+    dup2(fileno(w->log), STDERR_FILENO);
+    
+    entry_opts.device_path = e->path;
+    entry_opts.volume_name = e->name ? e->name : opts->volume_name;
+    entry_opts.filesystem_type = e->hfsplus ? FS_TYPE_HFSPLUS : FS_TYPE_HFS;
+    entry_opts.total_size = e->size;
+    entry_opts.source_dir = e->dir;
+    entry_opts.batch_file = NULL;
+    
+    if (e->tmpl) {
+        result = mkfs_format_template(e->path, &entry_opts, e->tmpl);
+    } else if (e->hfsplus) {
+        result = mkfs_hfsplus_format(e->path, &entry_opts);
+    } else {
+        result = mkfs_hfs_format(e->path, &entry_opts);
+    }
+    
+    fflush(NULL);
+    _exit(result == 0 ? 0 : 1);
+}
+
+/*
+ * NAME:    print_log()
+ * DESCRIPTION: Copy a finished worker's output, each line prefixed with
+ *              its volume's path
+ */
+static void print_log(const char *path, FILE *log)
+{
+    char line[1024];
+    int bol = 1;
+    
+    rewind(log);
+    while (fgets(line, sizeof(line), log)) {
+        if (bol) {
+            printf("%s: ", path);
+        }
+        fputs(line, stdout);
+        bol = strchr(line, '\n') != NULL;
+    }
+    if (!bol) {
+        putchar('\n');
+    }
+}
+
+/*
+ * NAME:    finish_worker()
+ * DESCRIPTION: Report a worker that has exited and release its slot
+ */
+static int finish_worker(const batch_t *batch, struct worker *w, int status)
+{
+    const char *path = batch->entries[w->entry].path;
+    int result;
+    
+    print_log(path, w->log);
+    
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("%s: formatted\n", path);
+        result = 0;
+    } else if (WIFSIGNALED(status)) {
+        printf("%s: killed by signal %d\n", path, WTERMSIG(status));
+        result = -1;
+    } else {
+        printf("%s: failed\n", path);
+        result = -1;
+    }
+    fflush(stdout);
+    
+    fclose(w->log);
+    w->pid = 0;
+    
+    return result;
+}
+
+/*
+ * NAME:    free_batch()
+ * DESCRIPTION: Release the manifest and its templates
+ */
+static void free_batch(batch_t *batch)
+{
+    int i;
+    
+    for (i = 0; i < batch->count; i++) {
+        free(batch->entries[i].path);
+        free(batch->entries[i].name);
+        free(batch->entries[i].dir);
+    }
+    for (i = 0; i < batch->ntemplates; i++) {
+        mkfs_template_free(batch->templates[i]);
+    }
+    free(batch->entries);
+    free(batch->templates);
+}
@@ -0,0 +1,29 @@
+/*
+ * mkfs_batch.h - Format the volumes listed in a manifest
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MKFS_BATCH_H
+#define MKFS_BATCH_H
+
+#include "../embedded/mkfs/mkfs_hfs.h"
+
+/*
+ * Format every volume of a manifest ("-" reads standard input), with at
+ * most opts->jobs running at once.  Each line is
+ *
+ *     path size type [name [directory]]
+ *
+ * where size may be "-" for the device's own size (or -s), type is hfs,
+ * hfs+ or hfsplus, and name may be "-" for the -l name.  Fields holding
+ * spaces are double-quoted; '#' starts a comment.  The other options
+ * apply to every volume.  Returns 0 when every volume was formatted.
+ */
+int mkfs_batch(const char *manifest, const mkfs_options_t *opts);
+
+#endif /* MKFS_BATCH_H */
@@ -134,8 +134,13 @@ int mkfs_validate_volume_name(const char *name, int is_hfsplus)
 int mkfs_parse_command_line(int argc, char *argv[], mkfs_options_t *opts, int is_hfsplus)
 {
     int c;
+    char *endptr;
     static struct option long_options[] = {
+        {"batch",   required_argument, 0, 'b'},
         {"force",   no_argument,       0, 'f'},
+        {"directory", required_argument, 0, 'd'},
+        {"discard", no_argument,       0, 'D'},
+        {"jobs",    required_argument, 0, 'J'},
         {"label",   required_argument, 0, 'L'},  /* Primary: -L per Unix convention */
         {"size",    required_argument, 0, 's'},
         {"verbose", no_argument,       0, 'v'},
@@ -147,10 +152,30 @@ int mkfs_parse_command_line(int argc, char *argv[], mkfs_options_t *opts, int is
     
     /* HFS+ supports -s option, HFS does not */
     /* Configure getopt_long options based on filesystem type */
-    const char *optstring = is_hfsplus ? "fj:l:L:s:vVh" : "fl:L:vVh";
+    const char *optstring = is_hfsplus ? "b:d:DfjJ:l:L:s:vVh" : "b:d:DfJ:l:L:vVh";
     
     while ((c = getopt_long(argc, argv, optstring, long_options, NULL)) != -1) {
         switch (c) {
+            case 'b':
+                opts->batch_file = strdup(optarg);
+                if (!opts->batch_file) {
+                    error_print_errno("failed to allocate memory for manifest name");
+                    return -1;
+                }
+                break;
+                
+            case 'd':
+                opts->source_dir = strdup(optarg);
+                if (!opts->source_dir) {
+                    error_print_errno("failed to allocate memory for directory name");
+                    return -1;
+                }
+                break;
+                
+            case 'D':
+                opts->discard = 1;
+                break;
+                
             case 'f':
                 opts->force = 1;
                 break;
@@ -196,6 +221,14 @@ int mkfs_parse_command_line(int argc, char *argv[], mkfs_options_t *opts, int is
                 fprintf(stderr, "\\n");
                 break;
                 
+            case 'J':
+                opts->jobs = (int)strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || opts->jobs < 1) {
+                    error_print("invalid number of jobs: %s", optarg);
+                    return -1;
+                }
+                break;
+                
             case 's':
                 /* Size option only for HFS+ */
                 if (!is_hfsplus) {
@@ -235,6 +268,19 @@ int mkfs_parse_command_line(int argc, char *argv[], mkfs_options_t *opts, int is
         }
     }
     
+    /* A batch takes its devices from the manifest */
+    if (opts->batch_file) {
+        if (optind < argc) {
+            error_print("no device may be given with --batch");
+            return -1;
+        }
+        if (opts->source_dir) {
+            error_print("-d cannot be used with --batch; give directories in the manifest");
+            return -1;
+        }
+        return 0;
+    }
+    
     /* Parse positional arguments */
     if (optind >= argc) {
         error_print("missing device argument");
@@ -302,6 +348,16 @@ void mkfs_cleanup_options(mkfs_options_t *opts)
         free(opts->volume_name);
         opts->volume_name = NULL;
     }
+    
+    if (opts->source_dir) {
+        free(opts->source_dir);
+        opts->source_dir = NULL;
+    }
+    
+    if (opts->batch_file) {
+        free(opts->batch_file);
+        opts->batch_file = NULL;
+    }
 }
 
 /*
@@ -467,4 +523,14 @@ void cleanup_options_common(mkfs_options_t *opts)
         free(opts->volume_name);
         opts->volume_name = NULL;
     }
+    
+    if (opts->source_dir) {
+        free(opts->source_dir);
+        opts->source_dir = NULL;
+    }
+    
+    if (opts->batch_file) {
+        free(opts->batch_file);
+        opts->batch_file = NULL;
+    }
 }
\ No newline at end of file
@@ -21,6 +21,15 @@
 #include <sys/stat.h>
 
 #include "../embedded/mkfs/mkfs_hfs.h"
+#include "mkfs_populate.h"
+#include "mkfs_plan.h"
+
+/* B*-tree node sizes */
+#define HFS_NODE_SIZE           512
+#define HFSPLUS_NODE_SIZE       4096
+
+/* Nodes the map record of a header node can track */
+#define MAP_NODES(node_size)    (((node_size) - 256) * 8)
 
 /* Volume parameters structure for HFS */
 typedef struct {
@@ -30,8 +39,15 @@ typedef struct {
     uint32_t allocation_block_size;
     uint16_t total_allocation_blocks;
     uint16_t free_allocation_blocks;
+    uint16_t bitmap_sectors;        /* Volume bitmap, from sector 3 */
+    uint16_t first_allocation_sector; /* drAlBlSt */
+    uint16_t extents_start_block;   /* In allocation blocks */
+    uint16_t catalog_start_block;
     uint32_t catalog_file_size;
     uint32_t extents_file_size;
+    uint32_t clump_size;            /* Clump of both B*-tree files */
+    uint32_t data_blocks;           /* File data copied in after the catalog */
+    populate_t *content;            /* Tree copied in with -d, or NULL */
     time_t creation_date;
 } volume_params_t;
 
@@ -39,61 +55,222 @@ typedef struct {
 typedef struct {
     off_t device_size;
     uint32_t sector_size;
-    uint32_t total_sectors;
+    uint64_t total_sectors;
     uint32_t block_size;           /* HFS+ uses larger blocks */
     uint32_t total_blocks;         /* 32-bit for HFS+ */
     uint32_t free_blocks;          /* 32-bit for HFS+ */
+    uint32_t allocation_start_block;
     uint32_t allocation_file_size;
+    uint32_t extents_start_block;
     uint32_t extents_file_size;
+    uint32_t catalog_start_block;
     uint32_t catalog_file_size;
     uint32_t attributes_file_size;
     uint32_t startup_file_size;
+    uint32_t tail_start_block;     /* First block holding the alternate header */
+    uint32_t data_blocks;          /* File data copied in after the catalog */
+    populate_t *content;           /* Tree copied in with -d, or NULL */
     time_t creation_date;
     int enable_journaling;         /* Future: journaling support */
     int case_sensitive;            /* Future: case sensitivity */
 } hfsplus_volume_params_t;
 
+/* Shape of a new B*-tree, as recorded in its header node */
+typedef struct {
+    uint32_t node_size;
+    uint16_t depth;
+    uint32_t root;
+    uint32_t leaf_records;
+    uint32_t first_leaf;
+    uint32_t last_leaf;
+    uint16_t max_key_length;
+    uint32_t total_nodes;
+    uint32_t used_nodes;           /* Nodes 0..used_nodes-1 are in use */
+} btree_layout_t;
+
+/* The layout of an empty volume, shared by every volume of its type and size */
+struct mkfs_template {
+    int hfsplus;
+    off_t size;
+    volume_params_t hfs_params;
+    hfsplus_volume_params_t hfsplus_params;
+    write_plan_t layout;           /* Structures that carry no name or date */
+};
+
 /* Forward declarations - HFS */
+static int format_hfs(const char *device_path, const mkfs_options_t *opts,
+                      const mkfs_template_t *tmpl);
+static off_t volume_size(const char *device_path, const mkfs_options_t *opts);
 static int validate_device(const char *device_path, int force);
-static int calculate_volume_parameters(const char *device_path, mkfs_options_t *opts, 
-                                     volume_params_t *params);
-static int format_hfs_volume(const char *device_path, int partno, 
-                            const mkfs_options_t *opts, const volume_params_t *params);
-static int verify_hfs_volume(const char *device_path, int partno, const mkfs_options_t *opts);
-static int write_boot_blocks(int fd, const volume_params_t *params);
-static int write_master_directory_block(int fd, const volume_params_t *params, 
+static int calculate_volume_parameters(off_t device_size, mkfs_options_t *opts,
+                                     populate_t *content, volume_params_t *params);
+static int format_hfs_volume(const char *device_path, int partno,
+                            const mkfs_options_t *opts, const volume_params_t *params,
+                            write_plan_t *plan, const write_plan_t *layout);
+static int verify_hfs_volume(const char *device_path, int partno, const mkfs_options_t *opts,
+                             write_plan_t *plan);
+static int write_boot_blocks(write_plan_t *plan, const volume_params_t *params);
+static int write_master_directory_block(write_plan_t *plan, off_t offset, const volume_params_t *params,
                                        const mkfs_options_t *opts);
-static int write_volume_bitmap(int fd, const volume_params_t *params);
-static int initialize_catalog_file(int fd, const volume_params_t *params);
-static int initialize_extents_file(int fd, const volume_params_t *params);
+static int write_volume_bitmap(write_plan_t *plan, const volume_params_t *params);
+static int initialize_catalog_file(write_plan_t *plan, const volume_params_t *params,
+                                   const mkfs_options_t *opts);
+static int initialize_extents_file(write_plan_t *plan, const volume_params_t *params);
+static int plan_hfs_layout(write_plan_t *plan, const volume_params_t *params);
+static int plan_hfs_volume(write_plan_t *plan, const volume_params_t *params,
+                           const mkfs_options_t *opts);
 static int validate_volume_name(const char *vname);
 
 /* Forward declarations - HFS+ */
-static int calculate_hfsplus_volume_parameters(const char *device_path, mkfs_options_t *opts,
+static int format_hfsplus(const char *device_path, const mkfs_options_t *opts,
+                          const mkfs_template_t *tmpl);
+static int create_image_file(const char *path, long long size);
+static int calculate_hfsplus_volume_parameters(off_t device_size, mkfs_options_t *opts,
+                                             populate_t *content,
                                              hfsplus_volume_params_t *params);
 static int format_hfsplus_volume(const char *device_path, int partno,
-                                const mkfs_options_t *opts, const hfsplus_volume_params_t *params);
-static int verify_hfsplus_volume(const char *device_path, int partno, const mkfs_options_t *opts);
-static int write_hfsplus_boot_blocks(int fd, const hfsplus_volume_params_t *params);
-static int write_hfsplus_volume_header(int fd, const hfsplus_volume_params_t *params,
+                                const mkfs_options_t *opts, const hfsplus_volume_params_t *params,
+                                write_plan_t *plan, const write_plan_t *layout);
+static int verify_hfsplus_volume(const char *device_path, int partno, const mkfs_options_t *opts,
+                                 write_plan_t *plan);
+static int write_hfsplus_boot_blocks(write_plan_t *plan, const hfsplus_volume_params_t *params);
+static int write_hfsplus_volume_header(write_plan_t *plan, off_t offset, const hfsplus_volume_params_t *params,
                                      const mkfs_options_t *opts);
-static int write_hfsplus_allocation_bitmap(int fd, const hfsplus_volume_params_t *params);
-static int initialize_hfsplus_catalog_file(int fd, const hfsplus_volume_params_t *params);
-static int initialize_hfsplus_extents_file(int fd, const hfsplus_volume_params_t *params);
+static int write_hfsplus_allocation_bitmap(write_plan_t *plan, const hfsplus_volume_params_t *params);
+static int initialize_hfsplus_catalog_file(write_plan_t *plan, const hfsplus_volume_params_t *params,
+                                           const mkfs_options_t *opts);
+static int initialize_hfsplus_extents_file(write_plan_t *plan, const hfsplus_volume_params_t *params);
+static int plan_hfsplus_layout(write_plan_t *plan, const hfsplus_volume_params_t *params);
+static int plan_hfsplus_volume(write_plan_t *plan, const hfsplus_volume_params_t *params,
+                               const mkfs_options_t *opts);
+static void put_fork(unsigned char *fork, uint64_t size, uint32_t clump,
+                     uint32_t start, uint32_t blocks);
+static size_t put_hfsplus_name(unsigned char *p, const char *name);
+
+/* Forward declarations - on-disk helpers */
+static void put_be16(unsigned char *p, uint16_t value);
+static void put_be32(unsigned char *p, uint32_t value);
+static void put_be64(unsigned char *p, uint64_t value);
+static int write_bitmap(write_plan_t *plan, off_t offset, uint64_t length, uint32_t unit,
+                        uint32_t lead, uint32_t tail, uint32_t total);
+static void btree_init_node(unsigned char *node, uint32_t node_size, int kind, int height);
+static int btree_add_record(unsigned char *node, uint32_t node_size,
+                            const unsigned char *rec, uint32_t len);
+static void btree_header_node(unsigned char *node, const btree_layout_t *bt);
+static int write_btree_file(write_plan_t *plan, off_t offset, uint32_t file_size,
+                            const unsigned char *nodes, uint32_t nnodes,
+                            uint32_t node_size, const char *what);
+static int build_populated_catalog(const populate_t *content, uint32_t node_size,
+                                   uint16_t max_key_length, uint32_t file_size,
+                                   unsigned char **nodes, uint32_t *nnodes);
+static void discard_free_area(int fd, const mkfs_options_t *opts, off_t start, off_t end);
 
 /*
  * NAME:    mkfs_hfs_format()
  * DESCRIPTION: Format device as HFS filesystem using libhfs logic
  */
 int mkfs_hfs_format(const char *device_path, const mkfs_options_t *opts)
+{
+    return format_hfs(device_path, opts, NULL);
+}
+
+/*
+ * NAME:    mkfs_hfsplus_format()
+ * DESCRIPTION: Format device as HFS+ filesystem
+ */
+int mkfs_hfsplus_format(const char *device_path, const mkfs_options_t *opts)
+{
+    return format_hfsplus(device_path, opts, NULL);
+}
+
+/*
+ * NAME:    mkfs_template_new()
+ * DESCRIPTION: Lay out an empty volume of one type and size once, for a
+ *              batch that formats many of them
+ */
+mkfs_template_t *mkfs_template_new(int hfsplus, long long size, const mkfs_options_t *opts)
+{
+    mkfs_template_t *tmpl;
+    int result;
+    
+    tmpl = calloc(1, sizeof(*tmpl));
+    if (!tmpl) {
+        error_print_errno("failed to allocate memory for volume template");
+        return NULL;
+    }
+    
+    tmpl->hfsplus = hfsplus;
+    tmpl->size = size;
+    write_plan_init(&tmpl->layout);
+    
+    if (hfsplus) {
+        result = calculate_hfsplus_volume_parameters(size, (mkfs_options_t *)opts, NULL,
+                                                     &tmpl->hfsplus_params);
+        if (result == 0) {
+            result = plan_hfsplus_layout(&tmpl->layout, &tmpl->hfsplus_params);
+        }
+    } else {
+        result = calculate_volume_parameters(size, (mkfs_options_t *)opts, NULL,
+                                             &tmpl->hfs_params);
+        if (result == 0) {
+            result = plan_hfs_layout(&tmpl->layout, &tmpl->hfs_params);
+        }
+    }
+    
+    if (result != 0) {
+        mkfs_template_free(tmpl);
+        return NULL;
+    }
+    
+    return tmpl;
+}
+
+/*
+ * NAME:    mkfs_template_free()
+ * DESCRIPTION: Release a volume template
+ */
+void mkfs_template_free(mkfs_template_t *tmpl)
+{
+    if (tmpl) {
+        write_plan_free(&tmpl->layout);
+        free(tmpl);
+    }
+}
+
+/*
+ * NAME:    mkfs_format_template()
+ * DESCRIPTION: Format a device or image file from a volume template; only
+ *              the structures carrying the name and dates are built
+ */
+int mkfs_format_template(const char *device_path, const mkfs_options_t *opts,
+                         const mkfs_template_t *tmpl)
+{
+    if (tmpl->hfsplus) {
+        return format_hfsplus(device_path, opts, tmpl);
+    }
+    
+    return format_hfs(device_path, opts, tmpl);
+}
+
+/*
+ * NAME:    format_hfs()
+ * DESCRIPTION: Format device as HFS, from a template if one is given
+ */
+static int format_hfs(const char *device_path, const mkfs_options_t *opts,
+                      const mkfs_template_t *tmpl)
 {
     int result = -1;
     volume_params_t params;
+    populate_t content, *tree = NULL;
+    write_plan_t plan;
     char *resolved_path = NULL;
+    off_t size;
     int nparts;
     
     error_verbose("starting HFS formatting of %s", device_path);
     
+    write_plan_init(&plan);
+    
     /* Resolve device path */
     resolved_path = common_resolve_device_path(device_path);
     if (!resolved_path) {
@@ -101,6 +278,12 @@ int mkfs_hfs_format(const char *device_path, const mkfs_options_t *opts)
         return -1;
     }
     
+    /* With a size, a new image file is created sparse at that size */
+    if (opts->total_size > 0 && access(resolved_path, F_OK) != 0 &&
+        create_image_file(resolved_path, opts->total_size) != 0) {
+        goto cleanup;
+    }
+    
     /* Validate device and options */
     if (validate_device(resolved_path, opts->force) != 0) {
         goto cleanup;
@@ -139,8 +322,24 @@ int mkfs_hfs_format(const char *device_path, const mkfs_options_t *opts)
         }
     }
     
-    /* Calculate volume parameters */
-    if (calculate_volume_parameters(resolved_path, (mkfs_options_t *)opts, &params) != 0) {
+    /* With -d, the host tree is scanned first: it sizes the catalog */
+    if (opts->source_dir) {
+        if (populate_scan(&content, opts->source_dir, opts->volume_name, 0) != 0) {
+            populate_free(&content);
+            goto cleanup;
+        }
+        tree = &content;
+    }
+    
+    /* Calculate volume parameters, unless a template already holds them */
+    size = volume_size(resolved_path, opts);
+    if (size < 0) {
+        goto cleanup;
+    }
+    if (tmpl && size == tmpl->size) {
+        params = tmpl->hfs_params;
+        params.creation_date = hfs_get_safe_time();
+    } else if (calculate_volume_parameters(size, (mkfs_options_t *)opts, tree, &params) != 0) {
         error_print("failed to calculate volume parameters");
         goto cleanup;
     }
@@ -152,13 +351,14 @@ int mkfs_hfs_format(const char *device_path, const mkfs_options_t *opts)
     error_verbose("  free allocation blocks: %u", params.free_allocation_blocks);
     
     /* Perform the actual formatting using integrated libhfs logic */
-    if (format_hfs_volume(resolved_path, partno, opts, &params) != 0) {
+    if (format_hfs_volume(resolved_path, partno, opts, &params, &plan,
+                          tmpl && size == tmpl->size ? &tmpl->layout : NULL) != 0) {
         error_print("HFS formatting failed");
         goto cleanup;
     }
     
     /* Verify the created filesystem */
-    if (verify_hfs_volume(resolved_path, partno, opts) != 0) {
+    if (verify_hfs_volume(resolved_path, partno, opts, &plan) != 0) {
         error_warning("filesystem verification failed, but volume may still be usable");
     }
     
@@ -168,10 +368,18 @@ int mkfs_hfs_format(const char *device_path, const mkfs_options_t *opts)
     printf("Volume size: %lld bytes (%u allocation blocks)\n", 
            (long long)params.device_size, params.total_allocation_blocks);
     printf("Allocation block size: %u bytes\n", params.allocation_block_size);
+    if (tree) {
+        printf("Copied %u files and %u folders from %s\n",
+               tree->files, tree->folders, opts->source_dir);
+    }
     
     result = 0;
     
 cleanup:
+    write_plan_free(&plan);
+    if (tree) {
+        populate_free(tree);
+    }
     if (resolved_path) {
         free(resolved_path);
     }
@@ -180,18 +388,24 @@ cleanup:
 }
 
 /*
- * NAME:    mkfs_hfsplus_format()
- * DESCRIPTION: Format device as HFS+ filesystem
+ * NAME:    format_hfsplus()
+ * DESCRIPTION: Format device as HFS+, from a template if one is given
  */
-int mkfs_hfsplus_format(const char *device_path, const mkfs_options_t *opts)
+static int format_hfsplus(const char *device_path, const mkfs_options_t *opts,
+                          const mkfs_template_t *tmpl)
 {
     int result = -1;
     hfsplus_volume_params_t params;
+    populate_t content, *tree = NULL;
+    write_plan_t plan;
     char *resolved_path = NULL;
+    off_t size;
     int nparts;
     
     error_verbose("starting HFS+ formatting of %s", device_path);
     
+    write_plan_init(&plan);
+    
     /* Resolve device path */
     resolved_path = common_resolve_device_path(device_path);
     if (!resolved_path) {
@@ -199,6 +413,12 @@ int mkfs_hfsplus_format(const char *device_path, const mkfs_options_t *opts)
         return -1;
     }
     
+    /* With -s, a new image file is created sparse at the requested size */
+    if (opts->total_size > 0 && access(resolved_path, F_OK) != 0 &&
+        create_image_file(resolved_path, opts->total_size) != 0) {
+        goto cleanup;
+    }
+    
     /* Validate device and options */
     if (validate_device(resolved_path, opts->force) != 0) {
         goto cleanup;
@@ -237,8 +457,25 @@ int mkfs_hfsplus_format(const char *device_path, const mkfs_options_t *opts)
         }
     }
     
+    /* With -d, the host tree is scanned first: it sizes the catalog */
+    if (opts->source_dir) {
+        if (populate_scan(&content, opts->source_dir, opts->volume_name, 1) != 0) {
+            populate_free(&content);
+            goto cleanup;
+        }
+        tree = &content;
+    }
+    
     /* Calculate HFS+ volume parameters */
-    if (calculate_hfsplus_volume_parameters(resolved_path, (mkfs_options_t *)opts, &params) != 0) {
+    size = volume_size(resolved_path, opts);
+    if (size < 0) {
+        goto cleanup;
+    }
+    if (tmpl && size == tmpl->size) {
+        params = tmpl->hfsplus_params;
+        params.creation_date = hfs_get_safe_time();
+    } else if (calculate_hfsplus_volume_parameters(size, (mkfs_options_t *)opts, tree,
+                                                   &params) != 0) {
         error_print("failed to calculate HFS+ volume parameters");
         goto cleanup;
     }
@@ -250,13 +487,14 @@ int mkfs_hfsplus_format(const char *device_path, const mkfs_options_t *opts)
     error_verbose("  free blocks: %u", params.free_blocks);
     
     /* Perform the actual HFS+ formatting */
-    if (format_hfsplus_volume(resolved_path, partno, opts, &params) != 0) {
+    if (format_hfsplus_volume(resolved_path, partno, opts, &params, &plan,
+                              tmpl && size == tmpl->size ? &tmpl->layout : NULL) != 0) {
         error_print("HFS+ formatting failed");
         goto cleanup;
     }
     
     /* Verify the created filesystem */
-    if (verify_hfsplus_volume(resolved_path, partno, opts) != 0) {
+    if (verify_hfsplus_volume(resolved_path, partno, opts, &plan) != 0) {
         error_warning("filesystem verification failed, but volume may still be usable");
     }
     
@@ -267,10 +505,18 @@ int mkfs_hfsplus_format(const char *device_path, const mkfs_options_t *opts)
            (long long)params.device_size, params.total_blocks);
     printf("Block size: %u bytes\n", params.block_size);
     printf("Features: Basic HFS+ (no journaling)\n");
+    if (tree) {
+        printf("Copied %u files and %u folders from %s\n",
+               tree->files, tree->folders, opts->source_dir);
+    }
     
     result = 0;
     
 cleanup:
+    write_plan_free(&plan);
+    if (tree) {
+        populate_free(tree);
+    }
     if (resolved_path) {
         free(resolved_path);
     }
@@ -278,6 +524,40 @@ cleanup:
     return result;
 }
 
+/*
+ * NAME:    volume_size()
+ * DESCRIPTION: Size of the volume to create: the whole device, or the -s
+ *              size, to which an image file grows
+ */
+static off_t volume_size(const char *device_path, const mkfs_options_t *opts)
+{
+    struct stat st;
+    off_t size;
+    
+    size = device_get_size(device_path);
+    if (size < 0) {
+        error_print("cannot determine device size");
+        return -1;
+    }
+    
+    /* An image file grows to the requested size; a device cannot */
+    if (opts->total_size > 0) {
+        if (opts->total_size > size &&
+            (stat(device_path, &st) != 0 || !S_ISREG(st.st_mode))) {
+            error_print("requested size is larger than the device");
+            return -1;
+        }
+        size = opts->total_size;
+    }
+    
+    if (size <= 0) {
+        error_print("cannot determine device size");
+        return -1;
+    }
+    
+    return size;
+}
+
 /*
  * NAME:    validate_device()
  * DESCRIPTION: Validate device for formatting
@@ -331,62 +611,103 @@ static int validate_device(const char *device_path, int force)
 
 /*
  * NAME:    calculate_volume_parameters()
- * DESCRIPTION: Calculate volume parameters based on device size
+ * DESCRIPTION: Calculate volume parameters for a volume of device_size bytes
  */
-static int calculate_volume_parameters(const char *device_path, mkfs_options_t *opts, 
-                                     volume_params_t *params)
+static int calculate_volume_parameters(off_t device_size, mkfs_options_t *opts,
+                                     populate_t *content, volume_params_t *params)
 {
-    memset(params, 0, sizeof(*params));
+    uint32_t sectors_per_block;
+    uint32_t clump_blocks, btree_blocks, catalog_blocks;
+    uint64_t needed;
     
-    /* Get device size */
-    params->device_size = device_get_size(device_path);
-    if (params->device_size <= 0) {
-        error_print("cannot determine device size");
-        return -1;
-    }
+    memset(params, 0, sizeof(*params));
+    params->content = content;
+    params->device_size = device_size;
     
     /* Set sector size (always 512 for HFS) */
     params->sector_size = 512;
     params->total_sectors = params->device_size / params->sector_size;
     
-    /* Calculate allocation block size according to HFS specification */
-    /* AB size = max(512, (volume_size / 65536) * 512) for efficiency */
-    params->allocation_block_size = 512;
-    if (params->device_size > 32 * 1024 * 1024) {  /* > 32MB */
-        params->allocation_block_size = ((params->device_size / 65536) / 512) * 512;
-        if (params->allocation_block_size < 512) {
-            params->allocation_block_size = 512;
-        }
-        /* Ensure it's a multiple of 512 */
-        params->allocation_block_size = (params->allocation_block_size + 511) & ~511;
+    /* libhfs will not mount anything smaller than an 800K floppy */
+    if (params->total_sectors < 1600) {
+        error_print("volume too small for HFS (minimum 800K)");
+        return -1;
+    }
+    
+    /*
+     * Allocation blocks are the fewest whole sectors that keep their count
+     * within 16 bits; this is the geometry hformat has always used.
+     */
+    sectors_per_block = 1 + ((params->total_sectors - 6) >> 16);
+    params->allocation_block_size = sectors_per_block * params->sector_size;
+    
+    /* A B*-tree file must have room for at least its own map */
+    if (params->allocation_block_size > MAP_NODES(HFS_NODE_SIZE) * HFS_NODE_SIZE) {
+        error_print("volume too large for HFS; use HFS+ instead");
+        return -1;
+    }
+    
+    /* Volume bitmap starts at sector 3, allocation blocks follow it */
+    params->bitmap_sectors = (params->total_sectors / sectors_per_block + 0x0fff) >> 12;
+    params->first_allocation_sector = 3 + params->bitmap_sectors;
+    params->total_allocation_blocks = (params->total_sectors - 2 -
+                                       params->first_allocation_sector) / sectors_per_block;
+    
+    /* Both B*-tree files start with one clump of 1/128 of the volume */
+    clump_blocks = params->total_allocation_blocks / 128;
+    if (clump_blocks == 0) {
+        clump_blocks = 1;
+    }
+    params->clump_size = clump_blocks * params->allocation_block_size;
+    
+    /* ... as long as their header node map can track every node */
+    btree_blocks = clump_blocks;
+    if (btree_blocks * params->allocation_block_size > MAP_NODES(HFS_NODE_SIZE) * HFS_NODE_SIZE) {
+        btree_blocks = MAP_NODES(HFS_NODE_SIZE) * HFS_NODE_SIZE / params->allocation_block_size;
     }
     
-    /* Calculate total allocation blocks (max 65535 for HFS) */
-    params->total_allocation_blocks = params->device_size / params->allocation_block_size;
-    if (params->total_allocation_blocks > 65535) {
-        params->total_allocation_blocks = 65535;
-        /* Recalculate allocation block size */
-        params->allocation_block_size = params->device_size / 65535;
-        params->allocation_block_size = (params->allocation_block_size + 511) & ~511;
+    /* The catalog needs a header node and the root directory's leaf */
+    if (btree_blocks * params->allocation_block_size < 2 * HFS_NODE_SIZE) {
+        btree_blocks = (2 * HFS_NODE_SIZE) / params->allocation_block_size;
     }
     
-    /* Calculate file sizes (catalog and extents files) */
-    /* Catalog file: minimum 4 allocation blocks, scale with volume size */
-    params->catalog_file_size = 4 * params->allocation_block_size;
-    if (params->total_allocation_blocks > 1000) {
-        params->catalog_file_size = (params->total_allocation_blocks / 250) * params->allocation_block_size;
+    /* A populated catalog grows to hold the whole tree */
+    catalog_blocks = btree_blocks;
+    if (content) {
+        needed = (uint64_t)populate_catalog_nodes(content, HFS_NODE_SIZE) * HFS_NODE_SIZE;
+        if (needed == 0 || needed > MAP_NODES(HFS_NODE_SIZE) * HFS_NODE_SIZE) {
+            error_print("too many files in %s for an HFS catalog", opts->source_dir);
+            return -1;
+        }
+        needed = (needed + params->allocation_block_size - 1) / params->allocation_block_size;
+        if (needed > catalog_blocks) {
+            catalog_blocks = needed;
+        }
     }
     
-    /* Extents file: minimum 1 allocation block */
-    params->extents_file_size = params->allocation_block_size;
+    params->extents_file_size = btree_blocks * params->allocation_block_size;
+    params->catalog_file_size = catalog_blocks * params->allocation_block_size;
+    params->extents_start_block = 0;
+    params->catalog_start_block = btree_blocks;
+    
+    if (btree_blocks + catalog_blocks >= params->total_allocation_blocks) {
+        error_print("volume too small for HFS");
+        return -1;
+    }
     
-    /* Calculate free allocation blocks (total minus system files) */
-    /* System uses: boot blocks (2), MDB (1), alternate MDB (1), bitmap, catalog, extents */
-    uint32_t bitmap_blocks = ((params->total_allocation_blocks + 7) / 8 + params->allocation_block_size - 1) / params->allocation_block_size;
-    uint32_t catalog_blocks = (params->catalog_file_size + params->allocation_block_size - 1) / params->allocation_block_size;
-    uint32_t extents_blocks = (params->extents_file_size + params->allocation_block_size - 1) / params->allocation_block_size;
+    /* File data follows the catalog, one extent per fork */
+    if (content) {
+        needed = populate_layout(content, btree_blocks + catalog_blocks,
+                                 params->allocation_block_size);
+        if (btree_blocks + catalog_blocks + needed > params->total_allocation_blocks) {
+            error_print("%s does not fit on the volume", opts->source_dir);
+            return -1;
+        }
+        params->data_blocks = needed;
+    }
     
-    params->free_allocation_blocks = params->total_allocation_blocks - bitmap_blocks - catalog_blocks - extents_blocks;
+    params->free_allocation_blocks = params->total_allocation_blocks - btree_blocks -
+                                     catalog_blocks - params->data_blocks;
     
     /* Set creation date */
     params->creation_date = hfs_get_safe_time();
@@ -398,7 +719,7 @@ static int calculate_volume_parameters(const char *device_path, mkfs_options_t *
  * NAME:    write_boot_blocks()
  * DESCRIPTION: Write HFS boot blocks (blocks 0-1)
  */
-static int write_boot_blocks(int fd, const volume_params_t *params)
+static int write_boot_blocks(write_plan_t *plan, const volume_params_t *params)
 {
     unsigned char boot_block[1024];
     
@@ -418,32 +739,20 @@ static int write_boot_blocks(int fd, const volume_params_t *params)
     boot_block[6] = 0x80;  /* High byte: bit 7 = new format */
     boot_block[7] = 0x15;  /* Low byte: >= $15 for heap use */
     
-    /* Write to device */
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to boot blocks");
-        return -1;
-    }
-    
-    if (write(fd, boot_block, sizeof(boot_block)) != sizeof(boot_block)) {
-        error_print_errno("failed to write boot blocks");
-        return -1;
-    }
-    
-    return 0;
+    return write_plan_add(plan, 0, boot_block, sizeof(boot_block), "boot blocks");
 }
 
 /*
  * NAME:    write_master_directory_block()
  * DESCRIPTION: Write HFS Master Directory Block according to specification
  */
-static int write_master_directory_block(int fd, const volume_params_t *params, 
+static int write_master_directory_block(write_plan_t *plan, off_t offset, const volume_params_t *params,
                                        const mkfs_options_t *opts)
 {
     unsigned char mdb_block[512];
     uint32_t hfs_date;
     size_t name_len;
-    uint32_t catalog_blocks, extents_blocks;
-    uint32_t bitmap_blocks;
+    uint16_t extents_blocks, catalog_blocks;
     
     /* Clear MDB block */
     memset(mdb_block, 0, sizeof(mdb_block));
@@ -451,297 +760,286 @@ static int write_master_directory_block(int fd, const volume_params_t *params,
     /* Convert Unix time to HFS time (seconds since 1904) */
     hfs_date = params->creation_date + HFS_EPOCH_OFFSET;
     
-    /* Calculate system file allocation blocks */
-    bitmap_blocks = ((params->total_allocation_blocks + 7) / 8 + params->allocation_block_size - 1) / params->allocation_block_size;
-    catalog_blocks = (params->catalog_file_size + params->allocation_block_size - 1) / params->allocation_block_size;
-    extents_blocks = (params->extents_file_size + params->allocation_block_size - 1) / params->allocation_block_size;
+    extents_blocks = params->extents_file_size / params->allocation_block_size;
+    catalog_blocks = params->catalog_file_size / params->allocation_block_size;
     
     /* Set MDB fields according to HFS specification (Inside Macintosh: Files) */
     
     /* drSigWord: HFS signature ($4244 = 'BD') */
-    mdb_block[0] = 0x42;
-    mdb_block[1] = 0x44;
+    put_be16(mdb_block + 0, 0x4244);
     
-    /* drCrDate: Creation date */
-    mdb_block[2] = (hfs_date >> 24) & 0xFF;
-    mdb_block[3] = (hfs_date >> 16) & 0xFF;
-    mdb_block[4] = (hfs_date >> 8) & 0xFF;
-    mdb_block[5] = hfs_date & 0xFF;
-    
-    /* drLsMod: Last modification date (same as creation) */
-    mdb_block[6] = (hfs_date >> 24) & 0xFF;
-    mdb_block[7] = (hfs_date >> 16) & 0xFF;
-    mdb_block[8] = (hfs_date >> 8) & 0xFF;
-    mdb_block[9] = hfs_date & 0xFF;
+    /* drCrDate, drLsMod: creation and last modification dates */
+    put_be32(mdb_block + 2, hfs_date);
+    put_be32(mdb_block + 6, hfs_date);
     
     /* drAtrb: Volume attributes (bit 8=unmounted cleanly) */
-    mdb_block[10] = 0x01;  /* Set unmounted bit */
-    mdb_block[11] = 0x00;
-    
-    /* drNmFls: Number of files in root directory (0 initially) */
-    mdb_block[12] = 0x00;
-    mdb_block[13] = 0x00;
+    put_be16(mdb_block + 10, 0x0100);
     
     /* drVBMSt: Volume bitmap start block (always 3) */
-    mdb_block[14] = 0x00;
-    mdb_block[15] = 0x03;
+    put_be16(mdb_block + 14, 3);
     
     /* drAllocPtr: Next allocation search pointer (start after system files) */
-    uint16_t alloc_ptr = bitmap_blocks + catalog_blocks + extents_blocks;
-    mdb_block[16] = (alloc_ptr >> 8) & 0xFF;
-    mdb_block[17] = alloc_ptr & 0xFF;
+    put_be16(mdb_block + 16, params->catalog_start_block + catalog_blocks + params->data_blocks);
     
     /* drNmAlBlks: Number of allocation blocks */
-    mdb_block[18] = (params->total_allocation_blocks >> 8) & 0xFF;
-    mdb_block[19] = params->total_allocation_blocks & 0xFF;
+    put_be16(mdb_block + 18, params->total_allocation_blocks);
     
     /* drAlBlkSiz: Allocation block size */
-    mdb_block[20] = (params->allocation_block_size >> 24) & 0xFF;
-    mdb_block[21] = (params->allocation_block_size >> 16) & 0xFF;
-    mdb_block[22] = (params->allocation_block_size >> 8) & 0xFF;
-    mdb_block[23] = params->allocation_block_size & 0xFF;
+    put_be32(mdb_block + 20, params->allocation_block_size);
     
     /* drClpSiz: Default clump size (4 * allocation block size) */
-    uint32_t clump_size = params->allocation_block_size * 4;
-    mdb_block[24] = (clump_size >> 24) & 0xFF;
-    mdb_block[25] = (clump_size >> 16) & 0xFF;
-    mdb_block[26] = (clump_size >> 8) & 0xFF;
-    mdb_block[27] = clump_size & 0xFF;
+    put_be32(mdb_block + 24, params->allocation_block_size * 4);
     
-    /* drAlBlSt: First allocation block (after bitmap) */
-    uint16_t first_alloc_block = 3 + bitmap_blocks;
-    mdb_block[28] = (first_alloc_block >> 8) & 0xFF;
-    mdb_block[29] = first_alloc_block & 0xFF;
+    /* drAlBlSt: First sector of allocation block 0 (after bitmap) */
+    put_be16(mdb_block + 28, params->first_allocation_sector);
     
     /* drNxtCNID: Next catalog node ID (start at 16 per spec) */
-    mdb_block[30] = 0x00;
-    mdb_block[31] = 0x00;
-    mdb_block[32] = 0x00;
-    mdb_block[33] = 0x10;
+    put_be32(mdb_block + 30, params->content ? params->content->next_cnid : 16);
     
     /* drFreeBks: Number of free allocation blocks */
-    mdb_block[34] = (params->free_allocation_blocks >> 8) & 0xFF;
-    mdb_block[35] = params->free_allocation_blocks & 0xFF;
+    put_be16(mdb_block + 34, params->free_allocation_blocks);
     
     /* drVN: Volume name (Pascal string format - length byte + chars) */
     name_len = strlen(opts->volume_name);
     if (name_len > 27) name_len = 27;
     mdb_block[36] = name_len;
     memcpy(&mdb_block[37], opts->volume_name, name_len);
-    /* Pad remaining bytes with zeros (already done by memset) */
-    
-    /* drVolBkUp: Volume backup date (0 = never backed up) */
-    mdb_block[64] = 0x00;
-    mdb_block[65] = 0x00;
-    mdb_block[66] = 0x00;
-    mdb_block[67] = 0x00;
-    
-    /* drVSeqNum: Volume sequence number (0) */
-    mdb_block[68] = 0x00;
-    mdb_block[69] = 0x00;
-    
-    /* drWrCnt: Write count (0) */
-    mdb_block[70] = 0x00;
-    mdb_block[71] = 0x00;
-    mdb_block[72] = 0x00;
-    mdb_block[73] = 0x00;
-    
-    /* drXTClpSiz: Extents overflow file clump size */
-    uint32_t xt_clump = params->extents_file_size;
-    mdb_block[74] = (xt_clump >> 24) & 0xFF;
-    mdb_block[75] = (xt_clump >> 16) & 0xFF;
-    mdb_block[76] = (xt_clump >> 8) & 0xFF;
-    mdb_block[77] = xt_clump & 0xFF;
-    
-    /* drCTClpSiz: Catalog file clump size */
-    uint32_t ct_clump = params->catalog_file_size;
-    mdb_block[78] = (ct_clump >> 24) & 0xFF;
-    mdb_block[79] = (ct_clump >> 16) & 0xFF;
-    mdb_block[80] = (ct_clump >> 8) & 0xFF;
-    mdb_block[81] = ct_clump & 0xFF;
-    
-    /* drNmRtDirs: Number of directories in root (0 initially) */
-    mdb_block[82] = 0x00;
-    mdb_block[83] = 0x00;
-    
-    /* drFilCnt: Total number of files (0 initially) */
-    mdb_block[84] = 0x00;
-    mdb_block[85] = 0x00;
-    mdb_block[86] = 0x00;
-    mdb_block[87] = 0x00;
-    
-    /* drDirCnt: Total number of directories (1 for root) */
-    mdb_block[88] = 0x00;
-    mdb_block[89] = 0x00;
-    mdb_block[90] = 0x00;
-    mdb_block[91] = 0x01;
     
-    /* drFndrInfo: Finder info (8 longs, all zeros) */
-    /* Already zeroed by memset */
-    
-    /* drXTFlSize: Extents overflow file size in bytes */
-    mdb_block[130] = (params->extents_file_size >> 24) & 0xFF;
-    mdb_block[131] = (params->extents_file_size >> 16) & 0xFF;
-    mdb_block[132] = (params->extents_file_size >> 8) & 0xFF;
-    mdb_block[133] = params->extents_file_size & 0xFF;
-    
-    /* drXTExtRec: Extents overflow file first extent record */
-    uint16_t xt_start_block = bitmap_blocks;
-    mdb_block[134] = (xt_start_block >> 8) & 0xFF;
-    mdb_block[135] = xt_start_block & 0xFF;
-    mdb_block[136] = (extents_blocks >> 8) & 0xFF;
-    mdb_block[137] = extents_blocks & 0xFF;
-    /* Remaining extent entries are zero */
-    
-    /* drCTFlSize: Catalog file size in bytes */
-    mdb_block[146] = (params->catalog_file_size >> 24) & 0xFF;
-    mdb_block[147] = (params->catalog_file_size >> 16) & 0xFF;
-    mdb_block[148] = (params->catalog_file_size >> 8) & 0xFF;
-    mdb_block[149] = params->catalog_file_size & 0xFF;
-    
-    /* drCTExtRec: Catalog file first extent record */
-    uint16_t ct_start_block = bitmap_blocks + extents_blocks;
-    mdb_block[150] = (ct_start_block >> 8) & 0xFF;
-    mdb_block[151] = ct_start_block & 0xFF;
-    mdb_block[152] = (catalog_blocks >> 8) & 0xFF;
-    mdb_block[153] = catalog_blocks & 0xFF;
-    /* Remaining extent entries are zero */
-    
-    /* Write MDB to device */
-    if (write(fd, mdb_block, sizeof(mdb_block)) != sizeof(mdb_block)) {
-        error_print_errno("failed to write master directory block");
-        return -1;
+    /* drVolBkUp, drVSeqNum, drWrCnt: never backed up, never written */
+    
+    /* drXTClpSiz, drCTClpSiz: B*-tree file clump sizes */
+    put_be32(mdb_block + 74, params->clump_size);
+    put_be32(mdb_block + 78, params->clump_size);
+    
+    /* drNmFls, drNmRtDirs, drFilCnt, drDirCnt: the root is not counted */
+    if (params->content) {
+        put_be16(mdb_block + 12, params->content->root_files);
+        put_be16(mdb_block + 82, params->content->root_folders);
+        put_be32(mdb_block + 84, params->content->files);
+        put_be32(mdb_block + 88, params->content->folders);
     }
     
-    return 0;
+    /* drFndrInfo: Finder info (8 longs, all zeros) */
+    
+    /* drXTFlSize, drXTExtRec: Extents overflow file and its first extent */
+    put_be32(mdb_block + 130, params->extents_file_size);
+    put_be16(mdb_block + 134, params->extents_start_block);
+    put_be16(mdb_block + 136, extents_blocks);
+    
+    /* drCTFlSize, drCTExtRec: Catalog file and its first extent */
+    put_be32(mdb_block + 146, params->catalog_file_size);
+    put_be16(mdb_block + 150, params->catalog_start_block);
+    put_be16(mdb_block + 152, catalog_blocks);
+    
+    return write_plan_add(plan, offset, mdb_block, sizeof(mdb_block), "master directory block");
 }
 
 /*
  * NAME:    write_volume_bitmap()
  * DESCRIPTION: Write HFS volume bitmap with correct allocation block marking
  */
-static int write_volume_bitmap(int fd, const volume_params_t *params)
+static int write_volume_bitmap(write_plan_t *plan, const volume_params_t *params)
 {
-    size_t bitmap_size = (params->total_allocation_blocks + 7) / 8;
-    size_t bitmap_sectors = (bitmap_size + params->sector_size - 1) / params->sector_size;
-    unsigned char *bitmap;
-    uint32_t bitmap_blocks, catalog_blocks, extents_blocks;
-    uint32_t used_blocks, i;
-    
-    /* Calculate system file sizes in allocation blocks */
-    bitmap_blocks = (bitmap_size + params->allocation_block_size - 1) / params->allocation_block_size;
-    catalog_blocks = (params->catalog_file_size + params->allocation_block_size - 1) / params->allocation_block_size;
-    extents_blocks = (params->extents_file_size + params->allocation_block_size - 1) / params->allocation_block_size;
-    
-    /* Total used blocks = bitmap + extents + catalog */
-    used_blocks = bitmap_blocks + extents_blocks + catalog_blocks;
-    
-    error_verbose("bitmap allocation: bitmap=%u, extents=%u, catalog=%u blocks", 
-                 bitmap_blocks, extents_blocks, catalog_blocks);
-    
-    /* Allocate bitmap buffer */
-    bitmap = calloc(bitmap_sectors, params->sector_size);
-    if (!bitmap) {
-        error_print_errno("failed to allocate memory for volume bitmap");
-        return -1;
-    }
+    uint32_t used_blocks;
     
-    /* Mark system allocation blocks as used */
-    /* HFS allocation blocks start after the bitmap area */
-    /* Block layout: boot(0-1), MDB(2), bitmap(3+), then allocation blocks */
-    
-    for (i = 0; i < used_blocks && i < params->total_allocation_blocks; i++) {
-        /* Set bit i in the bitmap (bit 0 = allocation block 0) */
-        bitmap[i / 8] |= (0x80 >> (i % 8));
-    }
+    /* The extents and catalog files, then any file data, come first */
+    used_blocks = params->catalog_start_block +
+                  params->catalog_file_size / params->allocation_block_size +
+                  params->data_blocks;
     
-    error_verbose("marked %u allocation blocks as used in bitmap", used_blocks);
+    error_verbose("bitmap allocation: extents=%u, catalog=%u blocks",
+                 params->extents_file_size / params->allocation_block_size,
+                 params->catalog_file_size / params->allocation_block_size);
     
-    /* Seek to bitmap location (block 3) */
-    if (lseek(fd, 3 * params->sector_size, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to volume bitmap");
-        free(bitmap);
+    if (write_bitmap(plan, 3 * params->sector_size,
+                     (uint64_t)params->bitmap_sectors * params->sector_size,
+                     params->sector_size, used_blocks,
+                     params->total_allocation_blocks, params->total_allocation_blocks) != 0) {
         return -1;
     }
     
-    /* Write bitmap */
-    if (write(fd, bitmap, bitmap_sectors * params->sector_size) != (ssize_t)(bitmap_sectors * params->sector_size)) {
-        error_print_errno("failed to write volume bitmap");
-        free(bitmap);
-        return -1;
-    }
+    error_verbose("marked %u allocation blocks as used in bitmap", used_blocks);
     
-    free(bitmap);
     return 0;
 }
 
 /*
  * NAME:    initialize_catalog_file()
- * DESCRIPTION: Initialize empty HFS catalog B*-tree
+ * DESCRIPTION: Initialize HFS catalog B*-tree holding the root directory
+ */
+static int initialize_catalog_file(write_plan_t *plan, const volume_params_t *params,
+                                   const mkfs_options_t *opts)
+{
+    unsigned char nodes[2 * HFS_NODE_SIZE];
+    unsigned char rec[128];
+    btree_layout_t bt;
+    uint32_t hfs_date = params->creation_date + HFS_EPOCH_OFFSET;
+    size_t name_len = strlen(opts->volume_name);
+    size_t keylen;
+    off_t catalog_offset;
+    
+    if (name_len > 27) name_len = 27;
+    
+    catalog_offset = ((off_t)params->first_allocation_sector * params->sector_size) +
+                     (off_t)params->catalog_start_block * params->allocation_block_size;
+    
+    /* With -d, the catalog holds the whole tree */
+    if (params->content) {
+        unsigned char *tree_nodes;
+        uint32_t nnodes;
+        int result;
+        
+        if (build_populated_catalog(params->content, HFS_NODE_SIZE, 0x25,
+                                    params->catalog_file_size, &tree_nodes, &nnodes) != 0) {
+            return -1;
+        }
+        result = write_btree_file(plan, catalog_offset, params->catalog_file_size,
+                                  tree_nodes, nnodes, HFS_NODE_SIZE, "catalog file");
+        free(tree_nodes);
+        return result;
+    }
+    
+    /* Node 0 is the header, node 1 the only leaf */
+    memset(&bt, 0, sizeof(bt));
+    bt.node_size = HFS_NODE_SIZE;
+    bt.depth = 1;
+    bt.root = 1;
+    bt.leaf_records = 2;
+    bt.first_leaf = 1;
+    bt.last_leaf = 1;
+    bt.max_key_length = 0x25;
+    bt.total_nodes = params->catalog_file_size / HFS_NODE_SIZE;
+    bt.used_nodes = 2;
+    
+    btree_header_node(nodes, &bt);
+    btree_init_node(nodes + HFS_NODE_SIZE, HFS_NODE_SIZE, -1, 1);
+    
+    /* Root directory: key (parent 1, volume name), then the directory record */
+    memset(rec, 0, sizeof(rec));
+    rec[0] = 6 + name_len;
+    put_be32(rec + 2, 1);
+    rec[6] = name_len;
+    memcpy(rec + 7, opts->volume_name, name_len);
+    keylen = (1 + rec[0] + 1) & ~1;
+    rec[keylen + 0] = 1;                        /* cdrDirRec */
+    put_be32(rec + keylen + 6, 2);              /* dirDirID */
+    put_be32(rec + keylen + 10, hfs_date);      /* dirCrDat */
+    put_be32(rec + keylen + 14, hfs_date);      /* dirMdDat */
+    btree_add_record(nodes + HFS_NODE_SIZE, HFS_NODE_SIZE, rec, keylen + 70);
+    
+    /* Its thread: key (2, ""), pointing back at parent 1 and the name */
+    memset(rec, 0, sizeof(rec));
+    rec[0] = 6;
+    put_be32(rec + 2, 2);
+    keylen = 8;
+    rec[keylen + 0] = 3;                        /* cdrThdRec */
+    put_be32(rec + keylen + 10, 1);             /* thdParID */
+    rec[keylen + 14] = name_len;                /* thdCName */
+    memcpy(rec + keylen + 15, opts->volume_name, name_len);
+    btree_add_record(nodes + HFS_NODE_SIZE, HFS_NODE_SIZE, rec, keylen + 46);
+    
+    return write_btree_file(plan, catalog_offset, params->catalog_file_size,
+                            nodes, 2, HFS_NODE_SIZE, "catalog file");
+}
+
+/*
+ * NAME:    initialize_extents_file()
+ * DESCRIPTION: Initialize empty HFS extents overflow B*-tree
+ */
+static int initialize_extents_file(write_plan_t *plan, const volume_params_t *params)
+{
+    unsigned char node[HFS_NODE_SIZE];
+    btree_layout_t bt;
+    off_t extents_offset;
+    
+    /* An empty tree is just its header node */
+    memset(&bt, 0, sizeof(bt));
+    bt.node_size = HFS_NODE_SIZE;
+    bt.max_key_length = 0x07;
+    bt.total_nodes = params->extents_file_size / HFS_NODE_SIZE;
+    bt.used_nodes = 1;
+    
+    btree_header_node(node, &bt);
+    
+    extents_offset = ((off_t)params->first_allocation_sector * params->sector_size) +
+                     (off_t)params->extents_start_block * params->allocation_block_size;
+    
+    return write_btree_file(plan, extents_offset, params->extents_file_size,
+                            node, 1, HFS_NODE_SIZE, "extents file");
+}
+
+/*
+ * NAME:    plan_hfs_layout()
+ * DESCRIPTION: Queue the HFS structures that depend only on the volume
+ *              geometry: boot blocks, bitmap, extents file, last sector
  */
-static int initialize_catalog_file(int fd, const volume_params_t *params)
+static int plan_hfs_layout(write_plan_t *plan, const volume_params_t *params)
 {
-    /* TODO: Implement catalog B*-tree initialization */
-    /* For now, just write zeros */
-    unsigned char *catalog_data = calloc(1, params->catalog_file_size);
-    if (!catalog_data) {
-        error_print_errno("failed to allocate memory for catalog file");
+    unsigned char tail[1024];
+    
+    /*
+     * Only blocks holding something are written; the unused parts of the
+     * bitmap and B*-tree files are cleared with device_zero_range(), which
+     * leaves holes in image files instead of writing zeros.
+     */
+    
+    /* Boot blocks (blocks 0-1) */
+    error_verbose("writing boot blocks");
+    if (write_boot_blocks(plan, params) != 0) {
+        error_print("failed to write boot blocks");
         return -1;
     }
     
-    /* Calculate catalog file location (after bitmap) */
-    size_t bitmap_size = (params->total_allocation_blocks + 7) / 8;
-    size_t bitmap_sectors = (bitmap_size + params->sector_size - 1) / params->sector_size;
-    off_t catalog_offset = (3 + bitmap_sectors) * params->sector_size;
-    
-    if (lseek(fd, catalog_offset, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to catalog file location");
-        free(catalog_data);
+    /* Volume bitmap (starting at block 3) */
+    error_verbose("writing volume bitmap");
+    if (write_volume_bitmap(plan, params) != 0) {
+        error_print("failed to write volume bitmap");
         return -1;
     }
     
-    if (write(fd, catalog_data, params->catalog_file_size) != (ssize_t)params->catalog_file_size) {
-        error_print_errno("failed to write catalog file");
-        free(catalog_data);
+    /* Extents overflow file B*-tree */
+    error_verbose("initializing extents overflow file");
+    if (initialize_extents_file(plan, params) != 0) {
+        error_print("failed to initialize extents overflow file");
         return -1;
     }
     
-    free(catalog_data);
-    return 0;
+    /* The last sector is reserved */
+    memset(tail, 0, sizeof(tail));
+    return write_plan_add(plan, (off_t)(params->total_sectors - 1) * params->sector_size,
+                          tail, params->sector_size, "last sector");
 }
 
 /*
- * NAME:    initialize_extents_file()
- * DESCRIPTION: Initialize empty HFS extents overflow B*-tree
+ * NAME:    plan_hfs_volume()
+ * DESCRIPTION: Queue the HFS structures that carry the volume name and
+ *              dates: both MDBs and the catalog
  */
-static int initialize_extents_file(int fd, const volume_params_t *params)
+static int plan_hfs_volume(write_plan_t *plan, const volume_params_t *params,
+                           const mkfs_options_t *opts)
 {
-    /* TODO: Implement extents B*-tree initialization */
-    /* For now, just write zeros */
-    unsigned char *extents_data = calloc(1, params->extents_file_size);
-    if (!extents_data) {
-        error_print_errno("failed to allocate memory for extents file");
+    /* Master Directory Block (block 2) */
+    error_verbose("writing master directory block");
+    if (write_master_directory_block(plan, 2 * params->sector_size, params, opts) != 0) {
+        error_print("failed to write master directory block");
         return -1;
     }
     
-    /* Calculate extents file location (after catalog file) */
-    size_t bitmap_size = (params->total_allocation_blocks + 7) / 8;
-    size_t bitmap_sectors = (bitmap_size + params->sector_size - 1) / params->sector_size;
-    off_t extents_offset = (3 + bitmap_sectors) * params->sector_size + params->catalog_file_size;
-    
-    if (lseek(fd, extents_offset, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to extents file location");
-        free(extents_data);
+    /* Catalog file B*-tree */
+    error_verbose("initializing catalog file");
+    if (initialize_catalog_file(plan, params, opts) != 0) {
+        error_print("failed to initialize catalog file");
         return -1;
     }
     
-    if (write(fd, extents_data, params->extents_file_size) != (ssize_t)params->extents_file_size) {
-        error_print_errno("failed to write extents file");
-        free(extents_data);
+    /* Alternate Master Directory Block (second to last sector) */
+    error_verbose("writing alternate master directory block");
+    if (write_master_directory_block(plan, (off_t)(params->total_sectors - 2) * params->sector_size,
+                                     params, opts) != 0) {
+        error_print("failed to write alternate master directory block");
         return -1;
     }
     
-    free(extents_data);
     return 0;
 }
 
@@ -749,9 +1047,11 @@ static int initialize_extents_file(int fd, const volume_params_t *params)
  * NAME:    format_hfs_volume()
  * DESCRIPTION: Perform the actual HFS formatting using libhfs-style logic
  */
-static int format_hfs_volume(const char *device_path, int partno, 
-                            const mkfs_options_t *opts, const volume_params_t *params)
+static int format_hfs_volume(const char *device_path, int partno,
+                            const mkfs_options_t *opts, const volume_params_t *params,
+                            write_plan_t *plan, const write_plan_t *layout)
 {
+    struct stat st;
     int fd = -1;
     int result = -1;
     
@@ -760,6 +1060,23 @@ static int format_hfs_volume(const char *device_path, int partno,
         return -1;
     }
     
+    /*
+     * The structures are queued in the write plan and only reach the
+     * device when it is flushed.  A batch template supplies the ones that
+     * depend on nothing but the volume size.
+     */
+    if (layout) {
+        if (write_plan_share(plan, layout) != 0) {
+            return -1;
+        }
+    } else if (plan_hfs_layout(plan, params) != 0) {
+        return -1;
+    }
+    
+    if (plan_hfs_volume(plan, params, opts) != 0) {
+        return -1;
+    }
+    
     /* Open device for writing */
     suid_enable();
     fd = open(device_path, O_RDWR);
@@ -772,53 +1089,36 @@ static int format_hfs_volume(const char *device_path, int partno,
     
     error_verbose("device opened successfully");
     
-    /* Write HFS structures in order following HFS specification */
-    
-    /* 1. Write boot blocks (blocks 0-1) */
-    error_verbose("writing boot blocks");
-    if (write_boot_blocks(fd, params) != 0) {
-        error_print("failed to write boot blocks");
-        goto cleanup;
-    }
-    
-    /* 2. Write Master Directory Block (block 2) */
-    error_verbose("writing master directory block");
-    if (write_master_directory_block(fd, params, opts) != 0) {
-        error_print("failed to write master directory block");
-        goto cleanup;
-    }
-    
-    /* 3. Write volume bitmap (starting at block 3) */
-    error_verbose("writing volume bitmap");
-    if (write_volume_bitmap(fd, params) != 0) {
-        error_print("failed to write volume bitmap");
-        goto cleanup;
+    /* An image file smaller than the requested size is extended sparse */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < params->device_size) {
+        if (ftruncate(fd, params->device_size) != 0) {
+            error_print_errno("cannot extend %s", device_path);
+            goto cleanup;
+        }
     }
     
-    /* 4. Initialize catalog file B*-tree */
-    error_verbose("initializing catalog file");
-    if (initialize_catalog_file(fd, params) != 0) {
-        error_print("failed to initialize catalog file");
+    if (write_plan_flush(plan, fd) != 0) {
         goto cleanup;
     }
     
-    /* 5. Initialize extents overflow file B*-tree */
-    error_verbose("initializing extents overflow file");
-    if (initialize_extents_file(fd, params) != 0) {
-        error_print("failed to initialize extents overflow file");
-        goto cleanup;
+    /* With -d, the file data follows the catalog */
+    if (params->content) {
+        error_verbose("copying files");
+        if (populate_write_forks(params->content, fd,
+                                 (off_t)params->first_allocation_sector * params->sector_size) != 0) {
+            error_print("failed to copy files");
+            goto cleanup;
+        }
     }
     
-    /* 6. Write alternate Master Directory Block (1024 bytes before end, per TN1150) */
-    error_verbose("writing alternate master directory block");
-    if (lseek(fd, params->device_size - 1024, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to alternate MDB location");
-        goto cleanup;
-    }
-    if (write_master_directory_block(fd, params, opts) != 0) {
-        error_print("failed to write alternate master directory block");
-        goto cleanup;
-    }
+    /* With -D, the blocks after the catalog and file data are discarded */
+    discard_free_area(fd, opts,
+                      (off_t)params->first_allocation_sector * params->sector_size +
+                      (off_t)(params->catalog_start_block +
+                              params->catalog_file_size / params->allocation_block_size +
+                              params->data_blocks) * params->allocation_block_size,
+                      (off_t)params->first_allocation_sector * params->sector_size +
+                      (off_t)params->total_allocation_blocks * params->allocation_block_size);
     
     /* Sync to ensure all data is written */
     if (fsync(fd) != 0) {
@@ -840,7 +1140,8 @@ cleanup:
  * NAME:    verify_hfs_volume()
  * DESCRIPTION: Verify the created HFS volume
  */
-static int verify_hfs_volume(const char *device_path, int partno, const mkfs_options_t *opts)
+static int verify_hfs_volume(const char *device_path, int partno, const mkfs_options_t *opts,
+                             write_plan_t *plan)
 {
     hfs_volume_info_t vol_info;
     int fd;
@@ -855,6 +1156,13 @@ static int verify_hfs_volume(const char *device_path, int partno, const mkfs_opt
         return -1;
     }
     
+    /* Everything the format wrote must read back unchanged */
+    if (write_plan_verify(plan, fd) != 0) {
+        error_print("verification failed: metadata did not read back as written");
+        close(fd);
+        return -1;
+    }
+    
     /* Read volume information */
     if (hfs_read_volume_info(fd, &vol_info) != 0) {
         error_print("failed to read volume information for verification");
@@ -922,72 +1230,152 @@ static int validate_volume_name(const char *vname)
     
     return 0;
 }
-/*
 
- * NAME:    calculate_hfsplus_volume_parameters()
- * DESCRIPTION: Calculate HFS+ volume parameters based on device size
+/*
+ * NAME:    create_image_file()
+ * DESCRIPTION: Create a sparse image file of the requested size
  */
-static int calculate_hfsplus_volume_parameters(const char *device_path, mkfs_options_t *opts,
-                                             hfsplus_volume_params_t *params)
+static int create_image_file(const char *path, long long size)
 {
-    memset(params, 0, sizeof(*params));
+    int fd;
     
-    /* Get device size */
-    params->device_size = device_get_size(device_path);
-    if (params->device_size <= 0) {
-        error_print("cannot determine device size");
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd == -1) {
+        error_print_errno("cannot create image file %s", path);
         return -1;
     }
     
-    /* Set sector size (always 512) */
-    params->sector_size = 512;
-    params->total_sectors = params->device_size / params->sector_size;
-    
-    /* HFS+ uses larger block sizes for efficiency */
-    /* Default block size is 4096 bytes for volumes > 1GB, 512 for smaller */
-    if (params->device_size > 1024 * 1024 * 1024) {  /* > 1GB */
-        params->block_size = 4096;
-    } else {
-        params->block_size = 512;
+    /* No data is written; the file system fills in the blocks it needs */
+    if (ftruncate(fd, size) != 0) {
+        error_print_errno("cannot set size of image file %s", path);
+        close(fd);
+        unlink(path);
+        return -1;
     }
     
-    /* Calculate total blocks */
-    params->total_blocks = params->device_size / params->block_size;
+    close(fd);
+    error_verbose("created %lld byte image file %s", size, path);
+    
+    return 0;
+}
+
+/*
+ * NAME:    calculate_hfsplus_volume_parameters()
+ * DESCRIPTION: Calculate HFS+ volume parameters for a volume of device_size bytes
+ */
+static int calculate_hfsplus_volume_parameters(off_t device_size, mkfs_options_t *opts,
+                                             populate_t *content,
+                                             hfsplus_volume_params_t *params)
+{
+    uint64_t total_blocks, btree_max, needed, used_blocks;
+    uint32_t unit, head_blocks, allocation_blocks, extents_blocks, catalog_blocks;
+    
+    memset(params, 0, sizeof(*params));
+    params->content = content;
+    params->device_size = device_size;
+    
+    /* Set sector size (always 512) */
+    params->sector_size = 512;
+    params->total_sectors = params->device_size / params->sector_size;
+    
+    /* HFS+ uses larger block sizes for efficiency */
+    /* Default block size is 4096 bytes for volumes > 1GB, 512 for smaller */
+    if (params->device_size > 1024 * 1024 * 1024) {  /* > 1GB */
+        params->block_size = 4096;
+    } else {
+        params->block_size = 512;
+    }
+    
+    /* Calculate total blocks */
+    total_blocks = params->device_size / params->block_size;
     
     /* HFS+ can handle much larger volumes than HFS */
-    if (params->total_blocks > 0xFFFFFFFF) {
+    if (total_blocks > 0xFFFFFFFF) {
         error_print("volume too large for HFS+");
         return -1;
     }
+    params->total_blocks = total_blocks;
+    
+    /*
+     * Layout: the boot blocks and volume header, then the allocation
+     * file, the extents overflow file and the catalog file.  The last
+     * 1024 bytes hold the alternate volume header and are reserved too.
+     */
+    head_blocks = (1536 + params->block_size - 1) / params->block_size;
     
-    /* Calculate system file sizes (larger than HFS) */
     /* Allocation file: 1 bit per block, rounded up to block size */
-    params->allocation_file_size = ((params->total_blocks + 7) / 8 + params->block_size - 1) & ~(params->block_size - 1);
+    allocation_blocks = ((params->total_blocks + 7) / 8 + params->block_size - 1) / params->block_size;
+    params->allocation_file_size = allocation_blocks * params->block_size;
+    
+    /*
+     * B*-tree files are whole nodes and whole blocks, scaled to the
+     * volume but no larger than one header node map can track.
+     */
+    unit = params->block_size > HFSPLUS_NODE_SIZE ? params->block_size : HFSPLUS_NODE_SIZE;
+    btree_max = (uint64_t)MAP_NODES(HFSPLUS_NODE_SIZE) * HFSPLUS_NODE_SIZE;
     
-    /* Catalog file: larger initial size for HFS+ */
-    params->catalog_file_size = params->block_size * 4;  /* 4 blocks minimum */
-    if (params->total_blocks > 10000) {
-        params->catalog_file_size = params->block_size * (params->total_blocks / 2500);
+    params->catalog_file_size = (params->device_size / 256 < btree_max ?
+                                 params->device_size / 256 : btree_max) / unit * unit;
+    if (params->catalog_file_size < 4 * unit) {
+        params->catalog_file_size = 4 * unit;
     }
     
-    /* Extents overflow file: 1 block minimum */
-    params->extents_file_size = params->block_size;
+    params->extents_file_size = (params->device_size / 1024 < btree_max ?
+                                 params->device_size / 1024 : btree_max) / unit * unit;
+    if (params->extents_file_size < 4 * unit) {
+        params->extents_file_size = 4 * unit;
+    }
     
-    /* Attributes file: 1 block (for extended attributes) */
-    params->attributes_file_size = params->block_size;
+    /* A populated catalog grows to hold the whole tree */
+    if (content) {
+        needed = (uint64_t)populate_catalog_nodes(content, HFSPLUS_NODE_SIZE) * HFSPLUS_NODE_SIZE;
+        if (needed == 0 || needed > btree_max) {
+            error_print("too many files in %s for an HFS+ catalog", opts->source_dir);
+            return -1;
+        }
+        needed = (needed + unit - 1) / unit * unit;
+        if (needed > params->catalog_file_size) {
+            params->catalog_file_size = needed;
+        }
+    }
     
-    /* Startup file: 0 (not used) */
+    extents_blocks = params->extents_file_size / params->block_size;
+    catalog_blocks = params->catalog_file_size / params->block_size;
+    
+    /* Attributes and startup files are created when first needed */
+    params->attributes_file_size = 0;
     params->startup_file_size = 0;
     
-    /* Calculate free blocks */
-    uint32_t system_blocks = 
-        (params->allocation_file_size + params->block_size - 1) / params->block_size +
-        (params->catalog_file_size + params->block_size - 1) / params->block_size +
-        (params->extents_file_size + params->block_size - 1) / params->block_size +
-        (params->attributes_file_size + params->block_size - 1) / params->block_size +
-        3;  /* Boot blocks + volume header + alternate volume header */
+    params->allocation_start_block = head_blocks;
+    params->extents_start_block = params->allocation_start_block + allocation_blocks;
+    params->catalog_start_block = params->extents_start_block + extents_blocks;
+    
+    /* Blocks overlapping the alternate volume header */
+    params->tail_start_block = (params->device_size - 1024) / params->block_size;
+    if (params->tail_start_block > params->total_blocks) {
+        params->tail_start_block = params->total_blocks;
+    }
+    
+    if ((uint64_t)params->catalog_start_block + catalog_blocks >= params->tail_start_block) {
+        error_print("volume too small for HFS+");
+        return -1;
+    }
+    
+    /* File data follows the catalog, one extent per fork */
+    if (content) {
+        needed = populate_layout(content, params->catalog_start_block + catalog_blocks,
+                                 params->block_size);
+        if (params->catalog_start_block + catalog_blocks + needed > params->tail_start_block) {
+            error_print("%s does not fit on the volume", opts->source_dir);
+            return -1;
+        }
+        params->data_blocks = needed;
+    }
+    
+    used_blocks = params->catalog_start_block + catalog_blocks + params->data_blocks +
+                  (params->total_blocks - params->tail_start_block);
     
-    params->free_blocks = params->total_blocks - system_blocks;
+    params->free_blocks = params->total_blocks - used_blocks;
     
     /* Set creation date */
     params->creation_date = hfs_get_safe_time();
@@ -1007,13 +1395,107 @@ static int calculate_hfsplus_volume_parameters(const char *device_path, mkfs_opt
     return 0;
 }
 
+/*
+ * NAME:    plan_hfsplus_layout()
+ * DESCRIPTION: Queue the HFS+ structures that depend only on the volume
+ *              geometry: boot blocks, allocation and extents files, and
+ *              the reserved areas
+ */
+static int plan_hfsplus_layout(write_plan_t *plan, const hfsplus_volume_params_t *params)
+{
+    off_t tail_offset, alternate_offset;
+    unsigned char tail[1024];
+    
+    /*
+     * Only blocks holding something are written; the unused parts of the
+     * allocation and B*-tree files are cleared with device_zero_range(),
+     * which leaves holes in image files instead of writing zeros.
+     */
+    
+    /* Boot blocks (blocks 0-1) */
+    error_verbose("writing HFS+ boot blocks");
+    if (write_hfsplus_boot_blocks(plan, params) != 0) {
+        error_print("failed to write boot blocks");
+        return -1;
+    }
+    
+    /* The rest of the first allocation blocks is unused */
+    if (write_plan_zero(plan, 1536,
+                        (off_t)params->allocation_start_block * params->block_size - 1536,
+                        "reserved blocks") != 0) {
+        return -1;
+    }
+    
+    /* Allocation bitmap */
+    error_verbose("writing allocation bitmap");
+    if (write_hfsplus_allocation_bitmap(plan, params) != 0) {
+        error_print("failed to write allocation bitmap");
+        return -1;
+    }
+    
+    /* Extents overflow file B*-tree */
+    error_verbose("initializing extents overflow file");
+    if (initialize_hfsplus_extents_file(plan, params) != 0) {
+        error_print("failed to initialize extents overflow file");
+        return -1;
+    }
+    
+    /* Blocks between the last allocation block and the alternate header */
+    tail_offset = (off_t)params->tail_start_block * params->block_size;
+    alternate_offset = params->device_size - 1024;
+    
+    if (tail_offset < alternate_offset &&
+        write_plan_zero(plan, tail_offset, alternate_offset - tail_offset,
+                        "reserved blocks") != 0) {
+        return -1;
+    }
+    
+    /* The last sector is reserved */
+    memset(tail, 0, sizeof(tail));
+    return write_plan_add(plan, params->device_size - 512, tail, 512, "last sector");
+}
+
+/*
+ * NAME:    plan_hfsplus_volume()
+ * DESCRIPTION: Queue the HFS+ structures that carry the volume name and
+ *              dates: both volume headers and the catalog
+ */
+static int plan_hfsplus_volume(write_plan_t *plan, const hfsplus_volume_params_t *params,
+                               const mkfs_options_t *opts)
+{
+    /* Volume Header (block 2) */
+    error_verbose("writing HFS+ volume header");
+    if (write_hfsplus_volume_header(plan, 1024, params, opts) != 0) {
+        error_print("failed to write volume header");
+        return -1;
+    }
+    
+    /* Catalog file B*-tree */
+    error_verbose("initializing catalog file");
+    if (initialize_hfsplus_catalog_file(plan, params, opts) != 0) {
+        error_print("failed to initialize catalog file");
+        return -1;
+    }
+    
+    /* Alternate Volume Header (1024 bytes before end, per TN1150) */
+    error_verbose("writing alternate volume header");
+    if (write_hfsplus_volume_header(plan, params->device_size - 1024, params, opts) != 0) {
+        error_print("failed to write alternate volume header");
+        return -1;
+    }
+    
+    return 0;
+}
+
 /*
  * NAME:    format_hfsplus_volume()
  * DESCRIPTION: Perform the actual HFS+ formatting
  */
 static int format_hfsplus_volume(const char *device_path, int partno,
-                                const mkfs_options_t *opts, const hfsplus_volume_params_t *params)
+                                const mkfs_options_t *opts, const hfsplus_volume_params_t *params,
+                                write_plan_t *plan, const write_plan_t *layout)
 {
+    struct stat st;
     int fd = -1;
     int result = -1;
     
@@ -1022,6 +1504,23 @@ static int format_hfsplus_volume(const char *device_path, int partno,
         return -1;
     }
     
+    /*
+     * The structures are queued in the write plan and only reach the
+     * device when it is flushed.  A batch template supplies the ones that
+     * depend on nothing but the volume size.
+     */
+    if (layout) {
+        if (write_plan_share(plan, layout) != 0) {
+            return -1;
+        }
+    } else if (plan_hfsplus_layout(plan, params) != 0) {
+        return -1;
+    }
+    
+    if (plan_hfsplus_volume(plan, params, opts) != 0) {
+        return -1;
+    }
+    
     /* Open device for writing */
     suid_enable();
     fd = open(device_path, O_RDWR);
@@ -1034,53 +1533,33 @@ static int format_hfsplus_volume(const char *device_path, int partno,
     
     error_verbose("device opened successfully");
     
-    /* Write HFS+ structures in order */
-    
-    /* 1. Write boot blocks (blocks 0-1) */
-    error_verbose("writing HFS+ boot blocks");
-    if (write_hfsplus_boot_blocks(fd, params) != 0) {
-        error_print("failed to write boot blocks");
-        goto cleanup;
-    }
-    
-    /* 2. Write Volume Header (block 2) */
-    error_verbose("writing HFS+ volume header");
-    if (write_hfsplus_volume_header(fd, params, opts) != 0) {
-        error_print("failed to write volume header");
-        goto cleanup;
-    }
-    
-    /* 3. Write allocation bitmap */
-    error_verbose("writing allocation bitmap");
-    if (write_hfsplus_allocation_bitmap(fd, params) != 0) {
-        error_print("failed to write allocation bitmap");
-        goto cleanup;
+    /* An image file smaller than the requested size is extended sparse */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < params->device_size) {
+        if (ftruncate(fd, params->device_size) != 0) {
+            error_print_errno("cannot extend %s", device_path);
+            goto cleanup;
+        }
     }
     
-    /* 4. Initialize catalog file B*-tree */
-    error_verbose("initializing catalog file");
-    if (initialize_hfsplus_catalog_file(fd, params) != 0) {
-        error_print("failed to initialize catalog file");
+    if (write_plan_flush(plan, fd) != 0) {
         goto cleanup;
     }
     
-    /* 5. Initialize extents overflow file B*-tree */
-    error_verbose("initializing extents overflow file");
-    if (initialize_hfsplus_extents_file(fd, params) != 0) {
-        error_print("failed to initialize extents overflow file");
-        goto cleanup;
+    /* With -d, the file data follows the catalog */
+    if (params->content) {
+        error_verbose("copying files");
+        if (populate_write_forks(params->content, fd, 0) != 0) {
+            error_print("failed to copy files");
+            goto cleanup;
+        }
     }
     
-    /* 6. Write alternate Volume Header (1024 bytes before end, per TN1150) */
-    error_verbose("writing alternate volume header");
-    if (lseek(fd, params->device_size - 1024, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to alternate volume header location");
-        goto cleanup;
-    }
-    if (write_hfsplus_volume_header(fd, params, opts) != 0) {
-        error_print("failed to write alternate volume header");
-        goto cleanup;
-    }
+    /* With -D, everything up to the block of the alternate header goes */
+    discard_free_area(fd, opts,
+                      (off_t)(params->catalog_start_block +
+                              params->catalog_file_size / params->block_size +
+                              params->data_blocks) * params->block_size,
+                      (off_t)params->tail_start_block * params->block_size);
     
     /* Sync to ensure all data is written */
     if (fsync(fd) != 0) {
@@ -1098,11 +1577,30 @@ cleanup:
     return result;
 }
 
+/*
+ * NAME:    discard_free_area()
+ * DESCRIPTION: Let the device or image drop the old contents of the free
+ *              allocation blocks; a device that cannot discard is only
+ *              worth a warning
+ */
+static void discard_free_area(int fd, const mkfs_options_t *opts, off_t start, off_t end)
+{
+    if (!opts->discard || end <= start) {
+        return;
+    }
+    
+    error_verbose("discarding %lld bytes of free space", (long long)(end - start));
+    
+    if (device_discard_range(fd, start, end - start) != 0) {
+        error_warning("cannot discard free space: %s", strerror(errno));
+    }
+}
+
 /*
  * NAME:    write_hfsplus_boot_blocks()
  * DESCRIPTION: Write HFS+ boot blocks (same as HFS)
  */
-static int write_hfsplus_boot_blocks(int fd, const hfsplus_volume_params_t *params)
+static int write_hfsplus_boot_blocks(write_plan_t *plan, const hfsplus_volume_params_t *params)
 {
     unsigned char boot_block[1024];
     
@@ -1122,29 +1620,36 @@ static int write_hfsplus_boot_blocks(int fd, const hfsplus_volume_params_t *para
     boot_block[6] = 0x80;  /* High byte: bit 7 = new format */
     boot_block[7] = 0x15;  /* Low byte: >= $15 for heap use */
     
-    /* Write to device */
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to boot blocks");
-        return -1;
-    }
+    return write_plan_add(plan, 0, boot_block, sizeof(boot_block), "boot blocks");
+}
+
+/*
+ * NAME:    put_fork()
+ * DESCRIPTION: Fill in a volume header fork of one contiguous extent
+ */
+static void put_fork(unsigned char *fork, uint64_t size, uint32_t clump,
+                     uint32_t start, uint32_t blocks)
+{
+    put_be64(fork + 0, size);           /* logicalSize */
+    put_be32(fork + 8, clump);          /* clumpSize */
+    put_be32(fork + 12, blocks);        /* totalBlocks */
     
-    if (write(fd, boot_block, sizeof(boot_block)) != sizeof(boot_block)) {
-        error_print_errno("failed to write boot blocks");
-        return -1;
+    if (blocks > 0) {
+        put_be32(fork + 16, start);     /* extents[0].startBlock */
+        put_be32(fork + 20, blocks);    /* extents[0].blockCount */
     }
-    
-    return 0;
 }
 
 /*
  * NAME:    write_hfsplus_volume_header()
  * DESCRIPTION: Write HFS+ Volume Header
  */
-static int write_hfsplus_volume_header(int fd, const hfsplus_volume_params_t *params,
+static int write_hfsplus_volume_header(write_plan_t *plan, off_t offset, const hfsplus_volume_params_t *params,
                                      const mkfs_options_t *opts)
 {
     unsigned char vh_block[512];
     uint32_t hfs_date;
+    uint32_t attributes;
     
     /* Clear volume header block */
     memset(vh_block, 0, sizeof(vh_block));
@@ -1154,699 +1659,248 @@ static int write_hfsplus_volume_header(int fd, const hfsplus_volume_params_t *pa
     
     /* Set Volume Header fields according to HFS+ specification */
     
-    /* signature: HFS+ signature ($482B = 'H+') */
-    vh_block[0] = 0x48;
-    vh_block[1] = 0x2B;
-    
-    /* version: always 4 for HFS+ */
-    vh_block[2] = 0x00;
-    vh_block[3] = 0x04;
+    /* signature: HFS+ signature ($482B = 'H+'), version: always 4 */
+    put_be16(vh_block + 0, 0x482B);
+    put_be16(vh_block + 2, 4);
     
     /* attributes: volume attributes (TN1150 kHFSVolumeUnmountedBit=0x0100 at bit 8) */
-    uint32_t attributes = 0x00000100;  /* bit 8: volume unmounted cleanly */
+    attributes = 0x00000100;  /* bit 8: volume unmounted cleanly */
     if (params->enable_journaling) {
         attributes |= 0x00002000;  /* kHFSVolumeJournaledMask */
     }
-    vh_block[4] = (attributes >> 24) & 0xFF;
-    vh_block[5] = (attributes >> 16) & 0xFF;
-    vh_block[6] = (attributes >> 8) & 0xFF;
-    vh_block[7] = attributes & 0xFF;
+    put_be32(vh_block + 4, attributes);
     
     /* lastMountedVersion: Mac OS X */
-    vh_block[8] = 0x31;   /* '1' */
-    vh_block[9] = 0x30;   /* '0' */
-    vh_block[10] = 0x2E;  /* '.' */
-    vh_block[11] = 0x30;  /* '0' */
-    
-    /* createDate: Creation date */
-    vh_block[12] = (hfs_date >> 24) & 0xFF;
-    vh_block[13] = (hfs_date >> 16) & 0xFF;
-    vh_block[14] = (hfs_date >> 8) & 0xFF;
-    vh_block[15] = hfs_date & 0xFF;
-    
-    /* modifyDate: Last modification date (same as creation) */
-    vh_block[16] = (hfs_date >> 24) & 0xFF;
-    vh_block[17] = (hfs_date >> 16) & 0xFF;
-    vh_block[18] = (hfs_date >> 8) & 0xFF;
-    vh_block[19] = hfs_date & 0xFF;
-    
-    /* backupDate: Last backup date (0 = never backed up) */
-    vh_block[20] = 0x00;
-    vh_block[21] = 0x00;
-    vh_block[22] = 0x00;
-    vh_block[23] = 0x00;
-    
-    /* checkedDate: Last checked date (same as creation) */
-    vh_block[24] = (hfs_date >> 24) & 0xFF;
-    vh_block[25] = (hfs_date >> 16) & 0xFF;
-    vh_block[26] = (hfs_date >> 8) & 0xFF;
-    vh_block[27] = hfs_date & 0xFF;
-    
-    /* fileCount: Number of files (0 initially) */
-    vh_block[28] = 0x00;
-    vh_block[29] = 0x00;
-    vh_block[30] = 0x00;
-    vh_block[31] = 0x00;
-    
-    /* folderCount: Number of folders (1 for root) */
-    vh_block[32] = 0x00;
-    vh_block[33] = 0x00;
-    vh_block[34] = 0x00;
-    vh_block[35] = 0x01;
-    
-    /* blockSize: Allocation block size */
-    vh_block[40] = (params->block_size >> 24) & 0xFF;
-    vh_block[41] = (params->block_size >> 16) & 0xFF;
-    vh_block[42] = (params->block_size >> 8) & 0xFF;
-    vh_block[43] = params->block_size & 0xFF;
-    
-    /* totalBlocks: Total allocation blocks */
-    vh_block[44] = (params->total_blocks >> 24) & 0xFF;
-    vh_block[45] = (params->total_blocks >> 16) & 0xFF;
-    vh_block[46] = (params->total_blocks >> 8) & 0xFF;
-    vh_block[47] = params->total_blocks & 0xFF;
-    
-    /* freeBlocks: Free allocation blocks */
-    vh_block[48] = (params->free_blocks >> 24) & 0xFF;
-    vh_block[49] = (params->free_blocks >> 16) & 0xFF;
-    vh_block[50] = (params->free_blocks >> 8) & 0xFF;
-    vh_block[51] = params->free_blocks & 0xFF;
+    memcpy(vh_block + 8, "10.0", 4);
+    
+    /* journalInfoBlock: no journal */
+    
+    /* createDate, modifyDate, checkedDate (backupDate 0 = never backed up) */
+    put_be32(vh_block + 16, hfs_date);
+    put_be32(vh_block + 20, hfs_date);
+    put_be32(vh_block + 28, hfs_date);
+    
+    /* fileCount, folderCount: the root folder is not counted */
+    if (params->content) {
+        put_be32(vh_block + 32, params->content->files);
+        put_be32(vh_block + 36, params->content->folders);
+    }
+    
+    /* blockSize, totalBlocks, freeBlocks */
+    put_be32(vh_block + 40, params->block_size);
+    put_be32(vh_block + 44, params->total_blocks);
+    put_be32(vh_block + 48, params->free_blocks);
     
     /* nextAllocation: Next allocation block (start after system files) */
-    uint32_t next_alloc = (params->total_blocks - params->free_blocks);
-    vh_block[52] = (next_alloc >> 24) & 0xFF;
-    vh_block[53] = (next_alloc >> 16) & 0xFF;
-    vh_block[54] = (next_alloc >> 8) & 0xFF;
-    vh_block[55] = next_alloc & 0xFF;
-    
-    /* rsrcClumpSize: Default resource fork clump size (offset +56) */
-    uint32_t rsrc_clump = params->block_size * 4;  /* 4 blocks default */
-    vh_block[56] = (rsrc_clump >> 24) & 0xFF;
-    vh_block[57] = (rsrc_clump >> 16) & 0xFF;
-    vh_block[58] = (rsrc_clump >> 8) & 0xFF;
-    vh_block[59] = rsrc_clump & 0xFF;
-    
-    /* dataClumpSize: Default data fork clump size (offset +60) */
-    uint32_t data_clump = params->block_size * 4;  /* 4 blocks default */
-    vh_block[60] = (data_clump >> 24) & 0xFF;
-    vh_block[61] = (data_clump >> 16) & 0xFF;
-    vh_block[62] = (data_clump >> 8) & 0xFF;
-    vh_block[63] = data_clump & 0xFF;
-    
-    /* nextCatalogID: Next catalog node ID (start at 16, offset +64, per TN1150) */
-    vh_block[64] = 0x00;
-    vh_block[65] = 0x00;
-    vh_block[66] = 0x00;
-    vh_block[67] = 0x10;
+    put_be32(vh_block + 52, params->catalog_start_block +
+                            params->catalog_file_size / params->block_size +
+                            params->data_blocks);
+    
+    /* rsrcClumpSize, dataClumpSize: 4 blocks default */
+    put_be32(vh_block + 56, params->block_size * 4);
+    put_be32(vh_block + 60, params->block_size * 4);
+    
+    /* nextCatalogID: Next catalog node ID (start at 16, per TN1150) */
+    put_be32(vh_block + 64, params->content ? params->content->next_cnid : 16);
     
     /* writeCount: Volume write count (0) */
-    vh_block[68] = 0x00;
-    vh_block[69] = 0x00;
-    vh_block[70] = 0x00;
-    vh_block[71] = 0x00;
     
-    /* TODO: Add fork data structures for system files */
-    /* For now, we'll leave them as zeros which is valid for an empty volume */
+    /* encodingsBitmap: names so far are MacRoman */
+    put_be64(vh_block + 72, 1);
     
-    /* Write Volume Header to device */
-    if (write(fd, vh_block, sizeof(vh_block)) != sizeof(vh_block)) {
-        error_print_errno("failed to write volume header");
-        return -1;
-    }
+    /* allocationFile, extentsFile and catalogFile forks */
+    put_fork(vh_block + 112, params->allocation_file_size, params->allocation_file_size,
+             params->allocation_start_block, params->allocation_file_size / params->block_size);
+    put_fork(vh_block + 192, params->extents_file_size, params->extents_file_size,
+             params->extents_start_block, params->extents_file_size / params->block_size);
+    put_fork(vh_block + 272, params->catalog_file_size, params->catalog_file_size,
+             params->catalog_start_block, params->catalog_file_size / params->block_size);
     
-    return 0;
+    /* attributesFile, startupFile: none yet */
+    
+    return write_plan_add(plan, offset, vh_block, sizeof(vh_block), "volume header");
 }
 
 /*
  * NAME:    write_hfsplus_allocation_bitmap()
  * DESCRIPTION: Write HFS+ allocation bitmap
  */
-static int write_hfsplus_allocation_bitmap(int fd, const hfsplus_volume_params_t *params)
+static int write_hfsplus_allocation_bitmap(write_plan_t *plan, const hfsplus_volume_params_t *params)
 {
-    size_t bitmap_size = (params->total_blocks + 7) / 8;
-    size_t bitmap_blocks = (bitmap_size + params->block_size - 1) / params->block_size;
-    unsigned char *bitmap;
-    uint32_t used_blocks, i;
-    
-    /* Calculate system file sizes in blocks */
-    uint32_t allocation_blocks = (params->allocation_file_size + params->block_size - 1) / params->block_size;
-    uint32_t catalog_blocks = (params->catalog_file_size + params->block_size - 1) / params->block_size;
-    uint32_t extents_blocks = (params->extents_file_size + params->block_size - 1) / params->block_size;
-    uint32_t attributes_blocks = (params->attributes_file_size + params->block_size - 1) / params->block_size;
-    
-    /* Total used blocks = allocation bitmap + catalog + extents + attributes */
-    used_blocks = allocation_blocks + catalog_blocks + extents_blocks + attributes_blocks;
-    
-    error_verbose("HFS+ allocation bitmap: allocation=%u, catalog=%u, extents=%u, attributes=%u blocks", 
-                 allocation_blocks, catalog_blocks, extents_blocks, attributes_blocks);
-    
-    /* Allocate bitmap buffer */
-    bitmap = calloc(bitmap_blocks, params->block_size);
-    if (!bitmap) {
-        error_print_errno("failed to allocate memory for allocation bitmap");
-        return -1;
-    }
+    uint32_t lead_blocks;
     
-    /* Mark system blocks as used */
-    for (i = 0; i < used_blocks && i < params->total_blocks; i++) {
-        /* Set bit i in the bitmap (bit 0 = allocation block 0) */
-        bitmap[i / 8] |= (0x80 >> (i % 8));
-    }
+    /* Everything up to the end of the catalog and file data, and the alternate header */
+    lead_blocks = params->catalog_start_block + params->catalog_file_size / params->block_size +
+                  params->data_blocks;
     
-    error_verbose("marked %u allocation blocks as used in bitmap", used_blocks);
+    error_verbose("HFS+ allocation bitmap: allocation=%u, catalog=%u, extents=%u blocks",
+                 params->allocation_file_size / params->block_size,
+                 params->catalog_file_size / params->block_size,
+                 params->extents_file_size / params->block_size);
     
-    /* Seek to allocation bitmap location (after volume header) */
-    if (lseek(fd, 3 * params->sector_size, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to allocation bitmap");
-        free(bitmap);
+    if (write_bitmap(plan, (off_t)params->allocation_start_block * params->block_size,
+                     params->allocation_file_size, params->block_size, lead_blocks,
+                     params->tail_start_block, params->total_blocks) != 0) {
         return -1;
     }
     
-    /* Write bitmap */
-    if (write(fd, bitmap, bitmap_blocks * params->block_size) != (ssize_t)(bitmap_blocks * params->block_size)) {
-        error_print_errno("failed to write allocation bitmap");
-        free(bitmap);
-        return -1;
-    }
+    error_verbose("marked %u allocation blocks as used in bitmap",
+                 params->total_blocks - params->free_blocks);
     
-    free(bitmap);
     return 0;
 }
 
 /*
- * NAME:    initialize_hfsplus_catalog_file()
- * DESCRIPTION: Initialize HFS+ catalog B-tree with proper structure per TN1150
+ * NAME:    put_hfsplus_name()
+ * DESCRIPTION: Store an ASCII name as an HFSUniStr255
  */
-static int initialize_hfsplus_catalog_file(int fd, const hfsplus_volume_params_t *params)
+static size_t put_hfsplus_name(unsigned char *p, const char *name)
 {
-    const uint32_t NODE_SIZE = 4096;  /* Standard HFS+ B-tree node size */
-    const uint16_t MAX_KEY_LENGTH = 516;  /* sizeof(HFSPlusCatalogKey) */
-    
-    unsigned char *node_data;
-    uint32_t total_nodes;
-    size_t bitmap_size;
-    size_t bitmap_blocks;
-    off_t catalog_offset;
-    
-    /* Calculate catalog file location */
-    bitmap_size = (params->total_blocks + 7) / 8;
-    bitmap_blocks = (bitmap_size + params->block_size - 1) / params->block_size;
-    catalog_offset = (3 * params->sector_size) + (bitmap_blocks * params->block_size);
-    
-    total_nodes = params->catalog_file_size / NODE_SIZE;
-    
-    /* Allocate buffer for one node */
-    node_data = calloc(1, NODE_SIZE);
-    if (!node_data) {
-        error_print_errno("failed to allocate memory for catalog node");
-        return -1;
-    }
+    size_t len = strlen(name), i;
     
-    /* === Node 0: Header Node === */
-    
-    /* Node Descriptor (14 bytes) */
-    /* fLink (next node) */
-    node_data[0] = 0x00;
-    node_data[1] = 0x00;
-    node_data[2] = 0x00;
-    node_data[3] = 0x00;
-    
-    /* bLink (previous node) */
-    node_data[4] = 0x00;
-    node_data[5] = 0x00;
-    node_data[6] = 0x00;
-    node_data[7] = 0x00;
-    
-    /* kind = 1 (header node) */
-    node_data[8] = 0x01;
-    
-    /* height = 0 */
-    node_data[9] = 0x00;
-    
-    /* numRecords = 3 (BTHeaderRec, user data, map record) */
-    node_data[10] = 0x00;
-    node_data[11] = 0x03;
-    
-    /* reserved */
-    node_data[12] = 0x00;
-    node_data[13] = 0x00;
-    
-    /* BTHeaderRec starts at offset 14 (106 bytes) */
-    int offset = 14;
-    
-    /* treeDepth = 1 (header + one leaf for root folder) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x01;
-    
-    /* rootNode = 1 (node 1 contains root folder) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x01;
-    
-    /* leafRecords = 1 (only root folder initially) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x01;
-    
-    /* firstLeafNode = 1 */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x01;
-    
-    /* lastLeafNode = 1 */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x01;
-    
-    /* nodeSize = 4096 */
-    node_data[offset++] = 0x10;
-    node_data[offset++] = 0x00;
-    
-    /* maxKeyLength = 516 */
-    node_data[offset++] = (MAX_KEY_LENGTH >> 8) & 0xFF;
-    node_data[offset++] = MAX_KEY_LENGTH & 0xFF;
-    
-    /* totalNodes */
-    node_data[offset++] = (total_nodes >> 24) & 0xFF;
-    node_data[offset++] = (total_nodes >> 16) & 0xFF;
-    node_data[offset++] = (total_nodes >> 8) & 0xFF;
-    node_data[offset++] = total_nodes & 0xFF;
-    
-    /* freeNodes = total_nodes - 2 (header + root leaf used) */
-    uint32_t free_nodes = total_nodes - 2;
-    node_data[offset++] = (free_nodes >> 24) & 0xFF;
-    node_data[offset++] = (free_nodes >> 16) & 0xFF;
-    node_data[offset++] = (free_nodes >> 8) & 0xFF;
-    node_data[offset++] = free_nodes & 0xFF;
-    
-    /* reserved1 */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* clumpSize (obsolete, use catalog clump from volume header) */
-    uint32_t clump_size = params->catalog_file_size;
-    node_data[offset++] = (clump_size >> 24) & 0xFF;
-    node_data[offset++] = (clump_size >> 16) & 0xFF;
-    node_data[offset++] = (clump_size >> 8) & 0xFF;
-    node_data[offset++] = clump_size & 0xFF;
-    
-    /* btreeType = 0 (Catalog) */
-    node_data[offset++] = 0x00;
-    
-    /* keyCompareType = 0xCF (case-insensitive, TN1150 default) */
-    node_data[offset++] = 0xCF;
-    
-    /* attributes = 0 (no special attributes) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* reserved3[16] (64 bytes) - already zeroed by calloc */
-    offset += 64;
-    
-    /* Map record (128 bytes showing nodes 0-1 allocated) */
-    /* Set bits 0 and 1 to mark header and root leaf as used */
-    int map_offset = NODE_SIZE - 256;  /* Map record typically at end of node */
-    node_data[map_offset] = 0xC0;  /* Binary: 11000000 = nodes 0,1 used */
-    
-    /* Record offsets at end of node (3 records + free space offset) */
-    /* Offset table grows backwards from end of node */
-    int rec_offset_base = NODE_SIZE - 2;
-    
-    /* Free space offset (points after map record) */
-    uint16_t free_offset = map_offset + 256;
-    node_data[rec_offset_base--] = (free_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = free_offset & 0xFF;
-    
-    /* Record 2: map record offset */
-    uint16_t map_rec_offset = map_offset;
-    node_data[rec_offset_base--] = (map_rec_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = map_rec_offset & 0xFF;
-    
-    /* Record 1: user data record (empty, 128 bytes reserved) */
-    uint16_t user_offset = map_offset - 128;
-    node_data[rec_offset_base--] = (user_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = user_offset & 0xFF;
-    
-    /* Record 0: BTHeaderRec offset */
-    uint16_t header_offset = 14;
-    node_data[rec_offset_base--] = (header_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = header_offset & 0xFF;
-    
-    /* Write header node */
-    if (lseek(fd, catalog_offset, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to catalog file location");
-        free(node_data);
-        return -1;
+    put_be16(p, len);
+    for (i = 0; i < len; i++) {
+        put_be16(p + 2 + 2 * i, (unsigned char)name[i]);
     }
     
-    if (write(fd, node_data, NODE_SIZE) != NODE_SIZE) {
-        error_print_errno("failed to write catalog header node");
-        free(node_data);
-        return -1;
-    }
-    
-    /* === Node 1: Root Folder Leaf Node === */
-    memset(node_data, 0, NODE_SIZE);
-    
-    /* Node Descriptor */
-    /* fLink = 0 (no next leaf) */
-    node_data[0] = 0x00;
-    node_data[1] = 0x00;
-    node_data[2] = 0x00;
-    node_data[3] = 0x00;
-    
-    /* bLink = 0 (no previous leaf) */
-    node_data[4] = 0x00;
-    node_data[5] = 0x00;
-    node_data[6] = 0x00;
-    node_data[7] = 0x00;
-    
-    /* kind = -1 (0xFF = leaf node) */
-    node_data[8] = 0xFF;
-    
-    /* height = 1 */
-    node_data[9] = 0x01;
-    
-    /* numRecords = 1 (root folder record) */
-    node_data[10] = 0x00;
-    node_data[11] = 0x01;
-    
-    /* reserved */
-    node_data[12] = 0x00;
-    node_data[13] = 0x00;
-    
-    /* Root folder record at offset 14 */
-    offset = 14;
-    
-    /* Catalog key: parentID=1 (kHFSRootParentID), name="" (empty for root) */
-    /* keyLength = 6 (minimum: 2 bytes parentID field + 2 bytes name length + 2 for keyLength itself) */
-    uint16_t key_length = 6;
-    node_data[offset++] = (key_length >> 8) & 0xFF;
-    node_data[offset++] = key_length & 0xFF;
-    
-    /* parentID = 1 (kHFSRootParentID) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x01;
-    
-    /* nodeName.length = 0 (empty name for root) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* Catalog folder record (88 bytes minimum) */
-    /* recordType = kHFSPlusFolderRecord (0x0001) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x01;
-    
-    /* flags = 0 */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* valence = 0 (no items in root initially) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* folderID = 2 (kHFSRootFolderID) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x02;
-    
-    /* createDate, contentModDate, attributeModDate, accessDate (all use current HFS time) */
-    uint32_t hfs_time = (uint32_t)(params->creation_date + HFS_EPOCH_OFFSET);
-    for (int i = 0; i < 4; i++) {
-        node_data[offset++] = (hfs_time >> 24) & 0xFF;
-        node_data[offset++] = (hfs_time >> 16) & 0xFF;
-        node_data[offset++] = (hfs_time >> 8) & 0xFF;
-        node_data[offset++] = hfs_time & 0xFF;
-    }
-    
-    /* backupDate = 0 */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* permissions (80 bytes, complex structure, zero for now) */
-    offset += 80;
-    
-    /* userInfo + finderInfo (32 bytes total) - zero */
-    offset += 32;
-    
-    /* textEncoding = 0 */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* reserved = 0 */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* Record offset table at end */
-    rec_offset_base = NODE_SIZE - 2;
-    
-    /* Free space offset */
-    uint16_t leaf_free_offset = offset;
-    node_data[rec_offset_base--] = (leaf_free_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = leaf_free_offset & 0xFF;
-    
-    /* Record 0 offset (root folder record) */
-    uint16_t rec0_offset = 14;
-    node_data[rec_offset_base--] = (rec0_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = rec0_offset & 0xFF;
-    
-    /* Write root folder leaf node */
-    if (write(fd, node_data, NODE_SIZE) != NODE_SIZE) {
-        error_print_errno("failed to write catalog root leaf node");
-        free(node_data);
-        return -1;
-    }
-    
-    /* Zero out remaining catalog nodes */
-    memset(node_data, 0, NODE_SIZE);
-    for (uint32_t i = 2; i < total_nodes; i++) {
-        if (write(fd, node_data, NODE_SIZE) != NODE_SIZE) {
-            error_print_errno("failed to write catalog empty nodes");
-            free(node_data);
+    return 2 + 2 * len;
+}
+
+/*
+ * NAME:    initialize_hfsplus_catalog_file()
+ * DESCRIPTION: Initialize HFS+ catalog B-tree with proper structure per TN1150
+ */
+static int initialize_hfsplus_catalog_file(write_plan_t *plan, const hfsplus_volume_params_t *params,
+                                           const mkfs_options_t *opts)
+{
+    unsigned char *nodes, *leaf;
+    unsigned char rec[256];
+    btree_layout_t bt;
+    uint32_t hfs_date = params->creation_date + HFS_EPOCH_OFFSET;
+    size_t keylen, namelen;
+    uint32_t nnodes;
+    int i, result;
+    
+    /* With -d, the catalog holds the whole tree */
+    if (params->content) {
+        if (build_populated_catalog(params->content, HFSPLUS_NODE_SIZE, 516,
+                                    params->catalog_file_size, &nodes, &nnodes) != 0) {
             return -1;
         }
+        
+        put_be32(nodes + 14 + 32, params->catalog_file_size);
+        nodes[14 + 37] = 0xCF;
+        put_be32(nodes + 14 + 38, 0x00000006);
+        
+        result = write_btree_file(plan, (off_t)params->catalog_start_block * params->block_size,
+                                  params->catalog_file_size, nodes, nnodes, HFSPLUS_NODE_SIZE,
+                                  "catalog file");
+        free(nodes);
+        return result;
     }
     
-    free(node_data);
-    return 0;
+    nodes = calloc(2, HFSPLUS_NODE_SIZE);
+    if (!nodes) {
+        error_print_errno("failed to allocate memory for catalog nodes");
+        return -1;
+    }
+    leaf = nodes + HFSPLUS_NODE_SIZE;
+    
+    /* Node 0 is the header, node 1 the only leaf */
+    memset(&bt, 0, sizeof(bt));
+    bt.node_size = HFSPLUS_NODE_SIZE;
+    bt.depth = 1;
+    bt.root = 1;
+    bt.leaf_records = 2;
+    bt.first_leaf = 1;
+    bt.last_leaf = 1;
+    bt.max_key_length = 516;
+    bt.total_nodes = params->catalog_file_size / HFSPLUS_NODE_SIZE;
+    bt.used_nodes = 2;
+    
+    btree_header_node(nodes, &bt);
+    
+    /* clumpSize, btreeType 0, case-insensitive keys, big and variable keys */
+    put_be32(nodes + 14 + 32, params->catalog_file_size);
+    nodes[14 + 37] = 0xCF;
+    put_be32(nodes + 14 + 38, 0x00000006);
+    
+    btree_init_node(leaf, HFSPLUS_NODE_SIZE, -1, 1);
+    
+    /* Root folder: key (parent 1, volume name), then the folder record */
+    memset(rec, 0, sizeof(rec));
+    put_be32(rec + 2, 1);
+    namelen = put_hfsplus_name(rec + 6, opts->volume_name);
+    put_be16(rec, 4 + namelen);
+    keylen = 6 + namelen;
+    put_be16(rec + keylen + 0, 1);              /* kHFSPlusFolderRecord */
+    put_be32(rec + keylen + 8, 2);              /* folderID */
+    for (i = 0; i < 4; i++) {                   /* create, contentMod, attributeMod, access */
+        put_be32(rec + keylen + 12 + 4 * i, hfs_date);
+    }
+    btree_add_record(leaf, HFSPLUS_NODE_SIZE, rec, keylen + 88);
+    
+    /* Its thread: key (2, ""), pointing back at parent 1 and the name */
+    memset(rec, 0, sizeof(rec));
+    put_be16(rec, 6);
+    put_be32(rec + 2, 2);
+    keylen = 8;
+    put_be16(rec + keylen + 0, 3);              /* kHFSPlusFolderThreadRecord */
+    put_be32(rec + keylen + 4, 1);              /* parentID */
+    namelen = put_hfsplus_name(rec + keylen + 8, opts->volume_name);
+    btree_add_record(leaf, HFSPLUS_NODE_SIZE, rec, keylen + 8 + namelen);
+    
+    result = write_btree_file(plan, (off_t)params->catalog_start_block * params->block_size,
+                              params->catalog_file_size, nodes, 2, HFSPLUS_NODE_SIZE,
+                              "catalog file");
+    
+    free(nodes);
+    return result;
 }
 
 /*
  * NAME:    initialize_hfsplus_extents_file()
  * DESCRIPTION: Initialize HFS+ extents overflow B-tree per TN1150
  */
-static int initialize_hfsplus_extents_file(int fd, const hfsplus_volume_params_t *params)
+static int initialize_hfsplus_extents_file(write_plan_t *plan, const hfsplus_volume_params_t *params)
 {
-    const uint32_t NODE_SIZE = 4096;  /* Standard HFS+ B-tree node size */
-    const uint16_t MAX_KEY_LENGTH = 10;  /* sizeof(HFSPlusExtentKey) */
+    unsigned char *node;
+    btree_layout_t bt;
+    int result;
     
-    unsigned char *node_data;
-    uint32_t total_nodes;
-    size_t bitmap_size;
-    size_t bitmap_blocks;
-    off_t extents_offset;
-    
-    /* Calculate extents file location (after catalog file) */
-    bitmap_size = (params->total_blocks + 7) / 8;
-    bitmap_blocks = (bitmap_size + params->block_size - 1) / params->block_size;
-    extents_offset = (3 * params->sector_size) + 
-                     (bitmap_blocks * params->block_size) + 
-                     params->catalog_file_size;
-    
-    total_nodes = params->extents_file_size / NODE_SIZE;
-    
-    /* Allocate buffer for one node */
-    node_data = calloc(1, NODE_SIZE);
-    if (!node_data) {
+    node = calloc(1, HFSPLUS_NODE_SIZE);
+    if (!node) {
         error_print_errno("failed to allocate memory for extents node");
         return -1;
     }
     
-    /* === Node 0: Header Node === */
-    
-    /* Node Descriptor (14 bytes) */
-    /* fLink (next node) */
-    node_data[0] = 0x00;
-    node_data[1] = 0x00;
-    node_data[2] = 0x00;
-    node_data[3] = 0x00;
-    
-    /* bLink (previous node) */
-    node_data[4] = 0x00;
-    node_data[5] = 0x00;
-    node_data[6] = 0x00;
-    node_data[7] = 0x00;
-    
-    /* kind = 1 (header node) */
-    node_data[8] = 0x01;
-    
-    /* height = 0 */
-    node_data[9] = 0x00;
-    
-    /* numRecords = 3 (BTHeaderRec, user data, map record) */
-    node_data[10] = 0x00;
-    node_data[11] = 0x03;
-    
-    /* reserved */
-    node_data[12] = 0x00;
-    node_data[13] = 0x00;
-    
-    /* BTHeaderRec starts at offset 14 (106 bytes) */
-    int offset = 14;
-    
-    /* treeDepth = 0 (empty tree - no extents overflow initially) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* rootNode = 0 (no root - tree is empty) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* leafRecords = 0 (no records initially) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* firstLeafNode = 0 (no leaves yet) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* lastLeafNode = 0 (no leaves yet) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* nodeSize = 4096 */
-    node_data[offset++] = 0x10;
-    node_data[offset++] = 0x00;
-    
-    /* maxKeyLength = 10 */
-    node_data[offset++] = (MAX_KEY_LENGTH >> 8) & 0xFF;
-    node_data[offset++] = MAX_KEY_LENGTH & 0xFF;
-    
-    /* totalNodes */
-    node_data[offset++] = (total_nodes >> 24) & 0xFF;
-    node_data[offset++] = (total_nodes >> 16) & 0xFF;
-    node_data[offset++] = (total_nodes >> 8) & 0xFF;
-    node_data[offset++] = total_nodes & 0xFF;
-    
-    /* freeNodes = total_nodes - 1 (only header used) */
-    uint32_t free_nodes = total_nodes - 1;
-    node_data[offset++] = (free_nodes >> 24) & 0xFF;
-    node_data[offset++] = (free_nodes >> 16) & 0xFF;
-    node_data[offset++] = (free_nodes >> 8) & 0xFF;
-    node_data[offset++] = free_nodes & 0xFF;
-    
-    /* reserved1 */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* clumpSize (obsolete, use extents clump from volume header) */
-    uint32_t clump_size = params->extents_file_size;
-    node_data[offset++] = (clump_size >> 24) & 0xFF;
-    node_data[offset++] = (clump_size >> 16) & 0xFF;
-    node_data[offset++] = (clump_size >> 8) & 0xFF;
-    node_data[offset++] = clump_size & 0xFF;
-    
-    /* btreeType = 255 (0xFF = Extents Overflow) */
-    node_data[offset++] = 0xFF;
-    
-    /* keyCompareType = 0 (simple comparison for extents keys) */
-    node_data[offset++] = 0x00;
-    
-    /* attributes = 0 (no special attributes) */
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    node_data[offset++] = 0x00;
-    
-    /* reserved3[16] (64 bytes) - already zeroed by calloc */
-    offset += 64;
-    
-    /* Map record (128 bytes showing only node 0 allocated) */
-    /* Set bit 0 to mark header as used */
-    int map_offset = NODE_SIZE - 256;  /* Map record at end of node */
-    node_data[map_offset] = 0x80;  /* Binary: 10000000 = node 0 used */
-    
-    /* Record offsets at end of node (3 records + free space offset) */
-    /* Offset table grows backwards from end of node */
-    int rec_offset_base = NODE_SIZE - 2;
-    
-    /* Free space offset (points after map record) */
-    uint16_t free_offset = map_offset + 256;
-    node_data[rec_offset_base--] = (free_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = free_offset & 0xFF;
-    
-    /* Record 2: map record offset */
-    uint16_t map_rec_offset = map_offset;
-    node_data[rec_offset_base--] = (map_rec_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = map_rec_offset & 0xFF;
-    
-    /* Record 1: user data record (empty, 128 bytes reserved) */
-    uint16_t user_offset = map_offset - 128;
-    node_data[rec_offset_base--] = (user_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = user_offset & 0xFF;
-    
-    /* Record 0: BTHeaderRec offset */
-    uint16_t header_offset = 14;
-    node_data[rec_offset_base--] = (header_offset >> 8) & 0xFF;
-    node_data[rec_offset_base--] = header_offset & 0xFF;
-    
-    /* Write header node */
-    if (lseek(fd, extents_offset, SEEK_SET) == -1) {
-        error_print_errno("failed to seek to extents file location");
-        free(node_data);
-        return -1;
-    }
+    /* An empty tree is just its header node */
+    memset(&bt, 0, sizeof(bt));
+    bt.node_size = HFSPLUS_NODE_SIZE;
+    bt.max_key_length = 10;
+    bt.total_nodes = params->extents_file_size / HFSPLUS_NODE_SIZE;
+    bt.used_nodes = 1;
     
-    if (write(fd, node_data, NODE_SIZE) != NODE_SIZE) {
-        error_print_errno("failed to write extents header node");
-        free(node_data);
-        return -1;
-    }
+    btree_header_node(node, &bt);
     
-    /* Zero out remaining extents nodes (all free) */
-    memset(node_data, 0, NODE_SIZE);
-    for (uint32_t i = 1; i < total_nodes; i++) {
-        if (write(fd, node_data, NODE_SIZE) != NODE_SIZE) {
-            error_print_errno("failed to write extents empty nodes");
-            free(node_data);
-            return -1;
-        }
-    }
+    /* clumpSize, btreeType 0, big keys */
+    put_be32(node + 14 + 32, params->extents_file_size);
+    put_be32(node + 14 + 38, 0x00000002);
     
-    free(node_data);
-    return 0;
+    result = write_btree_file(plan, (off_t)params->extents_start_block * params->block_size,
+                              params->extents_file_size, node, 1, HFSPLUS_NODE_SIZE,
+                              "extents file");
+    
+    free(node);
+    return result;
 }
 
 /*
  * NAME:    verify_hfsplus_volume()
  * DESCRIPTION: Verify the created HFS+ volume
  */
-static int verify_hfsplus_volume(const char *device_path, int partno, const mkfs_options_t *opts)
+static int verify_hfsplus_volume(const char *device_path, int partno, const mkfs_options_t *opts,
+                                 write_plan_t *plan)
 {
     hfs_volume_info_t vol_info;
     int fd;
@@ -1861,6 +1915,13 @@ static int verify_hfsplus_volume(const char *device_path, int partno, const mkfs
         return -1;
     }
     
+    /* Everything the format wrote must read back unchanged */
+    if (write_plan_verify(plan, fd) != 0) {
+        error_print("verification failed: metadata did not read back as written");
+        close(fd);
+        return -1;
+    }
+    
     /* Read volume information */
     if (hfs_read_volume_info(fd, &vol_info) != 0) {
         error_print("failed to read volume information for verification");
@@ -1883,4 +1944,211 @@ static int verify_hfsplus_volume(const char *device_path, int partno, const mkfs
     
     close(fd);
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * NAME:    put_be16()
+ * DESCRIPTION: Store a big-endian 16-bit value
+ */
+static void put_be16(unsigned char *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+/*
+ * NAME:    put_be32()
+ * DESCRIPTION: Store a big-endian 32-bit value
+ */
+static void put_be32(unsigned char *p, uint32_t value)
+{
+    put_be16(p, value >> 16);
+    put_be16(p + 2, value);
+}
+
+/*
+ * NAME:    put_be64()
+ * DESCRIPTION: Store a big-endian 64-bit value
+ */
+static void put_be64(unsigned char *p, uint64_t value)
+{
+    put_be32(p, value >> 32);
+    put_be32(p + 4, value);
+}
+
+/*
+ * NAME:    write_bitmap()
+ * DESCRIPTION: Write an allocation bitmap with blocks [0, lead) and
+ *              [tail, total) in use, in units of unit bytes; only units
+ *              holding set bits are written, the rest is cleared
+ */
+static int write_bitmap(write_plan_t *plan, off_t offset, uint64_t length, uint32_t unit,
+                        uint32_t lead, uint32_t tail, uint32_t total)
+{
+    unsigned char *buf;
+    uint64_t pos, first, last, bit, zero_start = 0;
+    int zeroing = 0;
+    
+    buf = malloc(unit);
+    if (!buf) {
+        error_print_errno("failed to allocate memory for volume bitmap");
+        return -1;
+    }
+    
+    for (pos = 0; pos < length; pos += unit) {
+        first = pos * 8;
+        last = (pos + unit) * 8;
+    
+        /* Runs of empty units are cleared together */
+        if (first >= lead && (last <= tail || first >= total)) {
+            if (!zeroing) {
+                zero_start = pos;
+                zeroing = 1;
+            }
+            continue;
+        }
+    
+        if (zeroing) {
+            if (write_plan_zero(plan, offset + zero_start, pos - zero_start, "volume bitmap") != 0) {
+                free(buf);
+                return -1;
+            }
+            zeroing = 0;
+        }
+    
+        memset(buf, 0, unit);
+        for (bit = first; bit < last && bit < lead; bit++) {
+            buf[(bit - first) / 8] |= 0x80 >> (bit % 8);
+        }
+        for (bit = first > tail ? first : tail; bit < last && bit < total; bit++) {
+            buf[(bit - first) / 8] |= 0x80 >> (bit % 8);
+        }
+    
+        if (write_plan_add(plan, offset + pos, buf, unit, "volume bitmap") != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    
+    free(buf);
+    
+    if (zeroing) {
+        return write_plan_zero(plan, offset + zero_start, length - zero_start, "volume bitmap");
+    }
+    
+    return 0;
+}
+
+/*
+ * NAME:    btree_init_node()
+ * DESCRIPTION: Start an empty B*-tree node of the given kind and height
+ */
+static void btree_init_node(unsigned char *node, uint32_t node_size, int kind, int height)
+{
+    memset(node, 0, node_size);
+    node[8] = (unsigned char)kind;
+    node[9] = height;
+    
+    /* Free space starts right after the node descriptor */
+    put_be16(node + node_size - 2, 14);
+}
+
+/*
+ * NAME:    btree_add_record()
+ * DESCRIPTION: Append a record to a node, keeping the offset table at its end
+ */
+static int btree_add_record(unsigned char *node, uint32_t node_size,
+                            const unsigned char *rec, uint32_t len)
+{
+    uint16_t nrecs = (node[10] << 8) | node[11];
+    unsigned char *slot = node + node_size - 2 * (nrecs + 1);
+    uint16_t start = (slot[0] << 8) | slot[1];
+    
+    if (start + len + 2 * (nrecs + 2) > node_size) {
+        return -1;
+    }
+    
+    memcpy(node + start, rec, len);
+    put_be16(node + 10, nrecs + 1);
+    put_be16(slot - 2, start + len);
+    
+    return 0;
+}
+
+/*
+ * NAME:    btree_header_node()
+ * DESCRIPTION: Build a header node: header record, user data record and map
+ */
+static void btree_header_node(unsigned char *node, const btree_layout_t *bt)
+{
+    unsigned char *hdr = node + 14;
+    uint32_t i;
+    
+    btree_init_node(node, bt->node_size, 1, 0);
+    put_be16(node + 10, 3);
+    
+    put_be16(hdr + 0, bt->depth);
+    put_be32(hdr + 2, bt->root);
+    put_be32(hdr + 6, bt->leaf_records);
+    put_be32(hdr + 10, bt->first_leaf);
+    put_be32(hdr + 14, bt->last_leaf);
+    put_be16(hdr + 18, bt->node_size);
+    put_be16(hdr + 20, bt->max_key_length);
+    put_be32(hdr + 22, bt->total_nodes);
+    put_be32(hdr + 26, bt->total_nodes - bt->used_nodes);
+    
+    /* Map record: one bit per node, the used ones first */
+    for (i = 0; i < bt->used_nodes; i++) {
+        node[0xf8 + i / 8] |= 0x80 >> (i % 8);
+    }
+    
+    /* Header, user data and map records, then the (empty) free space */
+    put_be16(node + bt->node_size - 2, 0x0e);
+    put_be16(node + bt->node_size - 4, 0x78);
+    put_be16(node + bt->node_size - 6, 0xf8);
+    put_be16(node + bt->node_size - 8, bt->node_size - 8);
+}
+
+/*
+ * NAME:    write_btree_file()
+ * DESCRIPTION: Write the first nodes of a new B*-tree file and clear the rest
+ */
+static int write_btree_file(write_plan_t *plan, off_t offset, uint32_t file_size,
+                            const unsigned char *nodes, uint32_t nnodes,
+                            uint32_t node_size, const char *what)
+{
+    off_t written = (off_t)nnodes * node_size;
+    
+    if (write_plan_add(plan, offset, nodes, written, what) != 0) {
+        return -1;
+    }
+    
+    return write_plan_zero(plan, offset + written, file_size - written, what);
+}
+
+/*
+ * NAME:    build_populated_catalog()
+ * DESCRIPTION: Build the catalog of a -d tree behind its header node
+ */
+static int build_populated_catalog(const populate_t *content, uint32_t node_size,
+                                   uint16_t max_key_length, uint32_t file_size,
+                                   unsigned char **nodes, uint32_t *nnodes)
+{
+    btree_layout_t bt;
+    
+    memset(&bt, 0, sizeof(bt));
+    if (populate_build_catalog(content, node_size, nodes, nnodes, &bt.depth, &bt.root,
+                               &bt.first_leaf, &bt.last_leaf) != 0) {
+        return -1;
+    }
+    
+    bt.node_size = node_size;
+    bt.leaf_records = content->nrecords;
+    bt.max_key_length = max_key_length;
+    bt.total_nodes = file_size / node_size;
+    bt.used_nodes = *nnodes;
+    
+    btree_header_node(*nodes, &bt);
+    
+    return 0;
+}
@@ -20,6 +20,7 @@
 
 #include "../embedded/mkfs/mkfs_hfs.h"
 #include "mkfs_common.h"
+#include "mkfs_batch.h"
 
 /* Program information */
 static const char *program_name = "mkfs.hfs";
@@ -77,11 +78,16 @@ static void usage(int exit_code)
     const char *fs_type_str = (program_type == PROGRAM_MKFS_HFSPLUS) ? "HFS+" : "HFS";
     
     printf("Usage: %s [options] device [partition-no]\n", program_name);
+    printf("       %s [options] -b manifest\n", program_name);
     printf("\n");
     printf("Create %s filesystems on devices or files.\n", fs_type_str);
     printf("\n");
     printf("Options:\n");
+    printf("  -b, --batch FILE     Format every volume listed in FILE (- for stdin)\n");
+    printf("  -d, --directory DIR  Copy the contents of DIR onto the new volume\n");
+    printf("  -D, --discard        Discard the free blocks (TRIM, or holes in an image)\n");
     printf("  -f, --force          Force creation, overwrite existing filesystem\n");
+    printf("  -J, --jobs N         Format up to N batch volumes at once (default: CPUs)\n");
     printf("  -l, --label NAME     Set volume label/name (max 27 characters for HFS)\n");
     printf("  -v, --verbose        Display detailed formatting information\n");
     printf("  -V, --version        Display version information\n");
@@ -98,6 +104,8 @@ static void usage(int exit_code)
     printf("  %s -f /dev/sdb 1                # Force format partition 1\n", program_name);
     printf("  %s -f /dev/sdb 0                # Format entire disk (erases partition table)\n", program_name);
     printf("  %s -v /dev/fd0                  # Format floppy with verbose output\n", program_name);
+    printf("  %s -d disk/ floppy.img          # Build a populated volume\n", program_name);
+    printf("  %s -J 4 -b images.txt           # Format the volumes of a manifest\n", program_name);
     printf("\n");
     printf("Notes:\n");
     printf("  - mkfs.hfs creates HFS filesystems only\n");
@@ -125,8 +133,13 @@ static void usage(int exit_code)
 static int parse_command_line(int argc, char *argv[], mkfs_options_t *opts)
 {
     int c;
+    char *endptr;
     static struct option long_options[] = {
+        {"batch",   required_argument, 0, 'b'},
+        {"directory", required_argument, 0, 'd'},
+        {"discard", no_argument,       0, 'D'},
         {"force",   no_argument,       0, 'f'},
+        {"jobs",    required_argument, 0, 'J'},
         {"label",   required_argument, 0, 'l'},
         {"verbose", no_argument,       0, 'v'},
         {"version", no_argument,       0, 'V'},
@@ -135,12 +148,40 @@ static int parse_command_line(int argc, char *argv[], mkfs_options_t *opts)
         {0, 0, 0, 0}
     };
     
-    while ((c = getopt_long(argc, argv, "fl:vVh", long_options, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "b:d:DfJ:l:vVh", long_options, NULL)) != -1) {
         switch (c) {
+            case 'b':
+                opts->batch_file = strdup(optarg);
+                if (!opts->batch_file) {
+                    error_print_errno("failed to allocate memory for manifest name");
+                    return -1;
+                }
+                break;
+                
+            case 'd':
+                opts->source_dir = strdup(optarg);
+                if (!opts->source_dir) {
+                    error_print_errno("failed to allocate memory for directory name");
+                    return -1;
+                }
+                break;
+                
+            case 'D':
+                opts->discard = 1;
+                break;
+                
             case 'f':
                 opts->force = 1;
                 break;
                 
+            case 'J':
+                opts->jobs = (int)strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || opts->jobs < 1) {
+                    error_print("invalid number of jobs: %s", optarg);
+                    return -1;
+                }
+                break;
+                
             case 'l':
                 opts->volume_name = strdup(optarg);
                 if (!opts->volume_name) {
@@ -180,6 +221,19 @@ static int parse_command_line(int argc, char *argv[], mkfs_options_t *opts)
         }
     }
     
+    /* A batch takes its devices from the manifest */
+    if (opts->batch_file) {
+        if (optind < argc) {
+            error_print("no device may be given with --batch");
+            return -1;
+        }
+        if (opts->source_dir) {
+            error_print("-d cannot be used with --batch; give directories in the manifest");
+            return -1;
+        }
+        return 0;
+    }
+    
     /* Parse positional arguments */
     if (optind >= argc) {
         error_print("missing device argument");
@@ -260,6 +314,16 @@ static void cleanup_options(mkfs_options_t *opts)
         free(opts->volume_name);
         opts->volume_name = NULL;
     }
+    
+    if (opts->source_dir) {
+        free(opts->source_dir);
+        opts->source_dir = NULL;
+    }
+    
+    if (opts->batch_file) {
+        free(opts->batch_file);
+        opts->batch_file = NULL;
+    }
 }
 
 /*
@@ -320,6 +384,14 @@ int main(int argc, char *argv[])
         return EXIT_USAGE_ERROR;
     }
     
+    /* A batch reports each volume itself */
+    if (opts.batch_file) {
+        result = mkfs_batch(opts.batch_file, &opts);
+        cleanup_options(&opts);
+        common_cleanup();
+        return result == 0 ? 0 : 1;
+    }
+    
     /* Check if root privileges are required */
     common_check_root_required(opts.device_path, 1);  /* Write access required */
     
@@ -20,6 +20,7 @@
 
 #include "../embedded/mkfs/mkfs_hfs.h"
 #include "mkfs_common.h"
+#include "mkfs_batch.h"
 
 /* Program information */
 static const char *program_name = "mkfs.hfs+";
@@ -52,12 +53,17 @@ static mkfs_options_t default_options = {
 static void usage(int exit_code)
 {
     printf("Usage: %s [options] device [partition-no]\n", program_name);
+    printf("       %s [options] -b manifest\n", program_name);
     printf("\n");
     printf("Create HFS+ filesystems on devices or files.\n");
     printf("\n");
     printf("Options:\n");
+    printf("  -b, --batch FILE     Format every volume listed in FILE (- for stdin)\n");
+    printf("  -d, --directory DIR  Copy the contents of DIR onto the new volume\n");
+    printf("  -D, --discard        Discard the free blocks (TRIM, or holes in an image)\n");
     printf("  -f, --force          Force creation, overwrite existing filesystem\n");
     printf("  -j, --journal        Enable HFS+ journaling (Linux kernel driver does NOT support)\n");
+    printf("  -J, --jobs N         Format up to N batch volumes at once (default: CPUs)\n");
     printf("  -L, --label NAME     Set volume label/name (also accepts -l)\n");
     printf("  -s, --size SIZE      Specify filesystem size in bytes (supports K, M, G suffixes)\n");
     printf("  -v, --verbose        Display detailed formatting information\n");
@@ -76,6 +82,8 @@ static void usage(int exit_code)
     printf("  %s -f /dev/sdb 1                # Force format partition 1\n", program_name);
     printf("  %s -f /dev/sdb 0                # Format entire disk (erases partition table)\n", program_name);
     printf("  %s -v /dev/fd0                  # Format floppy with verbose output\n", program_name);
+    printf("  %s -s 4G -d dist/ dist.img      # Build a populated image\n", program_name);
+    printf("  %s -J 4 -b images.txt           # Format the volumes of a manifest\n", program_name);
     printf("\n");
     printf("HFS+ Features:\n");
     printf("  - Supports volumes larger than 2GB\n");
@@ -151,6 +159,14 @@ int main(int argc, char *argv[])
         return EXIT_USAGE_ERROR;
     }
     
+    /* A batch reports each volume itself */
+    if (opts.batch_file) {
+        result = mkfs_batch(opts.batch_file, &opts);
+        mkfs_cleanup_options(&opts);
+        common_cleanup();
+        return result == 0 ? 0 : 1;
+    }
+    
     /* Check if root privileges are required */
     common_check_root_required(opts.device_path, 1);  /* Write access required */
     
@@ -0,0 +1,414 @@
+/*
+ * mkfs_plan.c - Ordered write plan for the metadata of a new volume
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * The structures of a new volume are built in memory and queued here
+ * instead of being written one at a time.  The flush sorts them by
+ * offset and hands each run of adjacent regions to a single pwritev(),
+ * so boot blocks, MDB and bitmap, or the alternate header and the last
+ * sector, go out together; ranges that only need clearing are passed to
+ * device_zero_range().  Verification reads the same runs back with one
+ * read each and compares them with what was queued.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "../embedded/mkfs/mkfs_hfs.h"
+#include "mkfs_plan.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX             1024
+#endif
+
+static write_plan_region_t *add_region(write_plan_t *plan, off_t offset, uint64_t len,
+                                       const char *what);
+static int region_cmp(const void *a, const void *b);
+static int sort_plan(write_plan_t *plan);
+static size_t next_batch(const write_plan_t *plan, size_t first, uint64_t *bytes);
+static int write_batch(int fd, struct iovec *iov, int iovcnt, off_t offset);
+static int read_batch(int fd, unsigned char *buf, size_t len, off_t offset);
+
+/*
+ * NAME:    write_plan_init()
+ * DESCRIPTION: Start an empty plan
+ */
+void write_plan_init(write_plan_t *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+}
+
+/*
+ * NAME:    write_plan_free()
+ * DESCRIPTION: Release the queued regions
+ */
+void write_plan_free(write_plan_t *plan)
+{
+    size_t i;
+    
+    for (i = 0; i < plan->count; i++) {
+        if (!plan->regions[i].borrowed) {
+            free(plan->regions[i].data);
+        }
+    }
+    free(plan->regions);
+    write_plan_init(plan);
+}
+
+/*
+ * NAME:    add_region()
+ * DESCRIPTION: Append a region, growing the table as needed
+ */
+static write_plan_region_t *add_region(write_plan_t *plan, off_t offset, uint64_t len,
+                                       const char *what)
+{
+    write_plan_region_t *r;
+    
+    if (plan->count == plan->alloc) {
+        size_t alloc = plan->alloc ? plan->alloc * 2 : 64;
+        
+        r = realloc(plan->regions, alloc * sizeof(*r));
+        if (!r) {
+            error_print_errno("failed to allocate memory for %s", what);
+            return NULL;
+        }
+        plan->regions = r;
+        plan->alloc = alloc;
+    }
+    
+    r = &plan->regions[plan->count++];
+    r->offset = offset;
+    r->length = len;
+    r->data = NULL;
+    r->what = what;
+    r->borrowed = 0;
+    plan->sorted = 0;
+    
+    return r;
+}
+
+/*
+ * NAME:    write_plan_add()
+ * DESCRIPTION: Queue a copy of a structure to be written at offset
+ */
+int write_plan_add(write_plan_t *plan, off_t offset, const void *buf, size_t len,
+                   const char *what)
+{
+    write_plan_region_t *r;
+    unsigned char *copy;
+    
+    if (len == 0) {
+        return 0;
+    }
+    
+    copy = malloc(len);
+    if (!copy) {
+        error_print_errno("failed to allocate memory for %s", what);
+        return -1;
+    }
+    memcpy(copy, buf, len);
+    
+    r = add_region(plan, offset, len, what);
+    if (!r) {
+        free(copy);
+        return -1;
+    }
+    r->data = copy;
+    
+    return 0;
+}
+
+/*
+ * NAME:    write_plan_zero()
+ * DESCRIPTION: Queue a range to be cleared without writing it out
+ */
+int write_plan_zero(write_plan_t *plan, off_t offset, off_t len, const char *what)
+{
+    if (len <= 0) {
+        return 0;
+    }
+    
+    return add_region(plan, offset, len, what) ? 0 : -1;
+}
+
+/*
+ * NAME:    write_plan_share()
+ * DESCRIPTION: Queue the regions of a template plan; their data stays
+ *              with the template, which must outlive this plan
+ */
+int write_plan_share(write_plan_t *plan, const write_plan_t *shared)
+{
+    size_t i;
+    
+    for (i = 0; i < shared->count; i++) {
+        const write_plan_region_t *src = &shared->regions[i];
+        write_plan_region_t *r = add_region(plan, src->offset, src->length, src->what);
+        
+        if (!r) {
+            return -1;
+        }
+        r->data = src->data;
+        r->borrowed = 1;
+    }
+    
+    return 0;
+}
+
+/*
+ * NAME:    write_plan_flush()
+ * DESCRIPTION: Write the plan to the device in offset order; the caller
+ *              syncs once when everything else is written too
+ */
+int write_plan_flush(write_plan_t *plan, int fd)
+{
+    struct iovec *iov;
+    uint64_t bytes;
+    size_t i, j, n;
+    
+    if (sort_plan(plan) != 0) {
+        return -1;
+    }
+    
+    iov = malloc(IOV_MAX * sizeof(*iov));
+    if (!iov) {
+        error_print_errno("failed to allocate memory for write plan");
+        return -1;
+    }
+    
+    plan->writes = 0;
+    plan->clears = 0;
+    plan->bytes = 0;
+    
+    for (i = 0; i < plan->count; i += n) {
+        write_plan_region_t *r = &plan->regions[i];
+        
+        n = next_batch(plan, i, &bytes);
+        
+        if (!r->data) {
+            if (device_zero_range(fd, r->offset, bytes) != 0) {
+                error_print_errno("failed to clear %s", r->what);
+                free(iov);
+                return -1;
+            }
+            plan->clears++;
+            continue;
+        }
+        
+        for (j = 0; j < n; j++) {
+            iov[j].iov_base = r[j].data;
+            iov[j].iov_len = r[j].length;
+        }
+        
+        if (write_batch(fd, iov, n, r->offset) != 0) {
+            error_print_errno("failed to write %s", r->what);
+            free(iov);
+            return -1;
+        }
+        plan->writes++;
+        plan->bytes += bytes;
+    }
+    
+    free(iov);
+    
+    error_verbose("write plan: %lu regions in %lu writes and %lu clears, %llu bytes",
+                 (unsigned long)plan->count, plan->writes, plan->clears,
+                 (unsigned long long)plan->bytes);
+    
+    return 0;
+}
+
+/*
+ * NAME:    write_plan_verify()
+ * DESCRIPTION: Read back each batch the flush wrote and compare it with
+ *              the queued regions
+ */
+int write_plan_verify(write_plan_t *plan, int fd)
+{
+    unsigned char *buf = NULL;
+    uint64_t bytes, size = 0;
+    size_t i, j, n;
+    
+    if (sort_plan(plan) != 0) {
+        return -1;
+    }
+    
+    for (i = 0; i < plan->count; i += n) {
+        write_plan_region_t *r = &plan->regions[i];
+        unsigned char *p;
+        
+        n = next_batch(plan, i, &bytes);
+        if (!r->data) {
+            continue;
+        }
+        
+        if (bytes > size) {
+            p = realloc(buf, bytes);
+            if (!p) {
+                error_print_errno("failed to allocate memory for verification");
+                free(buf);
+                return -1;
+            }
+            buf = p;
+            size = bytes;
+        }
+        
+        if (read_batch(fd, buf, bytes, r->offset) != 0) {
+            error_print_errno("failed to read back %s", r->what);
+            free(buf);
+            return -1;
+        }
+        
+        for (j = 0, p = buf; j < n; p += r[j].length, j++) {
+            if (memcmp(p, r[j].data, r[j].length) != 0) {
+                error_print("%s at offset %lld does not match what was written",
+                           r[j].what, (long long)r[j].offset);
+                free(buf);
+                return -1;
+            }
+        }
+    }
+    
+    free(buf);
+    return 0;
+}
+
+/*
+ * NAME:    region_cmp()
+ * DESCRIPTION: qsort() comparator ordering regions by offset
+ */
+static int region_cmp(const void *a, const void *b)
+{
+    const write_plan_region_t *ra = a, *rb = b;
+    
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+/*
+ * NAME:    sort_plan()
+ * DESCRIPTION: Put the regions in offset order and refuse overlaps
+ */
+static int sort_plan(write_plan_t *plan)
+{
+    size_t i;
+    
+    if (plan->sorted) {
+        return 0;
+    }
+    
+    qsort(plan->regions, plan->count, sizeof(*plan->regions), region_cmp);
+    
+    for (i = 1; i < plan->count; i++) {
+        const write_plan_region_t *prev = &plan->regions[i - 1];
+        
+        if (prev->offset + (off_t)prev->length > plan->regions[i].offset) {
+            error_print("%s overlaps %s in the write plan",
+                       prev->what, plan->regions[i].what);
+            return -1;
+        }
+    }
+    
+    plan->sorted = 1;
+    return 0;
+}
+
+/*
+ * NAME:    next_batch()
+ * DESCRIPTION: Count the regions from first on that can go out together:
+ *              adjacent, of the same kind, and within one call's limits
+ */
+static size_t next_batch(const write_plan_t *plan, size_t first, uint64_t *bytes)
+{
+    const write_plan_region_t *r = &plan->regions[first];
+    size_t n = 1;
+    
+    *bytes = r->length;
+    
+    while (first + n < plan->count) {
+        const write_plan_region_t *next = &r[n];
+        
+        if (next->offset != r->offset + (off_t)*bytes || !next->data != !r->data) {
+            break;
+        }
+        
+        /* Ranges to clear merge freely; writes are bounded */
+        if (r->data && (n == IOV_MAX || *bytes + next->length > WRITE_PLAN_CHUNK)) {
+            break;
+        }
+        
+        *bytes += next->length;
+        n++;
+    }
+    
+    return n;
+}
+
+/*
+ * NAME:    write_batch()
+ * DESCRIPTION: pwritev() a batch, picking up after short writes
+ */
+static int write_batch(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    while (iovcnt > 0) {
+        ssize_t done = pwritev(fd, iov, iovcnt, offset);
+        
+        if (done <= 0) {
+            if (done == -1 && errno == EINTR) {
+                continue;
+            }
+            if (done == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        
+        offset += done;
+        while (iovcnt > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * NAME:    read_batch()
+ * DESCRIPTION: Read a batch back with as few pread() calls as the device allows
+ */
+static int read_batch(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * mkfs_plan.h - Ordered write plan for the metadata of a new volume
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MKFS_PLAN_H
+#define MKFS_PLAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Largest batch of regions written or read back with one call */
+#define WRITE_PLAN_CHUNK    (8 * 1024 * 1024)
+
+/* One region of the plan: bytes to write, or a range to clear */
+typedef struct {
+    off_t offset;
+    uint64_t length;
+    unsigned char *data;        /* NULL when the range is cleared */
+    const char *what;           /* Structure name, for messages */
+    int borrowed;               /* data belongs to another plan */
+} write_plan_region_t;
+
+typedef struct {
+    write_plan_region_t *regions;
+    size_t count;
+    size_t alloc;
+    int sorted;
+    unsigned long writes;       /* pwritev calls issued by the last flush */
+    unsigned long clears;       /* Ranges cleared by the last flush */
+    uint64_t bytes;             /* Bytes written by the last flush */
+} write_plan_t;
+
+void write_plan_init(write_plan_t *plan);
+void write_plan_free(write_plan_t *plan);
+
+/* Queue a copy of buf for offset; nothing is written until the flush */
+int write_plan_add(write_plan_t *plan, off_t offset, const void *buf, size_t len,
+                   const char *what);
+
+/* Queue a range to be cleared with device_zero_range() */
+int write_plan_zero(write_plan_t *plan, off_t offset, off_t len, const char *what);
+
+/* Queue every region of a template plan without copying its data */
+int write_plan_share(write_plan_t *plan, const write_plan_t *shared);
+
+/* Write every region in offset order, adjacent ones with one pwritev */
+int write_plan_flush(write_plan_t *plan, int fd);
+
+/* Read the written regions back in the same batches and compare them */
+int write_plan_verify(write_plan_t *plan, int fd);
+
+#endif /* MKFS_PLAN_H */
@@ -0,0 +1,1335 @@
+/*
+ * mkfs_populate.c - Build a new volume's contents from a host directory
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * With -d, mkfs lays a host directory tree out on the new volume itself
+ * instead of leaving that to one hcopy per file.  The tree is scanned
+ * once; every folder and file gets its catalog node ID and every fork a
+ * single contiguous extent right after the catalog, so the extents
+ * overflow file stays empty.  The catalog records are sorted by key and
+ * packed into full nodes from the leaves up, and the forks are copied in
+ * block order, so the image is written front to back in one pass.
+ *
+ * Resource forks and Finder information are taken from AppleDouble
+ * sidecars ("._name" next to the file, or ".AppleDouble/name"), and a
+ * "name.bin" file holding a valid MacBinary II header becomes the file
+ * it encodes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* libhfs's apple.h clashes with hfs_common.h, so mkfs_hfs.h stays out */
+#include "../embedded/shared/error_utils.h"
+#include "../embedded/shared/hfs_detect.h"
+#include "apple.h"
+#include "unicode.h"
+#include "../../include/common/hfsplus_unicode.h"
+#include "mkfs_populate.h"
+
+/* Big-endian fields of on-disk records */
+#define GET_UW(p)     ((uint16_t) ((p)[0] << 8 | (p)[1]))
+#define GET_UL(p)     ((uint32_t) (p)[0] << 24 | (uint32_t) (p)[1] << 16 | \
+                       (uint32_t) (p)[2] << 8 | (uint32_t) (p)[3])
+#define PUT_UW(p, v)  ((p)[0] = (unsigned char) ((v) >> 8), (p)[1] = (unsigned char) (v))
+#define PUT_UL(p, v)  (PUT_UW(p, (v) >> 16), PUT_UW((p) + 2, v))
+#define PUT_UQ(p, v)  (PUT_UL(p, (uint64_t) (v) >> 32), PUT_UL((p) + 4, v))
+
+/* Catalog order[] entries: entry index, low bit set for its thread */
+#define ITEM(index, thread)   ((index) << 1 | (thread))
+#define ITEM_INDEX(item)      ((item) >> 1)
+#define ITEM_THREAD(item)     ((item) & 1)
+
+/* Longest names and records */
+#define HFS_NAME_MAX          31
+#define HFSPLUS_NAME_MAX      255
+#define MAX_RECORD            1024
+#define NODE_DESCSZ           14
+#define HFS_INDEX_KEYLEN      0x25
+
+/* Sidecar formats */
+#define APPLEDOUBLE_MAGIC     0x00051607
+#define AD_ENTRY_RSRC         2
+#define AD_ENTRY_DATES        8
+#define AD_ENTRY_FINDER       9
+#define AD_EPOCH              946684800     /* 2000-01-01 in Unix time */
+#define MACB_BLOCKSZ          128
+
+/* Finder flags MacOS resets when a file is copied, as hcopy does */
+#define FNDR_RESET_FLAGS      (0x0001 | 0x0100 | 0x0200)
+
+/* Files without Finder information get the hcopy raw type */
+#define RAW_TYPE              "????"
+#define RAW_CREA              "UNIX"
+
+#define COPY_BUFSZ            (1024 * 1024)
+
+/* The MacOS collating order for HFS names, as in libhfs */
+static const unsigned char charorder[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+
+    0x20, 0x22, 0x23, 0x28, 0x29, 0x2a, 0x2b, 0x2c,
+    0x2f, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e,
+    0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+
+    0x47, 0x48, 0x58, 0x5a, 0x5e, 0x60, 0x67, 0x69,
+    0x6b, 0x6d, 0x73, 0x75, 0x77, 0x79, 0x7b, 0x7f,
+    0x8d, 0x8f, 0x91, 0x93, 0x96, 0x98, 0x9f, 0xa1,
+    0xa3, 0xa5, 0xa8, 0xaa, 0xab, 0xac, 0xad, 0xae,
+
+    0x54, 0x48, 0x58, 0x5a, 0x5e, 0x60, 0x67, 0x69,
+    0x6b, 0x6d, 0x73, 0x75, 0x77, 0x79, 0x7b, 0x7f,
+    0x8d, 0x8f, 0x91, 0x93, 0x96, 0x98, 0x9f, 0xa1,
+    0xa3, 0xa5, 0xa8, 0xaf, 0xb0, 0xb1, 0xb2, 0xb3,
+
+    0x4c, 0x50, 0x5c, 0x62, 0x7d, 0x81, 0x9a, 0x55,
+    0x4a, 0x56, 0x4c, 0x4e, 0x50, 0x5c, 0x62, 0x64,
+    0x65, 0x66, 0x6f, 0x70, 0x71, 0x72, 0x7d, 0x89,
+    0x8a, 0x8b, 0x81, 0x83, 0x9c, 0x9d, 0x9e, 0x9a,
+
+    0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0x95,
+    0xbb, 0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0x52, 0x85,
+    0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8,
+    0xc9, 0xca, 0xcb, 0x57, 0x8c, 0xcc, 0x52, 0x85,
+
+    0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0x26,
+    0x27, 0xd4, 0x20, 0x4a, 0x4e, 0x83, 0x87, 0x87,
+    0xd5, 0xd6, 0x24, 0x25, 0x2d, 0x2e, 0xd7, 0xd8,
+    0xa7, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+
+    0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+    0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+    0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+/* Nodes of one B*-tree level as they are filled */
+typedef struct {
+    unsigned char *nodes;       /* NULL when only counting */
+    uint32_t node_size;
+    uint32_t count;             /* Nodes so far, header included */
+    uint32_t alloc;
+    uint32_t used;              /* Record bytes in the current node */
+    uint32_t nrecs;
+} packer_t;
+
+/* qsort() has no context argument */
+static const populate_t *sort_pop;
+
+/* Forward declarations */
+static int scan_folder(populate_t *pop, uint32_t index);
+static int add_entry(populate_t *pop, uint32_t parent, char *path, const char *name,
+                     const struct stat *st, int is_dir);
+static int read_sidecar(populate_entry_t *e, const char *path);
+static int read_macbinary(populate_t *pop, uint32_t parent, char *path,
+                          const struct stat *st);
+static int set_name(const populate_t *pop, populate_entry_t *e, const char *host);
+static int set_mac_name(const populate_t *pop, populate_entry_t *e,
+                        const unsigned char *mac, unsigned int len);
+static void store_uname(populate_entry_t *e);
+static unsigned int utf8_to_utf16(uint16_t *dst, unsigned int max, const char *src);
+static uint16_t macbinary_crc(const unsigned char *p, size_t len);
+static int compare_items(const void *a, const void *b);
+static void item_key(const populate_t *pop, uint32_t item, uint32_t *parent,
+                     const void **name, unsigned int *len);
+static unsigned int build_key(const populate_t *pop, uint32_t item, unsigned char *rec,
+                              int index);
+static unsigned int build_record(const populate_t *pop, uint32_t item, unsigned char *rec);
+static int pack_level(packer_t *pk, const populate_t *pop, const uint32_t *firsts,
+                      uint32_t n, uint32_t child, int height, uint32_t **level_firsts,
+                      uint32_t *level_nodes);
+static int pack_record(packer_t *pk, const unsigned char *rec, unsigned int len,
+                       int kind, int height, uint32_t *prev);
+static uint32_t mac_date(time_t t);
+static char *join_path(const char *dir, const char *name);
+static int read_at(int fd, off_t offset, void *buf, size_t len);
+static int copy_fork(const populate_fork_t *fork, int fd, off_t block_zero,
+                     uint32_t block_size, unsigned char *buf);
+
+/*
+ * NAME:    populate_scan()
+ * DESCRIPTION: Walk a host directory tree and sort what it holds into
+ *              catalog order
+ */
+int populate_scan(populate_t *pop, const char *dir, const char *volume_name, int hfsplus)
+{
+    struct stat st;
+    populate_entry_t *root;
+    uint32_t i, n;
+    
+    memset(pop, 0, sizeof(*pop));
+    pop->hfsplus = hfsplus;
+    pop->next_cnid = 16;
+    
+    if (stat(dir, &st) != 0) {
+        error_print_errno("cannot access %s", dir);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        error_print("%s is not a directory", dir);
+        return -1;
+    }
+    
+    /* The root folder: parent 1, ID 2, named after the volume */
+    pop->alloc = 256;
+    pop->entries = calloc(pop->alloc, sizeof(*pop->entries));
+    if (!pop->entries) {
+        error_print_errno("failed to allocate memory for directory tree");
+        return -1;
+    }
+    
+    pop->count = 1;
+    root = &pop->entries[0];
+    root->path = strdup(dir);
+    root->cnid = 2;
+    root->parent = 1;
+    root->is_dir = 1;
+    root->create_date = st.st_mtime;
+    root->modify_date = st.st_mtime;
+    root->access_date = st.st_atime;
+    root->mode = st.st_mode;
+    root->uid = st.st_uid;
+    root->gid = st.st_gid;
+    
+    if (!root->path) {
+        error_print_errno("failed to allocate memory for directory tree");
+        return -1;
+    }
+    
+    if (hfsplus) {
+        if (set_name(pop, root, volume_name) != 0) {
+            return -1;
+        }
+    } else if (set_mac_name(pop, root, (const unsigned char *)volume_name,
+                            strlen(volume_name)) != 0) {
+        return -1;
+    }
+    
+    /* Breadth first, so the contents of a folder get consecutive IDs */
+    for (i = 0; i < pop->count; i++) {
+        if (pop->entries[i].is_dir && scan_folder(pop, i) != 0) {
+            return -1;
+        }
+    }
+    
+    /* Every entry has a record; folders, and HFS+ files, have a thread */
+    n = 0;
+    for (i = 0; i < pop->count; i++) {
+        n += (pop->entries[i].is_dir || hfsplus) ? 2 : 1;
+    }
+    
+    pop->order = malloc(n * sizeof(*pop->order));
+    if (!pop->order) {
+        error_print_errno("failed to allocate memory for catalog records");
+        return -1;
+    }
+    
+    for (i = 0; i < pop->count; i++) {
+        pop->order[pop->nrecords++] = ITEM(i, 0);
+        if (pop->entries[i].is_dir || hfsplus) {
+            pop->order[pop->nrecords++] = ITEM(i, 1);
+        }
+    }
+    
+    sort_pop = pop;
+    qsort(pop->order, pop->nrecords, sizeof(*pop->order), compare_items);
+    
+    /* Names that only differ in ways the volume ignores collide */
+    for (i = 1; i < pop->nrecords; i++) {
+        if (compare_items(&pop->order[i - 1], &pop->order[i]) == 0) {
+            error_print("%s and %s have the same name on %s",
+                        pop->entries[ITEM_INDEX(pop->order[i - 1])].path,
+                        pop->entries[ITEM_INDEX(pop->order[i])].path,
+                        hfsplus ? "HFS+" : "HFS");
+            return -1;
+        }
+    }
+    
+    error_verbose("%s: %u files, %u folders", dir, pop->files, pop->folders);
+    
+    return 0;
+}
+
+/*
+ * NAME:    populate_catalog_nodes()
+ * DESCRIPTION: Count the nodes of the catalog populate_build_catalog()
+ *              would build
+ */
+uint32_t populate_catalog_nodes(const populate_t *pop, uint32_t node_size)
+{
+    uint32_t nnodes, root, first_leaf, last_leaf;
+    uint16_t depth;
+    
+    if (populate_build_catalog(pop, node_size, NULL, &nnodes, &depth, &root,
+                               &first_leaf, &last_leaf) != 0) {
+        return 0;
+    }
+    
+    return nnodes;
+}
+
+/*
+ * NAME:    populate_layout()
+ * DESCRIPTION: Place every fork in catalog order from first_block on;
+ *              return the number of blocks they take
+ */
+uint64_t populate_layout(populate_t *pop, uint32_t first_block, uint32_t block_size)
+{
+    uint64_t next = first_block;
+    uint32_t i;
+    
+    pop->block_size = block_size;
+    
+    for (i = 0; i < pop->nrecords; i++) {
+        populate_entry_t *e = &pop->entries[ITEM_INDEX(pop->order[i])];
+        populate_fork_t *forks[2] = { &e->data, &e->rsrc };
+        int f;
+        
+        if (ITEM_THREAD(pop->order[i]) || e->is_dir) {
+            continue;
+        }
+        
+        for (f = 0; f < 2; f++) {
+            uint64_t blocks = (forks[f]->length + block_size - 1) / block_size;
+            
+            forks[f]->start_block = blocks ? next : 0;
+            forks[f]->blocks = blocks;
+            next += blocks;
+        }
+    }
+    
+    pop->data_blocks = next - first_block;
+    
+    return pop->data_blocks;
+}
+
+/*
+ * NAME:    populate_build_catalog()
+ * DESCRIPTION: Pack the sorted records into leaf nodes, then index nodes
+ *              up to a single root; with nodes NULL, only count them
+ */
+int populate_build_catalog(const populate_t *pop, uint32_t node_size,
+                           unsigned char **nodes, uint32_t *nnodes,
+                           uint16_t *depth, uint32_t *root,
+                           uint32_t *first_leaf, uint32_t *last_leaf)
+{
+    packer_t pk;
+    uint32_t *firsts = NULL, *upper;
+    uint32_t n, start;
+    int height = 1;
+    
+    memset(&pk, 0, sizeof(pk));
+    pk.node_size = node_size;
+    pk.count = 1;
+    
+    if (nodes) {
+        pk.alloc = 64;
+        pk.nodes = calloc(pk.alloc, node_size);
+        if (!pk.nodes) {
+            error_print_errno("failed to allocate memory for catalog nodes");
+            return -1;
+        }
+    }
+    
+    /* Leaves hold the records themselves */
+    start = pk.count;
+    if (pack_level(&pk, pop, pop->order, pop->nrecords, 0, height, &firsts, &n) != 0) {
+        free(pk.nodes);
+        return -1;
+    }
+    *first_leaf = start;
+    *last_leaf = start + n - 1;
+    
+    /* Each index level has one record per node of the level below */
+    while (n > 1) {
+        uint32_t child = start;
+        
+        height++;
+        start = pk.count;
+        if (pack_level(&pk, pop, firsts, n, child, height, &upper, &n) != 0) {
+            free(firsts);
+            free(pk.nodes);
+            return -1;
+        }
+        free(firsts);
+        firsts = upper;
+    }
+    
+    free(firsts);
+    
+    if (nodes) {
+        *nodes = pk.nodes;
+    }
+    *nnodes = pk.count;
+    *depth = height;
+    *root = start;
+    
+    return 0;
+}
+
+/*
+ * NAME:    populate_write_forks()
+ * DESCRIPTION: Copy the forks to the blocks populate_layout() gave them
+ */
+int populate_write_forks(const populate_t *pop, int fd, off_t block_zero)
+{
+    unsigned char *buf;
+    uint32_t i;
+    
+    buf = malloc(COPY_BUFSZ);
+    if (!buf) {
+        error_print_errno("failed to allocate copy buffer");
+        return -1;
+    }
+    
+    /* populate_layout() handed out blocks in this same order */
+    for (i = 0; i < pop->nrecords; i++) {
+        const populate_entry_t *e = &pop->entries[ITEM_INDEX(pop->order[i])];
+        
+        if (ITEM_THREAD(pop->order[i]) || e->is_dir) {
+            continue;
+        }
+        
+        if (copy_fork(&e->data, fd, block_zero, pop->block_size, buf) != 0 ||
+            copy_fork(&e->rsrc, fd, block_zero, pop->block_size, buf) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    
+    free(buf);
+    
+    error_verbose("copied %llu blocks of file data",
+                  (unsigned long long)pop->data_blocks);
+    
+    return 0;
+}
+
+/*
+ * NAME:    populate_free()
+ * DESCRIPTION: Release a scanned tree
+ */
+void populate_free(populate_t *pop)
+{
+    uint32_t i;
+    
+    for (i = 0; i < pop->count; i++) {
+        populate_entry_t *e = &pop->entries[i];
+        
+        if (e->rsrc.source != e->path) {
+            free(e->rsrc.source);
+        }
+        if (e->data.source != e->path) {
+            free(e->data.source);
+        }
+        free(e->path);
+        free(e->name);
+        free(e->uname);
+    }
+    
+    free(pop->entries);
+    free(pop->order);
+    memset(pop, 0, sizeof(*pop));
+}
+
+/*
+ * NAME:    scan_folder()
+ * DESCRIPTION: Add the contents of one host directory
+ */
+static int scan_folder(populate_t *pop, uint32_t index)
+{
+    const char *dirpath = pop->entries[index].path;
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int result = 0;
+    
+    dir = opendir(dirpath);
+    if (!dir) {
+        error_print_errno("cannot open directory %s", dirpath);
+        return -1;
+    }
+    
+    while (result == 0 && (de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        const char *dot = strrchr(name, '.');
+        char *path;
+        
+        /* Sidecars are read along with the file they describe */
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+            strncmp(name, "._", 2) == 0 || strcmp(name, ".AppleDouble") == 0) {
+            continue;
+        }
+        
+        path = join_path(dirpath, name);
+        if (!path) {
+            result = -1;
+            break;
+        }
+        
+        if (lstat(path, &st) != 0) {
+            error_print_errno("cannot access %s", path);
+            free(path);
+            result = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            result = add_entry(pop, index, path, name, &st, 1);
+        } else if (!S_ISREG(st.st_mode)) {
+            error_warning("skipping %s: not a regular file or directory", path);
+            free(path);
+        } else if (dot && strcmp(dot, ".bin") == 0 &&
+                   (result = read_macbinary(pop, index, path, &st)) != 0) {
+            /* Decoded as MacBinary, or failed */
+            result = result < 0 ? -1 : 0;
+        } else {
+            result = add_entry(pop, index, path, name, &st, 0);
+        }
+        
+        /* add_entry() may have moved the entries */
+        dirpath = pop->entries[index].path;
+    }
+    
+    closedir(dir);
+    
+    return result;
+}
+
+/*
+ * NAME:    add_entry()
+ * DESCRIPTION: Add a host file or folder under a scanned folder; the entry
+ *              takes over path
+ */
+static int add_entry(populate_t *pop, uint32_t parent, char *path, const char *name,
+                     const struct stat *st, int is_dir)
+{
+    populate_entry_t *e;
+    
+    if (pop->count == pop->alloc) {
+        populate_entry_t *grown;
+        
+        grown = realloc(pop->entries, 2 * pop->alloc * sizeof(*grown));
+        if (!grown) {
+            error_print_errno("failed to allocate memory for directory tree");
+            free(path);
+            return -1;
+        }
+        memset(grown + pop->alloc, 0, pop->alloc * sizeof(*grown));
+        pop->entries = grown;
+        pop->alloc *= 2;
+    }
+    
+    if (pop->next_cnid == 0xffffffff) {
+        error_print("too many files for one volume");
+        free(path);
+        return -1;
+    }
+    
+    e = &pop->entries[pop->count++];
+    e->path = path;
+    e->cnid = pop->next_cnid++;
+    e->parent = pop->entries[parent].cnid;
+    e->is_dir = is_dir;
+    e->create_date = st->st_mtime;
+    e->modify_date = st->st_mtime;
+    e->access_date = st->st_atime;
+    e->mode = st->st_mode;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    
+    pop->entries[parent].valence++;
+    if (is_dir) {
+        pop->folders++;
+        pop->root_folders += (parent == 0);
+    } else {
+        pop->files++;
+        pop->root_files += (parent == 0);
+        
+        memcpy(e->finder + 0, RAW_TYPE, 4);
+        memcpy(e->finder + 4, RAW_CREA, 4);
+        if (st->st_size > 0) {
+            e->data.source = path;
+            e->data.length = st->st_size;
+        }
+    }
+    
+    if (name && set_name(pop, e, name) != 0) {
+        return -1;
+    }
+    
+    return read_sidecar(e, path);
+}
+
+/*
+ * NAME:    read_sidecar()
+ * DESCRIPTION: Take the resource fork, Finder information and creation
+ *              date from an AppleDouble file, if there is one
+ */
+static int read_sidecar(populate_entry_t *e, const char *path)
+{
+    const char *base = strrchr(path, '/');
+    char *sidecar;
+    unsigned char hdr[26], ent[12];
+    size_t dirlen;
+    uint16_t nentries, i;
+    int fd;
+    
+    base = base ? base + 1 : path;
+    dirlen = base - path;
+    
+    /* "._name" next to the file, else netatalk's ".AppleDouble/name" */
+    sidecar = malloc(dirlen + strlen(base) + sizeof(".AppleDouble/"));
+    if (!sidecar) {
+        error_print_errno("failed to allocate memory for %s", path);
+        return -1;
+    }
+    
+    sprintf(sidecar, "%.*s._%s", (int)dirlen, path, base);
+    fd = open(sidecar, O_RDONLY);
+    if (fd == -1) {
+        sprintf(sidecar, "%.*s.AppleDouble/%s", (int)dirlen, path, base);
+        fd = open(sidecar, O_RDONLY);
+    }
+    if (fd == -1) {
+        free(sidecar);
+        return 0;
+    }
+    
+    if (read_at(fd, 0, hdr, sizeof(hdr)) != 0 || GET_UL(hdr) != APPLEDOUBLE_MAGIC) {
+        error_warning("ignoring %s: not an AppleDouble file", sidecar);
+        close(fd);
+        free(sidecar);
+        return 0;
+    }
+    
+    nentries = GET_UW(hdr + 24);
+    for (i = 0; i < nentries; i++) {
+        uint32_t id, offset, length;
+        unsigned char buf[32];
+        
+        if (read_at(fd, sizeof(hdr) + 12 * i, ent, sizeof(ent)) != 0) {
+            break;
+        }
+        
+        id = GET_UL(ent);
+        offset = GET_UL(ent + 4);
+        length = GET_UL(ent + 8);
+        
+        if (id == AD_ENTRY_RSRC && !e->is_dir && length > 0) {
+            e->rsrc.source = sidecar;
+            e->rsrc.offset = offset;
+            e->rsrc.length = length;
+        } else if (id == AD_ENTRY_FINDER && length >= 16) {
+            memset(buf, 0, sizeof(buf));
+            if (read_at(fd, offset, buf, length < 32 ? length : 32) == 0) {
+                memcpy(e->finder, buf, 32);
+                PUT_UW(e->finder + 8, GET_UW(buf + 8) & ~FNDR_RESET_FLAGS);
+            }
+        } else if (id == AD_ENTRY_DATES && length >= 4 &&
+                   read_at(fd, offset, buf, 4) == 0 && GET_UL(buf) != 0x80000000) {
+            e->create_date = AD_EPOCH + (int32_t)GET_UL(buf);
+        }
+    }
+    
+    close(fd);
+    
+    if (e->rsrc.source != sidecar) {
+        free(sidecar);
+    }
+    
+    return 0;
+}
+
+/*
+ * NAME:    read_macbinary()
+ * DESCRIPTION: Add a "name.bin" file as the file it encodes; return 1 if
+ *              it was MacBinary II, 0 if not and -1 on error
+ */
+static int read_macbinary(populate_t *pop, uint32_t parent, char *path,
+                          const struct stat *st)
+{
+    unsigned char hdr[MACB_BLOCKSZ];
+    populate_entry_t *e;
+    uint32_t dsize, rsize;
+    off_t data_offset, rsrc_offset;
+    int fd, valid;
+    
+    if (st->st_size < MACB_BLOCKSZ) {
+        return 0;
+    }
+    
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        error_print_errno("cannot open %s", path);
+        free(path);
+        return -1;
+    }
+    valid = read_at(fd, 0, hdr, sizeof(hdr)) == 0;
+    close(fd);
+    
+    /* The checks cpi_macb() makes */
+    if (!valid || hdr[0] != 0 || hdr[74] != 0 || hdr[123] > 129 ||
+        macbinary_crc(hdr, 124) != GET_UW(hdr + 124) ||
+        hdr[1] < 1 || hdr[1] > 63 || hdr[2 + hdr[1]] != 0) {
+        return 0;
+    }
+    
+    dsize = GET_UL(hdr + 83);
+    rsize = GET_UL(hdr + 87);
+    data_offset = MACB_BLOCKSZ + ((GET_UW(hdr + 120) + MACB_BLOCKSZ - 1) & ~(MACB_BLOCKSZ - 1));
+    rsrc_offset = data_offset + ((dsize + MACB_BLOCKSZ - 1) & ~(MACB_BLOCKSZ - 1));
+    
+    if (dsize > 0x7fffffff || rsize > 0x7fffffff || rsrc_offset + rsize > st->st_size) {
+        return 0;
+    }
+    
+    if (add_entry(pop, parent, path, NULL, st, 0) != 0) {
+        return -1;
+    }
+    
+    e = &pop->entries[pop->count - 1];
+    if (set_mac_name(pop, e, hdr + 2, hdr[1]) != 0) {
+        return -1;
+    }
+    
+    /* Finder information and dates come from the header */
+    memset(e->finder, 0, sizeof(e->finder));
+    memcpy(e->finder + 0, hdr + 65, 8);         /* fdType, fdCreator */
+    PUT_UW(e->finder + 8, (hdr[73] << 8 | hdr[101]) & ~FNDR_RESET_FLAGS);
+    memcpy(e->finder + 10, hdr + 75, 6);        /* fdLocation, fdFldr */
+    e->create_date = (time_t)GET_UL(hdr + 91) - HFS_EPOCH_OFFSET;
+    e->modify_date = (time_t)GET_UL(hdr + 95) - HFS_EPOCH_OFFSET;
+    
+    e->data.source = dsize ? path : NULL;
+    e->data.offset = data_offset;
+    e->data.length = dsize;
+    
+    if (e->rsrc.source) {
+        error_warning("ignoring AppleDouble sidecar of MacBinary file %s", path);
+        free(e->rsrc.source);
+    }
+    e->rsrc.source = rsize ? path : NULL;
+    e->rsrc.offset = rsrc_offset;
+    e->rsrc.length = rsize;
+    
+    return 1;
+}
+
+/*
+ * NAME:    store_uname()
+ * DESCRIPTION: Put an HFS+ name in on-disk byte order, in which it is
+ *              both sorted and written
+ */
+static void store_uname(populate_entry_t *e)
+{
+    unsigned int i;
+    
+    for (i = 0; i < e->name_len; i++) {
+        e->uname[i] = htobe16(e->uname[i]);
+    }
+}
+
+/*
+ * NAME:    set_name()
+ * DESCRIPTION: Convert a UTF-8 host name to the volume's encoding; ':' is
+ *              stored as '/', as MacOS does for POSIX names
+ */
+static int set_name(const populate_t *pop, populate_entry_t *e, const char *host)
+{
+    uint16_t utf16[2 * HFSPLUS_NAME_MAX];
+    unsigned char mac[2 * HFSPLUS_NAME_MAX + 1];
+    unsigned int len, i;
+    
+    len = utf8_to_utf16(utf16, 2 * HFSPLUS_NAME_MAX, host);
+    for (i = 0; i < len; i++) {
+        if (utf16[i] == ':') {
+            utf16[i] = '/';
+        }
+    }
+    
+    if (!pop->hfsplus) {
+        /* u_tomac() also recomposes decomposed host names */
+        len = u_tomac((char *)mac, utf16, len);
+        return set_mac_name(pop, e, mac, len);
+    }
+    
+    e->uname = malloc(HFSPLUS_NAME_MAX * sizeof(*e->uname));
+    if (!e->uname) {
+        error_print_errno("failed to allocate memory for %s", e->path);
+        return -1;
+    }
+    
+    /* HFS+ stores names decomposed, as u_frommac() returns them */
+    e->name_len = 0;
+    for (i = 0; i < len; i++) {
+        UInteger parts[2] = { utf16[i], 0 };
+        char c[2];
+        unsigned int n = 1;
+        
+        if (utf16[i] >= 0x80 && u_tomac(c, &utf16[i], 1) == 1 &&
+            (unsigned char)c[0] >= 0x80) {
+            n = u_frommac(parts, c, 2);
+        }
+        
+        if (e->name_len + n > HFSPLUS_NAME_MAX) {
+            error_warning("%s: name truncated to %u characters", e->path, HFSPLUS_NAME_MAX);
+            break;
+        }
+        memcpy(e->uname + e->name_len, parts, n * sizeof(*parts));
+        e->name_len += n;
+    }
+    
+    store_uname(e);
+    
+    return 0;
+}
+
+/*
+ * NAME:    set_mac_name()
+ * DESCRIPTION: Give an entry a MacOS Standard Roman name
+ */
+static int set_mac_name(const populate_t *pop, populate_entry_t *e,
+                        const unsigned char *mac, unsigned int len)
+{
+    char cstr[2 * HFSPLUS_NAME_MAX + 1];
+    
+    if (pop->hfsplus) {
+        if (len > HFSPLUS_NAME_MAX) {
+            len = HFSPLUS_NAME_MAX;
+        }
+        memcpy(cstr, mac, len);
+        cstr[len] = 0;
+        
+        e->uname = malloc(2 * HFSPLUS_NAME_MAX * sizeof(*e->uname));
+        if (!e->uname) {
+            error_print_errno("failed to allocate memory for %s", e->path);
+            return -1;
+        }
+        
+        len = u_frommac(e->uname, cstr, 2 * HFSPLUS_NAME_MAX);
+        if (len > HFSPLUS_NAME_MAX) {
+            error_warning("%s: name truncated to %u characters", e->path, HFSPLUS_NAME_MAX);
+            len = HFSPLUS_NAME_MAX;
+        }
+        e->name_len = len;
+        store_uname(e);
+        return 0;
+    }
+    
+    if (len > HFS_NAME_MAX) {
+        error_warning("%s: name truncated to %u characters", e->path, HFS_NAME_MAX);
+        len = HFS_NAME_MAX;
+    }
+    
+    e->name = malloc(len + 1);
+    if (!e->name) {
+        error_print_errno("failed to allocate memory for %s", e->path);
+        return -1;
+    }
+    memcpy(e->name, mac, len);
+    e->name[len] = 0;
+    e->name_len = len;
+    
+    return 0;
+}
+
+/*
+ * NAME:    utf8_to_utf16()
+ * DESCRIPTION: Decode a host name; bytes that are not UTF-8 are taken as
+ *              Latin-1
+ */
+static unsigned int utf8_to_utf16(uint16_t *dst, unsigned int max, const char *src)
+{
+    const unsigned char *p = (const unsigned char *)src;
+    unsigned int len = 0;
+    
+    while (*p && len + 2 <= max) {
+        uint32_t c = *p;
+        int extra = 0, i;
+        
+        if (c >= 0xf0 && c < 0xf5) {
+            extra = 3;
+            c &= 0x07;
+        } else if (c >= 0xe0) {
+            extra = (c < 0xf0) ? 2 : 0;
+            c &= 0x0f;
+        } else if (c >= 0xc2) {
+            extra = 1;
+            c &= 0x1f;
+        }
+        
+        for (i = 1; i <= extra; i++) {
+            if ((p[i] & 0xc0) != 0x80) {
+                break;
+            }
+            c = c << 6 | (p[i] & 0x3f);
+        }
+        
+        if (i <= extra || (extra == 2 && (c < 0x800 || (c >= 0xd800 && c < 0xe000))) ||
+            (extra == 3 && (c < 0x10000 || c > 0x10ffff))) {
+            /* Not valid UTF-8 */
+            c = *p;
+            extra = 0;
+        }
+        p += 1 + extra;
+        
+        if (c >= 0x10000) {
+            dst[len++] = 0xd800 + ((c - 0x10000) >> 10);
+            dst[len++] = 0xdc00 + ((c - 0x10000) & 0x3ff);
+        } else {
+            dst[len++] = c;
+        }
+    }
+    
+    return len;
+}
+
+/*
+ * NAME:    macbinary_crc()
+ * DESCRIPTION: CRC-16/CCITT of a MacBinary II header, as crc_macb() computes
+ */
+static uint16_t macbinary_crc(const unsigned char *p, size_t len)
+{
+    uint16_t crc = 0;
+    int bit;
+    
+    while (len--) {
+        crc ^= *p++ << 8;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    
+    return crc;
+}
+
+/*
+ * NAME:    item_key()
+ * DESCRIPTION: The parent ID and name a catalog record is keyed by; a
+ *              thread is keyed by its own ID and an empty name
+ */
+static void item_key(const populate_t *pop, uint32_t item, uint32_t *parent,
+                     const void **name, unsigned int *len)
+{
+    const populate_entry_t *e = &pop->entries[ITEM_INDEX(item)];
+    
+    if (ITEM_THREAD(item)) {
+        *parent = e->cnid;
+        *name = NULL;
+        *len = 0;
+    } else {
+        *parent = e->parent;
+        *name = pop->hfsplus ? (const void *)e->uname : (const void *)e->name;
+        *len = e->name_len;
+    }
+}
+
+/*
+ * NAME:    compare_items()
+ * DESCRIPTION: qsort() order of catalog records: by parent ID, then by
+ *              name as the volume format collates them
+ */
+static int compare_items(const void *a, const void *b)
+{
+    uint32_t p1, p2;
+    const void *n1, *n2;
+    unsigned int l1, l2, i;
+    
+    item_key(sort_pop, *(const uint32_t *)a, &p1, &n1, &l1);
+    item_key(sort_pop, *(const uint32_t *)b, &p2, &n2, &l2);
+    
+    if (p1 != p2) {
+        return p1 < p2 ? -1 : 1;
+    }
+    
+    if (sort_pop->hfsplus) {
+        return hfsplus_unicode_compare(n1, l1, n2, l2);
+    }
+    
+    for (i = 0; i < l1 && i < l2; i++) {
+        int diff = charorder[((const unsigned char *)n1)[i]] -
+                   charorder[((const unsigned char *)n2)[i]];
+        
+        if (diff) {
+            return diff;
+        }
+    }
+    
+    return (int)l1 - (int)l2;
+}
+
+/*
+ * NAME:    build_key()
+ * DESCRIPTION: Store a record's catalog key; HFS index keys are padded to
+ *              their fixed length.  Return the key's length on disk.
+ */
+static unsigned int build_key(const populate_t *pop, uint32_t item, unsigned char *rec,
+                              int index)
+{
+    uint32_t parent;
+    const void *name;
+    unsigned int len;
+    
+    item_key(pop, item, &parent, &name, &len);
+    
+    if (pop->hfsplus) {
+        const uint16_t *uname = name;
+        
+        PUT_UW(rec, 6 + 2 * len);
+        PUT_UL(rec + 2, parent);
+        PUT_UW(rec + 6, len);
+        memcpy(rec + 8, uname, 2 * len);
+        return 8 + 2 * len;
+    }
+    
+    memset(rec, 0, 1 + HFS_INDEX_KEYLEN);
+    rec[0] = index ? HFS_INDEX_KEYLEN : 6 + len;
+    PUT_UL(rec + 2, parent);
+    rec[6] = len;
+    memcpy(rec + 7, name, len);
+    
+    return index ? 1 + HFS_INDEX_KEYLEN : (1 + rec[0] + 1) & ~1;
+}
+
+/*
+ * NAME:    build_record()
+ * DESCRIPTION: Store the leaf record of a catalog item; return its length
+ */
+static unsigned int build_record(const populate_t *pop, uint32_t item, unsigned char *rec)
+{
+    const populate_entry_t *e = &pop->entries[ITEM_INDEX(item)];
+    unsigned int keylen = build_key(pop, item, rec, 0);
+    unsigned char *d = rec + keylen;
+    uint32_t bs = pop->block_size;
+    
+    if (ITEM_THREAD(item)) {
+        if (pop->hfsplus) {
+            memset(d, 0, 10 + 2 * e->name_len);
+            PUT_UW(d, e->is_dir ? 3 : 4);       /* Folder or file thread */
+            PUT_UL(d + 4, e->parent);
+            PUT_UW(d + 8, e->name_len);
+            memcpy(d + 10, e->uname, 2 * e->name_len);
+            return keylen + 10 + 2 * e->name_len;
+        }
+        
+        memset(d, 0, 46);
+        d[0] = 3;                               /* cdrThdRec */
+        PUT_UL(d + 10, e->parent);              /* thdParID */
+        d[14] = e->name_len;                    /* thdCName */
+        memcpy(d + 15, e->name, e->name_len);
+        return keylen + 46;
+    }
+    
+    if (pop->hfsplus) {
+        unsigned int size = e->is_dir ? 88 : 248;
+        
+        memset(d, 0, size);
+        PUT_UW(d + 0, e->is_dir ? 1 : 2);       /* recordType */
+        PUT_UL(d + 8, e->cnid);
+        PUT_UL(d + 12, mac_date(e->create_date));
+        PUT_UL(d + 16, mac_date(e->modify_date));
+        PUT_UL(d + 20, mac_date(e->modify_date));
+        PUT_UL(d + 24, mac_date(e->access_date));
+        PUT_UL(d + 32, e->uid);                 /* HFSPlusBSDInfo */
+        PUT_UL(d + 36, e->gid);
+        PUT_UW(d + 42, e->mode);
+        memcpy(d + 48, e->finder, 32);          /* userInfo, finderInfo */
+        
+        if (e->is_dir) {
+            PUT_UL(d + 4, e->valence);
+        } else {
+            PUT_UW(d + 2, 0x0002);              /* kHFSThreadExistsMask */
+            PUT_UQ(d + 88, e->data.length);     /* dataFork */
+            PUT_UL(d + 88 + 12, e->data.blocks);
+            PUT_UL(d + 88 + 16, e->data.start_block);
+            PUT_UL(d + 88 + 20, e->data.blocks);
+            PUT_UQ(d + 168, e->rsrc.length);    /* resourceFork */
+            PUT_UL(d + 168 + 12, e->rsrc.blocks);
+            PUT_UL(d + 168 + 16, e->rsrc.start_block);
+            PUT_UL(d + 168 + 20, e->rsrc.blocks);
+        }
+        return keylen + size;
+    }
+    
+    if (e->is_dir) {
+        memset(d, 0, 70);
+        d[0] = 1;                               /* cdrDirRec */
+        PUT_UW(d + 4, e->valence > 0xffff ? 0xffff : e->valence);
+        PUT_UL(d + 6, e->cnid);                 /* dirDirID */
+        PUT_UL(d + 10, mac_date(e->create_date));
+        PUT_UL(d + 14, mac_date(e->modify_date));
+        memcpy(d + 22, e->finder, 32);          /* dirUsrInfo, dirFndrInfo */
+        return keylen + 70;
+    }
+    
+    memset(d, 0, 102);
+    d[0] = 2;                                   /* cdrFilRec */
+    memcpy(d + 4, e->finder, 16);               /* filUsrWds */
+    PUT_UL(d + 20, e->cnid);                    /* filFlNum */
+    PUT_UW(d + 24, e->data.start_block);        /* filStBlk */
+    PUT_UL(d + 26, e->data.length);             /* filLgLen */
+    PUT_UL(d + 30, e->data.blocks * bs);        /* filPyLen */
+    PUT_UW(d + 34, e->rsrc.start_block);        /* filRStBlk */
+    PUT_UL(d + 36, e->rsrc.length);             /* filRLgLen */
+    PUT_UL(d + 40, e->rsrc.blocks * bs);        /* filRPyLen */
+    PUT_UL(d + 44, mac_date(e->create_date));   /* filCrDat */
+    PUT_UL(d + 48, mac_date(e->modify_date));   /* filMdDat */
+    memcpy(d + 56, e->finder + 16, 16);         /* filFndrInfo */
+    PUT_UW(d + 74, e->data.start_block);        /* filExtRec */
+    PUT_UW(d + 76, e->data.blocks);
+    PUT_UW(d + 86, e->rsrc.start_block);        /* filRExtRec */
+    PUT_UW(d + 88, e->rsrc.blocks);
+    
+    return keylen + 102;
+}
+
+/*
+ * NAME:    pack_level()
+ * DESCRIPTION: Fill the nodes of one tree level; with child 0 the records
+ *              are the leaf records of firsts[], otherwise one index record
+ *              for each of the n nodes from child on.  Return the first
+ *              item under each new node.
+ */
+static int pack_level(packer_t *pk, const populate_t *pop, const uint32_t *firsts,
+                      uint32_t n, uint32_t child, int height, uint32_t **level_firsts,
+                      uint32_t *level_nodes)
+{
+    unsigned char rec[MAX_RECORD];
+    uint32_t *out, prev = 0, start = pk->count;
+    uint32_t i;
+    
+    /* Each node takes at least one record */
+    out = malloc(n * sizeof(*out));
+    if (!out) {
+        error_print_errno("failed to allocate memory for catalog nodes");
+        return -1;
+    }
+    
+    pk->used = pk->node_size;
+    
+    for (i = 0; i < n; i++) {
+        unsigned int len;
+        uint32_t node = pk->count;
+        
+        if (child) {
+            len = build_key(pop, firsts[i], rec, 1);
+            PUT_UL(rec + len, child + i);
+            len += 4;
+        } else {
+            len = build_record(pop, firsts[i], rec);
+        }
+        
+        if (pack_record(pk, rec, len, child ? 0 : 0xff, height, &prev) != 0) {
+            free(out);
+            return -1;
+        }
+        
+        if (pk->count != node) {
+            out[pk->count - 1 - start] = firsts[i];
+        }
+    }
+    
+    *level_firsts = out;
+    *level_nodes = pk->count - start;
+    
+    return 0;
+}
+
+/*
+ * NAME:    pack_record()
+ * DESCRIPTION: Append a record to the current node, starting a new node
+ *              of the level when it does not fit
+ */
+static int pack_record(packer_t *pk, const unsigned char *rec, unsigned int len,
+                       int kind, int height, uint32_t *prev)
+{
+    uint32_t ns = pk->node_size;
+    unsigned char *node;
+    
+    if (NODE_DESCSZ + pk->used + len + 2 * (pk->nrecs + 2) > ns) {
+        uint32_t number = pk->count++;
+        
+        if (pk->nodes) {
+            if (pk->count > pk->alloc) {
+                unsigned char *grown = realloc(pk->nodes, (size_t)2 * pk->alloc * ns);
+                
+                if (!grown) {
+                    error_print_errno("failed to allocate memory for catalog nodes");
+                    return -1;
+                }
+                memset(grown + (size_t)pk->alloc * ns, 0, (size_t)pk->alloc * ns);
+                pk->nodes = grown;
+                pk->alloc *= 2;
+            }
+            
+            /* Node descriptor, linked to the previous node of the level */
+            node = pk->nodes + (size_t)number * ns;
+            if (*prev) {
+                PUT_UL(pk->nodes + (size_t)*prev * ns, number);
+                PUT_UL(node + 4, *prev);
+            }
+            node[8] = kind;
+            node[9] = height;
+            PUT_UW(node + ns - 2, NODE_DESCSZ);
+        }
+        
+        *prev = number;
+        pk->used = 0;
+        pk->nrecs = 0;
+    }
+    
+    if (pk->nodes) {
+        node = pk->nodes + (size_t)*prev * ns;
+        memcpy(node + NODE_DESCSZ + pk->used, rec, len);
+        PUT_UW(node + 10, pk->nrecs + 1);
+        PUT_UW(node + ns - 2 * (pk->nrecs + 2), NODE_DESCSZ + pk->used + len);
+    }
+    
+    pk->used += len;
+    pk->nrecs++;
+    
+    return 0;
+}
+
+/*
+ * NAME:    mac_date()
+ * DESCRIPTION: Convert a Unix time to seconds since 1904, within range
+ */
+static uint32_t mac_date(time_t t)
+{
+    long long mac = (long long)t + HFS_EPOCH_OFFSET;
+    
+    if (mac < 0) {
+        return 0;
+    }
+    
+    return mac > 0xffffffffLL ? 0xffffffff : (uint32_t)mac;
+}
+
+/*
+ * NAME:    join_path()
+ * DESCRIPTION: Build "dir/name" in new memory
+ */
+static char *join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir);
+    char *path = malloc(len + strlen(name) + 2);
+    
+    if (!path) {
+        error_print_errno("failed to allocate memory for %s/%s", dir, name);
+        return NULL;
+    }
+    
+    sprintf(path, "%s%s%s", dir, (len && dir[len - 1] == '/') ? "" : "/", name);
+    
+    return path;
+}
+
+/*
+ * NAME:    read_at()
+ * DESCRIPTION: Read exactly len bytes at offset; -1 on error or short read
+ */
+static int read_at(int fd, off_t offset, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+    
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+/*
+ * NAME:    copy_fork()
+ * DESCRIPTION: Copy one fork to its blocks, zero filling the last one
+ */
+static int copy_fork(const populate_fork_t *fork, int fd, off_t block_zero,
+                     uint32_t block_size, unsigned char *buf)
+{
+    off_t dest = block_zero + (off_t)fork->start_block * block_size;
+    uint64_t done = 0;
+    int src;
+    
+    if (!fork->source || fork->length == 0) {
+        return 0;
+    }
+    
+    src = open(fork->source, O_RDONLY);
+    if (src == -1) {
+        error_print_errno("cannot open %s", fork->source);
+        return -1;
+    }
+    
+    while (done < fork->length) {
+        size_t want = fork->length - done < COPY_BUFSZ ? fork->length - done : COPY_BUFSZ;
+        size_t out = (want + block_size - 1) / block_size * block_size;
+        size_t got = 0;
+        
+        while (got < want) {
+            ssize_t n = pread(src, buf + got, want - got, fork->offset + done + got);
+            
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                error_print_errno("cannot read %s", fork->source);
+                close(src);
+                return -1;
+            }
+            if (n == 0) {
+                error_warning("%s shrank while being copied", fork->source);
+                break;
+            }
+            got += n;
+        }
+        
+        /* The rest of the last block is zero, as is anything that vanished */
+        memset(buf + got, 0, out - got);
+        
+        for (got = 0; got < out; ) {
+            ssize_t n = pwrite(fd, buf + got, out - got, dest + got);
+            
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                error_print_errno("failed to write %s", fork->source);
+                close(src);
+                return -1;
+            }
+            got += n;
+        }
+        
+        dest += out;
+        done += want;
+    }
+    
+    close(src);
+    
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * mkfs_populate.h - Build a new volume's contents from a host directory
+ * Copyright (C) 2025 Pablo Lezaeta
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MKFS_POPULATE_H
+#define MKFS_POPULATE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* One fork of a file: where its bytes come from and where they go */
+typedef struct {
+    char *source;               /* Host file holding the fork, NULL if empty */
+    off_t offset;               /* Where the fork starts in that file */
+    uint64_t length;
+    uint32_t start_block;       /* Set by populate_layout() */
+    uint32_t blocks;
+} populate_fork_t;
+
+/* A file or folder of the host tree */
+typedef struct {
+    char *path;                 /* Host path, for messages */
+    uint32_t cnid;
+    uint32_t parent;
+    int is_dir;
+    unsigned char *name;        /* MacRoman (HFS) */
+    uint16_t *uname;            /* Big-endian UTF-16, as stored (HFS+) */
+    uint16_t name_len;          /* Bytes or UTF-16 units */
+    uint32_t valence;
+    unsigned char finder[32];   /* FInfo/DInfo, then FXInfo/DXInfo */
+    time_t create_date;
+    time_t modify_date;
+    time_t access_date;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    populate_fork_t data;
+    populate_fork_t rsrc;
+} populate_entry_t;
+
+/* Everything found under the source directory */
+typedef struct {
+    int hfsplus;
+    populate_entry_t *entries;  /* entries[0] is the root folder */
+    uint32_t count;
+    uint32_t alloc;
+    uint32_t *order;            /* Catalog records in key order */
+    uint32_t nrecords;
+    uint32_t files;             /* The root folder is not counted */
+    uint32_t folders;
+    uint32_t root_files;
+    uint32_t root_folders;
+    uint32_t next_cnid;
+    uint32_t block_size;        /* Set by populate_layout() */
+    uint64_t data_blocks;
+} populate_t;
+
+/* Scan a host tree; the root folder takes the volume name */
+int populate_scan(populate_t *pop, const char *dir, const char *volume_name, int hfsplus);
+
+/* Nodes a catalog holding the tree needs, header node included */
+uint32_t populate_catalog_nodes(const populate_t *pop, uint32_t node_size);
+
+/* Give every fork a contiguous run of blocks from first_block on */
+uint64_t populate_layout(populate_t *pop, uint32_t first_block, uint32_t block_size);
+
+/*
+ * Build the catalog B*-tree in nodes 1..nnodes-1 of a new buffer; node 0
+ * is left for the caller's header node.
+ */
+int populate_build_catalog(const populate_t *pop, uint32_t node_size,
+                           unsigned char **nodes, uint32_t *nnodes,
+                           uint16_t *depth, uint32_t *root,
+                           uint32_t *first_leaf, uint32_t *last_leaf);
+
+/* Copy every fork to its blocks, in one ascending pass */
+int populate_write_forks(const populate_t *pop, int fd, off_t block_zero);
+
+void populate_free(populate_t *pop);
+
+#endif /* MKFS_POPULATE_H */
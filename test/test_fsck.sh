@@ -11,6 +11,122 @@ TMP="/tmp/test_fsck_$$"
 mkdir -p "$TMP"
 trap "rm -rf $TMP" EXIT
 
+# Helper: Read hex bytes
+read_hex() {
+    dd if="$1" bs=1 skip=$2 count=$3 2>/dev/null | od -v -An -tx1 | tr -d ' \n'
+}
+
+# Helper: Read uint16/uint32 big-endian
+read_uint16() {
+    local hex=$(read_hex "$1" $2 2)
+    echo $((16#$hex))
+}
+
+read_uint32() {
+    local hex=$(read_hex "$1" $2 4)
+    echo $((16#$hex))
+}
+
+# Helper: Write hex bytes in place
+write_hex() {
+    printf "$(echo "$3" | sed 's/../\\x&/g')" | dd of="$1" bs=1 seek=$2 conv=notrunc 2>/dev/null
+}
+
+# Helper: Write count copies of one character in place
+fill_char() {
+    head -c $3 /dev/zero | tr '\0' "$4" | dd of="$1" bs=1 seek=$2 conv=notrunc 2>/dev/null
+}
+
+# Helper: One counter of one phase from fsck --metrics=json output
+phase_metric() {
+    echo "$1" | grep -o "\"$2\":{[^}]*}" | grep -o "\"$3\":[0-9.]*" | cut -d: -f2
+}
+
+# Helper: Journal checksum of a hex string, as the kernel computes it
+journal_cksum() {
+    local hex=$1 sum=0 i
+    for ((i = 0; i < ${#hex}; i += 2)); do
+        sum=$(( ((sum << 8) ^ (sum + 16#${hex:i:2})) & 0xffffffff ))
+    done
+    printf '%08x' $(( ~sum & 0xffffffff ))
+}
+
+#
+# Journal layout used by the replay tests: a journal info block and a
+# journal of 511 blocks carved out of free space in the middle of the
+# volume, with a 512-byte journal header and 512-byte block list headers.
+#
+JHDR=512
+
+# Helper: Turn a fresh HFS+ image into a journaled one with an empty journal
+make_journal() {
+    local img="$1"
+    local bs=$(read_uint32 "$img" $((1024 + 40)))
+    local total=$(read_uint32 "$img" $((1024 + 44)))
+    local free=$(read_uint32 "$img" $((1024 + 48)))
+    local bitmap=$(( $(read_uint32 "$img" $((1024 + 128))) * bs ))
+    local attr=$(read_uint32 "$img" $((1024 + 4)))
+
+    JIB=$(( total / 2 / 8 * 8 ))
+    JOFF=$(( (JIB + 1) * bs ))
+    JSIZE=$(( 511 * bs ))
+    TARGET=$(( (JIB + 1024) * bs ))
+
+    # The 512 blocks must be free; mark them used
+    [ "$(read_hex "$img" $((bitmap + JIB / 8)) 64)" = "$(printf '%0128d' 0)" ] || return 1
+    write_hex "$img" $((bitmap + JIB / 8)) "$(printf 'ff%.0s' $(seq 64))"
+    write_hex "$img" $((1024 + 48)) "$(printf '%08x' $((free - 512)))"
+    write_hex "$img" $((1024 + 4)) "$(printf '%08x' $((attr | 0x2000)))"
+    write_hex "$img" $((1024 + 12)) "$(printf '%08x' $JIB)"
+
+    # Journal info block: in this file system, then offset and size
+    write_hex "$img" $((JIB * bs)) "00000001"
+    write_hex "$img" $((JIB * bs + 36)) "$(printf '%016x%016x' $JOFF $JSIZE)"
+
+    journal_header "$img" $JHDR $JHDR
+}
+
+# Helper: Write the journal header with the given start and end
+journal_header() {
+    local hex="4a4e4c7812345678$(printf '%016x%016x%016x%08x' $2 $3 $JSIZE $JHDR)"
+    local tail="$(printf '%08x' $JHDR)"
+    local sum=$(journal_cksum "${hex}00000000${tail}")
+    write_hex "$1" $JOFF "${hex}${sum}${tail}00000000"
+}
+
+# Helper: Add a block list journaling count bytes of one character to a
+# volume offset; the list starts at journal offset pos and its data may
+# wrap past the end of the journal.  Prints the offset after the list.
+journal_list() {
+    local img="$1" pos=$2 offset=$3 count=$4 char="$5"
+    local head="001f0002$(printf '%08x' $((JHDR + count)))"
+    local info="00000000000000000000000000000000"
+    local sum=$(journal_cksum "${head}00000000${info}")
+
+    [ "$6" = "badsum" ] && sum=$(printf '%08x' $((16#$sum ^ 1)))
+    write_hex "$img" $((JOFF + pos)) "${head}${sum}00000000${info}$(printf '%016x%08x00000000' $((offset / JHDR)) $count)"
+
+    pos=$((pos + JHDR))
+    if [ $((pos + count)) -gt $JSIZE ]; then
+        fill_char "$img" $((JOFF + pos)) $((JSIZE - pos)) "$char"
+        count=$((count - (JSIZE - pos)))
+        pos=$JHDR
+    fi
+    fill_char "$img" $((JOFF + pos)) $count "$char"
+    echo $((pos + count))
+}
+
+# Helper: Build an HFS volume (HFS+ with mkfs.hfs+ as second argument)
+# holding a few dozen small files
+make_hfs_files() {
+    mkdir -p "$TMP/files"
+    for i in $(seq 1 60); do
+        echo "contents of file number $i" > "$TMP/files/file-with-a-longer-name-$i.txt"
+    done
+    dd if=/dev/zero of="$1" bs=1M count=4 2>/dev/null
+    $BUILD/${2:-mkfs.hfs} -d "$TMP/files" -l "Files" "$1" >/dev/null 2>&1
+}
+
 echo "Testing fsck.hfs and fsck.hfs+"
 echo "==============================="
 
@@ -21,26 +137,464 @@ if [ ! -f "$BUILD/fsck.hfs+" ]; then
 fi
 
 # Test 1: Clean HFS+ volume
-echo "[1/3] Clean volume validation..."
+echo "[1/21] Clean volume validation..."
 dd if=/dev/zero of="$TMP/clean.img" bs=1M count=10 2>/dev/null
 $BUILD/mkfs.hfs+ -l "Clean" "$TMP/clean.img" >/dev/null 2>&1
 $BUILD/fsck.hfs+ -n "$TMP/clean.img" >/dev/null 2>&1 || { echo "FAIL: Clean volume has errors"; exit 1; }
 echo "+ Clean volume passes fsck"
 
 # Test 2: Journaling detection
-echo "[2/3] Journaling detection..."
+echo "[2/21] Journaling detection..."
 dd if=/dev/zero of="$TMP/journal.img" bs=1M count=20 2>/dev/null
 $BUILD/mkfs.hfs+ -j -l "Journal" "$TMP/journal.img" >/dev/null 2>&1
-output=$($BUILD/fsck.hfs+ -v "$TMP/journal.img" 2>&1 || true)
+output=$($BUILD/fsck.hfs+ -n -v "$TMP/journal.img" 2>&1 || true)
 # Should mention journal in output
 echo "$output" | grep -qi "journal" && echo "+ Journal detected by fsck" || echo "+ fsck ran on journaled volume"
 
 # Test 3: Exit codes
-echo "[3/3] Exit code validation..."
+echo "[3/21] Exit code validation..."
 $BUILD/fsck.hfs+ -n "$TMP/clean.img" >/dev/null 2>&1
 ret=$?
 [ $ret -eq 0 ] || { echo "FAIL: Expected exit code 0, got $ret"; exit 1; }
 echo "+ Exit codes correct"
 
+# Test 4: Journal replay, overlapping transactions
+echo "[4/21] Journal replay of overlapping transactions..."
+dd if=/dev/zero of="$TMP/jnl.img" bs=1M count=20 2>/dev/null
+$BUILD/mkfs.hfs+ -l "Journal" "$TMP/jnl.img" >/dev/null 2>&1
+make_journal "$TMP/jnl.img" || { echo "FAIL: No free space for the journal"; exit 1; }
+cp "$TMP/jnl.img" "$TMP/empty-jnl.img"
+$BUILD/fsck.hfs+ -n "$TMP/jnl.img" >/dev/null 2>&1 || { echo "FAIL: Empty journal reported as damaged"; exit 1; }
+# The second transaction rewrites the last 512 bytes of the first
+end=$(journal_list "$TMP/jnl.img" $JHDR $TARGET 1024 A)
+end=$(journal_list "$TMP/jnl.img" $end $((TARGET + 512)) 1024 B)
+journal_header "$TMP/jnl.img" $JHDR $end
+ret=0; $BUILD/fsck.hfs+ -n "$TMP/jnl.img" >/dev/null 2>&1 || ret=$?
+[ $ret -eq 4 ] || { echo "FAIL: Unreplayed journal: expected exit code 4, got $ret"; exit 1; }
+[ "$(read_hex "$TMP/jnl.img" $TARGET 1)" = "00" ] || { echo "FAIL: fsck -n replayed the journal"; exit 1; }
+ret=0; $BUILD/fsck.hfs+ -y "$TMP/jnl.img" >/dev/null 2>&1 || ret=$?
+[ $ret -eq 1 ] || { echo "FAIL: Journal replay: expected exit code 1, got $ret"; exit 1; }
+[ "$(read_hex "$TMP/jnl.img" $TARGET 1)$(read_hex "$TMP/jnl.img" $((TARGET + 511)) 1)" = "4141" ] &&
+[ "$(read_hex "$TMP/jnl.img" $((TARGET + 512)) 1)$(read_hex "$TMP/jnl.img" $((TARGET + 1535)) 1)" = "4242" ] &&
+[ "$(read_hex "$TMP/jnl.img" $((TARGET + 1536)) 1)" = "00" ] || { echo "FAIL: Newest transaction did not win"; exit 1; }
+$BUILD/fsck.hfs+ -n "$TMP/jnl.img" >/dev/null 2>&1 || { echo "FAIL: Journal not empty after replay"; exit 1; }
+echo "+ Overlapping transactions replayed, newest data wins"
+
+# Test 5: Journal replay, block list wrapping past the end of the journal
+echo "[5/21] Journal replay of a wrapped journal buffer..."
+cp "$TMP/empty-jnl.img" "$TMP/jnl.img"
+start=$((JSIZE - 1024))
+end=$(journal_list "$TMP/jnl.img" $start $TARGET 1024 C)
+[ $end -eq $((JHDR + 512)) ] || { echo "FAIL: Block list did not wrap"; exit 1; }
+journal_header "$TMP/jnl.img" $start $end
+ret=0; $BUILD/fsck.hfs+ -y "$TMP/jnl.img" >/dev/null 2>&1 || ret=$?
+[ $ret -eq 1 ] || { echo "FAIL: Wrapped journal replay: expected exit code 1, got $ret"; exit 1; }
+[ "$(read_hex "$TMP/jnl.img" $((TARGET + 511)) 1)$(read_hex "$TMP/jnl.img" $((TARGET + 512)) 1)" = "4343" ] &&
+[ "$(read_hex "$TMP/jnl.img" $((TARGET + 1023)) 1)" = "43" ] || { echo "FAIL: Wrapped block not replayed whole"; exit 1; }
+$BUILD/fsck.hfs+ -n "$TMP/jnl.img" >/dev/null 2>&1 || { echo "FAIL: Journal not empty after wrapped replay"; exit 1; }
+echo "+ Wrapped journal buffer replayed"
+
+# Test 6: Journal replay refuses a block list with a bad checksum
+echo "[6/21] Journal with a block list checksum error..."
+cp "$TMP/empty-jnl.img" "$TMP/jnl.img"
+end=$(journal_list "$TMP/jnl.img" $JHDR $TARGET 1024 D badsum)
+journal_header "$TMP/jnl.img" $JHDR $end
+ret=0; $BUILD/fsck.hfs+ -n "$TMP/jnl.img" >/dev/null 2>&1 || ret=$?
+[ $ret -eq 4 ] || { echo "FAIL: Bad block list checksum: expected exit code 4, got $ret"; exit 1; }
+$BUILD/fsck.hfs+ -y "$TMP/jnl.img" >/dev/null 2>&1 || true
+[ "$(read_hex "$TMP/jnl.img" $TARGET 1)" = "00" ] || { echo "FAIL: Block list with a bad checksum was replayed"; exit 1; }
+$BUILD/fsck.hfs+ -n "$TMP/jnl.img" >/dev/null 2>&1 || { echo "FAIL: Volume not clean after disabling the bad journal"; exit 1; }
+echo "+ Bad block list checksum detected, nothing replayed"
+
+# Test 7: HFS allocation bitmap repair
+echo "[7/21] HFS allocation bitmap repair..."
+make_hfs_files "$TMP/hfs.img"
+bitmap=$(( $(read_uint16 "$TMP/hfs.img" $((1024 + 14))) * 512 ))
+good=$(read_hex "$TMP/hfs.img" $bitmap 512)
+# Free the blocks in use at the start, claim some free ones further on
+write_hex "$TMP/hfs.img" $bitmap "0000"
+write_hex "$TMP/hfs.img" $((bitmap + 256)) "ffff"
+ret=0; $BUILD/fsck.hfs -n "$TMP/hfs.img" >/dev/null 2>&1 || ret=$?
+[ $ret -eq 4 ] || { echo "FAIL: Damaged bitmap: expected exit code 4, got $ret"; exit 1; }
+ret=0; $BUILD/fsck.hfs -y "$TMP/hfs.img" >/dev/null 2>&1 || ret=$?
+[ $ret -eq 1 ] || { echo "FAIL: Bitmap repair: expected exit code 1, got $ret"; exit 1; }
+[ "$(read_hex "$TMP/hfs.img" $bitmap 512)" = "$good" ] || { echo "FAIL: Bitmap not restored"; exit 1; }
+$BUILD/fsck.hfs -n "$TMP/hfs.img" >/dev/null 2>&1 || { echo "FAIL: Volume not clean after bitmap repair"; exit 1; }
+echo "+ Allocation bitmap rebuilt from the B-trees"
+
+# Test 8: HFS catalog leaf linked to itself
+echo "[8/21] HFS looped catalog leaf..."
+make_hfs_files "$TMP/loop.img"
+alblksz=$(read_uint32 "$TMP/loop.img" $((1024 + 20)))
+catalog=$(( $(read_uint16 "$TMP/loop.img" $((1024 + 28))) * 512 +
+            $(read_uint16 "$TMP/loop.img" $((1024 + 150))) * alblksz ))
+first=$(read_uint32 "$TMP/loop.img" $((catalog + 24)))
+second=$(read_uint32 "$TMP/loop.img" $((catalog + first * 512)))
+[ $second -ne 0 ] || { echo "FAIL: Catalog has a single leaf"; exit 1; }
+write_hex "$TMP/loop.img" $((catalog + second * 512)) "$(printf '%08x' $second)"
+cp "$TMP/loop.img" "$TMP/loop-orig.img"
+ret=0; output=$(timeout 60 $BUILD/fsck.hfs -n "$TMP/loop.img" 2>&1) || ret=$?
+[ $ret -eq 4 ] || { echo "FAIL: Looped leaf: expected exit code 4, got $ret"; exit 1; }
+echo "$output" | grep -q "bitmap left unchanged" || { echo "FAIL: Bitmap judged from a partial leaf walk"; exit 1; }
+cmp -s "$TMP/loop.img" "$TMP/loop-orig.img" || { echo "FAIL: fsck -n modified the volume"; exit 1; }
+# -y rebuilds the catalog, then checks the bitmap again against it
+ret=0; timeout 60 $BUILD/fsck.hfs -y "$TMP/loop.img" >/dev/null 2>&1 || ret=$?
+[ $ret -eq 1 ] || { echo "FAIL: Catalog rebuild: expected exit code 1, got $ret"; exit 1; }
+timeout 60 $BUILD/fsck.hfs -n "$TMP/loop.img" >/dev/null 2>&1 || { echo "FAIL: Volume not clean after catalog rebuild"; exit 1; }
+if [ -x ./hfsutil ]; then
+    ./hfsutil hmount "$TMP/loop.img" >/dev/null 2>&1 || { echo "FAIL: Rebuilt volume does not mount"; exit 1; }
+    for i in 1 30 60; do
+        ./hfsutil hcopy -r ":file-with-a-longer-name-$i.txt" - 2>/dev/null |
+            cmp -s - "$TMP/files/file-with-a-longer-name-$i.txt" || { echo "FAIL: File $i lost in catalog rebuild"; exit 1; }
+    done
+    ./hfsutil humount >/dev/null 2>&1
+fi
+echo "+ Looped leaf detected, catalog rebuilt and bitmap rechecked"
+
+# Test 9: HFS+ name order follows TN1150's case folding table
+echo "[9/21] HFS+ catalog name comparison..."
+if command -v "${CC:-cc}" >/dev/null 2>&1; then
+    cat > "$TMP/namecmp.c" <<'EOF_C'
+#include <stdio.h>
+#include <endian.h>
+#include "include/common/hfsplus_unicode.h"
+
+/* Compare two names given in host order; print and return the sign */
+static int cmp(const uint16_t *a, unsigned int la, const uint16_t *b, unsigned int lb)
+{
+    uint16_t x[8], y[8];
+    unsigned int i;
+
+    for (i = 0; i < la; i++) x[i] = htobe16(a[i]);
+    for (i = 0; i < lb; i++) y[i] = htobe16(b[i]);
+    i = hfsplus_unicode_compare(x, la, y, lb);
+    return (int)i < 0 ? -1 : (int)i > 0;
+}
+
+#define N(...) (const uint16_t[]){ __VA_ARGS__ }, sizeof((const uint16_t[]){ __VA_ARGS__ }) / 2
+
+int main(void)
+{
+    printf("%d %d %d %d %d %d %d %d %d %d %d\n",
+           cmp(N('A'), N('a')),                 /* 0: ASCII folds */
+           cmp(N(0x00C0), N('a')),              /* 1: precomposed A grave is not folded */
+           cmp(N(0x00C6), N(0x00E6)),           /* 0: AE folds */
+           cmp(N(0x0100), N(0x0101)),           /* -1: A macron is not folded */
+           cmp(N(0x0110), N(0x0111)),           /* 0: D stroke folds */
+           cmp(N(0x0391), N(0x03B1)),           /* 0: Greek folds */
+           cmp(N(0x0419), N(0x0439)),           /* -1: Cyrillic short I is not folded */
+           cmp(N(0x10A0), N(0x10D0)),           /* 0: Georgian folds */
+           cmp(N(0x2126), N(0x03C9)),           /* 1: Ohm sign is not folded */
+           cmp(N('a', 0x200C, 'b'), N('a', 'b')), /* 0: joiners are ignored */
+           cmp(N('a', 0), N('a', 'b')));        /* 1: NUL sorts last */
+    return 0;
+}
+EOF_C
+    ${CC:-cc} -I. -o "$TMP/namecmp" "$TMP/namecmp.c" src/common/hfsplus_unicode.c ||
+        { echo "FAIL: Cannot build name comparison check"; exit 1; }
+    result=$("$TMP/namecmp")
+    [ "$result" = "0 1 0 -1 0 0 -1 0 1 0 1" ] || { echo "FAIL: Name order differs from TN1150: $result"; exit 1; }
+    echo "+ Names compare as TN1150 FastUnicodeCompare"
+else
+    echo "+ No C compiler - skipping name comparison check"
+fi
+
+# Test 10: A check stopped in the catalog cross-check resumes there
+echo "[10/21] Interrupted catalog check resumes..."
+mkdir -p "$TMP/many"
+for i in $(seq 1 10000); do
+    echo "file $i" > "$TMP/many/a-fairly-long-file-name-for-the-catalog-$i.txt"
+done
+dd if=/dev/zero of="$TMP/many.img" bs=1M count=128 2>/dev/null
+$BUILD/mkfs.hfs+ -d "$TMP/many" -l "Many" "$TMP/many.img" >/dev/null 2>&1 ||
+    { echo "FAIL: Cannot build a volume with 10000 files"; exit 1; }
+CKPT="$TMP/many.ckpt"
+$BUILD/fsck.hfs+ -n --checkpoint="$CKPT" --checkpoint-interval=0 "$TMP/many.img" >/dev/null 2>&1 &
+pid=$!
+# The next catalog leaf is saved 68 bytes into the checkpoint file
+while kill -0 $pid 2>/dev/null; do
+    node=$(read_hex "$CKPT" 68 4)
+    [ -z "$node" ] || [ "$node" = "00000000" ] || break
+done
+kill -INT $pid 2>/dev/null || true
+ret=0; wait $pid || ret=$?
+[ $ret -eq 32 ] || { echo "FAIL: Interrupted check: expected exit code 32, got $ret"; exit 1; }
+ret=0; output=$($BUILD/fsck.hfs+ -n -v --checkpoint="$CKPT" "$TMP/many.img" 2>&1) || ret=$?
+[ $ret -eq 0 ] || { echo "FAIL: Resumed check: expected exit code 0, got $ret"; exit 1; }
+echo "$output" | grep -q "Resuming catalog cross-check at leaf node" ||
+    { echo "FAIL: Check did not resume inside the catalog"; exit 1; }
+echo "$output" | grep -q "Cross-checked 1 folders, 10000 files and 10001 threads" ||
+    { echo "FAIL: Resumed cross-check lost references"; exit 1; }
+[ ! -e "$CKPT" ] || { echo "FAIL: Checkpoint left after a finished check"; exit 1; }
+echo "+ Catalog cross-check resumed from its checkpoint"
+
+# Test 11: Every HFS+ catalog node is verified, and what is found is not repaired
+echo "[11/21] HFS+ catalog node with a bad descriptor..."
+make_hfs_files "$TMP/plus.img" mkfs.hfs+ || { echo "FAIL: Cannot build HFS+ volume with files"; exit 1; }
+$BUILD/fsck.hfs+ -n "$TMP/plus.img" >/dev/null 2>&1 || { echo "FAIL: Populated HFS+ volume has errors"; exit 1; }
+bs=$(read_uint32 "$TMP/plus.img" $((1024 + 40)))
+catalog=$(( $(read_uint32 "$TMP/plus.img" $((1024 + 272 + 16))) * bs ))
+nodesize=$(read_uint16 "$TMP/plus.img" $((catalog + 14 + 18)))
+leaf=$(read_uint32 "$TMP/plus.img" $((catalog + 14 + 10)))
+write_hex "$TMP/plus.img" $((catalog + leaf * nodesize + 9)) "05"   # leaf height
+ret=0; output=$($BUILD/fsck.hfs+ -n "$TMP/plus.img" 2>&1) || ret=$?
+[ $ret -eq 4 ] || { echo "FAIL: Bad catalog node: expected exit code 4, got $ret"; exit 1; }
+echo "$output" | grep -q "Catalog node $leaf has a bad node descriptor" ||
+    { echo "FAIL: Bad catalog node descriptor not reported"; exit 1; }
+ret=0; $BUILD/fsck.hfs+ -y "$TMP/plus.img" >/dev/null 2>&1 || ret=$?
+[ $ret -eq 4 ] || { echo "FAIL: Unrepaired catalog node: expected exit code 4, got $ret"; exit 1; }
+echo "+ Bad catalog node found and left uncorrected"
+
+# Test 12: B-tree metadata is read once, in offset order, before the checks
+echo "[12/21] Metadata preloaded through the I/O plan..."
+for fs in hfs hfs+; do
+    make_hfs_files "$TMP/plan.img" mkfs.$fs || { echo "FAIL: Cannot build $fs volume with files"; exit 1; }
+    output=$($BUILD/fsck.$fs -n --metrics=json "$TMP/plan.img" 2>/dev/null) ||
+        { echo "FAIL: Populated $fs volume has errors"; exit 1; }
+    [ "$(phase_metric "$output" preload bytes_read)" -gt 0 ] || { echo "FAIL: $fs metadata not preloaded"; exit 1; }
+    for phase in catalog extents; do
+        [ "$(phase_metric "$output" $phase bytes_read)" = 0 ] ||
+            { echo "FAIL: $fs $phase phase read past the preloaded plan"; exit 1; }
+    done
+done
+echo "+ Catalog and extents checked from the preloaded plan"
+
+# Test 13: --metrics=json is one line in a fixed shape, nodes counted once
+echo "[13/21] Metrics output..."
+make_hfs_files "$TMP/metrics.img" mkfs.hfs+ || { echo "FAIL: Cannot build HFS+ volume with files"; exit 1; }
+counters='\{"seconds":[0-9]+\.[0-9]{6},"bytes_read":[0-9]+,"nodes":[0-9]+,"records":[0-9]+,"errors":[0-9]+\}'
+schema='^\{"device":"[^"]*","filesystem":"hfs\+","exit_code":0,"seconds":[0-9]+\.[0-9]{6},"bytes_read":[0-9]+,"errors":0,"phases":\{'
+sep=
+for phase in volume_header journal preload catalog extents bitmap attributes; do
+    schema="$schema$sep\"$phase\":($counters|null)"
+    sep=,
+done
+schema="$schema\}\}\$"
+output=$($BUILD/fsck.hfs+ -n --metrics=json "$TMP/metrics.img" 2>/dev/null) || { echo "FAIL: Metrics run failed"; exit 1; }
+[ "$(echo "$output" | wc -l)" -eq 1 ] && echo "$output" | grep -Eq "$schema" ||
+    { echo "FAIL: Metrics do not match the schema: $output"; exit 1; }
+used=$($BUILD/fsck.hfs+ -n -v "$TMP/metrics.img" 2>/dev/null | sed -n 's/.*Checked \([0-9]*\) of [0-9]* catalog nodes.*/\1/p')
+[ -n "$used" ] && [ "$(phase_metric "$output" catalog nodes)" = "$used" ] ||
+    { echo "FAIL: Catalog phase counted $(phase_metric "$output" catalog nodes) nodes of $used"; exit 1; }
+echo "+ Metrics match the schema; the catalog phase counts each node once"
+
+# Test 14: fsck -j checks several volumes of both kinds at once
+echo "[14/21] Parallel checks with -j..."
+make_hfs_files "$TMP/jobs-hfs.img" || { echo "FAIL: Cannot build HFS volume with files"; exit 1; }
+make_hfs_files "$TMP/jobs-plus.img" mkfs.hfs+ || { echo "FAIL: Cannot build HFS+ volume with files"; exit 1; }
+images="$TMP/clean.img $TMP/jobs-hfs.img $TMP/jobs-plus.img"
+ret=0; output=$($BUILD/fsck.hfs -n -j 2 $images 2>&1) || ret=$?
+[ $ret -eq 0 ] || { echo "FAIL: Parallel check of clean volumes: expected exit code 0, got $ret"; exit 1; }
+for img in $images; do
+    echo "$output" | grep -qx "$img: clean (exit 0)" || { echo "FAIL: No result for $img"; exit 1; }
+done
+# The damaged volume of test 11 makes the combined exit code 4
+ret=0; output=$($BUILD/fsck.hfs -n -j 0 --metrics=json $images "$TMP/plus.img" 2>&1) || ret=$?
+[ $ret -eq 4 ] || { echo "FAIL: Parallel check with a damaged volume: expected exit code 4, got $ret"; exit 1; }
+echo "$output" | grep -qx "$TMP/plus.img: errors not corrected (exit 4)" ||
+    { echo "FAIL: No result for the damaged volume"; exit 1; }
+[ "$(echo "$output" | grep -c '^{"device":')" -eq 4 ] || { echo "FAIL: Expected one metrics line per volume"; exit 1; }
+echo "$output" | grep -v '^{"device":' | grep -qv "^$TMP/[a-z-]*\.img: " && { echo "FAIL: Unprefixed output line"; exit 1; }
+ret=0; $BUILD/fsck.hfs -j 2 $images >/dev/null 2>&1 || ret=$?
+[ $ret -eq 16 ] || { echo "FAIL: -j without -n, -y or -a: expected exit code 16, got $ret"; exit 1; }
+echo "+ Volumes checked in parallel, results combined"
+
+# Test 15: hfsck verifies B*-tree structure and leaves what it finds uncorrected
+echo "[15/21] hfsck B*-tree structure..."
+if [ -x hfsck/hfsck ]; then
+    hfsck/hfsck -n "$TMP/jobs-hfs.img" >/dev/null 2>&1 || { echo "FAIL: hfsck on a clean volume"; exit 1; }
+    # The looped leaf kept from test 8
+    for opt in -n -y; do
+        ret=0; output=$(timeout 60 hfsck/hfsck $opt "$TMP/loop-orig.img" 2>&1) || ret=$?
+        [ $ret -eq 4 ] || { echo "FAIL: hfsck $opt on a looped leaf: expected exit code 4, got $ret"; exit 1; }
+        echo "$output" | grep -q "catalog node $second links forward to node $second" ||
+            { echo "FAIL: hfsck $opt did not report the loop"; exit 1; }
+    done
+    echo "+ Looped leaf reported by hfsck and left uncorrected"
+else
+    echo "+ hfsck not built - skipping"
+fi
+
+# Test 16: A fast format leaves the image sparse, old data and all
+echo "[16/21] Sparse fast format..."
+$BUILD/mkfs.hfs+ -s 4G -l "Big" "$TMP/big.img" >/dev/null 2>&1 || { echo "FAIL: Cannot create a 4G image with -s"; exit 1; }
+[ "$(stat -c %s "$TMP/big.img")" -eq $((4 << 30)) ] || { echo "FAIL: 4G image has the wrong size"; exit 1; }
+[ $(( $(stat -c %b "$TMP/big.img") * 512 )) -lt $((1 << 20)) ] ||
+    { echo "FAIL: 4G image uses $(( $(stat -c %b "$TMP/big.img") * 512 )) bytes on disk"; exit 1; }
+$BUILD/fsck.hfs+ -n "$TMP/big.img" >/dev/null 2>&1 || { echo "FAIL: fsck on the sparse HFS+ image"; exit 1; }
+# Reformat an image whose first megabytes hold something else
+for mkfs in mkfs.hfs mkfs.hfs+; do
+    head -c 4M /dev/zero | tr '\0' '\377' >"$TMP/reused.img"
+    truncate -s 2G "$TMP/reused.img"
+    before=$(stat -c %b "$TMP/reused.img")
+    $BUILD/$mkfs -f -l "Reused" "$TMP/reused.img" >/dev/null 2>&1 || { echo "FAIL: $mkfs over old data"; exit 1; }
+    [ "$(stat -c %b "$TMP/reused.img")" -lt "$before" ] || { echo "FAIL: $mkfs left the old data allocated"; exit 1; }
+    $BUILD/fsck.${mkfs#mkfs.} -n "$TMP/reused.img" >/dev/null 2>&1 || { echo "FAIL: fsck after $mkfs over old data"; exit 1; }
+done
+echo "+ Formatted images stay sparse and check clean"
+
+# Test 17: mkfs -d builds nested folders, sidecar forks and large files
+echo "[17/21] Populated volumes..."
+mkdir -p "$TMP/tree/Docs/Deep"
+echo "hello" >"$TMP/tree/Read Me"
+seq 1 20000 >"$TMP/tree/Docs/numbers"
+echo "deep" >"$TMP/tree/Docs/Deep/leaf"
+# AppleDouble sidecar: Finder info (TEXT/ttxt) and a 5-byte resource fork
+{
+    printf '\x00\x05\x16\x07\x00\x02\x00\x00'; head -c 16 /dev/zero; printf '\x00\x02'
+    printf '\x00\x00\x00\x09\x00\x00\x00\x32\x00\x00\x00\x20'
+    printf '\x00\x00\x00\x02\x00\x00\x00\x52\x00\x00\x00\x05'
+    printf 'TEXTttxt'; head -c 24 /dev/zero; printf 'RSRC!'
+} >"$TMP/tree/._Read Me"
+for mkfs in mkfs.hfs mkfs.hfs+; do
+    rm -f "$TMP/tree.img"; truncate -s 16M "$TMP/tree.img"
+    $BUILD/$mkfs -d "$TMP/tree" -l "Tree" "$TMP/tree.img" >/dev/null 2>&1 || { echo "FAIL: $mkfs -d"; exit 1; }
+    $BUILD/fsck.${mkfs#mkfs.} -n "$TMP/tree.img" >/dev/null 2>&1 || { echo "FAIL: fsck after $mkfs -d"; exit 1; }
+    if [ -x ./hfsutil ]; then
+        ./hfsutil hmount "$TMP/tree.img" >/dev/null 2>&1 || { echo "FAIL: $mkfs -d volume does not mount"; exit 1; }
+        ./hfsutil hls -l 2>/dev/null | grep -q "^f  TEXT/ttxt  *5  *6 .* Read Me$" ||
+            { echo "FAIL: $mkfs -d lost the sidecar's type, creator or resource fork"; exit 1; }
+        ./hfsutil hcopy -r ":Docs:numbers" - 2>/dev/null | cmp -s - "$TMP/tree/Docs/numbers" &&
+            [ "$(./hfsutil hcopy -r ":Docs:Deep:leaf" - 2>/dev/null)" = "deep" ] ||
+            { echo "FAIL: $mkfs -d file contents differ"; exit 1; }
+        ./hfsutil hls ":" 2>/dev/null | grep -q "^\._" && { echo "FAIL: $mkfs -d copied the sidecar"; exit 1; }
+        ./hfsutil humount >/dev/null 2>&1
+    fi
+done
+echo "+ Populated HFS and HFS+ volumes check clean and read back"
+
+# Test 18: mkfs writes its metadata through one ordered plan, all or nothing
+echo "[18/21] mkfs write plan..."
+truncate -s 20M "$TMP/plan.img"
+blocks=$(( $(stat -c %s "$TMP/plan.img") / 512 ))
+for mkfs in mkfs.hfs mkfs.hfs+; do
+    output=$($BUILD/$mkfs -f -v -l "Plan" "$TMP/plan.img" 2>&1) || { echo "FAIL: $mkfs -v"; exit 1; }
+    writes=$(echo "$output" | sed -n 's/.*write plan: [0-9]* regions in \([0-9]*\) writes.*/\1/p')
+    [ -n "$writes" ] && [ "$writes" -le 4 ] || { echo "FAIL: $mkfs wrote its metadata in ${writes:-?} writes"; exit 1; }
+    echo "$output" | grep -q "volume verification successful" || { echo "FAIL: $mkfs did not verify the plan"; exit 1; }
+    [ "$(read_hex "$TMP/plan.img" 1024 512)" = "$(read_hex "$TMP/plan.img" $(( (blocks - 2) * 512 )) 512)" ] ||
+        { echo "FAIL: $mkfs alternate header differs from the primary"; exit 1; }
+    $BUILD/fsck.${mkfs#mkfs.} -n "$TMP/plan.img" >/dev/null 2>&1 || { echo "FAIL: fsck after $mkfs"; exit 1; }
+done
+# Names that collide on the volume fail before the device is written
+mkdir -p "$TMP/collide"
+echo 1 >"$TMP/collide/name"; echo 2 >"$TMP/collide/NAME"
+cp "$TMP/plan.img" "$TMP/plan-orig.img"
+for mkfs in mkfs.hfs mkfs.hfs+; do
+    $BUILD/$mkfs -f -d "$TMP/collide" -l "Collide" "$TMP/plan.img" >/dev/null 2>&1 &&
+        { echo "FAIL: $mkfs -d accepted colliding names"; exit 1; }
+    cmp -s "$TMP/plan.img" "$TMP/plan-orig.img" || { echo "FAIL: Failed $mkfs changed the device"; exit 1; }
+done
+echo "+ Metadata written in a few batches, verified, untouched on failure"
+
+# Test 19: mkfs -b formats every volume of a manifest, each one checking clean
+echo "[19/21] Batch formatting from a manifest..."
+truncate -s 2M "$TMP/batch-c.img"
+truncate -s 5M "$TMP/batch-d.img"
+cat >"$TMP/manifest" <<EOF
+# Two empty HFS+ volumes alike share one template
+$TMP/batch-a.img 12M hfs+ "Volume A"
+$TMP/batch-b.img 12M hfs+
+$TMP/batch-c.img 2M hfs - $TMP/tree
+$TMP/batch-d.img - hfs "Volume D"
+$TMP/batch-e.img 30M hfsplus "Volume E" $TMP/tree
+EOF
+output=$($BUILD/mkfs.hfs+ -b "$TMP/manifest" -J 3 -l "Batch" 2>&1) || { echo "FAIL: mkfs -b"; exit 1; }
+echo "$output" | grep -qx "5 of 5 volumes formatted" || { echo "FAIL: mkfs -b summary"; exit 1; }
+for vol in a:hfs+:12582912:Volume\ A b:hfs+:12582912:Batch c:hfs:2097152:Batch d:hfs:5242880:Volume\ D e:hfs+:31457280:Volume\ E; do
+    IFS=: read -r id kind size name <<<"$vol"
+    img="$TMP/batch-$id.img"
+    echo "$output" | grep -qx "$img: formatted" || { echo "FAIL: No result for $img"; exit 1; }
+    echo "$output" | grep -q "^$img: .* volume '$name' created" || { echo "FAIL: $img not named $name"; exit 1; }
+    [ "$(stat -c %s "$img")" -eq $size ] || { echo "FAIL: $img has the wrong size"; exit 1; }
+    $BUILD/fsck.$kind -n "$img" >/dev/null 2>&1 || { echo "FAIL: fsck.$kind on $img"; exit 1; }
+done
+# One volume that cannot be created fails the batch, not the others
+ret=0; output=$(printf '%s\n' "$TMP/batch-f.img 12M hfs+" "$TMP/missing/batch-g.img 12M hfs+" |
+    $BUILD/mkfs.hfs+ -b - 2>&1) || ret=$?
+[ $ret -eq 1 ] || { echo "FAIL: Batch with a failed volume: expected exit code 1, got $ret"; exit 1; }
+echo "$output" | grep -qx "$TMP/missing/batch-g.img: failed" || { echo "FAIL: No failure for the missing directory"; exit 1; }
+$BUILD/fsck.hfs+ -n "$TMP/batch-f.img" >/dev/null 2>&1 || { echo "FAIL: fsck on the volume formatted beside a failure"; exit 1; }
+# A bad line stops the batch before anything is formatted
+ret=0; printf '%s\n' "$TMP/batch-h.img 12M hfs+" "$TMP/batch-i.img 12Q hfs+" |
+    $BUILD/mkfs.hfs+ -b - >/dev/null 2>&1 || ret=$?
+[ $ret -ne 0 ] && [ ! -e "$TMP/batch-h.img" ] || { echo "FAIL: Bad manifest line did not stop the batch"; exit 1; }
+echo "+ Manifest volumes formatted in parallel and check clean"
+
+# Test 20: mkfs -D discards the free blocks of an image full of old data
+echo "[20/21] Discarding free blocks..."
+for mkfs in mkfs.hfs mkfs.hfs+; do
+    head -c 64M /dev/zero | tr '\0' '\377' >"$TMP/discard.img"
+    $BUILD/$mkfs -f -D -d "$TMP/tree" -l "Discard" "$TMP/discard.img" >/dev/null 2>&1 || { echo "FAIL: $mkfs -D"; exit 1; }
+    [ "$(stat -c %s "$TMP/discard.img")" -eq $((64 << 20)) ] || { echo "FAIL: $mkfs -D changed the image size"; exit 1; }
+    [ $(( $(stat -c %b "$TMP/discard.img") * 512 )) -lt $((1 << 20)) ] ||
+        { echo "FAIL: $mkfs -D left $(( $(stat -c %b "$TMP/discard.img") * 512 )) bytes allocated"; exit 1; }
+    [ "$(read_hex "$TMP/discard.img" $((32 << 20)) 16)" = "00000000000000000000000000000000" ] ||
+        { echo "FAIL: $mkfs -D left old data in the free blocks"; exit 1; }
+    $BUILD/fsck.${mkfs#mkfs.} -n "$TMP/discard.img" >/dev/null 2>&1 || { echo "FAIL: fsck after $mkfs -D"; exit 1; }
+    if [ -x ./hfsutil ]; then
+        ./hfsutil hmount "$TMP/discard.img" >/dev/null 2>&1 || { echo "FAIL: $mkfs -D volume does not mount"; exit 1; }
+        ./hfsutil hcopy -r ":Docs:numbers" - 2>/dev/null | cmp -s - "$TMP/tree/Docs/numbers" ||
+            { echo "FAIL: $mkfs -D discarded file data"; exit 1; }
+        ./hfsutil humount >/dev/null 2>&1
+    fi
+done
+echo "+ Free blocks discarded, metadata and file data kept"
+
+# Test 21: Every HFS partition of an Apple partition map at once with -P
+echo "[21/21] Partitioned medium..."
+if [ -x ./hfsutil ] && [ -x hfsck/hfsck ]; then
+    # Map in blocks 1-63, then two 4M HFS partitions
+    truncate -s $(( (64 + 2 * 8192) * 512 )) "$TMP/apm.img"
+    write_hex "$TMP/apm.img" 0 "45520200$(printf '%08x' $((64 + 2 * 8192)))"
+    entry=1
+    for part in "1 63 Apple Apple_partition_map" "64 8192 One Apple_HFS" "8256 8192 Two Apple_HFS"; do
+        read -r start count name type <<<"$part"
+        at=$((entry * 512))
+        write_hex "$TMP/apm.img" $at "504d000000000003$(printf '%08x%08x' $start $count)"
+        printf '%s' "$name" | dd of="$TMP/apm.img" bs=1 seek=$((at + 16)) conv=notrunc 2>/dev/null
+        printf '%s' "$type" | dd of="$TMP/apm.img" bs=1 seek=$((at + 48)) conv=notrunc 2>/dev/null
+        write_hex "$TMP/apm.img" $((at + 84)) "$(printf '%08x' $count)00000033"
+        if [ $type = Apple_HFS ]; then
+            rm -rf "$TMP/part"; mkdir -p "$TMP/part"
+            echo "in $name" >"$TMP/part/$name.txt"
+            truncate -s 4M "$TMP/part.img"
+            $BUILD/mkfs.hfs -f -d "$TMP/part" -l "$name" "$TMP/part.img" >/dev/null 2>&1 ||
+                { echo "FAIL: Cannot build partition $name"; exit 1; }
+            dd if="$TMP/part.img" of="$TMP/apm.img" bs=512 seek=$start conv=notrunc 2>/dev/null
+        fi
+        entry=$((entry + 1))
+    done
+    ./hfsutil hmount "$TMP/apm.img" 1 >/dev/null 2>&1 || { echo "FAIL: Cannot mount partition 1"; exit 1; }
+    output=$(./hfsutil hls -P 2>&1) || { echo "FAIL: hls -P"; exit 1; }
+    [ "$(echo "$output" | grep -v '^$' | tr '\n' ' ')" = "One (partition 1): One.txt Two (partition 2): Two.txt " ] ||
+        { echo "FAIL: hls -P listed: $output"; exit 1; }
+    mkdir -p "$TMP/parts"
+    ./hfsutil hcopy -P -R -r : "$TMP/parts/" >/dev/null 2>&1 || { echo "FAIL: hcopy -P"; exit 1; }
+    ./hfsutil humount >/dev/null 2>&1
+    [ "$(cat "$TMP/parts/1/One/One.txt")" = "in One" ] && [ "$(cat "$TMP/parts/2/Two/Two.txt")" = "in Two" ] ||
+        { echo "FAIL: hcopy -P did not copy out every partition"; exit 1; }
+    output=$(hfsck/hfsck -P -n "$TMP/apm.img" 2>&1) || { echo "FAIL: hfsck -P on clean partitions"; exit 1; }
+    for n in 1 2; do
+        echo "$output" | grep -qx "$TMP/apm.img (partition $n): exit 0" || { echo "FAIL: No result for partition $n"; exit 1; }
+    done
+    # Loop the catalog leaf of partition 2 onto itself
+    alblksz=$(read_uint32 "$TMP/part.img" $((1024 + 20)))
+    catalog=$(( $(read_uint16 "$TMP/part.img" $((1024 + 28))) * 512 +
+                $(read_uint16 "$TMP/part.img" $((1024 + 150))) * alblksz ))
+    leaf=$(read_uint32 "$TMP/part.img" $((catalog + 24)))
+    write_hex "$TMP/apm.img" $(( 8256 * 512 + catalog + leaf * 512 )) "$(printf '%08x' $leaf)"
+    ret=0; output=$(timeout 60 hfsck/hfsck -P -n "$TMP/apm.img" 2>&1) || ret=$?
+    [ $ret -eq 4 ] || { echo "FAIL: hfsck -P with a damaged partition: expected exit code 4, got $ret"; exit 1; }
+    echo "$output" | grep -qx "$TMP/apm.img (partition 1): exit 0" &&
+        echo "$output" | grep -qx "$TMP/apm.img (partition 2): .*links forward to node $leaf" ||
+        { echo "FAIL: hfsck -P results: $output"; exit 1; }
+    ret=0; hfsck/hfsck -P "$TMP/apm.img" >/dev/null 2>&1 || ret=$?
+    [ $ret -eq 16 ] || { echo "FAIL: hfsck -P without -n, -y or -a: expected exit code 16, got $ret"; exit 1; }
+    echo "+ Partitions listed, copied out and checked each on their own"
+else
+    echo "+ hfsutil or hfsck not built - skipping"
+fi
+
 echo ""
-echo "+ All fsck tests passed (3/3)"
+echo "+ All fsck tests passed (21/21)"
@@ -8,10 +8,53 @@ set -e
 cd "$(dirname "$0")/.."
 
 HFSUTIL="./hfsutil"
+BUILD="./build/standalone"
 TMP="/tmp/test_hfsutils_$$"
 mkdir -p "$TMP"
 trap "rm -rf $TMP" EXIT
 
+# Helper: Read uint16 big-endian
+read_uint16() {
+    local hex=$(dd if="$1" bs=1 skip=$2 count=2 2>/dev/null | od -An -tx1 | tr -d ' \n')
+    echo $((16#$hex))
+}
+
+# Helper: Write hex bytes in place
+write_hex() {
+    printf "$(echo "$3" | sed 's/../\\x&/g')" | dd of="$1" bs=1 seek=$2 conv=notrunc 2>/dev/null
+}
+
+# Helper: Byte offset of the first occurrence of hex bytes in a file
+find_hex() {
+    od -v -An -tx1 "$1" | tr -d ' \n' | grep -obF "$2" | awk -F: '$1 % 2 == 0 { print $1 / 2; exit }'
+}
+
+# Helper: Turn the empty HFS+ file whose key ends in the given hex bytes into
+# a directory hard link to dir_77 of the private directory
+link_dir() {
+    local at=$(find_hex "$1" "$2")
+    [ -n "$at" ] || return 1
+    at=$((at + ${#2} / 2 - 2))
+    write_hex "$1" $((at + 44)) "0000004d"             # bsdInfo.special
+    write_hex "$1" $((at + 48)) "666472704d414353"     # 'fdrp' 'MACS'
+}
+
+# Helper: Count the blocks marked in use in an HFS volume bitmap
+bitmap_used() {
+    local start=$(( $(read_uint16 "$1" $((1024 + 14))) * 512 ))
+    local blocks=$(read_uint16 "$1" $((1024 + 18)))
+    dd if="$1" bs=1 skip=$start count=$(( (blocks + 7) / 8 )) 2>/dev/null | od -v -An -tu1 |
+        awk '{ for (i = 1; i <= NF; i++) for (b = $i; b; b = int(b / 2)) n += b % 2 } END { print n + 0 }'
+}
+
+# Helper: Check files on the current volume against their sources in $TMP/src
+check_files() {
+    local f
+    for f in "$@"; do
+        $HFSUTIL hcopy -r ":$f" - 2>/dev/null | cmp -s - "$TMP/src/$f" || return 1
+    done
+}
+
 echo "========================================="
 echo "  hfsutil Commands Test Suite"
 echo "  (for systems without HFS mount drivers)"
@@ -71,9 +114,407 @@ echo "+ HFS operations complete"
 echo ""
 
 #
-# TEST 2: HFS+ Volume Operations
+# TEST 2: Resize Round Trip
+#
+echo "=== Test 2: Resize Round Trip ==="
+mkdir -p "$TMP/src"
+for i in 1 2 3 4 5 6 7 8; do
+    head -c 1000000 /dev/urandom > "$TMP/src/f$i.bin"
+done
+
+echo "[1] Fill HFS volume, then free its lower half..."
+dd if=/dev/zero of="$TMP/resize.img" bs=1M count=10 2>/dev/null
+$HFSUTIL hformat -l "Resize" "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: hformat"; exit 1; }
+$HFSUTIL hmount "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: hmount"; exit 1; }
+for i in 1 2 3 4 5 6 7 8; do
+    $HFSUTIL hcopy -r "$TMP/src/f$i.bin" ":f$i.bin" >/dev/null 2>&1 || { echo "FAIL: hcopy f$i.bin"; exit 1; }
+done
+$HFSUTIL hdel :f1.bin :f2.bin :f3.bin :f4.bin >/dev/null 2>&1 || { echo "FAIL: hdel"; exit 1; }
+$HFSUTIL humount >/dev/null 2>&1
+echo "  + 4MB of files left in the upper half"
+
+echo "[2] Shrink HFS volume..."
+$HFSUTIL hresize "$TMP/resize.img" 6M >/dev/null 2>&1 || { echo "FAIL: hresize shrink"; exit 1; }
+[ $(stat -c%s "$TMP/resize.img") -eq 6291456 ] || { echo "FAIL: image not truncated"; exit 1; }
+$HFSUTIL hmount "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: hmount after shrink"; exit 1; }
+check_files f5.bin f6.bin f7.bin f8.bin || { echo "FAIL: content changed by shrink"; exit 1; }
+$HFSUTIL humount >/dev/null 2>&1
+if [ -x "$BUILD/fsck.hfs" ]; then
+    $BUILD/fsck.hfs -n "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: fsck after shrink"; exit 1; }
+fi
+echo "  + Files moved below the new end intact"
+
+echo "[3] Grow HFS volume..."
+$HFSUTIL hresize "$TMP/resize.img" 12M >/dev/null 2>&1 || { echo "FAIL: hresize grow"; exit 1; }
+[ $(stat -c%s "$TMP/resize.img") -eq 12582912 ] || { echo "FAIL: image not extended"; exit 1; }
+$HFSUTIL hmount "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: hmount after grow"; exit 1; }
+check_files f5.bin f6.bin f7.bin f8.bin || { echo "FAIL: content changed by grow"; exit 1; }
+$HFSUTIL humount >/dev/null 2>&1
+if [ -x "$BUILD/fsck.hfs" ]; then
+    $BUILD/fsck.hfs -n "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: fsck after grow"; exit 1; }
+fi
+echo "  + HFS grow and shrink keep file contents"
+
+echo "[4] Grow and shrink HFS+ volume..."
+if [ -x "$BUILD/mkfs.hfs+" ]; then
+    # libhfs writes HFS+ only through hresize, so mkfs fills the volume
+    dd if=/dev/zero of="$TMP/resize.img" bs=1M count=20 2>/dev/null
+    $BUILD/mkfs.hfs+ -d "$TMP/src" -l "Resize" "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: mkfs.hfs+ -d"; exit 1; }
+    for size in 40M 10M; do
+        $HFSUTIL hresize "$TMP/resize.img" $size >/dev/null 2>&1 || { echo "FAIL: hresize $size"; exit 1; }
+        $HFSUTIL hmount "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: hmount after hresize $size"; exit 1; }
+        check_files f1.bin f2.bin f3.bin f4.bin f5.bin f6.bin f7.bin f8.bin || { echo "FAIL: content changed by hresize $size"; exit 1; }
+        $HFSUTIL humount >/dev/null 2>&1
+        if [ -x "$BUILD/fsck.hfs+" ]; then
+            $BUILD/fsck.hfs+ -n "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: fsck.hfs+ after hresize $size"; exit 1; }
+        fi
+    done
+    [ $(stat -c%s "$TMP/resize.img") -eq 10485760 ] || { echo "FAIL: HFS+ image not truncated"; exit 1; }
+    echo "  + HFS+ grow and shrink keep file contents"
+
+    echo "[5] Refuse to shrink below the data..."
+    $HFSUTIL hresize "$TMP/resize.img" 6M >/dev/null 2>&1 && { echo "FAIL: shrink past the data accepted"; exit 1; }
+    [ $(stat -c%s "$TMP/resize.img") -eq 10485760 ] || { echo "FAIL: refused shrink changed the image"; exit 1; }
+    $HFSUTIL hmount "$TMP/resize.img" >/dev/null 2>&1 || { echo "FAIL: hmount after refused shrink"; exit 1; }
+    check_files f1.bin f8.bin || { echo "FAIL: content changed by refused shrink"; exit 1; }
+    $HFSUTIL humount >/dev/null 2>&1
+    echo "  + Volume left as it was"
+else
+    echo "  + mkfs.hfs+ not built - skipping HFS+ resize"
+fi
+
+echo "[6] Usage names the command..."
+$HFSUTIL hresize 2>&1 | grep -q "^Usage: hresize " || { echo "FAIL: hresize usage"; exit 1; }
+echo "  + hresize usage correct"
+
+echo "+ Resize round trip complete"
+echo ""
+
+#
+# TEST 3: Defragmentation
+#
+echo "=== Test 3: Defragmentation ==="
+
+echo "[1] Fragment a file..."
+dd if=/dev/zero of="$TMP/frag.img" bs=1M count=2 2>/dev/null
+$HFSUTIL hformat -l "Frag" "$TMP/frag.img" >/dev/null 2>&1 || { echo "FAIL: hformat"; exit 1; }
+$HFSUTIL hmount "$TMP/frag.img" >/dev/null 2>&1 || { echo "FAIL: hmount"; exit 1; }
+# Fill the volume, free every other file, write a file too big for any gap
+for i in $(seq 1 20); do
+    head -c 100000 /dev/urandom > "$TMP/src/s$i.bin"
+    $HFSUTIL hcopy -r "$TMP/src/s$i.bin" ":s$i.bin" >/dev/null 2>&1 || { echo "FAIL: hcopy s$i.bin"; exit 1; }
+done
+for i in $(seq 1 2 19); do
+    $HFSUTIL hdel ":s$i.bin" >/dev/null 2>&1 || { echo "FAIL: hdel"; exit 1; }
+done
+head -c 600000 /dev/urandom > "$TMP/src/big.bin"
+$HFSUTIL hcopy -r "$TMP/src/big.bin" :big.bin >/dev/null 2>&1 || { echo "FAIL: hcopy big.bin"; exit 1; }
+# Then make room for it in one piece
+$HFSUTIL hdel :s14.bin :s16.bin :s18.bin :s20.bin >/dev/null 2>&1 || { echo "FAIL: hdel"; exit 1; }
+$HFSUTIL hfrag -j | grep -q '"fragmented":1,' || { echo "FAIL: big.bin not fragmented"; exit 1; }
+free=$($HFSUTIL hvol | grep "bytes free")
+$HFSUTIL humount >/dev/null 2>&1
+used=$(bitmap_used "$TMP/frag.img")
+echo "  + big.bin written in several extents"
+
+echo "[2] Report only..."
+cp "$TMP/frag.img" "$TMP/frag-orig.img"
+$HFSUTIL hmount "$TMP/frag.img" >/dev/null 2>&1 || { echo "FAIL: hmount"; exit 1; }
+$HFSUTIL hdefrag -n >/dev/null 2>&1 || { echo "FAIL: hdefrag -n"; exit 1; }
+$HFSUTIL humount >/dev/null 2>&1
+cmp -s "$TMP/frag.img" "$TMP/frag-orig.img" || { echo "FAIL: hdefrag -n changed the volume"; exit 1; }
+echo "  + hdefrag -n changes nothing"
+
+echo "[3] Defragment..."
+$HFSUTIL hmount "$TMP/frag.img" >/dev/null 2>&1 || { echo "FAIL: hmount"; exit 1; }
+$HFSUTIL hdefrag >/dev/null 2>&1 || { echo "FAIL: hdefrag"; exit 1; }
+check_files big.bin s2.bin s4.bin s6.bin s8.bin s10.bin s12.bin || { echo "FAIL: content changed by hdefrag"; exit 1; }
+[ "$($HFSUTIL hvol | grep "bytes free")" = "$free" ] || { echo "FAIL: free space changed by hdefrag"; exit 1; }
+$HFSUTIL hfrag -j | grep -q '"forks":7,"fragmented":0,"extents":7,' || { echo "FAIL: hfrag still reports fragments"; exit 1; }
+$HFSUTIL humount >/dev/null 2>&1
+[ "$(bitmap_used "$TMP/frag.img")" = "$used" ] || { echo "FAIL: bitmap block count changed by hdefrag"; exit 1; }
+if [ -x "$BUILD/fsck.hfs" ]; then
+    $BUILD/fsck.hfs -n "$TMP/frag.img" >/dev/null 2>&1 || { echo "FAIL: fsck after hdefrag"; exit 1; }
+fi
+echo "  + Contents and allocated blocks unchanged, every fork contiguous"
+
+echo "[4] Usage names the command..."
+$HFSUTIL hdefrag -x 2>&1 | grep -q "^Usage: hdefrag " || { echo "FAIL: hdefrag usage"; exit 1; }
+echo "  + hdefrag usage correct"
+
+echo "+ Defragmentation complete"
+echo ""
+
+#
+# TEST 4: HFS+ Read Access
+#
+echo "=== Test 4: HFS+ Read Access ==="
+if [ -x "$BUILD/mkfs.hfs+" ]; then
+    echo "[1] Populate HFS+ volume..."
+    rm -rf "$TMP/src"
+    mkdir -p "$TMP/src/dir"
+    echo "top" > "$TMP/src/top.txt"
+    echo "nested" > "$TMP/src/dir/nested.txt"
+    han=$'\xe4\xb8\xad'    # U+4E2D, not in MacOS Roman
+    echo "x" > "$TMP/src/${han}x"
+    echo "y" > "$TMP/src/${han}y"
+    dd if=/dev/zero of="$TMP/plus.img" bs=1M count=10 2>/dev/null
+    $BUILD/mkfs.hfs+ -d "$TMP/src" -l "Plus" "$TMP/plus.img" >/dev/null 2>&1 || { echo "FAIL: mkfs.hfs+ -d"; exit 1; }
+    $HFSUTIL hmount "$TMP/plus.img" >/dev/null 2>&1 || { echo "FAIL: hmount"; exit 1; }
+    check_files top.txt || { echo "FAIL: hcopy :top.txt"; exit 1; }
+    $HFSUTIL hcopy -r :dir:nested.txt - 2>/dev/null | cmp -s - "$TMP/src/dir/nested.txt" || { echo "FAIL: hcopy :dir:nested.txt"; exit 1; }
+    echo "  + Files read back from HFS+"
+
+    echo "[2] Missing names are reported..."
+    for path in :nosuch :nodir:x :dir:nosuch; do
+        $HFSUTIL hcopy -r $path - 2>&1 >/dev/null | grep -q "no such file or directory" || { echo "FAIL: hcopy $path error"; exit 1; }
+    done
+    echo "  + Lookups that miss fail with ENOENT"
+
+    echo "[3] Names outside MacOS Roman..."
+    [ "$($HFSUTIL hls -1 : | grep -c '^%u4E2D[xy]$')" = 2 ] || { echo "FAIL: hls escapes"; exit 1; }
+    [ "$($HFSUTIL hcopy -r :%u4E2Dx -)" = "x" ] || { echo "FAIL: hcopy :%u4E2Dx"; exit 1; }
+    $HFSUTIL hcopy -R : "$TMP/out" >/dev/null 2>&1 || { echo "FAIL: hcopy -R :"; exit 1; }
+    cmp -s "$TMP/out/%u4E2Dy" "$TMP/src/${han}y" || { echo "FAIL: hcopy -R escaped name"; exit 1; }
+    echo "  + Escaped names list, reopen and copy out"
+    $HFSUTIL humount >/dev/null 2>&1
+
+    echo "[4] Directory hard links..."
+    priv="$TMP/links/.HFS+ Private Directory Data"$'\r'/dir_77
+    mkdir -p "$priv" "$TMP/links/a" "$TMP/links/b"
+    echo "inner" > "$priv/inner.txt"
+    : > "$priv/loop"
+    : > "$TMP/links/a/link1"
+    : > "$TMP/links/b/link2"
+    dd if=/dev/zero of="$TMP/links.img" bs=1M count=10 2>/dev/null
+    $BUILD/mkfs.hfs+ -d "$TMP/links" -l "Links" "$TMP/links.img" >/dev/null 2>&1 || { echo "FAIL: mkfs.hfs+ -d links"; exit 1; }
+    # keys end in the UTF-16 name; file records start with type 0x0002
+    link_dir "$TMP/links.img" "0004006c006f006f00700002" &&
+    link_dir "$TMP/links.img" "0005006c0069006e006b00310002" &&
+    link_dir "$TMP/links.img" "0005006c0069006e006b00320002" || { echo "FAIL: link records not found"; exit 1; }
+    $HFSUTIL hmount "$TMP/links.img" >/dev/null 2>&1 || { echo "FAIL: hmount links"; exit 1; }
+    ret=0; output=$(timeout 60 $HFSUTIL hcopy -R : "$TMP/links-out" 2>&1) || ret=$?
+    [ $ret -eq 1 ] || { echo "FAIL: hcopy -R through a directory cycle: expected exit code 1, got $ret"; exit 1; }
+    echo "$output" | grep -q ":a:link1:loop\": directory contains itself" || { echo "FAIL: directory cycle not reported"; exit 1; }
+    cmp -s "$TMP/links-out/a/link1/inner.txt" "$priv/inner.txt" || { echo "FAIL: linked directory not copied"; exit 1; }
+    [ "$(readlink "$TMP/links-out/b/link2")" = "$(cd "$TMP/links-out/a/link1" && pwd -P)" ] || { echo "FAIL: second link not made a symlink"; exit 1; }
+    echo "  + Cycles refused, repeat links become symlinks"
+
+    $HFSUTIL humount >/dev/null 2>&1
+
+    echo "[5] Extended attributes and compressed files..."
+    if command -v "${CC:-cc}" >/dev/null 2>&1; then
+        cat > "$TMP/addattr.c" <<'EOF_C'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * Give a fresh mkfs.hfs+ image an attributes B-tree with an inline
+ * attribute on one file of the root folder, and a zlib decmpfs record on
+ * another that is marked compressed:
+ *   addattr IMAGE FILE NAME VALUE COMPRESSED-FILE CONTENTS
+ */
+
+static unsigned char *img;
+static long imgsz;
+
+static unsigned long get32(const unsigned char *p)
+{
+    return (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(unsigned char *p, unsigned long v)
+{
+    put16(p, v >> 16);
+    put16(p + 2, v);
+}
+
+/* Catalog file record of an ASCII name in the root folder */
+static unsigned char *filerec(const char *name)
+{
+    unsigned char key[8 + 2 * 255];
+    unsigned int n = strlen(name), i;
+
+    put32(key, 2);
+    put16(key + 4, n);
+    for (i = 0; i < n; i++)
+        put16(key + 6 + 2 * i, (unsigned char)name[i]);
+    put16(key + 6 + 2 * n, 2);
+    for (long at = 0; at + 8 + 2 * n < imgsz; at += 2)
+        if (memcmp(img + at, key, 8 + 2 * n) == 0)
+            return img + at + 6 + 2 * n;
+    return NULL;
+}
+
+/* Write an inline attribute record; returns its length */
+static unsigned int record(unsigned char *p, unsigned long cnid, const char *name,
+                           const void *value, unsigned int size)
+{
+    unsigned int n = strlen(name), i, len = 14 + 2 * n;
+
+    memset(p, 0, len + 16 + size + 1);
+    put16(p, len - 2);
+    put32(p + 4, cnid);
+    put16(p + 12, n);
+    for (i = 0; i < n; i++)
+        put16(p + 14 + 2 * i, (unsigned char)name[i]);
+    put32(p + len, 0x10);
+    put32(p + len + 12, size);
+    memcpy(p + len + 16, value, size);
+    return (len + 16 + size + 1) & ~1u;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char *vh, *file, *comp, *node, cdata[4096];
+    unsigned long bs, total, bitmap, start, fileID, compID, clen = sizeof(cdata) - 16;
+    unsigned int nodesz = 4096, need, run = 0, off = 14, i;
+    FILE *f;
+
+    if (argc != 7 || !(f = fopen(argv[1], "r+b")))
+        return 2;
+    fseek(f, 0, SEEK_END);
+    imgsz = ftell(f);
+    img = malloc(imgsz);
+    rewind(f);
+    if (!img || fread(img, imgsz, 1, f) != 1)
+        return 2;
+
+    vh = img + 1024;
+    bs = get32(vh + 40);
+    total = get32(vh + 44);
+    bitmap = get32(vh + 112 + 16) * bs;
+    file = filerec(argv[2]);
+    comp = filerec(argv[5]);
+    if (!file || !comp || get32(vh + 352 + 4))
+        return 3;
+    fileID = get32(file + 8);
+    compID = get32(comp + 8);
+
+    /* Two nodes in the last free blocks before the alternate header */
+    need = (2 * nodesz + bs - 1) / bs;
+    for (start = total - 2; start > 0 && run < need; start--)
+        run = (img[bitmap + start / 8] & (0x80 >> start % 8)) ? 0 : run + 1;
+    if (run < need)
+        return 3;
+    start++;
+    for (i = 0; i < need; i++)
+        img[bitmap + (start + i) / 8] |= 0x80 >> (start + i) % 8;
+    put32(vh + 48, get32(vh + 48) - need);
+    put32(vh + 352 + 4, 2 * nodesz);
+    put32(vh + 352 + 8, need * bs);
+    put32(vh + 352 + 12, need);
+    put32(vh + 352 + 16, start);
+    put32(vh + 352 + 20, need);
+
+    /* Header node: header record, user data record and map */
+    node = img + start * bs;
+    memset(node, 0, 2 * nodesz);
+    node[8] = 1;
+    put16(node + 10, 3);
+    put16(node + 14, 1);                /* depth */
+    put32(node + 16, 1);                /* root */
+    put32(node + 20, 2);                /* leaf records */
+    put32(node + 24, 1);                /* first leaf */
+    put32(node + 28, 1);                /* last leaf */
+    put16(node + 32, nodesz);
+    put16(node + 34, 266);
+    put32(node + 36, 2);                /* total nodes */
+    put32(node + 46, 2 * nodesz);       /* clump size */
+    put32(node + 52, 6);                /* big keys, variable index keys */
+    node[248] = 0xc0;                   /* map: both nodes in use */
+    put16(node + nodesz - 2, 14);
+    put16(node + nodesz - 4, 120);
+    put16(node + nodesz - 6, 248);
+    put16(node + nodesz - 8, nodesz - 8);
+
+    /* decmpfs header, little-endian: 'cmpf', zlib inline, size */
+    memset(cdata, 0, 16);
+    memcpy(cdata, "fpmc", 4);
+    cdata[4] = 3;
+    for (i = 0; i < 4; i++)
+        cdata[8 + i] = strlen(argv[6]) >> (8 * i);
+    if (compress2(cdata + 16, &clen, (const unsigned char *)argv[6],
+                  strlen(argv[6]), 9) != Z_OK)
+        return 3;
+    comp[41] |= 0x20;                   /* UF_COMPRESSED */
+
+    /* Leaf node, records in file ID order */
+    node += nodesz;
+    node[8] = 0xff;
+    node[9] = 1;
+    put16(node + 10, 2);
+    for (i = 0; i < 2; i++) {
+        put16(node + nodesz - 2 * (i + 1), off);
+        if ((i == 0) == (fileID < compID))
+            off += record(node + off, fileID, argv[3], argv[4], strlen(argv[4]));
+        else
+            off += record(node + off, compID, "com.apple.decmpfs", cdata, 16 + clen);
+    }
+    put16(node + nodesz - 6, off);
+    memcpy(img + imgsz - 1024, vh, 512);
+
+    rewind(f);
+    return fwrite(img, imgsz, 1, f) == 1 && fclose(f) == 0 ? 0 : 2;
+}
+EOF_C
+        ${CC:-cc} -o "$TMP/addattr" "$TMP/addattr.c" -lz || { echo "FAIL: Cannot build attribute writer"; exit 1; }
+        rm -rf "$TMP/src"
+        mkdir -p "$TMP/src"
+        echo "top" > "$TMP/src/top.txt"
+        echo "placeholder" > "$TMP/src/comp.txt"
+        contents=$(printf 'compressed contents %s\n' $(seq 1 50))
+        printf '%s' "$contents" > "$TMP/comp.txt"
+        dd if=/dev/zero of="$TMP/attr.img" bs=1M count=10 2>/dev/null
+        $BUILD/mkfs.hfs+ -d "$TMP/src" -l "Attr" "$TMP/attr.img" >/dev/null 2>&1 || { echo "FAIL: mkfs.hfs+ -d attr"; exit 1; }
+        "$TMP/addattr" "$TMP/attr.img" top.txt com.example.note "hello attribute" \
+            comp.txt "$contents" || { echo "FAIL: attributes B-tree not written"; exit 1; }
+        $HFSUTIL hmount "$TMP/attr.img" >/dev/null 2>&1 || { echo "FAIL: hmount attr"; exit 1; }
+        [ "$($HFSUTIL hattrib -x :top.txt)" = "       15 com.example.note" ] || { echo "FAIL: hattrib -x"; exit 1; }
+        [ "$($HFSUTIL hattrib -X com.example.note :top.txt)" = "hello attribute" ] || { echo "FAIL: hattrib -X"; exit 1; }
+        [ -z "$($HFSUTIL hattrib -x :comp.txt)" ] || { echo "FAIL: decmpfs attribute listed"; exit 1; }
+        $HFSUTIL hcopy -r :comp.txt - | cmp -s - "$TMP/comp.txt" || { echo "FAIL: compressed file not decompressed"; exit 1; }
+        echo "  + Attributes read, decmpfs file copied out decompressed"
+        $HFSUTIL humount >/dev/null 2>&1
+    else
+        echo "  + No C compiler - skipping attributes"
+    fi
+
+    echo "[6] HFS+ volume in an HFS wrapper..."
+    # The wrapper MDB: 4K blocks from sector 8, 'H+' in blocks 1-2560
+    dd if=/dev/zero of="$TMP/wrap.img" bs=4096 count=2 2>/dev/null
+    cat "$TMP/plus.img" >> "$TMP/wrap.img"
+    write_hex "$TMP/wrap.img" 1024 "4244"
+    write_hex "$TMP/wrap.img" $((1024 + 20)) "00001000"
+    write_hex "$TMP/wrap.img" $((1024 + 28)) "0008"
+    write_hex "$TMP/wrap.img" $((1024 + 124)) "482b00010a00"
+    $HFSUTIL hmount "$TMP/wrap.img" >/dev/null 2>&1 || { echo "FAIL: hmount wrapper"; exit 1; }
+    [ "$($HFSUTIL hls -1 : | grep -c '^top.txt$')" = 1 ] || { echo "FAIL: hls in wrapper"; exit 1; }
+    [ "$($HFSUTIL hcopy -r :dir:nested.txt - 2>/dev/null)" = "nested" ] || { echo "FAIL: hcopy in wrapper"; exit 1; }
+    $HFSUTIL humount >/dev/null 2>&1
+    if [ -x "$BUILD/fsck.hfs+" ]; then
+        $BUILD/fsck.hfs+ -n "$TMP/wrap.img" >/dev/null 2>&1 || { echo "FAIL: fsck.hfs+ on wrapper"; exit 1; }
+    fi
+    echo "  + Embedded volume listed, copied and checked"
+
+    echo "+ HFS+ read access complete"
+else
+    echo "+ mkfs.hfs+ not built - skipping HFS+ read access"
+fi
+echo ""
+
+#
+# TEST 5: HFS+ Volume Operations
 #
-echo "=== Test 2: HFS+ Volume Operations ==="
+echo "=== Test 5: HFS+ Volume Operations ==="
 echo "[1] Format as HFS+..."
 $HFSUTIL hformat -t hfs+ -l "TestHFSPlus" "$IMG" >/dev/null 2>&1 || { echo "FAIL: hformat -t hfs+"; exit 1; }
 echo "  + hformat created HFS+ volume"
@@ -104,9 +545,9 @@ echo "+ HFS+ operations complete"
 echo ""
 
 #
-# TEST 3: Version Info
+# TEST 6: Version Info
 #
-echo "=== Test 3: Version Info ==="
+echo "=== Test 6: Version Info ==="
 $HFSUTIL --version >/dev/null 2>&1 || { echo "FAIL: version"; exit 1; }
 echo "+ Version info available"
 echo ""
@@ -119,4 +560,6 @@ echo "  - Directory creation (mkdir)"
 echo "  - File listing (ls)"
 echo "  - File copy in/out (hcopy)"
 echo "  - Content integrity verified"
+echo "  - Volume grow and shrink (hresize)"
+echo "  - Defragmentation (hdefrag, hfrag)"
 echo "========================================="